@@ -37,6 +37,8 @@
 #include <limits.h>
 #include <termios.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <netinet/in.h>
 
 #define VID       (0x1d50)
 #define PID       (0x6018)
@@ -62,13 +64,21 @@ struct
   char *chanPath;
   char *port;
   int speed;
+  char *eventsFile;
+  int eventsPort;
 } options = {.nChannels=NUM_FIFOS, .chanPath="", .speed=115200};
 
 // Runtime state
 struct
 {
   int fifo[MAX_FIFOS];
-} _r;
+  BOOL eventsOn;
+  FILE *events;
+  int eventsListen;
+  int eventsConn;
+  uint64_t localTime;
+  uint64_t globalTime;
+} _r = {.eventsListen=-1, .eventsConn=-1};
 
 // ====================================================================================================
 // ====================================================================================================
@@ -180,6 +190,97 @@ static void _removeFifoTasks(void)
 // ====================================================================================================
 // ====================================================================================================
 // ====================================================================================================
+// Decoded event stream
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
+static BOOL _openEvents(void)
+
+/* Open the file and/or the TCP port the decoded events go to */
+
+{
+  if (options.eventsFile)
+    {
+      if (!strcmp(options.eventsFile,"-"))
+	_r.events=stdout;
+      else if (!(_r.events=fopen(options.eventsFile,"w")))
+	{
+	  perror("Opening events file");
+	  return FALSE;
+	}
+      setvbuf(_r.events,NULL,_IOLBF,0);
+    }
+
+  if (options.eventsPort)
+    {
+      struct sockaddr_in addr = {.sin_family=AF_INET, .sin_port=htons(options.eventsPort),
+				 .sin_addr.s_addr=htonl(INADDR_LOOPBACK)};
+      int one=1;
+
+      if (((_r.eventsListen=socket(AF_INET,SOCK_STREAM,0))<0) ||
+	  (setsockopt(_r.eventsListen,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one))<0) ||
+	  (bind(_r.eventsListen,(struct sockaddr *)&addr,sizeof(addr))<0) ||
+	  (listen(_r.eventsListen,1)<0))
+	{
+	  perror("Opening events port");
+	  return FALSE;
+	}
+      fcntl(_r.eventsListen,F_SETFL,O_NONBLOCK);
+    }
+
+  _r.eventsOn=(_r.events!=NULL) || (_r.eventsListen>=0);
+  return TRUE;
+}
+// ====================================================================================================
+static void _emitEvent(const char *fmt, ...)
+
+/* Write one event, as a line led by the local time it happened at */
+
+{
+  char line[128];
+  va_list ap;
+  int len=snprintf(line,sizeof(line),"%llu ",(unsigned long long)_r.localTime);
+
+  va_start(ap,fmt);
+  len+=vsnprintf(line+len,sizeof(line)-len-1,fmt,ap);
+  va_end(ap);
+  if (len>(int)sizeof(line)-2)
+    len=sizeof(line)-2;
+  line[len++]='\n';
+  line[len]=0;
+
+  if (_r.events)
+    fputs(line,_r.events);
+
+  if (_r.eventsListen>=0)
+    {
+      /* One consumer at a time, a slow or gone one is dropped rather than waited for */
+      if (_r.eventsConn<0)
+	{
+	  if ((_r.eventsConn=accept(_r.eventsListen,NULL,NULL))>=0)
+	    fcntl(_r.eventsConn,F_SETFL,O_NONBLOCK);
+	}
+      if ((_r.eventsConn>=0) && (send(_r.eventsConn,line,len,MSG_NOSIGNAL)!=len))
+	{
+	  close(_r.eventsConn);
+	  _r.eventsConn=-1;
+	}
+    }
+}
+// ====================================================================================================
+static uint32_t _value(uint8_t length, uint8_t *d)
+
+/* Payloads are little endian */
+
+{
+  uint32_t v=0;
+  for (int i=0; i<length; i++)
+    v|=(uint32_t)d[i]<<(8*i);
+  return v;
+}
+// ====================================================================================================
+// ====================================================================================================
+// ====================================================================================================
 // Handlers for each message type
 // ====================================================================================================
 // ====================================================================================================
@@ -190,14 +291,126 @@ void _handleSWIT(uint8_t addr, uint8_t length, uint8_t *d)
   if (addr<options.nChannels)
     write(_r.fifo[addr],d,length);
 
+  if (_r.eventsOn)
+    _emitEvent("SWIT %u %u 0x%08x",addr,length,_value(length,d));
+
   //  if (addr==0)
   //  fprintf(stdout,"%c",*d);
 }
 // ====================================================================================================
+void _handleHWIT(uint8_t disc, uint8_t length, uint8_t *d)
+
+/* Hardware source packets, from the DWT */
+
+{
+  static const char *_excFn[]={"?","enter","exit","return"};
+  uint32_t v=_value(length,d);
+
+  if (!_r.eventsOn)
+    return;
+
+  if (disc==0)
+    {
+      /* Event counter wrapped: CPI, Exc, Sleep, LSU, Fold, Cyc in bits 0..5 */
+      _emitEvent("EVT 0x%02x",v&0x3F);
+    }
+  else if (disc==1)
+    {
+      _emitEvent("EXC %u %s",v&0x1FF,_excFn[(v>>12)&3]);
+    }
+  else if (disc==2)
+    {
+      if (length==1)
+	_emitEvent("PC sleep");
+      else
+	_emitEvent("PC 0x%08x",v);
+    }
+  else if ((disc&0x18)==0x08)
+    {
+      /* Data trace comparator match, with the PC or the low address bits */
+      if (disc&1)
+	_emitEvent("DADDR %u 0x%04x",(disc>>1)&3,v);
+      else
+	_emitEvent("DPC %u 0x%08x",(disc>>1)&3,v);
+    }
+  else if ((disc&0x18)==0x10)
+    {
+      _emitEvent("DVAL %u %c %u 0x%08x",(disc>>1)&3,(disc&1)?'w':'r',length,v);
+    }
+  else
+    {
+      _emitEvent("HWIT %u %u 0x%08x",disc,length,v);
+    }
+}
+// ====================================================================================================
 void _handleTS(uint8_t length, uint8_t *d)
 
+/* Local timestamps, the time since the last one in trace clock cycles */
+
+{
+  uint32_t delta;
+  uint8_t tc=0;
+
+  if (!(d[0]&0x80))
+    {
+      /* Single byte form, the delta is in the header */
+      delta=(d[0]>>4)&0x07;
+    }
+  else
+    {
+      tc=(d[0]>>4)&0x03;
+      delta=0;
+      for (int i=1; i<length; i++)
+	delta|=(uint32_t)(d[i]&0x7F)<<(7*(i-1));
+    }
+
+  _r.localTime+=delta;
+  if (_r.eventsOn)
+    _emitEvent("LTS %u %u",delta,tc);
+}
+// ====================================================================================================
+void _handleGTS(uint8_t header, uint8_t length, uint8_t *d)
+
+/* Global timestamps, only the bits that changed are sent */
+
 {
+  uint64_t v=0;
+  for (int i=1; i<length; i++)
+    v|=(uint64_t)(d[i]&0x7F)<<(7*(i-1));
 
+  if (header==0x94)
+    {
+      /* GTS1 carries bits 25:0, the last of four bytes has the wrap and clock change flags */
+      int bits=(length-1)*7;
+      BOOL wrap=FALSE, clkch=FALSE;
+      if (length==5)
+	{
+	  bits=26;
+	  wrap=(d[4]&0x40)!=0;
+	  clkch=(d[4]&0x20)!=0;
+	}
+      uint64_t mask=(1ULL<<bits)-1;
+      _r.globalTime=(_r.globalTime&~mask)|(v&mask);
+      if (_r.eventsOn)
+	_emitEvent("GTS 0x%012llx%s%s",(unsigned long long)_r.globalTime,wrap?" wrap":"",clkch?" clkch":"");
+    }
+  else
+    {
+      /* GTS2 carries the bits from 26 up */
+      _r.globalTime=(_r.globalTime&((1ULL<<26)-1))|(v<<26);
+    }
+}
+// ====================================================================================================
+void _handleExtension(uint8_t length, uint8_t *d)
+
+{
+  uint32_t ex=(d[0]>>4)&0x07;
+  for (int i=1; i<length; i++)
+    ex|=(uint32_t)(d[i]&0x7F)<<(3+7*(i-1));
+
+  /* With the source bit clear this is the stimulus port page */
+  if (_r.eventsOn)
+    _emitEvent("EXT %s %u",(d[0]&0x04)?"hw":"page",ex);
 }
 // ====================================================================================================
 // ====================================================================================================
@@ -206,10 +419,10 @@ void _handleTS(uint8_t length, uint8_t *d)
 // ====================================================================================================
 // ====================================================================================================
 // ====================================================================================================
-enum _protoState {ITM_IDLE, ITM_SYNCING, ITM_TS, ITM_SWIT};
+enum _protoState {ITM_IDLE, ITM_SYNCING, ITM_TS, ITM_GTS, ITM_EXT, ITM_SWIT, ITM_HWIT};
 
 #ifdef PRINT_TRANSITIONS
-static char *_protoNames[]={"IDLE", "SYNCING","TS","SWIT"};
+static char *_protoNames[]={"IDLE", "SYNCING","TS","GTS","EXT","SWIT","HWIT"};
 #endif
 
 void _protocolPump(uint8_t *c)
@@ -217,7 +430,7 @@ void _protocolPump(uint8_t *c)
 {
   static enum _protoState p;
   static int targetCount, currentCount, srcAddr;
-  static uint8_t rxPacket[5];
+  static uint8_t rxPacket[7];
 
 #ifdef PRINT_TRANSITIONS
   printf("%02x %s --> ",*c,_protoNames[p]);
@@ -227,11 +440,15 @@ void _protocolPump(uint8_t *c)
     {
       // -----------------------------------------------------
     case ITM_IDLE:
+      rxPacket[0]=*c;
+      currentCount=1;
       if (*c==0b01110000)
 	{
 	  /* This is an overflow packet */
 	  if (options.verbose)
 	    fprintf(stderr,"Overflow!\n");
+	  if (_r.eventsOn)
+	    _emitEvent("OVF");
 	  break;
 	}
       // **********
@@ -246,10 +463,7 @@ void _protocolPump(uint8_t *c)
       // **********
       if (!(*c&0x0F))
 	{
-	  currentCount=1;
 	  /* This is a timestamp packet */
-	  rxPacket[0]=*c;
-
 	  if (!(*c&0x80))
 	    {
 	      /* A one byte output */
@@ -257,77 +471,109 @@ void _protocolPump(uint8_t *c)
 	    }
 	  else
 	    {
+	      targetCount=5;
 	      p=ITM_TS;
 	    }
 	  break;
 	}
       // **********
-      if ((*c&0x0F) == 0x04)
+      if ((*c==0x94) || (*c==0xB4))
 	{
-	  /* This is a reserved packet */
+	  /* This is a global timestamp packet, GTS1 or GTS2 */
+	  targetCount=(*c==0x94)?5:7;
+	  p=ITM_GTS;
 	  break;
 	}
       // **********
-      if (!(*c&0x04))
+      if ((*c&0x0B)==0x08)
 	{
-	  /* This is a SWIT packet */
-	  if ((targetCount=*c&0x03)==3)
-	    targetCount=4;
-	  srcAddr=(*c&0xF8)>>3;
-	  currentCount=0;
-	  p=ITM_SWIT;
+	  /* This is an extension packet */
+	  if (*c&0x80)
+	    {
+	      targetCount=5;
+	      p=ITM_EXT;
+	    }
+	  else
+	    {
+	      _handleExtension(currentCount,rxPacket);
+	    }
 	  break;
 	}
       // **********
-      if (options.verbose)
-	fprintf(stderr,"Illegal packet start in IDLE state\n");
+      if ((*c&0x03)==0)
+	{
+	  /* This is a reserved packet */
+	  break;
+	}
+      // **********
+      /* This is a SWIT packet, or a hardware source one from the DWT */
+      if ((targetCount=*c&0x03)==3)
+	targetCount=4;
+      srcAddr=(*c&0xF8)>>3;
+      currentCount=0;
+      p=(*c&0x04)?ITM_HWIT:ITM_SWIT;
       break;
       // -----------------------------------------------------
     case ITM_SWIT:
+    case ITM_HWIT:
 	  rxPacket[currentCount]=*c;
 	  currentCount++;
 
 	  if (currentCount>=targetCount)
 	    {
+	      if (p==ITM_SWIT)
+		_handleSWIT(srcAddr, targetCount, rxPacket);
+	      else
+		_handleHWIT(srcAddr, targetCount, rxPacket);
 	      p=ITM_IDLE;
-	      _handleSWIT(srcAddr, targetCount, rxPacket);
 	    }
 	  break;
       // -----------------------------------------------------
     case ITM_TS:
+    case ITM_GTS:
+    case ITM_EXT:
+      /* Payload bytes with a continuation bit, up to targetCount bytes including the header */
       rxPacket[currentCount++]=*c;
       if (!(*c&0x80))
 	{
 	  /* We are done */
-	  _handleTS(currentCount,rxPacket);
+	  if (p==ITM_TS)
+	    _handleTS(currentCount,rxPacket);
+	  else if (p==ITM_GTS)
+	    _handleGTS(rxPacket[0],currentCount,rxPacket);
+	  else
+	    _handleExtension(currentCount,rxPacket);
+	  p=ITM_IDLE;
 	}
-      else
+      else if (currentCount>=targetCount)
 	{
-	  if (currentCount>4)
-	    {
-	      /* Something went badly wrong */
-	      p=ITM_IDLE;
-	    }
-	  break;
+	  /* Something went badly wrong */
+	  if (options.verbose)
+	    fprintf(stderr,"Overlong packet\n");
+	  p=ITM_IDLE;
 	}
+      break;
 
       // -----------------------------------------------------
     case ITM_SYNCING:
-      if ((*c==0) && (currentCount<targetCount))
+      if (*c==0)
 	{
-	  currentCount++;
+	  /* A sync can have more than the 47 zero bits it needs */
+	  if (currentCount<targetCount)
+	    currentCount++;
 	}
       else
 	{
-	  if (*c==0x80)
+	  if ((*c==0x80) && (currentCount>=targetCount))
 	    {
-	      p=ITM_IDLE;
+	      if (_r.eventsOn)
+		_emitEvent("SYNC");
 	    }
-	  else
+	  else if (options.verbose)
 	    {
-	      /* This should really be an UNKNOWN state */
-	      p=ITM_IDLE;
+	      fprintf(stderr,"Bad sync packet\n");
 	    }
+	  p=ITM_IDLE;
 	}
       break;
       // -----------------------------------------------------
@@ -346,13 +592,15 @@ void intHandler(int dummy)
 void _printHelp(char *progName)
 
 {
-  printf("Useage: %s <dhnv> <b basedir> <p port> <s speed>\n",progName);
+  printf("Useage: %s <dhnv> <b basedir> <e events> <p port> <s speed> <t eventport>\n",progName);
   printf("        b: <basedir> for channels\n");
   printf("        h: This help\n");
   printf("        d: Dump received data without further processing\n");
+  printf("        e: <file> to write decoded ITM/DWT events to, - for stdout\n");
   printf("        n: <Number> of channels to populate\n");
   printf("        p: <serialPort> to use\n");
   printf("        s: <serialSpeed> to use\n");
+  printf("        t: <port> to serve decoded ITM/DWT events on over TCP\n");
   printf("        v: Verbose mode\n");
 }
 // ====================================================================================================
@@ -360,7 +608,7 @@ int _processOptions(int argc, char *argv[])
 
 {
   int c;
-  while ((c = getopt (argc, argv, "vdn:b:hp:s:")) != -1)
+  while ((c = getopt (argc, argv, "vde:n:b:hp:s:t:")) != -1)
     switch (c)
       {
       case 'v':
@@ -369,9 +617,15 @@ int _processOptions(int argc, char *argv[])
       case 'd':
         options.dump = 1;
         break;
+      case 'e':
+	options.eventsFile=optarg;
+	break;
       case 'p':
 	options.port=optarg;
 	break;
+      case 't':
+	options.eventsPort=atoi(optarg);
+	break;
       case 's':
 	options.speed=atoi(optarg);
 	break;
@@ -535,6 +789,10 @@ int main(int argc, char *argv[])
       fprintf(stderr,"Failed to make channel devices\n");
       exit(-1);
     }
+  if (!_openEvents())
+    {
+      exit(-1);
+    }
 
   /* Using the exit construct rather than return ensures the atexit gets called */
   if (!options.port)
@@ -0,0 +1,134 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The record kept in the settings page says how the target was reached, SWD
+ * with its multidrop TARGETSEL or JTAG, and which Cortex-M it was. Coming back
+ * to it only scans that one DP, has the driver that claimed it last time tried
+ * first, and picks it out by fingerprint. It is rewritten only when the target
+ * changes, the settings flash is not worn on every attach.
+ */
+
+#include "general.h"
+#include "exception.h"
+#include "autoattach.h"
+#include "adiv5.h"
+#include "cortexm.h"
+#include "jtag_scan.h"
+
+#define AUTOATTACH_MAGIC 0x31544141U /* "AAT1" */
+
+typedef struct autoattach_record {
+	uint32_t magic;
+	uint32_t fingerprint;
+	uint32_t targetsel;
+	uint8_t enabled;
+	uint8_t swd;
+	uint8_t probe;
+	uint8_t reserved;
+} autoattach_record_s;
+
+static autoattach_record_s autoattach_record;
+static bool autoattach_loaded;
+
+static autoattach_record_s *autoattach_load(void)
+{
+	if (!autoattach_loaded) {
+		if (!platform_settings_read(&autoattach_record, sizeof(autoattach_record)) ||
+			autoattach_record.magic != AUTOATTACH_MAGIC) {
+			memset(&autoattach_record, 0, sizeof(autoattach_record));
+			autoattach_record.magic = AUTOATTACH_MAGIC;
+			autoattach_record.probe = CORTEXM_PROBE_NONE;
+		}
+		autoattach_loaded = true;
+	}
+	return &autoattach_record;
+}
+
+static bool autoattach_store(const autoattach_record_s *const record)
+{
+	autoattach_record_s *const current = autoattach_load();
+	if (!memcmp(current, record, sizeof(*record)))
+		return true;
+	if (!platform_settings_write(record, sizeof(*record)))
+		return false;
+	*current = *record;
+	return true;
+}
+
+bool autoattach_enabled(void)
+{
+	return autoattach_load()->enabled;
+}
+
+bool autoattach_enable(const bool enable)
+{
+	autoattach_record_s record = *autoattach_load();
+	record.enabled = enable;
+	return autoattach_store(&record);
+}
+
+void autoattach_remember(target *const t)
+{
+	autoattach_record_s record = *autoattach_load();
+	if (!record.enabled || !cortexm_identity(t, &record.fingerprint, &record.probe))
+		return;
+	const ADIv5_DP_t *const dp = cortexm_ap(t)->dp;
+	record.swd = dp->dp_read == firmware_swdp_read;
+	record.targetsel = record.swd ? dp->targetsel : 0;
+	if (!autoattach_store(&record))
+		DEBUG_WARN("autoattach: failed to save the target\n");
+}
+
+typedef struct autoattach_match {
+	uint32_t fingerprint;
+	target *target;
+} autoattach_match_s;
+
+static void autoattach_find(const int i, target *const t, void *const context)
+{
+	(void)i;
+	autoattach_match_s *const match = (autoattach_match_s *)context;
+	uint32_t fingerprint;
+	uint8_t probe;
+	if (!match->target && cortexm_identity(t, &fingerprint, &probe) && fingerprint == match->fingerprint)
+		match->target = t;
+}
+
+target *autoattach_scan(void)
+{
+	const autoattach_record_s *const record = autoattach_load();
+	if (!record->enabled || record->probe == CORTEXM_PROBE_NONE)
+		return NULL;
+	cortexm_probe_hint(record->fingerprint, record->probe);
+
+	if (connect_assert_nrst)
+		platform_nrst_set_val(true); /* will be deasserted after attach */
+	volatile uint32_t devs = 0;
+	volatile struct exception e;
+	TRY_CATCH (e, EXCEPTION_ALL) {
+		devs = record->swd ? adiv5_swdp_scan(record->targetsel) : jtag_scan(NULL);
+	}
+	platform_target_clk_output_enable(false);
+
+	autoattach_match_s match = {.fingerprint = record->fingerprint};
+	if (!e.type && devs)
+		target_foreach(autoattach_find, &match);
+	if (!match.target)
+		platform_nrst_set_val(false);
+	return match.target;
+}
@@ -32,34 +32,54 @@
 #include "target_internal.h"
 #include "morse.h"
 #include "version.h"
+#include "target_drivers.h"
 #include "serialno.h"
 #include "jtagtap.h"
+#include "cortexm.h"
+#include "stats.h"
 
 #ifdef ENABLE_RTT
 #include "rtt.h"
+#include "sample.h"
 #endif
 
 #ifdef PLATFORM_HAS_TRACESWO
 #include "traceswo.h"
 #endif
 
+#ifdef PLATFORM_HAS_SETTINGS
+#include "autoattach.h"
+#endif
+
 #if defined(_WIN32) || defined(__CYGWIN__)
 #include <malloc.h>
 #else
 #include <alloca.h>
 #endif
 
+#if PC_HOSTED == 1
+#include <errno.h>
+#include "coredump.h"
+#endif
+
 static bool cmd_version(target *t, int argc, const char **argv);
 static bool cmd_help(target *t, int argc, const char **argv);
 
 static bool cmd_jtag_scan(target *t, int argc, const char **argv);
 static bool cmd_swdp_scan(target *t, int argc, const char **argv);
 static bool cmd_auto_scan(target *t, int argc, const char **argv);
+static bool cmd_recover_scan(target *t, int argc, const char **argv);
 static bool cmd_frequency(target *t, int argc, const char **argv);
 static bool cmd_targets(target *t, int argc, const char **argv);
 static bool cmd_morse(target *t, int argc, const char **argv);
 static bool cmd_halt_timeout(target *t, int argc, const char **argv);
+static bool cmd_dp_retry(target *t, int argc, const char **argv);
 static bool cmd_connect_reset(target *t, int argc, const char **argv);
+static bool cmd_flash_incremental(target *t, int argc, const char **argv);
+static bool cmd_flash_verify(target *t, int argc, const char **argv);
+#ifdef PLATFORM_HAS_SETTINGS
+static bool cmd_autoattach(target *t, int argc, const char **argv);
+#endif
 static bool cmd_reset(target *t, int argc, const char **argv);
 static bool cmd_tdi_low_reset(target *t, int argc, const char **argv);
 #ifdef PLATFORM_HAS_POWER_SWITCH
@@ -69,40 +89,66 @@ static bool cmd_target_power(target *t, int argc, const char **argv);
 static bool cmd_traceswo(target *t, int argc, const char **argv);
 #endif
 static bool cmd_heapinfo(target *t, int argc, const char **argv);
+static bool cmd_stats(target *t, int argc, const char **argv);
+#if PC_HOSTED == 1
+static bool cmd_dump(target *t, int argc, const char **argv);
+static bool cmd_coredump(target *t, int argc, const char **argv);
+static bool cmd_snapshot(target *t, int argc, const char **argv);
+#endif
 #ifdef ENABLE_RTT
 static bool cmd_rtt(target *t, int argc, const char **argv);
+static bool cmd_sample(target *t, int argc, const char **argv);
 #endif
 #if defined(PLATFORM_HAS_DEBUG) && (PC_HOSTED == 0)
 static bool cmd_debug_bmp(target *t, int argc, const char **argv);
 #endif
 
+/* The transport of the last scan that found something, which auto_scan tries first */
+static bool scan_swd_first;
+
 const command_t cmd_list[] = {
 	{"version", cmd_version, "Display firmware version info"},
 	{"help", cmd_help, "Display help for monitor commands"},
 	{"jtag_scan", cmd_jtag_scan, "Scan JTAG chain for devices"},
 	{"swdp_scan", cmd_swdp_scan, "Scan SW-DP for devices"},
 	{"auto_scan", cmd_auto_scan, "Automatically scan all chain types for devices"},
-	{"frequency", cmd_frequency, "set minimum high and low times"},
+	{"recover_scan", cmd_recover_scan, "Scan SW-DP, mass erasing a protected nRF52 so it comes up as a normal target"},
+	{"frequency", cmd_frequency, "set minimum high and low times: (<freq>|auto)"},
 	{"targets", cmd_targets, "Display list of available targets"},
 	{"morse", cmd_morse, "Display morse error message"},
 	{"halt_timeout", cmd_halt_timeout, "Timeout (ms) to wait until Cortex-M is halted: (Default 2000)"},
+	{"dp_retry", cmd_dp_retry, "DP WAIT/FAULT retry policy for the next scan: (wait) (fault) (idle) (idle_max) (idle_after)"},
 	{"connect_rst", cmd_connect_reset, "Configure connect under reset: (enable|disable)"},
+	{"flash_incremental", cmd_flash_incremental, "Skip erasing and programming unchanged flash blocks: (enable|disable)"},
+	{"flash_verify", cmd_flash_verify, "Verify each flash block as it is programmed: (enable|disable)"},
+#ifdef PLATFORM_HAS_SETTINGS
+	{"autoattach", cmd_autoattach, "Attach to the last target when GDB connects: (enable|disable)"},
+#endif
 	{"reset", cmd_reset, "Pulse the nRST line - disconnects target"},
 	{"tdi_low_reset", cmd_tdi_low_reset, "Pulse nRST with TDI set low to attempt to wake certain targets up (eg LPC82x)"},
 #ifdef PLATFORM_HAS_POWER_SWITCH
 	{"tpwr", cmd_target_power, "Supplies power to the target: (enable|disable)"},
 #endif
 #ifdef ENABLE_RTT
-	{"rtt", cmd_rtt, "enable|disable|status|channel 0..15|ident (str)|cblock|poll maxms minms maxerr"},
+	{"rtt", cmd_rtt, "enable|disable|status|channel 0..15|ident (str)|cblock|poll maxms minms maxerr|watch (enable|disable)"},
+	{"sample", cmd_sample, "Stream memory while the target runs: (addr len period_us)|clear|status"},
 #endif
 #ifdef PLATFORM_HAS_TRACESWO
 #if defined TRACESWO_PROTOCOL && TRACESWO_PROTOCOL == 2
-	{"traceswo", cmd_traceswo, "Start trace capture, NRZ mode: (baudrate) (decode channel ...)"},
+	{"traceswo", cmd_traceswo,
+		"Start trace capture, NRZ mode: (baudrate) (decode channel ... (aggregate window_ms channel ...))|status"},
 #else
-	{"traceswo", cmd_traceswo, "Start trace capture, Manchester mode: (decode channel ...)"},
+	{"traceswo", cmd_traceswo,
+		"Start trace capture, Manchester mode: (decode channel ... (aggregate window_ms channel ...))"},
 #endif
 #endif
 	{"heapinfo", cmd_heapinfo, "Set semihosting heapinfo"},
+	{"stats", cmd_stats, "Display packet latency and transfer statistics: (reset)"},
+#if PC_HOSTED == 1
+	{"dump", cmd_dump, "Write target memory to a local file: <addr> <len> <file>"},
+	{"coredump", cmd_coredump, "Write registers and RAM to a local ELF core file for gdb -c: <file>"},
+	{"snapshot", cmd_snapshot, "Write a core file reading back only RAM changed since the last: <prefix>|reset"},
+#endif
 #if defined(PLATFORM_HAS_DEBUG) && (PC_HOSTED == 0)
 	{"debug_bmp", cmd_debug_bmp, "Output BMP \"debug\" strings to the second vcom: (enable|disable)"},
 #endif
@@ -110,6 +156,7 @@ const command_t cmd_list[] = {
 };
 
 bool connect_assert_nrst;
+bool scan_recover;
 #if defined(PLATFORM_HAS_DEBUG) && (PC_HOSTED == 0)
 bool debug_bmp;
 #endif
@@ -158,10 +205,11 @@ bool cmd_version(target *t, int argc, const char **argv)
 #if PC_HOSTED == 1
 	char ident[256];
 	gdb_ident(ident, sizeof(ident));
-	DEBUG_WARN("%s\n", ident);
+	DEBUG_WARN("%s\nTarget drivers: " TARGET_DRIVERS "\n", ident);
 #else
 	gdb_out(BOARD_IDENT);
 	gdb_outf(", Hardware Version %d\n", platform_hwversion());
+	gdb_out("Target drivers: " TARGET_DRIVERS "\n");
 	gdb_out("Copyright (C) 2022 Black Magic Debug Project\n");
 	gdb_out("License GPLv3+: GNU GPL version 3 or later "
 		"<http://gnu.org/licenses/gpl.html>\n\n");
@@ -230,6 +278,7 @@ static bool cmd_jtag_scan(target *t, int argc, const char **argv)
 		return false;
 	}
 
+	scan_swd_first = false;
 	cmd_targets(NULL, 0, NULL);
 	platform_target_clk_output_enable(false);
 	morse(NULL, false);
@@ -273,12 +322,22 @@ bool cmd_swdp_scan(target *t, int argc, const char **argv)
 		return false;
 	}
 
+	scan_swd_first = true;
 	cmd_targets(NULL, 0, NULL);
 	platform_target_clk_output_enable(false);
 	morse(NULL, false);
 	return true;
 }
 
+/* One scan that mass erases any protected part it finds, instead of a scan, erase and scan again */
+static bool cmd_recover_scan(target *t, int argc, const char **argv)
+{
+	scan_recover = true;
+	const bool result = cmd_swdp_scan(t, argc, argv);
+	scan_recover = false;
+	return result;
+}
+
 bool cmd_auto_scan(target *t, int argc, const char **argv)
 {
 	(void)t;
@@ -290,35 +349,31 @@ bool cmd_auto_scan(target *t, int argc, const char **argv)
 	if (connect_assert_nrst)
 		platform_nrst_set_val(true); /* will be deasserted after attach */
 
-	uint32_t devs = 0;
-	volatile struct exception e;
-	TRY_CATCH (e, EXCEPTION_ALL) {
+	volatile uint32_t devs = 0;
+	bool swd = scan_swd_first;
+	for (size_t attempt = 0; attempt < 2U && !devs; ++attempt, swd = !swd) {
+		volatile struct exception e;
+		TRY_CATCH (e, EXCEPTION_ALL) {
 #if PC_HOSTED == 1
-		devs = platform_jtag_scan(NULL);
+			devs = swd ? platform_adiv5_swdp_scan(0) : platform_jtag_scan(NULL);
 #else
-		devs = jtag_scan(NULL);
+			devs = swd ? adiv5_swdp_scan(0) : jtag_scan(NULL);
 #endif
-		if (devs > 0)
+		}
+		switch (e.type) {
+		case EXCEPTION_TIMEOUT:
+			gdb_outf("Timeout during scan. Is target stuck in WFI?\n");
 			break;
-		gdb_out("JTAG scan found no devices, trying SWD!\n");
-
-#if PC_HOSTED == 1
-		devs = platform_adiv5_swdp_scan(0);
-#else
-		devs = adiv5_swdp_scan(0);
-#endif
-		if (devs > 0)
+		case EXCEPTION_ERROR:
+			gdb_outf("Exception: %s\n", e.msg);
 			break;
-
-		gdb_out("SW-DP scan found no devices.\n");
-	}
-	switch (e.type) {
-	case EXCEPTION_TIMEOUT:
-		gdb_outf("Timeout during scan. Is target stuck in WFI?\n");
-		break;
-	case EXCEPTION_ERROR:
-		gdb_outf("Exception: %s\n", e.msg);
-		break;
+		}
+		if (devs)
+			scan_swd_first = swd;
+		else if (!attempt)
+			gdb_outf("%s scan found no devices, trying %s!\n", swd ? "SW-DP" : "JTAG", swd ? "JTAG" : "SWD");
+		else
+			gdb_outf("%s scan found no devices.\n", swd ? "SW-DP" : "JTAG");
 	}
 
 	if (devs == 0) {
@@ -337,7 +392,16 @@ bool cmd_auto_scan(target *t, int argc, const char **argv)
 bool cmd_frequency(target *t, int argc, const char **argv)
 {
 	(void)t;
-	if (argc == 2) {
+	if (argc == 2 && !strcmp(argv[1], "auto")) {
+		if (!t)
+			t = target_list;
+		if (!t || !target_is_cortexm(t)) {
+			gdb_out("Automatic frequency search needs a scanned ARM Cortex-M target\n");
+			return false;
+		}
+		if (!adiv5_swj_frequency_auto(cortexm_ap(t)))
+			gdb_out("Automatic frequency search failed\n");
+	} else if (argc == 2) {
 		char *multiplier = NULL;
 		uint32_t frequency = strtoul(argv[1], &multiplier, 10);
 		if (!multiplier) {
@@ -435,6 +499,63 @@ static bool cmd_connect_reset(target *t, int argc, const char **argv)
 	return true;
 }
 
+static bool cmd_flash_incremental(target *t, int argc, const char **argv)
+{
+	(void)t;
+	bool print_status = false;
+	if (argc == 1)
+		print_status = true;
+	else if (argc == 2) {
+		if (parse_enable_or_disable(argv[1], &target_flash_incremental))
+			print_status = true;
+	} else
+		gdb_out("Unrecognized command format\n");
+
+	if (print_status)
+		gdb_outf("Incremental flashing: %s\n", target_flash_incremental ? "enabled" : "disabled");
+	return true;
+}
+
+static bool cmd_flash_verify(target *t, int argc, const char **argv)
+{
+	(void)t;
+	bool print_status = false;
+	if (argc == 1)
+		print_status = true;
+	else if (argc == 2) {
+		if (parse_enable_or_disable(argv[1], &target_flash_verify))
+			print_status = true;
+	} else
+		gdb_out("Unrecognized command format\n");
+
+	if (print_status)
+		gdb_outf("Verify while flashing: %s\n", target_flash_verify ? "enabled" : "disabled");
+	return true;
+}
+
+#ifdef PLATFORM_HAS_SETTINGS
+static bool cmd_autoattach(target *t, int argc, const char **argv)
+{
+	bool enable = autoattach_enabled();
+	if (argc == 2) {
+		if (!parse_enable_or_disable(argv[1], &enable))
+			return false;
+		if (!autoattach_enable(enable)) {
+			gdb_out("Failed to save setting\n");
+			return false;
+		}
+		/* Remember the target we are on now rather than waiting for the next attach */
+		if (enable && t)
+			autoattach_remember(t);
+	} else if (argc != 1) {
+		gdb_out("Unrecognized command format\n");
+		return true;
+	}
+	gdb_outf("Auto attach: %s\n", enable ? "enabled" : "disabled");
+	return true;
+}
+#endif
+
 static bool cmd_halt_timeout(target *t, int argc, const char **argv)
 {
 	(void)t;
@@ -444,6 +565,31 @@ static bool cmd_halt_timeout(target *t, int argc, const char **argv)
 	return true;
 }
 
+static bool cmd_dp_retry(target *t, int argc, const char **argv)
+{
+	adiv5_retry_policy_s *const retry = &adiv5_retry_default;
+	if (argc > 1)
+		retry->wait_retries = strtoul(argv[1], NULL, 0);
+	if (argc > 2)
+		retry->fault_retries = strtoul(argv[2], NULL, 0);
+	if (argc > 3)
+		retry->idle_cycles = strtoul(argv[3], NULL, 0);
+	if (argc > 4)
+		retry->idle_cycles_max = strtoul(argv[4], NULL, 0);
+	if (argc > 5)
+		retry->idle_after = strtoul(argv[5], NULL, 0);
+	if (retry->idle_cycles_max < retry->idle_cycles)
+		retry->idle_cycles_max = retry->idle_cycles;
+	gdb_outf("DP retries: %u WAIT, %u FAULT, idle cycles %u doubling up to %u, %u after each transfer\n",
+		retry->wait_retries, retry->fault_retries, retry->idle_cycles, retry->idle_cycles_max, retry->idle_after);
+	if (t && target_is_cortexm(t)) {
+		const ADIv5_DP_t *const dp = cortexm_ap(t)->dp;
+		gdb_outf("Target DP: %u idle cycles after each transfer, %u of them learned from WAITs\n",
+			(unsigned)adiv5_dp_idle_after(dp), dp->idle_learned);
+	}
+	return true;
+}
+
 static bool cmd_reset(target *t, int argc, const char **argv)
 {
 	(void)t;
@@ -469,9 +615,17 @@ static bool cmd_tdi_low_reset(target *t, int argc, const char **argv)
 static bool cmd_target_power(target *t, int argc, const char **argv)
 {
 	(void)t;
-	if (argc == 1)
+	if (argc == 1) {
 		gdb_outf("Target Power: %s\n", platform_target_get_power() ? "enabled" : "disabled");
-	else if (argc == 2) {
+#ifdef PLATFORM_HAS_VOLTAGE_MONITOR
+		platform_voltage_window_s window;
+		platform_target_voltage_window(&window);
+		gdb_outf("Target voltage: %" PRIu32 ".%" PRIu32 "V, lately %" PRIu32 ".%" PRIu32 "V to %" PRIu32 ".%" PRIu32
+				 "V\n",
+			window.last / 10U, window.last % 10U, window.min / 10U, window.min % 10U, window.max / 10U,
+			window.max % 10U);
+#endif
+	} else if (argc == 2) {
 		bool want_enable = false;
 		if (parse_enable_or_disable(argv[1], &want_enable)) {
 			if (want_enable && !platform_target_get_power() &&
@@ -502,9 +656,11 @@ static bool cmd_rtt(target *t, int argc, const char **argv)
 	if (argc == 1 || (argc == 2 && !strncmp(argv[1], "enabled", command_len))) {
 		rtt_enabled = true;
 		rtt_found = false;
+		rtt_stats_reset();
 	} else if ((argc == 2) && !strncmp(argv[1], "disabled", command_len)) {
 		rtt_enabled = false;
 		rtt_found = false;
+		rtt_watch_disarm(t);
 	} else if ((argc == 2) && !strncmp(argv[1], "status", command_len)) {
 		gdb_outf("rtt: %s found: %s ident: \"%s\"", on_or_off(rtt_enabled), rtt_found ? "yes" : "no",
 			rtt_ident[0] == '\0' ? "off" : rtt_ident);
@@ -518,6 +674,17 @@ static bool cmd_rtt(target *t, int argc, const char **argv)
 		}
 		gdb_outf(
 			"\nmax poll ms: %u min poll ms: %u max errs: %u\n", rtt_max_poll_ms, rtt_min_poll_ms, rtt_max_poll_errs);
+		gdb_outf("watch: %s\n", on_or_off(rtt_watch));
+		gdb_outf("polls: %" PRIu32 " effective poll us: %" PRIu32 "\n", rtt_polls,
+			rtt_polls > 1 ? (uint32_t)(rtt_poll_time_us / (rtt_polls - 1)) : 0);
+		gdb_out("ch i/o      bytes    polls    empty errs ovfl\n");
+		for (size_t i = 0; i < MAX_RTT_CHAN; ++i) {
+			if (!rtt_stats[i].polls && !rtt_stats[i].overflows)
+				continue;
+			gdb_outf("%2" PRIu32 " %s %10" PRIu32 " %8" PRIu32 " %8" PRIu32 " %4" PRIu32 " %4" PRIu32 "\n", (uint32_t)i,
+				rtt_channel[i].is_output ? "out" : "in ", rtt_stats[i].bytes, rtt_stats[i].polls,
+				rtt_stats[i].empty_polls, rtt_stats[i].errors, rtt_stats[i].overflows);
+		}
 	} else if (argc >= 2 && !strncmp(argv[1], "channel", command_len)) {
 		/* mon rtt channel switches to auto rtt channel selection
 		   mon rtt channel number... selects channels given */
@@ -555,6 +722,12 @@ static bool cmd_rtt(target *t, int argc, const char **argv)
 			if (rtt_ident[i] == '_')
 				rtt_ident[i] = ' ';
 		}
+	} else if (argc == 3 && !strncmp(argv[1], "watch", command_len)) {
+		/* arm write watchpoints on the up buffers the next time rtt is polled */
+		if (parse_enable_or_disable(argv[2], &rtt_watch) && !rtt_watch)
+			rtt_watch_disarm(t);
+		else
+			rtt_found = false;
 	} else if (argc == 5 && !strncmp(argv[1], "poll", command_len)) {
 		/* set polling params */
 		rtt_max_poll_ms = strtoul(argv[2], NULL, 0);
@@ -564,6 +737,36 @@ static bool cmd_rtt(target *t, int argc, const char **argv)
 		gdb_out("what?\n");
 	return true;
 }
+
+static bool cmd_sample(target *t, int argc, const char **argv)
+{
+	(void)t;
+	if (argc == 4) {
+		const uint32_t addr = strtoul(argv[1], NULL, 0);
+		const uint32_t len = strtoul(argv[2], NULL, 0);
+		const uint32_t period_us = strtoul(argv[3], NULL, 0);
+		if (!sample_add(addr, len, period_us)) {
+			gdb_outf("At most %u ranges of 1 to %u bytes\n", SAMPLE_MAX_RANGES, SAMPLE_MAX_LEN);
+			return false;
+		}
+	} else if (argc == 2 && !strcmp(argv[1], "clear"))
+		sample_clear();
+	else if (argc == 1 || (argc == 2 && !strcmp(argv[1], "status"))) {
+		const sample_range_s *ranges;
+		const size_t count = sample_ranges(&ranges);
+		gdb_outf("sampling on rtt channel %u, halt: %s\n", SAMPLE_CHANNEL,
+			on_or_off(target_no_background_memory_access(t)));
+		gdb_out("addr       len period_us  samples  dropped errors\n");
+		for (size_t i = 0; i < count; ++i) {
+			gdb_outf("0x%08" PRIx32 " %3u %9" PRIu32 " %8" PRIu32 " %8" PRIu32 " %6" PRIu32 "\n", ranges[i].addr,
+				(unsigned)ranges[i].len, ranges[i].period_us, ranges[i].samples, ranges[i].dropped, ranges[i].errors);
+		}
+	} else {
+		gdb_out("usage: monitor sample (addr len period_us)|clear|status\n");
+		return false;
+	}
+	return true;
+}
 #endif
 
 #ifdef PLATFORM_HAS_TRACESWO
@@ -574,8 +777,23 @@ static bool cmd_traceswo(target *t, int argc, const char **argv)
 	uint32_t baudrate = SWO_DEFAULT_BAUD;
 #endif
 	uint32_t swo_channelmask = 0; /* swo decoding off */
+	uint32_t aggregate_mask = 0;
+	uint32_t aggregate_ms = 0;
 	uint8_t decode_arg = 1;
 #if TRACESWO_PROTOCOL == 2
+	if (argc == 2 && !strcmp(argv[1], "status")) {
+		traceswo_stats_s stats;
+		traceswo_get_stats(&stats);
+		if (!stats.baudrate) {
+			gdb_out("Trace capture not started\n");
+			return true;
+		}
+		gdb_outf("Baudrate: %" PRIu32 " max: %" PRIu32 "\n", stats.baudrate, stats.max_baudrate);
+		gdb_outf("Received: %" PRIu32 " sent: %" PRIu32 " bytes\n", stats.bytes_received, stats.bytes_sent);
+		gdb_outf("Overrun: %" PRIu32 " bytes lost to USB, %" PRIu32 " UART overruns\n", stats.overrun_bytes,
+			stats.uart_overruns);
+		return true;
+	}
 	/* argument: optional baud rate for async mode */
 	if (argc > 1 && argv[1][0] >= '0' && argv[1][0] <= '9') {
 		baudrate = strtoul(argv[1], NULL, 0);
@@ -590,16 +808,29 @@ static bool cmd_traceswo(target *t, int argc, const char **argv)
 		/* arguments: channels to decode */
 		if (argc > decode_arg + 1) {
 			swo_channelmask = 0U;
+			bool aggregate = false;
 			for (size_t i = decode_arg + 1; i < (size_t)argc; ++i) { /* create bitmask of channels to decode */
+				/* channels after 'aggregate window_ms' are summarised on the probe */
+				if (!strcmp(argv[i], "aggregate") && i + 1U < (size_t)argc) {
+					aggregate_ms = strtoul(argv[++i], NULL, 0);
+					aggregate = true;
+					continue;
+				}
 				const uint32_t channel = strtoul(argv[i], NULL, 0);
-				if (channel < 32)
+				if (channel < 32) {
 					swo_channelmask |= 1U << channel;
+					if (aggregate)
+						aggregate_mask |= 1U << channel;
+				}
 			}
 		}
 	}
 
 #if TRACESWO_PROTOCOL == 2
+	baudrate = traceswo_init(baudrate, swo_channelmask);
 	gdb_outf("Baudrate: %lu ", baudrate);
+#else
+	traceswo_init(swo_channelmask);
 #endif
 	gdb_outf("Channel mask: ");
 	for (size_t i = 0; i < 32; ++i) {
@@ -607,12 +838,10 @@ static bool cmd_traceswo(target *t, int argc, const char **argv)
 		gdb_outf("%" PRIu32, bit);
 	}
 	gdb_outf("\n");
-
-#if TRACESWO_PROTOCOL == 2
-	traceswo_init(baudrate, swo_channelmask);
-#else
-	traceswo_init(swo_channelmask);
-#endif
+	traceswo_setaggregate(aggregate_mask, aggregate_ms);
+	if (aggregate_mask)
+		gdb_outf("Aggregate mask: 0x%08" PRIx32 ", summary every %" PRIu32 " ms\n", aggregate_mask,
+			aggregate_ms ? aggregate_ms : SWO_AGGREGATE_DEFAULT_MS);
 
 	gdb_outf("Trace enabled for BMP serial %s, USB EP 5\n", serial_no);
 	return true;
@@ -653,3 +882,120 @@ static bool cmd_heapinfo(target *t, int argc, const char **argv)
 		gdb_outf("heapinfo heap_base heap_limit stack_base stack_limit\n");
 	return true;
 }
+
+static bool cmd_stats(target *t, int argc, const char **argv)
+{
+	(void)t;
+	if (argc > 1) {
+		if (strncmp(argv[1], "reset", strlen(argv[1])) != 0)
+			return false;
+		stats_reset();
+		gdb_out("Statistics reset\n");
+		return true;
+	}
+	stats_print();
+	return true;
+}
+
+#if PC_HOSTED == 1
+/*
+ * Read memory straight into a file on the machine running this, in big chunks
+ * and without the hex encoding GDB's dump memory goes through.
+ */
+static bool cmd_dump(target *t, int argc, const char **argv)
+{
+	if (!t) {
+		gdb_out("not attached\n");
+		return true;
+	}
+	if (argc != 4) {
+		gdb_out("usage: monitor dump <addr> <len> <file>\n");
+		return true;
+	}
+	target_addr_t addr = strtoul(argv[1], NULL, 0);
+	const size_t len = strtoul(argv[2], NULL, 0);
+	FILE *file = fopen(argv[3], "wb");
+	if (!file) {
+		gdb_outf("Can not open %s: %s\n", argv[3], strerror(errno));
+		return false;
+	}
+	const size_t chunk_size = 0x10000U;
+	uint8_t *chunk = malloc(chunk_size);
+	if (!chunk) { /* malloc failed: heap exhaustion */
+		DEBUG_WARN("malloc: failed in %s\n", __func__);
+		fclose(file);
+		return false;
+	}
+	const uint32_t start_time = platform_time_ms();
+	uint32_t tick_time = start_time;
+	size_t done = 0;
+	bool ok = true;
+	while (done < len) {
+		const size_t count = MIN(chunk_size, len - done);
+		if (target_mem_read(t, chunk, addr, count)) {
+			gdb_outf("Read failed at 0x%08" PRIx32 "\n", addr);
+			ok = false;
+			break;
+		}
+		if (fwrite(chunk, 1, count, file) != count) {
+			gdb_outf("Write to %s failed: %s\n", argv[3], strerror(errno));
+			ok = false;
+			break;
+		}
+		done += count;
+		addr += count;
+		const uint32_t now = platform_time_ms();
+		if (now - tick_time >= 1000U) {
+			tick_time = now;
+			gdb_outf("%zu of %zu kiB\n", done / 1024U, len / 1024U);
+		}
+	}
+	free(chunk);
+	if (fclose(file))
+		ok = false;
+	const uint32_t elapsed = MAX(platform_time_ms() - start_time, 1U);
+	gdb_outf("Dumped %zu bytes in %" PRIu32 " ms, %.1f kiB/s\n", done, elapsed, done / 1.024 / elapsed);
+	return ok;
+}
+
+static bool cmd_coredump(target *t, int argc, const char **argv)
+{
+	if (!t) {
+		gdb_out("not attached\n");
+		return true;
+	}
+	if (argc != 2) {
+		gdb_out("usage: monitor coredump <file>\n");
+		return true;
+	}
+	if (!coredump_write(t, argv[1])) {
+		gdb_outf("Core dump to %s failed\n", argv[1]);
+		return false;
+	}
+	gdb_outf("Core dump written to %s\n", argv[1]);
+	return true;
+}
+
+static bool cmd_snapshot(target *t, int argc, const char **argv)
+{
+	if (argc != 2) {
+		gdb_out("usage: monitor snapshot <prefix>|reset\n");
+		return true;
+	}
+	if (!strcmp(argv[1], "reset")) {
+		coredump_snapshot_reset();
+		return true;
+	}
+	if (!t) {
+		gdb_out("not attached\n");
+		return true;
+	}
+	const char *const path = coredump_snapshot(t, argv[1]);
+	if (!path) {
+		gdb_outf("Snapshot to %s failed\n", argv[1]);
+		return false;
+	}
+	gdb_outf("Snapshot written to %s\n", path);
+	return true;
+}
+#endif
@@ -98,7 +98,7 @@ static uint32_t crc32_calc(uint32_t crc, uint8_t data)
 	return (crc << 8) ^ crc32_table[((crc >> 24) ^ data) & 255];
 }
 
-int generic_crc32(target *t, uint32_t *crc_res, uint32_t base, size_t len)
+static int probe_crc32(target *t, uint32_t *crc_res, uint32_t base, size_t len)
 {
 	uint32_t crc = -1;
 #if PC_HOSTED == 1
@@ -121,7 +121,7 @@ int generic_crc32(target *t, uint32_t *crc_res, uint32_t base, size_t len)
 		}
 		size_t read_len = MIN(sizeof(bytes), len);
 		if (target_mem_read(t, bytes, base, read_len)) {
-			DEBUG_WARN("generic_crc32 error around address 0x%08" PRIx32 "\n",
+			DEBUG_WARN("probe_crc32 error around address 0x%08" PRIx32 "\n",
 					   base);
 			return -1;
 		}
@@ -136,9 +136,80 @@ int generic_crc32(target *t, uint32_t *crc_res, uint32_t base, size_t len)
 	*crc_res = crc;
 	return 0;
 }
+#elif defined(CRC_DMA_CHAN)
+#include <libopencm3/stm32/crc.h>
+#include <libopencm3/stm32/dma.h>
+#include <libopencm3/stm32/rcc.h>
+
+/* Wait for the DMA to finish feeding the CRC unit the last chunk handed to it */
+static void probe_crc32_dma_wait(void)
+{
+	if (!(DMA_CCR(CRC_DMA_BUS, CRC_DMA_CHAN) & DMA_CCR_EN))
+		return;
+	while (!dma_get_interrupt_flag(CRC_DMA_BUS, CRC_DMA_CHAN, DMA_TCIF))
+		continue;
+	dma_disable_channel(CRC_DMA_BUS, CRC_DMA_CHAN);
+	dma_clear_interrupt_flags(CRC_DMA_BUS, CRC_DMA_CHAN, DMA_TCIF);
+}
+
+static void probe_crc32_dma_start(const uint8_t *data, size_t len)
+{
+	dma_channel_reset(CRC_DMA_BUS, CRC_DMA_CHAN);
+	dma_set_peripheral_address(CRC_DMA_BUS, CRC_DMA_CHAN, (uint32_t)&CRC_DR);
+	dma_set_memory_address(CRC_DMA_BUS, CRC_DMA_CHAN, (uint32_t)data);
+	dma_set_number_of_data(CRC_DMA_BUS, CRC_DMA_CHAN, len);
+	dma_set_read_from_memory(CRC_DMA_BUS, CRC_DMA_CHAN);
+	dma_enable_memory_increment_mode(CRC_DMA_BUS, CRC_DMA_CHAN);
+	/* Byte writes to CRC_DR are taken a byte at a time, so no swapping is needed */
+	dma_set_peripheral_size(CRC_DMA_BUS, CRC_DMA_CHAN, DMA_CCR_PSIZE_8BIT);
+	dma_set_memory_size(CRC_DMA_BUS, CRC_DMA_CHAN, DMA_CCR_MSIZE_8BIT);
+	dma_enable_mem2mem_mode(CRC_DMA_BUS, CRC_DMA_CHAN);
+	dma_enable_channel(CRC_DMA_BUS, CRC_DMA_CHAN);
+}
+
+/*
+ * The reads alternate between two buffers: while one chunk is read from the
+ * target, the DMA feeds the CRC unit the chunk before it, so the CRC costs
+ * nothing on top of the reads.
+ */
+static int probe_crc32(target *t, uint32_t *crc_res, uint32_t base, size_t len)
+{
+	static uint8_t bytes[2][512];
+	size_t buffer = 0;
+
+	rcc_periph_clock_enable(CRC_DMA_CLK);
+	CRC_CR |= CRC_CR_RESET;
+
+	uint32_t last_time = platform_time_ms();
+	while (len) {
+		uint32_t actual_time = platform_time_ms();
+		if ( actual_time > last_time + 1000) {
+			last_time = actual_time;
+			gdb_if_putchar(0, true);
+		}
+		size_t read_len = MIN(sizeof(bytes[0]), len);
+		if (target_mem_read(t, bytes[buffer], base, read_len)) {
+			DEBUG_WARN("probe_crc32 error around address 0x%08" PRIx32 "\n",
+					   base);
+			probe_crc32_dma_wait();
+			return -1;
+		}
+
+		probe_crc32_dma_wait();
+		probe_crc32_dma_start(bytes[buffer], read_len);
+		buffer ^= 1U;
+
+		base += read_len;
+		len -= read_len;
+	}
+	probe_crc32_dma_wait();
+
+	*crc_res = CRC_DR;
+	return 0;
+}
 #else
 #include <libopencm3/stm32/crc.h>
-int generic_crc32(target *t, uint32_t *crc_res, uint32_t base, size_t len)
+static int probe_crc32(target *t, uint32_t *crc_res, uint32_t base, size_t len)
 {
 	uint8_t bytes[128];
 	uint32_t crc;
@@ -154,7 +225,7 @@ int generic_crc32(target *t, uint32_t *crc_res, uint32_t base, size_t len)
 		}
 		size_t read_len = MIN(sizeof(bytes), len) & ~3;
 		if (target_mem_read(t, bytes, base, read_len)) {
-			DEBUG_WARN("generic_crc32 error around address 0x%08" PRIx32 "\n",
+			DEBUG_WARN("probe_crc32 error around address 0x%08" PRIx32 "\n",
 					   base);
 			return -1;
 		}
@@ -169,7 +240,7 @@ int generic_crc32(target *t, uint32_t *crc_res, uint32_t base, size_t len)
 	crc = CRC_DR;
 
 	if (target_mem_read(t, bytes, base, len)) {
-		DEBUG_WARN("generic_crc32 error around address 0x%08" PRIx32 "\n",
+		DEBUG_WARN("probe_crc32 error around address 0x%08" PRIx32 "\n",
 				   base);
 		return -1;
 	}
@@ -188,3 +259,33 @@ int generic_crc32(target *t, uint32_t *crc_res, uint32_t base, size_t len)
 }
 #endif
 
+/* The same CRC as generic_crc32(), of data already in probe memory */
+uint32_t generic_crc32_buffer(uint32_t crc, const uint8_t *data, size_t len)
+{
+#if !defined(STM32F0) && !defined(STM32F1) && !defined(STM32F2) && \
+	!defined(STM32F3) && !defined(STM32F4) && !defined(STM32F7) && \
+	!defined(STM32L0) && !defined(STM32L1) && !defined(STM32F4) && \
+	!defined(STM32G0) && !defined(STM32G4)
+	for (size_t i = 0; i < len; i++)
+		crc = crc32_calc(crc, data[i]);
+#else
+	while (len--) {
+		crc ^= (uint32_t)*data++ << 24U;
+		for (int i = 0; i < 8; i++) {
+			if (crc & 0x80000000)
+				crc = (crc << 1) ^ 0x4C11DB7;
+			else
+				crc <<= 1;
+		}
+	}
+#endif
+	return crc;
+}
+
+int generic_crc32(target *t, uint32_t *crc_res, uint32_t base, size_t len)
+{
+	/* Let the target do the work if it can, reading everything back is very slow */
+	if (target_mem_crc32(t, crc_res, base, len))
+		return 0;
+	return probe_crc32(t, crc_res, base, len);
+}
@@ -0,0 +1,413 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The bytecode is that of the "Agent Expressions" appendix of the GDB
+ * manual: a stack machine over 64 bit values with register and memory
+ * access. Floating point, trace collection and the state variable opcodes
+ * are not implemented, an expression using them counts as true so the
+ * breakpoint is reported and GDB can decide.
+ */
+
+#include "general.h"
+#include "target.h"
+#include "gdb_agent.h"
+#include "hex_utils.h"
+
+#define GDB_AGENT_STACK   32U
+#define GDB_AGENT_STEPS   1024U /* Bounds a condition that loops */
+#define GDB_AGENT_STEP_MS 100U
+
+enum gdb_agent_op {
+	AX_ADD = 0x02,
+	AX_SUB = 0x03,
+	AX_MUL = 0x04,
+	AX_DIV_SIGNED = 0x05,
+	AX_DIV_UNSIGNED = 0x06,
+	AX_REM_SIGNED = 0x07,
+	AX_REM_UNSIGNED = 0x08,
+	AX_LSH = 0x09,
+	AX_RSH_SIGNED = 0x0a,
+	AX_RSH_UNSIGNED = 0x0b,
+	AX_LOG_NOT = 0x0e,
+	AX_BIT_AND = 0x0f,
+	AX_BIT_OR = 0x10,
+	AX_BIT_XOR = 0x11,
+	AX_BIT_NOT = 0x12,
+	AX_EQUAL = 0x13,
+	AX_LESS_SIGNED = 0x14,
+	AX_LESS_UNSIGNED = 0x15,
+	AX_EXT = 0x16,
+	AX_REF8 = 0x17,
+	AX_REF16 = 0x18,
+	AX_REF32 = 0x19,
+	AX_REF64 = 0x1a,
+	AX_IF_GOTO = 0x20,
+	AX_GOTO = 0x21,
+	AX_CONST8 = 0x22,
+	AX_CONST16 = 0x23,
+	AX_CONST32 = 0x24,
+	AX_CONST64 = 0x25,
+	AX_REG = 0x26,
+	AX_END = 0x27,
+	AX_DUP = 0x28,
+	AX_POP = 0x29,
+	AX_ZERO_EXT = 0x2a,
+	AX_SWAP = 0x2b,
+	AX_PICK = 0x32,
+	AX_ROT = 0x33,
+};
+
+/* The conditions of one breakpoint, each stored as a big endian 16 bit length and its bytecode */
+struct gdb_agent_cond {
+	struct gdb_agent_cond *next;
+	uint32_t type;
+	uint32_t addr;
+	uint32_t len;
+	size_t size;
+	uint8_t code[];
+};
+
+static struct gdb_agent_cond *gdb_agent_conds;
+
+void gdb_agent_cond_clear(const uint32_t type, const uint32_t addr, const uint32_t len)
+{
+	for (struct gdb_agent_cond **cond = &gdb_agent_conds; *cond; cond = &(*cond)->next) {
+		if ((*cond)->type == type && (*cond)->addr == addr && (*cond)->len == len) {
+			struct gdb_agent_cond *const next = (*cond)->next;
+			free(*cond);
+			*cond = next;
+			return;
+		}
+	}
+}
+
+void gdb_agent_cond_clear_all(void)
+{
+	while (gdb_agent_conds) {
+		struct gdb_agent_cond *const next = gdb_agent_conds->next;
+		free(gdb_agent_conds);
+		gdb_agent_conds = next;
+	}
+}
+
+bool gdb_agent_cond_set(const uint32_t type, const uint32_t addr, const uint32_t len, const char *conds)
+{
+	gdb_agent_cond_clear(type, addr, len);
+	/* The bytecode takes half the room of its hex, which leaves space for the lengths */
+	struct gdb_agent_cond *const cond = malloc(sizeof(*cond) + strlen(conds));
+	if (!cond) { /* malloc failed: heap exhaustion */
+		DEBUG_WARN("malloc: failed in %s\n", __func__);
+		return false;
+	}
+	cond->type = type;
+	cond->addr = addr;
+	cond->len = len;
+	cond->size = 0;
+	/* Only the conditions are used, a trailing ";cmds:" list is for a persistent agent */
+	while (conds[0] == ';' && conds[1] == 'X') {
+		char *end;
+		const unsigned long size = strtoul(conds + 2, &end, 16);
+		if (*end != ',' || !size || size > 0xffffU || strspn(end + 1, "0123456789abcdefABCDEF") < size * 2U) {
+			free(cond);
+			return false;
+		}
+		cond->code[cond->size++] = size >> 8U;
+		cond->code[cond->size++] = size & 0xffU;
+		unhexify(cond->code + cond->size, end + 1, size);
+		cond->size += size;
+		conds = end + 1 + size * 2U;
+	}
+	if (!cond->size) {
+		free(cond);
+		return *conds == '\0' || !strncmp(conds, ";cmds:", 6);
+	}
+	cond->next = gdb_agent_conds;
+	gdb_agent_conds = cond;
+	return true;
+}
+
+/* Operands in the bytecode are big endian, target memory and registers little endian */
+static uint64_t gdb_agent_operand(const uint8_t *code, const size_t size)
+{
+	uint64_t value = 0;
+	for (size_t i = 0; i < size; ++i)
+		value = (value << 8U) | code[i];
+	return value;
+}
+
+static uint64_t gdb_agent_le(const uint8_t *data, const size_t size)
+{
+	uint64_t value = 0;
+	for (size_t i = size; i; --i)
+		value = (value << 8U) | data[i - 1U];
+	return value;
+}
+
+static bool gdb_agent_read(target *t, uint64_t *value, const target_addr_t addr, const size_t size)
+{
+	uint8_t data[8];
+	if (target_mem_read(t, data, addr, size))
+		return false;
+	*value = gdb_agent_le(data, size);
+	return true;
+}
+
+/* Returns false if the expression can't be evaluated, else its value in result */
+static bool gdb_agent_eval(target *t, const uint8_t *const code, const size_t len, uint64_t *const result)
+{
+	uint64_t stack[GDB_AGENT_STACK];
+	size_t sp = 0;
+	size_t pc = 0;
+	for (size_t steps = 0; steps < GDB_AGENT_STEPS && pc < len; ++steps) {
+		const uint8_t op = code[pc++];
+		/* Bytes of immediate operand following each opcode */
+		static const uint8_t operand_size[] = {
+			[AX_EXT] = 1U,
+			[AX_IF_GOTO] = 2U,
+			[AX_GOTO] = 2U,
+			[AX_CONST8] = 1U,
+			[AX_CONST16] = 2U,
+			[AX_CONST32] = 4U,
+			[AX_CONST64] = 8U,
+			[AX_REG] = 2U,
+			[AX_ZERO_EXT] = 1U,
+			[AX_PICK] = 1U,
+		};
+		const size_t operand_len = op < ARRAY_LENGTH(operand_size) ? operand_size[op] : 0U;
+		if (pc + operand_len > len)
+			return false;
+		const uint64_t operand = gdb_agent_operand(code + pc, operand_len);
+		pc += operand_len;
+
+		if (op >= AX_ADD && op <= AX_LESS_UNSIGNED && op != AX_LOG_NOT && op != AX_BIT_NOT) {
+			if (sp < 2U)
+				return false;
+			const uint64_t b = stack[--sp];
+			const uint64_t a = stack[sp - 1U];
+			uint64_t *const top = &stack[sp - 1U];
+			switch (op) {
+			case AX_ADD:
+				*top = a + b;
+				break;
+			case AX_SUB:
+				*top = a - b;
+				break;
+			case AX_MUL:
+				*top = a * b;
+				break;
+			case AX_DIV_SIGNED:
+			case AX_DIV_UNSIGNED:
+			case AX_REM_SIGNED:
+			case AX_REM_UNSIGNED:
+				if (!b)
+					return false;
+				if (op == AX_DIV_SIGNED)
+					*top = (uint64_t)((int64_t)a / (int64_t)b);
+				else if (op == AX_DIV_UNSIGNED)
+					*top = a / b;
+				else if (op == AX_REM_SIGNED)
+					*top = (uint64_t)((int64_t)a % (int64_t)b);
+				else
+					*top = a % b;
+				break;
+			case AX_LSH:
+				*top = b < 64U ? a << b : 0;
+				break;
+			case AX_RSH_SIGNED:
+				*top = (uint64_t)((int64_t)a >> (b < 64U ? b : 63U));
+				break;
+			case AX_RSH_UNSIGNED:
+				*top = b < 64U ? a >> b : 0;
+				break;
+			case AX_BIT_AND:
+				*top = a & b;
+				break;
+			case AX_BIT_OR:
+				*top = a | b;
+				break;
+			case AX_BIT_XOR:
+				*top = a ^ b;
+				break;
+			case AX_EQUAL:
+				*top = a == b;
+				break;
+			case AX_LESS_SIGNED:
+				*top = (int64_t)a < (int64_t)b;
+				break;
+			case AX_LESS_UNSIGNED:
+				*top = a < b;
+				break;
+			default:
+				return false;
+			}
+			continue;
+		}
+
+		switch (op) {
+		case AX_CONST8:
+		case AX_CONST16:
+		case AX_CONST32:
+		case AX_CONST64:
+			if (sp == GDB_AGENT_STACK)
+				return false;
+			stack[sp++] = operand;
+			break;
+		case AX_REG: {
+			uint8_t data[8] = {0};
+			if (sp == GDB_AGENT_STACK || target_reg_read(t, operand, data, sizeof(data)) <= 0)
+				return false;
+			stack[sp++] = gdb_agent_le(data, sizeof(data));
+			break;
+		}
+		case AX_REF8:
+		case AX_REF16:
+		case AX_REF32:
+		case AX_REF64:
+			if (!sp || !gdb_agent_read(t, &stack[sp - 1U], stack[sp - 1U], 1U << (op - AX_REF8)))
+				return false;
+			break;
+		case AX_LOG_NOT:
+		case AX_BIT_NOT:
+			if (!sp)
+				return false;
+			stack[sp - 1U] = op == AX_LOG_NOT ? !stack[sp - 1U] : ~stack[sp - 1U];
+			break;
+		case AX_EXT:
+		case AX_ZERO_EXT:
+			if (!sp || !operand || operand > 64U)
+				return false;
+			if (operand < 64U) {
+				const uint64_t mask = (UINT64_C(1) << operand) - 1U;
+				const uint64_t sign = UINT64_C(1) << (operand - 1U);
+				uint64_t value = stack[sp - 1U] & mask;
+				if (op == AX_EXT && (value & sign))
+					value |= ~mask;
+				stack[sp - 1U] = value;
+			}
+			break;
+		case AX_IF_GOTO:
+			if (!sp)
+				return false;
+			if (stack[--sp])
+				pc = operand;
+			break;
+		case AX_GOTO:
+			pc = operand;
+			break;
+		case AX_DUP:
+			if (!sp || sp == GDB_AGENT_STACK)
+				return false;
+			stack[sp] = stack[sp - 1U];
+			++sp;
+			break;
+		case AX_POP:
+			if (!sp)
+				return false;
+			--sp;
+			break;
+		case AX_SWAP: {
+			if (sp < 2U)
+				return false;
+			const uint64_t top = stack[sp - 1U];
+			stack[sp - 1U] = stack[sp - 2U];
+			stack[sp - 2U] = top;
+			break;
+		}
+		case AX_PICK:
+			if (operand >= sp || sp == GDB_AGENT_STACK)
+				return false;
+			stack[sp] = stack[sp - 1U - operand];
+			++sp;
+			break;
+		case AX_ROT: {
+			/* a b c => c a b */
+			if (sp < 3U)
+				return false;
+			const uint64_t c = stack[sp - 1U];
+			stack[sp - 1U] = stack[sp - 2U];
+			stack[sp - 2U] = stack[sp - 3U];
+			stack[sp - 3U] = c;
+			break;
+		}
+		case AX_END:
+			if (!sp)
+				return false;
+			*result = stack[sp - 1U];
+			return true;
+		default:
+			DEBUG_WARN("Agent expression opcode 0x%02x not supported\n", op);
+			return false;
+		}
+	}
+	return false;
+}
+
+static bool gdb_agent_is_breakpoint(const struct gdb_agent_cond *const cond, const uint32_t pc)
+{
+	return (cond->type == TARGET_BREAK_SOFT || cond->type == TARGET_BREAK_HARD) && cond->addr == pc;
+}
+
+bool gdb_agent_should_stop(target *t, const uint32_t pc)
+{
+	bool conditional = false;
+	for (const struct gdb_agent_cond *cond = gdb_agent_conds; cond; cond = cond->next) {
+		if (!gdb_agent_is_breakpoint(cond, pc))
+			continue;
+		conditional = true;
+		for (size_t offset = 0; offset < cond->size;) {
+			const size_t size = ((size_t)cond->code[offset] << 8U) | cond->code[offset + 1U];
+			offset += 2U;
+			uint64_t value;
+			if (!gdb_agent_eval(t, cond->code + offset, size, &value) || value)
+				return true;
+			offset += size;
+		}
+	}
+	/* A breakpoint GDB didn't attach conditions to, or one it doesn't know about */
+	return !conditional;
+}
+
+enum target_halt_reason gdb_agent_resume(target *t, const uint32_t pc)
+{
+	for (const struct gdb_agent_cond *cond = gdb_agent_conds; cond; cond = cond->next) {
+		if (gdb_agent_is_breakpoint(cond, pc))
+			target_breakwatch_clear(t, cond->type, cond->addr, cond->len);
+	}
+	target_halt_resume(t, true);
+	platform_timeout timeout;
+	platform_timeout_set(&timeout, GDB_AGENT_STEP_MS);
+	target_addr_t watch;
+	enum target_halt_reason reason;
+	while ((reason = target_halt_poll(t, &watch)) == TARGET_HALT_RUNNING) {
+		if (platform_timeout_is_expired(&timeout)) {
+			target_halt_request(t);
+			platform_timeout_set(&timeout, GDB_AGENT_STEP_MS);
+		}
+	}
+	/* The target list has been freed */
+	if (reason == TARGET_HALT_ERROR)
+		return reason;
+	for (const struct gdb_agent_cond *cond = gdb_agent_conds; cond; cond = cond->next) {
+		if (gdb_agent_is_breakpoint(cond, pc) && target_breakwatch_set(t, cond->type, cond->addr, cond->len))
+			return TARGET_HALT_BREAKPOINT; /* Lost it, let GDB sort it out */
+	}
+	if (reason != TARGET_HALT_STEPPING)
+		return reason;
+	target_halt_resume(t, false);
+	return TARGET_HALT_RUNNING;
+}
@@ -0,0 +1,48 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GDB_AGENT_H
+#define GDB_AGENT_H
+
+#include "target.h"
+
+/*
+ * Breakpoint conditions sent by GDB as agent expressions on Z0/Z1 packets,
+ * evaluated on the probe so that a breakpoint whose condition is false costs
+ * a step over and a resume instead of a round trip to GDB.
+ */
+
+/* Attach the ";X<len>,<bytecode>..." condition list of a Z packet, false if it is malformed */
+bool gdb_agent_cond_set(uint32_t type, uint32_t addr, uint32_t len, const char *conds);
+void gdb_agent_cond_clear(uint32_t type, uint32_t addr, uint32_t len);
+void gdb_agent_cond_clear_all(void);
+
+/*
+ * Called with the core halted on a breakpoint at pc. Returns true if GDB
+ * should hear about it: no condition is attached, one of them holds or one
+ * could not be evaluated.
+ */
+bool gdb_agent_should_stop(target *t, uint32_t pc);
+
+/*
+ * Carry on after gdb_agent_should_stop() said no: single step with the
+ * breakpoints at pc taken out, put them back and resume. Returns
+ * TARGET_HALT_RUNNING, or why the step stopped if it wasn't just the step.
+ */
+enum target_halt_reason gdb_agent_resume(target *t, uint32_t pc);
+
+#endif /* GDB_AGENT_H */
@@ -31,12 +31,20 @@
 #include "gdb_packet.h"
 #include "gdb_main.h"
 #include "gdb_hostio.h"
+#include "gdb_agent.h"
 #include "target.h"
 #include "command.h"
 #include "crc32.h"
+#include "stats.h"
 #include "morse.h"
+#include "scheduler.h"
+#include "rtos.h"
 #ifdef ENABLE_RTT
 #include "rtt.h"
+#include "sample.h"
+#endif
+#ifdef PLATFORM_HAS_SETTINGS
+#include "autoattach.h"
 #endif
 
 #if defined(_WIN32) || defined(__CYGWIN__)
@@ -46,13 +54,14 @@
 #endif
 
 enum gdb_signal {
+	GDB_SIGNONE = 0,
 	GDB_SIGINT = 2,
 	GDB_SIGTRAP = 5,
 	GDB_SIGSEGV = 11,
 	GDB_SIGLOST = 29,
 };
 
-#define BUF_SIZE	1024U
+#define BUF_SIZE GDB_PACKET_BUFFER_SIZE
 
 #define ERROR_IF_NO_TARGET()	\
 	if(!cur_target) { gdb_putpacketz("EFF"); break; }
@@ -68,24 +77,142 @@ static char pbuf[BUF_SIZE + 1U];
 static target *cur_target;
 static target *last_target;
 static bool gdb_needs_detach_notify = false;
+/* Set when a pipelined vFlashWrite fails, reported to GDB on vFlashDone */
+static bool gdb_flash_write_failed = false;
+
+/*
+ * IDEs write structures as bursts of small M/X packets to adjacent addresses.
+ * Writes to RAM of a halted target are acknowledged at once and held here,
+ * growing while each carries on from the last, and go out as one
+ * target_mem_write before any other packet is handled or a write elsewhere.
+ */
+#define GDB_WRITE_COMBINE_SIZE 256U
+
+static struct {
+	target *t;
+	target_addr_t addr;
+	size_t len;
+	uint8_t data[GDB_WRITE_COMBINE_SIZE];
+} gdb_write_combine;
+/*
+ * Non-stop mode: the target is resumed with vCont, GDB carries on issuing packets
+ * (like memory reads) while it runs and the halt is sent as a %Stop notification.
+ */
+static bool gdb_non_stop = false;
+static bool gdb_target_running = false;
+static bool gdb_stop_requested = false;
+
+#define GDB_MAX_THREADS 8U
+
+/*
+ * The cores of one device (see target_group()) are attached together and shown
+ * to GDB as the threads of one process, numbered from 1 in target list order.
+ * cur_target is the core GDB attached to and keeps flash, reset and monitor
+ * commands, Hg picks the thread for register and memory access and Hc the one
+ * that steps. Each driver keeps its own core's registers, so switching thread
+ * costs nothing. When one thread stops the others are stopped too.
+ */
+static target *gdb_threads[GDB_MAX_THREADS];
+static bool gdb_thread_running[GDB_MAX_THREADS];
+static size_t gdb_thread_count;
+static size_t gdb_thread_general;
+static size_t gdb_thread_step;
+/* Thread the last stop was reported for */
+static size_t gdb_thread_event;
+/* Non-stop mode: threads stopped along with the event thread, reported on vStopped */
+static uint32_t gdb_thread_stop_pending;
+/*
+ * The RTOS tasks not running on a core follow the cores as threads, known to
+ * GDB by their TCB address (see rtos.h). Hg to one of those has its registers
+ * read from its stack, it is the TCB here and 0 when Hg picked a core.
+ */
+static uint32_t gdb_thread_task;
+/* The next task for qsThreadInfo to list */
+static size_t gdb_thread_info_task;
+
+#if PC_HOSTED == 1
+/*
+ * With a port per target (see gdb_if_listen_targets()) each port is a session
+ * of its own, whose copy of the state above is kept here while another session
+ * is served. A target resumed in all-stop mode then doesn't hold up the others:
+ * the stop reply is owed to the client that resumed it, and gdb_sessions_poll()
+ * sends it once the target halts.
+ */
+typedef struct gdb_session {
+	target *cur_target;
+	target *last_target;
+	bool needs_detach_notify;
+	bool flash_write_failed;
+	bool non_stop;
+	bool target_running;
+	bool stop_requested;
+	uint32_t stop_client;
+	target *threads[GDB_MAX_THREADS];
+	bool thread_running[GDB_MAX_THREADS];
+	size_t thread_count;
+	size_t thread_general;
+	size_t thread_step;
+	size_t thread_event;
+	uint32_t thread_stop_pending;
+	uint32_t thread_task;
+} gdb_session_s;
+
+static gdb_session_s gdb_sessions[GDB_IF_MAX_TARGET_PORTS + 1U];
+/* The session whose state is the one above */
+static uint32_t gdb_session;
+/* The client owed an all-stop stop reply by gdb_sessions_poll(), 0 for none */
+static uint32_t gdb_stop_client;
+
+static void gdb_sessions_forget(target *t);
+#endif
 
 static void handle_q_packet(char *packet, size_t len);
 static void handle_v_packet(char *packet, size_t len);
 static void handle_z_packet(char *packet, size_t len);
 static void handle_kill_target(void);
 
+/* Drop a thread whose target went away, falling back to cur_target's thread */
+static void gdb_thread_forget(target *const t)
+{
+	for (size_t i = 0; i < gdb_thread_count; ++i) {
+		if (gdb_threads[i] != t)
+			continue;
+		--gdb_thread_count;
+		memmove(gdb_threads + i, gdb_threads + i + 1U, (gdb_thread_count - i) * sizeof(*gdb_threads));
+		memmove(gdb_thread_running + i, gdb_thread_running + i + 1U,
+			(gdb_thread_count - i) * sizeof(*gdb_thread_running));
+		gdb_thread_stop_pending = 0;
+		for (size_t j = 0; j < gdb_thread_count; ++j) {
+			if (gdb_threads[j] == cur_target) {
+				gdb_thread_general = j;
+				gdb_thread_step = j;
+				gdb_thread_event = j;
+			}
+		}
+		return;
+	}
+}
+
 static void gdb_target_destroy_callback(struct target_controller *tc, target *t)
 {
 	(void)tc;
 	if (cur_target == t) {
-		gdb_put_notificationz("%Stop:W00");
+		gdb_put_notificationz("Stop:W00");
+		gdb_target_running = false;
 		gdb_out("You are now detached from the previous target.\n");
 		cur_target = NULL;
+		gdb_thread_count = 0;
 		gdb_needs_detach_notify = true;
-	}
+	} else
+		gdb_thread_forget(t);
 
 	if (last_target == t)
 		last_target = NULL;
+	if (gdb_write_combine.t == t)
+		gdb_write_combine.len = 0;
+#if PC_HOSTED == 1
+	gdb_sessions_forget(t);
+#endif
 }
 
 static void gdb_target_printf(struct target_controller *tc,
@@ -113,24 +240,524 @@ static struct target_controller gdb_controller = {
 	.system = hostio_system,
 };
 
+/* Thread for register and memory access */
+static target *gdb_thread_target(void)
+{
+	return gdb_thread_count ? gdb_threads[gdb_thread_general] : cur_target;
+}
+
+/* Attach the other cores of cur_target's device as its threads */
+static void gdb_threads_attach(void)
+{
+	target *cores[GDB_MAX_THREADS];
+	const size_t count = target_group(cur_target, cores, GDB_MAX_THREADS);
+	gdb_thread_count = 0;
+	gdb_thread_general = 0;
+	for (size_t i = 0; i < count; ++i) {
+		if (cores[i] == cur_target)
+			gdb_thread_general = gdb_thread_count;
+		else if (!target_attach(cores[i], &gdb_controller))
+			continue;
+		gdb_thread_running[gdb_thread_count] = false;
+		gdb_threads[gdb_thread_count++] = cores[i];
+	}
+	/* A device with more cores than that still gets cur_target as a thread */
+	if (gdb_threads[gdb_thread_general] != cur_target) {
+		gdb_thread_general = gdb_thread_count < GDB_MAX_THREADS ? gdb_thread_count++ : 0;
+		gdb_threads[gdb_thread_general] = cur_target;
+		gdb_thread_running[gdb_thread_general] = false;
+	}
+	gdb_thread_step = gdb_thread_general;
+	gdb_thread_event = gdb_thread_general;
+	gdb_thread_stop_pending = 0;
+	gdb_thread_task = 0;
+	rtos_invalidate();
+}
+
+static target *gdb_attach(target *const t)
+{
+	cur_target = target_attach(t, &gdb_controller);
+	if (cur_target) {
+		gdb_threads_attach();
+#ifdef PLATFORM_HAS_SETTINGS
+		autoattach_remember(cur_target);
+#endif
+	}
+	return cur_target;
+}
+
+/* Detach the threads other than cur_target, which the caller deals with */
+static void gdb_threads_detach(void)
+{
+	for (size_t i = 0; i < gdb_thread_count; ++i) {
+		if (gdb_threads[i] != cur_target)
+			target_detach(gdb_threads[i]);
+	}
+	gdb_thread_count = 0;
+	gdb_thread_stop_pending = 0;
+}
+
+/* Thread index for a GDB thread id, -1 for all threads and -2 if there is no such thread */
+static int gdb_thread_index(const uint32_t thread_id)
+{
+	if (thread_id == UINT32_MAX)
+		return -1;
+	if (thread_id == 0 || thread_id > gdb_thread_count)
+		return -2;
+	return (int)thread_id - 1;
+}
+
+/* Is the GDB thread id that of an RTOS task */
+static bool gdb_thread_is_task(const uint32_t thread_id)
+{
+	return cur_target && thread_id > gdb_thread_count && thread_id != UINT32_MAX &&
+		rtos_task_find(cur_target, thread_id);
+}
+
+static void gdb_thread_resume(const size_t thread, const bool step)
+{
+	if (gdb_thread_running[thread])
+		return;
+	target_halt_resume(gdb_threads[thread], step);
+	gdb_thread_running[thread] = true;
+	gdb_thread_stop_pending &= ~(1U << thread);
+	/* The tasks will have moved on, GDB asks for them again after the stop */
+	gdb_thread_task = 0;
+	rtos_invalidate();
+}
+
+/* Resume all threads, or single step the Hc one leaving the others halted */
+static void gdb_threads_resume(const bool step)
+{
+	if (step) {
+		gdb_thread_resume(gdb_thread_step, true);
+		return;
+	}
+	for (size_t i = 0; i < gdb_thread_count; ++i)
+		gdb_thread_resume(i, false);
+}
+
+static void gdb_threads_halt_request(void)
+{
+	for (size_t i = 0; i < gdb_thread_count; ++i) {
+		if (gdb_thread_running[i])
+			target_halt_request(gdb_threads[i]);
+	}
+}
+
+static bool gdb_threads_running(void)
+{
+	for (size_t i = 0; i < gdb_thread_count; ++i) {
+		if (gdb_thread_running[i])
+			return true;
+	}
+	return false;
+}
+
+/* Sends the stop reply for reason, as a %Stop notification in non-stop mode */
+static void gdb_put_stop_reply(const enum target_halt_reason reason, const target_addr_t watch, const bool notify)
+{
+	char reply[48];
+	/* Non-stop GDB tracks threads, as does GDB on a device with several, so tell it which one stopped */
+	char thread[24] = "";
+	if (gdb_non_stop || gdb_thread_count > 1U)
+		snprintf(thread, sizeof(thread), "thread:%x;", (unsigned)gdb_thread_event + 1U);
+	switch (reason) {
+	case TARGET_HALT_ERROR:
+		snprintf(reply, sizeof(reply), "%sX%02X", notify ? "Stop:" : "", GDB_SIGLOST);
+		morse("TARGET LOST.", true);
+		break;
+	case TARGET_HALT_REQUEST:
+		/* A vCont;t stop must be reported with signal 0 */
+		snprintf(reply, sizeof(reply), "%sT%02X%s", notify ? "Stop:" : "",
+			gdb_stop_requested ? GDB_SIGNONE : GDB_SIGINT, thread);
+		break;
+	case TARGET_HALT_WATCHPOINT:
+		snprintf(reply, sizeof(reply), "%sT%02Xwatch:%08" PRIX32 ";%s", notify ? "Stop:" : "", GDB_SIGTRAP,
+			(uint32_t)watch, thread);
+		break;
+	case TARGET_HALT_FAULT:
+		snprintf(reply, sizeof(reply), "%sT%02X%s", notify ? "Stop:" : "", GDB_SIGSEGV, thread);
+		break;
+	default:
+		snprintf(reply, sizeof(reply), "%sT%02X%s", notify ? "Stop:" : "", GDB_SIGTRAP, thread);
+	}
+	gdb_stop_requested = false;
+	if (notify)
+		gdb_put_notificationz(reply);
+	else
+		gdb_putpacketz(reply);
+}
+
+#ifdef ENABLE_RTT
+static uint32_t gdb_rtt_task(void)
+{
+	return poll_rtt(cur_target);
+}
+
+static uint32_t gdb_sample_task(void)
+{
+	return poll_sample(cur_target);
+}
+#endif
+
+/*
+ * Poll a thread for a halt, leaving out the target stopping on an RTT watchpoint, which only wants
+ * servicing, and on a breakpoint whose conditions are all false, which is stepped over and resumed here
+ */
+static enum target_halt_reason gdb_thread_halt_poll(target *const t, target_addr_t *const watch)
+{
+	const enum target_halt_reason reason = target_halt_poll(t, watch);
+#ifdef ENABLE_RTT
+	if (reason == TARGET_HALT_WATCHPOINT && rtt_watch_hit(t, *watch))
+		return TARGET_HALT_RUNNING;
+#endif
+	uint32_t pc;
+	/* The PC is register 15 in the Cortex-M/A GDB register maps */
+	if (reason == TARGET_HALT_BREAKPOINT && target_reg_read(t, 15, &pc, sizeof(pc)) == sizeof(pc) &&
+		!gdb_agent_should_stop(t, pc))
+		return gdb_agent_resume(t, pc);
+	return reason;
+}
+
+/* Stop the threads still running after another one halted */
+static void gdb_threads_stop_others(void)
+{
+	for (size_t i = 0; i < gdb_thread_count; ++i) {
+		if (!gdb_thread_running[i])
+			continue;
+		target_halt_request(gdb_threads[i]);
+		platform_timeout timeout;
+		platform_timeout_set(&timeout, 500);
+		target_addr_t watch;
+		while (target_halt_poll(gdb_threads[i], &watch) == TARGET_HALT_RUNNING &&
+			!platform_timeout_is_expired(&timeout))
+			continue;
+		gdb_thread_running[i] = false;
+		if (gdb_non_stop)
+			gdb_thread_stop_pending |= 1U << i;
+	}
+}
+
+/* Poll the running threads, the first to halt becomes the event thread and the rest are stopped */
+static enum target_halt_reason gdb_halt_poll(target_addr_t *const watch)
+{
+	/* With everything halted already, ask the thread that last stopped again */
+	if (!gdb_threads_running() && gdb_thread_count)
+		gdb_thread_running[gdb_thread_event] = true;
+	for (size_t i = 0; i < gdb_thread_count; ++i) {
+		if (!gdb_thread_running[i])
+			continue;
+		const enum target_halt_reason reason = gdb_thread_halt_poll(gdb_threads[i], watch);
+		if (reason == TARGET_HALT_RUNNING)
+			continue;
+		gdb_thread_running[i] = false;
+		gdb_thread_event = i;
+		gdb_threads_stop_others();
+		return reason;
+	}
+	return TARGET_HALT_RUNNING;
+}
+
+/* Wait for the target to halt, servicing Ctrl-C and RTT meanwhile */
+static enum target_halt_reason gdb_wait_for_halt(target_addr_t *const watch)
+{
+	enum target_halt_reason reason;
+	while (!(reason = gdb_halt_poll(watch))) {
+		char c = (char)gdb_getchar_to(0);
+		if(c == '\x03' || c == '\x04')
+			gdb_threads_halt_request();
+		platform_pace_poll();
+		scheduler_run();
+	}
+	SET_RUN_STATE(0);
+	return reason;
+}
+
+/*
+ * In non-stop mode, keep polling the running target between packets and send the
+ * %Stop notification when it halts. Returns as soon as GDB has sent something.
+ */
+static void gdb_poll_running_target(void)
+{
+	while (gdb_target_running) {
+		if (!cur_target) {
+			gdb_target_running = false;
+			break;
+		}
+		if (gdb_packet_available(0))
+			break;
+		target_addr_t watch;
+		const enum target_halt_reason reason = gdb_halt_poll(&watch);
+		if (reason != TARGET_HALT_RUNNING) {
+			gdb_target_running = false;
+			SET_RUN_STATE(0);
+			gdb_put_stop_reply(reason, watch, true);
+			break;
+		}
+		platform_pace_poll();
+		scheduler_run();
+	}
+}
+
+/* Writes out what is held back, returning non-zero if that failed as target_mem_write does */
+static int gdb_write_flush(void)
+{
+	if (!gdb_write_combine.len)
+		return 0;
+	const size_t len = gdb_write_combine.len;
+	gdb_write_combine.len = 0;
+	return target_mem_write(gdb_write_combine.t, gdb_write_combine.addr, gdb_write_combine.data, len);
+}
+
+/* target_mem_write for M and X packets, adding to the held back writes where it can */
+static int gdb_mem_write(target *const t, const target_addr_t addr, const void *const data, const size_t len)
+{
+	const bool combine = len <= GDB_WRITE_COMBINE_SIZE && !gdb_threads_running() && target_mem_is_ram(t, addr, len);
+	/* The write may be to the kernel's task lists */
+	rtos_invalidate();
+	/* A write that doesn't carry on from the last sends that first */
+	if (gdb_write_combine.len &&
+		(!combine || gdb_write_combine.t != t || addr != gdb_write_combine.addr + gdb_write_combine.len ||
+			gdb_write_combine.len + len > GDB_WRITE_COMBINE_SIZE) &&
+		gdb_write_flush())
+		return -1;
+	if (!combine)
+		return target_mem_write(t, addr, data, len);
+	if (!gdb_write_combine.len) {
+		gdb_write_combine.t = t;
+		gdb_write_combine.addr = addr;
+	}
+	memcpy(gdb_write_combine.data + gdb_write_combine.len, data, len);
+	gdb_write_combine.len += len;
+	return 0;
+}
+
+/*
+ * Sends the held back writes ahead of any packet but another write. Those were
+ * acknowledged already, so if they fail a read or resume that follows is
+ * answered with the error in place of what could otherwise act on bad memory.
+ */
+static bool gdb_write_flush_before(const char *const packet)
+{
+	if (packet[0] == 'M' || packet[0] == 'X' || !gdb_write_flush())
+		return true;
+	DEBUG_WARN("Held back memory write failed\n");
+	return !strchr("mxcs", packet[0]) && strncmp(packet, "vCont;", 6U) != 0;
+}
+
+#if PC_HOSTED == 1
+static void gdb_session_save(gdb_session_s *const session)
+{
+	session->cur_target = cur_target;
+	session->last_target = last_target;
+	session->needs_detach_notify = gdb_needs_detach_notify;
+	session->flash_write_failed = gdb_flash_write_failed;
+	session->non_stop = gdb_non_stop;
+	session->target_running = gdb_target_running;
+	session->stop_requested = gdb_stop_requested;
+	session->stop_client = gdb_stop_client;
+	memcpy(session->threads, gdb_threads, sizeof(gdb_threads));
+	memcpy(session->thread_running, gdb_thread_running, sizeof(gdb_thread_running));
+	session->thread_count = gdb_thread_count;
+	session->thread_general = gdb_thread_general;
+	session->thread_step = gdb_thread_step;
+	session->thread_event = gdb_thread_event;
+	session->thread_stop_pending = gdb_thread_stop_pending;
+	session->thread_task = gdb_thread_task;
+}
+
+static void gdb_session_load(const gdb_session_s *const session)
+{
+	cur_target = session->cur_target;
+	last_target = session->last_target;
+	gdb_needs_detach_notify = session->needs_detach_notify;
+	gdb_flash_write_failed = session->flash_write_failed;
+	gdb_non_stop = session->non_stop;
+	gdb_target_running = session->target_running;
+	gdb_stop_requested = session->stop_requested;
+	gdb_stop_client = session->stop_client;
+	memcpy(gdb_threads, session->threads, sizeof(gdb_threads));
+	memcpy(gdb_thread_running, session->thread_running, sizeof(gdb_thread_running));
+	gdb_thread_count = session->thread_count;
+	gdb_thread_general = session->thread_general;
+	gdb_thread_step = session->thread_step;
+	gdb_thread_event = session->thread_event;
+	gdb_thread_stop_pending = session->thread_stop_pending;
+	gdb_thread_task = session->thread_task;
+}
+
+static void gdb_session_enter(const uint32_t session)
+{
+	if (session == gdb_session)
+		return;
+	gdb_session_save(&gdb_sessions[gdb_session]);
+	gdb_session_load(&gdb_sessions[session]);
+	gdb_session = session;
+}
+
+/* A target going away is dropped from the sessions not being served too */
+static void gdb_sessions_forget(target *const t)
+{
+	const uint32_t current = gdb_session;
+	for (uint32_t i = 0; i < gdb_if_sessions(); ++i) {
+		const gdb_session_s *const session = &gdb_sessions[i];
+		bool uses = session->cur_target == t || session->last_target == t;
+		for (size_t j = 0; j < session->thread_count; ++j)
+			uses |= session->threads[j] == t;
+		if (i == current || !uses)
+			continue;
+		gdb_session_enter(i);
+		if (cur_target == t) {
+			cur_target = NULL;
+			gdb_thread_count = 0;
+			gdb_target_running = false;
+			gdb_needs_detach_notify = true;
+		} else
+			gdb_thread_forget(t);
+		if (last_target == t)
+			last_target = NULL;
+	}
+	gdb_session_enter(current);
+}
+
+/* Follows the client a packet came from to its session, a new client of a target port starting attached */
+static void gdb_session_switch(void)
+{
+	bool fresh;
+	const uint32_t session = gdb_if_session(&fresh);
+	gdb_session_enter(session);
+	if (fresh && session && !cur_target) {
+		cur_target = target_attach_n(session, &gdb_controller);
+		if (cur_target)
+			gdb_threads_attach();
+	}
+}
+
+/* With sessions, leave reporting the halt of a resumed all-stop target to gdb_sessions_poll() */
+static bool gdb_session_defer_halt(void)
+{
+	if (gdb_if_sessions() < 2U || gdb_non_stop)
+		return false;
+	gdb_target_running = true;
+	gdb_stop_client = gdb_if_client();
+	return true;
+}
+
+/*
+ * Polls the running targets of every session, sending each stop reply or
+ * notification to its session's client, until there are none left running or
+ * any client has sent something.
+ */
+static void gdb_sessions_poll(void)
+{
+	while (!gdb_packet_buffered()) {
+		bool running = false;
+		for (uint32_t i = 0; i < gdb_if_sessions(); ++i) {
+			if (!(i == gdb_session ? gdb_target_running : gdb_sessions[i].target_running))
+				continue;
+			gdb_session_enter(i);
+			/* Nobody is left to tell about the stop, let it run */
+			if (!cur_target || !gdb_if_client_select(gdb_non_stop ? 0 : gdb_stop_client, i)) {
+				gdb_target_running = false;
+				continue;
+			}
+			running = true;
+			/* Clear while polling, a semihosting call handled in there has the target halted */
+			gdb_target_running = false;
+			target_addr_t watch;
+			const enum target_halt_reason reason = gdb_halt_poll(&watch);
+			if (reason == TARGET_HALT_RUNNING) {
+				gdb_target_running = true;
+				continue;
+			}
+			SET_RUN_STATE(0);
+			gdb_put_stop_reply(reason, watch, gdb_non_stop);
+		}
+		if (!running || gdb_if_ready())
+			break;
+		platform_pace_poll();
+		scheduler_run();
+	}
+}
+#endif
+
+/*
+ * The registers of the Hg task. A task not running has r0-r15 and xPSR on its
+ * stack, the rest of the register map is sent as unavailable.
+ */
+static void gdb_put_task_regs(void)
+{
+	uint32_t regs[RTOS_TASK_REGS];
+	if (!rtos_task_regs(cur_target, gdb_thread_task, regs)) {
+		gdb_putpacketz("E01");
+		return;
+	}
+	const size_t size = MAX(target_regs_size(cur_target), sizeof(regs));
+	hexify(pbuf, regs, sizeof(regs));
+	memset(pbuf + sizeof(regs) * 2U, 'x', (size - sizeof(regs)) * 2U);
+	gdb_putpacket(pbuf, size * 2U);
+}
+
+/* One register of the Hg task, size bytes long as on the core */
+static void gdb_put_task_reg(const uint32_t reg, const size_t size)
+{
+	uint32_t regs[RTOS_TASK_REGS];
+	if (!rtos_task_regs(cur_target, gdb_thread_task, regs)) {
+		gdb_putpacketz("EFF");
+		return;
+	}
+	char reply[16];
+	if (reg < RTOS_TASK_REGS && size == sizeof(regs[reg]))
+		hexify(reply, &regs[reg], sizeof(regs[reg]));
+	else
+		memset(reply, 'x', MIN(size, 8U) * 2U);
+	gdb_putpacket(reply, MIN(size, 8U) * 2U);
+}
+
 int gdb_main_loop(struct target_controller *tc, bool in_syscall)
 {
 	bool single_step = false;
 
+#if PC_HOSTED == 1
+	/* The reply to a semihosting call comes from the client of the session that made it */
+	const bool pinned = gdb_if_pin(in_syscall);
+#endif
+
 	/* GDB protocol main loop */
 	while (1) {
 		SET_IDLE_STATE(1);
+#if PC_HOSTED == 1
+		if (gdb_if_sessions() > 1U && !in_syscall)
+			gdb_sessions_poll();
+		else
+#endif
+			gdb_poll_running_target();
 		size_t size = gdb_getpacket(pbuf, BUF_SIZE);
+#if PC_HOSTED == 1
+		if (!in_syscall)
+			gdb_session_switch();
+#endif
 		// If port closed and target detached, stay idle
 		if ((pbuf[0] != 0x04) || cur_target) {
 			SET_IDLE_STATE(0);
 		}
+		stats_packet_begin(pbuf, size);
+		if (!gdb_write_flush_before(pbuf)) {
+			gdb_putpacketz("E01");
+			stats_packet_end();
+			continue;
+		}
 		switch(pbuf[0]) {
 		/* Implementation of these is mandatory! */
 		case 'g': { /* 'g': Read general registers */
 			ERROR_IF_NO_TARGET();
-			uint8_t gp_regs[target_regs_size(cur_target)];
-			target_regs_read(cur_target, gp_regs);
+			if (gdb_thread_task) {
+				gdb_put_task_regs();
+				break;
+			}
+			uint8_t gp_regs[target_regs_size(gdb_thread_target())];
+			target_regs_read(gdb_thread_target(), gp_regs);
 			gdb_putpacket(hexify(pbuf, gp_regs, sizeof(gp_regs)), sizeof(gp_regs) * 2U);
 			break;
 		}
@@ -144,18 +771,44 @@ int gdb_main_loop(struct target_controller *tc, bool in_syscall)
 			}
 			DEBUG_GDB("m packet: addr = %" PRIx32 ", len = %" PRIx32 "\n",
 					  addr, len);
-			uint8_t mem[len];
-			if (target_mem_read(cur_target, mem, addr, len))
+			/*
+			 * Read into the top half of pbuf and hexify downwards in place,
+			 * each output pair only ever overwrites bytes already consumed.
+			 */
+			uint8_t *const mem = (uint8_t *)pbuf + (sizeof(pbuf) - 1U) - len;
+			if (target_mem_read(gdb_thread_target(), mem, addr, len))
 				gdb_putpacketz("E01");
 			else
-				gdb_putpacket(hexify(pbuf, mem, len), len * 2U);
+				gdb_putpacket(hexify(pbuf + (sizeof(pbuf) - 1U) - 2U * len, mem, len), len * 2U);
+			break;
+		}
+		case 'x': {	/* 'x addr,len': Read len bytes from addr as binary */
+			uint32_t addr, len;
+			ERROR_IF_NO_TARGET();
+			sscanf(pbuf, "x%" SCNx32 ",%" SCNx32, &addr, &len);
+			if (len > BUF_SIZE) {
+				gdb_putpacketz("E02");
+				break;
+			}
+			DEBUG_GDB("x packet: addr = %" PRIx32 ", len = %" PRIx32 "\n",
+					  addr, len);
+			/* The reply is escaped on the way out by gdb_putpacket2, so read straight into pbuf */
+			if (target_mem_read(gdb_thread_target(), pbuf, addr, len))
+				gdb_putpacketz("E01");
+			else
+				gdb_putpacket2("b", 1U, pbuf, len);
 			break;
 		}
 		case 'G': {	/* 'G XX': Write general registers */
 			ERROR_IF_NO_TARGET();
-			uint8_t gp_regs[target_regs_size(cur_target)];
+			/* The registers of a task not running are only ever read */
+			if (gdb_thread_task) {
+				gdb_putpacketz("E01");
+				break;
+			}
+			uint8_t gp_regs[target_regs_size(gdb_thread_target())];
 			unhexify(gp_regs, &pbuf[1], sizeof(gp_regs));
-			target_regs_write(cur_target, gp_regs);
+			target_regs_write(gdb_thread_target(), gp_regs);
 			gdb_putpacketz("OK");
 			break;
 		}
@@ -171,22 +824,44 @@ int gdb_main_loop(struct target_controller *tc, bool in_syscall)
 			}
 			DEBUG_GDB("M packet: addr = %" PRIx32 ", len = %" PRIx32 "\n",
 					  addr, len);
-			uint8_t mem[len];
+			/* Unhexify in place, the decoded data never overtakes the hex digits being read */
+			uint8_t *const mem = (uint8_t *)pbuf + hex;
 			unhexify(mem, pbuf + hex, len);
-			if (target_mem_write(cur_target, addr, mem, len))
+			if (gdb_mem_write(gdb_thread_target(), addr, mem, len))
 				gdb_putpacketz("E01");
 			else
 				gdb_putpacketz("OK");
 			break;
 		}
-		/* '[m|M|g|G|c][thread-id]' : Set the thread ID for the given subsequent operation
-		 * (we don't actually care which as we only care about the TID for whether to send OK or an error)
+		/* 'H[g|c][thread-id]' : Set the thread for register and memory access or for stepping,
+		 * 0 (any thread) and -1 (all threads) leave the choice as it is
 		 */
 		case 'H': {
 			char operation = 0;
 			uint32_t thread_id = 0;
 			sscanf(pbuf, "H%c%" SCNx32, &operation, &thread_id);
-			if (thread_id <= 1)
+			/* A task can be looked at but not stepped on its own */
+			if (operation == 'g' && gdb_thread_is_task(thread_id)) {
+				gdb_thread_task = thread_id;
+				gdb_putpacketz("OK");
+				break;
+			}
+			const int thread = gdb_thread_index(thread_id);
+			if (thread >= 0 && operation == 'g') {
+				gdb_thread_general = (size_t)thread;
+				gdb_thread_task = 0;
+			} else if (thread >= 0 && operation == 'c')
+				gdb_thread_step = (size_t)thread;
+			if (thread != -2 || thread_id == 0 || (!gdb_thread_count && thread_id == 1))
+				gdb_putpacketz("OK");
+			else
+				gdb_putpacketz("E01");
+			break;
+		}
+		case 'T': { /* 'T thread-id': Is the thread alive */
+			uint32_t thread_id = 0;
+			sscanf(pbuf, "T%" SCNx32, &thread_id);
+			if (gdb_thread_index(thread_id) >= 0 || gdb_thread_is_task(thread_id))
 				gdb_putpacketz("OK");
 			else
 				gdb_putpacketz("E01");
@@ -201,15 +876,18 @@ int gdb_main_loop(struct target_controller *tc, bool in_syscall)
 				break;
 			}
 
-			target_halt_resume(cur_target, single_step);
+			gdb_threads_resume(single_step);
 			SET_RUN_STATE(1);
 			single_step = false;
+#if PC_HOSTED == 1
+			if (gdb_session_defer_halt())
+				break;
+#endif
 			/* fall through */
 		case '?': {	/* '?': Request reason for target halt */
 			/* This packet isn't documented as being mandatory,
 			 * but GDB doesn't work without it. */
-			target_addr_t watch;
-			enum target_halt_reason reason;
+			target_addr_t watch = 0;
 
 			if (!cur_target) {
 				/* Report "target exited" if no target */
@@ -217,37 +895,15 @@ int gdb_main_loop(struct target_controller *tc, bool in_syscall)
 				break;
 			}
 
-			/* Wait for target halt */
-			while(!(reason = target_halt_poll(cur_target, &watch))) {
-				char c = (char)gdb_if_getchar_to(0);
-				if(c == '\x03' || c == '\x04')
-					target_halt_request(cur_target);
-				platform_pace_poll();
-				#ifdef ENABLE_RTT
-				if (rtt_enabled)
-					poll_rtt(cur_target);
-				#endif
-			}
-			SET_RUN_STATE(0);
-
-			/* Translate reason to GDB signal */
-			switch (reason) {
-			case TARGET_HALT_ERROR:
-				gdb_putpacket_f("X%02X", GDB_SIGLOST);
-				morse("TARGET LOST.", true);
-				break;
-			case TARGET_HALT_REQUEST:
-				gdb_putpacket_f("T%02X", GDB_SIGINT);
-				break;
-			case TARGET_HALT_WATCHPOINT:
-				gdb_putpacket_f("T%02Xwatch:%08X;", GDB_SIGTRAP, watch);
-				break;
-			case TARGET_HALT_FAULT:
-				gdb_putpacket_f("T%02X", GDB_SIGSEGV);
+			/* In non-stop mode a running target has nothing to report yet */
+			if (gdb_non_stop && gdb_target_running) {
+				gdb_putpacketz("OK");
 				break;
-			default:
-				gdb_putpacket_f("T%02X", GDB_SIGTRAP);
 			}
+
+			/* Wait for target halt and translate reason to GDB signal */
+			const enum target_halt_reason reason = gdb_wait_for_halt(&watch);
+			gdb_put_stop_reply(reason, watch, false);
 			break;
 		}
 
@@ -257,8 +913,10 @@ int gdb_main_loop(struct target_controller *tc, bool in_syscall)
 			uint32_t reg;
 			sscanf(pbuf, "p%" SCNx32, &reg);
 			uint8_t val[8];
-			size_t s = target_reg_read(cur_target, reg, val, sizeof(val));
-			if (s > 0)
+			size_t s = target_reg_read(gdb_thread_target(), reg, val, sizeof(val));
+			if (gdb_thread_task && s > 0)
+				gdb_put_task_reg(reg, s);
+			else if (s > 0)
 				gdb_putpacket(hexify(pbuf, val, s), s * 2);
 			else
 				gdb_putpacketz("EFF");
@@ -272,7 +930,7 @@ int gdb_main_loop(struct target_controller *tc, bool in_syscall)
 			// TODO: FIXME, VLAs considered harmful.
 			uint8_t val[strlen(&pbuf[n]) / 2];
 			unhexify(val, pbuf + n, sizeof(val));
-			if (target_reg_write(cur_target, reg, val, sizeof(val)) > 0)
+			if (!gdb_thread_task && target_reg_write(gdb_thread_target(), reg, val, sizeof(val)) > 0)
 				gdb_putpacketz("OK");
 			else
 				gdb_putpacketz("EFF");
@@ -280,9 +938,13 @@ int gdb_main_loop(struct target_controller *tc, bool in_syscall)
 		}
 
 		case 'F':	/* Semihosting call finished */
-			if (in_syscall)
+			if (in_syscall) {
+				stats_packet_end();
+#if PC_HOSTED == 1
+				gdb_if_pin(pinned);
+#endif
 				return hostio_reply(tc, pbuf, size);
-			else {
+			} else {
 				DEBUG_GDB("*** F packet when not in syscall! '%s'\n", pbuf);
 				gdb_putpacketz("");
 			}
@@ -296,11 +958,19 @@ int gdb_main_loop(struct target_controller *tc, bool in_syscall)
 			gdb_putpacketz("OK");
 			break;
 
+		case 0x03: /* Ctrl-C for a target left running, see gdb_session_defer_halt() */
+			if (gdb_target_running)
+				gdb_threads_halt_request();
+			break;
+
 		case 0x04:
 		case 'D':	/* GDB 'detach' command. */
+			gdb_target_running = false;
 			if(cur_target) {
 				SET_RUN_STATE(1);
+				gdb_threads_detach();
 				target_detach(cur_target);
+				gdb_agent_cond_clear_all();
 				last_target = cur_target;
 				cur_target = NULL;
 			}
@@ -317,7 +987,7 @@ int gdb_main_loop(struct target_controller *tc, bool in_syscall)
 			if (cur_target)
 				target_reset(cur_target);
 			else if (last_target) {
-				cur_target = target_attach(last_target, &gdb_controller);
+				gdb_attach(last_target);
 				if (cur_target)
 					morse(NULL, false);
 				target_reset(cur_target);
@@ -335,7 +1005,7 @@ int gdb_main_loop(struct target_controller *tc, bool in_syscall)
 			}
 			DEBUG_GDB("X packet: addr = %" PRIx32 ", len = %" PRIx32 "\n",
 					  addr, len);
-			if (target_mem_write(cur_target, addr, pbuf + bin, len))
+			if (gdb_mem_write(gdb_thread_target(), addr, pbuf + bin, len))
 				gdb_putpacketz("E01");
 			else
 				gdb_putpacketz("OK");
@@ -343,6 +1013,7 @@ int gdb_main_loop(struct target_controller *tc, bool in_syscall)
 		}
 
 		case 'q':	/* General query packet */
+		case 'Q':	/* General set packet */
 			handle_q_packet(pbuf, size);
 			break;
 
@@ -361,6 +1032,7 @@ int gdb_main_loop(struct target_controller *tc, bool in_syscall)
 			DEBUG_GDB("*** Unsupported packet: %s\n", pbuf);
 			gdb_putpacketz("");
 		}
+		stats_packet_end();
 	}
 }
 
@@ -426,7 +1098,16 @@ static void exec_q_supported(const char *packet, const size_t length)
 {
 	(void)packet;
 	(void)length;
-	gdb_putpacket_f("PacketSize=%X;qXfer:memory-map:read+;qXfer:features:read+", BUF_SIZE);
+#ifdef PLATFORM_HAS_SETTINGS
+	/* A new GDB connection with nothing scanned yet, go back to the target of the last session */
+	if (!cur_target && !last_target && autoattach_enabled()) {
+		target *const t = autoattach_scan();
+		if (t && gdb_attach(t))
+			morse(NULL, false);
+	}
+#endif
+	gdb_putpacket_f("PacketSize=%X;qXfer:memory-map:read+;qXfer:features:read+;binary-upload+;QNonStop+;"
+		"ConditionalBreakpoints+", BUF_SIZE);
 }
 
 static void exec_q_memory_map(const char *packet, const size_t length)
@@ -436,16 +1117,18 @@ static void exec_q_memory_map(const char *packet, const size_t length)
 	/* Read target XML memory map */
 	if ((!cur_target) && last_target) {
 		/* Attach to last target if detached. */
-		cur_target = target_attach(last_target,
-				   &gdb_controller);
+		gdb_attach(last_target);
 	}
 	if (!cur_target) {
 		gdb_putpacketz("E01");
 		return;
 	}
-	char buf[1024];
-	target_mem_map(cur_target, buf, sizeof(buf)); /* Fixme: Check size!*/
-	handle_q_string_reply(buf, packet);
+	const char *const map = target_mem_map(cur_target);
+	if (!map) {
+		gdb_putpacketz("E01");
+		return;
+	}
+	handle_q_string_reply(map, packet);
 }
 
 static void exec_q_feature_read(const char *packet, const size_t length)
@@ -454,7 +1137,7 @@ static void exec_q_feature_read(const char *packet, const size_t length)
 	/* Read target description */
 	if ((!cur_target) && last_target) {
 	  /* Attach to last target if detached. */
-	  cur_target = target_attach(last_target, &gdb_controller);
+	  gdb_attach(last_target);
 	}
 	if (!cur_target) {
 	  gdb_putpacketz("E01");
@@ -474,7 +1157,7 @@ static void exec_q_crc(const char *packet, const size_t length)
 			return;
 		}
 		uint32_t crc;
-		if (generic_crc32(cur_target, &crc, addr, addr_length))
+		if (generic_crc32(gdb_thread_target(), &crc, addr, addr_length))
 			gdb_putpacketz("E03");
 		else
 			gdb_putpacket_f("C%lx", crc);
@@ -482,30 +1165,170 @@ static void exec_q_crc(const char *packet, const size_t length)
 }
 
 /*
- * qC queries are for the current thread. We don't support threads but GDB 11 and 12 require this,
- * so we always answer that the current thread is thread 1.
+ * qC queries are for the current thread. GDB 11 and 12 require this even with a single core,
+ * which is then always thread 1.
  */
 static void exec_q_c(const char *packet, const size_t length)
 {
 	(void)packet;
 	(void)length;
-	gdb_putpacketz("QC1");
+	gdb_putpacket_f("QC%x", (unsigned)gdb_thread_general + 1U);
 }
 
 /*
  * qfThreadInfo queries are required in GDB 11 and 12 as these GDBs require the server to support
- * threading even when there's only the possiblity for one thread to exist. In this instance,
- * we have to tell GDB that there is a single active thread so it doesn't think the "thread" died.
- * qsThreadInfo will always follow qfThreadInfo when we reply as we have to specify 'l' at the
- * end to terminate the list.. GDB doesn't like this not happening.
+ * threading even when there's only the possiblity for one thread to exist, so there is always at
+ * least thread 1 so GDB doesn't think the "thread" died. The cores go in the qfThreadInfo reply
+ * with the first of the RTOS tasks, each qsThreadInfo that follows gets more tasks until the 'l'
+ * that terminates the list.
  */
+#define GDB_THREAD_INFO_TASKS 32U
+
 static void exec_q_thread_info(const char *packet, const size_t length)
 {
 	(void)length;
-	if (packet[-11] == 'f')
-		gdb_putpacketz("m1");
-	else
+	const rtos_task_s *tasks = NULL;
+	const size_t task_count = cur_target ? rtos_tasks(cur_target, &tasks) : 0U;
+	char reply[GDB_MAX_THREADS * 3U + GDB_THREAD_INFO_TASKS * 9U + 2U] = "m1";
+	size_t offset = 2;
+	if (packet[-11] == 'f') {
+		for (size_t i = 1; i < gdb_thread_count; ++i)
+			offset += snprintf(reply + offset, sizeof(reply) - offset, ",%x", (unsigned)i + 1U);
+		gdb_thread_info_task = 0;
+	} else if (gdb_thread_info_task < task_count)
+		offset = 1;
+	else {
 		gdb_putpacketz("l");
+		return;
+	}
+	const size_t end = MIN(task_count, gdb_thread_info_task + GDB_THREAD_INFO_TASKS);
+	for (; gdb_thread_info_task < end; ++gdb_thread_info_task) {
+		offset += snprintf(reply + offset, sizeof(reply) - offset, "%s%" PRIx32, offset > 1U ? "," : "",
+			tasks[gdb_thread_info_task].tcb);
+	}
+	gdb_putpacket(reply, offset);
+}
+
+/*
+ * qThreadExtraInfo,<thread-id> names the core behind the thread and the RTOS task running on it,
+ * or for a task thread its name and state
+ */
+static void exec_q_thread_extra_info(const char *packet, const size_t length)
+{
+	(void)length;
+	static const char *const task_state[] = {"Ready", "Blocked", "Suspended"};
+	const uint32_t thread_id = strtoul(packet, NULL, 16);
+	const int thread = gdb_thread_index(thread_id);
+	char info[48];
+	if (thread >= 0) {
+		target *const t = gdb_threads[thread];
+		const char *const name = target_core_name(t) ? target_core_name(t) : target_driver_name(t);
+		const char *const task = t == cur_target ? rtos_current_task(t) : NULL;
+		if (task)
+			snprintf(info, sizeof(info), "%s: %s", name, task);
+		else
+			snprintf(info, sizeof(info), "%s", name);
+	} else if (gdb_thread_is_task(thread_id)) {
+		const rtos_task_s *const task = rtos_task_find(cur_target, thread_id);
+		snprintf(info, sizeof(info), "%s (%s)", task->name, task_state[task->state]);
+	} else {
+		gdb_putpacketz("E01");
+		return;
+	}
+	const size_t info_length = strlen(info);
+	char reply[sizeof(info) * 2U];
+	gdb_putpacket(hexify(reply, info, info_length), info_length * 2U);
+}
+
+static void exec_q_non_stop(const char *packet, const size_t length)
+{
+	(void)length;
+	if (packet[0] == '0' || packet[0] == '1') {
+		gdb_non_stop = packet[0] == '1';
+		gdb_putpacketz("OK");
+	} else
+		gdb_putpacketz("E01");
+}
+
+/* Longest symbol name asked for */
+#define GDB_SYMBOL_MAX 24U
+
+/* The symbols to ask GDB for, those of the RTOS kernels and then the RTT control block */
+static const char *gdb_symbol(const size_t index)
+{
+	size_t rtos_symbols = 0;
+	while (rtos_symbol(rtos_symbols))
+		++rtos_symbols;
+	if (index < rtos_symbols)
+		return rtos_symbol(index);
+#ifdef ENABLE_RTT
+	if (index == rtos_symbols)
+		return "_SEGGER_RTT";
+#endif
+	return NULL;
+}
+
+/* Takes the value GDB has for the symbol, 0 if it doesn't know it, and returns the index of the next to ask for */
+static size_t gdb_symbol_set(const char *const symbol, const uint32_t value)
+{
+	size_t index = 0;
+	const char *name;
+	while ((name = gdb_symbol(index)) && strcmp(name, symbol))
+		++index;
+	if (!name)
+		return SIZE_MAX;
+	if (rtos_symbol(index))
+		rtos_symbol_set(symbol, value);
+#ifdef ENABLE_RTT
+	else {
+		rtt_symbol_addr = value;
+		rtt_found = false;
+		if (value)
+			DEBUG_INFO("rtt: control block symbol at 0x%" PRIx32 "\n", rtt_symbol_addr);
+	}
+#endif
+	return index + 1U;
+}
+
+/*
+ * GDB offers to look symbols up with qSymbol:: whenever it loads some. Ask for
+ * the RTOS kernel variables and the RTT control block, one at a time, GDB
+ * answers each with one of qSymbol:<value>:<name> or qSymbol::<name> when it
+ * doesn't know the symbol, and OK ends the lookups.
+ */
+static void exec_q_symbol(const char *packet, const size_t length)
+{
+	const char *const name = memchr(packet, ':', length);
+	if (!name) {
+		gdb_putpacketz("E01");
+		return;
+	}
+	size_t next = 0;
+	if (name == packet && name[1] == '\0') {
+		/* New symbols, so everything looked up before may have moved */
+		rtos_symbols_reset();
+#ifdef ENABLE_RTT
+		rtt_symbol_addr = 0;
+		rtt_found = false;
+#endif
+	} else {
+		char symbol[GDB_SYMBOL_MAX + 1U] = {0};
+		const size_t name_length = (length - (name + 1 - packet)) / 2U;
+		if (name_length > GDB_SYMBOL_MAX) {
+			gdb_putpacketz("OK");
+			return;
+		}
+		unhexify(symbol, name + 1, name_length);
+		next = gdb_symbol_set(symbol, name != packet ? strtoul(packet, NULL, 16) : 0U);
+	}
+	const char *const symbol = next != SIZE_MAX ? gdb_symbol(next) : NULL;
+	if (!symbol) {
+		gdb_putpacketz("OK");
+		return;
+	}
+	char request[8U + GDB_SYMBOL_MAX * 2U + 1U] = "qSymbol:";
+	hexify(request + 8U, symbol, strlen(symbol));
+	gdb_putpacketz(request);
 }
 
 static const cmd_executer q_commands[]=
@@ -518,6 +1341,9 @@ static const cmd_executer q_commands[]=
 	{"qC",                             exec_q_c},
 	{"qfThreadInfo",                   exec_q_thread_info},
 	{"qsThreadInfo",                   exec_q_thread_info},
+	{"qThreadExtraInfo,",              exec_q_thread_extra_info},
+	{"QNonStop:",                      exec_q_non_stop},
+	{"qSymbol:",                       exec_q_symbol},
 	{NULL, NULL},
 };
 
@@ -525,7 +1351,9 @@ static void handle_kill_target(void)
 {
 	if (cur_target) {
 		target_reset(cur_target);
+		gdb_threads_detach();
 		target_detach(cur_target);
+		gdb_agent_cond_clear_all();
 		last_target = cur_target;
 		cur_target = NULL;
 	}
@@ -539,6 +1367,115 @@ static void handle_q_packet(char *packet, const size_t length)
 	gdb_putpacket("", 0);
 }
 
+/*
+ * Range stepping: keep single stepping while the PC stays inside [start, end) and only
+ * report to GDB once it leaves the range or the target stops for another reason.
+ */
+static enum target_halt_reason gdb_range_step(
+	const size_t thread, const uint32_t start, const uint32_t end, target_addr_t *const watch)
+{
+	enum target_halt_reason reason;
+	uint32_t pc;
+	do {
+		gdb_thread_resume(thread, true);
+		SET_RUN_STATE(1);
+		reason = gdb_wait_for_halt(watch);
+		if (reason != TARGET_HALT_STEPPING)
+			break;
+		/* The PC is register 15 in the Cortex-M/A GDB register maps */
+		if (target_reg_read(gdb_threads[thread], 15, &pc, sizeof(pc)) != sizeof(pc))
+			break;
+	} while (pc >= start && pc < end);
+	return reason;
+}
+
+static void handle_vcont(const char *const actions)
+{
+	const char action = actions[0];
+	if (!cur_target) {
+		gdb_putpacketz("X1D");
+		return;
+	}
+	/* The action may name a thread with ":thread-id", otherwise it is for all of them */
+	int thread = -1;
+	const char *const thread_id = strchr(actions, ':');
+	const char *const next_action = strchr(actions, ';');
+	if (thread_id && (!next_action || thread_id < next_action)) {
+		const uint32_t id = strtoul(thread_id + 1, NULL, 16);
+		thread = gdb_thread_index(id);
+		/* A task only runs with its core, so continuing or stopping it acts on them all */
+		if (thread == -2 && gdb_thread_is_task(id) && strchr("cCt", action))
+			thread = -1;
+	}
+	if (thread == -2) {
+		gdb_putpacketz("E01");
+		return;
+	}
+
+	switch (action) {
+	case 't': /* Stop, only meaningful in non-stop mode */
+		if (!gdb_non_stop) {
+			gdb_putpacketz("E01");
+			return;
+		}
+		if (gdb_target_running) {
+			gdb_stop_requested = true;
+			if (thread >= 0 && gdb_thread_running[thread])
+				target_halt_request(gdb_threads[thread]);
+			else
+				gdb_threads_halt_request();
+		}
+		gdb_putpacketz("OK");
+		return;
+
+	case 'c':
+	case 'C':
+	case 's':
+	case 'S': {
+		const bool step = action == 's' || action == 'S';
+		if (thread >= 0)
+			gdb_thread_resume((size_t)thread, step);
+		else
+			gdb_threads_resume(step);
+		SET_RUN_STATE(1);
+		if (gdb_non_stop) {
+			/* Carry on serving packets, the halt is reported as a notification */
+			gdb_target_running = true;
+			gdb_putpacketz("OK");
+		}
+#if PC_HOSTED == 1
+		else if (gdb_session_defer_halt())
+			return;
+#endif
+		else {
+			target_addr_t watch = 0;
+			const enum target_halt_reason reason = gdb_wait_for_halt(&watch);
+			gdb_put_stop_reply(reason, watch, false);
+		}
+		return;
+	}
+
+	case 'r': {
+		uint32_t start = 0;
+		uint32_t end = 0;
+		if (gdb_target_running || sscanf(actions + 1, "%" SCNx32 ",%" SCNx32, &start, &end) != 2) {
+			gdb_putpacketz("E01");
+			return;
+		}
+		if (gdb_non_stop)
+			gdb_putpacketz("OK");
+		target_addr_t watch = 0;
+		const size_t step_thread = thread >= 0 ? (size_t)thread : gdb_thread_step;
+		const enum target_halt_reason reason = gdb_range_step(step_thread, start, end, &watch);
+		gdb_put_stop_reply(reason, watch, gdb_non_stop);
+		return;
+	}
+
+	default:
+		gdb_putpacketz("E01");
+	}
+}
+
 static void handle_v_packet(char *packet, const size_t plen)
 {
 	uint32_t addr = 0;
@@ -549,6 +1486,10 @@ static void handle_v_packet(char *packet, const size_t plen)
 		/* Attach to remote target processor */
 		cur_target = target_attach_n(addr, &gdb_controller);
 		if(cur_target) {
+			gdb_threads_attach();
+#ifdef PLATFORM_HAS_SETTINGS
+			autoattach_remember(cur_target);
+#endif
 			morse(NULL, false);
 			/*
 			 * We don't actually support threads, but GDB 11 and 12 can't work without
@@ -559,7 +1500,7 @@ static void handle_v_packet(char *packet, const size_t plen)
 			 * https://sourceware.org/pipermail/gdb-patches/2022-April/188058.html
 			 * https://sourceware.org/pipermail/gdb-patches/2022-July/190869.html
 			 */
-			gdb_putpacketz("T05thread:1;");
+			gdb_putpacket_f("T05thread:%x;", (unsigned)gdb_thread_general + 1U);
 		} else
 			gdb_putpacketz("E01");
 
@@ -608,8 +1549,7 @@ static void handle_v_packet(char *packet, const size_t plen)
 			target_reset(cur_target);
 			gdb_putpacketz("T05");
 		} else if (last_target) {
-			cur_target = target_attach(last_target,
-						   &gdb_controller);
+			gdb_attach(last_target);
 
 			/* If we were able to attach to the target again */
 			if (cur_target) {
@@ -631,6 +1571,8 @@ static void handle_v_packet(char *packet, const size_t plen)
 			return;
 		}
 
+		/* An erase starts a new load, so forget any error latched by a previous one */
+		gdb_flash_write_failed = false;
 		if (target_flash_erase(cur_target, addr, len))
 			gdb_putpacketz("OK");
 		else {
@@ -642,24 +1584,48 @@ static void handle_v_packet(char *packet, const size_t plen)
 		/* Write Flash Memory */
 		const uint32_t count = plen - bin;
 		DEBUG_GDB("Flash Write %08" PRIX32 " %08" PRIX32 "\n", addr, count);
-		if (cur_target && target_flash_write(cur_target, addr, (void*)packet + bin, count))
-			gdb_putpacketz("OK");
-		else {
-			target_flash_complete(cur_target);
+		if (!cur_target) {
 			gdb_putpacketz("EFF");
+			return;
+		}
+		/*
+		 * Acknowledge the packet before programming it: the data stays in pbuf until we
+		 * return to read the next packet, so GDB can be sending that while the target
+		 * programs this one. A failure is latched and reported on vFlashDone, and the
+		 * rest of the load is discarded.
+		 */
+		gdb_putpacketz("OK");
+		if (!gdb_flash_write_failed && !target_flash_write_in_place(cur_target, addr, packet + bin, count)) {
+			DEBUG_WARN("Flash write at 0x%08" PRIx32 " failed\n", addr);
+			target_flash_complete(cur_target);
+			gdb_flash_write_failed = true;
 		}
 
 	} else if (!strcmp(packet, "vFlashDone")) {
 		/* Commit flash operations. */
-		if (target_flash_complete(cur_target))
+		const bool write_failed = gdb_flash_write_failed;
+		gdb_flash_write_failed = false;
+		if (target_flash_complete(cur_target) && !write_failed)
 			gdb_putpacketz("OK");
 		else
 			gdb_putpacketz("EFF");
 
+	} else if (!strcmp(packet, "vCont?")) {
+		gdb_putpacketz("vCont;c;C;s;S;t;r");
+
+	} else if (!strncmp(packet, "vCont;", 6)) {
+		/* Threads are run and stopped together, so only the first action matters */
+		handle_vcont(packet + 6);
+
 	} else if (!strcmp(packet, "vStopped")) {
 		if (gdb_needs_detach_notify) {
 			gdb_putpacketz("W00");
 			gdb_needs_detach_notify = false;
+		} else if (gdb_thread_stop_pending) {
+			/* The threads stopped along with the one the notification was for */
+			const size_t thread = __builtin_ctz(gdb_thread_stop_pending);
+			gdb_thread_stop_pending &= ~(1U << thread);
+			gdb_putpacket_f("T%02Xthread:%x;", GDB_SIGNONE, (unsigned)thread + 1U);
 		} else
 			gdb_putpacketz("OK");
 
@@ -672,6 +1638,42 @@ static void handle_v_packet(char *packet, const size_t plen)
 	}
 }
 
+/*
+ * Hardware break- and watchpoints go on every thread's core. A software breakpoint
+ * is a change to memory the cores may share, so only cur_target puts it in.
+ */
+static size_t gdb_breakwatch_threads(const uint32_t type)
+{
+	return type == TARGET_BREAK_SOFT ? 0U : gdb_thread_count;
+}
+
+static target *gdb_breakwatch_target(const uint32_t type, const size_t thread)
+{
+	return type == TARGET_BREAK_SOFT || !gdb_thread_count ? cur_target : gdb_threads[thread];
+}
+
+static int gdb_breakwatch_set(const uint32_t type, const uint32_t addr, const uint32_t len)
+{
+	int ret = target_breakwatch_set(gdb_breakwatch_target(type, 0), type, addr, len);
+	for (size_t i = 1; !ret && i < gdb_breakwatch_threads(type); ++i) {
+		ret = target_breakwatch_set(gdb_threads[i], type, addr, len);
+		/* Take it back out of the cores it did go on */
+		for (size_t j = 0; ret && j < i; ++j)
+			target_breakwatch_clear(gdb_threads[j], type, addr, len);
+	}
+	return ret;
+}
+
+static int gdb_breakwatch_clear(const uint32_t type, const uint32_t addr, const uint32_t len)
+{
+	int ret = target_breakwatch_clear(gdb_breakwatch_target(type, 0), type, addr, len);
+	for (size_t i = 1; i < gdb_breakwatch_threads(type); ++i) {
+		if (target_breakwatch_clear(gdb_threads[i], type, addr, len))
+			ret = -1;
+	}
+	return ret;
+}
+
 static void handle_z_packet(char *packet, const size_t plen)
 {
 	(void)plen;
@@ -682,10 +1684,18 @@ static void handle_z_packet(char *packet, const size_t plen)
 	sscanf(packet, "%*[zZ]%" PRIu32 ",%08" PRIx32 ",%" PRIu32, &type, &addr, &len);
 
 	int ret = 0;
-	if (packet[0] == 'Z')
-		ret = target_breakwatch_set(cur_target, type, addr, len);
-	else
-		ret = target_breakwatch_clear(cur_target, type, addr, len);
+	if (packet[0] == 'Z') {
+		ret = gdb_breakwatch_set(type, addr, len);
+		/* Any condition list follows the kind */
+		const char *const conds = strchr(packet, ';');
+		if (!ret && !gdb_agent_cond_set(type, addr, len, conds ? conds : "")) {
+			gdb_breakwatch_clear(type, addr, len);
+			ret = -1;
+		}
+	} else {
+		ret = gdb_breakwatch_clear(type, addr, len);
+		gdb_agent_cond_clear(type, addr, len);
+	}
 
 	if (ret < 0)
 		gdb_putpacketz("E01");
@@ -697,5 +1707,9 @@ static void handle_z_packet(char *packet, const size_t plen)
 
 void gdb_main(void)
 {
+#ifdef ENABLE_RTT
+	scheduler_add(gdb_rtt_task);
+	scheduler_add(gdb_sample_task);
+#endif
 	gdb_main_loop(&gdb_controller, false);
 }
@@ -27,9 +27,85 @@
 #include "gdb_packet.h"
 #include "hex_utils.h"
 #include "remote.h"
+#include "stats.h"
 
 #include <stdarg.h>
 
+/*
+ * Received bytes are pulled from the gdb_if backend a whole USB packet or socket read
+ * at a time and framed from this buffer, rather than one gdb_if_getchar() call per byte.
+ */
+#if PC_HOSTED == 1
+#define GDB_RX_BUFFER_SIZE 2048U
+#else
+#define GDB_RX_BUFFER_SIZE 64U
+#endif
+
+static char gdb_rx_buffer[GDB_RX_BUFFER_SIZE];
+static size_t gdb_rx_offset;
+static size_t gdb_rx_length;
+
+static char gdb_rx_getchar(void)
+{
+	if (gdb_rx_offset == gdb_rx_length) {
+		gdb_rx_length = gdb_if_read(gdb_rx_buffer, sizeof(gdb_rx_buffer));
+		gdb_rx_offset = 0;
+		stats_add(STATS_GDB_RX_BYTES, gdb_rx_length);
+	}
+	return gdb_rx_buffer[gdb_rx_offset++];
+}
+
+#if PC_HOSTED == 1
+/* Log a packet in one go rather than a call per byte, with the unprintable bytes escaped */
+static void gdb_debug_packet(
+	const char *const func, const char *const packet1, const size_t size1, const char *const packet2, const size_t size2)
+{
+	if ((cl_debuglevel & (BMP_DEBUG_GDB | BMP_DEBUG_WIRE)) != (BMP_DEBUG_GDB | BMP_DEBUG_WIRE))
+		return;
+	char *const text = malloc((size1 + size2) * 4U + 1U);
+	if (!text)
+		return;
+	size_t len = 0;
+	for (size_t i = 0; i < size1 + size2; ++i) {
+		const char c = i < size1 ? packet1[i] : packet2[i - size1];
+		if (c >= ' ' && c < 0x7f)
+			text[len++] = c;
+		else
+			len += sprintf(text + len, "\\x%02X", (uint8_t)c);
+	}
+	text[len] = '\0';
+	DEBUG_GDB_WIRE("%s: %s\n", func, text);
+	free(text);
+}
+#endif
+
+unsigned char gdb_getchar_to(const int timeout)
+{
+	/* Hand out anything left over from the last bulk read before asking the backend */
+	if (gdb_rx_offset < gdb_rx_length)
+		return gdb_rx_buffer[gdb_rx_offset++];
+	return gdb_if_getchar_to(timeout);
+}
+
+bool gdb_packet_available(const int timeout)
+{
+	if (gdb_rx_offset < gdb_rx_length)
+		return true;
+	const unsigned char c = gdb_if_getchar_to(timeout);
+	if (c == 0xffU)
+		return false;
+	/* Keep the byte for gdb_getpacket() to frame */
+	gdb_rx_buffer[0] = (char)c;
+	gdb_rx_offset = 0;
+	gdb_rx_length = 1;
+	return true;
+}
+
+bool gdb_packet_buffered(void)
+{
+	return gdb_rx_offset < gdb_rx_length;
+}
+
 size_t gdb_getpacket(char *packet, size_t size)
 {
 	unsigned char csum;
@@ -44,8 +120,9 @@ size_t gdb_getpacket(char *packet, size_t size)
 			 */
 			do {
 				/* Smells like bad code */
-				packet[0] = (char)gdb_if_getchar();
-				if (packet[0] == 0x04)
+				packet[0] = gdb_rx_getchar();
+				/* A Ctrl-C between packets is handed on too, for a target left running */
+				if (packet[0] == 0x04 || packet[0] == 0x03)
 					return 1;
 			} while ((packet[0] != '$') && (packet[0] != REMOTE_SOM));
 #if PC_HOSTED == 0
@@ -56,7 +133,7 @@ size_t gdb_getpacket(char *packet, size_t size)
 				bool gettingRemotePacket = true;
 				while (gettingRemotePacket) {
 					/* Smells like bad code */
-					const char c = (char)gdb_if_getchar();
+					const char c = gdb_rx_getchar();
 					switch (c) {
 					case REMOTE_SOM: /* Oh dear, packet restarts */
 						offset = 0;
@@ -95,30 +172,49 @@ size_t gdb_getpacket(char *packet, size_t size)
 
 		offset = 0;
 		csum = 0;
-		char c;
 		/* Capture packet data into buffer */
-		while ((c = (char)gdb_if_getchar()) != '#') {
+		while (true) {
+			if (gdb_rx_offset == gdb_rx_length) {
+				gdb_rx_length = gdb_if_read(gdb_rx_buffer, sizeof(gdb_rx_buffer));
+				gdb_rx_offset = 0;
+				stats_add(STATS_GDB_RX_BYTES, gdb_rx_length);
+			}
+
+			/* Copy and checksum the run of plain characters up to the next one needing attention */
+			const char *const chunk = gdb_rx_buffer + gdb_rx_offset;
+			const size_t limit = MIN(gdb_rx_length - gdb_rx_offset, size - offset);
+			size_t run = 0;
+			for (; run < limit; ++run) {
+				const char c = chunk[run];
+				if (c == '#' || c == '$' || c == '}')
+					break;
+				csum += c;
+			}
+			memcpy(packet + offset, chunk, run);
+			offset += run;
+			gdb_rx_offset += run;
 
 			/* If we run out of buffer space, exit early */
 			if (offset == size)
 				break;
+			if (gdb_rx_offset == gdb_rx_length)
+				continue;
 
+			const char c = gdb_rx_buffer[gdb_rx_offset++];
+			if (c == '#')
+				break;
 			if (c == '$') { /* Restart capture */
 				offset = 0;
 				csum = 0;
 				continue;
 			}
-			if (c == '}') { /* escaped char */
-				c = gdb_if_getchar();
-				csum += c + '}';
-				packet[offset++] = c ^ 0x20;
-				continue;
-			}
-			csum += c;
-			packet[offset++] = c;
+			/* escaped char */
+			const char escaped = gdb_rx_getchar();
+			csum += escaped + '}';
+			packet[offset++] = escaped ^ 0x20;
 		}
-		recv_csum[0] = (char)gdb_if_getchar();
-		recv_csum[1] = (char)gdb_if_getchar();
+		recv_csum[0] = gdb_rx_getchar();
+		recv_csum[1] = gdb_rx_getchar();
 		recv_csum[2] = 0;
 
 		/* return packet if checksum matches */
@@ -132,27 +228,13 @@ size_t gdb_getpacket(char *packet, size_t size)
 	packet[offset] = 0;
 
 #if PC_HOSTED == 1
-	DEBUG_GDB_WIRE("%s : ", __func__);
-	for (size_t j = 0; j < offset; j++) {
-		const char c = packet[j];
-		if (c >= ' ' && c < 0x7F)
-			DEBUG_GDB_WIRE("%c", c);
-		else
-			DEBUG_GDB_WIRE("\\x%02X", c);
-	}
-	DEBUG_GDB_WIRE("\n");
+	gdb_debug_packet(__func__, packet, offset, NULL, 0);
 #endif
 	return offset;
 }
 
 static void gdb_next_char(char c, unsigned char *csum)
 {
-#if PC_HOSTED == 1
-	if ((c >= 32) && (c < 127))
-		DEBUG_GDB_WIRE("%c", c);
-	else
-		DEBUG_GDB_WIRE("\\x%02X", c);
-#endif
 	if ((c == '$') || (c == '#') || (c == '}') || (c == '*')) {
 		gdb_if_putchar('}', 0);
 		gdb_if_putchar(c ^ 0x20, 0);
@@ -170,7 +252,9 @@ void gdb_putpacket2(const char *packet1, size_t size1, const char *packet2, size
 	size_t tries = 0;
 
 	do {
-		DEBUG_GDB_WIRE("%s: ", __func__);
+#if PC_HOSTED == 1
+		gdb_debug_packet(__func__, packet1, size1, packet2, size2);
+#endif
 		unsigned char csum = 0;
 		gdb_if_putchar('$', 0);
 
@@ -183,8 +267,8 @@ void gdb_putpacket2(const char *packet1, size_t size1, const char *packet2, size
 		snprintf(xmit_csum, sizeof(xmit_csum), "%02X", csum);
 		gdb_if_putchar(xmit_csum[0], 0);
 		gdb_if_putchar(xmit_csum[1], 1);
-		DEBUG_GDB_WIRE("\n");
-	} while (gdb_if_getchar_to(2000) != '+' && tries++ < 3);
+		stats_add(STATS_GDB_TX_BYTES, size1 + size2 + 4U);
+	} while (gdb_getchar_to(2000) != '+' && tries++ < 3);
 }
 
 void gdb_putpacket(const char *packet, size_t size)
@@ -193,7 +277,9 @@ void gdb_putpacket(const char *packet, size_t size)
 	size_t tries = 0;
 
 	do {
-		DEBUG_GDB_WIRE("%s: ", __func__);
+#if PC_HOSTED == 1
+		gdb_debug_packet(__func__, packet, size, NULL, 0);
+#endif
 		unsigned char csum = 0;
 		gdb_if_putchar('$', 0);
 		for (size_t i = 0; i < size; ++i)
@@ -202,15 +288,17 @@ void gdb_putpacket(const char *packet, size_t size)
 		snprintf(xmit_csum, sizeof(xmit_csum), "%02X", csum);
 		gdb_if_putchar(xmit_csum[0], 0);
 		gdb_if_putchar(xmit_csum[1], 1);
-		DEBUG_GDB_WIRE("\n");
-	} while (gdb_if_getchar_to(2000) != '+' && tries++ < 3);
+		stats_add(STATS_GDB_TX_BYTES, size + 4U);
+	} while (gdb_getchar_to(2000) != '+' && tries++ < 3);
 }
 
 void gdb_put_notification(const char *const packet, const size_t size)
 {
 	char xmit_csum[3];
 
-	DEBUG_GDB_WIRE("%s: ", __func__);
+#if PC_HOSTED == 1
+	gdb_debug_packet(__func__, packet, size, NULL, 0);
+#endif
 	uint8_t csum = 0;
 	gdb_if_putchar('%', 0);
 	for (size_t i = 0; i < size; ++i)
@@ -219,7 +307,7 @@ void gdb_put_notification(const char *const packet, const size_t size)
 	snprintf(xmit_csum, sizeof(xmit_csum), "%02X", csum);
 	gdb_if_putchar(xmit_csum[0], 0);
 	gdb_if_putchar(xmit_csum[1], 1);
-	DEBUG_GDB_WIRE("\n");
+	stats_add(STATS_GDB_TX_BYTES, size + 4U);
 }
 
 void gdb_putpacket_f(const char *fmt, ...)
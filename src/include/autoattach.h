@@ -0,0 +1,37 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef INCLUDE_AUTOATTACH_H
+#define INCLUDE_AUTOATTACH_H
+
+#include "target.h"
+
+/*
+ * The last target attached to, remembered in the platform's settings so that
+ * a GDB connection after the probe is plugged back in attaches to it again
+ * without a scan command. Only on platforms with PLATFORM_HAS_SETTINGS.
+ */
+bool autoattach_enabled(void);
+bool autoattach_enable(bool enable);
+
+/* Note t as the target to come back to, if autoattach is enabled and it can be found again */
+void autoattach_remember(target *t);
+
+/* Scan for the remembered target, NULL if it is not there any more */
+target *autoattach_scan(void);
+
+#endif /* INCLUDE_AUTOATTACH_H */
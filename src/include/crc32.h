@@ -22,5 +22,6 @@
 #define INCLUDE_CRC32_H
 
 int generic_crc32(target *t, uint32_t *crc, uint32_t base, int len);
+uint32_t generic_crc32_buffer(uint32_t crc, const uint8_t *data, size_t len);
 
 #endif /* INCLUDE_CRC32_H */
@@ -24,11 +24,44 @@
 #if PC_HOSTED == 0
 #include <libopencm3/usb/usbd.h>
 void gdb_usb_out_cb(usbd_device *dev, uint8_t ep);
+#ifndef LM4F
+void gdb_usb_in_cb(usbd_device *dev, uint8_t ep);
+/* Drop anything still queued for the host, as on a new USB configuration */
+void gdb_if_tx_reset(void);
+#endif
+#else
+/* Sleeps for up to timeout_us, returning early if the current GDB client has something to say */
+void gdb_if_wait(uint32_t timeout_us);
+
+/*
+ * Each of the first count targets can be served on a port of its own after the
+ * main port. The clients of a port form a session, numbered by port from 0 for
+ * the main one, and gdb_main keeps the protocol state separately per session.
+ */
+#define GDB_IF_MAX_TARGET_PORTS 7U
+void gdb_if_listen_targets(uint32_t count);
+/* How many sessions there can be, 1 without target ports */
+uint32_t gdb_if_sessions(void);
+/* The session of the client last served, fresh is set the first time for a new client */
+uint32_t gdb_if_session(bool *fresh);
+/* The client being served, as a number unique to its connection, 0 for none */
+uint32_t gdb_if_client(void);
+/* Serves the client numbered client next or, with that 0, any of the session's, false for none */
+bool gdb_if_client_select(uint32_t client, uint32_t session);
+/* Whether any client has sent something not read yet */
+bool gdb_if_ready(void);
+/* Keeps to the current client while pin is set, returning the previous setting */
+bool gdb_if_pin(bool pin);
 #endif
 
 int gdb_if_init(void);
 unsigned char gdb_if_getchar(void);
 unsigned char gdb_if_getchar_to(int timeout);
+/*
+ * Bulk read: blocks until at least one byte is available, then returns up to max bytes.
+ * Like gdb_if_getchar(), a closed port is reported as a single 0x04 byte.
+ */
+size_t gdb_if_read(void *buf, size_t max);
 
 /* sending gdb_if_putchar(0, true) seems to work as keep alive */
 void gdb_if_putchar(unsigned char c, int flush);
@@ -23,8 +23,22 @@
 
 #include <stddef.h>
 #include <stdarg.h>
+#include <stdbool.h>
+
+/*
+ * Platforms with more RAM to spare can raise the packet size in their platform.h,
+ * which cuts the number of request/ACK round trips for vFlashWrite, X, m and x.
+ */
+#ifndef GDB_PACKET_BUFFER_SIZE
+#define GDB_PACKET_BUFFER_SIZE 1024U
+#endif
 
 size_t gdb_getpacket(char *packet, size_t size);
+unsigned char gdb_getchar_to(int timeout);
+/* Waits up to timeout ms for input from GDB without consuming it */
+bool gdb_packet_available(int timeout);
+/* Whether input already read from the current client is still to be handled */
+bool gdb_packet_buffered(void);
 void gdb_putpacket(const char *packet, size_t size);
 void gdb_putpacket2(const char *packet1, size_t size1, const char *packet2, size_t size2);
 #define gdb_putpacketz(packet) gdb_putpacket((packet), strlen(packet))
@@ -87,84 +87,28 @@ void debug_serial_send_stdout(const uint8_t *data, size_t len);
 # include <stdarg.h>
 extern int cl_debuglevel;
 
-static inline void DEBUG_WARN(const char *format, ...)
-{
-	va_list ap;
-    va_start(ap, format);
-    vfprintf(stderr, format, ap);
-    va_end(ap);
-	return;
-}
-
-static inline void DEBUG_INFO(const char *format, ...)
-{
-	if (~cl_debuglevel & BMP_DEBUG_INFO)
-		return;
-	va_list ap;
-    va_start(ap, format);
-	if (cl_debuglevel & BMP_DEBUG_STDOUT)
-		vfprintf(stdout, format, ap);
-	else
-		vfprintf(stderr, format, ap);
-    va_end(ap);
-	return;
-}
-
-static inline void DEBUG_GDB(const char *format, ...)
-{
-	if (~cl_debuglevel & BMP_DEBUG_GDB)
-		return;
-	va_list ap;
-    va_start(ap, format);
-    vfprintf(stderr, format, ap);
-    va_end(ap);
-	return;
-}
-
-static inline void DEBUG_GDB_WIRE(const char *format, ...)
-{
-	if ((cl_debuglevel & (BMP_DEBUG_GDB | BMP_DEBUG_WIRE)) !=
-		(BMP_DEBUG_GDB | BMP_DEBUG_WIRE))
-		return;
-	va_list ap;
-    va_start(ap, format);
-    vfprintf(stderr, format, ap);
-    va_end(ap);
-	return;
-}
-
-static inline void DEBUG_TARGET(const char *format, ...)
-{
-	if (~cl_debuglevel & BMP_DEBUG_TARGET)
-		return;
-	va_list ap;
-    va_start(ap, format);
-    vfprintf(stderr, format, ap);
-    va_end(ap);
-	return;
-}
-
-static inline void DEBUG_PROBE(const char *format, ...)
-{
-	if (~cl_debuglevel & BMP_DEBUG_PROBE)
-		return;
-	va_list ap;
-    va_start(ap, format);
-    vfprintf(stderr, format, ap);
-    va_end(ap);
-	return;
-}
-
-static inline void DEBUG_WIRE(const char *format, ...)
-{
-	if (~cl_debuglevel & BMP_DEBUG_WIRE)
-		return;
-	va_list ap;
-    va_start(ap, format);
-    vfprintf(stderr, format, ap);
-    va_end(ap);
-	return;
-}
+/*
+ * Debug output is queued for a thread of its own to write out, so that turning
+ * it on doesn't slow the session down to the pace of the terminal. The level
+ * is checked before any of the arguments are evaluated.
+ */
+void debug_log(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+/* Writes out what is queued and goes back to writing directly, for exit */
+void debug_log_close(void);
+
+#define DEBUG_LOG_IF(mask, ...) \
+	do { \
+		if ((cl_debuglevel & (mask)) == (mask)) \
+			debug_log(mask, __VA_ARGS__); \
+	} while (0)
+
+#define DEBUG_WARN(...)     debug_log(BMP_DEBUG_NONE, __VA_ARGS__)
+#define DEBUG_INFO(...)     DEBUG_LOG_IF(BMP_DEBUG_INFO, __VA_ARGS__)
+#define DEBUG_GDB(...)      DEBUG_LOG_IF(BMP_DEBUG_GDB, __VA_ARGS__)
+#define DEBUG_GDB_WIRE(...) DEBUG_LOG_IF(BMP_DEBUG_GDB | BMP_DEBUG_WIRE, __VA_ARGS__)
+#define DEBUG_TARGET(...)   DEBUG_LOG_IF(BMP_DEBUG_TARGET, __VA_ARGS__)
+#define DEBUG_PROBE(...)    DEBUG_LOG_IF(BMP_DEBUG_PROBE, __VA_ARGS__)
+#define DEBUG_WIRE(...)     DEBUG_LOG_IF(BMP_DEBUG_WIRE, __VA_ARGS__)
 #endif
 
 #define ALIGN(x, n) (((x) + (n) - 1) & ~((n) - 1))
@@ -50,6 +50,12 @@ typedef struct jtag_proc_s {
 	void (*jtagtap_tdi_tdo_seq)(uint8_t *data_out, const bool final_tms, const uint8_t *data_in, size_t clock_cycles);
 	void (*jtagtap_tdi_seq)(const bool final_tms, const uint8_t *data_in, size_t clock_cycles);
 	void (*jtagtap_cycle)(const bool tms, const bool tdi, const size_t clock_cycles);
+	/*
+	 * Optional, for adaptors that take TMS for every clock cycle as well as TDI
+	 * in one transfer: shift a sequence with tms giving the TMS bits the same
+	 * way data_in gives the TDI bits. DO may be NULL to ignore captured data.
+	 */
+	void (*jtagtap_tms_tdi_tdo_seq)(uint8_t *data_out, const uint8_t *tms, const uint8_t *data_in, size_t clock_cycles);
 
 	/*
 	 * Some debug controllers such as the RISC-V debug controller use idle
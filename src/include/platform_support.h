@@ -39,11 +39,42 @@ void platform_timeout_set(platform_timeout *t, uint32_t ms);
 bool platform_timeout_is_expired(platform_timeout *t);
 void platform_delay(uint32_t ms);
 
+/* The same in microseconds, for the waits the ms tick can't resolve */
+typedef struct platform_timeout_us platform_timeout_us;
+void platform_timeout_us_set(platform_timeout_us *t, uint32_t us);
+bool platform_timeout_us_is_expired(const platform_timeout_us *t);
+void platform_delay_us(uint32_t us);
+
+typedef struct platform_backoff platform_backoff;
+void platform_backoff_init(platform_backoff *b, uint32_t max_us);
+/* Call before each poll after the first */
+void platform_backoff_wait(platform_backoff *b);
+
 #define POWER_CONFLICT_THRESHOLD	5 /* in 0.1V, so 5 stands for 0.5V */
 extern bool connect_assert_nrst;
+/* Mass erase protected parts found by the next scan, see nrf51_mdm_recover() */
+extern bool scan_recover;
 uint32_t platform_target_voltage_sense(void);
 const char *platform_target_voltage(void);
 int platform_hwversion(void);
+
+#ifdef PLATFORM_HAS_VOLTAGE_MONITOR
+/*
+ * VREF is sampled continuously in the background, so these cost no conversion.
+ * Voltages are in 0.1V like platform_target_voltage_sense(), the window covering
+ * the last few hundred microseconds.
+ */
+typedef struct platform_voltage_window {
+	uint32_t last;
+	uint32_t min;
+	uint32_t max;
+} platform_voltage_window_s;
+
+void platform_target_voltage_window(platform_voltage_window_s *window);
+/* Latch VREF going below threshold until the next call, 0 stops watching */
+void platform_target_voltage_watch(uint32_t threshold);
+bool platform_target_voltage_sagged(void);
+#endif
 void platform_nrst_set_val(bool assert);
 bool platform_nrst_get_val(void);
 bool platform_target_get_power(void);
@@ -54,4 +85,10 @@ uint32_t platform_max_frequency_get(void);
 
 void platform_target_clk_output_enable(bool enable);
 
+#ifdef PLATFORM_HAS_SETTINGS
+/* A small block of settings kept across power cycles, read returns false if none were saved */
+bool platform_settings_read(void *data, size_t len);
+bool platform_settings_write(const void *data, size_t len);
+#endif
+
 #endif /* INCLUDE_PLATFORM_SUPPORT_H */
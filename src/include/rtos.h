@@ -0,0 +1,74 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef INCLUDE_RTOS_H
+#define INCLUDE_RTOS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "target.h"
+
+/*
+ * RTOS awareness: the tasks of a FreeRTOS kernel on a Cortex-M, found through
+ * the kernel symbols GDB looks up for us with qSymbol, shown to GDB as threads
+ * next to the cores. Each task is known by the address of its TCB.
+ */
+#if PC_HOSTED == 1
+#define RTOS_MAX_TASKS 64U
+#else
+#define RTOS_MAX_TASKS 24U
+#endif
+#define RTOS_TASK_NAME_LEN 16U
+/* r0-r15 and xPSR, the start of the Cortex-M GDB register map */
+#define RTOS_TASK_REGS 17U
+
+typedef enum rtos_task_state {
+	RTOS_TASK_READY,
+	RTOS_TASK_BLOCKED,
+	RTOS_TASK_SUSPENDED,
+} rtos_task_state_e;
+
+typedef struct rtos_task {
+	uint32_t tcb;
+	uint32_t top_of_stack;
+	rtos_task_state_e state;
+	char name[RTOS_TASK_NAME_LEN + 1U];
+} rtos_task_s;
+
+/* The kernel symbols to ask GDB for, NULL past the last */
+const char *rtos_symbol(size_t index);
+/* Records the address GDB gave for a symbol, 0 when it doesn't know it */
+void rtos_symbol_set(const char *name, uint32_t addr);
+/* New symbols are on their way, forget the old ones and everything read with them */
+void rtos_symbols_reset(void);
+
+/* The target is about to run or had its memory written, the next query scans the kernel again */
+void rtos_invalidate(void);
+/*
+ * The tasks other than the one running on the core, scanned once per stop.
+ * Returns how many there are, 0 if no kernel was found or it isn't started yet.
+ */
+size_t rtos_tasks(target *t, const rtos_task_s **tasks);
+const rtos_task_s *rtos_task_find(target *t, uint32_t tcb);
+/* Name of the task running on the core, NULL if there is none */
+const char *rtos_current_task(target *t);
+/* The registers a task not running saved on its stack when switched out, false if they can't be decoded */
+bool rtos_task_regs(target *t, uint32_t tcb, uint32_t *regs);
+
+#endif /* INCLUDE_RTOS_H */
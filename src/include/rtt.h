@@ -34,12 +34,14 @@ extern char rtt_ident[16];	    // string
 extern bool rtt_enabled;	    // rtt on/off
 extern bool rtt_found;              // control block found
 extern uint32_t rtt_cbaddr;         // control block address
-extern uint32_t rtt_min_poll_ms;    // min time between polls (ms)
+extern uint32_t rtt_symbol_addr;    // control block address looked up from GDB, 0 if unknown
+extern uint32_t rtt_min_poll_ms;    // min time between polls (ms), 0 for as fast as rtt allows
 extern uint32_t rtt_max_poll_ms;    // max time between polls (ms)
 extern uint32_t rtt_max_poll_errs;  // max number of errors before disconnect
 extern bool rtt_auto_channel;       // manual or auto channel selection
 extern bool rtt_flag_skip;          // skip if host-to-target fifo full
 extern bool rtt_flag_block;         // block if host-to-target fifo full
+extern bool rtt_watch;              // watchpoints on up buffer write offsets trigger reads
 
 struct rtt_channel_struct {
 	bool is_enabled;            // does user want to see this channel?
@@ -54,8 +56,28 @@ struct rtt_channel_struct {
 
 extern struct rtt_channel_struct rtt_channel[MAX_RTT_CHAN];
 
+struct rtt_stats_struct {
+	uint32_t bytes;             // bytes moved, up for output channels, down for input channels
+	uint32_t polls;             // times the channel was looked at
+	uint32_t empty_polls;       // polls that found nothing to move
+	uint32_t errors;            // polls that failed to access target memory
+	uint32_t overflows;         // times the host side couldn't take or hold all the data
+};
+
+extern struct rtt_stats_struct rtt_stats[MAX_RTT_CHAN];
+extern uint32_t rtt_polls;          // polls since the stats were reset
+extern uint64_t rtt_poll_time_us;   // time spanned by those polls
+
 // true if target memory access does not work when target running
 bool target_no_background_memory_access(target *cur_target);
-void poll_rtt(target *cur_target);
+// poll now, returns the microseconds until the next poll is due
+uint32_t poll_rtt(target *cur_target);
+// true if the target stopped on an rtt watchpoint, rtt has then been serviced and the target resumed
+bool rtt_watch_hit(target *cur_target, target_addr_t watch);
+void rtt_watch_disarm(target *cur_target);
+// data for the host was lost on channel, RTT_DOWN_ANY for down data not yet tied to a channel
+#define RTT_DOWN_ANY UINT32_MAX
+void rtt_host_overflow(uint32_t channel);
+void rtt_stats_reset(void);
 
 #endif /* INCLUDE_RTT_H */
@@ -53,11 +53,38 @@ int rtt_if_init(void);
 /* hosted teardown */
 int rtt_if_exit(void);
 
+/* channel is the rtt channel the data belongs to, interfaces that only have one stream ignore it */
+
 /* target to host: write len bytes from the buffer starting at buf. return number bytes written */
-uint32_t rtt_write(const char *buf, uint32_t len);
+uint32_t rtt_write(uint32_t channel, const char *buf, uint32_t len);
+/* target to host: number of bytes rtt_write can take without dropping any */
+uint32_t rtt_write_space(uint32_t channel);
 /* host to target: read one character, non-blocking. return character, -1 if no character */
-int32_t rtt_getchar();
+int32_t rtt_getchar(uint32_t channel);
 /* host to target: true if no characters available for reading */
-bool rtt_nodata();
+bool rtt_nodata(uint32_t channel);
+
+#if PC_HOSTED == 1
+/* first of the tcp ports channels are served on, one port per channel, 0 for the terminal */
+extern uint16_t rtt_if_port;
+
+/* when set, target to host data goes here instead of the terminal or tcp ports, and nothing comes back */
+typedef struct rtt_if_sink {
+	uint32_t (*write)(uint32_t channel, const char *buf, uint32_t len);
+	uint32_t (*space)(uint32_t channel);
+} rtt_if_sink_s;
+
+extern const rtt_if_sink_s *rtt_if_sink;
+
+#if defined(ENABLE_RTT) && !defined(_WIN32) && !defined(__CYGWIN__)
+#include <sys/select.h>
+/* the rtt tcp sockets are waited on together with the gdb ones */
+#define RTT_IF_SELECT
+/* add the sockets there is something to wait for on to fds, returns the highest one or -1 */
+int rtt_if_fdset(fd_set *fds);
+/* deal with the sockets select() found ready in fds, returns how many of them were */
+int rtt_if_serve(const fd_set *fds);
+#endif
+#endif
 
 #endif /* INCLUDE_RTT_IF_H */
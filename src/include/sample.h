@@ -0,0 +1,54 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef INCLUDE_SAMPLE_H
+#define INCLUDE_SAMPLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "target.h"
+#include "rtt.h"
+
+/*
+ * Live variable sampling: ranges of target memory read every period while the
+ * target runs, each read sent to the host as a line of
+ * "<time_us> <addr> <hex bytes>" on the rtt_write() channel after the RTT ones.
+ */
+#define SAMPLE_MAX_RANGES 8U
+#define SAMPLE_MAX_LEN    64U
+#define SAMPLE_CHANNEL    MAX_RTT_CHAN
+
+typedef struct sample_range {
+	target_addr_t addr;
+	size_t len;
+	uint32_t period_us;
+	uint32_t samples;
+	uint32_t dropped; /* read, but the host side had no room for the line */
+	uint32_t errors;
+} sample_range_s;
+
+/* Adds a range, or changes the period of one already there, false when full or too long */
+bool sample_add(target_addr_t addr, size_t len, uint32_t period_us);
+void sample_clear(void);
+size_t sample_ranges(const sample_range_s **ranges);
+
+/* Samples every range that is due, returns the microseconds until the next one is */
+uint32_t poll_sample(target *t);
+
+#endif /* INCLUDE_SAMPLE_H */
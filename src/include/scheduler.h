@@ -0,0 +1,48 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * Copyright (C) 2022  Black Sphere Technologies Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* This file implements a small cooperative scheduler for the work done in the
+ * background of the GDB server, such as polling RTT while the target runs.
+ */
+
+#ifndef INCLUDE_SCHEDULER_H
+#define INCLUDE_SCHEDULER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SCHEDULER_MAX_TASKS 8U
+
+/* A task does its work and returns how many microseconds it wants to be left alone for */
+typedef uint32_t (*scheduler_task_fn)(void);
+
+/* Add a task, due right away, adding one that is already there only makes it due right away */
+void scheduler_add(scheduler_task_fn task);
+void scheduler_remove(scheduler_task_fn task);
+/* Run every task that is due */
+void scheduler_run(void);
+/*
+ * For loops waiting on GDB or the target: run every task that is due, then say whether
+ * the caller may sleep until the next interrupt, with nothing due before the next tick.
+ */
+bool scheduler_yield(void);
+/* Microseconds until the next task is due, UINT32_MAX with no tasks */
+uint32_t scheduler_next_us(void);
+
+#endif /* INCLUDE_SCHEDULER_H */
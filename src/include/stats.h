@@ -0,0 +1,95 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * Copyright (C) 2022  Black Sphere Technologies Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef INCLUDE_STATS_H
+#define INCLUDE_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Byte and event counters, dumped by 'monitor stats' */
+typedef enum stats_counter {
+	STATS_GDB_RX_BYTES,
+	STATS_GDB_TX_BYTES,
+	STATS_MEM_READ_BYTES,
+	STATS_MEM_WRITE_BYTES,
+	STATS_MEM_CACHED_BYTES,
+	STATS_FLASH_ERASE_BYTES,
+	STATS_FLASH_WRITE_BYTES,
+	STATS_FLASH_SKIPPED_BYTES,
+	STATS_FLASH_VERIFY_BYTES,
+	STATS_FLASH_BUSY_POLLS,
+	STATS_FLASH_BUSY_US,
+	STATS_DP_WAIT,
+	STATS_DP_FAULT,
+	STATS_DP_RETRY_EXHAUSTED,
+	STATS_RTT_UP_BYTES,
+	STATS_RTT_DOWN_BYTES,
+	STATS_RTT_POLLS,
+	STATS_RTT_HOST_OVERFLOWS,
+	STATS_AUX_UART_RX_BYTES,
+	STATS_AUX_UART_OVERRUNS,
+	STATS_AUX_UART_DROPPED_BYTES,
+	STATS_SWO_BYTES,
+	STATS_SWO_ERRORS,
+	STATS_COUNTER_COUNT,
+} stats_counter_e;
+
+#if PC_HOSTED == 1
+#define STATS_MAX_PACKET_TYPES 48U
+#else
+#define STATS_MAX_PACKET_TYPES 16U
+#endif
+#define STATS_PACKET_NAME_LENGTH 12U
+/* Each histogram bucket covers 8 times the range of the one before it */
+#define STATS_HISTOGRAM_BUCKETS 8U
+#define STATS_HISTOGRAM_SHIFT   3U
+
+typedef struct stats_packet {
+	char name[STATS_PACKET_NAME_LENGTH];
+	uint32_t count;
+	uint32_t max_time;
+	uint64_t total_time;
+	uint64_t total_bytes;
+	uint32_t histogram[STATS_HISTOGRAM_BUCKETS];
+} stats_packet_s;
+
+/* Everything counted, packets in the order their types were first seen */
+typedef struct stats {
+	stats_packet_s packets[STATS_MAX_PACKET_TYPES];
+	uint64_t counters[STATS_COUNTER_COUNT];
+	uint32_t dropped_packets;
+} stats_s;
+
+/* Free running timestamp in the units reported by 'monitor stats' */
+uint32_t stats_timestamp(void);
+
+void stats_add(stats_counter_e counter, uint32_t value);
+/* Bracket the handling of one GDB packet, end accounts it against its packet type */
+void stats_packet_begin(const char *packet, size_t length);
+void stats_packet_end(void);
+
+void stats_print(void);
+void stats_reset(void);
+
+/* For exporting the counts elsewhere than 'monitor stats' */
+const stats_s *stats_get(void);
+const char *stats_counter_name(stats_counter_e counter);
+
+#endif /* INCLUDE_STATS_H */
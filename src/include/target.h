@@ -49,19 +49,42 @@ target *target_attach(target *t, struct target_controller *);
 target *target_attach_n(size_t n, struct target_controller *);
 void target_detach(target *t);
 bool target_attached(target *t);
+/* The cores of the device t is part of, t included, in target list order */
+size_t target_group(target *t, target **cores, size_t max);
 const char *target_driver_name(target *t);
 const char *target_core_name(target *t);
 unsigned int target_designer(target *t);
 unsigned int target_part_id(target *t);
 
 /* Memory access functions */
-bool target_mem_map(target *t, char *buf, size_t len);
+const char *target_mem_map(target *t);
+/* Whether the whole range lies in one RAM region of the memory map */
+bool target_mem_is_ram(target *t, target_addr_t addr, size_t len);
 int target_mem_read(target *t, void *dest, target_addr_t src, size_t len);
 int target_mem_write(target *t, target_addr_t dest, const void *src, size_t len);
+/* One range of a scatter-gather read */
+typedef struct target_iovec {
+	void *dest;
+	target_addr_t src;
+	size_t len;
+} target_iovec_s;
+/* Reads many small independent ranges, as one batch where the probe can queue them */
+int target_mem_readv(target *t, const target_iovec_s *iov, size_t count);
+/* Memory access while the target runs, through its background path if it has one */
+bool target_has_background_mem_access(target *t);
+int target_background_mem_read(target *t, void *dest, target_addr_t src, size_t len);
+int target_background_mem_write(target *t, target_addr_t dest, const void *src, size_t len);
+bool target_mem_crc32(target *t, uint32_t *crc, target_addr_t base, size_t len);
 /* Flash memory access functions */
 bool target_flash_erase(target *t, target_addr_t addr, size_t len);
 bool target_flash_write(target *t, target_addr_t dest, const void *src, size_t len);
+/* As target_flash_write, but whole blocks may be programmed from src itself, which may be changed */
+bool target_flash_write_in_place(target *t, target_addr_t dest, void *src, size_t len);
 bool target_flash_complete(target *t);
+/* Only erase and program the flash blocks whose contents change */
+extern bool target_flash_incremental;
+/* Check each block of flash right after programming it */
+extern bool target_flash_verify;
 
 /* Register access functions */
 size_t target_regs_size(target *t);
@@ -0,0 +1 @@
+#define TARGET_DRIVERS "ch32 efm32 kinetis lmi lpc msp432 nrf renesas rp sam stm32"
@@ -25,7 +25,19 @@ struct platform_timeout {
 	uint32_t time;
 };
 
+struct platform_timeout_us {
+	uint32_t time;
+};
+
+/* Spaces out the polls of something slow: the first go back to back, then the gaps double up to a limit */
+struct platform_backoff {
+	uint32_t interval_us;
+	uint32_t max_us;
+};
+
 extern int32_t swj_delay_cnt;
 uint32_t platform_time_ms(void);
+/* Free running microsecond count, wrapping at 2^32, for intervals shorter than the ms tick resolves */
+uint32_t platform_time_us(void);
 
 #endif /* INCLUDE_TIMING_H */
@@ -0,0 +1 @@
+#define FIRMWARE_VERSION "bb1092f-dirty"
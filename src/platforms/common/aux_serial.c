@@ -36,17 +36,22 @@
 #include "general.h"
 #include "usb_serial.h"
 #include "aux_serial.h"
+#include "stats.h"
 
-static char aux_serial_receive_buffer[AUX_UART_BUFFER_SIZE];
+/*
+ * USB packets are sent straight out of this ring, and the packet memory copy may read one byte
+ * past an odd length, so the ring has a byte of slack at its end.
+ */
+static char aux_serial_receive_buffer[AUX_UART_RX_BUFFER_SIZE + 1U];
 /* Fifo in pointer, writes assumed to be atomic, should be only incremented within RX ISR */
-static uint8_t aux_serial_receive_write_index = 0;
+static uint16_t aux_serial_receive_write_index = 0;
 /* Fifo out pointer, writes assumed to be atomic, should be only incremented outside RX ISR */
-static uint8_t aux_serial_receive_read_index = 0;
+static uint16_t aux_serial_receive_read_index = 0;
 
 #if defined(STM32F0) || defined(STM32F1) || defined(STM32F3) || defined(STM32F4)
 static char aux_serial_transmit_buffer[2U][AUX_UART_BUFFER_SIZE];
 static uint8_t aux_serial_transmit_buffer_index = 0;
-static uint8_t aux_serial_transmit_buffer_consumed = 0;
+static uint16_t aux_serial_transmit_buffer_consumed = 0;
 static bool aux_serial_transmit_complete = true;
 
 static volatile uint8_t aux_serial_led_state = 0;
@@ -98,6 +103,8 @@ void aux_serial_init(void)
 	usart_set_parity(USBUSART, USART_PARITY_NONE);
 	usart_set_flow_control(USBUSART, USART_FLOWCONTROL_NONE);
 	USART_CR1(USBUSART) |= USART_CR1_IDLEIE;
+	/* Overruns only raise an interrupt with DMA reception through the error interrupt */
+	usart_enable_error_interrupt(USBUSART);
 
 	/* Setup USART TX DMA */
 #if !defined(USBUSART_TDR) && defined(USBUSART_DR)
@@ -130,7 +137,7 @@ void aux_serial_init(void)
 	dma_channel_reset(USBUSART_DMA_BUS, USBUSART_DMA_RX_CHAN);
 	dma_set_peripheral_address(USBUSART_DMA_BUS, USBUSART_DMA_RX_CHAN, (uintptr_t)&USBUSART_RDR);
 	dma_set_memory_address(USBUSART_DMA_BUS, USBUSART_DMA_RX_CHAN, (uintptr_t)aux_serial_receive_buffer);
-	dma_set_number_of_data(USBUSART_DMA_BUS, USBUSART_DMA_RX_CHAN, AUX_UART_BUFFER_SIZE);
+	dma_set_number_of_data(USBUSART_DMA_BUS, USBUSART_DMA_RX_CHAN, AUX_UART_RX_BUFFER_SIZE);
 	dma_enable_memory_increment_mode(USBUSART_DMA_BUS, USBUSART_DMA_RX_CHAN);
 	dma_enable_circular_mode(USBUSART_DMA_BUS, USBUSART_DMA_RX_CHAN);
 	dma_set_peripheral_size(USBUSART_DMA_BUS, USBUSART_DMA_RX_CHAN, DMA_PSIZE_8BIT);
@@ -301,11 +308,26 @@ void aux_serial_send(const size_t len)
 	}
 }
 
+/*
+ * The half and full transfer interrupts bring us here at least twice per lap of the ring, so how far
+ * the DMA moved since the last time is unambiguous. If it moved past the data not yet sent, the ring
+ * overflowed and none of what it holds can be trusted: count it all as dropped and carry on from
+ * where the DMA is.
+ */
 void aux_serial_update_receive_buffer_fullness(void)
 {
-	aux_serial_receive_write_index =
-		AUX_UART_BUFFER_SIZE - dma_get_number_of_data(USBUSART_DMA_BUS, USBUSART_DMA_RX_CHAN);
-	aux_serial_receive_write_index %= AUX_UART_BUFFER_SIZE;
+	const uint16_t write_index =
+		(AUX_UART_RX_BUFFER_SIZE - dma_get_number_of_data(USBUSART_DMA_BUS, USBUSART_DMA_RX_CHAN)) &
+		(AUX_UART_RX_BUFFER_SIZE - 1U);
+	const uint16_t pending =
+		(aux_serial_receive_write_index - aux_serial_receive_read_index) & (AUX_UART_RX_BUFFER_SIZE - 1U);
+	const uint16_t received = (write_index - aux_serial_receive_write_index) & (AUX_UART_RX_BUFFER_SIZE - 1U);
+	aux_serial_receive_write_index = write_index;
+	stats_add(STATS_AUX_UART_RX_BYTES, received);
+	if (pending + received >= AUX_UART_RX_BUFFER_SIZE) {
+		stats_add(STATS_AUX_UART_DROPPED_BYTES, pending + received);
+		aux_serial_receive_read_index = write_index;
+	}
 }
 
 bool aux_serial_receive_buffer_empty(void)
@@ -321,18 +343,27 @@ void aux_serial_drain_receive_buffer(void)
 
 void aux_serial_stage_receive_buffer(void)
 {
-	aux_serial_receive_read_index = debug_serial_fifo_send(
-		aux_serial_receive_buffer, aux_serial_receive_read_index, aux_serial_receive_write_index);
+	aux_serial_receive_read_index = debug_serial_fifo_send(aux_serial_receive_buffer, aux_serial_receive_read_index,
+		aux_serial_receive_write_index, AUX_UART_RX_BUFFER_SIZE);
 }
 
 static void aux_serial_receive_isr(const uint32_t usart, const uint8_t dma_irq)
 {
 	nvic_disable_irq(dma_irq);
 
-	/* Get IDLE flag and reset interrupt flags */
+	/* Get IDLE and overrun flags and reset interrupt flags */
 	const bool is_idle = usart_get_flag(usart, USART_FLAG_IDLE);
+	const bool is_overrun = usart_get_flag(usart, USART_FLAG_ORE);
 	usart_recv(usart);
 
+	/* A byte arrived before DMA got to the one before it */
+	if (is_overrun) {
+#ifdef USART_ICR
+		USART_ICR(usart) = USART_ICR_ORECF;
+#endif
+		stats_add(STATS_AUX_UART_OVERRUNS, 1);
+	}
+
 	/* If line is now idle, then transmit a packet */
 	if (is_idle) {
 #ifdef USART_ICR
@@ -494,12 +525,12 @@ void USBUART_ISR(void)
 		/* If the next increment of rx_in would put it at the same point
 		* as rx_out, the FIFO is considered full.
 		*/
-		if (((aux_serial_receive_write_index + 1) % AUX_UART_BUFFER_SIZE) != aux_serial_receive_read_index) {
+		if (((aux_serial_receive_write_index + 1) % AUX_UART_RX_BUFFER_SIZE) != aux_serial_receive_read_index) {
 			/* insert into FIFO */
 			aux_serial_receive_buffer[aux_serial_receive_write_index++] = c;
 
 			/* wrap out pointer */
-			if (aux_serial_receive_write_index >= AUX_UART_BUFFER_SIZE)
+			if (aux_serial_receive_write_index >= AUX_UART_RX_BUFFER_SIZE)
 				aux_serial_receive_write_index = 0;
 		} else
 			flush = true;
@@ -521,13 +552,13 @@ void USBUART_ISR(void)
 			packet_buf[packet_size++] = aux_serial_receive_buffer[buf_out++];
 
 			/* wrap out pointer */
-			if (buf_out >= AUX_UART_BUFFER_SIZE)
+			if (buf_out >= AUX_UART_RX_BUFFER_SIZE)
 				buf_out = 0;
 		}
 
 		/* advance fifo out pointer by amount written */
 		aux_serial_receive_read_index += usbd_ep_write_packet(usbdev, CDCACM_UART_ENDPOINT, packet_buf, packet_size);
-		aux_serial_receive_read_index %= AUX_UART_BUFFER_SIZE;
+		aux_serial_receive_read_index %= AUX_UART_RX_BUFFER_SIZE;
 	}
 }
 #endif
@@ -25,18 +25,40 @@
 #include <libopencm3/usb/cdc.h>
 
 #if defined(STM32F0) || defined(STM32F1) || defined(STM32F3) || defined(STM32F4)
+/*
+ * Both buffer sizes may be set by the platform. USART_DMA_BUF_SHIFT sizes each half of the
+ * double buffered transmit path, AUX_UART_RX_BUFFER_SHIFT the ring receive DMA runs around,
+ * which has to hold everything arriving while USB isn't draining it: 512 bytes last 1.7ms at 3Mbaud.
+ */
+#ifndef USART_DMA_BUF_SHIFT
 /* XXX: Does the st_usbfs_v2_usb_driver work on F3 with 128 byte buffers? */
-#if defined(STM32F1) || defined(STM32F3) || defined(STM32F4)
+#if defined(USB_HS)
+/* At least one high-speed packet */
+#define USART_DMA_BUF_SHIFT 9U
+#elif defined(STM32F1) || defined(STM32F3) || defined(STM32F4)
 #define USART_DMA_BUF_SHIFT 7U
 #elif defined(STM32F0)
 /* The st_usbfs_v2_usb_driver only works with up to 64-byte buffers on the F0 parts */
 #define USART_DMA_BUF_SHIFT 6U
 #endif
+#endif
+
+#ifndef AUX_UART_RX_BUFFER_SHIFT
+#if defined(USB_HS) || defined(STM32F4)
+#define AUX_UART_RX_BUFFER_SHIFT 11U
+#elif defined(STM32F0)
+#define AUX_UART_RX_BUFFER_SHIFT 8U
+#else
+#define AUX_UART_RX_BUFFER_SHIFT 9U
+#endif
+#endif
 
 #define USART_DMA_BUF_SIZE  (1U << USART_DMA_BUF_SHIFT)
 #define AUX_UART_BUFFER_SIZE (USART_DMA_BUF_SIZE)
+#define AUX_UART_RX_BUFFER_SIZE (1U << AUX_UART_RX_BUFFER_SHIFT)
 #elif defined(LM4F)
 #define AUX_UART_BUFFER_SIZE 128
+#define AUX_UART_RX_BUFFER_SIZE AUX_UART_BUFFER_SIZE
 #endif
 
 void aux_serial_init(void);
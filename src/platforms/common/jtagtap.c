@@ -26,6 +26,11 @@
 #include "jtagtap.h"
 #include "gdb_packet.h"
 
+#ifdef PLATFORM_HAS_JTAG_SPI
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/spi.h>
+#endif
+
 jtag_proc_t jtag_proc;
 
 static void jtagtap_reset(void);
@@ -47,6 +52,10 @@ int jtagtap_init()
 	jtag_proc.jtagtap_tdi_seq = jtagtap_tdi_seq;
 	jtag_proc.jtagtap_cycle = jtagtap_cycle;
 	jtag_proc.tap_idle_cycles = 1;
+#ifdef PLATFORM_HAS_JTAG_SPI
+	if (JTAG_SPI_AVAILABLE())
+		rcc_periph_clock_enable(JTAG_SPI_RCC);
+#endif
 
 	/* Go to JTAG mode for SWJ-DP */
 	for (size_t i = 0; i <= 50U; ++i)
@@ -195,10 +204,73 @@ static void jtagtap_tdi_tdo_seq_no_delay(const uint8_t *const data_in, uint8_t *
 		data_out[byte] = value;
 }
 
-static void jtagtap_tdi_tdo_seq(uint8_t *const data_out, const bool final_tms, const uint8_t *const data_in, size_t ticks)
+#ifdef PLATFORM_HAS_JTAG_SPI
+/*
+ * Pick the SPI baud rate divider that stays at or below the configured JTAG clock.
+ * Returns false if even the slowest SPI clock is too fast, so the caller bit-bangs.
+ */
+static bool jtagtap_spi_baudrate(uint32_t *const baudrate)
+{
+	if (!JTAG_SPI_AVAILABLE())
+		return false;
+	const uint32_t frequency = platform_max_frequency_get();
+	uint32_t divider = 0;
+	while (divider < 7U && (rcc_apb2_frequency >> (divider + 1U)) > frequency)
+		++divider;
+	if ((rcc_apb2_frequency >> (divider + 1U)) > frequency)
+		return false;
+	/* SPI_CR1_BAUDRATE_FPCLK_DIV_2 .. _DIV_256 are the divider shifted into the BR field */
+	*baudrate = divider << 3U;
+	return true;
+}
+
+/*
+ * Shift whole bytes through the SPI peripheral with TMS held low. SPI mode 0, LSB first,
+ * matches JTAG: TDI changes on the falling edge and TDO is sampled on the rising edge.
+ */
+static void jtagtap_spi_shift(
+	const uint8_t *const data_in, uint8_t *const data_out, const size_t bytes, const uint32_t baudrate)
+{
+	spi_init_master(JTAG_SPI, baudrate, SPI_CR1_CPOL_CLK_TO_0_WHEN_IDLE, SPI_CR1_CPHA_CLK_TRANSITION_1,
+		SPI_CR1_DFF_8BIT, SPI_CR1_LSBFIRST);
+	spi_enable_software_slave_management(JTAG_SPI);
+	spi_set_nss_high(JTAG_SPI);
+	spi_enable(JTAG_SPI);
+	JTAG_SPI_PINS_SPI();
+	for (size_t i = 0; i < bytes; ++i) {
+		const uint8_t value = spi_xfer(JTAG_SPI, data_in[i]);
+		if (data_out)
+			data_out[i] = value;
+	}
+	while (SPI_SR(JTAG_SPI) & SPI_SR_BSY)
+		continue;
+	JTAG_SPI_PINS_GPIO();
+	spi_disable(JTAG_SPI);
+}
+
+/* Returns the number of cycles left for bit-banging after shifting what can go through SPI */
+static size_t jtagtap_spi_seq(const uint8_t **data_in, uint8_t **data_out, const size_t clock_cycles)
+{
+	uint32_t baudrate;
+	/* Keep at least the final cycle, it carries the TMS transition */
+	const size_t bytes = clock_cycles > 8U ? (clock_cycles - 1U) >> 3U : 0;
+	if (!bytes || !jtagtap_spi_baudrate(&baudrate))
+		return clock_cycles;
+	jtagtap_spi_shift(*data_in, *data_out, bytes, baudrate);
+	*data_in += bytes;
+	if (*data_out)
+		*data_out += bytes;
+	return clock_cycles - (bytes << 3U);
+}
+#endif
+
+static void jtagtap_tdi_tdo_seq(uint8_t *data_out, const bool final_tms, const uint8_t *data_in, size_t ticks)
 {
 	gpio_clear(TMS_PORT, TMS_PIN);
 	gpio_clear(TDI_PORT, TDI_PIN);
+#ifdef PLATFORM_HAS_JTAG_SPI
+	ticks = jtagtap_spi_seq(&data_in, &data_out, ticks);
+#endif
 	if (swd_delay_cnt)
 		jtagtap_tdi_tdo_seq_swd_delay(data_in, data_out, final_tms, ticks);
 	else
@@ -249,9 +321,13 @@ static void jtagtap_tdi_seq_no_delay(const uint8_t *const data_in, const bool fi
 	}
 }
 
-static void jtagtap_tdi_seq(const bool final_tms, const uint8_t *const data_in, const size_t ticks)
+static void jtagtap_tdi_seq(const bool final_tms, const uint8_t *data_in, size_t ticks)
 {
 	gpio_clear(TMS_PORT, TMS_PIN);
+#ifdef PLATFORM_HAS_JTAG_SPI
+	uint8_t *no_data_out = NULL;
+	ticks = jtagtap_spi_seq(&data_in, &no_data_out, ticks);
+#endif
 	if (swd_delay_cnt)
 		jtagtap_tdi_seq_swd_delay(data_in, final_tms, ticks);
 	else
@@ -0,0 +1,199 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * RTT on a vendor bulk interface of its own, built with RTT_USB=1, leaving the aux
+ * UART to the target's console. All channels share the one pair of endpoints, each
+ * packet carrying data for a single channel after a one byte header giving its number:
+ *  - IN packets hold data from an up channel, or from live sampling on MAX_RTT_CHAN.
+ *  - OUT packets hold data for a down channel.
+ * Packets are kept shorter than the endpoint size, so no zero length packets are needed.
+ *
+ * Each up channel has its own flow control. The host says with RTT_USB_REQ_CLOSE which
+ * channels it isn't reading, those report no space, so a blocking channel waits and the
+ * others drop while the channels that are read carry on. Down data queues in order of
+ * arrival, and with blocking set the host is held off while the queue is full.
+ */
+
+#include <libopencm3/cm3/nvic.h>
+
+#include "general.h"
+#include "platform.h"
+#include "rtt.h"
+#include "rtt_if.h"
+#include "rtt_usb.h"
+
+#define RTT_USB_PAYLOAD    (RTT_ENDPOINT_SIZE - 2U)
+#define RTT_USB_TX_PACKETS (RTT_UP_BUF_SIZE / RTT_ENDPOINT_SIZE)
+#define RTT_USB_RX_PACKETS (RTT_DOWN_BUF_SIZE / RTT_ENDPOINT_SIZE)
+
+#if RTT_USB_RX_PACKETS < 2
+#error "RTT_DOWN_BUF_SIZE has to hold at least two RTT packets"
+#endif
+
+/* Packets for the host, the main loop adds at tx_head and the USB interrupt sends from tx_tail */
+static uint8_t tx_packet[RTT_USB_TX_PACKETS][RTT_ENDPOINT_SIZE];
+static uint16_t tx_len[RTT_USB_TX_PACKETS];
+static volatile uint32_t tx_head;
+static volatile uint32_t tx_tail;
+
+/* Packets from the host, the other way round, rx_offset is how far the oldest was read */
+static uint8_t rx_packet[RTT_USB_RX_PACKETS][RTT_ENDPOINT_SIZE];
+static uint16_t rx_len[RTT_USB_RX_PACKETS];
+static volatile uint32_t rx_head;
+static volatile uint32_t rx_tail;
+static uint32_t rx_offset;
+
+/* Up channels the host reads, one bit each and one for sampling */
+static uint32_t rtt_usb_open = UINT32_MAX;
+
+/* Send the next packet if the endpoint is free, called from the interrupt or with it masked */
+static void rtt_usb_send(usbd_device *dev, uint8_t ep)
+{
+	(void)ep;
+	if (tx_tail == tx_head)
+		return;
+	const uint32_t slot = tx_tail % RTT_USB_TX_PACKETS;
+	if (usbd_ep_write_packet(dev, RTT_ENDPOINT | USB_REQ_TYPE_IN, tx_packet[slot], tx_len[slot]) == tx_len[slot])
+		++tx_tail;
+}
+
+static void rtt_usb_receive(usbd_device *dev, uint8_t ep)
+{
+	if (rx_head - rx_tail == RTT_USB_RX_PACKETS) {
+		/* No room, so take the packet off the endpoint and drop it */
+		uint8_t packet[RTT_ENDPOINT_SIZE];
+		usbd_ep_read_packet(dev, ep, packet, sizeof(packet));
+		rtt_host_overflow(RTT_DOWN_ANY);
+		return;
+	}
+	const uint32_t slot = rx_head % RTT_USB_RX_PACKETS;
+	rx_len[slot] = usbd_ep_read_packet(dev, ep, rx_packet[slot], RTT_ENDPOINT_SIZE);
+	/* A packet needs a channel and some data for it */
+	if (rx_len[slot] < 2U)
+		return;
+	++rx_head;
+	if (rtt_flag_block && rx_head - rx_tail == RTT_USB_RX_PACKETS)
+		usbd_ep_nak_set(dev, ep, 1);
+}
+
+static void rtt_usb_rx_release(void)
+{
+	rx_offset = 0;
+	++rx_tail;
+	usbd_ep_nak_set(usbdev, RTT_ENDPOINT, 0);
+}
+
+/* The oldest packet from the host, after dropping any for channels that don't take input */
+static const uint8_t *rtt_usb_rx_next(void)
+{
+	while (rx_tail != rx_head) {
+		const uint8_t *const packet = rx_packet[rx_tail % RTT_USB_RX_PACKETS];
+		const uint32_t channel = packet[0];
+		if (channel < MAX_RTT_CHAN && rtt_channel[channel].is_enabled && rtt_channel[channel].is_configured &&
+			!rtt_channel[channel].is_output)
+			return packet;
+		rtt_host_overflow(RTT_DOWN_ANY);
+		rtt_usb_rx_release();
+	}
+	return NULL;
+}
+
+static enum usbd_request_return_codes rtt_usb_control_request(usbd_device *dev, struct usb_setup_data *req,
+	uint8_t **buf, uint16_t *len, void (**complete)(usbd_device *dev, struct usb_setup_data *req))
+{
+	(void)dev;
+	(void)buf;
+	(void)len;
+	(void)complete;
+	if (req->wIndex != RTT_IF_NO)
+		return USBD_REQ_NEXT_CALLBACK;
+	if (req->wValue > MAX_RTT_CHAN)
+		return USBD_REQ_NOTSUPP;
+
+	switch (req->bRequest) {
+	case RTT_USB_REQ_OPEN:
+		rtt_usb_open |= 1U << req->wValue;
+		return USBD_REQ_HANDLED;
+	case RTT_USB_REQ_CLOSE:
+		rtt_usb_open &= ~(1U << req->wValue);
+		return USBD_REQ_HANDLED;
+	}
+	return USBD_REQ_NOTSUPP;
+}
+
+void rtt_usb_set_config(usbd_device *dev, uint16_t value)
+{
+	(void)value;
+	tx_head = tx_tail = 0;
+	rx_head = rx_tail = 0;
+	rx_offset = 0;
+	rtt_usb_open = UINT32_MAX;
+	usbd_ep_setup(dev, RTT_ENDPOINT, USB_ENDPOINT_ATTR_BULK, RTT_ENDPOINT_SIZE, rtt_usb_receive);
+	usbd_ep_setup(dev, RTT_ENDPOINT | USB_REQ_TYPE_IN, USB_ENDPOINT_ATTR_BULK, RTT_ENDPOINT_SIZE, rtt_usb_send);
+	usbd_register_control_callback(dev, USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_INTERFACE,
+		USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT, rtt_usb_control_request);
+}
+
+/* rtt host to target: read one character */
+int32_t rtt_getchar(uint32_t channel)
+{
+	const uint8_t *const packet = rtt_usb_rx_next();
+	if (!packet || packet[0] != channel)
+		return -1;
+	const int32_t c = packet[1U + rx_offset++];
+	if (1U + rx_offset == rx_len[rx_tail % RTT_USB_RX_PACKETS])
+		rtt_usb_rx_release();
+	return c;
+}
+
+/* rtt host to target: true if no characters available for reading */
+bool rtt_nodata(uint32_t channel)
+{
+	const uint8_t *const packet = rtt_usb_rx_next();
+	return !packet || packet[0] != channel;
+}
+
+/* rtt target to host: what fits in the free packets, none for a channel the host isn't reading */
+uint32_t rtt_write_space(uint32_t channel)
+{
+	if (!usbdev || !usb_get_config() || channel > MAX_RTT_CHAN || !(rtt_usb_open & (1U << channel)))
+		return 0;
+	return (RTT_USB_TX_PACKETS - (tx_head - tx_tail)) * RTT_USB_PAYLOAD;
+}
+
+/* rtt target to host: queue what fits, returns how much that was */
+uint32_t rtt_write(uint32_t channel, const char *buf, uint32_t len)
+{
+	if (!rtt_write_space(channel))
+		return 0;
+	uint32_t done = 0;
+	while (done < len && tx_head - tx_tail < RTT_USB_TX_PACKETS) {
+		const uint32_t slot = tx_head % RTT_USB_TX_PACKETS;
+		const uint32_t count = MIN(len - done, RTT_USB_PAYLOAD);
+		tx_packet[slot][0] = channel;
+		memcpy(tx_packet[slot] + 1U, buf + done, count);
+		tx_len[slot] = count + 1U;
+		++tx_head;
+		done += count;
+	}
+	/* Start sending unless a packet is already on its way, whose completion sends the next */
+	nvic_disable_irq(USB_IRQ);
+	rtt_usb_send(usbdev, RTT_ENDPOINT | USB_REQ_TYPE_IN);
+	nvic_enable_irq(USB_IRQ);
+	return done;
+}
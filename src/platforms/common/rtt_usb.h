@@ -0,0 +1,29 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PLATFORMS_COMMON_RTT_USB_H
+#define PLATFORMS_COMMON_RTT_USB_H
+
+#include "usb.h"
+
+/* Vendor requests on the RTT interface, wValue is the channel, wIndex the interface */
+#define RTT_USB_REQ_OPEN  0x01U /* the host reads the up channel, the default for all of them */
+#define RTT_USB_REQ_CLOSE 0x02U /* the host has stopped reading the up channel */
+
+void rtt_usb_set_config(usbd_device *dev, uint16_t value);
+
+#endif /* PLATFORMS_COMMON_RTT_USB_H */
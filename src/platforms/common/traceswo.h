@@ -25,7 +25,20 @@
 #if defined TRACESWO_PROTOCOL && TRACESWO_PROTOCOL == 2
 /* Default line rate, used as default for a request without baudrate */
 #define SWO_DEFAULT_BAUD (2250000)
-void traceswo_init(uint32_t baudrate, uint32_t swo_chan_bitmask);
+/* returns the baudrate in use, requests above what the USART can do get its maximum */
+uint32_t traceswo_init(uint32_t baudrate, uint32_t swo_chan_bitmask);
+
+/* counters for 'monitor traceswo status' */
+typedef struct traceswo_stats {
+	uint32_t baudrate;
+	uint32_t max_baudrate;
+	uint32_t bytes_received;
+	uint32_t bytes_sent;
+	uint32_t overrun_bytes; /* lost as USB didn't keep up */
+	uint32_t uart_overruns; /* times the DMA didn't keep up with the USART */
+} traceswo_stats_s;
+
+void traceswo_get_stats(traceswo_stats_s *stats);
 #else
 void traceswo_init(uint32_t swo_chan_bitmask);
 #endif
@@ -35,6 +48,11 @@ void trace_buf_drain(usbd_device *dev, uint8_t ep);
 /* set bitmask of swo channels to be decoded */
 void traceswo_setmask(uint32_t mask);
 
+/* Summary window used when none is given */
+#define SWO_AGGREGATE_DEFAULT_MS 1000U
+/* set bitmask of decoded channels to be summarised every window_ms instead of forwarded */
+void traceswo_setaggregate(uint32_t mask, uint32_t window_ms);
+
 /* print decoded swo packet on usb serial */
 uint16_t traceswo_decode(usbd_device *usbd_dev, uint8_t addr,
 				const void *buf, uint16_t len);
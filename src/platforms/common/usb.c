@@ -25,6 +25,9 @@
 #include "usb_descriptors.h"
 #include "usb_serial.h"
 #include "usb_dfu_stub.h"
+#ifdef RTT_USB
+#include "rtt_usb.h"
+#endif
 #include "serialno.h"
 
 usbd_device *usbdev = NULL;
@@ -42,6 +45,9 @@ void blackmagic_usb_init(void)
 
 	usbd_register_set_config_callback(usbdev, usb_serial_set_config);
 	usbd_register_set_config_callback(usbdev, dfu_set_config);
+#ifdef RTT_USB
+	usbd_register_set_config_callback(usbdev, rtt_usb_set_config);
+#endif
 
 	nvic_set_priority(USB_IRQ, IRQ_PRI_USB);
 	nvic_enable_irq(USB_IRQ);
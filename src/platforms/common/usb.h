@@ -27,21 +27,64 @@
 extern usbd_device *usbdev;
 extern uint16_t usb_config;
 
-#define CDCACM_PACKET_SIZE 64
+/*
+ * USB_HS=1 builds for high-speed operation, for platforms that drive a ULPI or
+ * internal HS PHY and say so with PLATFORM_HAS_USB_HS, along with the matching
+ * USB_DRIVER, USB_IRQ and USB_ISR. The bulk endpoints then go from 64 to 512
+ * bytes, and the interrupt endpoints count their interval in microframes.
+ */
+#ifdef USB_HS
+#ifndef PLATFORM_HAS_USB_HS
+#error "USB_HS needs a platform with a high-speed USB PHY"
+#endif
+#define CDCACM_PACKET_SIZE 512
+/* 2^(12 - 1) microframes, the 256ms the full-speed value asks for */
+#define USB_NOTIFY_INTERVAL 12
+#else
+#define CDCACM_PACKET_SIZE  64
+#define USB_NOTIFY_INTERVAL 255
+#endif
+#define TRACE_ENDPOINT_SIZE CDCACM_PACKET_SIZE
 
 #define CDCACM_GDB_ENDPOINT  1
 #define CDCACM_UART_ENDPOINT 3
 #define TRACE_ENDPOINT       5
+#define RTT_ENDPOINT         6
+
+/* The F1's packet memory has room for two 32 byte buffers after the others */
+#if defined(STM32F1)
+#define RTT_ENDPOINT_SIZE 32U
+#else
+#define RTT_ENDPOINT_SIZE CDCACM_PACKET_SIZE
+#endif
 
 #define GDB_IF_NO  0
 #define UART_IF_NO 2
 #define DFU_IF_NO  4
 #ifdef PLATFORM_HAS_TRACESWO
-#define TRACE_IF_NO      5
-#define TOTAL_INTERFACES 6
+#define TRACE_IF_NO 5
+#define RTT_IF_NO   6
 #else
-#define TOTAL_INTERFACES 5
+#define RTT_IF_NO 5
 #endif
+/* RTT_USB=1 builds add a vendor interface for RTT, see rtt_usb.c, after the others */
+#ifdef RTT_USB
+#define TOTAL_INTERFACES (RTT_IF_NO + 1)
+#else
+#define TOTAL_INTERFACES RTT_IF_NO
+#endif
+
+/* Alternate setting of the GDB data interface that carries the remote protocol over raw bulk */
+#define GDB_REMOTE_ALTSETTING 1U
+#ifdef PLATFORM_HAS_TRACESWO
+#define GDB_REMOTE_STRING_INDEX 8
+#else
+#define GDB_REMOTE_STRING_INDEX 7
+#endif
+#define RTT_STRING_INDEX (GDB_REMOTE_STRING_INDEX + 1)
+
+/* Currently selected alternate setting of the GDB data interface */
+extern uint8_t gdb_data_altsetting;
 
 void blackmagic_usb_init(void);
 
@@ -64,7 +64,7 @@ static const struct usb_endpoint_descriptor gdb_comm_endp = {
 	.bEndpointAddress = (CDCACM_GDB_ENDPOINT + 1) | USB_REQ_TYPE_IN,
 	.bmAttributes = USB_ENDPOINT_ATTR_INTERRUPT,
 	.wMaxPacketSize = 16,
-	.bInterval = 255,
+	.bInterval = USB_NOTIFY_INTERVAL,
 };
 
 static const struct usb_endpoint_descriptor gdb_data_endp[] = {
@@ -141,18 +141,38 @@ static const struct usb_interface_descriptor gdb_comm_iface = {
 	.extralen = sizeof(gdb_cdcacm_functional_descriptors),
 };
 
-static const struct usb_interface_descriptor gdb_data_iface = {
-	.bLength = USB_DT_INTERFACE_SIZE,
-	.bDescriptorType = USB_DT_INTERFACE,
-	.bInterfaceNumber = GDB_IF_NO + 1,
-	.bAlternateSetting = 0,
-	.bNumEndpoints = 2,
-	.bInterfaceClass = USB_CLASS_DATA,
-	.bInterfaceSubClass = 0,
-	.bInterfaceProtocol = 0,
-	.iInterface = 0,
-
-	.endpoint = gdb_data_endp,
+/*
+ * The GDB data interface has a second, vendor class alternate setting sharing the same bulk endpoints.
+ * Selecting it lets the hosted tool talk the remote protocol over raw bulk transfers without going
+ * through the host's CDC-ACM driver and tty layer, and opens the GDB port the way DTR would.
+ */
+static const struct usb_interface_descriptor gdb_data_iface[] = {
+	{
+		.bLength = USB_DT_INTERFACE_SIZE,
+		.bDescriptorType = USB_DT_INTERFACE,
+		.bInterfaceNumber = GDB_IF_NO + 1,
+		.bAlternateSetting = 0,
+		.bNumEndpoints = 2,
+		.bInterfaceClass = USB_CLASS_DATA,
+		.bInterfaceSubClass = 0,
+		.bInterfaceProtocol = 0,
+		.iInterface = 0,
+
+		.endpoint = gdb_data_endp,
+	},
+	{
+		.bLength = USB_DT_INTERFACE_SIZE,
+		.bDescriptorType = USB_DT_INTERFACE,
+		.bInterfaceNumber = GDB_IF_NO + 1,
+		.bAlternateSetting = GDB_REMOTE_ALTSETTING,
+		.bNumEndpoints = 2,
+		.bInterfaceClass = 0xFF,
+		.bInterfaceSubClass = 0,
+		.bInterfaceProtocol = 0,
+		.iInterface = GDB_REMOTE_STRING_INDEX,
+
+		.endpoint = gdb_data_endp,
+	},
 };
 
 static const struct usb_iface_assoc_descriptor gdb_assoc = {
@@ -174,7 +194,7 @@ static const struct usb_endpoint_descriptor uart_comm_endp = {
 	.bEndpointAddress = (CDCACM_UART_ENDPOINT + 1) | USB_REQ_TYPE_IN,
 	.bmAttributes = USB_ENDPOINT_ATTR_INTERRUPT,
 	.wMaxPacketSize = 16,
-	.bInterval = 255,
+	.bInterval = USB_NOTIFY_INTERVAL,
 };
 
 static const struct usb_endpoint_descriptor uart_data_endp[] = {
@@ -321,7 +341,7 @@ static const struct usb_endpoint_descriptor trace_endp = {
 	.bDescriptorType = USB_DT_ENDPOINT,
 	.bEndpointAddress = TRACE_ENDPOINT | USB_REQ_TYPE_IN,
 	.bmAttributes = USB_ENDPOINT_ATTR_BULK,
-	.wMaxPacketSize = 64,
+	.wMaxPacketSize = TRACE_ENDPOINT_SIZE,
 	.bInterval = 0,
 };
 
@@ -351,6 +371,54 @@ static const struct usb_iface_assoc_descriptor trace_assoc = {
 };
 #endif
 
+/* RTT interface */
+
+#ifdef RTT_USB
+static const struct usb_endpoint_descriptor rtt_endp[] = {
+	{
+		.bLength = USB_DT_ENDPOINT_SIZE,
+		.bDescriptorType = USB_DT_ENDPOINT,
+		.bEndpointAddress = RTT_ENDPOINT,
+		.bmAttributes = USB_ENDPOINT_ATTR_BULK,
+		.wMaxPacketSize = RTT_ENDPOINT_SIZE,
+		.bInterval = 0,
+	},
+	{
+		.bLength = USB_DT_ENDPOINT_SIZE,
+		.bDescriptorType = USB_DT_ENDPOINT,
+		.bEndpointAddress = RTT_ENDPOINT | USB_REQ_TYPE_IN,
+		.bmAttributes = USB_ENDPOINT_ATTR_BULK,
+		.wMaxPacketSize = RTT_ENDPOINT_SIZE,
+		.bInterval = 0,
+	},
+};
+
+static const struct usb_interface_descriptor rtt_iface = {
+	.bLength = USB_DT_INTERFACE_SIZE,
+	.bDescriptorType = USB_DT_INTERFACE,
+	.bInterfaceNumber = RTT_IF_NO,
+	.bAlternateSetting = 0,
+	.bNumEndpoints = 2,
+	.bInterfaceClass = 0xFF,
+	.bInterfaceSubClass = 0xFF,
+	.bInterfaceProtocol = 0xFF,
+	.iInterface = RTT_STRING_INDEX,
+
+	.endpoint = rtt_endp,
+};
+
+static const struct usb_iface_assoc_descriptor rtt_assoc = {
+	.bLength = USB_DT_INTERFACE_ASSOCIATION_SIZE,
+	.bDescriptorType = USB_DT_INTERFACE_ASSOCIATION,
+	.bFirstInterface = RTT_IF_NO,
+	.bInterfaceCount = 1,
+	.bFunctionClass = 0xFF,
+	.bFunctionSubClass = 0xFF,
+	.bFunctionProtocol = 0xFF,
+	.iFunction = RTT_STRING_INDEX,
+};
+#endif
+
 /* Interface and configuration descriptors */
 
 static const struct usb_interface ifaces[] = {
@@ -360,8 +428,9 @@ static const struct usb_interface ifaces[] = {
 		.altsetting = &gdb_comm_iface,
 	},
 	{
-		.num_altsetting = 1,
-		.altsetting = &gdb_data_iface,
+		.num_altsetting = 2,
+		.cur_altsetting = &gdb_data_altsetting,
+		.altsetting = gdb_data_iface,
 	},
 	{
 		.num_altsetting = 1,
@@ -384,6 +453,13 @@ static const struct usb_interface ifaces[] = {
 		.altsetting = &trace_iface,
 	},
 #endif
+#ifdef RTT_USB
+	{
+		.num_altsetting = 1,
+		.iface_assoc = &rtt_assoc,
+		.altsetting = &rtt_iface,
+	},
+#endif
 };
 
 static const struct usb_config_descriptor config = {
@@ -408,6 +484,10 @@ static const char *const usb_strings[] = {
 	"Black Magic DFU",
 #if defined(PLATFORM_HAS_TRACESWO)
 	"Black Magic Trace Capture",
+#endif
+	"Black Magic Remote Protocol",
+#ifdef RTT_USB
+	"Black Magic RTT",
 #endif
 };
 
@@ -57,11 +57,12 @@
 #endif
 
 static bool gdb_serial_dtr = true;
+uint8_t gdb_data_altsetting;
 
 static void usb_serial_set_state(usbd_device *dev, uint16_t iface, uint8_t ep);
 
 static void debug_serial_send_callback(usbd_device *dev, uint8_t ep);
-#ifndef ENABLE_RTT
+#if !defined(ENABLE_RTT) || defined(RTT_USB)
 static void debug_serial_receive_callback(usbd_device *dev, uint8_t ep);
 #endif
 
@@ -78,9 +79,21 @@ static bool debug_serial_send_complete = true;
  */
 void initialise_monitor_handles(void);
 
-static char debug_serial_debug_buffer[AUX_UART_BUFFER_SIZE];
-static uint8_t debug_serial_debug_write_index;
-static uint8_t debug_serial_debug_read_index;
+/*
+ * Debug output ring, sized by DEBUG_SERIAL_BUFFER_SHIFT from platform.h. _write() is its only producer
+ * and only moves the write index, the UART IN endpoint is its only consumer and only moves the read
+ * index, so neither side needs to lock the other out. It's sent from in place like the aux UART
+ * receive ring, so it gets the same byte of slack.
+ */
+#ifndef DEBUG_SERIAL_BUFFER_SHIFT
+#define DEBUG_SERIAL_BUFFER_SHIFT 9U
+#endif
+#define DEBUG_SERIAL_BUFFER_SIZE (1U << DEBUG_SERIAL_BUFFER_SHIFT)
+#define DEBUG_SERIAL_BUFFER_MASK (DEBUG_SERIAL_BUFFER_SIZE - 1U)
+
+static char debug_serial_debug_buffer[DEBUG_SERIAL_BUFFER_SIZE + 1U];
+static volatile uint16_t debug_serial_debug_write_index;
+static volatile uint16_t debug_serial_debug_read_index;
 #endif
 
 static enum usbd_request_return_codes gdb_serial_control_request(usbd_device *dev, struct usb_setup_data *req,
@@ -105,9 +118,13 @@ static enum usbd_request_return_codes gdb_serial_control_request(usbd_device *de
 	return USBD_REQ_NOTSUPP;
 }
 
+/*
+ * The GDB port counts as open either when DTR is asserted on the CDC-ACM port, or when the host
+ * has selected the remote protocol's vendor alternate setting and talks raw bulk to it.
+ */
 bool gdb_serial_get_dtr(void)
 {
-	return gdb_serial_dtr;
+	return gdb_serial_dtr || gdb_data_altsetting == GDB_REMOTE_ALTSETTING;
 }
 
 static enum usbd_request_return_codes debug_serial_control_request(usbd_device *dev, struct usb_setup_data *req,
@@ -162,7 +179,12 @@ void usb_serial_set_config(usbd_device *dev, uint16_t value)
 #else
 	usbd_ep_setup(dev, CDCACM_GDB_ENDPOINT, USB_ENDPOINT_ATTR_BULK, CDCACM_PACKET_SIZE, NULL);
 #endif
+#ifdef LM4F
 	usbd_ep_setup(dev, CDCACM_GDB_ENDPOINT | USB_REQ_TYPE_IN, USB_ENDPOINT_ATTR_BULK, CDCACM_PACKET_SIZE, NULL);
+#else
+	gdb_if_tx_reset();
+	usbd_ep_setup(dev, CDCACM_GDB_ENDPOINT | USB_REQ_TYPE_IN, USB_ENDPOINT_ATTR_BULK, CDCACM_PACKET_SIZE, gdb_usb_in_cb);
+#endif
 	usbd_ep_setup(dev, (CDCACM_GDB_ENDPOINT + 1) | USB_REQ_TYPE_IN, USB_ENDPOINT_ATTR_INTERRUPT, 16, NULL);
 
 	/* Serial interface */
@@ -173,7 +195,7 @@ void usb_serial_set_config(usbd_device *dev, uint16_t value)
 
 #ifdef PLATFORM_HAS_TRACESWO
 	/* Trace interface */
-	usbd_ep_setup(dev, TRACE_ENDPOINT | USB_REQ_TYPE_IN, USB_ENDPOINT_ATTR_BULK, 64, trace_buf_drain);
+	usbd_ep_setup(dev, TRACE_ENDPOINT | USB_REQ_TYPE_IN, USB_ENDPOINT_ATTR_BULK, TRACE_ENDPOINT_SIZE, trace_buf_drain);
 #endif
 
 	usbd_register_control_callback(dev, USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
@@ -203,21 +225,18 @@ void debug_serial_send_stdout(const uint8_t *const data, const size_t len)
 	}
 }
 
-uint32_t debug_serial_fifo_send(const char *const fifo, const uint32_t fifo_begin, const uint32_t fifo_end)
+/*
+ * Sends the next packet straight out of the FIFO, as much as there is before it wraps.
+ * To avoid the need of sending ZLP don't transmit full packet.
+ */
+uint32_t debug_serial_fifo_send(
+	const char *const fifo, const uint32_t fifo_begin, const uint32_t fifo_end, const uint32_t fifo_size)
 {
-	/*
-	 * To avoid the need of sending ZLP don't transmit full packet.
-	 * Also reserve space for copy function overrun.
-	 */
-	char packet[CDCACM_PACKET_SIZE - 1];
-	uint32_t packet_len = 0;
-	for (uint32_t fifo_index = fifo_begin; fifo_index != fifo_end && packet_len < CDCACM_PACKET_SIZE - 1U;
-		 fifo_index %= AUX_UART_BUFFER_SIZE)
-		packet[packet_len++] = fifo[fifo_index++];
-
+	const uint32_t contiguous = (fifo_end >= fifo_begin ? fifo_end : fifo_size) - fifo_begin;
+	const uint16_t packet_len = MIN(contiguous, CDCACM_PACKET_SIZE - 1U);
 	if (packet_len) {
-		const uint16_t written = usbd_ep_write_packet(usbdev, CDCACM_UART_ENDPOINT, packet, packet_len);
-		return (fifo_begin + written) % AUX_UART_BUFFER_SIZE;
+		const uint16_t written = usbd_ep_write_packet(usbdev, CDCACM_UART_ENDPOINT, fifo + fifo_begin, packet_len);
+		return (fifo_begin + written) % fifo_size;
 	}
 	return fifo_begin;
 }
@@ -253,7 +272,8 @@ static void debug_serial_send_data(void)
 		debug_serial_send_complete = true;
 	} else {
 #if defined(ENABLE_DEBUG) && defined(PLATFORM_HAS_DEBUG)
-		debug_serial_debug_read_index = debug_serial_fifo_send(debug_serial_debug_buffer, debug_serial_debug_read_index, debug_serial_debug_write_index);
+		debug_serial_debug_read_index = debug_serial_fifo_send(debug_serial_debug_buffer,
+			debug_serial_debug_read_index, debug_serial_debug_write_index, DEBUG_SERIAL_BUFFER_SIZE);
 #endif
 		aux_serial_stage_receive_buffer();
 	}
@@ -263,6 +283,8 @@ void debug_serial_run(void)
 {
 	nvic_disable_irq(USB_IRQ);
 	aux_serial_set_led(AUX_SERIAL_LED_RX);
+	/* Keep up with the receive ring even while usb is busy, so overflows get noticed */
+	aux_serial_update_receive_buffer_fullness();
 
 	/* Try to send a packet if usb is idle */
 	if (debug_serial_send_complete)
@@ -281,7 +303,7 @@ static void debug_serial_send_callback(usbd_device *dev, uint8_t ep)
 #endif
 }
 
-#ifndef ENABLE_RTT
+#if !defined(ENABLE_RTT) || defined(RTT_USB)
 static void debug_serial_receive_callback(usbd_device *dev, uint8_t ep)
 {
 	char *const transmit_buffer = aux_serial_current_transmit_buffer() + aux_serial_transmit_buffer_fullness();
@@ -307,33 +329,46 @@ static void debug_serial_receive_callback(usbd_device *dev, uint8_t ep)
 
 #ifdef ENABLE_DEBUG
 #ifdef PLATFORM_HAS_DEBUG
-static void debug_serial_append_char(const char c)
-{
-	debug_serial_debug_buffer[debug_serial_debug_write_index] = c;
-	++debug_serial_debug_write_index;
-	debug_serial_debug_write_index %= AUX_UART_BUFFER_SIZE;
-}
-
-static size_t debug_serial_debug_write(const char *buf, const size_t len)
+static size_t debug_serial_debug_write(const char *const buf, const size_t len)
 {
+	/* Only thread mode may produce, output from the interrupts that consume the ring is dropped */
 	if (nvic_get_active_irq(USB_IRQ) || nvic_get_active_irq(USBUSART_IRQ) || nvic_get_active_irq(USBUSART_DMA_RX_IRQ))
 		return 0;
 
-	CM_ATOMIC_CONTEXT();
+	uint16_t write_index = debug_serial_debug_write_index;
+	const uint16_t read_index = debug_serial_debug_read_index;
 	size_t offset = 0;
-
-	for (; offset < len && (debug_serial_debug_write_index + 1) % AUX_UART_BUFFER_SIZE != debug_serial_debug_read_index;
-		 ++offset) {
+	while (offset < len) {
+		/* One slot always stays free so a full ring doesn't look empty */
+		const uint16_t space = (read_index - write_index - 1U) & DEBUG_SERIAL_BUFFER_MASK;
 		if (buf[offset] == '\n') {
-			debug_serial_append_char('\r');
-
-			if ((debug_serial_debug_write_index + 1) % AUX_UART_BUFFER_SIZE == debug_serial_debug_read_index)
+			if (space < 2U)
 				break;
+			debug_serial_debug_buffer[write_index] = '\r';
+			write_index = (write_index + 1U) & DEBUG_SERIAL_BUFFER_MASK;
+			debug_serial_debug_buffer[write_index] = '\n';
+			write_index = (write_index + 1U) & DEBUG_SERIAL_BUFFER_MASK;
+			++offset;
+			continue;
 		}
-		debug_serial_append_char(buf[offset]);
+		/* Copy up to the next newline in one go, as far as the space and the end of the ring allow */
+		const char *const newline = memchr(buf + offset, '\n', len - offset);
+		const size_t run = (newline ? (size_t)(newline - buf) : len) - offset;
+		const size_t count = MIN(MIN(run, (size_t)space), DEBUG_SERIAL_BUFFER_SIZE - write_index);
+		if (!count)
+			break;
+		memcpy(debug_serial_debug_buffer + write_index, buf + offset, count);
+		write_index = (write_index + count) & DEBUG_SERIAL_BUFFER_MASK;
+		offset += count;
 	}
 
-	debug_serial_run();
+	/* Publish the new data only once it's all in the ring */
+	__asm__ volatile("" ::: "memory");
+	debug_serial_debug_write_index = write_index;
+
+	/* Only start the endpoint when it's idle, its completion callback keeps refilling it from there */
+	if (debug_serial_send_complete)
+		debug_serial_run();
 	return offset;
 }
 #endif
@@ -30,9 +30,9 @@ void usb_serial_set_config(usbd_device *dev, uint16_t value);
 bool gdb_serial_get_dtr(void);
 
 void debug_serial_run(void);
-uint32_t debug_serial_fifo_send(const char *fifo, uint32_t fifo_begin, uint32_t fifo_end);
+uint32_t debug_serial_fifo_send(const char *fifo, uint32_t fifo_begin, uint32_t fifo_end, uint32_t fifo_size);
 
-#ifdef ENABLE_RTT
+#if defined(ENABLE_RTT) && !defined(RTT_USB)
 void debug_serial_receive_callback(usbd_device *dev, uint8_t ep);
 #endif
 
@@ -120,6 +120,11 @@
 #define USBUSART_DMA_RXTX_IRQ NVIC_DMA1_CHANNEL4_7_DMA2_CHANNEL3_5_IRQ
 #define USBUSART_DMA_RXTX_ISR(x) dma1_channel4_7_dma2_channel3_5_isr(x)
 
+/* The CRC unit takes bytes here, so probe_crc32() feeds it by DMA while the next chunk is read */
+#define CRC_DMA_BUS DMA1
+#define CRC_DMA_CLK RCC_DMA1
+#define CRC_DMA_CHAN DMA_CHANNEL1
+
 #define STK_CSR_CLKSOURCE_AHB_DIV8 STK_CSR_CLKSOURCE_AHB
 
 /* TX/RX on the REV 0/1 boards are swapped against ftdijtag.*/
@@ -32,7 +32,11 @@
 #include <setjmp.h>
 
 #define PLATFORM_HAS_TRACESWO
+/* SWDIO and SWCLK share a port, clock SWD bits with combined BSRR writes */
+#define PLATFORM_HAS_FAST_SWD
 #define PLATFORM_IDENT "(F4Discovery) "
+/* The F4 has plenty of SRAM, so allow GDB packets larger than the 1KiB default */
+#define GDB_PACKET_BUFFER_SIZE 4096U
 
 /* Important pin mappings for STM32 implementation:
  *
@@ -0,0 +1,575 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Debug link benchmark for the command line. Every figure comes from timing a
+ * loop of the same operations the GDB server uses, so they track what a user
+ * sees, and they are printed as JSON to be compared across releases, probes
+ * and probe firmware versions.
+ */
+
+#include "general.h"
+#include <errno.h>
+#include "target_internal.h"
+#include "cortexm.h"
+#include "crc32.h"
+#include "version.h"
+#include "bmp_hosted.h"
+#include "bench.h"
+
+/* Each figure is an average over at least this long, to smooth out USB scheduling */
+#define BENCH_MIN_TIME_US 200000U
+#define BENCH_MIN_RUNS    8U
+#define BENCH_MAX_RUNS    100000U
+#define BENCH_HALT_RUNS   8U
+#define BENCH_HALT_TIMEOUT_MS 1000U
+
+static const size_t bench_block_sizes[] = {64U, 1024U, 4096U, 16384U};
+#define BENCH_BLOCK_MAX 16384U
+#define BENCH_SCATTER_READS 16U
+
+typedef struct bench_context {
+	target *t;
+	ADIv5_AP_t *ap;
+	target_addr_t ram;
+	size_t size;
+	uint8_t *buffer;
+	/* What the RAM held before, put back before the target runs again and when done */
+	const uint8_t *saved;
+	size_t ram_size;
+} bench_context_s;
+
+typedef void (*bench_op_f)(bench_context_s *ctx);
+
+/* Average microseconds per run of op, or -1 if the target reported an error */
+static double bench_time_us(bench_context_s *const ctx, const bench_op_f op)
+{
+	const uint32_t start = platform_time_us();
+	uint32_t elapsed = 0;
+	size_t runs = 0;
+	while (runs < BENCH_MIN_RUNS || (elapsed < BENCH_MIN_TIME_US && runs < BENCH_MAX_RUNS)) {
+		op(ctx);
+		++runs;
+		elapsed = platform_time_us() - start;
+	}
+	if (target_check_error(ctx->t))
+		return -1;
+	return (double)elapsed / (double)runs;
+}
+
+static void bench_dp_read(bench_context_s *const ctx)
+{
+	adiv5_dp_read(ctx->ap->dp, ADIV5_DP_DPIDR);
+}
+
+static void bench_word_read(bench_context_s *const ctx)
+{
+	target_mem_read32(ctx->t, ctx->ram);
+}
+
+static void bench_word_write(bench_context_s *const ctx)
+{
+	target_mem_write32(ctx->t, ctx->ram, 0);
+}
+
+static void bench_block_read(bench_context_s *const ctx)
+{
+	target_mem_read(ctx->t, ctx->buffer, ctx->ram, ctx->size);
+}
+
+/* Words spread over the RAM, read as one scatter-gather batch */
+static void bench_scatter_read(bench_context_s *const ctx)
+{
+	target_iovec_s iov[BENCH_SCATTER_READS];
+	for (size_t i = 0; i < BENCH_SCATTER_READS; ++i) {
+		iov[i].dest = ctx->buffer + i * 4U;
+		iov[i].src = ctx->ram + (uint32_t)((i * ctx->ram_size / BENCH_SCATTER_READS) & ~3U);
+		iov[i].len = 4U;
+	}
+	target_mem_readv(ctx->t, iov, BENCH_SCATTER_READS);
+}
+
+static void bench_block_write(bench_context_s *const ctx)
+{
+	target_mem_write(ctx->t, ctx->ram, ctx->buffer, ctx->size);
+}
+
+static void bench_regs_read(bench_context_s *const ctx)
+{
+	target_regs_read(ctx->t, ctx->buffer);
+}
+
+/* Average time for the target to start running and to stop again once asked */
+static bool bench_halt_resume(target *const t, double *const resume_us, double *const halt_us)
+{
+	uint32_t resume_total = 0;
+	uint32_t halt_total = 0;
+	for (size_t i = 0; i < BENCH_HALT_RUNS; ++i) {
+		uint32_t start = platform_time_us();
+		target_halt_resume(t, false);
+		resume_total += platform_time_us() - start;
+
+		platform_timeout timeout;
+		platform_timeout_set(&timeout, BENCH_HALT_TIMEOUT_MS);
+		start = platform_time_us();
+		target_halt_request(t);
+		target_addr_t watch;
+		enum target_halt_reason reason;
+		while ((reason = target_halt_poll(t, &watch)) == TARGET_HALT_RUNNING) {
+			if (platform_timeout_is_expired(&timeout))
+				return false;
+		}
+		halt_total += platform_time_us() - start;
+		if (reason == TARGET_HALT_ERROR)
+			return false;
+	}
+	*resume_us = (double)resume_total / BENCH_HALT_RUNS;
+	*halt_us = (double)halt_total / BENCH_HALT_RUNS;
+	return true;
+}
+
+static void bench_print_string(FILE *const out, const char *const name, const char *const value)
+{
+	fprintf(out, ",\"%s\":\"", name);
+	for (const char *c = value; *c; ++c) {
+		if (*c == '"' || *c == '\\')
+			fprintf(out, "\\%c", *c);
+		else if ((unsigned char)*c < 0x20U)
+			fprintf(out, "\\u%04x", (unsigned char)*c);
+		else
+			fputc(*c, out);
+	}
+	fputc('"', out);
+}
+
+/* Negative values are failed measurements, shown as null */
+static void bench_print_value(FILE *const out, const char *const name, const double value)
+{
+	if (value < 0)
+		fprintf(out, ",\"%s\":null", name);
+	else
+		fprintf(out, ",\"%s\":%.3f", name, value);
+}
+
+/* Block transfer rates in MB/s for each size that fits the RAM used */
+static void bench_print_blocks(bench_context_s *const ctx, const char *const name, const bench_op_f op,
+	const size_t ram_size)
+{
+	printf(",\"%s\":{", name);
+	bool first = true;
+	for (size_t i = 0; i < ARRAY_LENGTH(bench_block_sizes); ++i) {
+		ctx->size = bench_block_sizes[i];
+		if (ctx->size > ram_size)
+			break;
+		const double us = bench_time_us(ctx, op);
+		printf(first ? "\"%zu\":" : ",\"%zu\":", ctx->size);
+		first = false;
+		if (us > 0)
+			printf("%.3f", (double)ctx->size / us);
+		else
+			printf("null");
+	}
+	putchar('}');
+}
+
+static void bench_link(bench_context_s *const ctx, const uint32_t frequency)
+{
+	const size_t ram_size = ctx->ram_size;
+	platform_max_frequency_set(frequency);
+	printf("{\"frequency\":%" PRIu32, platform_max_frequency_get());
+	DEBUG_INFO("Measuring at %" PRIu32 "Hz\n", platform_max_frequency_get());
+
+	bench_print_value(stdout, "dp_read_us", ctx->ap ? bench_time_us(ctx, bench_dp_read) : -1);
+	bench_print_value(stdout, "word_read_us", ram_size ? bench_time_us(ctx, bench_word_read) : -1);
+	bench_print_value(stdout, "word_write_us", ram_size ? bench_time_us(ctx, bench_word_write) : -1);
+	bench_print_value(stdout, "scatter_read_us", ram_size >= 64U ? bench_time_us(ctx, bench_scatter_read) : -1);
+	bench_print_blocks(ctx, "block_read_MBps", bench_block_read, ram_size);
+	bench_print_blocks(ctx, "block_write_MBps", bench_block_write, ram_size);
+	bench_print_value(stdout, "regs_read_us", bench_time_us(ctx, bench_regs_read));
+
+	if (ram_size)
+		target_mem_write(ctx->t, ctx->ram, ctx->saved, ram_size);
+
+	double resume_us = -1;
+	double halt_us = -1;
+	if (!bench_halt_resume(ctx->t, &resume_us, &halt_us))
+		DEBUG_WARN("Halt/resume measurement failed\n");
+	bench_print_value(stdout, "resume_us", resume_us);
+	bench_print_value(stdout, "halt_us", halt_us);
+	putchar('}');
+}
+
+/* Erase and program rates in KiB/s, over a region whose contents are lost */
+static void bench_flash(target *const t, const uint32_t addr, const size_t size)
+{
+	uint8_t *const data = malloc(size);
+	if (!data) { /* malloc failed: heap exhaustion */
+		DEBUG_WARN("malloc: failed in %s\n", __func__);
+		return;
+	}
+	/* Something other than the erased value, so every word gets programmed */
+	for (size_t i = 0; i < size; ++i)
+		data[i] = (uint8_t)(i * 7U + 0x5aU);
+
+	DEBUG_INFO("Measuring flash over %zu bytes at 0x%08" PRIx32 "\n", size, addr);
+	uint32_t start = platform_time_us();
+	const bool erased = target_flash_erase(t, addr, size) && target_flash_complete(t);
+	const uint32_t erase_us = platform_time_us() - start;
+	start = platform_time_us();
+	const bool written = erased && target_flash_write(t, addr, data, size) && target_flash_complete(t);
+	const uint32_t write_us = platform_time_us() - start;
+	free(data);
+
+	printf(",\"flash\":{\"addr\":%" PRIu32 ",\"size\":%zu", addr, size);
+	bench_print_value(stdout, "erase_KiBps", erased ? (double)size * 1000000.0 / 1024.0 / erase_us : -1);
+	bench_print_value(stdout, "program_KiBps", written ? (double)size * 1000000.0 / 1024.0 / write_us : -1);
+	putchar('}');
+}
+
+bool bench_run(target *const t, const char *const frequencies, const uint32_t flash_addr, const size_t flash_size)
+{
+	const size_t ram_size = t->ram ? MIN(t->ram->length, BENCH_BLOCK_MAX) : 0U;
+	bench_context_s ctx = {
+		.t = t,
+		.ap = target_is_cortexm(t) ? cortexm_ap(t) : NULL,
+		.ram = t->ram ? t->ram->start : 0,
+		.ram_size = ram_size,
+	};
+	const size_t buffer_size = MAX(BENCH_BLOCK_MAX, target_regs_size(t));
+	ctx.buffer = calloc(1, buffer_size);
+	uint8_t *const saved = calloc(1, BENCH_BLOCK_MAX);
+	if (!ctx.buffer || !saved) { /* calloc failed: heap exhaustion */
+		DEBUG_WARN("calloc: failed in %s\n", __func__);
+		free(ctx.buffer);
+		free(saved);
+		return false;
+	}
+	if (ram_size)
+		target_mem_read(t, saved, ctx.ram, ram_size);
+	ctx.saved = saved;
+
+	printf("{\"bmda\":\"%s\"", FIRMWARE_VERSION);
+	bench_print_string(stdout, "adapter", info.product);
+	bench_print_string(stdout, "adapter_version", info.version);
+	bench_print_string(stdout, "adapter_serial", info.serial);
+	bench_print_string(stdout, "target", target_driver_name(t));
+	bench_print_string(stdout, "core", target_core_name(t) ? target_core_name(t) : "");
+	printf(",\"links\":[");
+
+	const uint32_t original = platform_max_frequency_get();
+	if (frequencies) {
+		bool first = true;
+		for (const char *p = frequencies; *p;) {
+			char *end;
+			uint32_t frequency = strtoul(p, &end, 0);
+			if (*end == 'k' || *end == 'K')
+				frequency *= 1000U;
+			else if (*end == 'm' || *end == 'M')
+				frequency *= 1000U * 1000U;
+			end += strcspn(end, ",");
+			p = *end ? end + 1 : end;
+			if (!frequency)
+				continue;
+			if (!first)
+				putchar(',');
+			first = false;
+			bench_link(&ctx, frequency);
+		}
+	} else
+		bench_link(&ctx, original);
+	platform_max_frequency_set(original);
+	putchar(']');
+	free(saved);
+	free(ctx.buffer);
+
+	if (flash_size)
+		bench_flash(t, flash_addr, flash_size);
+	printf("}\n");
+	fflush(stdout);
+	return true;
+}
+
+/*
+ * The regression scenario: one fixed sequence run the same way on every
+ * target, printed as a single JSON line. A baseline file holds one such line
+ * per adapter and target driver, so runs across the supported families build
+ * up a corpus that shows what a driver or probe change did to each of them.
+ */
+#define BENCH_IMAGE_MAX       (64U * 1024U)
+#define BENCH_STEPS           1000U
+#define BENCH_STEP_TIMEOUT_MS 100U
+#define BENCH_RAM_READ        (1024U * 1024U)
+#define BENCH_LINE_MAX        1024U
+/* How much worse than its baseline a figure may get before it counts as a regression */
+#define BENCH_TOLERANCE 0.10
+
+typedef struct bench_scenario {
+	size_t image_size;
+	double attach_ms;
+	double erase_ms;
+	double program_KiBps;
+	double verify_KiBps;
+	double step_us;
+	double ram_read_MBps;
+} bench_scenario_s;
+
+typedef struct bench_metric {
+	const char *name;
+	size_t offset;
+	bool higher_is_better;
+} bench_metric_s;
+
+static const bench_metric_s bench_metrics[] = {
+	{"attach_ms", offsetof(bench_scenario_s, attach_ms), false},
+	{"erase_ms", offsetof(bench_scenario_s, erase_ms), false},
+	{"program_KiBps", offsetof(bench_scenario_s, program_KiBps), true},
+	{"verify_KiBps", offsetof(bench_scenario_s, verify_KiBps), true},
+	{"step_us", offsetof(bench_scenario_s, step_us), false},
+	{"ram_read_MBps", offsetof(bench_scenario_s, ram_read_MBps), true},
+};
+
+static double bench_metric_value(const bench_scenario_s *const result, const bench_metric_s *const metric)
+{
+	double value;
+	memcpy(&value, (const uint8_t *)result + metric->offset, sizeof(value));
+	return value;
+}
+
+static double bench_KiBps(const size_t size, const uint32_t us)
+{
+	return (double)size * 1000000.0 / 1024.0 / (us ? us : 1U);
+}
+
+/* All of the flash, with the target's mass erase where it has one */
+static bool bench_scenario_erase(target *const t)
+{
+	if (t->mass_erase)
+		return t->mass_erase(t);
+	for (target_flash_s *f = t->flash; f; f = f->next) {
+		if (!target_flash_erase(t, f->start, f->length))
+			return false;
+	}
+	return target_flash_complete(t);
+}
+
+/* Average time of a single step over a branch to itself in RAM, -1 if the core can't be stepped */
+static double bench_scenario_step(target *const t)
+{
+	if (!target_is_cortexm(t) || !t->ram || t->ram->length < 4U)
+		return -1;
+	/* b . ; b . */
+	target_mem_write32(t, t->ram->start, 0xe7fee7feU);
+	const uint32_t pc = t->ram->start;
+	const uint32_t xpsr = CORTEXM_XPSR_THUMB;
+	if (target_check_error(t) || target_reg_write(t, REG_PC, &pc, sizeof(pc)) != sizeof(pc) ||
+		target_reg_write(t, REG_XPSR, &xpsr, sizeof(xpsr)) != sizeof(xpsr))
+		return -1;
+
+	const uint32_t start = platform_time_us();
+	for (size_t i = 0; i < BENCH_STEPS; ++i) {
+		target_halt_resume(t, true);
+		platform_timeout timeout;
+		platform_timeout_set(&timeout, BENCH_STEP_TIMEOUT_MS);
+		target_addr_t watch;
+		enum target_halt_reason reason;
+		while ((reason = target_halt_poll(t, &watch)) == TARGET_HALT_RUNNING) {
+			if (platform_timeout_is_expired(&timeout))
+				return -1;
+		}
+		if (reason == TARGET_HALT_ERROR)
+			return -1;
+	}
+	return (double)(platform_time_us() - start) / BENCH_STEPS;
+}
+
+/* MB/s reading 1MiB from the start of RAM, as many times over as the RAM is smaller */
+static double bench_scenario_ram_read(target *const t)
+{
+	if (!t->ram)
+		return -1;
+	const size_t block = MIN(t->ram->length, BENCH_BLOCK_MAX);
+	uint8_t *const buffer = malloc(block);
+	if (!buffer) { /* malloc failed: heap exhaustion */
+		DEBUG_WARN("malloc: failed in %s\n", __func__);
+		return -1;
+	}
+	const uint32_t start = platform_time_us();
+	bool failed = false;
+	for (size_t done = 0; done < BENCH_RAM_READ && !failed; done += block)
+		failed = target_mem_read(t, buffer, t->ram->start, MIN(block, BENCH_RAM_READ - done));
+	const uint32_t elapsed = platform_time_us() - start;
+	free(buffer);
+	return failed ? -1 : (double)BENCH_RAM_READ / (elapsed ? elapsed : 1U);
+}
+
+static void bench_scenario_print(FILE *const out, target *const t, const bench_scenario_s *const result)
+{
+	fprintf(out, "{\"bmda\":\"%s\"", FIRMWARE_VERSION);
+	bench_print_string(out, "adapter", info.product);
+	bench_print_string(out, "adapter_version", info.version);
+	bench_print_string(out, "target", target_driver_name(t));
+	fprintf(out, ",\"image_size\":%zu", result->image_size);
+	for (size_t i = 0; i < ARRAY_LENGTH(bench_metrics); ++i)
+		bench_print_value(out, bench_metrics[i].name, bench_metric_value(result, &bench_metrics[i]));
+	fprintf(out, "}\n");
+}
+
+/* A string field of a line bench_scenario_print() wrote, false if the line has none */
+static bool bench_json_string(const char *const line, const char *const name, char *const value, const size_t size)
+{
+	char key[32];
+	snprintf(key, sizeof(key), "\"%s\":\"", name);
+	const char *c = strstr(line, key);
+	if (!c)
+		return false;
+	size_t len = 0;
+	for (c += strlen(key); *c && *c != '"'; ++c) {
+		if (*c == '\\' && c[1])
+			++c;
+		if (len + 1U < size)
+			value[len++] = *c;
+	}
+	value[len] = '\0';
+	return *c == '"';
+}
+
+/* A number field of such a line, -1 if it is missing or null */
+static double bench_json_number(const char *const line, const char *const name)
+{
+	char key[32];
+	snprintf(key, sizeof(key), "\"%s\":", name);
+	const char *const c = strstr(line, key);
+	if (!c)
+		return -1;
+	char *end;
+	const double value = strtod(c + strlen(key), &end);
+	return end == c + strlen(key) ? -1 : value;
+}
+
+/* Finds the baseline line for this adapter and target, false if there is none */
+static bool bench_baseline_find(const char *const path, target *const t, char *const line, const size_t size)
+{
+	FILE *const file = fopen(path, "r");
+	if (!file)
+		return false;
+	bool found = false;
+	while (!found && fgets(line, (int)size, file)) {
+		char adapter[sizeof(info.product)];
+		char driver[64];
+		found = bench_json_string(line, "adapter", adapter, sizeof(adapter)) && !strcmp(adapter, info.product) &&
+			bench_json_string(line, "target", driver, sizeof(driver)) && !strcmp(driver, target_driver_name(t));
+	}
+	fclose(file);
+	return found;
+}
+
+/*
+ * Compares the result with its baseline, or records it as the baseline if the
+ * file has none for this adapter and target yet. False if a figure regressed.
+ */
+static bool bench_baseline_compare(const char *const path, target *const t, const bench_scenario_s *const result)
+{
+	char line[BENCH_LINE_MAX];
+	if (!bench_baseline_find(path, t, line, sizeof(line))) {
+		FILE *const file = fopen(path, "a");
+		if (!file) {
+			DEBUG_WARN("Can not add to baseline %s: %s\n", path, strerror(errno));
+			return false;
+		}
+		bench_scenario_print(file, t, result);
+		fclose(file);
+		DEBUG_WARN("No baseline for %s on %s yet, recorded this run in %s\n", target_driver_name(t), info.product,
+			path);
+		return true;
+	}
+
+	bool regressed = false;
+	for (size_t i = 0; i < ARRAY_LENGTH(bench_metrics); ++i) {
+		const bench_metric_s *const metric = &bench_metrics[i];
+		const double base = bench_json_number(line, metric->name);
+		const double value = bench_metric_value(result, metric);
+		if (base <= 0 || value < 0) {
+			/* Something that used to work failing is a regression too */
+			const bool failed = base >= 0 && value < 0;
+			DEBUG_WARN("%-14s %s\n", metric->name, failed ? "failed" : "not measured");
+			regressed |= failed;
+			continue;
+		}
+		const double change = (value - base) / base;
+		const bool worse = (metric->higher_is_better ? -change : change) > BENCH_TOLERANCE;
+		DEBUG_WARN("%-14s %10.3f -> %10.3f %+6.1f%%%s\n", metric->name, base, value, change * 100.0,
+			worse ? "  regressed" : "");
+		regressed |= worse;
+	}
+	return !regressed;
+}
+
+bool bench_scenario(target *const t, const uint32_t attach_us, const char *const baseline, const uint32_t flash_addr,
+	const size_t flash_size)
+{
+	bench_scenario_s result = {
+		.image_size = MIN(flash_size, BENCH_IMAGE_MAX),
+		.attach_ms = attach_us / 1000.0,
+		.erase_ms = -1,
+		.program_KiBps = -1,
+		.verify_KiBps = -1,
+	};
+
+	DEBUG_INFO("Erasing all flash\n");
+	uint32_t start = platform_time_us();
+	if (bench_scenario_erase(t))
+		result.erase_ms = (platform_time_us() - start) / 1000.0;
+	else
+		DEBUG_WARN("Flash erase failed\n");
+
+	uint8_t *const image = result.image_size ? malloc(result.image_size) : NULL;
+	if (image) {
+		/* The reference image, the same pseudo random bytes every time */
+		uint32_t seed = 0x2545f491U;
+		for (size_t i = 0; i < result.image_size; ++i) {
+			seed = seed * 1664525U + 1013904223U;
+			image[i] = (uint8_t)(seed >> 24U);
+		}
+		DEBUG_INFO("Programming %zu bytes at 0x%08" PRIx32 "\n", result.image_size, flash_addr);
+		start = platform_time_us();
+		if (target_flash_write(t, flash_addr, image, result.image_size) && target_flash_complete(t))
+			result.program_KiBps = bench_KiBps(result.image_size, platform_time_us() - start);
+		else
+			DEBUG_WARN("Flash programming failed\n");
+
+		start = platform_time_us();
+		uint32_t crc;
+		if (target_mem_crc32(t, &crc, flash_addr, result.image_size) &&
+			crc == generic_crc32_buffer(0xffffffffU, image, result.image_size))
+			result.verify_KiBps = bench_KiBps(result.image_size, platform_time_us() - start);
+		else
+			DEBUG_WARN("Flash CRC verify failed\n");
+		free(image);
+	} else if (result.image_size) /* malloc failed: heap exhaustion */
+		DEBUG_WARN("malloc: failed in %s\n", __func__);
+
+	DEBUG_INFO("Single stepping %u times\n", BENCH_STEPS);
+	result.step_us = bench_scenario_step(t);
+	DEBUG_INFO("Reading 1MiB of RAM\n");
+	result.ram_read_MBps = bench_scenario_ram_read(t);
+	/* Leave the core out of the loop the steps ran on */
+	target_reset(t);
+
+	bench_scenario_print(stdout, t, &result);
+	fflush(stdout);
+	return !baseline || bench_baseline_compare(baseline, t, &result);
+}
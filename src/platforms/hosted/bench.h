@@ -0,0 +1,46 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PLATFORMS_HOSTED_BENCH_H
+#define PLATFORMS_HOSTED_BENCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "target.h"
+
+/*
+ * Measure the debug link to an attached target and print the results as one
+ * JSON object on stdout. frequencies is a comma separated list of SWJ clocks
+ * to repeat the link measurements at, NULL for the current one. Flash erase
+ * and program rates are only measured when flash_size is not 0, over that many
+ * bytes at flash_addr, whose contents are lost.
+ */
+bool bench_run(target *t, const char *frequencies, uint32_t flash_addr, size_t flash_size);
+
+/*
+ * Run the regression scenario on an attached target: erase all flash, program
+ * and CRC verify a reference image of up to 64KiB at flash_addr, single step
+ * 1000 times and read 1MiB of RAM, then print the figures, with the attach time
+ * given, as one JSON line. With a baseline file, compare them with the line
+ * for the same adapter and target driver in it, or add one if there is none.
+ * False if a figure regressed by more than 10%. All of the flash is lost.
+ */
+bool bench_scenario(target *t, uint32_t attach_us, const char *baseline, uint32_t flash_addr, size_t flash_size);
+
+#endif /* PLATFORMS_HOSTED_BENCH_H */
@@ -45,18 +45,34 @@ struct trans_ctx {
     volatile unsigned long flags;
 };
 
+/* Transfers a link can have submitted at once, completed in submission order */
+#define USB_LINK_POOL_SIZE 8U
+
 typedef struct usb_link_s {
 	libusb_context        *ul_libusb_ctx;
 	libusb_device_handle  *ul_libusb_device_handle;
 	unsigned char         ep_tx;
 	unsigned char         ep_rx;
-	struct libusb_transfer* req_trans;
-	struct libusb_transfer* rep_trans;
 	void                  *priv;
+	/* Pre-allocated transfers used as a ring, the oldest one is collected first */
+	struct libusb_transfer *pool[USB_LINK_POOL_SIZE];
+	struct trans_ctx       pool_ctx[USB_LINK_POOL_SIZE];
+	size_t                 pool_head;
+	size_t                 pool_count;
 } usb_link_t;
 
 int send_recv(usb_link_t *link, uint8_t *txbuf, size_t txsize,
 			  uint8_t *rxbuf, size_t rxsize);
+/*
+ * Asynchronous transfers: the buffer stays owned by the caller and must remain
+ * valid until the transfer has been collected. Collecting waits for the oldest
+ * outstanding transfer and returns its actual length, or -1 on error.
+ */
+int usb_link_submit(usb_link_t *link, bool in, uint8_t *buf, size_t size);
+int usb_link_collect(usb_link_t *link);
+size_t usb_link_pending(const usb_link_t *link);
+bool usb_link_ready(const usb_link_t *link);
+void usb_link_cancel(usb_link_t *link);
 #endif
 typedef struct bmp_info_s {
 	bmp_type_t bmp_type;
@@ -73,15 +89,26 @@ typedef struct bmp_info_s {
 	unsigned int vid;
 	unsigned int pid;
 	uint8_t interface_num;
+	uint8_t alt_setting;
 	uint8_t in_ep;
 	uint8_t out_ep;
 #endif
 } bmp_info_t;
 
 extern bmp_info_t info;
+/*
+ * Opens the probe picked by command line style options, as platform_init() does,
+ * for the library's users. NULL if there is none, else the options parsed.
+ */
+BMP_CL_OPTIONS_t *platform_open(int argc, char **argv);
+/* Lets go of the probe platform_open() opened and everything found through it */
+void platform_close(void);
 void bmp_ident(bmp_info_t *info);
 int find_debuggers(BMP_CL_OPTIONS_t *cl_opts,bmp_info_t *info);
 void libusb_exit_function(bmp_info_t *info);
+#if HOSTED_BMP_ONLY != 1
+libusb_device_handle *bmp_libusb_open_probe(bmp_info_t *info);
+#endif
 
 #if defined(_WIN32) || defined(__CYGWIN__)
 #include <wchar.h>
@@ -19,10 +19,12 @@
 
 /* Find all known usb connected debuggers */
 #include "general.h"
+#include <limits.h>
 #include "libusb-1.0/libusb.h"
 #include "cli.h"
 #include "ftdi_bmp.h"
 #include "version.h"
+#include "wire_trace.h"
 
 #define NO_SERIAL_NUMBER "<no serial number>"
 
@@ -41,8 +43,9 @@ void libusb_exit_function(bmp_info_t *info)
 {
 	if (!info->usb_link)
 		return;
-	libusb_free_transfer(info->usb_link->req_trans);
-	libusb_free_transfer(info->usb_link->rep_trans);
+	usb_link_cancel(info->usb_link);
+	for (size_t i = 0; i < USB_LINK_POOL_SIZE; ++i)
+		libusb_free_transfer(info->usb_link->pool[i]);
 	if (info->usb_link->ul_libusb_device_handle) {
 		libusb_release_interface (
 			info->usb_link->ul_libusb_device_handle, 0);
@@ -114,6 +117,322 @@ static bmp_type_t find_cmsis_dap_interface(libusb_device *dev,bmp_info_t *info)
 	return type;
 }
 
+/* Open the USB device behind the Black Magic Probe picked by serial number, or the first one found */
+libusb_device_handle *bmp_libusb_open_probe(bmp_info_t *const info)
+{
+	if (!info->libusb_ctx && libusb_init(&info->libusb_ctx))
+		return NULL;
+	libusb_device **devs;
+	const ssize_t n_devs = libusb_get_device_list(info->libusb_ctx, &devs);
+	if (n_devs < 0)
+		return NULL;
+	libusb_device_handle *result = NULL;
+	for (ssize_t i = 0; i < n_devs && !result; ++i) {
+		struct libusb_device_descriptor desc;
+		if (libusb_get_device_descriptor(devs[i], &desc) || desc.idVendor != VENDOR_ID_BMP ||
+			desc.idProduct != PRODUCT_ID_BMP)
+			continue;
+		libusb_device_handle *handle;
+		if (libusb_open(devs[i], &handle))
+			continue;
+		char serial[64] = "";
+		if (desc.iSerialNumber)
+			libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber, (uint8_t *)serial, sizeof(serial));
+		if (!info->serial[0] || !strcmp(serial, info->serial))
+			result = handle;
+		else
+			libusb_close(handle);
+	}
+	libusb_free_device_list(devs, 1);
+	return result;
+}
+
+/*
+ * A Black Magic Probe offers the remote protocol as a vendor class alternate setting of its GDB data
+ * interface, so it can be driven with raw bulk transfers rather than through the CDC-ACM tty.
+ */
+static void find_bmp_remote_interface(libusb_device *dev, bmp_info_t *info)
+{
+	info->in_ep = 0;
+	info->out_ep = 0;
+	struct libusb_config_descriptor *conf;
+	if (libusb_get_active_config_descriptor(dev, &conf) < 0)
+		return;
+	for (uint8_t i = 0; i < conf->bNumInterfaces; ++i) {
+		const struct libusb_interface *const interface = &conf->interface[i];
+		for (int alt = 1; alt < interface->num_altsetting; ++alt) {
+			const struct libusb_interface_descriptor *const desc = &interface->altsetting[alt];
+			if (desc->bInterfaceClass != LIBUSB_CLASS_VENDOR_SPEC || desc->bNumEndpoints != 2)
+				continue;
+			info->interface_num = desc->bInterfaceNumber;
+			info->alt_setting = desc->bAlternateSetting;
+			for (uint8_t j = 0; j < desc->bNumEndpoints; ++j) {
+				const uint8_t ep = desc->endpoint[j].bEndpointAddress;
+				if (ep & LIBUSB_ENDPOINT_IN)
+					info->in_ep = ep;
+				else
+					info->out_ep = ep;
+			}
+			libusb_free_config_descriptor(conf);
+			return;
+		}
+	}
+	libusb_free_config_descriptor(conf);
+}
+
+/* Whether a device could be the cable named on the command line, judged by VID/PID alone */
+static bool cable_could_be(const char *const name, const struct libusb_device_descriptor *const desc)
+{
+	for (const cable_desc_t *cable = cable_desc; cable->name; ++cable) {
+		if (cable->vendor == desc->idVendor && cable->product == desc->idProduct &&
+			!strncmp(cable->name, name, strlen(cable->name)))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Probe enumeration cache. Finding a probe by serial number means opening every
+ * USB device on the host for its strings, which on a busy host takes hundreds
+ * of milliseconds. The probe picked is remembered with where it sits on the
+ * bus, so a later run given its complete serial number looks there first and
+ * checks the VID/PID and the serial number of just that device. Anything that
+ * doesn't match, such as the probe having been moved, falls back to a full scan,
+ * which then remembers it afresh.
+ */
+#define PROBE_CACHE_FILE    "blackmagic-probes.txt"
+#define PROBE_CACHE_ENTRIES 16U
+/* USB 3 allows for 7 tiers of hubs */
+#define PROBE_CACHE_PORTS 7U
+#define PROBE_CACHE_LINE  512U
+
+typedef struct probe_cache_entry {
+	uint8_t bus;
+	uint8_t ports[PROBE_CACHE_PORTS];
+	int port_count;
+	uint16_t vid;
+	uint16_t pid;
+	bmp_type_t type;
+	uint8_t interface_num;
+	uint8_t alt_setting;
+	uint8_t in_ep;
+	uint8_t out_ep;
+	char serial[64];
+	char cable[64];
+	char manufacturer[128];
+	char product[128];
+} probe_cache_entry_s;
+
+/* Splits off the next tab separated field of line, empty fields included */
+static char *probe_cache_field(char **const line)
+{
+	char *const field = *line;
+	if (!field)
+		return "";
+	char *const end = strpbrk(field, "\t\n");
+	if (end) {
+		*line = *end == '\t' ? end + 1 : NULL;
+		*end = '\0';
+	} else
+		*line = NULL;
+	return field;
+}
+
+static size_t probe_cache_load(probe_cache_entry_s *const entries)
+{
+	char path[PATH_MAX];
+	if (!platform_cache_path(PROBE_CACHE_FILE, path, sizeof(path)))
+		return 0;
+	FILE *const file = fopen(path, "r");
+	if (!file)
+		return 0;
+	size_t count = 0;
+	char line[PROBE_CACHE_LINE];
+	while (count < PROBE_CACHE_ENTRIES && fgets(line, sizeof(line), file)) {
+		probe_cache_entry_s *const entry = &entries[count];
+		memset(entry, 0, sizeof(*entry));
+		char *rest = line;
+		entry->bus = strtoul(probe_cache_field(&rest), NULL, 10);
+		char *ports = probe_cache_field(&rest);
+		while (*ports && entry->port_count < (int)PROBE_CACHE_PORTS) {
+			entry->ports[entry->port_count++] = strtoul(ports, &ports, 10);
+			if (*ports == '.')
+				++ports;
+		}
+		entry->vid = strtoul(probe_cache_field(&rest), NULL, 16);
+		entry->pid = strtoul(probe_cache_field(&rest), NULL, 16);
+		entry->type = (bmp_type_t)strtoul(probe_cache_field(&rest), NULL, 10);
+		entry->interface_num = strtoul(probe_cache_field(&rest), NULL, 10);
+		entry->alt_setting = strtoul(probe_cache_field(&rest), NULL, 10);
+		entry->in_ep = strtoul(probe_cache_field(&rest), NULL, 16);
+		entry->out_ep = strtoul(probe_cache_field(&rest), NULL, 16);
+		snprintf(entry->serial, sizeof(entry->serial), "%s", probe_cache_field(&rest));
+		snprintf(entry->cable, sizeof(entry->cable), "%s", probe_cache_field(&rest));
+		snprintf(entry->manufacturer, sizeof(entry->manufacturer), "%s", probe_cache_field(&rest));
+		snprintf(entry->product, sizeof(entry->product), "%s", probe_cache_field(&rest));
+		/* Only entries for probes with a serial number are ever written, skip anything else */
+		if (entry->serial[0] && entry->port_count && entry->type != BMP_TYPE_NONE)
+			++count;
+	}
+	fclose(file);
+	return count;
+}
+
+/* Tabs and line ends would split a field, USB strings shouldn't have them anyway */
+static void probe_cache_put_string(FILE *const file, const char *const str)
+{
+	for (const char *c = str; *c; ++c)
+		fputc(*c == '\t' || *c == '\n' || *c == '\r' ? ' ' : *c, file);
+}
+
+static void probe_cache_save(const probe_cache_entry_s *const entries, const size_t count)
+{
+	char path[PATH_MAX];
+	if (!platform_cache_path(PROBE_CACHE_FILE, path, sizeof(path)))
+		return;
+	FILE *const file = fopen(path, "w");
+	if (!file) {
+		DEBUG_INFO("Can not write probe cache %s\n", path);
+		return;
+	}
+	for (size_t i = 0; i < count; ++i) {
+		const probe_cache_entry_s *const entry = &entries[i];
+		fprintf(file, "%u\t", entry->bus);
+		for (int port = 0; port < entry->port_count; ++port)
+			fprintf(file, "%s%u", port ? "." : "", entry->ports[port]);
+		fprintf(file, "\t%04x\t%04x\t%u\t%u\t%u\t%02x\t%02x\t", entry->vid, entry->pid, (unsigned)entry->type,
+			entry->interface_num, entry->alt_setting, entry->in_ep, entry->out_ep);
+		probe_cache_put_string(file, entry->serial);
+		fputc('\t', file);
+		probe_cache_put_string(file, entry->cable);
+		fputc('\t', file);
+		probe_cache_put_string(file, entry->manufacturer);
+		fputc('\t', file);
+		probe_cache_put_string(file, entry->product);
+		fputc('\n', file);
+	}
+	fclose(file);
+}
+
+/* The cable_desc name of the cable, so it outlives the cache entry */
+static char *probe_cache_cable(const char *const name)
+{
+	for (cable_desc_t *cable = cable_desc; cable->name; ++cable) {
+		if (!strcmp(cable->name, name))
+			return cable->name;
+	}
+	return NULL;
+}
+
+/* Remember the probe just picked, most recent first, replacing what was known of it or its place on the bus */
+static void probe_cache_remember(libusb_device *const dev, const bmp_info_t *const info, const char *const cable)
+{
+	if (!info->serial[0])
+		return;
+	probe_cache_entry_s entry;
+	memset(&entry, 0, sizeof(entry));
+	entry.bus = libusb_get_bus_number(dev);
+	entry.port_count = libusb_get_port_numbers(dev, entry.ports, PROBE_CACHE_PORTS);
+	if (entry.port_count <= 0)
+		return;
+	entry.vid = info->vid;
+	entry.pid = info->pid;
+	entry.type = info->bmp_type;
+	entry.interface_num = info->interface_num;
+	entry.alt_setting = info->alt_setting;
+	entry.in_ep = info->in_ep;
+	entry.out_ep = info->out_ep;
+	snprintf(entry.serial, sizeof(entry.serial), "%s", info->serial);
+	snprintf(entry.cable, sizeof(entry.cable), "%s", cable ? cable : "");
+	snprintf(entry.manufacturer, sizeof(entry.manufacturer), "%s", info->manufacturer);
+	snprintf(entry.product, sizeof(entry.product), "%s", info->product);
+
+	probe_cache_entry_s *const entries = calloc(PROBE_CACHE_ENTRIES, sizeof(*entries));
+	if (!entries) { /* calloc failed: heap exhaustion */
+		DEBUG_WARN("calloc: failed in %s\n", __func__);
+		return;
+	}
+	const size_t loaded = probe_cache_load(entries);
+	/* Nothing to write when it is already the most recent entry */
+	if (!loaded || memcmp(&entries[0], &entry, sizeof(entry))) {
+		size_t count = 1;
+		for (size_t i = 0; i < loaded && count < PROBE_CACHE_ENTRIES; ++i) {
+			const bool same_place = entries[i].bus == entry.bus && entries[i].port_count == entry.port_count &&
+				!memcmp(entries[i].ports, entry.ports, sizeof(entry.ports));
+			if (!same_place && strcmp(entries[i].serial, entry.serial))
+				entries[count++] = entries[i];
+		}
+		entries[0] = entry;
+		probe_cache_save(entries, count);
+	}
+	free(entries);
+}
+
+/*
+ * With a complete serial number the probe may be found where it was last time.
+ * Other selections, such as by position or ident string, need the full scan.
+ */
+static bool probe_cache_find(BMP_CL_OPTIONS_t *const cl_opts, bmp_info_t *const info, libusb_device **const devs)
+{
+	if (!cl_opts->opt_serial || cl_opts->opt_position || cl_opts->opt_list_only || cl_opts->opt_ident_string ||
+		cl_opts->opt_cable)
+		return false;
+	probe_cache_entry_s *const entries = calloc(PROBE_CACHE_ENTRIES, sizeof(*entries));
+	if (!entries) /* calloc failed: heap exhaustion */
+		return false;
+	const size_t count = probe_cache_load(entries);
+	const probe_cache_entry_s *entry = NULL;
+	for (size_t i = 0; i < count && !entry; ++i) {
+		if (!strcmp(entries[i].serial, cl_opts->opt_serial))
+			entry = &entries[i];
+	}
+
+	bool found = false;
+	for (size_t i = 0; entry && devs[i] && !found; ++i) {
+		libusb_device *const dev = devs[i];
+		uint8_t ports[PROBE_CACHE_PORTS];
+		const int port_count = libusb_get_port_numbers(dev, ports, PROBE_CACHE_PORTS);
+		struct libusb_device_descriptor desc;
+		if (libusb_get_bus_number(dev) != entry->bus || port_count != entry->port_count ||
+			memcmp(ports, entry->ports, (size_t)port_count) || libusb_get_device_descriptor(dev, &desc) ||
+			desc.idVendor != entry->vid || desc.idProduct != entry->pid || !desc.iSerialNumber)
+			continue;
+		/* Right place and kind of device, its serial number says whether it is the same probe */
+		libusb_device_handle *handle;
+		if (libusb_open(dev, &handle) != LIBUSB_SUCCESS)
+			break;
+		char serial[64];
+		const int res =
+			libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber, (uint8_t *)serial, sizeof(serial));
+		libusb_close(handle);
+		if (res <= 0 || (size_t)res >= sizeof(serial))
+			break;
+		serial[res] = '\0';
+		if (strcmp(serial, entry->serial))
+			break;
+		char *const cable = entry->type == BMP_TYPE_LIBFTDI ? probe_cache_cable(entry->cable) : NULL;
+		if (entry->type == BMP_TYPE_LIBFTDI && !cable)
+			break;
+		info->vid = entry->vid;
+		info->pid = entry->pid;
+		info->bmp_type = entry->type;
+		info->interface_num = entry->interface_num;
+		info->alt_setting = entry->alt_setting;
+		info->in_ep = entry->in_ep;
+		info->out_ep = entry->out_ep;
+		snprintf(info->serial, sizeof(info->serial), "%s", entry->serial);
+		snprintf(info->manufacturer, sizeof(info->manufacturer), "%s", entry->manufacturer);
+		snprintf(info->product, sizeof(info->product), "%s", entry->product);
+		if (cable)
+			cl_opts->opt_cable = cable;
+		found = true;
+	}
+	if (entry && !found)
+		DEBUG_INFO("Probe %s is not where it was last time, scanning\n", entry->serial);
+	free(entries);
+	return found;
+}
+
 int find_debuggers(BMP_CL_OPTIONS_t *cl_opts, bmp_info_t *info)
 {
 	libusb_device **devs;
@@ -142,6 +461,10 @@ int find_debuggers(BMP_CL_OPTIONS_t *cl_opts, bmp_info_t *info)
         DEBUG_WARN( "WARN:libusb_get_device_list() failed");
 		return -1;
 	}
+	if (probe_cache_find(cl_opts, info, devs)) {
+		libusb_free_device_list(devs, 1);
+		return 0;
+	}
 	bool report = false;
 	int found_debuggers;
 	struct libusb_device_descriptor desc;
@@ -151,6 +474,7 @@ int find_debuggers(BMP_CL_OPTIONS_t *cl_opts, bmp_info_t *info)
 	bool access_problems = false;
 	char *active_cable = NULL;
 	bool ftdi_unknown = false;
+	libusb_device *found_dev = NULL;
 rescan:
 	found_debuggers = 0;
 	serial[0] = 0;
@@ -175,6 +499,9 @@ rescan:
 		case LIBUSB_CLASS_WIRELESS:
 			continue;
 		}
+		/* With a cable given, opening anything else for its strings is wasted time */
+		if (cl_opts->opt_cable && !cable_could_be(cl_opts->opt_cable, &desc))
+			continue;
 		libusb_device_handle *handle = NULL;
 		res = libusb_open(dev, &handle);
 		if (res != LIBUSB_SUCCESS) {
@@ -250,9 +577,10 @@ rescan:
 		/* Either serial and/or ident_string match or are not given.
 		 * Check type.*/
 		if (desc.idVendor == VENDOR_ID_BMP) {
-			if (desc.idProduct == PRODUCT_ID_BMP)
+			if (desc.idProduct == PRODUCT_ID_BMP) {
 				type = BMP_TYPE_BMP;
-			else {
+				find_bmp_remote_interface(dev, info);
+			} else {
 				if (desc.idProduct == PRODUCT_ID_BMP_BL)
 					DEBUG_WARN("BMP in bootloader mode found. Restart or reflash!\n");
 				continue;
@@ -318,14 +646,16 @@ rescan:
 				serial[0] ? serial :  NO_SERIAL_NUMBER,
 				manufacturer,product);
 		}
+		found_dev = dev;
 		info->vid = desc.idVendor;
 		info->pid = desc.idProduct;
 		info->bmp_type = type;
 		strncpy(info->serial, serial, sizeof(info->serial));
 		strncpy(info->product, product, sizeof(info->product));
 		strncpy(info->manufacturer, manufacturer, sizeof(info->manufacturer));
-		if (cl_opts->opt_position &&
-			cl_opts->opt_position == found_debuggers + 1) {
+		/* A position or a complete serial number picks one probe, the rest of the bus needn't be looked at */
+		if ((cl_opts->opt_position && cl_opts->opt_position == found_debuggers + 1) ||
+			(!report && cl_opts->opt_serial && !strcmp(serial, cl_opts->opt_serial))) {
 			found_debuggers = 1;
 			break;
 		} else
@@ -335,6 +665,8 @@ rescan:
 		DEBUG_WARN("Generic FTDI MPSSE VID/PID found. Please specify exact type with \"-c <cable>\" !\n");
 	if (found_debuggers == 1 && !cl_opts->opt_cable && info->bmp_type == BMP_TYPE_LIBFTDI)
 		cl_opts->opt_cable = active_cable;
+	if (found_debuggers == 1 && !report)
+		probe_cache_remember(found_dev, info, info->bmp_type == BMP_TYPE_LIBFTDI ? cl_opts->opt_cable : NULL);
 	if (!found_debuggers && cl_opts->opt_list_only)
 		DEBUG_WARN("No usable debugger found\n");
 	if (found_debuggers > 1 ||
@@ -379,24 +711,10 @@ static void LIBUSB_CALL on_trans_done(struct libusb_transfer *trans)
     ctx->flags |= TRANS_FLAGS_IS_DONE;
 }
 
-static int submit_wait(usb_link_t *link, struct libusb_transfer *trans) {
-	struct trans_ctx trans_ctx;
-	enum libusb_error error;
-
-	trans_ctx.flags = 0;
-
-	/* brief intrusion inside the libusb interface */
-	trans->callback = on_trans_done;
-	trans->user_data = &trans_ctx;
-
-	if ((error = libusb_submit_transfer(trans))) {
-		DEBUG_WARN("libusb_submit_transfer(%d): %s\n", error,
-			  libusb_strerror(error));
-		exit(-1);
-	}
-
+static int wait_transfer(usb_link_t *link, struct libusb_transfer *trans, struct trans_ctx *trans_ctx)
+{
 	uint32_t start_time = platform_time_ms();
-	while (trans_ctx.flags == 0) {
+	while (trans_ctx->flags == 0) {
 		struct timeval timeout;
 		timeout.tv_sec = 1;
 		timeout.tv_usec = 0;
@@ -408,10 +726,15 @@ static int submit_wait(usb_link_t *link, struct libusb_transfer *trans) {
 		if (now - start_time > 1000) {
 			libusb_cancel_transfer(trans);
 			DEBUG_WARN("libusb_handle_events() timeout\n");
+			/* Let the cancellation complete so the transfer can be reused */
+			while (!(trans_ctx->flags & TRANS_FLAGS_IS_DONE)) {
+				if (libusb_handle_events_timeout(link->ul_libusb_ctx, &timeout))
+					break;
+			}
 			return -1;
 		}
 	}
-	if (trans_ctx.flags & TRANS_FLAGS_HAS_ERROR) {
+	if (trans_ctx->flags & TRANS_FLAGS_HAS_ERROR) {
 		DEBUG_WARN("libusb_handle_events() | has_error\n");
 		return -1;
 	}
@@ -419,18 +742,80 @@ static int submit_wait(usb_link_t *link, struct libusb_transfer *trans) {
 	return 0;
 }
 
-/* One USB transaction */
+int usb_link_submit(usb_link_t *link, bool in, uint8_t *buf, size_t size)
+{
+	if (link->pool_count == USB_LINK_POOL_SIZE)
+		return -1;
+	const size_t slot = (link->pool_head + link->pool_count) % USB_LINK_POOL_SIZE;
+	if (!link->pool[slot]) {
+		link->pool[slot] = libusb_alloc_transfer(0);
+		if (!link->pool[slot])
+			return -1;
+	}
+	struct libusb_transfer *trans = link->pool[slot];
+	struct trans_ctx *trans_ctx = &link->pool_ctx[slot];
+	libusb_fill_bulk_transfer(trans, link->ul_libusb_device_handle,
+		in ? (link->ep_rx | LIBUSB_ENDPOINT_IN) : (link->ep_tx | LIBUSB_ENDPOINT_OUT), buf, size,
+		on_trans_done, trans_ctx, 0);
+	trans_ctx->flags = 0;
+
+	const enum libusb_error error = libusb_submit_transfer(trans);
+	if (error) {
+		DEBUG_WARN("libusb_submit_transfer(%d): %s\n", error, libusb_strerror(error));
+		return -1;
+	}
+	++link->pool_count;
+	return 0;
+}
+
+int usb_link_collect(usb_link_t *link)
+{
+	if (!link->pool_count)
+		return -1;
+	const size_t slot = link->pool_head;
+	struct libusb_transfer *trans = link->pool[slot];
+	const int res = wait_transfer(link, trans, &link->pool_ctx[slot]);
+	link->pool_head = (link->pool_head + 1U) % USB_LINK_POOL_SIZE;
+	--link->pool_count;
+	if (res) {
+		const bool in = trans->endpoint & LIBUSB_ENDPOINT_IN;
+		libusb_clear_halt(link->ul_libusb_device_handle, in ? link->ep_rx : link->ep_tx);
+		return -1;
+	}
+	return trans->actual_length;
+}
+
+size_t usb_link_pending(const usb_link_t *link)
+{
+	return link->pool_count;
+}
+
+/* True once the oldest outstanding transfer has finished, so collecting it won't block */
+bool usb_link_ready(const usb_link_t *link)
+{
+	return link->pool_count && (link->pool_ctx[link->pool_head].flags & TRANS_FLAGS_IS_DONE);
+}
+
+/* Abandon everything outstanding, waiting for libusb to hand the transfers back */
+void usb_link_cancel(usb_link_t *link)
+{
+	for (size_t i = 0; i < link->pool_count; ++i)
+		libusb_cancel_transfer(link->pool[(link->pool_head + i) % USB_LINK_POOL_SIZE]);
+	while (link->pool_count)
+		usb_link_collect(link);
+}
+
+/*
+ * One USB transaction. The response transfer is submitted together with the
+ * request, so the USB stack already holds it when the adaptor answers.
+ */
 int send_recv(usb_link_t *link,
 					 uint8_t *txbuf, size_t txsize,
 					 uint8_t *rxbuf, size_t rxsize)
 {
 	int res = 0;
 	if (txsize) {
-		libusb_fill_bulk_transfer(link->req_trans,
-								  link->ul_libusb_device_handle,
-								  link->ep_tx | LIBUSB_ENDPOINT_OUT,
-								  txbuf, txsize,
-								  NULL, NULL, 0);
+		wire_trace_request(WIRE_TRACE_USB, txbuf, txsize);
 		size_t i = 0;
 		DEBUG_WIRE(" Send (%3zu): ", txsize);
 		for (; i < txsize; ++i) {
@@ -442,24 +827,27 @@ int send_recv(usb_link_t *link,
 		}
 		if (!(i & 31U))
 			DEBUG_WIRE("\n");
-		if (submit_wait(link, link->req_trans)) {
-			libusb_clear_halt(link->ul_libusb_device_handle, link->ep_tx);
+		if (usb_link_submit(link, false, txbuf, txsize)) {
+			usb_link_cancel(link);
 			return -1;
 		}
 	}
 	/* send_only */
+	if (rxsize != 0 && usb_link_submit(link, true, rxbuf, rxsize)) {
+		usb_link_cancel(link);
+		return -1;
+	}
+	if (txsize && usb_link_collect(link) < 0) {
+		usb_link_cancel(link);
+		return -1;
+	}
 	if (rxsize != 0) {
 		/* read the response */
-		libusb_fill_bulk_transfer(link->rep_trans, link->ul_libusb_device_handle,
-								  link->ep_rx | LIBUSB_ENDPOINT_IN,
-								  rxbuf, rxsize, NULL, NULL, 0);
-
-		if (submit_wait(link, link->rep_trans)) {
+		res = usb_link_collect(link);
+		if (res < 0) {
 			DEBUG_WARN("clear 1\n");
-			libusb_clear_halt(link->ul_libusb_device_handle, link->ep_rx);
 			return -1;
 		}
-		res = link->rep_trans->actual_length;
 		if (res > 0) {
 			const size_t rxlen = (size_t)res;
 			DEBUG_WIRE(" Rec (%zu/%zu)", rxsize, rxlen);
@@ -469,6 +857,7 @@ int send_recv(usb_link_t *link,
 				DEBUG_WIRE("%02x", rxbuf[i]);
 			}
 		}
+		wire_trace_response(WIRE_TRACE_USB, rxbuf, (size_t)res, res);
 	}
 	DEBUG_WIRE("\n");
 	return res;
@@ -35,6 +35,13 @@
 
 #include "adiv5.h"
 
+/* Size of the firmware's packet buffer, as reported over the v3 HL protocol */
+static size_t remote_packet_size = REMOTE_MAX_MSG_SIZE;
+/* Big enough for the escaped form of the largest binary transfer */
+static uint8_t remote_buffer[2U * REMOTE_BIN_MAX_MSG_SIZE + 16U];
+/* Set once the firmware has taken the binary memory transfers */
+static bool remote_binary;
+
 int remote_init(void)
 {
 	char construct[REMOTE_MAX_MSG_SIZE];
@@ -180,6 +187,22 @@ const char *remote_target_voltage(void)
 	return (char *)&construct[1];
 }
 
+/* Starts raw trace capture on the probe, returning false if its firmware can't */
+bool remote_traceswo_init(const uint32_t baudrate, uint32_t *const actual)
+{
+	char buffer[REMOTE_MAX_MSG_SIZE];
+	int length = snprintf(buffer, REMOTE_MAX_MSG_SIZE, REMOTE_TRACESWO_STR, baudrate);
+	platform_buffer_write((uint8_t *)buffer, length);
+
+	length = platform_buffer_read((uint8_t *)buffer, REMOTE_MAX_MSG_SIZE);
+	if (length < 1 || buffer[0] != REMOTE_RESP_OK) {
+		DEBUG_WARN("Update Firmware to allow to start trace capture\n");
+		return false;
+	}
+	unhexify(actual, buffer + 1, 4);
+	return true;
+}
+
 void remote_target_clk_output_enable(const bool enable)
 {
 	char buffer[REMOTE_MAX_MSG_SIZE];
@@ -191,9 +214,122 @@ void remote_target_clk_output_enable(const bool enable)
 		DEBUG_WARN("remote_target_clk_output_enable failed, error %s\n", length ? buffer + 1 : "unknown");
 }
 
+/*
+ * DP/AP accesses the target drivers queue go to the probe in batches (HB) that
+ * it runs in order through its own DP queue. A batch is sent once it is full,
+ * with up to REMOTE_BATCH_DEPTH of them in flight, and the flush collects
+ * the rest, so a halt check or a register file transfer costs a single round
+ * trip instead of one per access, which is what keeps a high latency link usable.
+ */
+#define REMOTE_BATCH_DEPTH 4U
+
+typedef struct remote_batch {
+	uint32_t *results[REMOTE_BATCH_MAX];
+	size_t reads;
+} remote_batch_s;
+
+typedef struct remote_queue {
+	remote_batch_s batches[REMOTE_BATCH_DEPTH];
+	size_t oldest;
+	size_t outstanding;
+	/* The request of the batch being filled, after the outstanding ones */
+	char request[REMOTE_MAX_MSG_SIZE];
+	size_t length;
+	size_t accesses;
+	bool failed;
+} remote_queue_s;
+
+static remote_queue_s remote_queue;
+
+static void remote_queue_collect(void)
+{
+	const remote_batch_s *const batch = &remote_queue.batches[remote_queue.oldest];
+	remote_queue.oldest = (remote_queue.oldest + 1U) % REMOTE_BATCH_DEPTH;
+	--remote_queue.outstanding;
+
+	const int s = platform_buffer_read(remote_buffer, sizeof(remote_buffer));
+	if (s < 1) {
+		/* Nothing more is going to arrive in order, stop waiting on the rest */
+		DEBUG_WARN("Remote batch error %d\n", s);
+		remote_queue.failed = true;
+		remote_queue.outstanding = 0;
+		return;
+	}
+	if (remote_buffer[0] != REMOTE_RESP_OK || (size_t)s - 1U < batch->reads * 8U) {
+		remote_queue.failed = true;
+		return;
+	}
+	for (size_t i = 0; i < batch->reads; ++i)
+		unhexify(batch->results[i], (const char *)remote_buffer + 1U + i * 8U, 4U);
+}
+
+static void remote_queue_send(void)
+{
+	remote_queue.request[remote_queue.length++] = REMOTE_EOM;
+	platform_buffer_write((const uint8_t *)remote_queue.request, remote_queue.length);
+	++remote_queue.outstanding;
+	remote_queue.length = 0;
+	remote_queue.accesses = 0;
+}
+
+/* Sends what is queued and waits for all of it, before any other request can go out */
+static void remote_queue_drain(void)
+{
+	if (remote_queue.accesses)
+		remote_queue_send();
+	while (remote_queue.outstanding)
+		remote_queue_collect();
+}
+
+static void remote_queue_access(ADIv5_DP_t *dp, const bool read, const uint16_t addr, const uint32_t value,
+	uint32_t *const result)
+{
+	if (remote_queue.accesses == REMOTE_BATCH_MAX)
+		remote_queue_send();
+	if (!remote_queue.accesses) {
+		if (remote_queue.outstanding == REMOTE_BATCH_DEPTH)
+			remote_queue_collect();
+		remote_queue.length = snprintf(remote_queue.request, sizeof(remote_queue.request), REMOTE_HL_BATCH_STR,
+			dp->dp_jd_index);
+		remote_queue.batches[(remote_queue.oldest + remote_queue.outstanding) % REMOTE_BATCH_DEPTH].reads = 0;
+	}
+	remote_batch_s *const batch =
+		&remote_queue.batches[(remote_queue.oldest + remote_queue.outstanding) % REMOTE_BATCH_DEPTH];
+	char *const request = remote_queue.request + remote_queue.length;
+	const size_t space = sizeof(remote_queue.request) - remote_queue.length;
+	if (read) {
+		batch->results[batch->reads++] = result;
+		remote_queue.length += snprintf(request, space, REMOTE_BATCH_READ_STR, addr);
+	} else
+		remote_queue.length += snprintf(request, space, REMOTE_BATCH_WRITE_STR, addr, value);
+	++remote_queue.accesses;
+}
+
+static void remote_queue_read(ADIv5_DP_t *dp, uint16_t addr, uint32_t *result)
+{
+	remote_queue_access(dp, true, addr, 0, result);
+}
+
+static void remote_queue_write(ADIv5_DP_t *dp, uint16_t addr, uint32_t value)
+{
+	remote_queue_access(dp, false, addr, value, NULL);
+}
+
+/* The probe already cleared whatever error a batch ran into */
+static bool remote_queue_flush(ADIv5_DP_t *dp)
+{
+	remote_queue_drain();
+	const bool failed = remote_queue.failed;
+	remote_queue.failed = false;
+	if (failed)
+		adiv5_dp_cache_invalidate(dp);
+	return failed;
+}
+
 static uint32_t remote_adiv5_dp_read(ADIv5_DP_t *dp, uint16_t addr)
 {
 	(void)dp;
+	remote_queue_drain();
 	uint8_t construct[REMOTE_MAX_MSG_SIZE];
 	int s = snprintf((char *)construct, REMOTE_MAX_MSG_SIZE, REMOTE_DP_READ_STR,
 		dp->dp_jd_index, addr);
@@ -204,7 +340,7 @@ static uint32_t remote_adiv5_dp_read(ADIv5_DP_t *dp, uint16_t addr)
 	}
     uint32_t dest[1];
 	unhexify(dest, (const char*)&construct[1], 4);
-	DEBUG_PROBE("dp_read addr %04x: %08" PRIx32 "\n", dest[0]);
+	DEBUG_PROBE("dp_read addr %04x: %08" PRIx32 "\n", addr, dest[0]);
 	return dest[0];
 }
 
@@ -212,6 +348,7 @@ static uint32_t remote_adiv5_low_access(
 	ADIv5_DP_t *dp, uint8_t RnW, uint16_t addr, uint32_t value)
 {
 	(void)dp;
+	remote_queue_drain();
 	uint8_t construct[REMOTE_MAX_MSG_SIZE];
 	int s = snprintf((char *)construct, REMOTE_MAX_MSG_SIZE,
 		REMOTE_LOW_ACCESS_STR, dp->dp_jd_index, RnW, addr, value);
@@ -227,7 +364,10 @@ static uint32_t remote_adiv5_low_access(
 
 static uint32_t remote_adiv5_ap_read(ADIv5_AP_t *ap, uint16_t addr)
 {
+	remote_queue_drain();
 	uint8_t construct[REMOTE_MAX_MSG_SIZE];
+	/* The remote end does its own SELECT/CSW/TAR setup */
+	adiv5_dp_cache_invalidate(ap->dp);
 	int s = snprintf((char *)construct, REMOTE_MAX_MSG_SIZE,REMOTE_AP_READ_STR,
 		ap->dp->dp_jd_index, ap->apsel, addr);
 	platform_buffer_write(construct, s);
@@ -242,7 +382,9 @@ static uint32_t remote_adiv5_ap_read(ADIv5_AP_t *ap, uint16_t addr)
 
 static void remote_adiv5_ap_write(ADIv5_AP_t *ap, uint16_t addr, uint32_t value)
 {
+	remote_queue_drain();
 	uint8_t construct[REMOTE_MAX_MSG_SIZE];
+	adiv5_dp_cache_invalidate(ap->dp);
 	int s = snprintf((char *)construct, REMOTE_MAX_MSG_SIZE,REMOTE_AP_WRITE_STR,
 		ap->dp->dp_jd_index,  ap->apsel, addr, value);
 	platform_buffer_write(construct, s);
@@ -296,83 +438,208 @@ static void remote_mem_read(
 }
 #endif
 
+/*
+ * The probe handles remote packets strictly in order, so memory transfers keep
+ * up to REMOTE_PIPELINE_DEPTH chunk requests in flight and match each response
+ * to the oldest outstanding one, rather than paying a USB round trip per chunk.
+ * Only small requests or small responses are ever queued together which keeps
+ * the host from blocking in a write while the probe blocks sending to it.
+ */
+#define REMOTE_PIPELINE_DEPTH 4U
+
+typedef struct remote_request {
+	uint32_t address;
+	uint8_t *dest; /* Where a read's data goes, NULL for writes */
+	size_t count;
+} remote_request_s;
+
+typedef struct remote_pipeline {
+	remote_request_s requests[REMOTE_PIPELINE_DEPTH];
+	size_t oldest;
+	size_t outstanding;
+	/* Failures are collected here while the rest of the window drains */
+	bool failed;
+	bool link_error;
+	uint32_t fault_address;
+} remote_pipeline_s;
+
+static void remote_pipeline_push(remote_pipeline_s *pipeline, uint32_t address, uint8_t *dest, size_t count)
+{
+	remote_request_s *request =
+		&pipeline->requests[(pipeline->oldest + pipeline->outstanding) % REMOTE_PIPELINE_DEPTH];
+	request->address = address;
+	request->dest = dest;
+	request->count = count;
+	++pipeline->outstanding;
+}
+
+static bool remote_pipeline_can_issue(const remote_pipeline_s *pipeline)
+{
+	return !pipeline->failed && pipeline->outstanding < REMOTE_PIPELINE_DEPTH;
+}
+
+static void remote_pipeline_fail(remote_pipeline_s *pipeline, const remote_request_s *request)
+{
+	if (!pipeline->failed)
+		pipeline->fault_address = request->address;
+	pipeline->failed = true;
+}
+
+/* Collect the response to the oldest outstanding request */
+static void remote_pipeline_collect(remote_pipeline_s *pipeline)
+{
+	const remote_request_s *request = &pipeline->requests[pipeline->oldest];
+	pipeline->oldest = (pipeline->oldest + 1U) % REMOTE_PIPELINE_DEPTH;
+	--pipeline->outstanding;
+
+	const int s = platform_buffer_read(remote_buffer, sizeof(remote_buffer));
+	if (s < 1) {
+		/* Nothing more is going to arrive in order, stop waiting on the rest */
+		DEBUG_WARN("Remote memory access error %d around 0x%08" PRIx32 "\n", s, request->address);
+		remote_pipeline_fail(pipeline, request);
+		pipeline->link_error = true;
+		pipeline->outstanding = 0;
+		return;
+	}
+	if (remote_buffer[0] != REMOTE_RESP_OK) {
+		remote_pipeline_fail(pipeline, request);
+		return;
+	}
+	if (!request->dest)
+		return;
+	const char *const data = (const char *)remote_buffer + 1;
+	const size_t length = (size_t)s - 1U;
+	if (remote_binary) {
+		if (remote_unescape(request->dest, data, length) != request->count)
+			remote_pipeline_fail(pipeline, request);
+	} else if (length < request->count * 2U)
+		remote_pipeline_fail(pipeline, request);
+	else
+		unhexify(request->dest, data, request->count);
+}
+
+static void remote_pipeline_finish(ADIv5_AP_t *ap, const remote_pipeline_s *pipeline, const char *func)
+{
+	if (!pipeline->failed)
+		return;
+	ap->dp->fault = 1;
+	if (!pipeline->link_error)
+		DEBUG_WARN("%s returned REMOTE_RESP_ERR at apsel %d, addr: 0x%08" PRIx32 "\n", func, ap->apsel,
+			pipeline->fault_address);
+}
+
+/* Issue a read of up to len bytes at src, returning how many it covers */
+static size_t remote_mem_read_request(ADIv5_AP_t *ap, uint32_t src, size_t len)
+{
+	size_t count;
+	int s;
+	if (remote_binary) {
+		/* Leave the firmware room to align its buffer */
+		count = MIN(len, MIN(remote_packet_size, REMOTE_BIN_MAX_MSG_SIZE) - 8U);
+		s = snprintf((char *)remote_buffer, sizeof(remote_buffer), REMOTE_AP_MEM_READ_BIN_STR,
+			ap->dp->dp_jd_index, ap->apsel, ap->csw, src, (uint32_t)count);
+	} else {
+		count = MIN(len, (REMOTE_MAX_MSG_SIZE - 0x20U) / 2U);
+		s = snprintf((char *)remote_buffer, sizeof(remote_buffer), REMOTE_AP_MEM_READ_STR,
+			ap->dp->dp_jd_index, ap->apsel, ap->csw, src, (uint32_t)count);
+	}
+	platform_buffer_write(remote_buffer, s);
+	return count;
+}
+
+/*
+ * Issue a write of up to len bytes to dest, returning how many it covers.
+ * Binary transfers send data raw apart from escaping the framing characters,
+ * so they carry close to twice what the hex ones do in the same packet.
+ */
+static size_t remote_mem_write_request(ADIv5_AP_t *ap, uint32_t dest, const uint8_t *data, size_t len,
+	enum align align)
+{
+	size_t count = 0;
+	uint8_t *p;
+	if (remote_binary) {
+		/*
+		 * Everything but the header, EOM and the firmware's NUL terminator is data.
+		 * The header's fields expand to at most 8 characters more than their format.
+		 */
+		const size_t header = sizeof(REMOTE_AP_MEM_WRITE_BIN_STR) + 8U;
+		const size_t budget = MIN(remote_packet_size, REMOTE_BIN_MAX_MSG_SIZE) - header - 2U;
+		const size_t unit = 1U << align;
+		/* Take whole units for as long as their escaped form fits the budget */
+		size_t escaped = 0;
+		while (count < len) {
+			const size_t step = MIN(unit, len - count);
+			size_t step_escaped = 0;
+			for (size_t i = 0; i < step; ++i)
+				step_escaped += remote_needs_escape(data[count + i]) ? 2U : 1U;
+			if (escaped + step_escaped > budget)
+				break;
+			escaped += step_escaped;
+			count += step;
+		}
+		const int s = snprintf((char *)remote_buffer, sizeof(remote_buffer), REMOTE_AP_MEM_WRITE_BIN_STR,
+			ap->dp->dp_jd_index, ap->apsel, ap->csw, align, dest, (uint32_t)count);
+		p = remote_buffer + s;
+		p += remote_escape((char *)p, data, count);
+	} else {
+		/* (5 * 1 (char)) + (2 * 2 (bytes)) + (3 * 8 (words)) */
+		count = MIN(len, (REMOTE_MAX_MSG_SIZE - 0x30U) / 2U);
+		const int s = snprintf((char *)remote_buffer, sizeof(remote_buffer), REMOTE_AP_MEM_WRITE_SIZED_STR,
+			ap->dp->dp_jd_index, ap->apsel, ap->csw, align, dest, (uint32_t)count);
+		p = remote_buffer + s;
+		hexify((char *)p, data, count);
+		p += 2U * count;
+	}
+	*p++ = REMOTE_EOM;
+	platform_buffer_write(remote_buffer, p - remote_buffer);
+	return count;
+}
+
 static void remote_ap_mem_read(
 	ADIv5_AP_t *ap, void *dest, uint32_t src, size_t len)
 {
-	(void)ap;
-	if (len == 0)
-		return;
-	char construct[REMOTE_MAX_MSG_SIZE];
-	int batchsize = (REMOTE_MAX_MSG_SIZE - 0x20) / 2;
-	while (len) {
-		int s;
-		int count = len;
-		if (count > batchsize)
-			count = batchsize;
-		s = snprintf(construct, REMOTE_MAX_MSG_SIZE, REMOTE_AP_MEM_READ_STR,
-			ap->dp->dp_jd_index, ap->apsel, ap->csw, src, count);
-		platform_buffer_write((uint8_t*)construct, s);
-		s = platform_buffer_read((uint8_t*)construct, REMOTE_MAX_MSG_SIZE);
-		if (s > 0 && construct[0] == REMOTE_RESP_OK) {
-			unhexify(dest, (const char*)&construct[1], count);
+	remote_queue_drain();
+	adiv5_dp_cache_invalidate(ap->dp);
+	uint8_t *data = dest;
+	remote_pipeline_s pipeline = {0};
+	while (len || pipeline.outstanding) {
+		while (len && remote_pipeline_can_issue(&pipeline)) {
+			const size_t count = remote_mem_read_request(ap, src, len);
+			remote_pipeline_push(&pipeline, src, data, count);
 			src  += count;
-			dest += count;
+			data += count;
 			len  -= count;
-			continue;
-		} else {
-			if (construct[0] == REMOTE_RESP_ERR) {
-				ap->dp->fault = 1;
-				DEBUG_WARN("%s returned REMOTE_RESP_ERR at apsel %d, "
-					"addr: 0x%08" PRIx32 "\n", __func__, ap->apsel, src);
-				break;
-			} else {
-				DEBUG_WARN("%s error %d around 0x%08" PRIx32 "\n",
-					__func__, s, src);
-				break;
-			}
 		}
+		if (pipeline.failed)
+			len = 0;
+		if (pipeline.outstanding)
+			remote_pipeline_collect(&pipeline);
 	}
+	remote_pipeline_finish(ap, &pipeline, __func__);
 }
 
 static void remote_ap_mem_write_sized(
 	ADIv5_AP_t *ap, uint32_t dest, const void *src, size_t len,
 	enum align align)
 {
-	(void)ap;
-	if (len == 0)
-		return;
-	char construct[REMOTE_MAX_MSG_SIZE];
-	/* (5 * 1 (char)) + (2 * 2 (bytes)) + (3 * 8 (words)) */
-	int batchsize = (REMOTE_MAX_MSG_SIZE - 0x30) / 2;
-	while (len) {
-		int count = len;
-		if (count > batchsize)
-			count = batchsize;
-		int s = snprintf(construct, REMOTE_MAX_MSG_SIZE, REMOTE_AP_MEM_WRITE_SIZED_STR,
-			ap->dp->dp_jd_index, ap->apsel, ap->csw, align, dest, count);
-		char *p = construct + s;
-		hexify(p, src, count);
-		p += 2 * count;
-		src  += count;
-		dest += count;
-		len  -= count;
-		*p++ = REMOTE_EOM;
-		*p   = 0;
-		platform_buffer_write((uint8_t*)construct, p - construct);
-
-		s = platform_buffer_read((uint8_t*)construct, REMOTE_MAX_MSG_SIZE);
-		if (s > 0 && construct[0] == REMOTE_RESP_OK)
-			continue;
-		if (s > 0 && construct[0] == REMOTE_RESP_ERR) {
-			ap->dp->fault = 1;
-			DEBUG_WARN("%s returned REMOTE_RESP_ERR at apsel %d, "
-				"addr: 0x%08x\n", __func__, ap->apsel, dest);
-		} else {
-			DEBUG_WARN("%s error %d around address 0x%08" PRIx32 "\n",
-				__func__, s, dest);
-			break;
+	remote_queue_drain();
+	adiv5_dp_cache_invalidate(ap->dp);
+	const uint8_t *data = src;
+	remote_pipeline_s pipeline = {0};
+	while (len || pipeline.outstanding) {
+		while (len && remote_pipeline_can_issue(&pipeline)) {
+			const size_t count = remote_mem_write_request(ap, dest, data, len, align);
+			remote_pipeline_push(&pipeline, dest, NULL, count);
+			dest += count;
+			data += count;
+			len  -= count;
 		}
+		if (pipeline.failed)
+			len = 0;
+		if (pipeline.outstanding)
+			remote_pipeline_collect(&pipeline);
 	}
+	remote_pipeline_finish(ap, &pipeline, __func__);
 }
 
 void remote_adiv5_dp_defaults(ADIv5_DP_t *dp)
@@ -382,8 +649,9 @@ void remote_adiv5_dp_defaults(ADIv5_DP_t *dp)
 		REMOTE_HL_CHECK_STR);
 	platform_buffer_write(construct, s);
 	s = platform_buffer_read(construct, REMOTE_MAX_MSG_SIZE);
-	if (s < 1 || construct[0] == REMOTE_RESP_ERR ||
-		construct[1] - '0' < REMOTE_HL_VERSION) {
+	remote_binary = false;
+	const uint64_t version = s < 1 || construct[0] == REMOTE_RESP_ERR ? 0 : remotehston(8, (const char *)construct + 1);
+	if (version < 2) {
 		DEBUG_WARN("Please update BMP firmware for substantial speed increase!\n");
 		return;
 	}
@@ -393,6 +661,27 @@ void remote_adiv5_dp_defaults(ADIv5_DP_t *dp)
 	dp->ap_read    = remote_adiv5_ap_read;
 	dp->mem_read   = remote_ap_mem_read;
 	dp->mem_write_sized = remote_ap_mem_write_sized;
+	if (version >= REMOTE_HL_VERSION_BATCH) {
+		dp->queue_read  = remote_queue_read;
+		dp->queue_write = remote_queue_write;
+		dp->queue_flush = remote_queue_flush;
+	}
+	if (version < REMOTE_HL_VERSION_BINARY) {
+		DEBUG_WARN("Please update BMP firmware for binary memory transfers\n");
+		return;
+	}
+
+	s = snprintf((char *)construct, REMOTE_MAX_MSG_SIZE, "%s", REMOTE_HL_PACKET_SIZE_STR);
+	platform_buffer_write(construct, s);
+	s = platform_buffer_read(construct, REMOTE_MAX_MSG_SIZE);
+	if (s < 1 || construct[0] != REMOTE_RESP_OK)
+		return;
+	remote_packet_size = remotehston(8, (const char *)construct + 1);
+	/* Anything smaller could not hold a worthwhile burst after the header */
+	if (remote_packet_size < 64U)
+		return;
+	DEBUG_INFO("Remote packet size %zu\n", remote_packet_size);
+	remote_binary = true;
 }
 
 void remote_add_jtag_dev(uint32_t i, const jtag_dev_t *jtag_dev)
@@ -26,6 +26,8 @@
 #include "target_internal.h"
 
 #define REMOTE_MAX_MSG_SIZE (1024)
+/* Upper bound on the packet size negotiated for binary memory transfers */
+#define REMOTE_BIN_MAX_MSG_SIZE (16384)
 
 int platform_buffer_write(const uint8_t *data, int size);
 int platform_buffer_read(uint8_t *data, int size);
@@ -41,6 +43,7 @@ bool remote_nrst_get_val(void);
 void remote_max_frequency_set(uint32_t freq);
 uint32_t remote_max_frequency_get(void);
 void remote_target_clk_output_enable(bool enable);
+bool remote_traceswo_init(uint32_t baudrate, uint32_t *actual);
 
 void remote_adiv5_dp_defaults(ADIv5_DP_t *dp);
 void remote_add_jtag_dev(uint32_t i, const jtag_dev_t *jtag_dev);
@@ -230,6 +230,7 @@ int find_debuggers(BMP_CL_OPTIONS_t *cl_opts, bmp_info_t *info)
 	if (!dir) /* No serial device connected!*/
 		return 0;
 	int found_bmps = 0;
+	bool selected = false;
 	struct dirent *dp;
 	int i = 0;
 	while ((dp = readdir(dir)) != NULL) {
@@ -252,6 +253,7 @@ int find_debuggers(BMP_CL_OPTIONS_t *cl_opts, bmp_info_t *info)
 					DEBUG_WARN("Overflow\n");
 				strncpy(info->version, version, sizeof(info->version));
 				found_bmps = 1;
+				selected = true;
 				break;
 			} else {
 				found_bmps++;
@@ -259,6 +261,9 @@ int find_debuggers(BMP_CL_OPTIONS_t *cl_opts, bmp_info_t *info)
 		}
 	}
 	closedir(dir);
+	/* The probe asked for is filled in already, the others needn't be looked at again */
+	if (selected && !cl_opts->opt_list_only)
+		return 0;
 	if (found_bmps < 1) {
 		DEBUG_WARN("No BMP probe found\n");
 		return -1;
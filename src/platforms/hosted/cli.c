@@ -33,6 +33,13 @@
 #include "target_internal.h"
 #include "cortexm.h"
 #include "command.h"
+#include "crc32.h"
+#include "image.h"
+#include "flash_cache.h"
+#include "read_cache.h"
+#include "bench.h"
+#include "coredump.h"
+#include "gdb_if.h"
 
 #include "cli.h"
 #include "bmp_hosted.h"
@@ -44,6 +51,7 @@
 # include <windows.h>
 #else
 # include <sys/mman.h>
+# include <sys/wait.h>
 #endif
 
 static void cl_target_printf(struct target_controller *tc,
@@ -70,6 +78,8 @@ struct mmap_data {
 };
 int cl_debuglevel;
 static struct mmap_data map; /* Portable way way to nullify the struct!*/
+static image_s image;
+static flash_cache_s flash_cache;
 
 
 static int bmp_mmap(char *file, struct mmap_data *map)
@@ -134,8 +144,8 @@ static void cl_help(char **argv)
 	PRINT_INFO(
 		"\n"
 		"Usage: %s [-h | -l | [-vBITMASK] [-d PATH | -P NUMBER | -s SERIAL | -c TYPE]\n"
-		"\t[-n NUMBER] [-j | -A] [-C] [-t | -T] [-e] [-p] [-R[h]] [-H] [-M STRING ...]\n"
-		"\t[-f | -m] [-E | -w | -V | -r] [-a ADDR] [-S number] [file]]\n"
+		"\t[-n NUMBER] [-j | -A] [-C] [-t | -T] [-e] [-p] [-R[h]] [-H] [-M STRING ...] [-o PORT]\n"
+		"\t[-f | -m] [-E | -w | -V | -r] [-a ADDR] [-S number] [-K DIR] [file]]\n"
 		"\n"
 		"The default is to start a debug server at localhost:2000\n\n"
 		"Single-shot and verbosity options [-h | -l | -vBITMASK]:\n"
@@ -145,26 +155,46 @@ static void cl_help(char **argv)
 		"\t                   1 = INFO, 2 = GDB, 4 = TARGET, 8 = PROBE, 16 = WIRE\n"
 		"\n"
 		"Probe selection arguments [-d PATH | -P NUMBER | -s SERIAL | -c TYPE]:\n"
-		"\t-d, --device     Use a serial device at the given path\n"
+		"\t-d, --device     Use a serial device at the given path, or tcp:HOST:PORT\n"
+		"\t                   for the probe of BMDA running with --serve there\n"
 		"\t-P, --probe      Use the <number>th debug probe found while scanning the\n"
 		"\t                   system, see the output from list for the order\n"
-		"\t-s, --serial     Select the debug probe with the given serial number\n"
+		"\t-s, --serial     Select the debug probe with the given serial number. A\n"
+		"\t                   comma separated list runs the flash operation on all\n"
+		"\t                   of those probes at once (gang programming). A USB\n"
+		"\t                   probe's complete serial number is looked for first\n"
+		"\t                   where it was last found, skipping the full USB scan\n"
 		"\t-c, --ftdi-type  Select the FTDI-based debug probe with of the given\n"
 		"\t                   type (cable)\n"
 		"\n"
-		"General configuration options: [-n NUMBER] [-j] [-C] [-t | -T] [-e] [-p] [-R[h]]\n"
-		"\t\t[-H] [-M STRING ...]\n"
+		"General configuration options: [-n NUMBER] [-j] [-C] [-t | -T | -B | -D FILE] [-e] [-p] [-R[h]]\n"
+		"\t\t[-H] [-M STRING ...] [-o PORT] [-O DEST [-b BAUD]] [-L DEST [-z]]\n"
+		"\t\t[-x FILE | -X FILE]\n"
 		"\t-n, --number     Select the target device at the given position in the\n"
 		"\t                   scan chain (use the -t option to get a scan chain listing)\n"
 		"\t-j, --jtag       Use JTAG instead of SWD\n"
 		"\t-A, --auto-scan  Automatic scanning - try JTAG first, then SWD\n"
 		"\t-C, --hw-reset   Connect to target under hardware reset\n"
+		"\t-U, --recover    Mass erase a protected nRF52 found by the scan, so it\n"
+		"\t                  comes up as a normal target. This erases all of it\n"
 		"\t-F, --fast-poll  Poll the target for execution status at maximum speed at\n"
 		"\t                  the expense of increased CPU and USB resource utilisation.\n"
 		"\t-t, --list-chain Perform a chain scan and display information about the\n"
 		"\t                   conected devices\n"
 		"\t-T, --timing     Perform continues read- or write-back of a value to allow\n"
 		"\t                   measurement of protocol timing. Aborted by ^C\n"
+		"\t-B, --bench[=FREQ,...] Measure debug link latencies and transfer rates,\n"
+		"\t                   at each of the given SWJ frequencies, and print them\n"
+		"\t                   as JSON. With -S, also the flash erase and program\n"
+		"\t                   rates over that many bytes at -a, which are lost\n"
+		"\t-Q, --scenario[=BASELINE] Run the regression scenario: erase all Flash,\n"
+		"\t                   program and CRC verify a reference image, single\n"
+		"\t                   step 1000 times, read 1MiB of RAM, and print the\n"
+		"\t                   figures as JSON. Compare them with the line for this\n"
+		"\t                   adapter and target in the BASELINE file, or add one.\n"
+		"\t                   Fails on a regression of more than 10%%\n"
+		"\t-D, --coredump   Halt the target and write its registers and RAM to an\n"
+		"\t                   ELF core FILE, to look at with gdb -c FILE program.elf\n"
 		"\t-e, --ext-res    Assume external resistors for FTDI devices, that is having the\n"
 		"\t                   FTDI chip connected through resistors to TMS, TDI and TDO\n"
 		"\t-p, --power      Power the target from the probe (if possible)\n"
@@ -175,9 +205,44 @@ static void cl_help(char **argv)
 		"\t                   can be repeated for as many commands you wish to run.\n"
 		"\t                   If the command contains spaces, use quotes around the\n"
 		"\t                   complete command\n"
+		"\t-o, --rtt-port   Serve each RTT channel on its own TCP port, channel 0\n"
+		"\t                   on the given port, instead of on the terminal, and\n"
+		"\t                   'monitor sample' readings on the port after channel 15\n"
+		"\t-O, --swo        Capture SWO from a Black Magic Probe while debugging and\n"
+		"\t                   write the decoded ITM/DWT events to DEST: '-' for\n"
+		"\t                   stdout, a TCP port number, or a file name\n"
+		"\t-b, --swo-baud   SWO baudrate for probes sampling it as NRZ (UART)\n"
+		"\t-L, --timeline   Write SWO events, RTT output and GDB halt/resume merged\n"
+		"\t                   into one time ordered stream to DEST: '-' for stdout,\n"
+		"\t                   a TCP port number to serve it to up to 4 consumers,\n"
+		"\t                   or a file name. On a Black Magic Probe this starts\n"
+		"\t                   SWO capture even without -O\n"
+		"\t-z, --lz4        Send the TCP timeline as an LZ4 frame\n"
+		"\t-x, --record     Record all traffic with the probe, with timestamps, to a\n"
+		"\t                   wire trace FILE and print round trip counts on exit\n"
+		"\t-X, --replay     Answer the remote protocol from a wire trace FILE of a\n"
+		"\t                   Black Magic Probe instead of a probe, and print round\n"
+		"\t                   trips, host CPU time and requests that differed\n"
+		"\t-y, --sim        Debug a simulated STM32F103 instead of a probe, with\n"
+		"\t                   comma separated OPTIONS: dev=0x410|0x414, ram=SIZE,\n"
+		"\t                   flash=SIZE, and latency=US per DP/AP access, erase=US\n"
+		"\t                   per page, program=US per halfword\n"
+		"\t-k, --read-cache Keep target memory GDB reads on the host: 'off',\n"
+		"\t                   'flash' (the default) until it is next erased or\n"
+		"\t                   written, or 'ram' for RAM too while the target is\n"
+		"\t                   halted, for programs DMA does not write to then\n"
+		"\t-G, --target-ports Serve each of the first COUNT targets to a debug\n"
+		"\t                   session of its own on the ports after the main GDB\n"
+		"\t                   port, attaching a client that connects there to it\n"
+		"\t-Z, --serve      Serve the probe on the given TCP port instead of GDB, for\n"
+		"\t                   BMDA elsewhere to debug through with -d tcp:HOST:PORT\n"
+		"\t-W, --metrics    Serve the 'monitor stats' counters over HTTP on a TCP port\n"
+		"\t                   or at a Unix socket PATH: /metrics in the Prometheus\n"
+		"\t                   text format, /metrics.json as JSON\n"
 		"\n"
 		"SWD-specific configuration options [-f FREQUENCY | -m TARGET]:\n"
-		"\t-f, --freq       Set an operating frequency for SWD\n"
+		"\t-f, --freq       Set an operating frequency for SWD, or 'auto' to search for\n"
+		"\t                   the fastest one the target link handles reliably\n"
 		"\t-m, --mult-drop  Use the given target ID for selection in SWD multi-drop\n"
 		"\n"
 		"Flash operation selection options [-E | -w | -V | -r]:\n"
@@ -185,15 +250,23 @@ static void cl_help(char **argv)
 		"\t-w, --write      Write the specified binary file to the target device\n"
 		"\t                   Flash (the default)\n"
 		"\t-V, --verify     Verify the target device Flash against the specified\n"
-		"\t                   binary file\n"
+		"\t                   binary file. With --verify=crc, blocks are compared by\n"
+		"\t                   a CRC computed on the target and only mismatching\n"
+		"\t                   blocks are read back\n"
 		"\t-r, --read       Read the target device Flash\n"
 		"\n"
-		"Flash operation modifiers options: [-a ADDR] [-S number] [FILE]\n"
+		"Flash operation modifiers options: [-a ADDR] [-S number] [-K DIR] [FILE]\n"
 		"\t-a, --addr       Start address for the given Flash operation (defaults to\n"
 		"\t                   the start of Flash)\n"
 		"\t-S, --byte-count Number of bytes to work on in the Flash operation (default\n"
 		"\t                   is till the operation fails or is complete)\n"
-		"\t<file>           Binary file to use in Flash operations\n",
+		"\t-K, --flash-cache Remember what was written to this target through this\n"
+		"\t                   probe in a file in DIR, and skip writing the Flash\n"
+		"\t                   blocks that still hold the same data next time\n"
+		"\t<file>           File to use in Flash operations. ELF, Intel HEX and\n"
+		"\t                   S-record files are flashed at their own addresses,\n"
+		"\t                   only where they hold data. Anything else is taken\n"
+		"\t                   as a raw binary for -a and -S\n",
 		argv[0]
 	);
 	exit(0);
@@ -212,8 +285,12 @@ static const struct option long_options[] = {
 	{"jtag", no_argument, NULL, 'j'},
 	{"auto-scan", no_argument, NULL, 'A'},
 	{"hw-reset", no_argument, NULL, 'C'},
+	{"recover", no_argument, NULL, 'U'},
 	{"list-chain", no_argument, NULL, 't'},
 	{"timing", no_argument, NULL, 'T'},
+	{"bench", optional_argument, NULL, 'B'},
+	{"scenario", optional_argument, NULL, 'Q'},
+	{"coredump", required_argument, NULL, 'D'},
 	{"ext-res", no_argument, NULL, 'e'},
 	{"power", no_argument, NULL, 'p'},
 	{"reset", optional_argument, NULL, 'R'},
@@ -223,10 +300,23 @@ static const struct option long_options[] = {
 	{"multi-drop", required_argument, NULL, 'm'},
 	{"erase", no_argument, NULL, 'E'},
 	{"write", no_argument, NULL, 'W'},
-	{"verify", no_argument, NULL, 'V'},
+	{"verify", optional_argument, NULL, 'V'},
 	{"read", no_argument, NULL, 'r'},
 	{"addr", required_argument, NULL, 'a'},
 	{"byte-count", required_argument, NULL, 'S'},
+	{"flash-cache", required_argument, NULL, 'K'},
+	{"rtt-port", required_argument, NULL, 'o'},
+	{"swo", required_argument, NULL, 'O'},
+	{"swo-baud", required_argument, NULL, 'b'},
+	{"timeline", required_argument, NULL, 'L'},
+	{"lz4", no_argument, NULL, 'z'},
+	{"record", required_argument, NULL, 'x'},
+	{"replay", required_argument, NULL, 'X'},
+	{"sim", optional_argument, NULL, 'y'},
+	{"read-cache", required_argument, NULL, 'k'},
+	{"target-ports", required_argument, NULL, 'G'},
+	{"serve", required_argument, NULL, 'Z'},
+	{"metrics", required_argument, NULL, 'W'},
 	{NULL, 0, NULL, 0}
 } ;
 
@@ -239,7 +329,7 @@ void cl_init(BMP_CL_OPTIONS_t *opt, int argc, char **argv)
 	opt->opt_max_swj_frequency = 4000000;
 	opt->opt_scanmode = BMP_SCAN_SWD;
 	opt->opt_mode = BMP_MODE_DEBUG;
-	while((c = getopt_long(argc, argv, "eEFhHv:d:f:s:I:c:Cln:m:M:wVtTa:S:jApP:rR::", long_options, NULL)) != -1) {
+	while((c = getopt_long(argc, argv, "eEFhHv:d:f:s:I:c:CUln:m:M:wVtTB::Q::D:a:S:K:o:O:b:L:zx:X:y::k:G:Z:W:jApP:rR::", long_options, NULL)) != -1) {
 		switch(c) {
 		case 'c':
 			if (optarg)
@@ -269,6 +359,9 @@ void cl_init(BMP_CL_OPTIONS_t *opt, int argc, char **argv)
 		case 'C':
 			opt->opt_connect_under_reset = true;
 			break;
+		case 'U':
+			opt->opt_recover = true;
+			break;
 		case 'e':
 			opt->external_resistor_swd = true;
 			break;
@@ -280,7 +373,9 @@ void cl_init(BMP_CL_OPTIONS_t *opt, int argc, char **argv)
 			opt->fast_poll = true;
 			break;
 		case 'f':
-			if (optarg) {
+			if (optarg && !strcmp(optarg, "auto"))
+				opt->opt_swj_frequency_auto = true;
+			else if (optarg) {
 				char *p;
 				uint32_t frequency = strtol(optarg, &p, 10);
 				switch(*p) {
@@ -312,6 +407,18 @@ void cl_init(BMP_CL_OPTIONS_t *opt, int argc, char **argv)
 		case 'T':
 			opt->opt_mode = BMP_MODE_SWJ_TEST;
 			break;
+		case 'B':
+			opt->opt_mode = BMP_MODE_BENCH;
+			opt->opt_bench_frequencies = optarg;
+			break;
+		case 'Q':
+			opt->opt_mode = BMP_MODE_SCENARIO;
+			opt->opt_bench_baseline = optarg;
+			break;
+		case 'D':
+			opt->opt_mode = BMP_MODE_COREDUMP;
+			opt->opt_coredump = optarg;
+			break;
 		case 'w':
 			if (opt->opt_mode == BMP_MODE_FLASH_VERIFY)
 				opt->opt_mode = BMP_MODE_FLASH_WRITE_VERIFY;
@@ -319,6 +426,12 @@ void cl_init(BMP_CL_OPTIONS_t *opt, int argc, char **argv)
 				opt->opt_mode = BMP_MODE_FLASH_WRITE;
 			break;
 		case 'V':
+			if (optarg && !strcmp(optarg, "crc"))
+				opt->opt_verify_crc = true;
+			else if (optarg) {
+				DEBUG_WARN("Unknown verify mode \"%s\"\n", optarg);
+				exit(1);
+			}
 			if (opt->opt_mode == BMP_MODE_FLASH_WRITE)
 				opt->opt_mode = BMP_MODE_FLASH_WRITE_VERIFY;
 			else
@@ -356,6 +469,57 @@ void cl_init(BMP_CL_OPTIONS_t *opt, int argc, char **argv)
 			if (optarg)
 				opt->opt_position = atoi(optarg);
 			break;
+		case 'K':
+			if (optarg)
+				opt->opt_flash_cache = optarg;
+			break;
+		case 'o':
+			if (optarg)
+				opt->opt_rtt_port = strtoul(optarg, NULL, 0);
+			break;
+		case 'O':
+			if (optarg)
+				opt->opt_swo = optarg;
+			break;
+		case 'b':
+			if (optarg)
+				opt->opt_swo_baud = strtoul(optarg, NULL, 0);
+			break;
+		case 'L':
+			if (optarg)
+				opt->opt_timeline = optarg;
+			break;
+		case 'z':
+			opt->opt_timeline_lz4 = true;
+			break;
+		case 'x':
+			opt->opt_record = optarg;
+			break;
+		case 'X':
+			opt->opt_replay = optarg;
+			break;
+		case 'y':
+			opt->opt_sim = optarg ? optarg : "";
+			break;
+		case 'k':
+			if (!read_cache_set_mode(optarg)) {
+				DEBUG_WARN("Unknown read cache mode '%s', use off, flash or ram\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'G':
+			opt->opt_target_ports = strtoul(optarg, NULL, 0);
+			if (opt->opt_target_ports > GDB_IF_MAX_TARGET_PORTS) {
+				DEBUG_WARN("At most %u target ports\n", GDB_IF_MAX_TARGET_PORTS);
+				exit(1);
+			}
+			break;
+		case 'Z':
+			opt->opt_serve_port = strtoul(optarg, NULL, 0);
+			break;
+		case 'W':
+			opt->opt_metrics = optarg;
+			break;
 		case 'S':
 			if (optarg) {
 				char *endptr;
@@ -387,6 +551,9 @@ void cl_init(BMP_CL_OPTIONS_t *opt, int argc, char **argv)
 	/* Checks */
 	if ((opt->opt_flash_file) && ((opt->opt_mode == BMP_MODE_TEST ) ||
 								  (opt->opt_mode == BMP_MODE_SWJ_TEST) ||
+								  (opt->opt_mode == BMP_MODE_BENCH) ||
+								  (opt->opt_mode == BMP_MODE_SCENARIO) ||
+								  (opt->opt_mode == BMP_MODE_COREDUMP) ||
 								  (opt->opt_mode == BMP_MODE_RESET) ||
 								  (opt->opt_mode == BMP_MODE_RESET_HW))) {
 		DEBUG_WARN("Ignoring filename in reset/test mode\n");
@@ -411,26 +578,162 @@ static void display_target(int i, target *t, void *context)
 	}
 }
 
-int cl_execute(BMP_CL_OPTIONS_t *opt)
+/*
+ * Gang programming. The target layer and the probe drivers keep their state
+ * in globals, so rather than threads each probe gets a process of its own,
+ * forked once the options are parsed. This returns in each child with
+ * opt_serial narrowed to its probe, the parent waits for all of them, reports
+ * how each did and exits.
+ */
+void cl_gang_execute(BMP_CL_OPTIONS_t *opt)
+{
+	if (opt->opt_mode == BMP_MODE_DEBUG || opt->opt_mode == BMP_MODE_MONITOR) {
+		DEBUG_WARN("Several probes can only be used for flash operations\n");
+		exit(1);
+	}
+#if defined(_WIN32) || defined(__CYGWIN__)
+	DEBUG_WARN("Gang programming is not supported on this platform\n");
+	exit(1);
+#else
+	size_t count = 1;
+	for (const char *p = opt->opt_serial; *p; ++p)
+		count += *p == ',';
+	char *serials = strdup(opt->opt_serial);
+	struct {
+		const char *serial;
+		pid_t pid;
+		uint32_t start_time;
+	} *probes = calloc(count, sizeof(*probes));
+	if (!serials || !probes) {
+		DEBUG_WARN("calloc: failed in %s\n", __func__);
+		exit(1);
+	}
+	count = 0;
+	for (char *serial = strtok(serials, ","); serial; serial = strtok(NULL, ","))
+		probes[count++].serial = serial;
+
+	fflush(stdout);
+	for (size_t i = 0; i < count; ++i) {
+		probes[i].start_time = platform_time_ms();
+		probes[i].pid = fork();
+		if (probes[i].pid == 0) {
+			opt->opt_serial = strdup(probes[i].serial);
+			free(probes);
+			free(serials);
+			return;
+		}
+		if (probes[i].pid < 0)
+			DEBUG_WARN("Probe %s: can not start: %s\n", probes[i].serial, strerror(errno));
+	}
+
+	size_t failed = 0;
+	for (size_t running = count; running; --running) {
+		int status;
+		const pid_t pid = wait(&status);
+		if (pid < 0)
+			break;
+		for (size_t i = 0; i < count; ++i) {
+			if (probes[i].pid != pid)
+				continue;
+			const bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+			DEBUG_WARN("Probe %s: %s after %" PRIu32 " ms\n", probes[i].serial, ok ? "succeeded" : "FAILED",
+				platform_time_ms() - probes[i].start_time);
+			failed += !ok;
+		}
+	}
+	for (size_t i = 0; i < count; ++i)
+		failed += probes[i].pid < 0;
+	DEBUG_WARN("%zu of %zu probes succeeded\n", count - failed, count);
+	exit(failed ? 1 : 0);
+#endif
+}
+
+static bool cl_flash_cache_open(BMP_CL_OPTIONS_t *opt, target *t)
+{
+	const char *serial = info.serial[0] ? info.serial : opt->opt_serial;
+	return flash_cache_open(&flash_cache, opt->opt_flash_cache, serial ? serial : "unknown", t);
+}
+
+/*
+ * Erases the flash under the image and programs it in one flash session. When
+ * the flash cache has planned the write it works block by block instead, leaving
+ * out the blocks the cache found already hold their data.
+ */
+static bool cl_flash_image(target *t, const flash_cache_s *cache)
+{
+	if (!cache->block_count) {
+		for (size_t i = 0; i < image.count; ++i) {
+			const image_segment_s *segment = &image.segments[i];
+			DEBUG_INFO("Erase    %zu bytes at 0x%08" PRIx32 "\n", segment->size, segment->addr);
+			if (!target_flash_erase(t, segment->addr, segment->size)) {
+				DEBUG_WARN("Erasure failed!\n");
+				return false;
+			}
+		}
+		for (size_t i = 0; i < image.count; ++i) {
+			const image_segment_s *segment = &image.segments[i];
+			DEBUG_INFO("Flashing %zu bytes at 0x%08" PRIx32 "\n", segment->size, segment->addr);
+			/* Buffered write cares for padding*/
+			if (!target_flash_write(t, segment->addr, segment->data, segment->size)) {
+				DEBUG_WARN("Flashing failed!\n");
+				return false;
+			}
+		}
+	} else {
+		bool touched = false;
+		for (size_t i = 0; i < cache->block_count; ++i) {
+			const flash_cache_block_s *block = &cache->blocks[i];
+			if (block->unchanged)
+				continue;
+			touched = true;
+			if (!target_flash_erase(t, block->addr, block->size)) {
+				DEBUG_WARN("Erasure failed!\n");
+				return false;
+			}
+		}
+		if (!touched) {
+			DEBUG_INFO("Flash already holds the image\n");
+			return true;
+		}
+		for (size_t i = 0; i < cache->block_count; ++i) {
+			const flash_cache_block_s *block = &cache->blocks[i];
+			if (block->unchanged)
+				continue;
+			for (size_t j = 0; j < image.count; ++j) {
+				const image_segment_s *segment = &image.segments[j];
+				const uint32_t start = MAX(segment->addr, block->addr);
+				const uint32_t end = MIN(segment->addr + segment->size, block->addr + block->size);
+				if (start < end && !target_flash_write(t, start, segment->data + (start - segment->addr), end - start)) {
+					DEBUG_WARN("Flashing failed!\n");
+					return false;
+				}
+			}
+		}
+	}
+	if (!target_flash_complete(t)) {
+		DEBUG_WARN("Flashing failed!\n");
+		return false;
+	}
+	return true;
+}
+
+static void cl_power(const BMP_CL_OPTIONS_t *const opt)
 {
-	int res = 0;
-	int num_targets;
 	if (opt->opt_tpwr) {
 		platform_target_set_power(true);
 		platform_delay(500);
 	}
-	if (opt->opt_mode == BMP_MODE_RESET_HW) {
-			platform_nrst_set_val(true);
-			platform_delay(1);
-			platform_nrst_set_val(false);
-			return res;
-	}
+}
+
+int cl_scan(BMP_CL_OPTIONS_t *opt)
+{
+	int num_targets;
+	cl_power(opt);
 	if (opt->opt_connect_under_reset)
 		DEBUG_INFO("Connecting under reset\n");
 	connect_assert_nrst = opt->opt_connect_under_reset;
+	scan_recover = opt->opt_recover;
 	platform_nrst_set_val(opt->opt_connect_under_reset);
-	if (opt->opt_mode == BMP_MODE_TEST)
-		DEBUG_INFO("Running in Test Mode\n");
 	DEBUG_INFO("Target voltage: %s Volt\n", platform_target_voltage());
 
 	if (opt->opt_scanmode == BMP_SCAN_JTAG)
@@ -450,24 +753,53 @@ int cl_execute(BMP_CL_OPTIONS_t *opt)
 	}
 
 found_targets:
+	scan_recover = false;
 	if (!num_targets) {
 		DEBUG_WARN("No target found\n");
-		return -1;
-	} else {
-		num_targets = target_foreach(display_target, &num_targets);
+		return 0;
 	}
+	/* target_foreach() counts one past the last target */
+	return target_foreach(display_target, &num_targets) - 1;
+}
+
+int cl_execute(BMP_CL_OPTIONS_t *opt)
+{
+	int res = 0;
+	if (opt->opt_mode == BMP_MODE_RESET_HW) {
+			cl_power(opt);
+			platform_nrst_set_val(true);
+			platform_delay(1);
+			platform_nrst_set_val(false);
+			return res;
+	}
+	if (opt->opt_mode == BMP_MODE_TEST)
+		DEBUG_INFO("Running in Test Mode\n");
+	const int num_targets = cl_scan(opt);
+	if (!num_targets)
+		return -1;
 	if (opt->opt_target_dev > num_targets) {
 		DEBUG_WARN("Given target number %d not available max %d\n",
 				   opt->opt_target_dev, num_targets);
 		return -1;
 	}
+	const uint32_t attach_start = platform_time_us();
 	target *t = target_attach_n(opt->opt_target_dev, &cl_controller);
+	const uint32_t attach_us = platform_time_us() - attach_start;
 
 	if (!t) {
 		DEBUG_WARN("Can not attach to target %d\n", opt->opt_target_dev);
 		res = -1;
 		goto target_detach;
 	}
+	if (opt->opt_swj_frequency_auto) {
+		const uint32_t frequency = target_is_cortexm(t) ? adiv5_swj_frequency_auto(cortexm_ap(t)) : 0;
+		if (frequency) {
+			DEBUG_INFO("Using SWJ frequency %" PRIu32 "Hz\n", frequency);
+			opt->opt_max_swj_frequency = frequency;
+		} else
+			DEBUG_WARN("Automatic SWJ frequency search failed, keeping %" PRIu32 "Hz\n",
+				platform_max_frequency_get());
+	}
 	/* List each defined RAM */
 	int n_ram = 0;
 	for (struct target_ram *r = t->ram; r; r = r->next)
@@ -504,7 +836,8 @@ found_targets:
 	if ((opt->opt_flash_size == 0xffffffff) &&
 	    (opt->opt_mode != BMP_MODE_FLASH_WRITE) &&
 	    (opt->opt_mode != BMP_MODE_FLASH_VERIFY) &&
-	    (opt->opt_mode != BMP_MODE_FLASH_WRITE_VERIFY))
+	    (opt->opt_mode != BMP_MODE_FLASH_WRITE_VERIFY) &&
+	    (opt->opt_mode != BMP_MODE_BENCH))
 		opt->opt_flash_size = lowest_flash_size;
 	if (opt->opt_mode == BMP_MODE_SWJ_TEST) {
 		switch (t->core[0]) {
@@ -520,6 +853,23 @@ found_targets:
 			DEBUG_WARN("No test for this core type yet\n");
 		}
 	}
+	if (opt->opt_mode == BMP_MODE_BENCH) {
+		/* Flash is only measured when asked for, as what it holds is lost */
+		if (!bench_run(t, opt->opt_bench_frequencies, opt->opt_flash_start,
+				opt->opt_flash_size == 0xffffffff ? 0U : opt->opt_flash_size))
+			res = -1;
+		goto target_detach;
+	}
+	if (opt->opt_mode == BMP_MODE_SCENARIO) {
+		if (!bench_scenario(t, attach_us, opt->opt_bench_baseline, opt->opt_flash_start, opt->opt_flash_size))
+			res = -1;
+		goto target_detach;
+	}
+	if (opt->opt_mode == BMP_MODE_COREDUMP) {
+		if (!coredump_write(t, opt->opt_coredump))
+			res = -1;
+		goto target_detach;
+	}
 	if ((opt->opt_mode == BMP_MODE_TEST) ||
 		(opt->opt_mode == BMP_MODE_SWJ_TEST))
 		goto target_detach;
@@ -544,9 +894,29 @@ found_targets:
 			goto target_detach;
 		}
 	}
-	if (opt->opt_flash_size < map.size)
-		/* restrict to size given on command line */
-		map.size = opt->opt_flash_size;
+	bool malformed = false;
+	if (map.data && image_load(&image, map.data, map.size, &malformed)) {
+		/* Only the populated ranges get erased and programmed, all in this one session */
+		for (size_t i = 0; i < image.count; ++i)
+			DEBUG_INFO("Segment %zu: %zu bytes at 0x%08" PRIx32 "\n", i, image.segments[i].size,
+				image.segments[i].addr);
+	} else if (malformed) {
+		DEBUG_WARN("Can not parse %s. Aborting!\n", opt->opt_flash_file);
+		res = -1;
+		goto free_map;
+	} else {
+		if (opt->opt_flash_size < map.size)
+			/* restrict to size given on command line */
+			map.size = opt->opt_flash_size;
+		const size_t size = opt->opt_mode == BMP_MODE_FLASH_READ ? opt->opt_flash_size : map.size;
+		if (!image_raw(&image, opt->opt_flash_start, map.data, size)) {
+			res = -1;
+			goto free_map;
+		}
+	}
+	size_t image_size = 0;
+	for (size_t i = 0; i < image.count; ++i)
+		image_size += image.segments[i].size;
 	if (opt->opt_monitor) {
 		res = command_process(t, opt->opt_monitor);
 		if (res)
@@ -556,34 +926,41 @@ found_targets:
 		target_reset(t);
 	} else if (opt->opt_mode == BMP_MODE_FLASH_ERASE) {
 		DEBUG_INFO("Erase %zu bytes at 0x%08" PRIx32 "\n", opt->opt_flash_size, opt->opt_flash_start);
-		if (!target_flash_erase(t, opt->opt_flash_start, opt->opt_flash_size)) {
+		if (opt->opt_flash_cache && cl_flash_cache_open(opt, t))
+			flash_cache_discard(&flash_cache);
+		if (!target_flash_erase(t, opt->opt_flash_start, opt->opt_flash_size) || !target_flash_complete(t)) {
 			DEBUG_WARN("Erasure failed!\n");
 			res = -1;
 			goto free_map;
 		}
 		target_reset(t);
 	} else if ((opt->opt_mode == BMP_MODE_FLASH_WRITE) || (opt->opt_mode == BMP_MODE_FLASH_WRITE_VERIFY)) {
-		DEBUG_INFO("Erase    %zu bytes at 0x%08" PRIx32 "\n", map.size, opt->opt_flash_start);
 		uint32_t start_time = platform_time_ms();
-		if (!target_flash_erase(t, opt->opt_flash_start, map.size)) {
-			DEBUG_WARN("Erasure failed!\n");
-			res = -1;
-			goto free_map;
-		} else {
-			DEBUG_INFO("Flashing %zu bytes at 0x%08" PRIx32 "\n", map.size, opt->opt_flash_start);
-			/* Buffered write cares for padding*/
-			if (!target_flash_write(t, opt->opt_flash_start, map.data, map.size) || !target_flash_complete(t)) {
-				DEBUG_WARN("Flashing failed!\n");
+		/* Check each block as it's programmed rather than reading it all back afterwards */
+		target_flash_verify = opt->opt_mode == BMP_MODE_FLASH_WRITE_VERIFY;
+		if (opt->opt_flash_cache) {
+			if (!cl_flash_cache_open(opt, t) || !flash_cache_plan(&flash_cache, t, &image)) {
 				res = -1;
 				goto free_map;
-			} else {
-				DEBUG_INFO("Success!\n");
 			}
+			/* Until this write has succeeded the target's contents are unknown */
+			flash_cache_discard(&flash_cache);
+		}
+		if (!cl_flash_image(t, &flash_cache)) {
+			res = -1;
+			goto free_map;
 		}
+		if (opt->opt_flash_cache)
+			flash_cache_save(&flash_cache);
+		DEBUG_INFO("Success!\n");
 		uint32_t end_time = platform_time_ms();
 		DEBUG_WARN("Flash Write succeeded for %d bytes, %8.3f kiB/s\n",
-			   (int)map.size, (((map.size * 1.0)/(end_time - start_time))));
-		if (opt->opt_mode != BMP_MODE_FLASH_WRITE_VERIFY) {
+			   (int)image_size, (((image_size * 1.0)/(end_time - start_time))));
+		/* Only blocks the flash cache skipped are left to verify */
+		bool verified = true;
+		for (size_t i = 0; i < flash_cache.block_count; ++i)
+			verified &= !flash_cache.blocks[i].unchanged;
+		if (opt->opt_mode != BMP_MODE_FLASH_WRITE_VERIFY || verified) {
 			target_reset(t);
 			goto free_map;
 		}
@@ -591,8 +968,9 @@ found_targets:
 	if ((opt->opt_mode == BMP_MODE_FLASH_READ) ||
 	    (opt->opt_mode == BMP_MODE_FLASH_VERIFY) ||
 	    (opt->opt_mode == BMP_MODE_FLASH_WRITE_VERIFY)) {
-#define WORKSIZE 0x1000
-		uint8_t *data = alloca(WORKSIZE);
+/* Big reads keep the adaptor's pipelines full, the per-read turnaround is what costs */
+#define WORKSIZE 0x10000
+		uint8_t *data = malloc(WORKSIZE);
 		if (!data) {
 			DEBUG_WARN("Can not malloc memory for flash read/verify "
 					   "operation\n");
@@ -603,50 +981,96 @@ found_targets:
 			DEBUG_INFO("Reading flash from 0x%08" PRIx32 " for %zu"
 				   " bytes to %s\n", opt->opt_flash_start,  opt->opt_flash_size,
 				   opt->opt_flash_file);
-		uint32_t flash_src = opt->opt_flash_start;
-		size_t size = (opt->opt_mode == BMP_MODE_FLASH_READ) ? opt->opt_flash_size:
-			map.size;
+		uint8_t *read_map = NULL;
+#if !defined(_WIN32) && !defined(__CYGWIN__)
+		size_t read_map_size = 0;
+		/* Read straight into the output file's pages instead of copying through write() */
+		if (read_file != -1 && image_size && !ftruncate(read_file, image_size)) {
+			read_map = mmap(NULL, image_size, PROT_READ | PROT_WRITE, MAP_SHARED, read_file, 0);
+			if (read_map == MAP_FAILED)
+				read_map = NULL;
+			else
+				read_map_size = image_size;
+		}
+#endif
 		int bytes_read = 0;
-		void *flash = map.data;
 		uint32_t start_time = platform_time_ms();
-		while (size) {
-			int worksize = (size > WORKSIZE) ? WORKSIZE : size;
-			int n_read = target_mem_read(t, data, flash_src, worksize);
-			if (n_read) {
-				if (opt->opt_flash_size == 0) {/* we reached end of flash */
-					DEBUG_INFO("Reached end of flash at size %" PRId32 "\n",
-						   flash_src - opt->opt_flash_start);
+		uint32_t tick_time = start_time;
+		bool ticked = false;
+		bool stopped = false;
+		for (size_t segment = 0; segment < image.count && !stopped; ++segment) {
+			uint32_t flash_src = image.segments[segment].addr;
+			const uint8_t *flash = image.segments[segment].data;
+			size_t size = image.segments[segment].size;
+			while (size) {
+				int worksize = (size > WORKSIZE) ? WORKSIZE : size;
+				uint8_t *dest = read_map ? read_map + bytes_read : data;
+				/* A block whose CRC matches needn't come over the wire at all */
+				uint32_t crc;
+				const bool crc_matched = opt->opt_verify_crc && flash &&
+					target_mem_crc32(t, &crc, flash_src, worksize) &&
+					crc == generic_crc32_buffer(0xffffffffU, flash, worksize);
+				int n_read = crc_matched ? 0 : target_mem_read(t, dest, flash_src, worksize);
+				if (n_read) {
+					if (opt->opt_flash_size == 0) {/* we reached end of flash */
+						DEBUG_INFO("Reached end of flash at size %" PRId32 "\n",
+							   flash_src - opt->opt_flash_start);
+					} else {
+						DEBUG_WARN("Read failed at flash address 0x%08" PRIx32 "\n",
+							   flash_src);
+					}
+					stopped = true;
 					break;
 				} else {
-					DEBUG_WARN("Read failed at flash address 0x%08" PRIx32 "\n",
-						   flash_src);
-					break;
+					bytes_read += worksize;
 				}
-			} else {
-				bytes_read += worksize;
-			}
-			if ((opt->opt_mode == BMP_MODE_FLASH_VERIFY) ||
-			    (opt->opt_mode == BMP_MODE_FLASH_WRITE_VERIFY)) {
-				int difference = memcmp(data, flash, worksize);
-				if (difference){
-					DEBUG_WARN("Verify failed at flash region 0x%08"
-							   PRIx32 "\n", flash_src);
-					res = -1;
-					goto free_map;
+				if ((opt->opt_mode == BMP_MODE_FLASH_VERIFY) ||
+				    (opt->opt_mode == BMP_MODE_FLASH_WRITE_VERIFY)) {
+					int difference = crc_matched ? 0 : memcmp(data, flash, worksize);
+					if (difference){
+						int offset = 0;
+						while (data[offset] == flash[offset])
+							++offset;
+						DEBUG_WARN("Verify failed at flash address 0x%08"
+								   PRIx32 "\n", flash_src + offset);
+						res = -1;
+						free(data);
+						goto free_map;
+					}
+					flash += worksize;
+				} else if (read_file != -1 && !read_map) {
+					int written = write(read_file, data, worksize);
+					if (written < worksize) {
+						DEBUG_WARN("Read failed at flash region 0x%08" PRIx32 "\n",
+							   flash_src);
+						res = -1;
+						free(data);
+						goto free_map;
+					}
 				}
-				flash += worksize;
-			} else if (read_file != -1) {
-				int written = write(read_file, data, worksize);
-				if (written < worksize) {
-					DEBUG_WARN("Read failed at flash region 0x%08" PRIx32 "\n",
-						   flash_src);
-					res = -1;
-					goto free_map;
+				flash_src += worksize;
+				size -= worksize;
+				/* Progress ticker, about once a second */
+				const uint32_t now = platform_time_ms();
+				if (now - tick_time >= 1000U) {
+					tick_time = now;
+					ticked = true;
+					DEBUG_INFO("\r%8d kiB, %8.3f kiB/s", bytes_read / 1024,
+						(bytes_read * 1.0) / (now - start_time));
 				}
 			}
-			flash_src += worksize;
-			size -= worksize;
 		}
+		if (ticked)
+			DEBUG_INFO("\n");
+		free(data);
+#if !defined(_WIN32) && !defined(__CYGWIN__)
+		if (read_map) {
+			munmap(read_map, read_map_size);
+			/* Don't leave a tail of zeros if the read stopped early */
+			if ((size_t)bytes_read < read_map_size && ftruncate(read_file, bytes_read))
+				DEBUG_WARN("Could not truncate %s\n", opt->opt_flash_file);
+		}
+#endif
 		uint32_t end_time = platform_time_ms();
 		if (read_file != -1)
 			close(read_file);
@@ -657,6 +1081,8 @@ found_targets:
 			target_reset(t);
 	}
   free_map:
+	flash_cache_free(&flash_cache);
+	image_free(&image);
 	if (map.size)
 		bmp_munmap(&map);
   target_detach:
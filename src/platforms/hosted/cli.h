@@ -38,6 +38,9 @@ enum bmp_cl_mode {
 	BMP_MODE_FLASH_VERIFY,
 	BMP_MODE_SWJ_TEST,
 	BMP_MODE_MONITOR,
+	BMP_MODE_BENCH,
+	BMP_MODE_SCENARIO,
+	BMP_MODE_COREDUMP,
 };
 
 typedef enum bmp_scan_mode_e {
@@ -52,6 +55,7 @@ typedef struct BMP_CL_OPTIONS_s {
 	bool opt_tpwr;
 	bool opt_list_only;
 	bool opt_connect_under_reset;
+	bool opt_recover;
 	bool external_resistor_swd;
 	bool fast_poll;
 	bool opt_no_hl;
@@ -67,12 +71,34 @@ typedef struct BMP_CL_OPTIONS_s {
 	int opt_target_dev;
 	uint32_t opt_flash_start;
 	uint32_t opt_max_swj_frequency;
+	bool opt_swj_frequency_auto;
+	bool opt_verify_crc;
+	char *opt_flash_cache;
+	uint16_t opt_rtt_port;
+	char *opt_swo;
+	uint32_t opt_swo_baud;
+	char *opt_timeline;
+	bool opt_timeline_lz4;
 	size_t opt_flash_size;
+	char *opt_bench_frequencies;
+	char *opt_bench_baseline;
+	char *opt_record;
+	char *opt_replay;
+	char *opt_sim;
+	uint32_t opt_target_ports;
+	uint16_t opt_serve_port;
+	char *opt_metrics;
+	char *opt_coredump;
 } BMP_CL_OPTIONS_t;
 
 void cl_init(BMP_CL_OPTIONS_t *opt, int argc, char **argv);
+/* Powers and scans as the options say, returns how many targets were found */
+int cl_scan(BMP_CL_OPTIONS_t *opt);
 int cl_execute(BMP_CL_OPTIONS_t *opt);
+void cl_gang_execute(BMP_CL_OPTIONS_t *opt);
 int serial_open(BMP_CL_OPTIONS_t *opt, char *serial);
 void serial_close(void);
+int serial_buffer_write(const uint8_t *data, int size);
+int serial_buffer_read(uint8_t *data, int maxsize);
 
 #endif /* PLATFORMS_HOSTED_CLI_H */
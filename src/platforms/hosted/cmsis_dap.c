@@ -38,6 +38,7 @@
 #include "bmp_hosted.h"
 #include "dap.h"
 #include "cmsis_dap.h"
+#include "wire_trace.h"
 
 #include "cli.h"
 #include "target.h"
@@ -46,7 +47,6 @@
 uint8_t dap_caps;
 uint8_t mode;
 
-#define TRANSFER_TIMEOUT_MS (100)
 
 typedef enum cmsis_type_e {
 	CMSIS_TYPE_NONE = 0,
@@ -57,12 +57,21 @@ typedef enum cmsis_type_e {
 /*- Variables ---------------------------------------------------------------*/
 static cmsis_type_t type;
 static libusb_device_handle *usb_handle = NULL;
+/* Bulk adaptors go through the async transfer pool, each request in flight needs its own buffer */
+static usb_link_t dap_link;
+static uint8_t dap_tx_buffers[USB_LINK_POOL_SIZE][1024];
+static size_t dap_tx_next;
 static uint8_t in_ep;
 static uint8_t out_ep;
 static hid_device *handle = NULL;
-static uint8_t buffer[1024 + 1];
-static int report_size = 64 + 1; // TODO: read actual report size
+/* Largest packet plus the HID report ID, and the 0xff padding byte beyond */
+static uint8_t buffer[1024 + 2];
+static int report_size = 64 + 1; /* Packet size plus the HID report ID, updated from DAP_Info */
+/* Set for adaptors known to misbehave with anything but 64 byte reports */
+static bool report_size_fixed = false;
 static bool has_swd_sequence = false;
+/* Commands the adaptor can buffer, so the number we may have in flight at once */
+static size_t packet_count = 1;
 
 static size_t mbslen(const char *str)
 {
@@ -138,6 +147,7 @@ static bool dap_init_hid(const bmp_info_t *const info)
 	if (info->vid == 0x1fc9 && info->pid == 0x0132) {
 		DEBUG_WARN("Blacklist\n");
 		report_size = 64 + 1;
+		report_size_fixed = true;
 	}
 	handle = hid_open(info->vid, info->pid, serial[0] ? serial : NULL);
 	if (!handle) {
@@ -165,6 +175,10 @@ static bool dap_init_bulk(const bmp_info_t *const info)
 	}
 	in_ep = info->in_ep;
 	out_ep = info->out_ep;
+	dap_link.ul_libusb_ctx = info->libusb_ctx;
+	dap_link.ul_libusb_device_handle = usb_handle;
+	dap_link.ep_tx = out_ep;
+	dap_link.ep_rx = in_ep;
 	return true;
 }
 
@@ -197,6 +211,16 @@ int dap_init(bmp_info_t *info)
 			has_swd_sequence = ((major > 1 ) || ((major > 0 ) && (minor > 1)));
 		}
 	}
+	size = dap_info(DAP_INFO_PACKET_COUNT, buffer, sizeof(buffer));
+	if (size && buffer[0])
+		packet_count = buffer[0];
+	/* Size every command to the packet the adaptor negotiates, 512 or 1024 bytes on bulk adaptors */
+	size = dap_info(DAP_INFO_PACKET_SIZE, buffer, sizeof(buffer));
+	if (size >= 2U) {
+		const size_t packet_size = buffer[0] | (buffer[1] << 8U);
+		if (packet_size >= 64U && packet_size <= 1024U && !report_size_fixed)
+			report_size = packet_size + 1U;
+	}
 	size = dap_info(DAP_INFO_CAPABILITIES, buffer, sizeof(buffer));
 	dap_caps = buffer[0];
 	DEBUG_INFO("Cap (0x%2x): %s%s%s", dap_caps,
@@ -211,7 +235,7 @@ int dap_init(bmp_info_t *info)
 		DEBUG_INFO(", Atomic Cmds");
 	if (has_swd_sequence)
 		DEBUG_INFO(", DAP_SWD_Sequence");
-	DEBUG_INFO("\n");
+	DEBUG_INFO(", %zu packets of %d bytes\n", packet_count, report_size - 1);
 	return 0;
 }
 
@@ -279,6 +303,9 @@ void dap_exit_function(void)
 	} else if (type == CMSIS_TYPE_BULK) {
 		if (usb_handle) {
 			dap_disconnect();
+			usb_link_cancel(&dap_link);
+			for (size_t i = 0; i < USB_LINK_POOL_SIZE; ++i)
+				libusb_free_transfer(dap_link.pool[i]);
 			libusb_close(usb_handle);
 		}
 	}
@@ -289,10 +316,16 @@ int dbg_get_report_size(void)
 	return report_size;
 }
 
-int dbg_dap_cmd(uint8_t *data, int size, int rsize)
+size_t dbg_dap_packet_count(void)
+{
+	/* Bulk requests in flight share the transfer pool with the response being waited on */
+	if (type == CMSIS_TYPE_BULK && packet_count > USB_LINK_POOL_SIZE - 1U)
+		return USB_LINK_POOL_SIZE - 1U;
+	return packet_count;
+}
 
+bool dbg_dap_cmd_send(const uint8_t *const data, const int rsize)
 {
-	char cmd = data[0];
 	int res = -1;
 
 	memset(buffer, 0xff, report_size + 1);
@@ -300,18 +333,37 @@ int dbg_dap_cmd(uint8_t *data, int size, int rsize)
 	buffer[0] = 0x00; // Report ID??
 	memcpy(&buffer[1], data, rsize);
 
+	wire_trace_request(WIRE_TRACE_DAP, data, rsize);
 	DEBUG_WIRE("cmd :   ");
 	for(int i = (type == CMSIS_TYPE_HID) ? 0 : 1; (i < rsize + 1); i++)
 		DEBUG_WIRE("%02x.",	buffer[i]);
 	DEBUG_WIRE("\n");
 	if (type == CMSIS_TYPE_HID) {
-		res = hid_write(handle, buffer, 65);
+		res = hid_write(handle, buffer, report_size);
 		if (res < 0) {
 			DEBUG_WARN("Error: %ls\n", hid_error(handle));
 			exit(-1);
 		}
+	} else if (type == CMSIS_TYPE_BULK) {
+		uint8_t *const tx_buffer = dap_tx_buffers[dap_tx_next];
+		dap_tx_next = (dap_tx_next + 1U) % USB_LINK_POOL_SIZE;
+		memcpy(tx_buffer, data, rsize);
+		res = usb_link_submit(&dap_link, false, tx_buffer, rsize);
+		if (res < 0) {
+			DEBUG_WARN("OUT error: %d\n", res);
+			return false;
+		}
+	}
+	return true;
+}
+
+int dbg_dap_cmd_recv(const uint8_t cmd, uint8_t *const data, const int size)
+{
+	int res = -1;
+
+	if (type == CMSIS_TYPE_HID) {
 		do {
-			res = hid_read_timeout(handle, buffer, 65, 1000);
+			res = hid_read_timeout(handle, buffer, report_size, 1000);
 			if (res < 0) {
 				DEBUG_WARN("debugger read(): %ls\n", hid_error(handle));
 				exit(-1);
@@ -321,23 +373,26 @@ int dbg_dap_cmd(uint8_t *data, int size, int rsize)
 			}
 		} while (buffer[0] != cmd);
 	} else if (type == CMSIS_TYPE_BULK) {
-		int transferred = 0;
-
-		res = libusb_bulk_transfer(usb_handle, out_ep, data, rsize, &transferred, TRANSFER_TIMEOUT_MS);
-		if (res < 0) {
-			DEBUG_WARN("OUT error: %d\n", res);
-			return res;
-		}
-
 		/* We repeat the read in case we're out of step with the transmitter */
 		do {
-			res = libusb_bulk_transfer(usb_handle, in_ep, buffer, report_size, &transferred, TRANSFER_TIMEOUT_MS);
+			if (usb_link_submit(&dap_link, true, buffer, report_size) < 0) {
+				DEBUG_WARN("IN error\n");
+				return -1;
+			}
+			/* Requests complete before the response submitted after them */
+			while (usb_link_pending(&dap_link) > 1U) {
+				if (usb_link_collect(&dap_link) < 0) {
+					DEBUG_WARN("OUT error\n");
+					usb_link_cancel(&dap_link);
+					return -1;
+				}
+			}
+			res = usb_link_collect(&dap_link);
 			if (res < 0) {
 				DEBUG_WARN("IN error: %d\n", res);
 				return res;
 			}
 		} while (buffer[0] != cmd);
-		res = transferred;
 	}
 	DEBUG_WIRE("cmd res:");
 	for (int i = 0; i < res; i++)
@@ -349,8 +404,18 @@ int dbg_dap_cmd(uint8_t *data, int size, int rsize)
 	}
 	if (size)
 		memcpy(data, &buffer[1], (size < res) ? size : res);
+	wire_trace_response(WIRE_TRACE_DAP, data, (size && res > 0) ? MIN(size, res) : 0, res);
 	return res;
 }
+
+int dbg_dap_cmd(uint8_t *data, int size, int rsize)
+{
+	const uint8_t cmd = data[0];
+	if (!dbg_dap_cmd_send(data, rsize))
+		return -1;
+	return dbg_dap_cmd_recv(cmd, data, size);
+}
+
 #define ALIGNOF(x) (((x) & 3) == 0 ? ALIGN_WORD :					\
                     (((x) & 1) == 0 ? ALIGN_HALFWORD : ALIGN_BYTE))
 
@@ -363,33 +428,21 @@ static void dap_mem_read(ADIv5_AP_t *ap, void *dest, uint32_t src, size_t len)
 		   src, len, align);
 	if (((unsigned)(1 << align)) == len)
 		return dap_read_single(ap, dest, src, align);
-	/* One word transfer for every byte/halfword/word
-	 * Total number of bytes in transfer*/
-	unsigned int max_size = ((dbg_get_report_size() - 6) >> (2 - align)) & ~3;
-	while (len) {
+	/* Short reads that do not wrap TAR go out in one exchange together with their setup */
+	int res = -1;
+	if ((src & 0x3ffU) + len <= 0x400U)
+		res = dap_read_block_batched(ap, dest, src, len, align);
+	if (res < 0) {
 		dap_ap_mem_access_setup(ap, src, align);
-		/* Calculate length until next access setup is needed */
-		unsigned int blocksize = (src | 0x3ff) - src + 1;
-		if (blocksize > len)
-			blocksize = len;
-		while (blocksize) {
-			unsigned int transfersize = blocksize;
-			if (transfersize > max_size)
-				transfersize = max_size;
-			unsigned int res = dap_read_block(ap, dest, src, transfersize,
-											  align);
-			if (res) {
-			    DEBUG_WIRE("mem_read failed %02x\n", res);
-				ap->dp->fault = 1;
-				return;
-			}
-			blocksize -= transfersize;
-			len       -= transfersize;
-			dest      += transfersize;
-			src       += transfersize;
-		}
+		/* dap_read_block() streams this, 1 KiB TAR wraps included */
+		res = dap_read_block(ap, dest, src, len, align);
 	}
-    DEBUG_WIRE("memread res last data %08" PRIx32 "\n", ((uint32_t*)dest)[-1]);
+	if (res) {
+	    DEBUG_WIRE("mem_read failed %02x\n", res);
+		ap->dp->fault = 1;
+		return;
+	}
+    DEBUG_WIRE("memread res last data %08" PRIx32 "\n", ((uint32_t*)((uint8_t *)dest + len))[-1]);
 }
 
 static void dap_mem_write_sized( ADIv5_AP_t *ap, uint32_t dest, const void *src, size_t len, enum align align)
@@ -400,32 +453,24 @@ static void dap_mem_write_sized( ADIv5_AP_t *ap, uint32_t dest, const void *src,
 		dest, len, align, *(uint32_t *)src);
 	if (((unsigned)(1 << align)) == len)
 		return dap_write_single(ap, dest, src, align);
-	unsigned int max_size = ((dbg_get_report_size() - 6) >> (2 - align) & ~3);
-	while (len) {
+	/* The batched form already ends with the read confirming the write completed */
+	int res = -1;
+	if ((dest & 0x3ffU) + len <= 0x400U)
+		res = dap_write_block_batched(ap, dest, src, len, align);
+	const bool confirmed = res >= 0;
+	if (res < 0) {
 		dap_ap_mem_access_setup(ap, dest, align);
-		unsigned int blocksize = (dest | 0x3ff) - dest + 1;
-		if (blocksize > len)
-			blocksize = len;
-		while (blocksize) {
-			unsigned int transfersize = blocksize;
-			if (transfersize > max_size)
-				transfersize = max_size;
-			unsigned int res = dap_write_block(ap, dest, src, transfersize,
-											   align);
-			if (res) {
-				DEBUG_WARN("mem_write failed %02x\n", res);
-				ap->dp->fault = 1;
-				return;
-			}
-			blocksize -= transfersize;
-			len       -= transfersize;
-			dest      += transfersize;
-			src       += transfersize;
-		}
+		res = dap_write_block(ap, dest, src, len, align);
+	}
+	if (res) {
+		DEBUG_WARN("mem_write failed %02x\n", res);
+		ap->dp->fault = 1;
+		return;
 	}
 
 	/* Make sure this write is complete by doing a dummy read */
-	adiv5_dp_read(ap->dp, ADIV5_DP_RDBUFF);
+	if (!confirmed)
+		adiv5_dp_read(ap->dp, ADIV5_DP_RDBUFF);
 	DEBUG_WIRE("memwrite done\n");
 }
 
@@ -437,6 +482,9 @@ void dap_adiv5_dp_defaults(ADIv5_DP_t *dp)
 	dp->ap_write = dap_ap_write;
 	dp->mem_read = dap_mem_read;
 	dp->mem_write_sized =  dap_mem_write_sized;
+	dp->queue_read = dap_queue_read;
+	dp->queue_write = dap_queue_write;
+	dp->queue_flush = dap_queue_flush;
 }
 
 static void cmsis_dap_jtagtap_reset(void)
@@ -465,6 +513,12 @@ static void cmsis_dap_jtagtap_tdi_seq(const bool final_tms, const uint8_t *const
 	DEBUG_PROBE("jtagtap_tdi_seq %zu, %02x\n", clock_cycles, data_in[0]);
 }
 
+static void cmsis_dap_jtagtap_tms_tdi_tdo_seq(
+	uint8_t *const data_out, const uint8_t *const tms, const uint8_t *const data_in, const size_t clock_cycles)
+{
+	dap_jtagtap_tdi_tdo_seq(data_out, false, tms, data_in, clock_cycles);
+}
+
 static bool cmsis_dap_jtagtap_next(const bool tms, const bool tdi)
 {
 	const uint8_t tms_byte = tms ? 1 : 0;
@@ -489,11 +543,13 @@ int cmsis_dap_jtagtap_init(jtag_proc_t *jtag_proc)
 	jtag_proc->jtagtap_tms_seq = cmsis_dap_jtagtap_tms_seq;
 	jtag_proc->jtagtap_tdi_tdo_seq = cmsis_dap_jtagtap_tdi_tdo_seq;
 	jtag_proc->jtagtap_tdi_seq = cmsis_dap_jtagtap_tdi_seq;
+	jtag_proc->jtagtap_tms_tdi_tdo_seq = cmsis_dap_jtagtap_tms_tdi_tdo_seq;
 	return 0;
 }
 
 int dap_jtag_dp_init(ADIv5_DP_t *dp)
 {
+	dap_retry_configure(dp);
 	dp->dp_read = dap_dp_read_reg;
 	dp->error = dap_dp_error;
 	dp->low_access = dap_dp_low_access;
@@ -537,7 +593,7 @@ int dap_swdptap_init(ADIv5_DP_t *dp)
 	if (!(dap_caps & DAP_CAP_SWD))
 		return 1;
 	mode =  DAP_CAP_SWD;
-	dap_transfer_configure(2, 128, 128);
+	dap_retry_configure(dp);
 	dap_swd_configure(0);
 	dap_connect(false);
 	dap_led(0, 1);
@@ -0,0 +1,374 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Post-mortem capture. The core file is laid out as the Linux kernel writes
+ * one for a 32-bit ARM process, which is what GDB's ARM support reads: a
+ * PT_NOTE holding an NT_PRSTATUS with r0-r15 and the (x)PSR, then a PT_LOAD
+ * per RAM region. Each region is read in the largest blocks target_mem_read
+ * takes, so a unit about to be reset by its watchdog is captured in as
+ * little time as the link allows.
+ *
+ * Snapshots keep a copy of RAM on the host between halts, with the CRC32 of
+ * each block of it. On the next halt the target works out the CRCs of the
+ * same blocks with the CRC stub and only the blocks that differ are read.
+ */
+
+#include "general.h"
+#include "target_internal.h"
+#include "coredump.h"
+#include "crc32.h"
+
+#include <errno.h>
+#include <limits.h>
+
+#define COREDUMP_CHUNK_SIZE      0x10000U
+#define COREDUMP_BLOCK_SIZE      0x1000U
+#define COREDUMP_HALT_TIMEOUT_MS 2000U
+
+#define ELF_HEADER_SIZE  52U
+#define ELF_PHDR_SIZE    32U
+#define ELF_ET_CORE      4U
+#define ELF_EM_ARM       40U
+#define ELF_PT_LOAD      1U
+#define ELF_PT_NOTE      4U
+#define ELF_PF_RWX       7U
+#define ELF_NT_PRSTATUS  1U
+
+/* struct elf_prstatus for 32-bit ARM: pr_reg holds r0-r15, cpsr and orig_r0 */
+#define PRSTATUS_SIZE        148U
+#define PRSTATUS_CURSIG      12U
+#define PRSTATUS_PID         24U
+#define PRSTATUS_REG         72U
+#define PRSTATUS_REG_COUNT   18U
+#define PRSTATUS_CORE_REGS   17U
+#define COREDUMP_NOTE_SIZE   (12U + 8U + PRSTATUS_SIZE)
+
+/* Linux's SIGTRAP, which is how GDB reads the signal of the note */
+#define PRSTATUS_SIGTRAP     5U
+
+static void coredump_put16(uint8_t *const data, const uint16_t value)
+{
+	data[0] = value & 0xffU;
+	data[1] = value >> 8U;
+}
+
+static void coredump_put32(uint8_t *const data, const uint32_t value)
+{
+	data[0] = value & 0xffU;
+	data[1] = (value >> 8U) & 0xffU;
+	data[2] = (value >> 16U) & 0xffU;
+	data[3] = value >> 24U;
+}
+
+static bool coredump_halt(target *const t)
+{
+	target_addr_t watch;
+	if (target_halt_poll(t, &watch) != TARGET_HALT_RUNNING)
+		return true;
+	target_halt_request(t);
+	platform_timeout timeout;
+	platform_timeout_set(&timeout, COREDUMP_HALT_TIMEOUT_MS);
+	enum target_halt_reason reason;
+	while ((reason = target_halt_poll(t, &watch)) == TARGET_HALT_RUNNING) {
+		if (platform_timeout_is_expired(&timeout))
+			return false;
+	}
+	return reason != TARGET_HALT_ERROR;
+}
+
+static void coredump_phdr(uint8_t *const phdr, const uint32_t type, const uint32_t offset, const uint32_t addr,
+	const uint32_t size, const uint32_t flags)
+{
+	coredump_put32(phdr, type);
+	coredump_put32(phdr + 4U, offset);
+	coredump_put32(phdr + 8U, addr);
+	coredump_put32(phdr + 12U, addr);
+	coredump_put32(phdr + 16U, size);
+	coredump_put32(phdr + 20U, size);
+	coredump_put32(phdr + 24U, flags);
+	coredump_put32(phdr + 28U, 4U);
+}
+
+/* The ELF header, program headers and register note, everything ahead of the RAM contents */
+static bool coredump_write_headers(target *const t, FILE *const file, const size_t regions)
+{
+	const size_t phnum = regions + 1U;
+	uint8_t header[ELF_HEADER_SIZE] = {0x7fU, 'E', 'L', 'F', 1U /* 32-bit */, 1U /* LSB */, 1U /* EV_CURRENT */};
+	coredump_put16(header + 16U, ELF_ET_CORE);
+	coredump_put16(header + 18U, ELF_EM_ARM);
+	coredump_put32(header + 20U, 1U);
+	coredump_put32(header + 28U, ELF_HEADER_SIZE);
+	coredump_put16(header + 40U, ELF_HEADER_SIZE);
+	coredump_put16(header + 42U, ELF_PHDR_SIZE);
+	coredump_put16(header + 44U, (uint16_t)phnum);
+	if (fwrite(header, 1, sizeof(header), file) != sizeof(header))
+		return false;
+
+	uint32_t offset = ELF_HEADER_SIZE + phnum * ELF_PHDR_SIZE;
+	uint8_t phdr[ELF_PHDR_SIZE];
+	coredump_phdr(phdr, ELF_PT_NOTE, offset, 0, COREDUMP_NOTE_SIZE, 0);
+	if (fwrite(phdr, 1, sizeof(phdr), file) != sizeof(phdr))
+		return false;
+	offset += COREDUMP_NOTE_SIZE;
+	for (const struct target_ram *r = t->ram; r; r = r->next) {
+		coredump_phdr(phdr, ELF_PT_LOAD, offset, r->start, r->length, ELF_PF_RWX);
+		if (fwrite(phdr, 1, sizeof(phdr), file) != sizeof(phdr))
+			return false;
+		offset += r->length;
+	}
+
+	/* The registers as GDB's g packet has them, core registers first on every ARM target */
+	const size_t regs_size = target_regs_size(t);
+	uint8_t *const regs = calloc(1, MAX(regs_size, PRSTATUS_CORE_REGS * 4U));
+	if (!regs) { /* calloc failed: heap exhaustion */
+		DEBUG_WARN("calloc: failed in %s\n", __func__);
+		return false;
+	}
+	target_regs_read(t, regs);
+
+	uint8_t note[COREDUMP_NOTE_SIZE] = {0};
+	coredump_put32(note, 5U);
+	coredump_put32(note + 4U, PRSTATUS_SIZE);
+	coredump_put32(note + 8U, ELF_NT_PRSTATUS);
+	memcpy(note + 12U, "CORE", 5U);
+	uint8_t *const prstatus = note + 20U;
+	coredump_put32(prstatus, PRSTATUS_SIGTRAP);
+	coredump_put16(prstatus + PRSTATUS_CURSIG, PRSTATUS_SIGTRAP);
+	coredump_put32(prstatus + PRSTATUS_PID, 1U);
+	memcpy(prstatus + PRSTATUS_REG, regs, MIN(regs_size, PRSTATUS_CORE_REGS * 4U));
+	/* orig_r0, only meaningful for a Linux system call */
+	coredump_put32(prstatus + PRSTATUS_REG + (PRSTATUS_REG_COUNT - 1U) * 4U, UINT32_MAX);
+	free(regs);
+	return fwrite(note, 1, sizeof(note), file) == sizeof(note);
+}
+
+/*
+ * Writes a region from image, or read from the target in chunks when image is NULL. Adds what
+ * could not be read to lost, false if the file could not be written.
+ */
+static bool coredump_write_region(target *const t, FILE *const file, const struct target_ram *const r,
+	const uint8_t *const image, uint8_t *const chunk, size_t *const lost)
+{
+	if (image)
+		return fwrite(image, 1, r->length, file) == r->length;
+	for (size_t done = 0; done < r->length;) {
+		const size_t count = MIN(COREDUMP_CHUNK_SIZE, r->length - done);
+		if (target_mem_read(t, chunk, r->start + done, count)) {
+			DEBUG_WARN("Core dump: read failed at 0x%08" PRIx32 ", written as zeros\n", (uint32_t)(r->start + done));
+			memset(chunk, 0, count);
+			*lost += count;
+		}
+		if (fwrite(chunk, 1, count, file) != count)
+			return false;
+		done += count;
+	}
+	return true;
+}
+
+/* The core file of the halted target, with RAM from images, one per region, or the target if NULL */
+static bool coredump_write_file(target *const t, const char *const path, uint8_t *const *const images, size_t *const lost)
+{
+	size_t regions = 0;
+	for (const struct target_ram *r = t->ram; r; r = r->next)
+		++regions;
+
+	FILE *const file = fopen(path, "wb");
+	if (!file) {
+		DEBUG_WARN("Core dump: can not open %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	uint8_t *const chunk = images ? NULL : malloc(COREDUMP_CHUNK_SIZE);
+	if (!images && !chunk) { /* malloc failed: heap exhaustion */
+		DEBUG_WARN("malloc: failed in %s\n", __func__);
+		fclose(file);
+		return false;
+	}
+	bool ok = coredump_write_headers(t, file, regions);
+	size_t i = 0;
+	for (const struct target_ram *r = t->ram; ok && r; r = r->next, ++i)
+		ok = coredump_write_region(t, file, r, images ? images[i] : NULL, chunk, lost);
+	free(chunk);
+	if (fclose(file))
+		ok = false;
+	if (!ok)
+		DEBUG_WARN("Core dump: writing %s failed: %s\n", path, strerror(errno));
+	return ok;
+}
+
+bool coredump_write(target *const t, const char *const path)
+{
+	const uint32_t start_time = platform_time_ms();
+	if (!coredump_halt(t)) {
+		DEBUG_WARN("Core dump: the target did not halt\n");
+		return false;
+	}
+	size_t regions = 0;
+	size_t ram_size = 0;
+	for (const struct target_ram *r = t->ram; r; r = r->next) {
+		++regions;
+		ram_size += r->length;
+	}
+
+	size_t lost = 0;
+	if (!coredump_write_file(t, path, NULL, &lost))
+		return false;
+
+	const uint32_t elapsed = MAX(platform_time_ms() - start_time, 1U);
+	DEBUG_WARN("Core dump: %zu bytes of RAM in %zu regions to %s in %" PRIu32 " ms, %.1f kiB/s\n", ram_size, regions,
+		path, elapsed, ram_size / 1.024 / elapsed);
+	if (lost)
+		DEBUG_WARN("Core dump: %zu bytes could not be read\n", lost);
+	return true;
+}
+
+/* The host's copy of RAM as of the last snapshot, one image per region of the memory map */
+static struct {
+	size_t regions;
+	target_addr_t *start;
+	size_t *length;
+	uint8_t **image;
+	uint32_t **crc; /* Of each COREDUMP_BLOCK_SIZE block of the image */
+	unsigned sequence;
+} snapshot;
+
+void coredump_snapshot_reset(void)
+{
+	for (size_t i = 0; i < snapshot.regions; ++i) {
+		free(snapshot.image[i]);
+		free(snapshot.crc[i]);
+	}
+	free(snapshot.start);
+	free(snapshot.length);
+	free(snapshot.image);
+	free(snapshot.crc);
+	memset(&snapshot, 0, sizeof(snapshot));
+}
+
+/*
+ * Whether the baseline still covers the memory map. Which target it was taken from doesn't
+ * matter, a baseline of another one only costs reading back more blocks.
+ */
+static bool coredump_snapshot_matches(const target *const t)
+{
+	size_t i = 0;
+	for (const struct target_ram *r = t->ram; r; r = r->next, ++i) {
+		if (i == snapshot.regions || snapshot.start[i] != r->start || snapshot.length[i] != r->length)
+			return false;
+	}
+	return i == snapshot.regions && i;
+}
+
+static bool coredump_snapshot_alloc(const target *const t)
+{
+	size_t regions = 0;
+	for (const struct target_ram *r = t->ram; r; r = r->next)
+		++regions;
+	if (!regions) {
+		DEBUG_WARN("Snapshot: the memory map has no RAM\n");
+		return false;
+	}
+	snapshot.start = calloc(regions, sizeof(*snapshot.start));
+	snapshot.length = calloc(regions, sizeof(*snapshot.length));
+	snapshot.image = calloc(regions, sizeof(*snapshot.image));
+	snapshot.crc = calloc(regions, sizeof(*snapshot.crc));
+	snapshot.regions = regions;
+	bool ok = snapshot.start && snapshot.length && snapshot.image && snapshot.crc;
+	size_t i = 0;
+	for (const struct target_ram *r = t->ram; ok && r; r = r->next, ++i) {
+		snapshot.start[i] = r->start;
+		snapshot.length[i] = r->length;
+		snapshot.image[i] = malloc(r->length);
+		snapshot.crc[i] = calloc((r->length + COREDUMP_BLOCK_SIZE - 1U) / COREDUMP_BLOCK_SIZE, sizeof(uint32_t));
+		ok = snapshot.image[i] && snapshot.crc[i];
+	}
+	if (!ok) { /* malloc failed: heap exhaustion */
+		DEBUG_WARN("malloc: failed in %s\n", __func__);
+		if (!snapshot.start || !snapshot.length || !snapshot.image || !snapshot.crc)
+			snapshot.regions = 0;
+		coredump_snapshot_reset();
+	}
+	return ok;
+}
+
+/*
+ * Brings a block of the image up to date, reading it back unless the target's CRC of it matches
+ * the one of the copy. Once the stub fails it isn't tried again for this snapshot, use_crc is
+ * cleared. Returns the bytes read, adding those that could not be to lost.
+ */
+static size_t coredump_snapshot_block(target *const t, const target_addr_t addr, uint8_t *const data,
+	const size_t len, uint32_t *const crc, bool *const use_crc, size_t *const lost)
+{
+	if (*use_crc) {
+		uint32_t target_crc;
+		if (target_mem_crc32(t, &target_crc, addr, len)) {
+			if (target_crc == *crc)
+				return 0;
+		} else {
+			DEBUG_WARN("Snapshot: no CRC stub on this target, reading every block\n");
+			*use_crc = false;
+		}
+	}
+	if (target_mem_read(t, data, addr, len)) {
+		DEBUG_WARN("Snapshot: read failed at 0x%08" PRIx32 ", written as zeros\n", (uint32_t)addr);
+		memset(data, 0, len);
+		*lost += len;
+	}
+	/* A block that read as zeros is read again next time unless the target's CRC says it is zeros */
+	*crc = generic_crc32_buffer(0xffffffffU, data, len);
+	return len;
+}
+
+const char *coredump_snapshot(target *const t, const char *const prefix)
+{
+	const uint32_t start_time = platform_time_ms();
+	if (!coredump_halt(t)) {
+		DEBUG_WARN("Snapshot: the target did not halt\n");
+		return NULL;
+	}
+	const bool baseline = !coredump_snapshot_matches(t);
+	if (baseline) {
+		coredump_snapshot_reset();
+		if (!coredump_snapshot_alloc(t))
+			return NULL;
+	}
+
+	size_t ram_size = 0;
+	size_t read = 0;
+	size_t lost = 0;
+	bool use_crc = !baseline;
+	for (size_t i = 0; i < snapshot.regions; ++i) {
+		ram_size += snapshot.length[i];
+		for (size_t offset = 0; offset < snapshot.length[i]; offset += COREDUMP_BLOCK_SIZE) {
+			const size_t len = MIN(COREDUMP_BLOCK_SIZE, snapshot.length[i] - offset);
+			read += coredump_snapshot_block(t, snapshot.start[i] + offset, snapshot.image[i] + offset, len,
+				&snapshot.crc[i][offset / COREDUMP_BLOCK_SIZE], &use_crc, &lost);
+		}
+	}
+
+	static char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s-%u.core", prefix, snapshot.sequence);
+	if (!coredump_write_file(t, path, snapshot.image, &lost))
+		return NULL;
+	++snapshot.sequence;
+
+	const uint32_t elapsed = MAX(platform_time_ms() - start_time, 1U);
+	DEBUG_WARN("Snapshot: %s, %zu of %zu bytes of RAM read back in %" PRIu32 " ms\n", path, read, ram_size, elapsed);
+	if (lost)
+		DEBUG_WARN("Snapshot: %zu bytes could not be read\n", lost);
+	return path;
+}
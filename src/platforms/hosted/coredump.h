@@ -0,0 +1,43 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PLATFORMS_HOSTED_COREDUMP_H
+#define PLATFORMS_HOSTED_COREDUMP_H
+
+#include <stdbool.h>
+
+#include "target.h"
+
+/*
+ * Halt the target and write its core registers and every RAM region of its
+ * memory map to an ELF core file at path, for `gdb -c path program.elf`.
+ * RAM that can't be read is written as zeros and counted in the log.
+ */
+bool coredump_write(target *t, const char *path);
+
+/*
+ * Halt the target and write a core file as coredump_write() does, to
+ * <prefix>-<n>.core with n counting up from 0 at the baseline. The first one
+ * reads all of RAM, later ones only the blocks whose CRC on the target no
+ * longer matches the copy kept from the one before. Returns the file name,
+ * valid until the next call, or NULL if it failed.
+ */
+const char *coredump_snapshot(target *t, const char *prefix);
+/* Drop the baseline, the next snapshot reads all of RAM and starts again at 0 */
+void coredump_snapshot_reset(void);
+
+#endif /* PLATFORMS_HOSTED_COREDUMP_H */
@@ -35,6 +35,7 @@
 #include "exception.h"
 #include "dap.h"
 #include "jtag_scan.h"
+#include "stats.h"
 
 /*- Definitions -------------------------------------------------------------*/
 enum
@@ -58,6 +59,7 @@ enum
 	ID_DAP_JTAG_CONFIGURE     = 0x15,
 	ID_DAP_JTAG_IDCODE        = 0x16,
 	ID_DAP_SWD_SEQUENCE       = 0x1D,
+	ID_DAP_EXECUTE_COMMANDS   = 0x7F,
 };
 
 enum
@@ -241,6 +243,27 @@ void dap_transfer_configure(uint8_t idle, uint16_t count, uint16_t retry)
 	dbg_dap_cmd(buf, sizeof(buf), 6);
 }
 
+/* Idle cycles the adaptor was last told to clock after each transfer */
+static size_t dap_transfer_idle;
+
+/*
+ * The adaptor does the WAIT retries itself. Its idle cycles follow every transfer,
+ * which is what the DP tunes from the WAITs seen, so those are handed on.
+ */
+void dap_retry_configure(ADIv5_DP_t *dp)
+{
+	dap_transfer_idle = adiv5_dp_idle_after(dp);
+	dap_transfer_configure(MIN(dap_transfer_idle, UINT8_MAX), dp->retry.wait_retries, 128);
+}
+
+/* Only WAITs the adaptor gave up on are seen here, each is a long run of them */
+static void dap_idle_tune(ADIv5_DP_t *dp, size_t waits)
+{
+	adiv5_dp_idle_tune(dp, waits);
+	if (adiv5_dp_idle_after(dp) != dap_transfer_idle)
+		dap_retry_configure(dp);
+}
+
 //-----------------------------------------------------------------------------
 void dap_swd_configure(uint8_t cfg)
 {
@@ -270,6 +293,81 @@ size_t dap_info(const dap_info_t info, uint8_t *const data, const size_t size)
 	return rsize;
 }
 
+/*
+ * Composite operations are collected into a batch and sent as one
+ * DAP_ExecuteCommands when the adaptor supports atomic commands, or one
+ * exchange per command otherwise. Either way the response buffer holds each
+ * command's response, starting with its command ID, in the order they were added.
+ */
+#define DAP_BATCH_MAX_COMMANDS 8U
+
+typedef struct dap_batch {
+	uint8_t request[1024];
+	size_t request_length;
+	size_t response_length;
+	uint8_t count;
+	uint16_t command_offset[DAP_BATCH_MAX_COMMANDS];
+	uint16_t command_length[DAP_BATCH_MAX_COMMANDS];
+	uint16_t response_size[DAP_BATCH_MAX_COMMANDS];
+} dap_batch_s;
+
+static dap_batch_s dap_batch;
+
+void dap_batch_begin(void)
+{
+	dap_batch.count = 0;
+	/* Room for the DAP_ExecuteCommands ID and command count */
+	dap_batch.request_length = 2;
+	dap_batch.response_length = 0;
+}
+
+int dap_batch_add(const uint8_t *const command, const size_t length, const size_t response_length)
+{
+	/* Both directions have to fit a single report, less the outer command ID and count */
+	const size_t limit = (size_t)dbg_get_report_size() - 1U;
+	if (dap_batch.count == DAP_BATCH_MAX_COMMANDS || dap_batch.request_length + length > limit ||
+		dap_batch.response_length + response_length + 1U > limit)
+		return -1;
+	const size_t index = dap_batch.count++;
+	dap_batch.command_offset[index] = dap_batch.request_length;
+	dap_batch.command_length[index] = length;
+	dap_batch.response_size[index] = response_length;
+	memcpy(dap_batch.request + dap_batch.request_length, command, length);
+	dap_batch.request_length += length;
+	const int offset = (int)dap_batch.response_length;
+	dap_batch.response_length += response_length;
+	return offset;
+}
+
+bool dap_batch_run(uint8_t *const response, const size_t size)
+{
+	if (dap_batch.response_length > size)
+		return false;
+	if (dap_batch.count > 1U && (dap_caps & DAP_CAP_ATOMIC_CMD)) {
+		dap_batch.request[0] = ID_DAP_EXECUTE_COMMANDS;
+		dap_batch.request[1] = dap_batch.count;
+		const uint8_t count = dap_batch.count;
+		if (dbg_dap_cmd(dap_batch.request, sizeof(dap_batch.request), dap_batch.request_length) < 0 ||
+			dap_batch.request[0] != count)
+			return false;
+		memcpy(response, dap_batch.request + 1U, dap_batch.response_length);
+		return true;
+	}
+
+	size_t offset = 0;
+	for (size_t i = 0; i < dap_batch.count; ++i) {
+		uint8_t buf[1024];
+		const uint8_t *const command = dap_batch.request + dap_batch.command_offset[i];
+		memcpy(buf, command, dap_batch.command_length[i]);
+		if (dbg_dap_cmd(buf, sizeof(buf), dap_batch.command_length[i]) < 0)
+			return false;
+		response[offset] = command[0];
+		memcpy(response + offset + 1U, buf, dap_batch.response_size[i] - 1U);
+		offset += dap_batch.response_size[i];
+	}
+	return true;
+}
+
 void dap_reset_pin(int state)
 {
 	uint8_t buf[7];
@@ -322,19 +420,25 @@ static void dap_line_reset(void)
 		DEBUG_WARN("line reset failed\n");
 }
 
-static uint32_t wait_word(uint8_t *buf, int size, int len, uint8_t *dp_fault)
+static uint32_t wait_word(uint8_t *buf, int size, int len, ADIv5_DP_t *dp)
 {
 	uint8_t cmd_copy[len];
 	memcpy(cmd_copy, buf, len);
+	size_t waits = 0;
 	do {
 		memcpy(buf, cmd_copy, len);
 		dbg_dap_cmd(buf, size, len);
 		if (buf[1] < DAP_TRANSFER_WAIT)
 			break;
+		/* The adaptor already used up its own WAIT retries on this one */
+		stats_add(STATS_DP_RETRY_EXHAUSTED, 1);
+		++waits;
 	} while (buf[1] == DAP_TRANSFER_WAIT);
+	dap_idle_tune(dp, waits);
 
 	if(buf[1] == SWDP_ACK_FAULT) {
-		*dp_fault = 1;
+		stats_add(STATS_DP_FAULT, 1);
+		dp->fault = 1;
 		return 0;
 	}
 
@@ -356,7 +460,7 @@ uint32_t dap_read_reg(ADIv5_DP_t *dp, uint8_t reg)
 	buf[1] = dap_index;
 	buf[2] = 0x01; // Request size
 	buf[3] = reg | DAP_TRANSFER_RnW;
-	uint32_t res = wait_word(buf, 8, 4, &dp->fault);
+	uint32_t res = wait_word(buf, 8, 4, dp);
 	DEBUG_WIRE("\tdap_read_reg %02x %08x\n", reg, res);
 	return res;
 }
@@ -379,14 +483,19 @@ void dap_write_reg(ADIv5_DP_t *dp, uint8_t reg, uint32_t data)
 	buf[7] = (data >> 24) & 0xff;
 	uint8_t cmd_copy[8];
 	memcpy(cmd_copy, buf, 8);
+	size_t waits = 0;
 	do {
 		memcpy(buf, cmd_copy, 8);
 		dbg_dap_cmd(buf, sizeof(buf), 8);
 		if (buf[1] < DAP_TRANSFER_WAIT)
 			break;
+		stats_add(STATS_DP_RETRY_EXHAUSTED, 1);
+		++waits;
 	} while (buf[1] == DAP_TRANSFER_WAIT);
+	dap_idle_tune(dp, waits);
 
 	if (buf[1] > DAP_TRANSFER_WAIT) {
+		stats_add(STATS_DP_FAULT, 1);
 		DEBUG_WARN("dap_write_reg %02x data %08x:fault\n", reg, data);
 		dp->fault = 1;
 	}
@@ -397,77 +506,279 @@ void dap_write_reg(ADIv5_DP_t *dp, uint8_t reg, uint32_t data)
 	}
 }
 
-unsigned int dap_read_block(ADIv5_AP_t *ap, void *dest, uint32_t src,
-							size_t len, enum align align)
+/* Target words a single DAP_TransferBlock carries, given the header bytes sharing the packet */
+static size_t dap_block_words(const size_t header)
+{
+	return ((size_t)dbg_get_report_size() - 1U - header) >> 2U;
+}
+
+/* Bytes to put in the next block: no more than fits a packet, and not past the 1 KiB TAR wrap */
+static size_t dap_block_length(const uint32_t addr, const size_t remaining, const size_t words, const enum align align)
+{
+	const size_t wrap = (addr | 0x3ffU) - addr + 1U;
+	return MIN(MIN(remaining, wrap), words << align);
+}
+
+#define DAP_PIPELINE_MAX 16U
+
+/*
+ * Block transfers are streamed as DAP_TransferBlock commands sized to the
+ * negotiated packet, with as many in flight as the adaptor can buffer. Where
+ * the address crosses a 1 KiB boundary the TAR rewrite goes into the same
+ * stream rather than costing a round trip of its own. Each entry of the ring
+ * is the length of data a command in flight carries, 0 for a TAR write.
+ */
+typedef struct dap_pipeline {
+	uint16_t length[DAP_PIPELINE_MAX];
+	size_t head;
+	size_t count;
+	size_t depth;
+} dap_pipeline_s;
+
+static void dap_pipeline_init(dap_pipeline_s *const pipeline)
+{
+	pipeline->head = 0;
+	pipeline->count = 0;
+	pipeline->depth = MIN(dbg_dap_packet_count(), DAP_PIPELINE_MAX);
+}
+
+static bool dap_pipeline_full(const dap_pipeline_s *const pipeline)
+{
+	return pipeline->count == pipeline->depth;
+}
+
+static void dap_pipeline_push(dap_pipeline_s *const pipeline, const size_t length)
+{
+	pipeline->length[(pipeline->head + pipeline->count++) % DAP_PIPELINE_MAX] = length;
+}
+
+static size_t dap_pipeline_pop(dap_pipeline_s *const pipeline)
+{
+	const size_t length = pipeline->length[pipeline->head];
+	pipeline->head = (pipeline->head + 1U) % DAP_PIPELINE_MAX;
+	--pipeline->count;
+	return length;
+}
+
+/* Queue the TAR write that follows an auto-increment wrap, returns false if it could not be sent */
+static bool dap_pipeline_tar(dap_pipeline_s *const pipeline, const uint8_t dap_index, const uint32_t addr)
+{
+	const uint8_t buf[] = {
+		ID_DAP_TRANSFER,
+		dap_index,
+		1,
+		SWD_AP_TAR,
+		addr & 0xff,
+		(addr >> 8) & 0xff,
+		(addr >> 16) & 0xff,
+		(addr >> 24) & 0xff,
+	};
+	if (!dbg_dap_cmd_send(buf, sizeof(buf)))
+		return false;
+	dap_pipeline_push(pipeline, 0);
+	return true;
+}
+
+/* Collect the response to a queued TAR write, returns true if it failed */
+static bool dap_pipeline_tar_response(bool *const line_reset)
+{
+	uint8_t buf[8];
+	dbg_dap_cmd_recv(ID_DAP_TRANSFER, buf, sizeof(buf));
+	if (buf[1] > DAP_TRANSFER_FAULT)
+		*line_reset = true;
+	return buf[0] != 1 || buf[1] != DAP_TRANSFER_OK;
+}
+
+/*
+ * Unpack a DAP_TransferBlock read response, starting at its transfer count.
+ * Returns non-zero if the block did not fully complete.
+ */
+static unsigned int dap_read_block_response(const uint8_t *const response, void *dest, uint32_t src,
+	const size_t len, const enum align align, bool *const line_reset)
 {
-	uint8_t buf[1024];
 	unsigned int sz = len >> align;
-	uint8_t dap_index = 0;
-	dap_index = ap->dp->dp_jd_index;
-    buf[0] = ID_DAP_TRANSFER_BLOCK;
-    buf[1] = dap_index;
-    buf[2] =  sz & 0xff;
-    buf[3] = (sz >> 8) & 0xff;
-    buf[4] = SWD_AP_DRW | DAP_TRANSFER_RnW;
-    dbg_dap_cmd(buf, 1023, 5);
-	unsigned int transferred = buf[0] + (buf[1] << 8);
-	if (buf[2] >= DAP_TRANSFER_FAULT) {
+	const unsigned int transferred = response[0] + (response[1] << 8);
+	if (response[2] >= DAP_TRANSFER_FAULT) {
 		DEBUG_WARN("dap_read_block @ %08" PRIx32 " fault -> line reset\n", src);
-		dap_line_reset();
+		*line_reset = true;
 	}
-	if (sz != transferred)
+	if (sz != transferred || response[2] > DAP_TRANSFER_WAIT)
 		return 1;
-
 	if (align > ALIGN_HALFWORD)
-		memcpy(dest, &buf[3], len);
+		memcpy(dest, &response[3], len);
 	else {
-		uint32_t *p = (uint32_t *)&buf[3];
-		while(sz) {
-			dest = extract(dest, src, *p, align);
-			p++;
-			src  += (1 << align);
+		const uint8_t *p = &response[3];
+		while (sz) {
+			uint32_t value;
+			memcpy(&value, p, sizeof(value));
+			dest = extract(dest, src, value, align);
+			p += 4;
+			src += (1 << align);
 			sz--;
 		}
 	}
-	return (buf[2] > DAP_TRANSFER_WAIT) ? 1 : 0;
+	return 0;
+}
+
+/*
+ * Read len bytes from src, CSW and TAR having been set up for src already.
+ * A fault stops further commands, but the ones in flight still get drained
+ * before any line reset so the responses stay in step.
+ */
+unsigned int dap_read_block(ADIv5_AP_t *ap, void *dest, uint32_t src,
+							size_t len, enum align align)
+{
+	const size_t words = dap_block_words(4U);
+	const uint8_t dap_index = ap->dp->dp_jd_index;
+	dap_pipeline_s pipeline;
+	dap_pipeline_init(&pipeline);
+	size_t end = len;
+	size_t issued = 0;
+	size_t done = 0;
+	bool tar_issued = false;
+	unsigned int res = 0;
+	bool line_reset = false;
+	uint8_t buf[1024];
+
+	while (true) {
+		while (issued < end && !dap_pipeline_full(&pipeline)) {
+			const uint32_t addr = src + issued;
+			if (issued && !(addr & 0x3ffU) && !tar_issued) {
+				if (!dap_pipeline_tar(&pipeline, dap_index, addr)) {
+					end = issued;
+					res = 1;
+					break;
+				}
+				tar_issued = true;
+				continue;
+			}
+			const size_t transfer = dap_block_length(addr, end - issued, words, align);
+			const size_t sz = transfer >> align;
+			buf[0] = ID_DAP_TRANSFER_BLOCK;
+			buf[1] = dap_index;
+			buf[2] = sz & 0xff;
+			buf[3] = (sz >> 8) & 0xff;
+			buf[4] = SWD_AP_DRW | DAP_TRANSFER_RnW;
+			if (!dbg_dap_cmd_send(buf, 5)) {
+				end = issued;
+				res = 1;
+				break;
+			}
+			dap_pipeline_push(&pipeline, transfer);
+			issued += transfer;
+			tar_issued = false;
+		}
+		if (!pipeline.count)
+			break;
+
+		const size_t transfer = dap_pipeline_pop(&pipeline);
+		bool failed;
+		if (!transfer)
+			failed = dap_pipeline_tar_response(&line_reset);
+		else {
+			dbg_dap_cmd_recv(ID_DAP_TRANSFER_BLOCK, buf, 1023);
+			failed = dap_read_block_response(buf, (uint8_t *)dest + done, src + done, transfer, align, &line_reset);
+			done += transfer;
+		}
+		if (failed) {
+			/* Stop issuing, but collect what is still outstanding */
+			res = 1;
+			end = issued;
+		}
+	}
+	if (line_reset)
+		dap_line_reset();
+	return res;
 }
 
+/* Lay out the data words of a DAP_TransferBlock write, moving sub-word data into its byte lane */
+static void dap_write_block_data(uint8_t *const buf, uint32_t dest, const uint8_t *const data,
+	const size_t len, const enum align align)
+{
+	if (align > ALIGN_HALFWORD) {
+		memcpy(buf, data, len);
+		return;
+	}
+	uint8_t *p = buf;
+	for (size_t i = 0; i < (len >> align); ++i) {
+		uint32_t value;
+		if (align == ALIGN_BYTE)
+			value = ((uint32_t)data[i]) << ((dest & 3) << 3);
+		else {
+			uint16_t halfword;
+			memcpy(&halfword, data + (i << 1U), sizeof(halfword));
+			value = ((uint32_t)halfword) << ((dest & 2) << 3);
+		}
+		memcpy(p, &value, sizeof(value));
+		p += 4;
+		dest += (1 << align);
+	}
+}
+
+/* Write len bytes to dest, CSW and TAR having been set up for dest already */
 unsigned int dap_write_block(ADIv5_AP_t *ap, uint32_t dest, const void *src,
 							 size_t len, enum align align)
 {
+	const size_t words = dap_block_words(5U);
+	const uint8_t dap_index = ap->dp->dp_jd_index;
+	dap_pipeline_s pipeline;
+	dap_pipeline_init(&pipeline);
+	size_t end = len;
+	size_t issued = 0;
+	bool tar_issued = false;
+	unsigned int res = 0;
+	bool line_reset = false;
 	uint8_t buf[1024];
-	unsigned int sz = len >> align;
-	uint8_t dap_index = 0;
-	dap_index = ap->dp->dp_jd_index;
-    buf[0] = ID_DAP_TRANSFER_BLOCK;
-    buf[1] = dap_index;
-    buf[2] =  sz & 0xff;
-    buf[3] = (sz >> 8) & 0xff;
-    buf[4] = SWD_AP_DRW;
-	if (align > ALIGN_HALFWORD)
-		memcpy(&buf[5], src, len);
-	else {
-		unsigned int size = len;
-		uint32_t *p = (uint32_t *)&buf[5];
-		while (size) {
-			uint32_t tmp = 0;
-			/* Pack data into correct data lane */
-			if (align == ALIGN_BYTE) {
-				tmp = ((uint32_t)*(uint8_t  *)src) << ((dest & 3) << 3);
-			} else {
-				tmp = ((uint32_t)*(uint16_t *)src) << ((dest & 2) << 3);
+
+	while (true) {
+		while (issued < end && !dap_pipeline_full(&pipeline)) {
+			const uint32_t addr = dest + issued;
+			if (issued && !(addr & 0x3ffU) && !tar_issued) {
+				if (!dap_pipeline_tar(&pipeline, dap_index, addr)) {
+					end = issued;
+					res = 1;
+					break;
+				}
+				tar_issued = true;
+				continue;
+			}
+			const size_t transfer = dap_block_length(addr, end - issued, words, align);
+			const unsigned int sz = transfer >> align;
+			buf[0] = ID_DAP_TRANSFER_BLOCK;
+			buf[1] = dap_index;
+			buf[2] = sz & 0xff;
+			buf[3] = (sz >> 8) & 0xff;
+			buf[4] = SWD_AP_DRW;
+			dap_write_block_data(&buf[5], addr, (const uint8_t *)src + issued, transfer, align);
+			if (!dbg_dap_cmd_send(buf, 5 + (sz << 2U))) {
+				end = issued;
+				res = 1;
+				break;
 			}
-			src = src + (1 << align);
-			dest += (1 << align);
-			size--;
-			*p++ = tmp;
+			dap_pipeline_push(&pipeline, transfer);
+			issued += transfer;
+			tar_issued = false;
+		}
+		if (!pipeline.count)
+			break;
+
+		bool failed;
+		if (!dap_pipeline_pop(&pipeline))
+			failed = dap_pipeline_tar_response(&line_reset);
+		else {
+			dbg_dap_cmd_recv(ID_DAP_TRANSFER_BLOCK, buf, 1023);
+			if (buf[2] > DAP_TRANSFER_FAULT)
+				line_reset = true;
+			failed = buf[2] > DAP_TRANSFER_WAIT;
+		}
+		if (failed) {
+			res = 1;
+			end = issued;
 		}
 	}
-	dbg_dap_cmd(buf, 1023, 5 + (sz << 2U));
-	if (buf[2] > DAP_TRANSFER_FAULT) {
+	if (line_reset)
 		dap_line_reset();
-	}
-	return (buf[2] > DAP_TRANSFER_WAIT) ? 1 : 0;
+	return res;
 }
 
 //-----------------------------------------------------------------------------
@@ -503,16 +814,21 @@ void dap_reset_link(bool jtag)
 		*p++ = 0x00;
 		buf[1] = (p - buf + 2) * 8;
 	}
-	dbg_dap_cmd(buf, sizeof(buf), p - buf);
+	dap_batch_begin();
+	dap_batch_add(buf, p - buf, 2U);
 
 	if (!jtag) {
 		//-------------
-		buf[0] = ID_DAP_TRANSFER;
-		buf[1] = 0; // DAP index
-		buf[2] = 1; // Request size
-		buf[3] = SWD_DP_R_IDCODE | DAP_TRANSFER_RnW;
-		dbg_dap_cmd(buf, sizeof(buf), 4);
+		/* The IDCODE read that completes the line reset goes in the same exchange */
+		const uint8_t idcode[] = {
+			ID_DAP_TRANSFER,
+			0, // DAP index
+			1, // Request size
+			SWD_DP_R_IDCODE | DAP_TRANSFER_RnW,
+		};
+		dap_batch_add(idcode, sizeof(idcode), 7U);
 	}
+	dap_batch_run(buf, sizeof(buf));
 }
 
 //-----------------------------------------------------------------------------
@@ -539,6 +855,8 @@ static uint8_t *mem_access_setup(ADIv5_AP_t *ap, uint8_t *p,
 	}
 	uint8_t dap_index = 0;
 	dap_index = ap->dp->dp_jd_index;
+	/* SELECT, CSW and TAR are rewritten here behind the generic cache */
+	adiv5_dp_cache_invalidate(ap->dp);
 	*p++ = ID_DAP_TRANSFER;
 	*p++ = dap_index;
 	*p++ = 3; /* Nr transfers */
@@ -570,6 +888,7 @@ void dap_ap_mem_access_setup(ADIv5_AP_t *ap, uint32_t addr, enum align align)
 uint32_t dap_ap_read(ADIv5_AP_t *ap, uint16_t addr)
 {
 	DEBUG_PROBE("dap_ap_read_start addr %x\n", addr);
+	adiv5_dp_cache_invalidate(ap->dp);
 	uint8_t buf[63], *p = buf;
 	buf[0] = ID_DAP_TRANSFER;
 	uint8_t dap_index = 0;
@@ -584,7 +903,7 @@ uint32_t dap_ap_read(ADIv5_AP_t *ap, uint16_t addr)
 	*p++ = ap->apsel & 0xff;
 	*p++ = (addr & 0x0c) | DAP_TRANSFER_RnW  |
 		((addr & 0x100) ?  DAP_TRANSFER_APnDP : 0);
-	uint32_t res = wait_word(buf, 63, p - buf, &ap->dp->fault);
+	uint32_t res = wait_word(buf, 63, p - buf, ap->dp);
 	if ((buf[0] != 2) || (buf[1] != 1)) {
 		DEBUG_WARN("dap_ap_read error %x\n", buf[1]);
 	}
@@ -594,6 +913,7 @@ uint32_t dap_ap_read(ADIv5_AP_t *ap, uint16_t addr)
 void dap_ap_write(ADIv5_AP_t *ap, uint16_t addr, uint32_t value)
 {
 	DEBUG_PROBE("dap_ap_write addr %04x value %08x\n", addr, value);
+	adiv5_dp_cache_invalidate(ap->dp);
 	uint8_t buf[63], *p = buf;
 	uint8_t dap_index = 0;
 	dap_index = ap->dp->dp_jd_index;
@@ -623,7 +943,7 @@ void dap_read_single(ADIv5_AP_t *ap, void *dest, uint32_t src, enum align align)
 	*p++ = SWD_AP_DRW | DAP_TRANSFER_RnW;
 	*p++ = SWD_DP_R_RDBUFF | DAP_TRANSFER_RnW;
 	buf[2] = 5;
-	uint32_t tmp = wait_word(buf, 63, p - buf, &ap->dp->fault);
+	uint32_t tmp = wait_word(buf, 63, p - buf, ap->dp);
 	dest = extract(dest, src, tmp, align);
 }
 
@@ -655,92 +975,248 @@ void dap_write_single(ADIv5_AP_t *ap, uint32_t dest, const void *src,
 	dbg_dap_cmd(buf, sizeof(buf), p - buf);
 }
 
+/*
+ * A transfer inside one TAR auto-increment block that fits a single report:
+ * CSW/TAR setup and the block read go out as one batch, so one USB round trip.
+ * Returns -1 when it does not fit and the caller has to take the long way.
+ */
+int dap_read_block_batched(ADIv5_AP_t *ap, void *dest, uint32_t src, size_t len, enum align align)
+{
+	uint8_t cmd[64];
+	const unsigned int sz = len >> align;
+	dap_batch_begin();
+	const uint8_t *p = mem_access_setup(ap, cmd, src, align);
+	const int setup = dap_batch_add(cmd, p - cmd, 3U);
+	cmd[0] = ID_DAP_TRANSFER_BLOCK;
+	cmd[1] = ap->dp->dp_jd_index;
+	cmd[2] = sz & 0xff;
+	cmd[3] = (sz >> 8) & 0xff;
+	cmd[4] = SWD_AP_DRW | DAP_TRANSFER_RnW;
+	const int block = dap_batch_add(cmd, 5U, 4U + (sz << 2U));
+	if (setup < 0 || block < 0)
+		return -1;
+
+	uint8_t response[1024];
+	if (!dap_batch_run(response, sizeof(response)))
+		return 1;
+	bool line_reset = false;
+	const unsigned int res = dap_read_block_response(response + block + 1, dest, src, len, align, &line_reset);
+	if (line_reset)
+		dap_line_reset();
+	return res;
+}
+
+/* Setup, block write and the RDBUFF read that makes sure it completed, all in one batch */
+int dap_write_block_batched(ADIv5_AP_t *ap, uint32_t dest, const void *src, size_t len, enum align align)
+{
+	uint8_t cmd[1024];
+	const unsigned int sz = len >> align;
+	if (5U + (sz << 2U) > sizeof(cmd))
+		return -1;
+	dap_batch_begin();
+	const uint8_t *p = mem_access_setup(ap, cmd, dest, align);
+	const int setup = dap_batch_add(cmd, p - cmd, 3U);
+	cmd[0] = ID_DAP_TRANSFER_BLOCK;
+	cmd[1] = ap->dp->dp_jd_index;
+	cmd[2] = sz & 0xff;
+	cmd[3] = (sz >> 8) & 0xff;
+	cmd[4] = SWD_AP_DRW;
+	dap_write_block_data(&cmd[5], dest, src, len, align);
+	const int block = dap_batch_add(cmd, 5U + (sz << 2U), 4U);
+	cmd[0] = ID_DAP_TRANSFER;
+	cmd[1] = ap->dp->dp_jd_index;
+	cmd[2] = 1;
+	cmd[3] = SWD_DP_R_RDBUFF | DAP_TRANSFER_RnW;
+	const int rdbuff = dap_batch_add(cmd, 4U, 7U);
+	if (setup < 0 || block < 0 || rdbuff < 0)
+		return -1;
+
+	uint8_t response[1024];
+	if (!dap_batch_run(response, sizeof(response)))
+		return 1;
+	const uint8_t ack = response[block + 3];
+	if (ack > DAP_TRANSFER_FAULT)
+		dap_line_reset();
+	return ack > DAP_TRANSFER_WAIT ? 1 : 0;
+}
+
+/* Deferred transfers, collected into one ID_DAP_TRANSFER command */
+#define DAP_QUEUE_SIZE 512U
+
+static uint8_t dap_queue_buf[DAP_QUEUE_SIZE];
+static size_t dap_queue_len = 3U;
+static size_t dap_queue_transfers;
+static uint32_t *dap_queue_results[DAP_QUEUE_SIZE / 4U];
+static size_t dap_queue_reads;
+static bool dap_queue_failed;
+
+static size_t dap_queue_limit(void)
+{
+	const size_t report_size = (size_t)dbg_get_report_size() - 1U;
+	return MIN(report_size, DAP_QUEUE_SIZE);
+}
+
+static void dap_queue_append(uint16_t addr, bool RnW, uint32_t value, uint32_t *result)
+{
+	uint8_t *p = dap_queue_buf + dap_queue_len;
+	*p++ = (addr & 0x0c) | (RnW ? DAP_TRANSFER_RnW : 0) | ((addr & ADIV5_APnDP) ? DAP_TRANSFER_APnDP : 0);
+	if (RnW)
+		dap_queue_results[dap_queue_reads++] = result;
+	else {
+		*p++ = (value >> 0) & 0xff;
+		*p++ = (value >> 8) & 0xff;
+		*p++ = (value >> 16) & 0xff;
+		*p++ = (value >> 24) & 0xff;
+	}
+	dap_queue_len = p - dap_queue_buf;
+	++dap_queue_transfers;
+}
+
+/* Send the collected transfers, returns true if the probe did not complete all of them */
+static bool dap_queue_send(ADIv5_DP_t *dp)
+{
+	if (!dap_queue_transfers)
+		return false;
+	const size_t transfers = dap_queue_transfers;
+	dap_queue_buf[0] = ID_DAP_TRANSFER;
+	dap_queue_buf[1] = dp->dp_jd_index;
+	dap_queue_buf[2] = transfers;
+	dbg_dap_cmd(dap_queue_buf, sizeof(dap_queue_buf), dap_queue_len);
+	const bool failed = dap_queue_buf[0] != transfers || dap_queue_buf[1] != DAP_TRANSFER_OK;
+	for (size_t i = 0; i < dap_queue_reads; ++i) {
+		const uint8_t *data = dap_queue_buf + 2U + i * 4U;
+		*dap_queue_results[i] = failed ? 0 :
+			((uint32_t)data[3] << 24) | ((uint32_t)data[2] << 16) | ((uint32_t)data[1] << 8) | data[0];
+	}
+	if (failed) {
+		DEBUG_WARN("dap_queue_send %zu of %zu transfers done, ack %x\n", (size_t)dap_queue_buf[0], transfers,
+			dap_queue_buf[1]);
+		dp->fault = 1;
+		if (dap_queue_buf[1] == DAP_TRANSFER_ERROR)
+			dap_line_reset();
+	}
+	dap_queue_len = 3U;
+	dap_queue_transfers = 0;
+	dap_queue_reads = 0;
+	return failed;
+}
+
+/* Make sure there is room for one more transfer, keeping space for the CTRL/STAT read on flush */
+static void dap_queue_reserve(ADIv5_DP_t *dp, bool RnW)
+{
+	const size_t limit = dap_queue_limit();
+	if (dap_queue_transfers + 2U > 255U || dap_queue_len + (RnW ? 1U : 5U) + 1U > limit ||
+		3U + (dap_queue_reads + (RnW ? 2U : 1U)) * 4U > limit)
+		dap_queue_failed |= dap_queue_send(dp);
+}
+
+void dap_queue_read(ADIv5_DP_t *dp, uint16_t addr, uint32_t *result)
+{
+	dap_queue_reserve(dp, true);
+	dap_queue_append(addr, true, 0, result);
+}
+
+void dap_queue_write(ADIv5_DP_t *dp, uint16_t addr, uint32_t value)
+{
+	dap_queue_reserve(dp, false);
+	dap_queue_append(addr, false, value, NULL);
+}
+
+bool dap_queue_flush(ADIv5_DP_t *dp)
+{
+	uint32_t ctrlstat = 0;
+	dap_queue_append(ADIV5_DP_CTRLSTAT, true, 0, &ctrlstat);
+	bool failed = dap_queue_send(dp) | dap_queue_failed;
+	dap_queue_failed = false;
+	if (ctrlstat & (ADIV5_DP_CTRLSTAT_STICKYORUN | ADIV5_DP_CTRLSTAT_STICKYCMP | ADIV5_DP_CTRLSTAT_STICKYERR |
+					   ADIV5_DP_CTRLSTAT_WDATAERR))
+		failed = true;
+	if (failed)
+		adiv5_dp_error(dp);
+	return failed;
+}
+
+/* Most clock cycles one DAP_JTAG_Sequence sequence takes, and most sequences in one command */
+#define DAP_JTAG_SEQUENCE_MAX_CYCLES 64U
+#define DAP_JTAG_SEQUENCES_MAX       255U
+
+static bool dap_bit(const uint8_t *const data, const size_t bit)
+{
+	return data[bit >> 3U] & (1U << (bit & 7U));
+}
+
+static void dap_bit_set(uint8_t *const data, const size_t bit, const bool value)
+{
+	if (value)
+		data[bit >> 3U] |= 1U << (bit & 7U);
+	else
+		data[bit >> 3U] &= ~(1U << (bit & 7U));
+}
+
+/* TMS for a cycle: from tms if given, otherwise high on the last cycle only when final_tms asks for it */
+static bool dap_jtag_tms(const uint8_t *const tms, const bool final_tms, const size_t cycle, const size_t cycles)
+{
+	if (tms)
+		return dap_bit(tms, cycle);
+	return final_tms && cycle == cycles - 1U;
+}
+
+/*
+ * Each run of cycles with the same TMS, up to 64 long, is one sequence of a
+ * DAP_JTAG_Sequence command, and a command takes as many as fit both its
+ * request and the TDO in its response in a report. So a long scan with its
+ * final TMS cycle is a handful of exchanges rather than one per 64 cycles
+ * and another for the last. TDI is held high without data_in.
+ */
 void dap_jtagtap_tdi_tdo_seq(
 	uint8_t *data_out, bool const final_tms, const uint8_t *tms, const uint8_t *data_in, size_t ticks)
 {
-	DEBUG_PROBE("dap_jtagtap_tdi_tdo_seq %s %d ticks\n", final_tms ? "final" : "", ticks);
-	uint8_t buf[64];
-	const uint8_t *din = data_in;
-	uint8_t *dout = data_out;
-	if (!tms) {
-		int last_byte = last_byte = (ticks - 1) >> 3;
-		int last_bit = (ticks - 1) & 7;
-		if (final_tms)
-			ticks--;
-		while (ticks) {
-			int transfers = ticks;
-			if (transfers > 64)
-				transfers = 64;
-			uint8_t *p = buf;
-			*p++ = ID_DAP_JTAG_SEQUENCE;
-			*p++ = 1;
-			*p++ = ((transfers == 64) ? 0 : transfers) | ((data_out) ? DAP_JTAG_TDO_CAPTURE : 0);
-			int n_di_bytes = (transfers + 7) >> 3;
-			if (din) {
-				p = memcpy(p, din, n_di_bytes);
-				din += n_di_bytes;
-			} else {
-				p = memset(p, 0xff, n_di_bytes);
-			}
-			p += n_di_bytes;
-			dbg_dap_cmd(buf, sizeof(buf), p - buf);
-			if (buf[0] != DAP_OK)
-				DEBUG_WARN("dap_jtagtap_tdi_tdo_seq failed %02x\n", buf[0]);
-			if (dout) {
-				memcpy(dout, &buf[1], (transfers + 7) >> 3);
-				dout += (transfers + 7) >> 3;
-			}
-			ticks -= transfers;
-		}
-		if (final_tms) {
-			uint8_t *p = buf;
-			*p++ = ID_DAP_JTAG_SEQUENCE;
-			*p++ = 1;
-			*p++ = 1 | ((dout) ? DAP_JTAG_TDO_CAPTURE : 0) | DAP_JTAG_TMS;
-			if (din) {
-				*p++ = ((data_in[last_byte] & (1 << last_bit)) ? 1 : 0);
-			} else {
-				*p++ = 0;
-			}
-			dbg_dap_cmd(buf, sizeof(buf), p - buf);
-			if (buf[0] == DAP_ERROR)
-				DEBUG_WARN("dap_jtagtap_tdi_tdo_seq failed %02x\n", buf[0]);
-			if (dout) {
-				if (buf[1] & 1)
-					data_out[last_byte] |= (1 << last_bit);
-				else
-					data_out[last_byte] &= ~(1 << last_bit);
+	DEBUG_PROBE("dap_jtagtap_tdi_tdo_seq %s %zu ticks\n", final_tms ? "final" : "", ticks);
+	const size_t limit = MIN((size_t)dbg_get_report_size() - 1U, 1024U);
+	uint8_t buf[1024];
+	uint8_t lengths[DAP_JTAG_SEQUENCES_MAX];
+	for (size_t cycle = 0; cycle < ticks;) {
+		const size_t first_cycle = cycle;
+		size_t request = 2;
+		size_t response = 1;
+		size_t sequences = 0;
+		while (cycle < ticks && sequences < DAP_JTAG_SEQUENCES_MAX) {
+			const bool tms_state = dap_jtag_tms(tms, final_tms, cycle, ticks);
+			size_t length = 1;
+			while (length < DAP_JTAG_SEQUENCE_MAX_CYCLES && cycle + length < ticks &&
+				dap_jtag_tms(tms, final_tms, cycle + length, ticks) == tms_state)
+				++length;
+			const size_t bytes = (length + 7U) >> 3U;
+			if (request + 1U + bytes > limit || (data_out && response + bytes > limit))
+				break;
+			buf[request++] = (length == DAP_JTAG_SEQUENCE_MAX_CYCLES ? 0U : length) |
+				(tms_state ? DAP_JTAG_TMS : 0U) | (data_out ? DAP_JTAG_TDO_CAPTURE : 0U);
+			memset(buf + request, 0xff, bytes);
+			if (data_in) {
+				for (size_t i = 0; i < length; ++i)
+					dap_bit_set(buf + request, i, dap_bit(data_in, cycle + i));
 			}
+			request += bytes;
+			if (data_out)
+				response += bytes;
+			lengths[sequences++] = (uint8_t)length;
+			cycle += length;
 		}
-	} else {
-		while (ticks) {
-			uint8_t *p = buf;
-			int transfers = ticks;
-			if (transfers > 64)
-				transfers = 64;
-			p = buf;
-			*p++ = ID_DAP_JTAG_SEQUENCE;
-			*p++ = transfers;
-			for (int i = 0; i < transfers; i++) {
-				*p++ =
-					1 | ((data_out) ? DAP_JTAG_TDO_CAPTURE : 0) | ((tms[i >> 3] & (1 << (i & 7))) ? DAP_JTAG_TMS : 0);
-				if (data_in)
-					*p++ = (data_in[i >> 3] & (1 << (i & 7))) ? 1 : 0;
-				else
-					*p++ = 1;
-			}
-			dbg_dap_cmd(buf, sizeof(buf), p - buf);
-			if (buf[0] == DAP_ERROR)
-				DEBUG_WARN("dap_jtagtap_tdi_tdo_seq failed %02x\n", buf[0]);
-			if (data_out) {
-				for (int i = 0; i < transfers; i++) {
-					if (buf[i + 1])
-						data_out[i >> 3] |= (1 << (i & 7));
-					else
-						data_out[i >> 3] &= ~(1 << (i & 7));
-				}
-			}
-			ticks -= transfers;
+		buf[0] = ID_DAP_JTAG_SEQUENCE;
+		buf[1] = (uint8_t)sequences;
+		dbg_dap_cmd(buf, sizeof(buf), (int)request);
+		if (buf[0] != DAP_OK)
+			DEBUG_WARN("dap_jtagtap_tdi_tdo_seq failed %02x\n", buf[0]);
+		if (!data_out)
+			continue;
+		/* Each sequence's TDO starts on a byte of its own in the response */
+		size_t offset = 1;
+		size_t out_cycle = first_cycle;
+		for (size_t i = 0; i < sequences; ++i) {
+			for (size_t j = 0; j < lengths[i]; ++j)
+				dap_bit_set(data_out, out_cycle + j, dap_bit(buf + offset, j));
+			offset += (lengths[i] + 7U) >> 3U;
+			out_cycle += lengths[i];
 		}
 	}
 }
@@ -58,10 +58,13 @@ typedef enum dap_cap_e {
 	DAP_CAP_SWO_STREAMING = (1 << 6),
 } dap_cap_t;
 
+extern uint8_t dap_caps;
+
 void dap_led(int index, int state);
 void dap_connect(bool jtag);
 void dap_disconnect(void);
 void dap_transfer_configure(uint8_t idle, uint16_t count, uint16_t retry);
+void dap_retry_configure(ADIv5_DP_t *dp);
 void dap_swd_configure(uint8_t cfg);
 size_t dap_info(dap_info_t info, uint8_t *data, size_t size);
 void dap_reset_target(void);
@@ -75,12 +78,24 @@ void dap_reset_link(bool jtag);
 uint32_t dap_read_idcode(ADIv5_DP_t *dp);
 unsigned int dap_read_block(ADIv5_AP_t *ap, void *dest, uint32_t src, size_t len, enum align align);
 unsigned int dap_write_block(ADIv5_AP_t *ap, uint32_t dest, const void *src, size_t len, enum align align);
+int dap_read_block_batched(ADIv5_AP_t *ap, void *dest, uint32_t src, size_t len, enum align align);
+int dap_write_block_batched(ADIv5_AP_t *ap, uint32_t dest, const void *src, size_t len, enum align align);
+void dap_batch_begin(void);
+int dap_batch_add(const uint8_t *command, size_t length, size_t response_length);
+bool dap_batch_run(uint8_t *response, size_t size);
 void dap_ap_mem_access_setup(ADIv5_AP_t *ap, uint32_t addr, enum align align);
 uint32_t dap_ap_read(ADIv5_AP_t *ap, uint16_t addr);
 void dap_ap_write(ADIv5_AP_t *ap, uint16_t addr, uint32_t value);
 void dap_read_single(ADIv5_AP_t *ap, void *dest, uint32_t src, enum align align);
 void dap_write_single(ADIv5_AP_t *ap, uint32_t dest, const void *src, enum align align);
 int dbg_dap_cmd(uint8_t *data, int size, int rsize);
+int dbg_get_report_size(void);
+size_t dbg_dap_packet_count(void);
+bool dbg_dap_cmd_send(const uint8_t *data, int rsize);
+int dbg_dap_cmd_recv(uint8_t cmd, uint8_t *data, int size);
+void dap_queue_read(ADIv5_DP_t *dp, uint16_t addr, uint32_t *result);
+void dap_queue_write(ADIv5_DP_t *dp, uint16_t addr, uint32_t value);
+bool dap_queue_flush(ADIv5_DP_t *dp);
 void dap_jtagtap_tdi_tdo_seq(uint8_t *data_out, bool final_tms, const uint8_t *tms, const uint8_t *data_in, size_t clock_cycles);
 int dap_jtag_configure(void);
 void dap_swdptap_seq_out(uint32_t tms_states, size_t clock_cycles);
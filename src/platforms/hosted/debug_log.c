@@ -0,0 +1,106 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The DEBUG_* output. Each message is formatted by the caller straight into
+ * an io_sink ring that a thread of its own writes to stderr, instead of going
+ * through an unbuffered stderr write per call, which with -v wire and GDB
+ * output on slowed the session to the pace of the terminal. Warnings share the
+ * ring, so everything stays in the order it was logged. With stdout chosen for
+ * the info output that goes to the shared stdout sink instead.
+ *
+ * The sink takes a single producer, while warnings come from other threads
+ * too, so producers take a lock. When the ring is full the caller waits: debug
+ * output is for reading afterwards, and losing any of it would be worse.
+ */
+
+#include "general.h"
+#include "io_sink.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+#define DEBUG_LOG_RING_SIZE (1024U * 1024U)
+#define DEBUG_LOG_LINE_SIZE 512U
+
+static pthread_mutex_t debug_log_lock = PTHREAD_MUTEX_INITIALIZER;
+static io_sink_s *debug_log_sink;
+/* Once the sink is closed, or if it can't be opened, write directly */
+static bool debug_log_direct;
+/* Set while this thread is in debug_log, a warning from opening a sink is written directly */
+static _Thread_local bool debug_log_busy;
+
+static io_sink_s *debug_log_stderr(void)
+{
+	if (!debug_log_sink && !debug_log_direct) {
+		fflush(stderr);
+		debug_log_sink = io_sink_open(STDERR_FILENO, false, DEBUG_LOG_RING_SIZE);
+		debug_log_direct = !debug_log_sink;
+		/* However the program ends up exiting, what was logged before then gets written out */
+		if (debug_log_sink)
+			atexit(debug_log_close);
+	}
+	return debug_log_sink;
+}
+
+void debug_log(const int level, const char *const format, ...)
+{
+	char line[DEBUG_LOG_LINE_SIZE];
+	char *text = line;
+	va_list ap;
+	va_start(ap, format);
+	int len = vsnprintf(line, sizeof(line), format, ap);
+	va_end(ap);
+	if (len < 0)
+		return;
+	if ((size_t)len >= sizeof(line)) {
+		text = malloc((size_t)len + 1U);
+		if (!text)
+			return;
+		va_start(ap, format);
+		len = vsnprintf(text, (size_t)len + 1U, format, ap);
+		va_end(ap);
+	}
+
+	const bool to_stdout = level == BMP_DEBUG_INFO && (cl_debuglevel & BMP_DEBUG_STDOUT);
+	FILE *const file = to_stdout ? stdout : stderr;
+	if (debug_log_busy) {
+		fwrite(text, 1, (size_t)len, file);
+		fflush(file);
+	} else {
+		debug_log_busy = true;
+		pthread_mutex_lock(&debug_log_lock);
+		io_sink_s *const sink = to_stdout ? io_sink_stdout() : debug_log_stderr();
+		if (!sink || !io_sink_write_all(sink, text, (size_t)len)) {
+			fwrite(text, 1, (size_t)len, file);
+			fflush(file);
+		}
+		pthread_mutex_unlock(&debug_log_lock);
+		debug_log_busy = false;
+	}
+	if (text != line)
+		free(text);
+}
+
+void debug_log_close(void)
+{
+	pthread_mutex_lock(&debug_log_lock);
+	io_sink_close(debug_log_sink, true);
+	debug_log_sink = NULL;
+	debug_log_direct = true;
+	pthread_mutex_unlock(&debug_log_lock);
+}
@@ -0,0 +1,251 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Per probe and target record of what was last flashed from the command line,
+ * so flashing the same image again only touches the blocks that changed without
+ * even asking the target for their CRCs.
+ *
+ * The file is named after the probe serial and the target's identification, and
+ * holds one "address hash" line per flash block. The target has no generic way
+ * to read a device UID, so a board swapped onto the same probe is caught by the
+ * sample read each skipped block gets instead.
+ */
+
+#include "general.h"
+#include "target_internal.h"
+#include "flash_cache.h"
+
+#include <ctype.h>
+#include <errno.h>
+
+#define FLASH_CACHE_MAGIC       "bmp-flash-cache 1"
+#define FLASH_CACHE_SAMPLE_SIZE 32U
+
+/* 64 bit FNV-1a, plenty to tell flash images apart */
+static uint64_t flash_cache_hash(uint64_t hash, const uint8_t *data, size_t size)
+{
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= data[i];
+		hash *= UINT64_C(0x100000001b3);
+	}
+	return hash;
+}
+
+#define FLASH_CACHE_HASH_INIT UINT64_C(0xcbf29ce484222325)
+
+static char *flash_cache_target_key(target *t)
+{
+	char key[128];
+	snprintf(key, sizeof(key), "%s %04x %04x %08" PRIx32, t->driver, t->designer_code, t->part_id, t->cpuid);
+	return strdup(key);
+}
+
+bool flash_cache_open(flash_cache_s *cache, const char *dir, const char *serial, target *t)
+{
+	memset(cache, 0, sizeof(*cache));
+	char name[96];
+	size_t len = 0;
+	/* Keep the file name portable whatever the serial and driver name hold */
+	for (const char *p = serial; *p && len < 48U; ++p)
+		name[len++] = isalnum((unsigned char)*p) ? *p : '_';
+	snprintf(name + len, sizeof(name) - len, "-%04x-%04x-%08" PRIx32 ".cache", t->designer_code, t->part_id,
+		t->cpuid);
+	const size_t path_size = strlen(dir) + strlen(name) + 2U;
+	cache->path = malloc(path_size);
+	cache->key = flash_cache_target_key(t);
+	if (!cache->path || !cache->key) {
+		flash_cache_free(cache);
+		return false;
+	}
+	snprintf(cache->path, path_size, "%s/%s", dir, name);
+
+	FILE *file = fopen(cache->path, "r");
+	if (!file) {
+		if (errno == ENOENT)
+			return true;
+		DEBUG_WARN("Can not open flash cache %s: %s\n", cache->path, strerror(errno));
+		flash_cache_free(cache);
+		return false;
+	}
+	char line[160];
+	/* The header has to name this target, anything else is ignored rather than trusted */
+	bool valid = fgets(line, sizeof(line), file) && !strncmp(line, FLASH_CACHE_MAGIC " ", strlen(FLASH_CACHE_MAGIC) + 1U);
+	if (valid) {
+		line[strcspn(line, "\r\n")] = '\0';
+		valid = !strcmp(line + strlen(FLASH_CACHE_MAGIC) + 1U, cache->key);
+	}
+	while (valid && fgets(line, sizeof(line), file)) {
+		uint32_t addr;
+		uint64_t hash;
+		if (sscanf(line, "%" SCNx32 " %" SCNx64, &addr, &hash) != 2)
+			continue;
+		flash_cache_entry_s *entries = realloc(cache->entries, (cache->count + 1U) * sizeof(*entries));
+		if (!entries)
+			break;
+		cache->entries = entries;
+		entries[cache->count].addr = addr;
+		entries[cache->count].hash = hash;
+		++cache->count;
+	}
+	if (!valid)
+		DEBUG_INFO("Flash cache %s is for another target, ignoring it\n", cache->path);
+	fclose(file);
+	return true;
+}
+
+static flash_cache_entry_s *flash_cache_find(flash_cache_s *cache, uint32_t addr)
+{
+	for (size_t i = 0; i < cache->count; ++i) {
+		if (cache->entries[i].addr == addr)
+			return &cache->entries[i];
+	}
+	return NULL;
+}
+
+static flash_cache_block_s *flash_cache_add_block(flash_cache_s *cache, uint32_t addr, size_t size)
+{
+	flash_cache_block_s *blocks = realloc(cache->blocks, (cache->block_count + 1U) * sizeof(*blocks));
+	if (!blocks)
+		return NULL;
+	cache->blocks = blocks;
+	flash_cache_block_s *block = &blocks[cache->block_count++];
+	memset(block, 0, sizeof(*block));
+	block->addr = addr;
+	block->size = size;
+	return block;
+}
+
+/* Fills buffer with what the block at addr holds once the image is flashed */
+static void flash_cache_block_content(
+	const image_s *image, uint32_t addr, size_t size, uint8_t erased, uint8_t *buffer)
+{
+	memset(buffer, erased, size);
+	for (size_t i = 0; i < image->count; ++i) {
+		const image_segment_s *segment = &image->segments[i];
+		const uint32_t start = MAX(segment->addr, addr);
+		const uint32_t end = MIN(segment->addr + segment->size, addr + size);
+		if (start < end)
+			memcpy(buffer + (start - addr), segment->data + (start - segment->addr), end - start);
+	}
+}
+
+bool flash_cache_plan(flash_cache_s *cache, target *t, const image_s *image)
+{
+	uint8_t *buffer = NULL;
+	size_t buffer_size = 0;
+	size_t skipped = 0;
+	for (size_t i = 0; i < image->count; ++i) {
+		const image_segment_s *segment = &image->segments[i];
+		const uint32_t end = segment->addr + segment->size;
+		for (uint32_t addr = segment->addr; addr < end;) {
+			target_flash_s *f = target_flash_for_addr(t, addr);
+			if (!f) {
+				/* Not flash, so nothing to remember, it just gets written */
+				if (!flash_cache_add_block(cache, addr, end - addr))
+					goto failed;
+				break;
+			}
+			const uint32_t block_addr = addr & ~(f->blocksize - 1U);
+			addr = block_addr + f->blocksize;
+			/* Segments sharing a block are sorted, so the block was just added */
+			if (cache->block_count && cache->blocks[cache->block_count - 1U].addr == block_addr)
+				continue;
+			flash_cache_block_s *block = flash_cache_add_block(cache, block_addr, f->blocksize);
+			if (!block)
+				goto failed;
+			if (buffer_size < f->blocksize) {
+				uint8_t *resized = realloc(buffer, f->blocksize);
+				if (!resized)
+					goto failed;
+				buffer = resized;
+				buffer_size = f->blocksize;
+			}
+			flash_cache_block_content(image, block_addr, f->blocksize, f->erased, buffer);
+			block->hash = flash_cache_hash(FLASH_CACHE_HASH_INIT, buffer, f->blocksize);
+			block->cacheable = true;
+			const flash_cache_entry_s *entry = flash_cache_find(cache, block_addr);
+			if (!entry || entry->hash != block->hash)
+				continue;
+			uint8_t sample[FLASH_CACHE_SAMPLE_SIZE];
+			const size_t sample_size = MIN(sizeof(sample), f->blocksize);
+			block->unchanged =
+				!target_mem_read(t, sample, block_addr, sample_size) && !memcmp(sample, buffer, sample_size);
+			if (block->unchanged)
+				skipped += f->blocksize;
+			else
+				DEBUG_INFO("Flash cache entry for 0x%08" PRIx32 " is stale\n", block_addr);
+		}
+	}
+	free(buffer);
+	if (skipped)
+		DEBUG_INFO("Flash cache: skipping %zu unchanged bytes\n", skipped);
+	return true;
+
+failed:
+	DEBUG_WARN("malloc: failed in %s\n", __func__);
+	free(buffer);
+	return false;
+}
+
+void flash_cache_discard(const flash_cache_s *cache)
+{
+	if (remove(cache->path) && errno != ENOENT)
+		DEBUG_WARN("Can not remove flash cache %s: %s\n", cache->path, strerror(errno));
+}
+
+bool flash_cache_save(flash_cache_s *cache)
+{
+	for (size_t i = 0; i < cache->block_count; ++i) {
+		const flash_cache_block_s *block = &cache->blocks[i];
+		if (!block->cacheable)
+			continue;
+		flash_cache_entry_s *entry = flash_cache_find(cache, block->addr);
+		if (!entry) {
+			flash_cache_entry_s *entries = realloc(cache->entries, (cache->count + 1U) * sizeof(*entries));
+			if (!entries)
+				return false;
+			cache->entries = entries;
+			entry = &entries[cache->count++];
+			entry->addr = block->addr;
+		}
+		entry->hash = block->hash;
+	}
+
+	FILE *file = fopen(cache->path, "w");
+	if (!file) {
+		DEBUG_WARN("Can not write flash cache %s: %s\n", cache->path, strerror(errno));
+		return false;
+	}
+	fprintf(file, FLASH_CACHE_MAGIC " %s\n", cache->key);
+	for (size_t i = 0; i < cache->count; ++i)
+		fprintf(file, "%08" PRIx32 " %016" PRIx64 "\n", cache->entries[i].addr, cache->entries[i].hash);
+	if (fclose(file)) {
+		DEBUG_WARN("Can not write flash cache %s: %s\n", cache->path, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+void flash_cache_free(flash_cache_s *cache)
+{
+	free(cache->path);
+	free(cache->key);
+	free(cache->entries);
+	free(cache->blocks);
+	memset(cache, 0, sizeof(*cache));
+}
@@ -0,0 +1,70 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PLATFORMS_HOSTED_FLASH_CACHE_H
+#define PLATFORMS_HOSTED_FLASH_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "target.h"
+#include "image.h"
+
+/* One flash block an image touches, with the hash of what it is to hold */
+typedef struct flash_cache_block {
+	uint32_t addr;
+	size_t size;
+	uint64_t hash;
+	bool cacheable;
+	bool unchanged;
+} flash_cache_block_s;
+
+typedef struct flash_cache_entry {
+	uint32_t addr;
+	uint64_t hash;
+} flash_cache_entry_s;
+
+/*
+ * What the command line last wrote to one target through one probe: the hash
+ * of every flash block it programmed, loaded from and saved to a file in the
+ * cache directory, plus the blocks the current image touches.
+ */
+typedef struct flash_cache {
+	char *path;
+	char *key;
+	flash_cache_entry_s *entries;
+	size_t count;
+	flash_cache_block_s *blocks;
+	size_t block_count;
+} flash_cache_s;
+
+/* Loads the cache for this probe and target from dir, a missing file just means an empty cache */
+bool flash_cache_open(flash_cache_s *cache, const char *dir, const char *serial, target *t);
+/*
+ * Splits the image into the flash blocks it touches and marks those the cache
+ * says already hold the right data. A short sample read of each block has to
+ * agree too, so a board erased or reflashed some other way is not skipped.
+ */
+bool flash_cache_plan(flash_cache_s *cache, target *t, const image_s *image);
+/* Removes the file, so if the flashing that follows fails nothing stale is left */
+void flash_cache_discard(const flash_cache_s *cache);
+/* Records the planned blocks as written and saves the cache */
+bool flash_cache_save(flash_cache_s *cache);
+void flash_cache_free(flash_cache_s *cache);
+
+#endif /* PLATFORMS_HOSTED_FLASH_CACHE_H */
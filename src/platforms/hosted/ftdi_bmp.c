@@ -35,6 +35,30 @@ struct ftdi_context *ftdic;
 static uint8_t outbuf[BUF_SIZE];
 static uint16_t bufptr = 0;
 
+/*
+ * TDO read backs queued by libftdi_jtagtap_tdi_tdo_seq() while deferring. The
+ * replies of all of them are fetched with one read at the next sync, so a run
+ * of scans costs a single USB round trip. The limits keep what the FTDI has
+ * to hold on to until then inside the smallest chip buffer.
+ */
+#define READBACK_MAX  64U
+#define READBACK_SIZE 384U
+
+typedef struct libftdi_readback {
+	uint8_t *data_out;
+	/* Reply bytes the shift produces */
+	size_t size;
+	/* Whole bytes shifted, then the bits after them */
+	size_t bytes;
+	uint8_t rticks;
+	bool final_tms;
+} libftdi_readback_s;
+
+static libftdi_readback_s readbacks[READBACK_MAX];
+static size_t readback_count;
+static size_t readback_size;
+static bool readback_defer;
+
 cable_desc_t *active_cable;
 data_desc_t active_state;
 
@@ -597,7 +621,7 @@ size_t libftdi_buffer_write(const uint8_t *data, size_t size)
 {
 	if ((bufptr + size) / BUF_SIZE > 0)
 		libftdi_buffer_flush();
-	DEBUG_WIRE("Write %d bytes:", size);
+	DEBUG_WIRE("Write %zu bytes:", size);
 	for (size_t i = 0; i < size; i++) {
 		DEBUG_WIRE(" %02x", data[i]);
 		if (i && (i & 0xf) == 0xf)
@@ -609,7 +633,7 @@ size_t libftdi_buffer_write(const uint8_t *data, size_t size)
 	return size;
 }
 
-int libftdi_buffer_read(uint8_t *data, int size)
+static void libftdi_read(uint8_t *data, int size)
 {
 #if defined(USE_USB_VERSION_BIT)
 	struct ftdi_transfer_control *tc;
@@ -631,9 +655,52 @@ int libftdi_buffer_read(uint8_t *data, int size)
 			DEBUG_WIRE("\n\t");
 	}
 	DEBUG_WIRE("\n");
+}
+
+int libftdi_buffer_read(uint8_t *data, int size)
+{
+	/* The read backs already queued come first in what the FTDI sends */
+	libftdi_buffer_sync();
+	libftdi_read(data, size);
 	return size;
 }
 
+/* Moves what a shift read from the MPSSE reply into the caller's buffer */
+static void libftdi_tdo_unpack(uint8_t *data_out, const uint8_t *reply, const size_t bytes, const uint8_t rticks,
+	const bool final_tms)
+{
+	memcpy(data_out, reply, bytes);
+	/* Bit mode reads shift in from the top of the byte, the TMS bit lands in bit 7 of its own */
+	if (final_tms) {
+		const uint8_t last = (rticks ? reply[bytes] >> 1U : 0U) | (reply[bytes + (rticks ? 1U : 0U)] & 0x80U);
+		data_out[bytes] = last >> (7U - rticks);
+	} else if (rticks)
+		data_out[bytes] = reply[bytes] >> (8U - rticks);
+}
+
+void libftdi_buffer_defer(const bool defer)
+{
+	if (!defer)
+		libftdi_buffer_sync();
+	readback_defer = defer;
+}
+
+void libftdi_buffer_sync(void)
+{
+	if (!readback_count)
+		return;
+	uint8_t reply[READBACK_SIZE];
+	libftdi_read(reply, (int)readback_size);
+	const uint8_t *res = reply;
+	for (size_t i = 0; i < readback_count; ++i) {
+		const libftdi_readback_s *readback = &readbacks[i];
+		libftdi_tdo_unpack(readback->data_out, res, readback->bytes, readback->rticks, readback->final_tms);
+		res += readback->size;
+	}
+	readback_count = 0;
+	readback_size = 0;
+}
+
 void libftdi_jtagtap_tdi_tdo_seq(uint8_t *DO, const bool final_tms, const uint8_t *DI, size_t ticks)
 {
 	int rsize, rticks;
@@ -643,7 +710,7 @@ void libftdi_jtagtap_tdi_tdo_seq(uint8_t *DO, const bool final_tms, const uint8_
 	if (!DI && !DO)
 		return;
 
-	DEBUG_WIRE("libftdi_jtagtap_tdi_tdo_seq %s ticks: %d\n",
+	DEBUG_WIRE("libftdi_jtagtap_tdi_tdo_seq %s ticks: %zu\n",
 			   (DI && DO) ? "read/write" : ((DI) ? "write" : "read"), ticks);
 	if (final_tms)
 		--ticks;
@@ -679,27 +746,24 @@ void libftdi_jtagtap_tdi_tdo_seq(uint8_t *DO, const bool final_tms, const uint8_
 	}
 	if (index)
 		libftdi_buffer_write(data, index);
-	if (DO) {
-		int index = 0;
-		uint8_t *tmp = alloca(rsize);
-		libftdi_buffer_read(tmp, rsize);
-		if(final_tms) rsize--;
-
-		while (rsize--)
-			*DO++ = tmp[index++];
-		if (rticks == 0)
-			*DO++ = 0;
-
-		if (final_tms) {
-			rticks++;
-			*(--DO) >>= 1;
-			*DO |= tmp[index] & 0x80;
-		} else
-			--DO;
-
-		if (rticks)
-			*DO >>= (8-rticks);
+	if (!DO)
+		return;
+	if (readback_defer && (size_t)rsize <= READBACK_SIZE) {
+		if (readback_count == READBACK_MAX || readback_size + rsize > READBACK_SIZE)
+			libftdi_buffer_sync();
+		readbacks[readback_count++] = (libftdi_readback_s){
+			.data_out = DO,
+			.size = rsize,
+			.bytes = ticks,
+			.rticks = rticks,
+			.final_tms = final_tms,
+		};
+		readback_size += rsize;
+		return;
 	}
+	uint8_t *tmp = alloca(rsize);
+	libftdi_buffer_read(tmp, rsize);
+	libftdi_tdo_unpack(DO, tmp, ticks, rticks, final_tms);
 }
 
 const char *libftdi_target_voltage(void)
@@ -105,9 +105,12 @@ typedef struct cable_desc_s {
 int ftdi_bmp_init(BMP_CL_OPTIONS_t *cl_opts, bmp_info_t *info) { return -1; }
 int libftdi_swdptap_init(ADIv5_DP_t *dp) { return -1; }
 int libftdi_jtagtap_init(jtag_proc_t *jtag_proc) { return 0; }
+int libftdi_jtagdp_init(ADIv5_DP_t *dp) { return 0; }
 void libftdi_buffer_flush(void) { }
 size_t libftdi_buffer_write(const uint8_t *data, size_t size) { return size; }
 int libftdi_buffer_read(uint8_t *data, int size) { return size; }
+void libftdi_buffer_defer(bool defer) { }
+void libftdi_buffer_sync(void) { }
 const char *libftdi_target_voltage(void) { return "ERROR"; }
 void libftdi_jtagtap_tdi_tdo_seq(uint8_t *const data_out, const bool final_tms,
 	const uint8_t *const data_in, const size_t ticks) { }
@@ -127,9 +130,17 @@ extern data_desc_t active_state;
 int ftdi_bmp_init(BMP_CL_OPTIONS_t *cl_opts, bmp_info_t *info);
 int libftdi_swdptap_init(ADIv5_DP_t *dp);
 int libftdi_jtagtap_init(jtag_proc_t *jtag_proc);
+int libftdi_jtagdp_init(ADIv5_DP_t *dp);
 void libftdi_buffer_flush(void);
 size_t libftdi_buffer_write(const uint8_t *data, size_t size);
 int libftdi_buffer_read(uint8_t *data, int size);
+/*
+ * While deferring, libftdi_jtagtap_tdi_tdo_seq() only queues its shifts and
+ * fills the data_out buffers at the next sync, which has to come before they
+ * are looked at. Any other read, and ending the deferral, syncs first.
+ */
+void libftdi_buffer_defer(bool defer);
+void libftdi_buffer_sync(void);
 const char *libftdi_target_voltage(void);
 void libftdi_jtagtap_tdi_tdo_seq(uint8_t *data_out, bool final_tms, const uint8_t *data_in, size_t ticks);
 bool  libftdi_swd_possible(bool *do_mpsse, bool *direct_bb_swd);
@@ -21,6 +21,18 @@
 /* This file implements a transparent channel over which the GDB Remote
  * Serial Debugging protocol is implemented.  This implementation for Linux
  * uses a TCP server on port 2000.
+ *
+ * Several clients may be connected at once. All sockets are non-blocking and
+ * are waited on together with select(), so new connections are accepted while
+ * another client is being served. Clients take turns at packet boundaries: the
+ * client that sent a packet gets the reply, and while a packet is in flight
+ * (or the target is running on its behalf) only that client is read from.
+ * The protocol state in gdb_main is shared by the clients of the main port, so
+ * that is meant for one debugger plus helper tools.
+ *
+ * Independent debug sessions each get a port of their own instead, one per
+ * target after the main port (see gdb_if_listen_targets()). gdb_main keeps
+ * separate state for every port and picks it from gdb_if_session().
  */
 
 #if defined(_WIN32) || defined(__CYGWIN__)
@@ -42,10 +54,115 @@
 #include <unistd.h>
 
 #include "gdb_if.h"
+#include "io_sink.h"
+#include "rtt_if.h"
 
-static int gdb_if_serv, gdb_if_conn;
 #define DEFAULT_PORT 2000
 #define NUM_GDB_SERVER 4
+#define GDB_MAX_CLIENTS 8
+/* The main port and the target ports */
+#define GDB_IF_MAX_PORTS (GDB_IF_MAX_TARGET_PORTS + 1U)
+#define GDB_IF_SINK_SIZE (64U * 1024U)
+
+#if defined(_WIN32) || defined(__CYGWIN__)
+#define GDB_IF_WOULD_BLOCK() (WSAGetLastError() == WSAEWOULDBLOCK)
+#else
+#define GDB_IF_WOULD_BLOCK() (errno == EWOULDBLOCK || errno == EAGAIN)
+#endif
+
+/* Listening sockets by port, the main one first, -1 for one not listened on */
+static int gdb_if_servs[GDB_IF_MAX_PORTS];
+static uint16_t gdb_if_main_port;
+/* Connected clients, -1 for a free slot, and the port each came in on */
+static int gdb_if_clients[GDB_MAX_CLIENTS];
+static uint32_t gdb_if_client_ports[GDB_MAX_CLIENTS];
+/* Not yet reported by gdb_if_session() */
+static bool gdb_if_client_fresh[GDB_MAX_CLIENTS];
+/* Numbers for the clients unique to each connection, as gdb_if_client() hands out */
+static uint32_t gdb_if_client_ids[GDB_MAX_CLIENTS];
+static uint32_t gdb_if_next_id = 1;
+static uint32_t gdb_if_port_count = 1;
+/* Stay with the current client, see gdb_if_pin() */
+static bool gdb_if_pinned;
+/* Replies go out from a thread per client, so one that stops reading can't stall the probe */
+static io_sink_s *gdb_if_sinks[GDB_MAX_CLIENTS];
+/* The client currently being served, replies go here */
+static int gdb_if_conn = -1;
+/* Port of the client last served, kept after it goes so what it left is still its session's */
+static uint32_t gdb_if_conn_port;
+
+/* Packet framing seen on gdb_if_conn, so clients are only switched between packets */
+static bool gdb_if_in_packet;
+static uint8_t gdb_if_checksum_left;
+
+static void gdb_if_set_nonblocking(int fd);
+
+/* Lets replies already queued, such as to a detach or kill, reach the clients */
+static void gdb_if_exit(void)
+{
+	for (size_t i = 0; i < GDB_MAX_CLIENTS; ++i) {
+		io_sink_close(gdb_if_sinks[i], true);
+		gdb_if_sinks[i] = NULL;
+	}
+}
+
+/* Opens a listening socket on port, -1 if that fails */
+static int gdb_if_listen(const uint16_t port)
+{
+	struct sockaddr_in addr;
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	const int serv = socket(PF_INET, SOCK_STREAM, 0);
+	if (serv == -1) {
+		DEBUG_WARN("PF_INET %d\n", serv);
+		return -1;
+	}
+
+	int opt = 1;
+	if (setsockopt(serv, SOL_SOCKET, SO_REUSEADDR, (void*)&opt, sizeof(opt)) == -1) {
+#if defined(_WIN32) || defined(__CYGWIN__)
+		DEBUG_WARN("error setsockopt SOL_SOCKET : %d error: %d\n", serv,
+		WSAGetLastError());
+#else
+		DEBUG_WARN("error setsockopt SOL_SOCKET : %d error: %s\n", serv,
+		strerror(errno));
+#endif
+		close(serv);
+		return -1;
+	}
+	if (setsockopt(serv, IPPROTO_TCP, TCP_NODELAY, (void*)&opt, sizeof(opt)) == -1) {
+#if defined(_WIN32) || defined(__CYGWIN__)
+		DEBUG_WARN("error setsockopt IPPROTO_TCP : %d error: %d\n", serv,
+		WSAGetLastError());
+#else
+		DEBUG_WARN("error setsockopt IPPROTO_TCP : %d error: %s\n", serv,
+		strerror(errno));
+#endif
+		close(serv);
+		return -1;
+	}
+	if (bind(serv, (void*)&addr, sizeof(addr)) == -1) {
+#if defined(_WIN32) || defined(__CYGWIN__)
+		DEBUG_WARN("error when binding socket: %d error: %d\n", serv,
+		WSAGetLastError());
+#else
+		DEBUG_WARN("error when binding socket: %d error: %s\n", serv,
+		strerror(errno));
+#endif
+		close(serv);
+		return -1;
+	}
+	if (listen(serv, GDB_MAX_CLIENTS) == -1) {
+		DEBUG_WARN("listen closed %d\n", serv);
+		close(serv);
+		return -1;
+	}
+	gdb_if_set_nonblocking(serv);
+	return serv;
+}
+
 int gdb_if_init(void)
 {
 #if defined(_WIN32) || defined(__CYGWIN__)
@@ -57,182 +174,336 @@ int gdb_if_init(void)
 		exit(1);
 	}
 #endif
-	struct sockaddr_in addr;
-	int opt;
-	int port = DEFAULT_PORT - 1;
+	for (size_t i = 0; i < GDB_IF_MAX_PORTS; ++i)
+		gdb_if_servs[i] = -1;
+	for (size_t i = 0; i < GDB_MAX_CLIENTS; ++i)
+		gdb_if_clients[i] = -1;
 
-	do {
-		port ++;
+	uint16_t port = DEFAULT_PORT;
+	for (; gdb_if_servs[0] == -1; ++port) {
 		if (port > DEFAULT_PORT + NUM_GDB_SERVER)
-			return - 1;
-		addr.sin_family = AF_INET;
-		addr.sin_port = htons(port);
-		addr.sin_addr.s_addr = htonl(INADDR_ANY);
-
-		gdb_if_serv = socket(PF_INET, SOCK_STREAM, 0);
-		if (gdb_if_serv == -1) {
-			DEBUG_WARN("PF_INET %d\n",gdb_if_serv);
-			continue;
-		}
+			return -1;
+		gdb_if_servs[0] = gdb_if_listen(port);
+	}
+	gdb_if_main_port = port - 1U;
+	DEBUG_WARN("Listening on TCP: %4d\n", gdb_if_main_port);
+	atexit(gdb_if_exit);
+
+	return 0;
+}
 
-		opt = 1;
-		if (setsockopt(gdb_if_serv, SOL_SOCKET, SO_REUSEADDR, (void*)&opt, sizeof(opt)) == -1) {
+void gdb_if_listen_targets(const uint32_t count)
+{
+	gdb_if_port_count = MIN(count, GDB_IF_MAX_TARGET_PORTS) + 1U;
+	for (uint32_t n = 1; n < gdb_if_port_count; ++n) {
+		const uint16_t port = gdb_if_main_port + n;
+		gdb_if_servs[n] = gdb_if_listen(port);
+		if (gdb_if_servs[n] != -1)
+			DEBUG_WARN("Listening on TCP: %4d for target %" PRIu32 "\n", port, n);
+	}
+}
+
+static void gdb_if_set_nonblocking(const int fd)
+{
 #if defined(_WIN32) || defined(__CYGWIN__)
-		    DEBUG_WARN("error setsockopt SOL_SOCKET : %d error: %d\n", gdb_if_serv,
-			WSAGetLastError());
+	unsigned long opt = 1;
+	const int iResult = ioctlsocket(fd, FIONBIO, &opt);
+	if (iResult != NO_ERROR)
+		DEBUG_WARN("ioctlsocket failed with error: %ld\n", iResult);
 #else
-			DEBUG_WARN("error setsockopt SOL_SOCKET : %d error: %d\n", gdb_if_serv,
-			strerror(errno));
+	const int flags = fcntl(fd, F_GETFL);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 #endif
-			close(gdb_if_serv);
-			continue;
-		}
-		if (setsockopt(gdb_if_serv, IPPROTO_TCP, TCP_NODELAY, (void*)&opt, sizeof(opt)) == -1) {
+}
+
+static void gdb_if_accept(const uint32_t port)
+{
+	while (true) {
+		const int conn = accept(gdb_if_servs[port], NULL, NULL);
+		if (conn == -1) {
+			if (GDB_IF_WOULD_BLOCK())
+				return;
 #if defined(_WIN32) || defined(__CYGWIN__)
-			DEBUG_WARN("error setsockopt IPPROTO_TCP : %d error: %d\n", gdb_if_serv,
-			WSAGetLastError());
+			DEBUG_WARN("error when accepting connection: %d", WSAGetLastError());
 #else
-			DEBUG_WARN("error setsockopt IPPROTO_TCP : %d error: %d\n", gdb_if_serv,
-			strerror(errno));
+			DEBUG_WARN("error when accepting connection: %s", strerror(errno));
 #endif
-			close(gdb_if_serv);
-			continue;
+			exit(1);
 		}
-		if (bind(gdb_if_serv, (void*)&addr, sizeof(addr)) == -1) {
-#if defined(_WIN32) || defined(__CYGWIN__)
-			DEBUG_WARN("error when binding socket: %d error: %d\n", gdb_if_serv,
-			WSAGetLastError());
-#else
-			DEBUG_WARN("error when binding socket: %d error: %d\n", gdb_if_serv,
-			strerror(errno));
-#endif
-			close(gdb_if_serv);
+
+		size_t slot = 0;
+		while (slot < GDB_MAX_CLIENTS && gdb_if_clients[slot] != -1)
+			++slot;
+		if (slot == GDB_MAX_CLIENTS) {
+			DEBUG_WARN("Too many GDB clients, refusing connection\n");
+			close(conn);
 			continue;
 		}
-		if (listen(gdb_if_serv, 1) == -1) {
-			DEBUG_WARN("listen closed %d\n",gdb_if_serv);
-			close(gdb_if_serv);
+		gdb_if_set_nonblocking(conn);
+		gdb_if_sinks[slot] = io_sink_open(conn, true, GDB_IF_SINK_SIZE);
+		if (!gdb_if_sinks[slot]) {
+			close(conn);
 			continue;
 		}
-		break;
-	} while(1);
-	DEBUG_WARN("Listening on TCP: %4d\n", port);
+		gdb_if_clients[slot] = conn;
+		gdb_if_client_ports[slot] = port;
+		gdb_if_client_fresh[slot] = true;
+		gdb_if_client_ids[slot] = gdb_if_next_id++;
+		DEBUG_INFO("Got connection\n");
+	}
+}
 
-	return 0;
+static void gdb_if_accept_all(void)
+{
+	for (uint32_t port = 0; port < gdb_if_port_count; ++port) {
+		if (gdb_if_servs[port] != -1)
+			gdb_if_accept(port);
+	}
 }
 
+static void gdb_if_set_conn(const size_t slot)
+{
+	gdb_if_conn = gdb_if_clients[slot];
+	gdb_if_conn_port = gdb_if_client_ports[slot];
+}
 
-unsigned char gdb_if_getchar(void)
+static void gdb_if_drop(const int conn)
 {
-	unsigned char ret;
-	int i = 0;
-#if defined(_WIN32) || defined(__CYGWIN__)
-	int iResult;
-	unsigned long opt;
-#else
-	int flags;
-#endif
-	while(i <= 0) {
-		if(gdb_if_conn <= 0) {
-#if defined(_WIN32) || defined(__CYGWIN__)
-			opt = 1;
-			iResult = ioctlsocket(gdb_if_serv, FIONBIO, &opt);
-			if (iResult != NO_ERROR) {
-				DEBUG_WARN("ioctlsocket failed with error: %ld\n", iResult);
-			}
-#else
-			flags = fcntl(gdb_if_serv, F_GETFL);
-			fcntl(gdb_if_serv, F_SETFL, flags | O_NONBLOCK);
-#endif
-			while(1) {
-				gdb_if_conn = accept(gdb_if_serv, NULL, NULL);
-				if (gdb_if_conn == -1) {
 #if defined(_WIN32) || defined(__CYGWIN__)
-					if (WSAGetLastError() == WSAEWOULDBLOCK) {
+	DEBUG_INFO("Dropped broken connection: %d\n", WSAGetLastError());
 #else
-					if (errno == EWOULDBLOCK) {
+	DEBUG_INFO("Dropped broken connection: %s\n", strerror(errno));
 #endif
-						SET_IDLE_STATE(1);
-						platform_delay(100);
-					} else {
-#if defined(_WIN32) || defined(__CYGWIN__)
-						DEBUG_WARN("error when accepting connection: %d",
-								   WSAGetLastError());
+	for (size_t i = 0; i < GDB_MAX_CLIENTS; ++i) {
+		if (gdb_if_clients[i] == conn) {
+			io_sink_close(gdb_if_sinks[i], false);
+			gdb_if_sinks[i] = NULL;
+			gdb_if_clients[i] = -1;
+		}
+	}
+	close(conn);
+	if (conn == gdb_if_conn) {
+		gdb_if_conn = -1;
+		gdb_if_in_packet = false;
+		gdb_if_checksum_left = 0;
+	}
+}
+
+/*
+ * Waits for activity on the listening socket and either every client or only the
+ * current one, accepting any new connections. A negative timeout, in microseconds,
+ * waits forever. Returns the number of readable clients in the set waited on.
+ */
+static int gdb_if_select(const int timeout_us, const bool any_client, fd_set *const fds)
+{
+#if defined(__CYGWIN__)
+	TIMEVAL tv;
 #else
-						DEBUG_WARN("error when accepting connection: %s",
-								   strerror(errno));
+	struct timeval tv;
 #endif
-						exit(1);
-					}
-				} else {
-#if defined(_WIN32) || defined(__CYGWIN__)
-					opt = 0;
-					ioctlsocket(gdb_if_serv, FIONBIO, &opt);
-#else
-					fcntl(gdb_if_serv, F_SETFL, flags);
+	tv.tv_sec = timeout_us / 1000000;
+	tv.tv_usec = timeout_us % 1000000;
+
+	int max_fd = -1;
+	FD_ZERO(fds);
+	for (uint32_t port = 0; port < gdb_if_port_count; ++port) {
+		if (gdb_if_servs[port] == -1)
+			continue;
+		FD_SET(gdb_if_servs[port], fds);
+		max_fd = MAX(max_fd, gdb_if_servs[port]);
+	}
+	for (size_t i = 0; i < GDB_MAX_CLIENTS; ++i) {
+		const int conn = gdb_if_clients[i];
+		if (conn == -1 || (!any_client && conn != gdb_if_conn))
+			continue;
+		FD_SET(conn, fds);
+		max_fd = MAX(max_fd, conn);
+	}
+#ifdef RTT_IF_SELECT
+	/* RTT consumers connecting or sending data wake us up too */
+	max_fd = MAX(max_fd, rtt_if_fdset(fds));
 #endif
-					break;
-				}
-			}
-			DEBUG_INFO("Got connection\n");
-#if defined(_WIN32) || defined(__CYGWIN__)
-			opt = 0;
-			ioctlsocket(gdb_if_conn, FIONBIO, &opt);
-#else
-			flags = fcntl(gdb_if_conn, F_GETFL);
-			fcntl(gdb_if_conn, F_SETFL, flags & ~O_NONBLOCK);
+
+	int ready = select(max_fd + 1, fds, NULL, NULL, timeout_us < 0 ? NULL : &tv);
+	if (ready <= 0)
+		return 0;
+#ifdef RTT_IF_SELECT
+	ready -= rtt_if_serve(fds);
+	if (ready <= 0)
+		return 0;
 #endif
+	for (uint32_t port = 0; port < gdb_if_port_count; ++port) {
+		if (gdb_if_servs[port] != -1 && FD_ISSET(gdb_if_servs[port], fds)) {
+			gdb_if_accept(port);
+			--ready;
 		}
-		i = recv(gdb_if_conn, (void*)&ret, 1, 0);
-		if(i <= 0) {
-			gdb_if_conn = -1;
-#if defined(_WIN32) || defined(__CYGWIN__)
-			DEBUG_INFO("Dropped broken connection: %d\n", WSAGetLastError());
-#else
-			DEBUG_INFO("Dropped broken connection: %s\n", strerror(errno));
-#endif
-			/* Return '+' in case we were waiting for an ACK */
-			return '+';
+	}
+	return ready;
+}
+
+/* Picks the next readable client after the current one, so all clients get a turn */
+static void gdb_if_switch_client(const fd_set *const fds)
+{
+	size_t current = 0;
+	while (current < GDB_MAX_CLIENTS && gdb_if_clients[current] != gdb_if_conn)
+		++current;
+	for (size_t offset = 1; offset <= GDB_MAX_CLIENTS; ++offset) {
+		const size_t slot = (current + offset) % GDB_MAX_CLIENTS;
+		if (gdb_if_clients[slot] != -1 && FD_ISSET(gdb_if_clients[slot], fds)) {
+			gdb_if_set_conn(slot);
+			return;
 		}
 	}
+}
+
+static void gdb_if_track_framing(const uint8_t *const data, const size_t len)
+{
+	for (size_t i = 0; i < len; ++i) {
+		if (gdb_if_checksum_left) {
+			if (--gdb_if_checksum_left == 0)
+				gdb_if_in_packet = false;
+		} else if (gdb_if_in_packet) {
+			/* Escaped bytes are XORed with 0x20 so a raw '#' always ends the packet */
+			if (data[i] == '#')
+				gdb_if_checksum_left = 2;
+		} else if (data[i] == '$')
+			gdb_if_in_packet = true;
+	}
+}
+
+size_t gdb_if_read(void *const buf, const size_t max)
+{
+	fd_set fds;
+	while (true) {
+		if (gdb_if_conn != -1) {
+			const int i = recv(gdb_if_conn, buf, max, 0);
+			if (i > 0) {
+				gdb_if_track_framing(buf, (size_t)i);
+				return (size_t)i;
+			}
+			if (i == 0 || !GDB_IF_WOULD_BLOCK()) {
+				gdb_if_drop(gdb_if_conn);
+				/* Return '+' in case we were waiting for an ACK */
+				*(unsigned char *)buf = '+';
+				return 1;
+			}
+			/* Stay with this client until the packet it is sending is complete */
+			if (gdb_if_in_packet || gdb_if_pinned) {
+				gdb_if_select(-1, false, &fds);
+				continue;
+			}
+		}
+		SET_IDLE_STATE(1);
+		if (gdb_if_select(-1, true, &fds) > 0)
+			gdb_if_switch_client(&fds);
+	}
+}
+
+unsigned char gdb_if_getchar(void)
+{
+	unsigned char ret;
+	gdb_if_read(&ret, 1);
 	return ret;
 }
 
 unsigned char gdb_if_getchar_to(int timeout)
 {
 	fd_set fds;
-# if defined(__CYGWIN__)
-        TIMEVAL tv;
-#else
-	struct timeval tv;
-#endif
+	if (gdb_if_conn == -1) {
+		gdb_if_accept_all();
+		return -1;
+	}
 
-	if(gdb_if_conn == -1) return -1;
+	/* Only the current client is read from here, this is ACK and Ctrl-C polling */
+	if (gdb_if_select(timeout < 0 ? -1 : timeout * 1000, false, &fds) > 0 && gdb_if_conn != -1 && FD_ISSET(gdb_if_conn, &fds))
+		return gdb_if_getchar();
 
-	tv.tv_sec = timeout / 1000;
-	tv.tv_usec = (timeout % 1000) * 1000;
+	return -1;
+}
 
-	FD_ZERO(&fds);
-	FD_SET(gdb_if_conn, &fds);
+void gdb_if_wait(const uint32_t timeout_us)
+{
+	fd_set fds;
+	if (gdb_if_conn == -1)
+		platform_delay(timeout_us / 1000U);
+	else
+		gdb_if_select((int)MIN(timeout_us, (uint32_t)INT32_MAX), false, &fds);
+}
 
-	if(select(gdb_if_conn+1, &fds, NULL, NULL, &tv) > 0)
-		return gdb_if_getchar();
+uint32_t gdb_if_sessions(void)
+{
+	return gdb_if_port_count;
+}
 
-	return -1;
+uint32_t gdb_if_session(bool *const fresh)
+{
+	*fresh = false;
+	for (size_t i = 0; i < GDB_MAX_CLIENTS; ++i) {
+		if (gdb_if_conn != -1 && gdb_if_clients[i] == gdb_if_conn) {
+			*fresh = gdb_if_client_fresh[i];
+			gdb_if_client_fresh[i] = false;
+		}
+	}
+	return gdb_if_conn_port;
+}
+
+uint32_t gdb_if_client(void)
+{
+	for (size_t i = 0; i < GDB_MAX_CLIENTS; ++i) {
+		if (gdb_if_conn != -1 && gdb_if_clients[i] == gdb_if_conn)
+			return gdb_if_client_ids[i];
+	}
+	return 0;
+}
+
+bool gdb_if_client_select(const uint32_t client, const uint32_t session)
+{
+	for (size_t i = 0; i < GDB_MAX_CLIENTS; ++i) {
+		if (gdb_if_clients[i] == -1 || (client ? gdb_if_client_ids[i] != client : gdb_if_client_ports[i] != session))
+			continue;
+		if (gdb_if_clients[i] != gdb_if_conn) {
+			gdb_if_set_conn(i);
+			gdb_if_in_packet = false;
+			gdb_if_checksum_left = 0;
+		}
+		return true;
+	}
+	return false;
+}
+
+bool gdb_if_ready(void)
+{
+	fd_set fds;
+	return gdb_if_select(0, true, &fds) > 0;
+}
+
+bool gdb_if_pin(const bool pin)
+{
+	const bool pinned = gdb_if_pinned;
+	gdb_if_pinned = pin;
+	return pinned;
+}
+
+static void gdb_if_send(const void *const data, const size_t len)
+{
+	for (size_t i = 0; i < GDB_MAX_CLIENTS; ++i) {
+		if (gdb_if_conn == -1 || gdb_if_clients[i] != gdb_if_conn)
+			continue;
+		/* Only waits if a whole ring's worth of replies is still unread */
+		if (!io_sink_write_all(gdb_if_sinks[i], data, len))
+			gdb_if_drop(gdb_if_conn);
+		return;
+	}
 }
 
 void gdb_if_putchar(unsigned char c, int flush)
 {
-#if defined(__WIN32__) || defined(__CYGWIN__)
-	static char buf[2048];
-#else
 	static uint8_t buf[2048];
-#endif
-	static int bufsize = 0;
-	if (gdb_if_conn > 0) {
+	static size_t bufsize = 0;
+	if (gdb_if_conn != -1) {
 		buf[bufsize++] = c;
 		if (flush || (bufsize == sizeof(buf))) {
-			send(gdb_if_conn, buf, bufsize, 0);
+			gdb_if_send(buf, bufsize);
 			bufsize = 0;
 		}
 	}
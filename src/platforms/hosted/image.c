@@ -0,0 +1,330 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Firmware image formats for the command line flash operations.
+ *
+ * Only the populated ranges of an image are handed back, so gaps between a
+ * bootloader, an application and configuration data are neither erased nor
+ * programmed. ELF files are read through their PT_LOAD program headers at the
+ * physical (load) address, which is where initialised data lives in flash.
+ */
+
+#include "general.h"
+#include "image.h"
+
+#define ELF_IDENT_CLASS   4U
+#define ELF_IDENT_DATA    5U
+#define ELF_CLASS_32      1U
+#define ELF_DATA_LSB      1U
+#define ELF_HDR_SIZE      0x34U
+#define ELF_HDR_PHOFF     0x1cU
+#define ELF_HDR_PHENTSIZE 0x2aU
+#define ELF_HDR_PHNUM     0x2cU
+#define ELF_PHDR_SIZE     0x20U
+#define ELF_PHDR_TYPE     0x00U
+#define ELF_PHDR_OFFSET   0x04U
+#define ELF_PHDR_PADDR    0x0cU
+#define ELF_PHDR_FILESZ   0x10U
+#define ELF_PT_LOAD       1U
+
+#define IHEX_DATA             0x00U
+#define IHEX_EOF              0x01U
+#define IHEX_EXT_SEGMENT_ADDR 0x02U
+#define IHEX_EXT_LINEAR_ADDR  0x04U
+
+static uint16_t image_read16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8U);
+}
+
+static uint32_t image_read32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8U) | (p[2] << 16U) | ((uint32_t)p[3] << 24U);
+}
+
+/* Adds decoded data, extending the last segment when it follows straight on from it */
+static bool image_add(image_s *image, size_t *storage_size, uint32_t addr, const uint8_t *data, size_t size)
+{
+	if (!size)
+		return true;
+	image_segment_s *last = image->count ? &image->segments[image->count - 1U] : NULL;
+	if (!last || last->addr + last->size != addr) {
+		image_segment_s *segments = realloc(image->segments, (image->count + 1U) * sizeof(*segments));
+		if (!segments)
+			return false;
+		image->segments = segments;
+		last = &segments[image->count++];
+		last->addr = addr;
+		last->size = 0;
+		last->data = NULL;
+	}
+	uint8_t *storage = realloc(image->storage, *storage_size + size);
+	if (!storage)
+		return false;
+	memcpy(storage + *storage_size, data, size);
+	image->storage = storage;
+	*storage_size += size;
+	last->size += size;
+	return true;
+}
+
+static int image_segment_compare(const void *a, const void *b)
+{
+	const image_segment_s *const lhs = a;
+	const image_segment_s *const rhs = b;
+	return lhs->addr < rhs->addr ? -1 : lhs->addr > rhs->addr;
+}
+
+/* Points the segments of a text format image into storage, then sorts them and checks for overlaps */
+static bool image_finish(image_s *image, const bool text)
+{
+	if (text) {
+		/* Segments were filled in storage order, each only ever growing at the end */
+		size_t offset = 0;
+		for (size_t i = 0; i < image->count; ++i) {
+			image->segments[i].data = image->storage + offset;
+			offset += image->segments[i].size;
+		}
+	}
+	qsort(image->segments, image->count, sizeof(*image->segments), image_segment_compare);
+	for (size_t i = 1; i < image->count; ++i) {
+		const image_segment_s *prev = &image->segments[i - 1U];
+		if (prev->addr + prev->size > image->segments[i].addr) {
+			DEBUG_WARN("Image data overlaps at 0x%08" PRIx32 "\n", image->segments[i].addr);
+			return false;
+		}
+	}
+	return image->count != 0;
+}
+
+static bool image_load_elf(image_s *image, const uint8_t *file, size_t size)
+{
+	if (size < ELF_HDR_SIZE || file[ELF_IDENT_CLASS] != ELF_CLASS_32 || file[ELF_IDENT_DATA] != ELF_DATA_LSB) {
+		DEBUG_WARN("Only 32 bit little endian ELF files are supported\n");
+		return false;
+	}
+	const uint32_t phoff = image_read32(file + ELF_HDR_PHOFF);
+	const uint16_t phentsize = image_read16(file + ELF_HDR_PHENTSIZE);
+	const uint16_t phnum = image_read16(file + ELF_HDR_PHNUM);
+	if (!phnum) {
+		DEBUG_WARN("ELF file has no program headers, link it as an executable\n");
+		return false;
+	}
+	if (phentsize < ELF_PHDR_SIZE || phoff > size || (size - phoff) / phentsize < phnum) {
+		DEBUG_WARN("ELF program headers out of bounds\n");
+		return false;
+	}
+	for (uint16_t i = 0; i < phnum; ++i) {
+		const uint8_t *phdr = file + phoff + (size_t)i * phentsize;
+		if (image_read32(phdr + ELF_PHDR_TYPE) != ELF_PT_LOAD)
+			continue;
+		const uint32_t offset = image_read32(phdr + ELF_PHDR_OFFSET);
+		const uint32_t filesz = image_read32(phdr + ELF_PHDR_FILESZ);
+		if (offset > size || size - offset < filesz) {
+			DEBUG_WARN("ELF segment %u out of bounds\n", i);
+			return false;
+		}
+		if (!filesz)
+			continue;
+		/* Segments point straight into the file, so they are never merged */
+		image_segment_s *segments = realloc(image->segments, (image->count + 1U) * sizeof(*segments));
+		if (!segments)
+			return false;
+		image->segments = segments;
+		segments[image->count].addr = image_read32(phdr + ELF_PHDR_PADDR);
+		segments[image->count].size = filesz;
+		segments[image->count].data = file + offset;
+		++image->count;
+	}
+	return image_finish(image, false);
+}
+
+static bool image_hex_bytes(const char *hex, size_t count, uint8_t *bytes)
+{
+	for (size_t i = 0; i < count; ++i) {
+		uint8_t value = 0;
+		for (size_t j = 0; j < 2U; ++j) {
+			const char c = hex[i * 2U + j];
+			value <<= 4U;
+			if (c >= '0' && c <= '9')
+				value |= c - '0';
+			else if (c >= 'a' && c <= 'f')
+				value |= c - 'a' + 10;
+			else if (c >= 'A' && c <= 'F')
+				value |= c - 'A' + 10;
+			else
+				return false;
+		}
+		bytes[i] = value;
+	}
+	return true;
+}
+
+/* Splits the next line off the file, returning its length without the line ending */
+static size_t image_next_line(const char **text, const char *end, const char **line)
+{
+	while (*text < end && (**text == '\r' || **text == '\n' || **text == ' ' || **text == '\t'))
+		++*text;
+	*line = *text;
+	while (*text < end && **text != '\r' && **text != '\n')
+		++*text;
+	size_t len = *text - *line;
+	while (len && ((*line)[len - 1U] == ' ' || (*line)[len - 1U] == '\t'))
+		--len;
+	return len;
+}
+
+static bool image_load_ihex(image_s *image, const char *text, size_t size)
+{
+	const char *const end = text + size;
+	size_t storage_size = 0;
+	uint32_t base = 0;
+	size_t line_number = 0;
+	const char *line;
+	for (size_t len; (len = image_next_line(&text, end, &line)); ) {
+		++line_number;
+		uint8_t record[5U + 255U];
+		if (line[0] != ':' || len < 11U || !(len & 1U) || (len - 1U) / 2U > sizeof(record) ||
+			!image_hex_bytes(line + 1U, (len - 1U) / 2U, record) ||
+			record[0] + 5U != (len - 1U) / 2U) {
+			DEBUG_WARN("Malformed Intel HEX record on line %zu\n", line_number);
+			return false;
+		}
+		uint8_t checksum = 0;
+		for (size_t i = 0; i < record[0] + 5U; ++i)
+			checksum += record[i];
+		if (checksum) {
+			DEBUG_WARN("Intel HEX checksum error on line %zu\n", line_number);
+			return false;
+		}
+		const uint16_t offset = (record[1] << 8U) | record[2];
+		const uint8_t *const data = record + 4U;
+		switch (record[3]) {
+		case IHEX_DATA:
+			if (!image_add(image, &storage_size, base + offset, data, record[0]))
+				return false;
+			break;
+		case IHEX_EOF:
+			return image_finish(image, true);
+		case IHEX_EXT_SEGMENT_ADDR:
+			base = ((data[0] << 8U) | data[1]) << 4U;
+			break;
+		case IHEX_EXT_LINEAR_ADDR:
+			base = ((uint32_t)data[0] << 24U) | (data[1] << 16U);
+			break;
+		default: /* Start addresses don't matter for flashing */
+			break;
+		}
+	}
+	DEBUG_WARN("Intel HEX file has no end of file record\n");
+	return false;
+}
+
+static bool image_load_srec(image_s *image, const char *text, size_t size)
+{
+	const char *const end = text + size;
+	size_t storage_size = 0;
+	size_t line_number = 0;
+	const char *line;
+	for (size_t len; (len = image_next_line(&text, end, &line)); ) {
+		++line_number;
+		uint8_t record[256U];
+		if (line[0] != 'S' || len < 4U || (len & 1U) || (len - 2U) / 2U > sizeof(record) ||
+			!image_hex_bytes(line + 2U, (len - 2U) / 2U, record) ||
+			record[0] + 1U != (len - 2U) / 2U) {
+			DEBUG_WARN("Malformed S-record on line %zu\n", line_number);
+			return false;
+		}
+		uint8_t checksum = 0;
+		for (size_t i = 0; i <= record[0]; ++i)
+			checksum += record[i];
+		if (checksum != 0xffU) {
+			DEBUG_WARN("S-record checksum error on line %zu\n", line_number);
+			return false;
+		}
+		size_t addr_len;
+		switch (line[1]) {
+		case '1':
+			addr_len = 2U;
+			break;
+		case '2':
+			addr_len = 3U;
+			break;
+		case '3':
+			addr_len = 4U;
+			break;
+		case '7':
+		case '8':
+		case '9':
+			return image_finish(image, true);
+		default: /* Header and record counts */
+			continue;
+		}
+		if (record[0] < addr_len + 1U) {
+			DEBUG_WARN("Malformed S-record on line %zu\n", line_number);
+			return false;
+		}
+		uint32_t addr = 0;
+		for (size_t i = 0; i < addr_len; ++i)
+			addr = (addr << 8U) | record[1U + i];
+		if (!image_add(image, &storage_size, addr, record + 1U + addr_len, record[0] - addr_len - 1U))
+			return false;
+	}
+	/* The termination record is optional for a lot of tools */
+	return image_finish(image, true);
+}
+
+bool image_load(image_s *image, const void *file, size_t size, bool *malformed)
+{
+	const uint8_t *const data = file;
+	memset(image, 0, sizeof(*image));
+	bool result;
+	if (size >= 4U && !memcmp(data, "\x7f" "ELF", 4U))
+		result = image_load_elf(image, data, size);
+	else if (size >= 11U && data[0] == ':')
+		result = image_load_ihex(image, file, size);
+	else if (size >= 4U && data[0] == 'S' && data[1] >= '0' && data[1] <= '9')
+		result = image_load_srec(image, file, size);
+	else {
+		*malformed = false;
+		return false;
+	}
+	*malformed = !result;
+	if (!result)
+		image_free(image);
+	return result;
+}
+
+bool image_raw(image_s *image, uint32_t addr, const void *data, size_t size)
+{
+	memset(image, 0, sizeof(*image));
+	image->segments = malloc(sizeof(*image->segments));
+	if (!image->segments)
+		return false;
+	image->segments->addr = addr;
+	image->segments->size = size;
+	image->segments->data = data;
+	image->count = 1;
+	return true;
+}
+
+void image_free(image_s *image)
+{
+	free(image->segments);
+	free(image->storage);
+	memset(image, 0, sizeof(*image));
+}
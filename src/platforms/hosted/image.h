@@ -0,0 +1,53 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PLATFORMS_HOSTED_IMAGE_H
+#define PLATFORMS_HOSTED_IMAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A contiguous run of an image's data and the address it loads to */
+typedef struct image_segment {
+	uint32_t addr;
+	size_t size;
+	const uint8_t *data;
+} image_segment_s;
+
+/*
+ * The populated ranges of a firmware image, sorted by address. For ELF the
+ * segment data points into the file as given, for the text formats it points
+ * into storage, which holds the decoded bytes.
+ */
+typedef struct image {
+	image_segment_s *segments;
+	size_t count;
+	uint8_t *storage;
+} image_s;
+
+/*
+ * Parses an ELF, Intel HEX or Motorola S-record file held in memory. Returns
+ * false if the file is none of those, in which case the caller treats it as a
+ * raw binary, or if it is malformed, which is said and flagged in malformed.
+ */
+bool image_load(image_s *image, const void *file, size_t size, bool *malformed);
+/* Describes a raw binary, or a range to read, as a single segment at addr */
+bool image_raw(image_s *image, uint32_t addr, const void *data, size_t size);
+void image_free(image_s *image);
+
+#endif /* PLATFORMS_HOSTED_IMAGE_H */
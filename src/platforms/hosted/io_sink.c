@@ -0,0 +1,278 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Output threads. BMDA runs the GDB protocol, the probe and the target drivers
+ * on one thread, which must never sit in a send() to a GDB client that isn't
+ * reading or a write() to a terminal or pipe that is held up, as meanwhile no
+ * transfers happen with the probe, RTT isn't polled and SWO isn't captured.
+ *
+ * Each sink is a single producer single consumer ring: the protocol thread
+ * fills it and only moves head, the sink's thread empties it and only moves
+ * tail, so neither takes a lock to pass data. The mutex and condition
+ * variables are just for a thread with nothing to do to sleep on.
+ */
+
+#include "general.h"
+#include "io_sink.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#if defined(_WIN32) || defined(__CYGWIN__)
+#include <winsock2.h>
+#define IO_SINK_WOULD_BLOCK() (WSAGetLastError() == WSAEWOULDBLOCK)
+#else
+#include <sys/select.h>
+#include <sys/socket.h>
+#define IO_SINK_WOULD_BLOCK() (errno == EWOULDBLOCK || errno == EAGAIN)
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* How long a sink's thread waits on a socket that won't take data before checking for close */
+#define IO_SINK_POLL_US      100000U
+#define IO_SINK_CLOSE_MS     1000U
+#define IO_SINK_STDOUT_SIZE  (256U * 1024U)
+
+struct io_sink {
+	int fd;
+	bool is_socket;
+	uint8_t *ring;
+	size_t size;
+	atomic_size_t head;
+	atomic_size_t tail;
+	atomic_bool stop;
+	atomic_bool discard;
+	atomic_bool failed;
+	atomic_bool done;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t queued;
+	pthread_cond_t written;
+};
+
+static io_sink_s *io_stdout;
+static bool io_stdout_closed;
+
+static void io_sink_signal(io_sink_s *const sink, pthread_cond_t *const cond)
+{
+	pthread_mutex_lock(&sink->lock);
+	pthread_cond_signal(cond);
+	pthread_mutex_unlock(&sink->lock);
+}
+
+/* Waits for a non-blocking socket to take more data, true if it should be tried again */
+static bool io_sink_wait_writable(io_sink_s *const sink)
+{
+	fd_set fds;
+	FD_ZERO(&fds);
+	FD_SET(sink->fd, &fds);
+	struct timeval tv = {.tv_sec = 0, .tv_usec = IO_SINK_POLL_US};
+	select(sink->fd + 1, NULL, &fds, NULL, &tv);
+	return !atomic_load(&sink->discard);
+}
+
+static ssize_t io_sink_out(io_sink_s *const sink, const uint8_t *const data, const size_t len)
+{
+	while (true) {
+#if defined(_WIN32) || defined(__CYGWIN__)
+		const ssize_t result =
+			sink->is_socket ? send(sink->fd, (const char *)data, (int)len, 0) : write(sink->fd, data, len);
+#else
+		const ssize_t result = sink->is_socket ? send(sink->fd, data, len, MSG_NOSIGNAL) : write(sink->fd, data, len);
+#endif
+		if (result > 0)
+			return result;
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result < 0 && IO_SINK_WOULD_BLOCK()) {
+			if (!io_sink_wait_writable(sink))
+				return -1;
+			continue;
+		}
+		return -1;
+	}
+}
+
+static void *io_sink_thread(void *const arg)
+{
+	io_sink_s *const sink = arg;
+	while (!atomic_load(&sink->discard)) {
+		const size_t tail = atomic_load_explicit(&sink->tail, memory_order_relaxed);
+		const size_t head = atomic_load_explicit(&sink->head, memory_order_acquire);
+		if (head == tail) {
+			if (atomic_load(&sink->stop))
+				break;
+			pthread_mutex_lock(&sink->lock);
+			while (atomic_load(&sink->head) == tail && !atomic_load(&sink->stop))
+				pthread_cond_wait(&sink->queued, &sink->lock);
+			pthread_mutex_unlock(&sink->lock);
+			continue;
+		}
+
+		/* Up to the end of the ring, the next round gets the rest */
+		const size_t offset = tail & (sink->size - 1U);
+		const size_t len = MIN(head - tail, sink->size - offset);
+		const ssize_t written = io_sink_out(sink, sink->ring + offset, len);
+		if (written < 0) {
+			if (!atomic_load(&sink->discard))
+				atomic_store(&sink->failed, true);
+			break;
+		}
+		atomic_store_explicit(&sink->tail, tail + (size_t)written, memory_order_release);
+		io_sink_signal(sink, &sink->written);
+	}
+	atomic_store(&sink->done, true);
+	/* Nothing more is going out, don't leave a producer waiting on that */
+	io_sink_signal(sink, &sink->written);
+	return NULL;
+}
+
+io_sink_s *io_sink_open(const int fd, const bool is_socket, const size_t size)
+{
+	io_sink_s *const sink = calloc(1, sizeof(*sink));
+	size_t ring_size = 4096U;
+	while (ring_size < size)
+		ring_size <<= 1U;
+	uint8_t *const ring = malloc(ring_size);
+	if (!sink || !ring) { /* malloc failed: heap exhaustion */
+		DEBUG_WARN("malloc: failed in %s\n", __func__);
+		free(sink);
+		free(ring);
+		return NULL;
+	}
+	sink->fd = fd;
+	sink->is_socket = is_socket;
+	sink->ring = ring;
+	sink->size = ring_size;
+	atomic_init(&sink->head, 0);
+	atomic_init(&sink->tail, 0);
+	atomic_init(&sink->stop, false);
+	atomic_init(&sink->discard, false);
+	atomic_init(&sink->failed, false);
+	atomic_init(&sink->done, false);
+	pthread_mutex_init(&sink->lock, NULL);
+	pthread_cond_init(&sink->queued, NULL);
+	pthread_cond_init(&sink->written, NULL);
+	if (pthread_create(&sink->thread, NULL, io_sink_thread, sink)) {
+		DEBUG_WARN("Can not start an output thread\n");
+		pthread_mutex_destroy(&sink->lock);
+		pthread_cond_destroy(&sink->queued);
+		pthread_cond_destroy(&sink->written);
+		free(ring);
+		free(sink);
+		return NULL;
+	}
+	return sink;
+}
+
+void io_sink_close(io_sink_s *const sink, const bool drain)
+{
+	if (!sink)
+		return;
+	pthread_mutex_lock(&sink->lock);
+	atomic_store(&sink->discard, !drain);
+	atomic_store(&sink->stop, true);
+	pthread_cond_signal(&sink->queued);
+	pthread_mutex_unlock(&sink->lock);
+
+	for (uint32_t waited = 0; !atomic_load(&sink->done) && waited < IO_SINK_CLOSE_MS; ++waited)
+		platform_delay(1U);
+	if (!atomic_load(&sink->done)) {
+		/* Stuck in a write to something that stopped reading, it has to be left there */
+		atomic_store(&sink->discard, true);
+		pthread_detach(sink->thread);
+		return;
+	}
+	pthread_join(sink->thread, NULL);
+	pthread_mutex_destroy(&sink->lock);
+	pthread_cond_destroy(&sink->queued);
+	pthread_cond_destroy(&sink->written);
+	free(sink->ring);
+	free(sink);
+}
+
+size_t io_sink_space(io_sink_s *const sink)
+{
+	if (atomic_load(&sink->failed))
+		return 0;
+	const size_t head = atomic_load_explicit(&sink->head, memory_order_relaxed);
+	return sink->size - (head - atomic_load_explicit(&sink->tail, memory_order_acquire));
+}
+
+bool io_sink_failed(io_sink_s *const sink)
+{
+	return atomic_load(&sink->failed);
+}
+
+size_t io_sink_write(io_sink_s *const sink, const void *const data, const size_t len)
+{
+	const size_t count = MIN(len, io_sink_space(sink));
+	if (!count)
+		return 0;
+	const size_t head = atomic_load_explicit(&sink->head, memory_order_relaxed);
+	const size_t offset = head & (sink->size - 1U);
+	const size_t first = MIN(count, sink->size - offset);
+	memcpy(sink->ring + offset, data, first);
+	memcpy(sink->ring, (const uint8_t *)data + first, count - first);
+	atomic_store_explicit(&sink->head, head + count, memory_order_release);
+	io_sink_signal(sink, &sink->queued);
+	return count;
+}
+
+bool io_sink_write_all(io_sink_s *const sink, const void *const data, const size_t len)
+{
+	const uint8_t *ptr = data;
+	size_t left = len;
+	while (!atomic_load(&sink->failed)) {
+		const size_t count = io_sink_write(sink, ptr, left);
+		ptr += count;
+		left -= count;
+		if (!left)
+			return true;
+		pthread_mutex_lock(&sink->lock);
+		while (!io_sink_space(sink) && !atomic_load(&sink->done))
+			pthread_cond_wait(&sink->written, &sink->lock);
+		pthread_mutex_unlock(&sink->lock);
+		if (atomic_load(&sink->done) && !io_sink_space(sink))
+			return false;
+	}
+	return false;
+}
+
+io_sink_s *io_sink_stdout(void)
+{
+	if (!io_stdout && !io_stdout_closed) {
+		/* Whatever stdio still holds goes out first, to keep the order */
+		fflush(stdout);
+		io_stdout = io_sink_open(STDOUT_FILENO, false, IO_SINK_STDOUT_SIZE);
+		io_stdout_closed = !io_stdout;
+	}
+	return io_stdout;
+}
+
+void io_sink_stdout_close(void)
+{
+	io_sink_close(io_stdout, true);
+	io_stdout = NULL;
+	io_stdout_closed = true;
+}
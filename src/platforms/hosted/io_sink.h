@@ -0,0 +1,50 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PLATFORMS_HOSTED_IO_SINK_H
+#define PLATFORMS_HOSTED_IO_SINK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A byte stream written out to a file descriptor or socket by a thread of its
+ * own, so the thread running the protocol only ever copies into a ring and
+ * never waits on a slow reader. There is one producer, the protocol thread.
+ */
+typedef struct io_sink io_sink_s;
+
+/* size is rounded up to a power of 2, is_socket selects send() over write() */
+io_sink_s *io_sink_open(int fd, bool is_socket, size_t size);
+/* Stops the thread, first writing out what is queued if drain is set, for as long as that takes up to a second */
+void io_sink_close(io_sink_s *sink, bool drain);
+
+/* Queues what fits of data without waiting, returns how much that was */
+size_t io_sink_write(io_sink_s *sink, const void *data, size_t len);
+/* Queues all of data, waiting for room as needed, false once writing out has failed */
+bool io_sink_write_all(io_sink_s *sink, const void *data, size_t len);
+size_t io_sink_space(io_sink_s *sink);
+/* Writing out hit an error, such as the reader going away, and stopped */
+bool io_sink_failed(io_sink_s *sink);
+
+/* The shared sink for stdout, opened on first use and drained at exit */
+io_sink_s *io_sink_stdout(void);
+/* Drains and stops it, after which io_sink_stdout() returns NULL and stdout is written directly */
+void io_sink_stdout_close(void);
+
+#endif /* PLATFORMS_HOSTED_IO_SINK_H */
@@ -206,10 +206,7 @@ int jlink_init(bmp_info_t *info)
 		goto error;
 	if (initialize_handle(info, devs[i]))
 		goto error;
-	jl->req_trans = libusb_alloc_transfer(0);
-	jl->rep_trans = libusb_alloc_transfer(0);
-	if (!jl->req_trans || !jl->rep_trans ||
-		!jl->ep_tx || !jl->ep_rx) {
+	if (!jl->ep_tx || !jl->ep_rx) {
 		DEBUG_WARN("Device setup failed\n");
 		goto error;
 	}
@@ -30,6 +30,7 @@
 #include "target_internal.h"
 #include "adiv5.h"
 #include "jlink.h"
+#include "swd_queue.h"
 #include "cli.h"
 
 static uint32_t jlink_adiv5_swdp_read(ADIv5_DP_t *dp, uint16_t addr);
@@ -40,6 +41,10 @@ static uint32_t jlink_adiv5_swdp_low_access(ADIv5_DP_t *dp, uint8_t RnW, uint16_
 
 static void jlink_adiv5_swdp_abort(ADIv5_DP_t *dp, uint32_t abort);
 
+static void jlink_adiv5_swdp_queue_read(ADIv5_DP_t *dp, uint16_t addr, uint32_t *result);
+static void jlink_adiv5_swdp_queue_write(ADIv5_DP_t *dp, uint16_t addr, uint32_t value);
+static bool jlink_adiv5_swdp_queue_flush(ADIv5_DP_t *dp);
+
 enum {
 	SWDIO_WRITE = 0,
 	SWDIO_READ
@@ -133,6 +138,11 @@ uint32_t jlink_swdp_scan(bmp_info_t *info)
 	dp->error = jlink_adiv5_swdp_error;
 	dp->low_access = jlink_adiv5_swdp_low_access;
 	dp->abort = jlink_adiv5_swdp_abort;
+	dp->queue_read = jlink_adiv5_swdp_queue_read;
+	dp->queue_write = jlink_adiv5_swdp_queue_write;
+	dp->queue_flush = jlink_adiv5_swdp_queue_flush;
+	dp->mem_read = swd_queue_mem_read;
+	dp->mem_write_sized = swd_queue_mem_write_sized;
 
 	jlink_adiv5_swdp_error(dp);
 
@@ -182,7 +192,7 @@ static uint32_t jlink_adiv5_swdp_low_access(ADIv5_DP_t *dp, uint8_t RnW, uint16_
 	uint8_t ack;
 	platform_timeout timeout;
 
-	if (APnDP && dp->fault)
+	if ((APnDP && dp->fault) || dp->deferred_error)
 		return 0;
 
 	uint8_t cmd[16];
@@ -205,18 +215,26 @@ static uint32_t jlink_adiv5_swdp_low_access(ADIv5_DP_t *dp, uint8_t RnW, uint16_
 	cmd[6] = request;
 
 	platform_timeout_set(&timeout, 2000);
+	size_t waits = 0;
 	do {
 		send_recv(info.usb_link, cmd, 8, res, 2);
 		send_recv(info.usb_link, NULL, 0, res + 2, 1);
 
-		if (res[2] != 0)
-			raise_exception(EXCEPTION_ERROR, "Low access setup failed");
+		if (res[2] != 0) {
+			adiv5_dp_raise(dp, EXCEPTION_ERROR, "Low access setup failed");
+			return 0;
+		}
 
 		ack = res[1] & 7;
+		if (ack == SWDP_ACK_WAIT)
+			++waits;
 	} while (ack == SWDP_ACK_WAIT && !platform_timeout_is_expired(&timeout));
+	adiv5_dp_idle_tune(dp, waits);
 
-	if (ack == SWDP_ACK_WAIT)
-		raise_exception(EXCEPTION_TIMEOUT, "SWDP ACK timeout");
+	if (ack == SWDP_ACK_WAIT) {
+		adiv5_dp_raise(dp, EXCEPTION_TIMEOUT, "SWDP ACK timeout");
+		return 0;
+	}
 
 	if (ack == SWDP_ACK_FAULT) {
 		if (cl_debuglevel & BMP_DEBUG_TARGET)
@@ -240,15 +258,19 @@ static uint32_t jlink_adiv5_swdp_low_access(ADIv5_DP_t *dp, uint8_t RnW, uint16_
 		send_recv(info.usb_link, cmd, 14, res, 5);
 		send_recv(info.usb_link, NULL, 0, res + 5, 1);
 
-		if (res[5] != 0)
-			raise_exception(EXCEPTION_ERROR, "Low access read failed");
+		if (res[5] != 0) {
+			adiv5_dp_raise(dp, EXCEPTION_ERROR, "Low access read failed");
+			return 0;
+		}
 
 		response = res[0] | res[1] << 8U | res[2] << 16U | res[3] << 24U;
 
 		const unsigned int parity = res[4] & 1;
 		const unsigned int bit_count = __builtin_popcount(response) + parity;
-		if (bit_count & 1) /* Give up on parity error */
-			raise_exception(EXCEPTION_ERROR, "SWDP Parity error");
+		if (bit_count & 1) { /* Give up on parity error */
+			adiv5_dp_raise(dp, EXCEPTION_ERROR, "SWDP Parity error");
+			return 0;
+		}
 	} else {
 		cmd[2] = 33 + 8; /* 8 idle cycle  to move data through SW-DP */
 		memset(cmd + 4, 0xffU, 6);
@@ -263,8 +285,10 @@ static uint32_t jlink_adiv5_swdp_low_access(ADIv5_DP_t *dp, uint8_t RnW, uint16_
 		send_recv(info.usb_link, cmd, 16, res, 6);
 		send_recv(info.usb_link, NULL, 0, res, 1);
 
-		if (res[0] != 0)
-			raise_exception(EXCEPTION_ERROR, "Low access write failed");
+		if (res[0] != 0) {
+			adiv5_dp_raise(dp, EXCEPTION_ERROR, "Low access write failed");
+			return 0;
+		}
 	}
 	return response;
 }
@@ -273,3 +297,137 @@ static void jlink_adiv5_swdp_abort(ADIv5_DP_t *dp, uint32_t abort)
 {
 	adiv5_dp_write(dp, ADIV5_DP_ABORT, abort);
 }
+
+
+/*
+ * SWD sequence assembler: a queue run is laid out as a single EMU_CMD_HW_JTAG3
+ * sequence and the responses decoded in bulk once it returns. The bit layout of
+ * each transfer is the concatenation of the two halves
+ * jlink_adiv5_swdp_low_access() sends, so the J-Link sampling quirk is kept.
+ */
+#define JLINK_SWD_READ_BITS  46U
+#define JLINK_SWD_WRITE_BITS 54U
+/* Sized to the J-Link TAP buffer */
+#define JLINK_SWD_SEQ_BYTES  2048U
+#define JLINK_SWD_QUEUE_MAX  ((JLINK_SWD_SEQ_BYTES * 8U) / JLINK_SWD_WRITE_BITS)
+
+static swd_queue_transfer_s jlink_swd_transfers[JLINK_SWD_QUEUE_MAX];
+static uint8_t jlink_swd_cmd[4U + 2U * JLINK_SWD_SEQ_BYTES];
+static uint8_t jlink_swd_res[JLINK_SWD_SEQ_BYTES + 1U];
+
+static void jlink_swd_seq_set(uint8_t *buf, size_t offset, uint32_t value, size_t count)
+{
+	for (size_t i = 0; i < count; ++i, ++offset) {
+		if (value & (1U << i))
+			buf[offset >> 3U] |= 1U << (offset & 7U);
+	}
+}
+
+static uint32_t jlink_swd_seq_get(const uint8_t *buf, size_t offset, size_t count)
+{
+	uint32_t value = 0;
+	for (size_t i = 0; i < count; ++i, ++offset) {
+		if (buf[offset >> 3U] & (1U << (offset & 7U)))
+			value |= 1U << i;
+	}
+	return value;
+}
+
+static size_t jlink_swd_transfer_bits(const swd_queue_transfer_s *transfer, size_t idle)
+{
+	return (transfer->RnW ? JLINK_SWD_READ_BITS : JLINK_SWD_WRITE_BITS) + idle;
+}
+
+/* One EMU_CMD_HW_JTAG3 sequence, with the DP's tuned idle cycles clocked after each transfer */
+static void jlink_swd_run_seq(swd_queue_transfer_s *transfers, size_t count, size_t idle, size_t bits)
+{
+	const size_t bytes = (bits + 7U) >> 3U;
+	uint8_t *direction = jlink_swd_cmd + 4U;
+	uint8_t *data = direction + bytes;
+	memset(jlink_swd_cmd, 0, 4U + 2U * bytes);
+	jlink_swd_cmd[0] = CMD_HW_JTAG3;
+	jlink_swd_cmd[2] = bits & 0xffU;
+	jlink_swd_cmd[3] = bits >> 8U;
+	for (size_t i = 0, offset = 0; i < count; ++i) {
+		const swd_queue_transfer_s *transfer = &transfers[i];
+		jlink_swd_seq_set(direction, offset, 0xffU, 8U);
+		jlink_swd_seq_set(data, offset, make_packet_request(transfer->RnW, transfer->addr), 8U);
+		if (transfer->RnW) {
+			/* Turnaround and ACK, 32 data bits and parity in, then 2 idle cycles out */
+			jlink_swd_seq_set(direction, offset + 44U, 0x3U, 2U);
+		} else {
+			/* Turnaround and ACK in, turnaround, data, parity and 8 idle cycles out */
+			jlink_swd_seq_set(direction, offset + 12U, 0x3ffffffU, 26U);
+			jlink_swd_seq_set(direction, offset + 38U, 0xffffU, 16U);
+			jlink_swd_seq_set(data, offset + 13U, transfer->value, 32U);
+			jlink_swd_seq_set(data, offset + 45U, __builtin_popcount(transfer->value) & 1U, 1U);
+		}
+		offset += jlink_swd_transfer_bits(transfer, 0);
+		for (size_t cycle = 0; cycle < idle; cycle += 32U)
+			jlink_swd_seq_set(direction, offset + cycle, 0xffffffffU, MIN(idle - cycle, 32U));
+		offset += idle;
+	}
+
+	send_recv(info.usb_link, jlink_swd_cmd, 4U + 2U * bytes, jlink_swd_res, bytes);
+	send_recv(info.usb_link, NULL, 0, jlink_swd_res + bytes, 1);
+	if (jlink_swd_res[bytes] != 0)
+		raise_exception(EXCEPTION_ERROR, "SWD sequence failed");
+
+	for (size_t i = 0, offset = 0; i < count; ++i) {
+		swd_queue_transfer_s *transfer = &transfers[i];
+		transfer->ack = jlink_swd_seq_get(jlink_swd_res, offset + 8U, 3U);
+		if (transfer->RnW) {
+			transfer->value = jlink_swd_seq_get(jlink_swd_res, offset + 11U, 32U);
+			const uint32_t parity = jlink_swd_seq_get(jlink_swd_res, offset + 43U, 1U);
+			transfer->parity_error = (__builtin_popcount(transfer->value) + parity) & 1U;
+		}
+		offset += jlink_swd_transfer_bits(transfer, idle);
+	}
+}
+
+/* Split the run into as few sequences as fit the J-Link TAP buffer */
+static void jlink_swd_run(ADIv5_DP_t *dp, swd_queue_transfer_s *transfers, size_t count)
+{
+	const size_t idle = adiv5_dp_idle_after(dp);
+	while (count) {
+		size_t seq_count = 0;
+		size_t bits = 0;
+		for (; seq_count < count; ++seq_count) {
+			const size_t transfer_bits = jlink_swd_transfer_bits(&transfers[seq_count], idle);
+			if (bits + transfer_bits > JLINK_SWD_SEQ_BYTES * 8U)
+				break;
+			bits += transfer_bits;
+		}
+		jlink_swd_run_seq(transfers, seq_count, idle, bits);
+		transfers += seq_count;
+		count -= seq_count;
+	}
+}
+
+static void jlink_swd_line_reset(ADIv5_DP_t *dp)
+{
+	(void)dp;
+	line_reset(&info);
+}
+
+static swd_queue_s jlink_swd_queue = {
+	.transfers = jlink_swd_transfers,
+	.size = JLINK_SWD_QUEUE_MAX,
+	.run = jlink_swd_run,
+	.line_reset = jlink_swd_line_reset,
+};
+
+static void jlink_adiv5_swdp_queue_read(ADIv5_DP_t *dp, uint16_t addr, uint32_t *result)
+{
+	swd_queue_read(&jlink_swd_queue, dp, addr, result);
+}
+
+static void jlink_adiv5_swdp_queue_write(ADIv5_DP_t *dp, uint16_t addr, uint32_t value)
+{
+	swd_queue_write(&jlink_swd_queue, dp, addr, value);
+}
+
+static bool jlink_adiv5_swdp_queue_flush(ADIv5_DP_t *dp)
+{
+	return swd_queue_flush(&jlink_swd_queue, dp);
+}
@@ -37,7 +37,7 @@ static void jtagtap_reset(void)
 
 static void jtagtap_tms_seq(uint32_t tms_states, size_t ticks)
 {
-	DEBUG_PROBE("jtagtap_tms_seq 0x%08" PRIx32 ", ticks %d\n", tms_states, ticks);
+	DEBUG_PROBE("jtagtap_tms_seq 0x%08" PRIx32 ", ticks %zu\n", tms_states, ticks);
 	int len = (ticks + 7) / 8;
 	uint8_t cmd[12];
 	cmd[0] = CMD_HW_JTAG3;
@@ -65,7 +65,7 @@ static void jtagtap_tdi_tdo_seq(uint8_t *data_out, const bool final_tms,
 		return;
 	int len = (ticks + 7) / 8;
 	if (cl_debuglevel & BMP_DEBUG_PROBE) {
-		DEBUG_PROBE("jtagtap_tdi_tdo %s, ticks %d, data_in: ",
+		DEBUG_PROBE("jtagtap_tdi_tdo %s, ticks %zu, data_in: ",
 			   (final_tms) ? "Final TMS" : "", ticks);
 		for (int i = 0; i < len; i++) {
 			DEBUG_PROBE("%02x", data_in[i]);
@@ -114,6 +114,29 @@ static void jtagtap_tdi_seq(const bool final_tms, const uint8_t *data_in,
 	return jtagtap_tdi_tdo_seq(NULL,  final_tms, data_in, ticks);
 }
 
+/* HW_JTAG3 takes a TMS bit for every cycle anyway, so a whole access goes in one command */
+static void jtagtap_tms_tdi_tdo_seq(uint8_t *data_out, const uint8_t *tms, const uint8_t *data_in, size_t ticks)
+{
+	if (!ticks)
+		return;
+	const size_t len = (ticks + 7U) / 8U;
+	uint8_t *cmd = alloca(4U + 2U * len);
+	cmd[0] = CMD_HW_JTAG3;
+	cmd[1] = 0;
+	cmd[2] = ticks & 0xffU;
+	cmd[3] = ticks >> 8U;
+	memcpy(cmd + 4U, tms, len);
+	if (data_in)
+		memcpy(cmd + 4U + len, data_in, len);
+	else
+		memset(cmd + 4U + len, 0xff, len);
+	send_recv(info.usb_link, cmd, 4U + 2U * len, data_out ? data_out : cmd, len);
+	uint8_t res[1];
+	send_recv(info.usb_link, NULL, 0, res, 1);
+	if (res[0] != 0)
+		raise_exception(EXCEPTION_ERROR, "jtagtap_tms_tdi_tdo_seq failed");
+}
+
 static bool jtagtap_next(bool tms, bool tdi)
 {
 	DEBUG_PROBE("jtagtap_next TMS 0x%02x, TDI %02x\n", tms, tdi);
@@ -178,5 +201,6 @@ int jlink_jtagtap_init(bmp_info_t *info, jtag_proc_t *jtag_proc)
 	jtag_proc->jtagtap_tms_seq = jtagtap_tms_seq;
 	jtag_proc->jtagtap_tdi_tdo_seq = jtagtap_tdi_tdo_seq;
 	jtag_proc->jtagtap_tdi_seq = jtagtap_tdi_seq;
+	jtag_proc->jtagtap_tms_tdi_tdo_seq = jtagtap_tms_tdi_tdo_seq;
 	return 0;
 }
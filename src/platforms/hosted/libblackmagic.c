@@ -0,0 +1,320 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The library front end: the probe is opened as platform_init() opens it and
+ * scanned as the command line scans, the rest maps onto the target API. Each
+ * call on the target runs under its own exception handler, as gdb_main() does
+ * under main(), so a lost target fails the call instead of the process.
+ */
+
+#include "general.h"
+#include "exception.h"
+#include "target.h"
+#include "cli.h"
+#include "bmp_hosted.h"
+#include "libblackmagic.h"
+#ifdef ENABLE_RTT
+#include "rtt.h"
+#include "rtt_if.h"
+#endif
+
+/* How long bmd_halt() waits for the core to stop */
+#define BMD_HALT_TIMEOUT_MS 1000U
+
+#ifdef ENABLE_RTT
+typedef struct bmd_rtt_ring {
+	char data[RTT_UP_BUF_SIZE];
+	size_t head;
+	size_t len;
+} bmd_rtt_ring_s;
+#endif
+
+struct bmd_probe {
+	BMP_CL_OPTIONS_t *opts;
+	target *t;
+#ifdef ENABLE_RTT
+	bmd_rtt_ring_s rtt[MAX_RTT_CHAN];
+#endif
+};
+
+static bmd_probe_s bmd_probe;
+
+static void bmd_target_printf(struct target_controller *tc, const char *fmt, va_list ap)
+{
+	(void)tc;
+	char buf[256];
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	DEBUG_INFO("%s", buf);
+}
+
+/* Attaching again or a new scan takes the target from under the session */
+static void bmd_target_destroy(struct target_controller *tc, target *t)
+{
+	(void)tc;
+	if (bmd_probe.t == t)
+		bmd_probe.t = NULL;
+}
+
+static struct target_controller bmd_controller = {
+	.destroy_callback = bmd_target_destroy,
+	.printf = bmd_target_printf,
+};
+
+/* The target went away under a call, drop it and everything the scan found with it */
+static void bmd_lost(bmd_probe_s *const probe, const char *const msg)
+{
+	DEBUG_WARN("Target lost: %s\n", msg ? msg : "");
+	probe->t = NULL;
+	target_list_free();
+}
+
+/* Runs call on the attached target, result only takes its value if it returns */
+#define BMD_TRY(probe, result, call)           \
+	do {                                       \
+		volatile struct exception e;           \
+		TRY_CATCH (e, EXCEPTION_ALL) {         \
+			(result) = (call);                 \
+		}                                      \
+		if (e.type)                            \
+			bmd_lost((probe), e.msg);          \
+	} while (0)
+
+bmd_probe_s *bmd_open(const int argc, char **const argv)
+{
+	if (bmd_probe.opts)
+		return NULL;
+	memset(&bmd_probe, 0, sizeof(bmd_probe));
+	bmd_probe.opts = platform_open(argc, argv);
+	return bmd_probe.opts ? &bmd_probe : NULL;
+}
+
+void bmd_close(bmd_probe_s *const probe)
+{
+	if (!probe || !probe->opts)
+		return;
+	bmd_rtt_stop(probe);
+	bmd_detach(probe);
+	platform_close();
+	probe->opts = NULL;
+}
+
+size_t bmd_scan(bmd_probe_s *const probe)
+{
+	bmd_detach(probe);
+	volatile int targets = 0;
+	BMD_TRY(probe, targets, cl_scan(probe->opts));
+	return targets > 0 ? (size_t)targets : 0U;
+}
+
+bool bmd_attach(bmd_probe_s *const probe, const size_t n)
+{
+	bmd_detach(probe);
+	target *volatile t = NULL;
+	BMD_TRY(probe, t, target_attach_n(n, &bmd_controller));
+	probe->t = t;
+	return t != NULL;
+}
+
+void bmd_detach(bmd_probe_s *const probe)
+{
+	if (!probe->t)
+		return;
+	volatile bool done = false;
+	BMD_TRY(probe, done, (target_detach(probe->t), true));
+	probe->t = NULL;
+	(void)done;
+}
+
+bool bmd_mem_read(bmd_probe_s *const probe, void *const dest, const uint32_t src, const size_t len)
+{
+	if (!probe->t)
+		return false;
+	volatile bool result = false;
+	BMD_TRY(probe, result, !target_mem_read(probe->t, dest, src, len));
+	return result;
+}
+
+bool bmd_mem_write(bmd_probe_s *const probe, const uint32_t dest, const void *const src, const size_t len)
+{
+	if (!probe->t)
+		return false;
+	volatile bool result = false;
+	BMD_TRY(probe, result, !target_mem_write(probe->t, dest, src, len));
+	return result;
+}
+
+bool bmd_flash_erase(bmd_probe_s *const probe, const uint32_t addr, const size_t len)
+{
+	if (!probe->t)
+		return false;
+	volatile bool result = false;
+	BMD_TRY(probe, result, target_flash_erase(probe->t, addr, len));
+	return result;
+}
+
+bool bmd_flash_write(bmd_probe_s *const probe, const uint32_t dest, const void *const src, const size_t len)
+{
+	if (!probe->t)
+		return false;
+	volatile bool result = false;
+	BMD_TRY(probe, result, target_flash_write(probe->t, dest, src, len));
+	return result;
+}
+
+bool bmd_flash_complete(bmd_probe_s *const probe)
+{
+	if (!probe->t)
+		return false;
+	volatile bool result = false;
+	BMD_TRY(probe, result, target_flash_complete(probe->t));
+	return result;
+}
+
+bool bmd_reset(bmd_probe_s *const probe)
+{
+	if (!probe->t)
+		return false;
+	volatile bool result = false;
+	BMD_TRY(probe, result, (target_reset(probe->t), true));
+	return result;
+}
+
+static bool bmd_halt_wait(target *const t)
+{
+	target_halt_request(t);
+	platform_timeout timeout;
+	platform_timeout_set(&timeout, BMD_HALT_TIMEOUT_MS);
+	target_addr_t watch;
+	enum target_halt_reason reason;
+	while ((reason = target_halt_poll(t, &watch)) == TARGET_HALT_RUNNING) {
+		if (platform_timeout_is_expired(&timeout))
+			return false;
+	}
+	return reason != TARGET_HALT_ERROR;
+}
+
+bool bmd_halt(bmd_probe_s *const probe)
+{
+	if (!probe->t)
+		return false;
+	volatile bool result = false;
+	BMD_TRY(probe, result, bmd_halt_wait(probe->t));
+	return result;
+}
+
+bool bmd_resume(bmd_probe_s *const probe)
+{
+	if (!probe->t)
+		return false;
+	volatile bool result = false;
+	BMD_TRY(probe, result, (target_halt_resume(probe->t, false), true));
+	return result;
+}
+
+#ifdef ENABLE_RTT
+/* What the target writes goes to the channel's ring until bmd_rtt_read() takes it */
+static uint32_t bmd_rtt_write(const uint32_t channel, const char *const buf, const uint32_t len)
+{
+	/* Samples and anything else past the target's channels aren't kept */
+	if (channel >= MAX_RTT_CHAN)
+		return len;
+	bmd_rtt_ring_s *const ring = &bmd_probe.rtt[channel];
+	const size_t taken = MIN(len, sizeof(ring->data) - ring->len);
+	for (size_t i = 0; i < taken; ++i)
+		ring->data[(ring->head + ring->len + i) % sizeof(ring->data)] = buf[i];
+	ring->len += taken;
+	return taken;
+}
+
+static uint32_t bmd_rtt_space(const uint32_t channel)
+{
+	if (channel >= MAX_RTT_CHAN)
+		return UINT32_MAX;
+	return sizeof(bmd_probe.rtt[channel].data) - bmd_probe.rtt[channel].len;
+}
+
+static const rtt_if_sink_s bmd_rtt_sink = {
+	.write = bmd_rtt_write,
+	.space = bmd_rtt_space,
+};
+
+bool bmd_rtt_start(bmd_probe_s *const probe, const uint32_t cbaddr)
+{
+	if (!probe->t)
+		return false;
+	memset(probe->rtt, 0, sizeof(probe->rtt));
+	rtt_if_sink = &bmd_rtt_sink;
+	rtt_symbol_addr = cbaddr;
+	rtt_enabled = true;
+	rtt_found = false;
+	rtt_stats_reset();
+	return true;
+}
+
+void bmd_rtt_stop(bmd_probe_s *const probe)
+{
+	if (!rtt_if_sink)
+		return;
+	if (probe->t)
+		rtt_watch_disarm(probe->t);
+	rtt_enabled = false;
+	rtt_found = false;
+	rtt_if_sink = NULL;
+}
+
+size_t bmd_rtt_read(bmd_probe_s *const probe, const uint32_t channel, void *const buf, const size_t len)
+{
+	if (!probe->t || !rtt_if_sink || channel >= MAX_RTT_CHAN)
+		return 0;
+	bmd_rtt_ring_s *const ring = &probe->rtt[channel];
+	if (!ring->len) {
+		volatile uint32_t next_poll_us = 0;
+		BMD_TRY(probe, next_poll_us, poll_rtt(probe->t));
+		(void)next_poll_us;
+	}
+	const size_t count = MIN(len, ring->len);
+	uint8_t *const data = buf;
+	for (size_t i = 0; i < count; ++i)
+		data[i] = ring->data[(ring->head + i) % sizeof(ring->data)];
+	ring->head = (ring->head + count) % sizeof(ring->data);
+	ring->len -= count;
+	return count;
+}
+#else
+bool bmd_rtt_start(bmd_probe_s *const probe, const uint32_t cbaddr)
+{
+	(void)probe;
+	(void)cbaddr;
+	DEBUG_WARN("RTT needs a library built with ENABLE_RTT=1\n");
+	return false;
+}
+
+void bmd_rtt_stop(bmd_probe_s *const probe)
+{
+	(void)probe;
+}
+
+size_t bmd_rtt_read(bmd_probe_s *const probe, const uint32_t channel, void *const buf, const size_t len)
+{
+	(void)probe;
+	(void)channel;
+	(void)buf;
+	(void)len;
+	return 0;
+}
+#endif
@@ -0,0 +1,80 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PLATFORMS_HOSTED_LIBBLACKMAGIC_H
+#define PLATFORMS_HOSTED_LIBBLACKMAGIC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * libblackmagic: the hosted probe and target code as a library, for test
+ * harnesses that would otherwise start blackmagic once per operation. A probe
+ * is opened, scanned and attached once, then any number of operations run on
+ * the same session. Build it with `make PROBE_HOST=hosted libblackmagic.a`.
+ *
+ * The probe state is the process's own, so one probe is open at a time. Calls
+ * return false (or 0) on failure. A failure that loses the target, such as a
+ * timeout on the wire, also detaches from it; scan and attach again to go on.
+ */
+
+typedef struct bmd_probe bmd_probe_s;
+
+/*
+ * Opens the probe picked by the options blackmagic takes on its command line,
+ * argv[0] included, e.g. { "bmd", "-s", "7BB180B4" } or { "bmd", "-d", "/dev/ttyACM0" }.
+ * Options that set up the scan (-j, -A, -C, -U, -m, -p) and the SWJ frequency (-f)
+ * apply to the session. NULL if no probe was found or one is open already.
+ */
+bmd_probe_s *bmd_open(int argc, char **argv);
+void bmd_close(bmd_probe_s *probe);
+
+/* Scans for targets, returns how many were found */
+size_t bmd_scan(bmd_probe_s *probe);
+/* Attaches to target n of the last scan, counting from 1, detaching from the one before */
+bool bmd_attach(bmd_probe_s *probe, size_t n);
+void bmd_detach(bmd_probe_s *probe);
+
+bool bmd_mem_read(bmd_probe_s *probe, void *dest, uint32_t src, size_t len);
+bool bmd_mem_write(bmd_probe_s *probe, uint32_t dest, const void *src, size_t len);
+
+/*
+ * A flash session: erase and write as many ranges as needed, in any order,
+ * then complete the session to program what is still buffered.
+ */
+bool bmd_flash_erase(bmd_probe_s *probe, uint32_t addr, size_t len);
+bool bmd_flash_write(bmd_probe_s *probe, uint32_t dest, const void *src, size_t len);
+bool bmd_flash_complete(bmd_probe_s *probe);
+
+/* Resets the target, which stays halted when it was */
+bool bmd_reset(bmd_probe_s *probe);
+bool bmd_halt(bmd_probe_s *probe);
+bool bmd_resume(bmd_probe_s *probe);
+
+/*
+ * RTT, in a library built with ENABLE_RTT=1. Starting looks for the control
+ * block at cbaddr, or all over RAM with cbaddr 0. Reading polls the target
+ * once if nothing is buffered, then returns up to len bytes the target wrote
+ * on the channel. What the target writes while nobody reads is held up to
+ * a few KiB per channel, the rest is dropped and counted as an overflow.
+ */
+bool bmd_rtt_start(bmd_probe_s *probe, uint32_t cbaddr);
+void bmd_rtt_stop(bmd_probe_s *probe);
+size_t bmd_rtt_read(bmd_probe_s *probe, uint32_t channel, void *buf, size_t len);
+
+#endif /* PLATFORMS_HOSTED_LIBBLACKMAGIC_H */
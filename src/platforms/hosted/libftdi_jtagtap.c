@@ -27,6 +27,11 @@
 #include <assert.h>
 #include <ftdi.h>
 #include "ftdi_bmp.h"
+#include "exception.h"
+#include "adiv5.h"
+#include "jtag_scan.h"
+#include "swd_queue.h"
+#include "cli.h"
 
 
 extern cable_desc_t *active_cable;
@@ -128,3 +133,187 @@ static bool jtagtap_next(bool dTMS, bool dTDI)
 
 	return ret;
 }
+
+/*
+ * JTAG-DP queue in MPSSE mode: a run shifts all its scans with the TDO read
+ * backs deferred, so they come back in one USB transaction. As on the SW-DP
+ * queue, CTRL/STAT.ORUNDETECT is set for the run, so nothing after the first
+ * WAIT is executed and the run can resume from there. Each scan captures the
+ * result of the access before it, so a read is complete with the next scan.
+ */
+#define FTDI_JTAGDP_QUEUE_MAX 64U
+/* The CTRL/STAT writes around a run and the RDBUFF read collecting its last read */
+#define FTDI_JTAGDP_QUEUE_RESERVED 3U
+
+#define JTAGDP_ACK_OK   0x02U
+#define JTAGDP_ACK_WAIT 0x01U
+
+#define IR_DPACC 0xAU
+#define IR_APACC 0xBU
+
+/* Power request bits the DP is kept at, see adiv5_dp_init() */
+#define FTDI_JTAGDP_CTRLSTAT (ADIV5_DP_CTRLSTAT_CSYSPWRUPREQ | ADIV5_DP_CTRLSTAT_CDBGPWRUPREQ)
+
+typedef struct ftdi_jtagdp_transfer {
+	uint8_t RnW;
+	uint16_t addr;
+	uint32_t value;
+	uint32_t *result;
+	uint64_t response;
+} ftdi_jtagdp_transfer_s;
+
+static ftdi_jtagdp_transfer_s ftdi_jtagdp_transfers[FTDI_JTAGDP_QUEUE_MAX];
+static size_t ftdi_jtagdp_count;
+/* A run that had to be made because the queue was full has failed */
+static bool ftdi_jtagdp_failed;
+
+static void ftdi_jtagdp_add(uint8_t RnW, uint16_t addr, uint32_t value, uint32_t *result)
+{
+	if (!ftdi_jtagdp_count) {
+		ftdi_jtagdp_transfers[ftdi_jtagdp_count++] = (ftdi_jtagdp_transfer_s){
+			.RnW = ADIV5_LOW_WRITE,
+			.addr = ADIV5_DP_CTRLSTAT,
+			.value = FTDI_JTAGDP_CTRLSTAT | ADIV5_DP_CTRLSTAT_ORUNDETECT,
+		};
+	}
+	ftdi_jtagdp_transfers[ftdi_jtagdp_count++] = (ftdi_jtagdp_transfer_s){
+		.RnW = RnW,
+		.addr = addr,
+		.value = value,
+		.result = result,
+	};
+}
+
+static void ftdi_jtagdp_shift(ADIv5_DP_t *dp, ftdi_jtagdp_transfer_s *transfer)
+{
+	const uint64_t request = ((uint64_t)transfer->value << 3U) | ((transfer->addr >> 1U) & 0x06U) |
+		(transfer->RnW ? 1U : 0U);
+	jtag_dev_write_ir(&jtag_proc, dp->dp_jd_index, (transfer->addr & ADIV5_APnDP) ? IR_APACC : IR_DPACC);
+	transfer->response = 0;
+	jtag_dev_shift_dr(&jtag_proc, dp->dp_jd_index, (uint8_t *)&transfer->response, (const uint8_t *)&request, 35);
+	const size_t idle_cycles = adiv5_dp_idle_after(dp);
+	for (size_t cycles = 0; cycles < idle_cycles; cycles += 32U)
+		jtag_proc.jtagtap_tms_seq(0, MIN(idle_cycles - cycles, 32U));
+}
+
+/* Send everything queued as one sequence, returns true if an access failed */
+static bool ftdi_jtagdp_run(ADIv5_DP_t *dp)
+{
+	if (!ftdi_jtagdp_count)
+		return false;
+	/* The RDBUFF read collects the last read and waits for the last AP write to complete */
+	ftdi_jtagdp_add(ADIV5_LOW_READ, ADIV5_DP_RDBUFF, 0, NULL);
+	ftdi_jtagdp_add(ADIV5_LOW_WRITE, ADIV5_DP_CTRLSTAT, FTDI_JTAGDP_CTRLSTAT, NULL);
+	const size_t count = ftdi_jtagdp_count;
+	ftdi_jtagdp_count = 0;
+	if (dp->deferred_error)
+		return true;
+
+	DEBUG_PROBE("JTAG-DP queue run of %zu transfers\n", count);
+	libftdi_buffer_defer(true);
+	for (size_t i = 0; i < count; ++i)
+		ftdi_jtagdp_shift(dp, &ftdi_jtagdp_transfers[i]);
+	libftdi_buffer_defer(false);
+
+	size_t i = 0;
+	uint8_t ack = JTAGDP_ACK_OK;
+	for (; i < count; ++i) {
+		ack = ftdi_jtagdp_transfers[i].response & 0x07U;
+		if (ack != JTAGDP_ACK_OK)
+			break;
+		adiv5_dp_idle_tune(dp, 0);
+		const ftdi_jtagdp_transfer_s *before = i ? &ftdi_jtagdp_transfers[i - 1U] : NULL;
+		if (before && before->RnW && before->result)
+			*before->result = (uint32_t)(ftdi_jtagdp_transfers[i].response >> 3U);
+	}
+	if (i == count)
+		return false;
+
+	if (ack != JTAGDP_ACK_WAIT) {
+		if (cl_debuglevel & BMP_DEBUG_TARGET)
+			DEBUG_WARN("Invalid ACK %u in JTAG-DP queue\n", ack);
+		fw_adiv5_jtagdp_low_access(
+			dp, ADIV5_LOW_WRITE, ADIV5_DP_CTRLSTAT, FTDI_JTAGDP_CTRLSTAT | ADIV5_DP_CTRLSTAT_STICKYORUN);
+		adiv5_dp_raise(dp, EXCEPTION_ERROR, "JTAG-DP invalid ACK");
+		return true;
+	}
+
+	/* Give the transfers of the next runs more time to avoid this */
+	adiv5_dp_idle_tune(dp, 1);
+	/*
+	 * The WAIT scan did not capture the result of the access before it, but as
+	 * nothing ran since, the next scan does. A RDBUFF read does nothing itself.
+	 */
+	uint32_t *pending = i && ftdi_jtagdp_transfers[i - 1U].RnW ? ftdi_jtagdp_transfers[i - 1U].result : NULL;
+	if (pending) {
+		*pending = fw_adiv5_jtagdp_low_access(dp, ADIV5_LOW_READ, ADIV5_DP_RDBUFF, 0);
+		pending = NULL;
+	}
+	/* Clear the overrun and leave overrun detection off again */
+	fw_adiv5_jtagdp_low_access(
+		dp, ADIV5_LOW_WRITE, ADIV5_DP_CTRLSTAT, FTDI_JTAGDP_CTRLSTAT | ADIV5_DP_CTRLSTAT_STICKYORUN);
+	/* Finish one transfer at a time, leaving out the CTRL/STAT write that just happened */
+	for (; i < count - 1U && !dp->fault; ++i) {
+		const ftdi_jtagdp_transfer_s *transfer = &ftdi_jtagdp_transfers[i];
+		const uint32_t captured = fw_adiv5_jtagdp_low_access(dp, transfer->RnW, transfer->addr, transfer->value);
+		if (pending)
+			*pending = captured;
+		pending = transfer->RnW ? transfer->result : NULL;
+	}
+	/* The trailing RDBUFF read never has a result to collect */
+	return dp->fault;
+}
+
+static void ftdi_jtagdp_reserve(ADIv5_DP_t *dp)
+{
+	if (ftdi_jtagdp_count + 1U + FTDI_JTAGDP_QUEUE_RESERVED > FTDI_JTAGDP_QUEUE_MAX && ftdi_jtagdp_run(dp))
+		ftdi_jtagdp_failed = true;
+}
+
+static void ftdi_jtagdp_queue_read(ADIv5_DP_t *dp, uint16_t addr, uint32_t *result)
+{
+	ftdi_jtagdp_reserve(dp);
+	/* Once a run failed, anything after it would act on the wrong TAR */
+	if (!ftdi_jtagdp_failed)
+		ftdi_jtagdp_add(ADIV5_LOW_READ, addr, 0, result);
+}
+
+static void ftdi_jtagdp_queue_write(ADIv5_DP_t *dp, uint16_t addr, uint32_t value)
+{
+	ftdi_jtagdp_reserve(dp);
+	if (!ftdi_jtagdp_failed)
+		ftdi_jtagdp_add(ADIV5_LOW_WRITE, addr, value, NULL);
+}
+
+static bool ftdi_jtagdp_queue_flush(ADIv5_DP_t *dp)
+{
+	volatile bool failed = false;
+	volatile struct exception e;
+	TRY_CATCH (e, EXCEPTION_ALL) {
+		failed = ftdi_jtagdp_run(dp);
+	}
+	/* Never leave a half built queue behind */
+	libftdi_buffer_defer(false);
+	ftdi_jtagdp_count = 0;
+	failed |= ftdi_jtagdp_failed;
+	ftdi_jtagdp_failed = false;
+	if (e.type)
+		raise_exception(e.type, e.msg);
+	if (failed)
+		adiv5_dp_error(dp);
+	return failed;
+}
+
+int libftdi_jtagdp_init(ADIv5_DP_t *dp)
+{
+	dp->dp_read = fw_adiv5_jtagdp_read;
+	dp->error = adiv5_jtagdp_error;
+	dp->low_access = fw_adiv5_jtagdp_low_access;
+	dp->abort = adiv5_jtagdp_abort;
+	dp->queue_read = ftdi_jtagdp_queue_read;
+	dp->queue_write = ftdi_jtagdp_queue_write;
+	dp->queue_flush = ftdi_jtagdp_queue_flush;
+	dp->mem_read = swd_queue_mem_read;
+	dp->mem_write_sized = swd_queue_mem_write_sized;
+	return 1;
+}
@@ -26,6 +26,7 @@
 
 #include <ftdi.h>
 #include "ftdi_bmp.h"
+#include "swd_queue.h"
 
 enum  swdio_status{
 	SWDIO_STATUS_DRIVE = 0,
@@ -125,6 +126,84 @@ static uint32_t swdptap_seq_in(size_t clock_cycles);
 static void swdptap_seq_out(uint32_t tms_states, size_t clock_cycles);
 static void swdptap_seq_out_parity(uint32_t tms_states, size_t clock_cycles);
 
+/*
+ * In MPSSE mode a queue run is compiled into one command stream, with a single
+ * read back of one ACK byte per transfer, for reads followed by four data bytes
+ * and a parity byte. The size keeps both well inside the FTDI buffers.
+ */
+#define FTDI_SWD_QUEUE_MAX 64U
+
+static swd_queue_transfer_s ftdi_swd_transfers[FTDI_SWD_QUEUE_MAX];
+
+static void ftdi_swd_run(ADIv5_DP_t *dp, swd_queue_transfer_s *transfers, size_t count)
+{
+	firmware_swdp_select(dp);
+	size_t rsize = 0;
+	for (size_t i = 0; i < count; ++i) {
+		const swd_queue_transfer_s *transfer = &transfers[i];
+		const uint8_t request = make_packet_request(transfer->RnW, transfer->addr);
+		swdptap_turnaround(SWDIO_STATUS_DRIVE);
+		libftdi_jtagtap_tdi_tdo_seq(NULL, 0, &request, 8);
+		swdptap_turnaround(SWDIO_STATUS_FLOAT);
+		const uint8_t ack_cmd[2] = {MPSSE_DO_READ | MPSSE_LSB | MPSSE_BITMODE, 2};
+		libftdi_buffer_write(ack_cmd, sizeof(ack_cmd));
+		++rsize;
+		if (transfer->RnW) {
+			const uint8_t data_cmd[5] = {MPSSE_DO_READ | MPSSE_LSB, 3, 0, MPSSE_DO_READ | MPSSE_LSB | MPSSE_BITMODE, 0};
+			libftdi_buffer_write(data_cmd, sizeof(data_cmd));
+			rsize += 5U;
+		} else {
+			/* Data, parity and 8 idle cycles to move the data through the SW-DP */
+			const uint8_t data[6] = {
+				transfer->value & 0xffU,
+				(transfer->value >> 8U) & 0xffU,
+				(transfer->value >> 16U) & 0xffU,
+				(transfer->value >> 24U) & 0xffU,
+				__builtin_parity(transfer->value) & 1U,
+				0,
+			};
+			swdptap_turnaround(SWDIO_STATUS_DRIVE);
+			libftdi_jtagtap_tdi_tdo_seq(NULL, 0, data, 32 + 1 + 8);
+		}
+	}
+
+	uint8_t response[FTDI_SWD_QUEUE_MAX * 6U];
+	libftdi_buffer_read(response, rsize);
+	const uint8_t *res = response;
+	for (size_t i = 0; i < count; ++i) {
+		swd_queue_transfer_s *transfer = &transfers[i];
+		/* Bit mode reads shift in from the top of the byte */
+		transfer->ack = *res++ >> 5U;
+		if (transfer->RnW) {
+			transfer->value = res[0] | (res[1] << 8U) | (res[2] << 16U) | ((uint32_t)res[3] << 24U);
+			transfer->parity_error = (__builtin_parity(transfer->value) ^ (res[4] >> 7U)) & 1U;
+			res += 5U;
+		}
+	}
+}
+
+static swd_queue_s ftdi_swd_queue = {
+	.transfers = ftdi_swd_transfers,
+	.size = FTDI_SWD_QUEUE_MAX,
+	.run = ftdi_swd_run,
+	.line_reset = firmware_swdp_line_reset,
+};
+
+static void ftdi_swdp_queue_read(ADIv5_DP_t *dp, uint16_t addr, uint32_t *result)
+{
+	swd_queue_read(&ftdi_swd_queue, dp, addr, result);
+}
+
+static void ftdi_swdp_queue_write(ADIv5_DP_t *dp, uint16_t addr, uint32_t value)
+{
+	swd_queue_write(&ftdi_swd_queue, dp, addr, value);
+}
+
+static bool ftdi_swdp_queue_flush(ADIv5_DP_t *dp)
+{
+	return swd_queue_flush(&ftdi_swd_queue, dp);
+}
+
 bool libftdi_swd_possible(bool *do_mpsse, bool *direct_bb_swd)
 {
 	const bool swd_read =
@@ -212,6 +291,13 @@ int libftdi_swdptap_init(ADIv5_DP_t *dp)
 	dp->error = firmware_swdp_error;
 	dp->low_access = firmware_swdp_low_access;
 	dp->abort = firmware_swdp_abort;
+	if (do_mpsse) {
+		dp->queue_read = ftdi_swdp_queue_read;
+		dp->queue_write = ftdi_swdp_queue_write;
+		dp->queue_flush = ftdi_swdp_queue_flush;
+		dp->mem_read = swd_queue_mem_read;
+		dp->mem_write_sized = swd_queue_mem_write_sized;
+	}
 	return 0;
 }
 
@@ -0,0 +1,470 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Metrics endpoint. Scrapes have to be answered while the protocol thread is
+ * blocked waiting on GDB, so a thread of its own serves them, one request per
+ * connection. It never touches the live counters: the protocol thread copies
+ * them into a snapshot under a lock whenever they may have moved, which is
+ * after each GDB packet and every so often from the scheduler while the target
+ * runs and RTT and SWO are being counted. Between those nothing changes.
+ *
+ * Counter names are made from the 'monitor stats' labels, so "GDB bytes sent"
+ * is exported as blackmagic_gdb_bytes_sent_total and "gdb_bytes_sent" in JSON.
+ * Packet latencies are a Prometheus histogram with the same buckets as there.
+ */
+
+#include "general.h"
+#include "metrics_if.h"
+#include "scheduler.h"
+#include "stats.h"
+
+#if !defined(_WIN32) && !defined(__CYGWIN__)
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#define METRICS_IF_REQUEST_SIZE 2048U
+#define METRICS_IF_OUT_SIZE     (64U * 1024U)
+#define METRICS_IF_POLL_US      100000U
+#define METRICS_IF_PUBLISH_US   250000U
+#define METRICS_IF_NAME_LENGTH  64U
+
+typedef enum metrics_format {
+	METRICS_PROMETHEUS,
+	METRICS_JSON,
+} metrics_format_e;
+
+typedef struct metrics_out {
+	char *buf;
+	size_t size;
+	size_t len;
+} metrics_out_s;
+
+static int metrics_serv = -1;
+static char metrics_socket_path[sizeof(((struct sockaddr_un *)NULL)->sun_path)];
+static pthread_t metrics_thread;
+static atomic_bool metrics_stop;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static stats_s metrics_stats;
+static uint32_t metrics_start_ms;
+static char metrics_probe[256];
+static char metrics_serial[64];
+static char metrics_version[256];
+
+static void metrics_printf(metrics_out_s *const out, const char *const format, ...)
+{
+	while (out->buf) {
+		va_list args;
+		va_start(args, format);
+		const int len = vsnprintf(out->buf + out->len, out->size - out->len, format, args);
+		va_end(args);
+		if (len < 0)
+			return;
+		if (out->len + (size_t)len < out->size) {
+			out->len += (size_t)len;
+			return;
+		}
+		/* Didn't fit, grow and format it again */
+		char *const buf = realloc(out->buf, out->size * 2U);
+		if (!buf) { /* realloc failed: heap exhaustion */
+			DEBUG_WARN("realloc: failed in %s\n", __func__);
+			free(out->buf);
+			out->buf = NULL;
+			return;
+		}
+		out->buf = buf;
+		out->size *= 2U;
+	}
+}
+
+/* A string as the inside of a quoted label value or JSON string, anything unprintable becomes '?' */
+static void metrics_print_string(metrics_out_s *const out, const char *const str)
+{
+	for (const char *c = str; *c; ++c) {
+		if (*c == '"' || *c == '\\')
+			metrics_printf(out, "\\%c", *c);
+		else
+			metrics_printf(out, "%c", *c >= ' ' && *c < 0x7f ? *c : '?');
+	}
+}
+
+/* "DP WAIT responses" -> "dp_wait_responses" */
+static void metrics_counter_name(char *const name, const stats_counter_e counter)
+{
+	const char *const label = stats_counter_name(counter);
+	size_t len = 0;
+	for (const char *c = label; *c && len < METRICS_IF_NAME_LENGTH - 1U; ++c)
+		name[len++] = *c == ' ' ? '_' : (char)tolower((unsigned char)*c);
+	name[len] = '\0';
+}
+
+/* Upper bound of a histogram bucket in seconds, the last one has none */
+static double metrics_bucket_limit(const size_t bucket)
+{
+	return (double)(1ULL << (STATS_HISTOGRAM_SHIFT * (bucket + 1U))) / 1e6;
+}
+
+static void metrics_packet_family(
+	metrics_out_s *const out, const char *const name, const char *const type, const char *const help)
+{
+	metrics_printf(out, "# HELP blackmagic_%s %s\n# TYPE blackmagic_%s %s\n", name, help, name, type);
+}
+
+static void metrics_packet_label(metrics_out_s *const out, const char *const metric, const stats_packet_s *const entry)
+{
+	metrics_printf(out, "blackmagic_%s{packet=\"", metric);
+	metrics_print_string(out, entry->name);
+	metrics_printf(out, "\"");
+}
+
+static void metrics_format_prometheus(metrics_out_s *const out, const stats_s *const stats, const double uptime)
+{
+	metrics_printf(out, "# HELP blackmagic_probe_info The probe being served\n# TYPE blackmagic_probe_info gauge\n");
+	metrics_printf(out, "blackmagic_probe_info{probe=\"");
+	metrics_print_string(out, metrics_probe);
+	metrics_printf(out, "\",serial=\"");
+	metrics_print_string(out, metrics_serial);
+	metrics_printf(out, "\",version=\"");
+	metrics_print_string(out, metrics_version);
+	metrics_printf(out, "\"} 1\n");
+	metrics_printf(out,
+		"# HELP blackmagic_uptime_seconds Time since BMDA started\n# TYPE blackmagic_uptime_seconds gauge\n"
+		"blackmagic_uptime_seconds %.3f\n",
+		uptime);
+
+	for (size_t i = 0; i < STATS_COUNTER_COUNT; ++i) {
+		char name[METRICS_IF_NAME_LENGTH];
+		metrics_counter_name(name, (stats_counter_e)i);
+		metrics_printf(out, "# HELP blackmagic_%s_total %s\n# TYPE blackmagic_%s_total counter\n", name,
+			stats_counter_name((stats_counter_e)i), name);
+		metrics_printf(out, "blackmagic_%s_total %" PRIu64 "\n", name, stats->counters[i]);
+	}
+
+	/* Every sample of a family has to come together, so each goes over the packet types again */
+	metrics_packet_family(out, "gdb_packets_total", "counter", "GDB packets handled, by type");
+	for (size_t i = 0; i < STATS_MAX_PACKET_TYPES && stats->packets[i].count; ++i) {
+		metrics_packet_label(out, "gdb_packets_total", &stats->packets[i]);
+		metrics_printf(out, "} %" PRIu32 "\n", stats->packets[i].count);
+	}
+	metrics_packet_family(out, "gdb_packet_bytes_total", "counter", "GDB packet bytes received, by type");
+	for (size_t i = 0; i < STATS_MAX_PACKET_TYPES && stats->packets[i].count; ++i) {
+		metrics_packet_label(out, "gdb_packet_bytes_total", &stats->packets[i]);
+		metrics_printf(out, "} %" PRIu64 "\n", stats->packets[i].total_bytes);
+	}
+	metrics_packet_family(
+		out, "gdb_packet_duration_seconds", "histogram", "Time taken handling GDB packets, by type");
+	for (size_t i = 0; i < STATS_MAX_PACKET_TYPES && stats->packets[i].count; ++i) {
+		const stats_packet_s *const entry = &stats->packets[i];
+		uint32_t cumulative = 0;
+		for (size_t bucket = 0; bucket < STATS_HISTOGRAM_BUCKETS; ++bucket) {
+			cumulative += entry->histogram[bucket];
+			metrics_packet_label(out, "gdb_packet_duration_seconds_bucket", entry);
+			if (bucket < STATS_HISTOGRAM_BUCKETS - 1U)
+				metrics_printf(out, ",le=\"%g\"} %" PRIu32 "\n", metrics_bucket_limit(bucket), cumulative);
+			else
+				metrics_printf(out, ",le=\"+Inf\"} %" PRIu32 "\n", cumulative);
+		}
+		metrics_packet_label(out, "gdb_packet_duration_seconds_sum", entry);
+		metrics_printf(out, "} %.6f\n", (double)entry->total_time / 1e6);
+		metrics_packet_label(out, "gdb_packet_duration_seconds_count", entry);
+		metrics_printf(out, "} %" PRIu32 "\n", entry->count);
+	}
+	metrics_packet_family(
+		out, "gdb_packet_duration_max_seconds", "gauge", "Longest time taken handling a GDB packet, by type");
+	for (size_t i = 0; i < STATS_MAX_PACKET_TYPES && stats->packets[i].count; ++i) {
+		metrics_packet_label(out, "gdb_packet_duration_max_seconds", &stats->packets[i]);
+		metrics_printf(out, "} %.6f\n", (double)stats->packets[i].max_time / 1e6);
+	}
+	metrics_printf(out,
+		"# HELP blackmagic_gdb_packets_untracked_total GDB packets of types beyond those tracked\n"
+		"# TYPE blackmagic_gdb_packets_untracked_total counter\n"
+		"blackmagic_gdb_packets_untracked_total %" PRIu32 "\n",
+		stats->dropped_packets);
+}
+
+static void metrics_format_json(metrics_out_s *const out, const stats_s *const stats, const double uptime)
+{
+	metrics_printf(out, "{\"probe\":{\"name\":\"");
+	metrics_print_string(out, metrics_probe);
+	metrics_printf(out, "\",\"serial\":\"");
+	metrics_print_string(out, metrics_serial);
+	metrics_printf(out, "\",\"version\":\"");
+	metrics_print_string(out, metrics_version);
+	metrics_printf(out, "\"},\"uptime_seconds\":%.3f,\"counters\":{", uptime);
+	for (size_t i = 0; i < STATS_COUNTER_COUNT; ++i) {
+		char name[METRICS_IF_NAME_LENGTH];
+		metrics_counter_name(name, (stats_counter_e)i);
+		metrics_printf(out, "%s\"%s\":%" PRIu64, i ? "," : "", name, stats->counters[i]);
+	}
+	metrics_printf(out, "},\"histogram_limits_us\":[");
+	for (size_t bucket = 0; bucket < STATS_HISTOGRAM_BUCKETS - 1U; ++bucket)
+		metrics_printf(out, "%s%" PRIu32, bucket ? "," : "", 1U << (STATS_HISTOGRAM_SHIFT * (bucket + 1U)));
+	metrics_printf(out, "],\"packets\":[");
+	for (size_t i = 0; i < STATS_MAX_PACKET_TYPES && stats->packets[i].count; ++i) {
+		const stats_packet_s *const entry = &stats->packets[i];
+		metrics_printf(out, "%s{\"packet\":\"", i ? "," : "");
+		metrics_print_string(out, entry->name);
+		metrics_printf(out,
+			"\",\"count\":%" PRIu32 ",\"bytes\":%" PRIu64 ",\"total_us\":%" PRIu64 ",\"max_us\":%" PRIu32
+			",\"histogram\":[",
+			entry->count, entry->total_bytes, entry->total_time, entry->max_time);
+		for (size_t bucket = 0; bucket < STATS_HISTOGRAM_BUCKETS; ++bucket)
+			metrics_printf(out, "%s%" PRIu32, bucket ? "," : "", entry->histogram[bucket]);
+		metrics_printf(out, "]}");
+	}
+	metrics_printf(out, "],\"untracked_packets\":%" PRIu32 "}\n", stats->dropped_packets);
+}
+
+static bool metrics_send(const int conn, const char *data, size_t len)
+{
+	while (len) {
+		const ssize_t sent = send(conn, data, len, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent <= 0)
+			return false;
+		data += sent;
+		len -= (size_t)sent;
+	}
+	return true;
+}
+
+static void metrics_respond(const int conn, const char *const status, const char *const type, const metrics_out_s *body)
+{
+	char header[256];
+	const int len = snprintf(header, sizeof(header),
+		"HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", status, type,
+		body ? body->len : 0U);
+	if (metrics_send(conn, header, (size_t)len) && body)
+		metrics_send(conn, body->buf, body->len);
+}
+
+/* Reads up to the end of the request head, only the request line matters */
+static void metrics_serve(const int conn)
+{
+	char request[METRICS_IF_REQUEST_SIZE];
+	size_t len = 0;
+	while (len < sizeof(request) - 1U) {
+		const ssize_t count = recv(conn, request + len, sizeof(request) - 1U - len, 0);
+		if (count < 0 && errno == EINTR)
+			continue;
+		if (count <= 0)
+			return;
+		len += (size_t)count;
+		request[len] = '\0';
+		if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+			break;
+	}
+	request[len] = '\0';
+
+	char path[128];
+	if (sscanf(request, "GET %127[^ ?\r\n]", path) != 1) {
+		metrics_respond(conn, "405 Method Not Allowed", "text/plain", NULL);
+		return;
+	}
+	metrics_format_e format;
+	if (!strcmp(path, "/") || !strcmp(path, "/metrics"))
+		format = METRICS_PROMETHEUS;
+	else if (!strcmp(path, "/metrics.json"))
+		format = METRICS_JSON;
+	else {
+		metrics_respond(conn, "404 Not Found", "text/plain", NULL);
+		return;
+	}
+
+	/* Format from a copy, so the protocol thread is never held up by a slow scrape */
+	stats_s *const stats = malloc(sizeof(*stats));
+	metrics_out_s out = {.buf = malloc(METRICS_IF_OUT_SIZE), .size = METRICS_IF_OUT_SIZE, .len = 0};
+	if (!stats || !out.buf) { /* malloc failed: heap exhaustion */
+		DEBUG_WARN("malloc: failed in %s\n", __func__);
+		free(stats);
+		free(out.buf);
+		return;
+	}
+	pthread_mutex_lock(&metrics_lock);
+	memcpy(stats, &metrics_stats, sizeof(*stats));
+	pthread_mutex_unlock(&metrics_lock);
+	const double uptime = (double)(platform_time_ms() - metrics_start_ms) / 1000.0;
+
+	if (format == METRICS_PROMETHEUS)
+		metrics_format_prometheus(&out, stats, uptime);
+	else
+		metrics_format_json(&out, stats, uptime);
+	if (out.buf)
+		metrics_respond(conn, "200 OK",
+			format == METRICS_PROMETHEUS ? "text/plain; version=0.0.4; charset=utf-8" : "application/json", &out);
+	free(out.buf);
+	free(stats);
+}
+
+static void *metrics_if_thread(void *const arg)
+{
+	(void)arg;
+	while (!atomic_load(&metrics_stop)) {
+		fd_set fds;
+		FD_ZERO(&fds);
+		FD_SET(metrics_serv, &fds);
+		struct timeval tv = {.tv_sec = 0, .tv_usec = METRICS_IF_POLL_US};
+		if (select(metrics_serv + 1, &fds, NULL, NULL, &tv) <= 0)
+			continue;
+		const int conn = accept(metrics_serv, NULL, NULL);
+		if (conn == -1)
+			continue;
+		/* A client that stops reading or writing mustn't keep the next scrape out */
+		const struct timeval timeout = {1, 0};
+		setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		metrics_serve(conn);
+		close(conn);
+	}
+	return NULL;
+}
+
+void metrics_if_publish(void)
+{
+	if (metrics_serv == -1)
+		return;
+	pthread_mutex_lock(&metrics_lock);
+	memcpy(&metrics_stats, stats_get(), sizeof(metrics_stats));
+	pthread_mutex_unlock(&metrics_lock);
+}
+
+static uint32_t metrics_if_poll(void)
+{
+	metrics_if_publish();
+	return METRICS_IF_PUBLISH_US;
+}
+
+static int metrics_if_listen_unix(const char *const path)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		DEBUG_WARN("metrics: socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	/* A socket left behind by an earlier run is in the way, anything else there is not ours to remove */
+	struct stat st;
+	if (!stat(path, &st) && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	const int serv = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (serv == -1)
+		return -1;
+	if (bind(serv, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(serv, 4) == -1) {
+		DEBUG_WARN("metrics: can not listen on %s: %s\n", path, strerror(errno));
+		close(serv);
+		return -1;
+	}
+	strcpy(metrics_socket_path, path);
+	DEBUG_WARN("Metrics on %s\n", path);
+	return serv;
+}
+
+static int metrics_if_listen_tcp(const uint16_t port)
+{
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	const int serv = socket(PF_INET, SOCK_STREAM, 0);
+	if (serv == -1)
+		return -1;
+	const int opt = 1;
+	if (setsockopt(serv, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1 ||
+		bind(serv, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(serv, 4) == -1) {
+		DEBUG_WARN("metrics: can not listen on TCP port %u: %s\n", port, strerror(errno));
+		close(serv);
+		return -1;
+	}
+	DEBUG_WARN("Metrics on TCP: %u\n", port);
+	return serv;
+}
+
+bool metrics_if_init(const char *const listen, const bmp_info_t *const info)
+{
+	char *end;
+	const unsigned long port = strtoul(listen, &end, 10);
+	if (*listen && !*end)
+		metrics_serv = port && port <= UINT16_MAX ? metrics_if_listen_tcp((uint16_t)port) : -1;
+	else
+		metrics_serv = metrics_if_listen_unix(listen);
+	if (metrics_serv == -1)
+		return false;
+
+	metrics_start_ms = platform_time_ms();
+	snprintf(metrics_probe, sizeof(metrics_probe), "%s", info->product);
+	snprintf(metrics_serial, sizeof(metrics_serial), "%s", info->serial);
+	snprintf(metrics_version, sizeof(metrics_version), "%s", info->version);
+	metrics_if_publish();
+	atomic_store(&metrics_stop, false);
+	if (pthread_create(&metrics_thread, NULL, metrics_if_thread, NULL)) {
+		DEBUG_WARN("metrics: can not start the endpoint's thread\n");
+		atomic_store(&metrics_stop, true);
+		metrics_if_exit();
+		return false;
+	}
+	scheduler_add(metrics_if_poll);
+	return true;
+}
+
+void metrics_if_exit(void)
+{
+	if (metrics_serv == -1)
+		return;
+	scheduler_remove(metrics_if_poll);
+	if (!atomic_load(&metrics_stop)) {
+		atomic_store(&metrics_stop, true);
+		pthread_join(metrics_thread, NULL);
+	}
+	close(metrics_serv);
+	metrics_serv = -1;
+	if (metrics_socket_path[0])
+		unlink(metrics_socket_path);
+	metrics_socket_path[0] = '\0';
+}
+#else
+bool metrics_if_init(const char *const listen, const bmp_info_t *const info)
+{
+	(void)listen;
+	(void)info;
+	DEBUG_WARN("The metrics endpoint is not supported on this platform\n");
+	return false;
+}
+
+void metrics_if_exit(void)
+{
+}
+
+void metrics_if_publish(void)
+{
+}
+#endif
@@ -0,0 +1,37 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PLATFORMS_HOSTED_METRICS_IF_H
+#define PLATFORMS_HOSTED_METRICS_IF_H
+
+#include <stdbool.h>
+
+#include "bmp_hosted.h"
+
+/*
+ * Serve the 'monitor stats' counters over HTTP for monitoring, on a TCP port
+ * when listen is a number and on a Unix socket at that path otherwise.
+ * GET /metrics answers in the Prometheus text format, GET /metrics.json with
+ * the same as JSON. The probe in info is reported for telling fixtures apart.
+ */
+bool metrics_if_init(const char *listen, const bmp_info_t *info);
+void metrics_if_exit(void);
+
+/* Hand the endpoint the counts as they are now, after each GDB packet and while the target runs */
+void metrics_if_publish(void);
+
+#endif /* PLATFORMS_HOSTED_METRICS_IF_H */
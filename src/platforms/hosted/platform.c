@@ -28,7 +28,10 @@
 #include "timing.h"
 #include "cli.h"
 #include "gdb_if.h"
+#include "scheduler.h"
 #include <signal.h>
+#include <getopt.h>
+#include <limits.h>
 
 #ifdef ENABLE_RTT
 #include "rtt_if.h"
@@ -40,12 +43,24 @@
 #include "ftdi_bmp.h"
 #include "jlink.h"
 #include "cmsis_dap.h"
+#include "timeline.h"
+#include "wire_trace.h"
+#include "remote_server.h"
+#include "sim.h"
+#include "io_sink.h"
+#include "metrics_if.h"
+#if HOSTED_BMP_ONLY != 1
+#include "swo_if.h"
+#include "remote_bulk.h"
+#endif
 
 bmp_info_t info;
 
 jtag_proc_t jtag_proc;
 
 static BMP_CL_OPTIONS_t cl_opts;
+/* Whether the probe is talked to over the serial port, which platform_close() then closes */
+static bool serial_opened;
 
 void gdb_ident(char *p, int count)
 {
@@ -54,6 +69,13 @@ void gdb_ident(char *p, int count)
 
 static void exit_function(void)
 {
+#if HOSTED_BMP_ONLY != 1
+	swo_if_exit();
+	remote_bulk_exit();
+#endif
+	timeline_exit();
+	metrics_if_exit();
+	wire_trace_close();
 	libusb_exit_function(&info);
 
 	switch (info.bmp_type) {
@@ -61,6 +83,10 @@ static void exit_function(void)
 		dap_exit_function();
 		break;
 
+	case BMP_TYPE_SIM:
+		sim_exit();
+		break;
+
 	default:
 		break;
 	}
@@ -68,6 +94,7 @@ static void exit_function(void)
 #ifdef ENABLE_RTT
 	rtt_if_exit();
 #endif
+	io_sink_stdout_close();
 	fflush(stdout);
 }
 
@@ -78,63 +105,143 @@ static void sigterm_handler(int sig)
 	exit(0);
 }
 
-void platform_init(int argc, char **argv)
+/* Opens the probe cl_opts picks, false if there is none or it can't be set up */
+static bool platform_probe_open(void)
 {
-	cl_init(&cl_opts, argc, argv);
-	atexit(exit_function);
-	signal(SIGTERM, sigterm_handler);
-	signal(SIGINT, sigterm_handler);
-
-	if (cl_opts.opt_device)
+	if (cl_opts.opt_replay) {
+		if (!wire_trace_replay_open(cl_opts.opt_replay, &info))
+			return false;
+	} else if (cl_opts.opt_sim) {
+		if (!sim_init(&info, cl_opts.opt_sim))
+			return false;
+	} else if (cl_opts.opt_device)
 		info.bmp_type = BMP_TYPE_BMP;
 	else if (find_debuggers(&cl_opts, &info))
-		exit(-1);
+		return false;
 
 	bmp_ident(&info);
+	if (cl_opts.opt_record && !wire_trace_record_open(cl_opts.opt_record, &info))
+		return false;
 
 	switch (info.bmp_type) {
 	case BMP_TYPE_BMP:
+		/* The trace answers for the probe */
+		if (wire_trace_replaying()) {
+			remote_init();
+			break;
+		}
+#if HOSTED_BMP_ONLY != 1
+		/* Unless a serial device was named, skip the tty when the probe takes the remote protocol over raw bulk */
+		if (!cl_opts.opt_device && remote_bulk_init(&info)) {
+			remote_init();
+			break;
+		}
+#endif
 		if (serial_open(&cl_opts, info.serial))
-			exit(-1);
+			return false;
+		serial_opened = true;
 		remote_init();
 		break;
 
 	case BMP_TYPE_STLINKV2:
 		if (stlink_init(&info))
-			exit(-1);
+			return false;
 		break;
 
 	case BMP_TYPE_CMSIS_DAP:
 		if (dap_init(&info))
-			exit(-1);
+			return false;
 		break;
 
 	case BMP_TYPE_LIBFTDI:
 		if (ftdi_bmp_init(&cl_opts, &info))
-			exit(-1);
+			return false;
 		break;
 
 	case BMP_TYPE_JLINK:
 		if (jlink_init(&info))
-			exit(-1);
+			return false;
+		break;
+
+	case BMP_TYPE_SIM:
 		break;
 
 	default:
+		return false;
+	}
+	return true;
+}
+
+void platform_init(int argc, char **argv)
+{
+	cl_init(&cl_opts, argc, argv);
+	/* Returns in a process of its own for each probe */
+	if (cl_opts.opt_serial && strchr(cl_opts.opt_serial, ','))
+		cl_gang_execute(&cl_opts);
+	atexit(exit_function);
+	signal(SIGTERM, sigterm_handler);
+	signal(SIGINT, sigterm_handler);
+
+	if (!platform_probe_open())
 		exit(-1);
+
+	if (cl_opts.opt_serve_port) {
+		/* The client drives the wire itself until it finds the high level commands */
+		if (info.bmp_type == BMP_TYPE_STLINKV2 || info.bmp_type == BMP_TYPE_JLINK) {
+			DEBUG_WARN("This probe can not be served, it has no SWD/JTAG level access\n");
+			exit(-1);
+		}
+		exit(remote_server_run(cl_opts.opt_serve_port));
 	}
 
 	if (cl_opts.opt_mode != BMP_MODE_DEBUG)
 		exit(cl_execute(&cl_opts));
 	else {
 		gdb_if_init();
+		gdb_if_listen_targets(cl_opts.opt_target_ports);
 
 #ifdef ENABLE_RTT
+		rtt_if_port = cl_opts.opt_rtt_port;
 		rtt_if_init();
+#endif
+		if (cl_opts.opt_timeline && !timeline_init(cl_opts.opt_timeline, cl_opts.opt_timeline_lz4))
+			exit(-1);
+		if (cl_opts.opt_metrics && !metrics_if_init(cl_opts.opt_metrics, &info))
+			exit(-1);
+#if HOSTED_BMP_ONLY != 1
+		/* The timeline takes SWO whenever the probe can capture it */
+		if ((cl_opts.opt_swo || (cl_opts.opt_timeline && info.bmp_type == BMP_TYPE_BMP)) &&
+			!swo_if_init(&info, cl_opts.opt_swo, cl_opts.opt_swo_baud))
+			exit(-1);
 #endif
 		return;
 	}
 }
 
+BMP_CL_OPTIONS_t *platform_open(int argc, char **argv)
+{
+	memset(&cl_opts, 0, sizeof(cl_opts));
+	memset(&info, 0, sizeof(info));
+	/* getopt starts over for every probe a library user opens */
+	optind = 1;
+	cl_init(&cl_opts, argc, argv);
+	if (!platform_probe_open()) {
+		platform_close();
+		return NULL;
+	}
+	return &cl_opts;
+}
+
+void platform_close(void)
+{
+	target_list_free();
+	exit_function();
+	if (serial_opened)
+		serial_close();
+	serial_opened = false;
+	memset(&info, 0, sizeof(info));
+}
+
 uint32_t platform_adiv5_swdp_scan(uint32_t targetid)
 {
 	info.is_jtag = false;
@@ -153,6 +260,9 @@ uint32_t platform_adiv5_swdp_scan(uint32_t targetid)
 	case BMP_TYPE_JLINK:
 		return jlink_swdp_scan(&info);
 
+	case BMP_TYPE_SIM:
+		return sim_swdp_scan();
+
 	default:
 		return 0;
 	}
@@ -167,6 +277,9 @@ int swdptap_init(ADIv5_DP_t *dp)
 	case BMP_TYPE_CMSIS_DAP:
 		return dap_swdptap_init(dp);
 
+	case BMP_TYPE_SIM:
+		return sim_swdptap_init(dp);
+
 	case BMP_TYPE_STLINKV2:
 	case BMP_TYPE_JLINK:
 		return 0;
@@ -247,19 +360,64 @@ void platform_adiv5_dp_defaults(ADIv5_DP_t *dp)
 	case BMP_TYPE_CMSIS_DAP:
 		return dap_adiv5_dp_defaults(dp);
 
+	case BMP_TYPE_SIM:
+		return sim_adiv5_dp_defaults(dp);
+
 	default:
 		break;
 	}
 }
 
+/* Caches live in $XDG_CACHE_HOME, falling back to ~/.cache */
+bool platform_cache_path(const char *const name, char *const path, const size_t size)
+{
+	const char *const cache_home = getenv("XDG_CACHE_HOME");
+	if (cache_home && cache_home[0])
+		return (size_t)snprintf(path, size, "%s/%s", cache_home, name) < size;
+	const char *const home = getenv("HOME");
+	if (!home || !home[0])
+		return false;
+	return (size_t)snprintf(path, size, "%s/.cache/%s", home, name) < size;
+}
+
+bool platform_rom_cache_load(void *data, size_t size)
+{
+	char path[PATH_MAX];
+	if (!platform_cache_path("blackmagic-romtable.bin", path, sizeof(path)))
+		return false;
+	FILE *const file = fopen(path, "rb");
+	if (!file)
+		return false;
+	const bool result = fread(data, 1, size, file) == size;
+	fclose(file);
+	return result;
+}
+
+void platform_rom_cache_save(const void *data, size_t size)
+{
+	char path[PATH_MAX];
+	if (!platform_cache_path("blackmagic-romtable.bin", path, sizeof(path)))
+		return;
+	FILE *const file = fopen(path, "wb");
+	if (!file) {
+		DEBUG_INFO("Can not write ROM table cache %s\n", path);
+		return;
+	}
+	if (fwrite(data, 1, size, file) != size)
+		DEBUG_WARN("Short write to ROM table cache %s\n", path);
+	fclose(file);
+}
+
 int platform_jtag_dp_init(ADIv5_DP_t *dp)
 {
 	switch (info.bmp_type) {
 	case BMP_TYPE_BMP:
-	case BMP_TYPE_LIBFTDI:
 	case BMP_TYPE_JLINK:
 		return 0;
 
+	case BMP_TYPE_LIBFTDI:
+		return libftdi_jtagdp_init(dp);
+
 	case BMP_TYPE_STLINKV2:
 		return stlink_jtag_dp_init(dp);
 
@@ -292,6 +450,9 @@ char *platform_ident(void)
 	case BMP_TYPE_JLINK:
 		return "J-Link";
 
+	case BMP_TYPE_SIM:
+		return "Simulator";
+
 	default:
 		return NULL;
 	}
@@ -312,6 +473,9 @@ const char *platform_target_voltage(void)
 	case BMP_TYPE_JLINK:
 		return jlink_target_voltage(&info);
 
+	case BMP_TYPE_SIM:
+		return sim_target_voltage();
+
 	default:
 		return NULL;
 	}
@@ -335,6 +499,9 @@ void platform_nrst_set_val(bool assert)
 	case BMP_TYPE_CMSIS_DAP:
 		return dap_nrst_set_val(assert);
 
+	case BMP_TYPE_SIM:
+		return sim_nrst_set_val(assert);
+
 	default:
 		break;
 	}
@@ -355,6 +522,9 @@ bool platform_nrst_get_val(void)
 	case BMP_TYPE_LIBFTDI:
 		return libftdi_nrst_get_val();
 
+	case BMP_TYPE_SIM:
+		return sim_nrst_get_val();
+
 	default:
 		return false;
 	}
@@ -386,6 +556,9 @@ void platform_max_frequency_set(uint32_t freq)
 		jlink_max_frequency_set(&info, freq);
 		break;
 
+	case BMP_TYPE_SIM:
+		break;
+
 	default:
 		DEBUG_WARN("Setting max SWJ frequency not yet implemented\n");
 		break;
@@ -417,6 +590,9 @@ uint32_t platform_max_frequency_get(void)
 	case BMP_TYPE_JLINK:
 		return jlink_max_frequency_get(&info);
 
+	case BMP_TYPE_SIM:
+		return FREQ_FIXED;
+
 	default:
 		DEBUG_WARN("Reading max SWJ frequency not yet implemented\n");
 		return 0;
@@ -465,6 +641,10 @@ uint32_t platform_target_voltage_sense(void)
 		break;
 	}
 
+	case BMP_TYPE_SIM:
+		targetVoltage = 33U;
+		break;
+
 	default:
 		break;
 	}
@@ -472,6 +652,35 @@ uint32_t platform_target_voltage_sense(void)
 	return targetVoltage;
 }
 
+int platform_buffer_write(const uint8_t *const data, const int size)
+{
+	if (wire_trace_replaying()) {
+		wire_trace_replay_request(WIRE_TRACE_REMOTE, data, size);
+		return size;
+	}
+	wire_trace_request(WIRE_TRACE_REMOTE, data, size);
+#if HOSTED_BMP_ONLY != 1
+	if (remote_bulk_active())
+		return remote_bulk_write(data, size);
+#endif
+	return serial_buffer_write(data, size);
+}
+
+int platform_buffer_read(uint8_t *const data, const int size)
+{
+	if (wire_trace_replaying())
+		return wire_trace_replay_response(WIRE_TRACE_REMOTE, data, size);
+	int result;
+#if HOSTED_BMP_ONLY != 1
+	if (remote_bulk_active())
+		result = remote_bulk_read(data, size);
+	else
+#endif
+		result = serial_buffer_read(data, size);
+	wire_trace_response(WIRE_TRACE_REMOTE, data, result > 0 ? result : 0, result);
+	return result;
+}
+
 void platform_buffer_flush(void)
 {
 	switch (info.bmp_type) {
@@ -485,8 +694,10 @@ void platform_buffer_flush(void)
 
 void platform_pace_poll(void)
 {
+	/* Wake up as soon as GDB sends something (like Ctrl-C) rather than sleeping blindly,
+	 * and in time for whatever the scheduler has due next */
 	if (!cl_opts.fast_poll)
-		platform_delay(8);
+		gdb_if_wait(MIN(scheduler_next_us(), 8000U));
 }
 
 void platform_target_clk_output_enable(const bool enable)
@@ -606,6 +817,7 @@ uint32_t adiv5_dp_read(ADIv5_DP_t *dp, uint16_t addr)
 
 uint32_t adiv5_dp_error(ADIv5_DP_t *dp)
 {
+	adiv5_dp_cache_invalidate(dp);
 	uint32_t ret = dp->error(dp);
 	DEBUG_TARGET("DP Error 0x%08" PRIx32 "\n", ret);
 	return ret;
@@ -642,7 +854,7 @@ void adiv5_ap_write(ADIv5_AP_t *ap, uint16_t addr, uint32_t value)
 
 void adiv5_mem_read(ADIv5_AP_t *ap, void *dest, uint32_t src, size_t len)
 {
-	ap->dp->mem_read(ap, dest, src, len);
+	adiv5_mem_read_split(ap, dest, src, len);
 	if (cl_debuglevel & BMP_DEBUG_TARGET) {
 		fprintf(stderr, "ap_memread @ %" PRIx32 " len %" PRIx32 ":", src, (uint32_t)len);
 		uint8_t *p = (uint8_t *)dest;
@@ -686,5 +898,6 @@ void adiv5_mem_write_sized(ADIv5_AP_t *ap, uint32_t dest, const void *src, size_
 void adiv5_dp_abort(struct ADIv5_DP_s *dp, uint32_t abort)
 {
 	DEBUG_TARGET("Abort: %08" PRIx32 "\n", abort);
+	adiv5_dp_cache_invalidate(dp);
 	return dp->abort(dp, abort);
 }
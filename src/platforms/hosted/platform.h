@@ -39,14 +39,21 @@
 
 char *platform_ident(void);
 void platform_buffer_flush(void);
+/* Where the cache file of the given name goes, false if there is nowhere */
+bool platform_cache_path(const char *name, char *path, size_t size);
+/* In timeline.c, notes GDB resuming and halting the target */
+void timeline_run_state(bool running);
 
 #define PLATFORM_IDENT     "(PC-Hosted) "
 #define SET_IDLE_STATE(x)
-#define SET_RUN_STATE(x)
+#define SET_RUN_STATE(x)  timeline_run_state(x)
 #define PLATFORM_HAS_POWER_SWITCH
 
 #define SYSTICKHZ 1000
 
+/* The host has memory to spare, so let GDB send and receive up to 16KiB per packet */
+#define GDB_PACKET_BUFFER_SIZE 16384U
+
 #define VENDOR_ID_BMP            0x1d50
 #define PRODUCT_ID_BMP_BL        0x6017
 #define PRODUCT_ID_BMP           0x6018
@@ -71,7 +78,8 @@ typedef enum bmp_type_e {
 	BMP_TYPE_STLINKV2,
 	BMP_TYPE_LIBFTDI,
 	BMP_TYPE_CMSIS_DAP,
-	BMP_TYPE_JLINK
+	BMP_TYPE_JLINK,
+	BMP_TYPE_SIM
 } bmp_type_t;
 
 void gdb_ident(char *p, int count);
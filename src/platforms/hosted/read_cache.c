@@ -0,0 +1,209 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host side cache of target memory reads. Debuggers read the same code, vector
+ * tables and constants over and over as views refresh and the program is
+ * stepped, and on a slow adaptor each of those reads is a round trip or more.
+ *
+ * Flash only changes through the flash routines, which drop the cache on the way
+ * into flash mode and read past it while there, so it stays cached across runs
+ * of the program until the next reset. A program that rewrites its own flash
+ * defeats that, hence the option to turn the cache off. RAM is only cached while
+ * the target is halted, and even then DMA can still change it underneath, so
+ * that is asked for explicitly.
+ */
+
+#include "general.h"
+#include "target_internal.h"
+#include "stats.h"
+#include "read_cache.h"
+
+#define READ_CACHE_PAGE_SIZE  512U
+#define READ_CACHE_PAGE_COUNT 128U
+/* Cores a RAM cache can be kept for at once */
+#define READ_CACHE_HALTED_MAX 8U
+
+typedef struct read_cache_page {
+	target *t;
+	target_addr_t addr;
+	/* What part of the page lies in the region it was fetched from */
+	uint16_t start;
+	uint16_t end;
+	bool ram;
+	uint8_t data[READ_CACHE_PAGE_SIZE];
+} read_cache_page_s;
+
+static read_cache_mode_e read_cache_mode = READ_CACHE_FLASH;
+static read_cache_page_s read_cache_pages[READ_CACHE_PAGE_COUNT];
+static size_t read_cache_next;
+static target *read_cache_halted_targets[READ_CACHE_HALTED_MAX];
+
+bool read_cache_set_mode(const char *const mode)
+{
+	if (!strcmp(mode, "off"))
+		read_cache_mode = READ_CACHE_OFF;
+	else if (!strcmp(mode, "flash"))
+		read_cache_mode = READ_CACHE_FLASH;
+	else if (!strcmp(mode, "ram"))
+		read_cache_mode = READ_CACHE_RAM;
+	else
+		return false;
+	return true;
+}
+
+static bool read_cache_is_halted(target *const t)
+{
+	for (size_t i = 0; i < READ_CACHE_HALTED_MAX; ++i) {
+		if (read_cache_halted_targets[i] == t)
+			return true;
+	}
+	return false;
+}
+
+/* The flash or RAM region the whole range lies in, if it may be cached */
+static bool read_cache_region(
+	target *const t, const target_addr_t addr, const size_t len, target_addr_t *start, target_addr_t *end, bool *ram)
+{
+	const target_flash_s *const f = target_flash_for_addr(t, addr);
+	if (f) {
+		*start = f->start;
+		*end = f->start + f->length;
+		*ram = false;
+		return addr + len <= *end;
+	}
+	if (read_cache_mode != READ_CACHE_RAM || !read_cache_is_halted(t))
+		return false;
+	for (const struct target_ram *r = t->ram; r; r = r->next) {
+		if (addr >= r->start && addr - r->start < r->length) {
+			*start = r->start;
+			*end = r->start + r->length;
+			*ram = true;
+			return addr + len <= *end;
+		}
+	}
+	return false;
+}
+
+static read_cache_page_s *read_cache_lookup(target *const t, const target_addr_t addr)
+{
+	for (size_t i = 0; i < READ_CACHE_PAGE_COUNT; ++i) {
+		read_cache_page_s *const page = &read_cache_pages[i];
+		if (page->t == t && page->addr == addr)
+			return page;
+	}
+	return NULL;
+}
+
+/* Reads the part of the page at addr that lies within the region, replacing the oldest page */
+static read_cache_page_s *read_cache_fetch(
+	target *const t, const target_addr_t addr, const target_addr_t start, const target_addr_t end, const bool ram)
+{
+	read_cache_page_s *const page = &read_cache_pages[read_cache_next];
+	read_cache_next = (read_cache_next + 1U) % READ_CACHE_PAGE_COUNT;
+	page->t = NULL;
+	page->start = MAX(start, addr) - addr;
+	page->end = MIN(end - addr, READ_CACHE_PAGE_SIZE);
+	page->ram = ram;
+	stats_add(STATS_MEM_READ_BYTES, page->end - page->start);
+	t->mem_read(t, page->data + page->start, addr + page->start, page->end - page->start);
+	if (target_check_error(t))
+		return NULL;
+	page->t = t;
+	page->addr = addr;
+	return page;
+}
+
+bool read_cache_read(target *const t, void *const dest, const target_addr_t src, const size_t len)
+{
+	target_addr_t start;
+	target_addr_t end;
+	bool ram;
+	if (read_cache_mode == READ_CACHE_OFF || !len || !read_cache_region(t, src, len, &start, &end, &ram))
+		return false;
+
+	uint8_t *data = dest;
+	for (target_addr_t addr = src; addr < src + len;) {
+		const target_addr_t page_addr = addr & ~(READ_CACHE_PAGE_SIZE - 1U);
+		const read_cache_page_s *page = read_cache_lookup(t, page_addr);
+		if (page)
+			stats_add(STATS_MEM_CACHED_BYTES, MIN(page_addr + READ_CACHE_PAGE_SIZE, src + len) - addr);
+		else
+			page = read_cache_fetch(t, page_addr, start, end, ram);
+		if (!page)
+			return false;
+		const size_t offset = addr - page_addr;
+		const size_t count = MIN(page->end - offset, src + len - addr);
+		memcpy(data, page->data + offset, count);
+		data += count;
+		addr += count;
+	}
+	return true;
+}
+
+void read_cache_write(const target_addr_t dest, const void *const src, const size_t len)
+{
+	for (size_t i = 0; i < READ_CACHE_PAGE_COUNT; ++i) {
+		read_cache_page_s *const page = &read_cache_pages[i];
+		if (!page->t)
+			continue;
+		const target_addr_t begin = MAX(dest, page->addr + page->start);
+		const target_addr_t end = MIN(dest + len, page->addr + page->end);
+		if (begin >= end)
+			continue;
+		/* What lands in flash depends on the part, so leave that to be read back */
+		if (page->ram)
+			memcpy(page->data + (begin - page->addr), (const uint8_t *)src + (begin - dest), end - begin);
+		else
+			page->t = NULL;
+	}
+}
+
+void read_cache_halted(target *const t, const bool halted)
+{
+	if (halted) {
+		if (read_cache_is_halted(t))
+			return;
+		for (size_t i = 0; i < READ_CACHE_HALTED_MAX; ++i) {
+			if (!read_cache_halted_targets[i]) {
+				read_cache_halted_targets[i] = t;
+				return;
+			}
+		}
+		return;
+	}
+
+	for (size_t i = 0; i < READ_CACHE_HALTED_MAX; ++i) {
+		if (read_cache_halted_targets[i] == t)
+			read_cache_halted_targets[i] = NULL;
+	}
+	/* Cores of one device share their RAM, so any of them running invalidates it all */
+	for (size_t i = 0; i < READ_CACHE_PAGE_COUNT; ++i) {
+		if (read_cache_pages[i].ram)
+			read_cache_pages[i].t = NULL;
+	}
+}
+
+void read_cache_invalidate(target *const t)
+{
+	for (size_t i = 0; i < READ_CACHE_PAGE_COUNT; ++i) {
+		if (!t || read_cache_pages[i].t == t)
+			read_cache_pages[i].t = NULL;
+	}
+	if (!t)
+		memset(read_cache_halted_targets, 0, sizeof(read_cache_halted_targets));
+}
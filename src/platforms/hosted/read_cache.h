@@ -0,0 +1,49 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PLATFORMS_HOSTED_READ_CACHE_H
+#define PLATFORMS_HOSTED_READ_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "target.h"
+
+typedef enum read_cache_mode {
+	READ_CACHE_OFF,
+	READ_CACHE_FLASH, /* Flash only, the default */
+	READ_CACHE_RAM,   /* Flash, and RAM while the target is halted */
+} read_cache_mode_e;
+
+/* Parses "off", "flash" or "ram" from the command line */
+bool read_cache_set_mode(const char *mode);
+
+/*
+ * Serves a read from the cache, fetching the pages it covers on a miss. Returns
+ * false, having done nothing, when the range is not cacheable or a fetch failed,
+ * for the caller to read the target directly.
+ */
+bool read_cache_read(target *t, void *dest, target_addr_t src, size_t len);
+/* Brings cached copies of a range written to up to date, for every target */
+void read_cache_write(target_addr_t dest, const void *src, size_t len);
+/* The target halted, or is about to run, which decides whether its RAM may be cached */
+void read_cache_halted(target *t, bool halted);
+/* Drops everything cached, for t or when NULL for all targets */
+void read_cache_invalidate(target *t);
+
+#endif /* PLATFORMS_HOSTED_READ_CACHE_H */
@@ -0,0 +1,176 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Remote protocol transport over raw bulk transfers. The probe's GDB data
+ * interface has a vendor class alternate setting sharing the CDC-ACM bulk
+ * endpoints, selecting it detaches the host's CDC-ACM driver and its tty
+ * layer so requests and responses go straight to and from the endpoints.
+ */
+
+#include "general.h"
+#include "remote.h"
+#include "remote_bulk.h"
+#include "cortexm.h"
+
+#define REMOTE_BULK_WRITE_TIMEOUT 1000U
+/* A whole number of high-speed packets, so a transfer never ends mid-packet */
+#define REMOTE_BULK_READ_SIZE 1024U
+
+static libusb_device_handle *bulk_handle;
+static uint8_t bulk_interface;
+static uint8_t bulk_in_ep;
+static uint8_t bulk_out_ep;
+
+static uint8_t read_buffer[REMOTE_BULK_READ_SIZE];
+static size_t read_buffer_fill;
+static size_t read_buffer_offset;
+
+bool remote_bulk_init(bmp_info_t *const info)
+{
+	if (!info->in_ep || !info->out_ep)
+		return false;
+	libusb_device_handle *const handle = bmp_libusb_open_probe(info);
+	if (!handle)
+		return false;
+	/* Hand the interface back to the CDC-ACM driver once released, where the OS supports that */
+	libusb_set_auto_detach_kernel_driver(handle, 1);
+	if (libusb_claim_interface(handle, info->interface_num)) {
+		DEBUG_INFO("Can not claim the remote protocol interface, using the serial port\n");
+		libusb_close(handle);
+		return false;
+	}
+	if (libusb_set_interface_alt_setting(handle, info->interface_num, info->alt_setting)) {
+		DEBUG_WARN("Can not select the remote protocol alternate setting\n");
+		libusb_release_interface(handle, info->interface_num);
+		libusb_close(handle);
+		return false;
+	}
+	bulk_handle = handle;
+	bulk_interface = info->interface_num;
+	bulk_in_ep = info->in_ep;
+	bulk_out_ep = info->out_ep;
+	read_buffer_fill = 0;
+	read_buffer_offset = 0;
+	DEBUG_INFO("Using raw bulk transfers for the remote protocol\n");
+	return true;
+}
+
+void remote_bulk_exit(void)
+{
+	if (!bulk_handle)
+		return;
+	/* Back on the CDC data alternate setting, the probe's GDB port only answers to DTR again */
+	libusb_set_interface_alt_setting(bulk_handle, bulk_interface, 0);
+	libusb_release_interface(bulk_handle, bulk_interface);
+	libusb_close(bulk_handle);
+	bulk_handle = NULL;
+}
+
+bool remote_bulk_active(void)
+{
+	return bulk_handle != NULL;
+}
+
+int remote_bulk_write(const uint8_t *const data, const int size)
+{
+	DEBUG_WIRE("%s\n", data);
+	int offset = 0;
+	while (offset < size) {
+		int transferred = 0;
+		const int res = libusb_bulk_transfer(bulk_handle, bulk_out_ep, (uint8_t *)data + offset, size - offset,
+			&transferred, REMOTE_BULK_WRITE_TIMEOUT);
+		if (res && !transferred) {
+			DEBUG_WARN("Failed to write: %s\n", libusb_strerror(res));
+			exit(-2);
+		}
+		offset += transferred;
+	}
+	return size;
+}
+
+/* Wait until the deadline for more data once the buffer is drained */
+static int read_buffer_refill(const uint32_t deadline)
+{
+	read_buffer_offset = 0;
+	read_buffer_fill = 0;
+	while (true) {
+		const uint32_t now = platform_time_ms();
+		if ((int32_t)(deadline - now) <= 0)
+			return 0;
+		int transferred = 0;
+		const int res = libusb_bulk_transfer(
+			bulk_handle, bulk_in_ep, read_buffer, sizeof(read_buffer), &transferred, deadline - now);
+		if (res && res != LIBUSB_ERROR_TIMEOUT) {
+			DEBUG_WARN("Failed to read: %s\n", libusb_strerror(res));
+			return -1;
+		}
+		/* A zero length packet just ends a transfer that filled its last packet, keep waiting */
+		if (transferred > 0) {
+			read_buffer_fill = (size_t)transferred;
+			return 1;
+		}
+	}
+}
+
+int remote_bulk_read(uint8_t *const data, const int maxsize)
+{
+	const uint32_t deadline = platform_time_ms() + cortexm_wait_timeout;
+
+	/* Look for start of response */
+	while (true) {
+		const uint8_t *const start = read_buffer + read_buffer_offset;
+		const uint8_t *const resp = memchr(start, REMOTE_RESP, read_buffer_fill - read_buffer_offset);
+		if (resp) {
+			read_buffer_offset += (resp - start) + 1U;
+			break;
+		}
+		const int ret = read_buffer_refill(deadline);
+		if (ret < 0)
+			return -3;
+		if (ret == 0) {
+			DEBUG_WARN("Timeout on read RESP\n");
+			return -4;
+		}
+	}
+
+	/* Now collect the response */
+	size_t length = 0;
+	while (true) {
+		const uint8_t *const start = read_buffer + read_buffer_offset;
+		const size_t available = read_buffer_fill - read_buffer_offset;
+		const uint8_t *const eom = memchr(start, REMOTE_EOM, available);
+		const size_t count = eom ? (size_t)(eom - start) : available;
+		if (length + count >= (size_t)maxsize) {
+			DEBUG_WARN("Failed to read\n");
+			return -6;
+		}
+		memcpy(data + length, start, count);
+		length += count;
+		read_buffer_offset += count;
+		if (eom) {
+			++read_buffer_offset;
+			data[length] = 0;
+			DEBUG_WIRE("       %s\n", data);
+			return (int)length;
+		}
+		if (read_buffer_refill(deadline) <= 0) {
+			DEBUG_WARN("Timeout on read\n");
+			return -5;
+		}
+	}
+}
@@ -0,0 +1,39 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PLATFORMS_HOSTED_REMOTE_BULK_H
+#define PLATFORMS_HOSTED_REMOTE_BULK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bmp_hosted.h"
+
+/*
+ * Talk the remote protocol to a Black Magic Probe over raw bulk transfers on
+ * the vendor alternate setting of its GDB data interface, found by
+ * find_debuggers(). Returns false if the probe doesn't offer it or the OS
+ * won't let go of the interface, in which case the tty is used instead.
+ */
+bool remote_bulk_init(bmp_info_t *info);
+void remote_bulk_exit(void);
+bool remote_bulk_active(void);
+
+int remote_bulk_write(const uint8_t *data, int size);
+int remote_bulk_read(uint8_t *data, int maxsize);
+
+#endif /* PLATFORMS_HOSTED_REMOTE_BULK_H */
@@ -43,6 +43,9 @@ static void jtagtap_tdi_seq(bool final_tms, const uint8_t *data_in, size_t clock
 static bool jtagtap_next(bool tms, bool tdi);
 static void jtagtap_cycle(bool tms, bool tdi, size_t clock_cycles);
 
+/* Most TDI/TDO bytes one JL packet carries each way, 0 if the firmware has no JL */
+static size_t remote_jtag_long_max;
+
 static inline unsigned int bool_to_int(const bool value)
 {
 	return value ? 1 : 0;
@@ -67,11 +70,23 @@ int remote_jtagtap_init(jtag_proc_t *jtag_proc)
 
 	platform_buffer_write((uint8_t *)REMOTE_HL_CHECK_STR, sizeof(REMOTE_HL_CHECK_STR));
 	length = platform_buffer_read((uint8_t *)buffer, REMOTE_MAX_MSG_SIZE);
-	if (!length || buffer[0] == REMOTE_RESP_ERR || buffer[0] == 1)
+	if (!length || buffer[0] == REMOTE_RESP_ERR || buffer[0] == 1) {
 		PRINT_INFO("Firmware does not support newer JTAG commands, please update it.");
-	else
-		jtag_proc->jtagtap_cycle = jtagtap_cycle;
+		return 0;
+	}
+	jtag_proc->jtagtap_cycle = jtagtap_cycle;
 
+	remote_jtag_long_max = 0;
+	if (remotehston(8, buffer + 1) < REMOTE_HL_VERSION_JTAG_LONG)
+		return 0;
+	platform_buffer_write((uint8_t *)REMOTE_HL_PACKET_SIZE_STR, sizeof(REMOTE_HL_PACKET_SIZE_STR));
+	length = platform_buffer_read((uint8_t *)buffer, REMOTE_MAX_MSG_SIZE);
+	if (length < 1 || buffer[0] != REMOTE_RESP_OK)
+		return 0;
+	/* Half the packet for each direction, less the header, the escapes are budgeted for when sending */
+	const size_t packet_size = MIN(remotehston(8, buffer + 1), REMOTE_BIN_MAX_MSG_SIZE);
+	if (packet_size >= 64U)
+		remote_jtag_long_max = packet_size / 2U - 16U;
 	return 0;
 }
 
@@ -101,16 +116,80 @@ static void jtagtap_tms_seq(uint32_t tms_states, size_t clock_cycles)
 	}
 }
 
-/* At least up to v1.7.1-233, remote handles only up to 32 clock cycles in one
- * call. Break up large calls.
- *
- * FIXME: Provide and test faster call and keep fallback
- * for old firmware
+/*
+ * Takes bytes of data_in, or of zeros without it, for as long as their escaped
+ * form fits in room, returning how many
+ */
+static size_t jtagtap_long_bytes(const uint8_t *const data_in, const size_t len, const size_t room)
+{
+	size_t escaped = 0;
+	size_t bytes = 0;
+	for (; bytes < len; ++bytes) {
+		const size_t width = data_in && remote_needs_escape(data_in[bytes]) ? 2U : 1U;
+		if (escaped + width > room)
+			break;
+		escaped += width;
+	}
+	return bytes;
+}
+
+/*
+ * Sequences go as JL packets of up to remote_jtag_long_max bytes of TDI each,
+ * the TDO only coming back if asked for. Each packet but the last carries
+ * whole bytes so the next starts on a byte boundary of data_in and data_out.
+ */
+static void jtagtap_tdi_tdo_seq_long(
+	uint8_t *const data_out, const bool final_tms, const uint8_t *const data_in, const size_t clock_cycles)
+{
+	static uint8_t buffer[2U * REMOTE_BIN_MAX_MSG_SIZE + 16U];
+	for (size_t cycle = 0; cycle < clock_cycles;) {
+		const size_t offset = cycle >> 3U;
+		const size_t remaining = ((clock_cycles - cycle + 7U) >> 3U);
+		const size_t bytes = jtagtap_long_bytes(data_in ? data_in + offset : NULL, MIN(remaining, remote_jtag_long_max),
+			remote_jtag_long_max);
+		const size_t chunk = MIN(clock_cycles - cycle, bytes * 8U);
+		cycle += chunk;
+
+		const uint8_t flags = (cycle == clock_cycles && final_tms ? REMOTE_JTAG_LONG_TMS : 0U) |
+			(data_out ? REMOTE_JTAG_LONG_TDO : 0U);
+		int length = snprintf((char *)buffer, sizeof(buffer), REMOTE_JTAG_TDITDO_LONG_STR, flags, (uint32_t)chunk);
+		if (data_in)
+			length += (int)remote_escape((char *)buffer + length, data_in + offset, bytes);
+		else {
+			memset(buffer + length, 0, bytes);
+			length += (int)bytes;
+		}
+		buffer[length++] = REMOTE_EOM;
+		platform_buffer_write(buffer, length);
+
+		length = platform_buffer_read(buffer, sizeof(buffer));
+		if (length < 1 || buffer[0] == REMOTE_RESP_ERR) {
+			DEBUG_WARN("jtagtap_tdi_tdo_seq failed, error %s\n", length > 0 ? (char *)buffer + 1 : "unknown");
+			exit(-1);
+		}
+		if (data_out) {
+			/* Decoded in place, never writing ahead of what it reads */
+			if (remote_unescape(buffer + 1, (const char *)buffer + 1, (size_t)length - 1U) != bytes) {
+				DEBUG_WARN("jtagtap_tdi_tdo_seq: short TDO response\n");
+				exit(-1);
+			}
+			memcpy(data_out + offset, buffer + 1, bytes);
+		}
+	}
+}
+
+/*
+ * Firmware without JL handles only up to 64 clock cycles in one call, so
+ * large calls are broken up for it.
  */
 static void jtagtap_tdi_tdo_seq(uint8_t *const data_out, const bool final_tms, const uint8_t *const data_in, const size_t clock_cycles)
 {
 	if (!clock_cycles || (!data_in && !data_out))
 		return;
+	if (remote_jtag_long_max) {
+		jtagtap_tdi_tdo_seq_long(data_out, final_tms, data_in, clock_cycles);
+		return;
+	}
 
 	char buffer[REMOTE_MAX_MSG_SIZE];
 	size_t in_offset = 0;
@@ -127,11 +206,11 @@ static void jtagtap_tdi_tdo_seq(uint8_t *const data_out, const bool final_tms, c
 		const size_t bytes = (chunk + 7U) >> 3U;
 		if (data_in) {
 			for (size_t i = 0; i < bytes; ++i)
-				data |= data_in[in_offset++] << (i * 8U);
+				data |= (uint64_t)data_in[in_offset++] << (i * 8U);
 		}
 		/* PRIx64 differs with system. Use it explicit in the format string*/
 		int length = snprintf(buffer, REMOTE_MAX_MSG_SIZE, "!J%c%02zx%" PRIx64 "%c",
-			!clock_cycles && final_tms ? REMOTE_TDITDO_TMS : REMOTE_TDITDO_NOTMS, chunk, data, REMOTE_EOM);
+			cycle == clock_cycles && final_tms ? REMOTE_TDITDO_TMS : REMOTE_TDITDO_NOTMS, chunk, data, REMOTE_EOM);
 		platform_buffer_write((uint8_t *)buffer, length);
 
 		length = platform_buffer_read((uint8_t *)buffer, REMOTE_MAX_MSG_SIZE);
@@ -0,0 +1,216 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Split mode: BMDA next to the hardware answers the remote protocol for its
+ * probe over TCP, exactly as Black Magic Probe firmware does over USB, and the
+ * BMDA that GDB talks to uses it with -d tcp:HOST:PORT. The packets are those
+ * of remote.c, whose handlers run here against the local probe.
+ *
+ * The client keeps several requests in flight on a slow link, so requests are
+ * handled in order from whatever has arrived, and their responses go out
+ * together once that is used up rather than a TCP segment each.
+ */
+
+#if defined(_WIN32) || defined(__CYGWIN__)
+#   define __USE_MINGW_ANSI_STDIO 1
+#   include <winsock2.h>
+#   include <windows.h>
+#   include <ws2tcpip.h>
+#else
+#   include <sys/socket.h>
+#   include <netinet/in.h>
+#   include <netinet/tcp.h>
+#endif
+
+#include "general.h"
+#include <errno.h>
+#include <unistd.h>
+
+#include "exception.h"
+#include "remote.h"
+#include "remote_server.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define REMOTE_SERVER_RX_SIZE 4096U
+#define REMOTE_SERVER_TX_SIZE (64U * 1024U)
+
+/* Room past the packet for remote.c to align the buffer it reuses for data */
+static char remote_server_packet[GDB_PACKET_BUFFER_SIZE + 16U];
+static size_t remote_server_offset;
+static bool remote_server_in_packet;
+
+static uint8_t remote_server_tx[REMOTE_SERVER_TX_SIZE];
+static size_t remote_server_tx_fill;
+static int remote_server_conn = -1;
+
+static void remote_server_send(void)
+{
+	size_t sent = 0;
+	while (remote_server_conn != -1 && sent < remote_server_tx_fill) {
+#if defined(_WIN32) || defined(__CYGWIN__)
+		const int result =
+			send(remote_server_conn, (const char *)remote_server_tx + sent, (int)(remote_server_tx_fill - sent), 0);
+#else
+		const ssize_t result =
+			send(remote_server_conn, remote_server_tx + sent, remote_server_tx_fill - sent, MSG_NOSIGNAL);
+#endif
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result <= 0) {
+			DEBUG_WARN("Remote client gone while sending\n");
+			close(remote_server_conn);
+			remote_server_conn = -1;
+			break;
+		}
+		sent += (size_t)result;
+	}
+	remote_server_tx_fill = 0;
+}
+
+void remote_server_putchar(const unsigned char c, const int flush)
+{
+	/* Responses are sent once the requests that have arrived are all handled */
+	(void)flush;
+	if (remote_server_tx_fill == sizeof(remote_server_tx))
+		remote_server_send();
+	remote_server_tx[remote_server_tx_fill++] = c;
+}
+
+static void remote_server_process(void)
+{
+	remote_server_packet[remote_server_offset] = '\0';
+	const size_t fill = remote_server_tx_fill;
+	volatile struct exception e;
+	TRY_CATCH (e, EXCEPTION_ALL) {
+		remotePacketProcess(remote_server_offset, remote_server_packet);
+	}
+	if (e.type) {
+		/* Drop anything of a response that was started and answer with the error */
+		DEBUG_WARN("Remote request failed: %s\n", e.msg ? e.msg : "");
+		remote_server_tx_fill = MIN(remote_server_tx_fill, fill);
+		char response[8];
+		const int length = snprintf(
+			response, sizeof(response), "%c%c%x%c", REMOTE_RESP, REMOTE_RESP_ERR, REMOTE_ERROR_EXCEPTION, REMOTE_EOM);
+		for (int i = 0; i < length; ++i)
+			remote_server_putchar(response[i], i == length - 1);
+	}
+}
+
+/* Frames packets as the firmware does, anything outside of one is ignored */
+static void remote_server_receive(const char *const data, const size_t len)
+{
+	for (size_t i = 0; i < len; ++i) {
+		const char c = data[i];
+		if (c == REMOTE_SOM) {
+			/* A packet can restart */
+			remote_server_in_packet = true;
+			remote_server_offset = 0;
+		} else if (!remote_server_in_packet)
+			continue;
+		else if (c == REMOTE_EOM) {
+			remote_server_in_packet = false;
+			remote_server_process();
+		} else if (remote_server_offset < GDB_PACKET_BUFFER_SIZE)
+			remote_server_packet[remote_server_offset++] = c;
+		else {
+			DEBUG_WARN("Remote request too long, dropped\n");
+			remote_server_in_packet = false;
+		}
+	}
+}
+
+static void remote_server_serve(void)
+{
+	char buffer[REMOTE_SERVER_RX_SIZE];
+	remote_server_in_packet = false;
+	remote_server_tx_fill = 0;
+	while (remote_server_conn != -1) {
+		const int count = recv(remote_server_conn, buffer, sizeof(buffer), 0);
+		if (count < 0 && errno == EINTR)
+			continue;
+		if (count <= 0) {
+			close(remote_server_conn);
+			remote_server_conn = -1;
+			break;
+		}
+		remote_server_receive(buffer, (size_t)count);
+		remote_server_send();
+	}
+	DEBUG_INFO("Remote client disconnected\n");
+}
+
+static int remote_server_listen(const uint16_t port)
+{
+	struct sockaddr_in addr;
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	const int serv = socket(PF_INET, SOCK_STREAM, 0);
+	if (serv == -1) {
+		DEBUG_WARN("PF_INET %d\n", serv);
+		return -1;
+	}
+	int opt = 1;
+	if (setsockopt(serv, SOL_SOCKET, SO_REUSEADDR, (void *)&opt, sizeof(opt)) == -1 ||
+		bind(serv, (void *)&addr, sizeof(addr)) == -1 || listen(serv, 1) == -1) {
+#if defined(_WIN32) || defined(__CYGWIN__)
+		DEBUG_WARN("Can not listen on port %u, error: %d\n", port, WSAGetLastError());
+#else
+		DEBUG_WARN("Can not listen on port %u, error: %s\n", port, strerror(errno));
+#endif
+		close(serv);
+		return -1;
+	}
+	return serv;
+}
+
+int remote_server_run(const uint16_t port)
+{
+#if defined(_WIN32) || defined(__CYGWIN__)
+	WSADATA wsaData;
+	const int result = WSAStartup(MAKEWORD(2, 2), &wsaData);
+	if (result != NO_ERROR) {
+		DEBUG_WARN("WSAStartup failed with error: %d\n", result);
+		return -1;
+	}
+#endif
+	const int serv = remote_server_listen(port);
+	if (serv == -1)
+		return -1;
+	DEBUG_WARN("Serving the probe on TCP: %4u\n", port);
+
+	while (true) {
+		const int conn = accept(serv, NULL, NULL);
+		if (conn == -1) {
+			if (errno == EINTR)
+				continue;
+			DEBUG_WARN("Accepting a remote client failed\n");
+			close(serv);
+			return -1;
+		}
+		int opt = 1;
+		setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, (void *)&opt, sizeof(opt));
+		DEBUG_INFO("Remote client connected\n");
+		remote_server_conn = conn;
+		remote_server_serve();
+	}
+}
@@ -0,0 +1,33 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PLATFORMS_HOSTED_REMOTE_SERVER_H
+#define PLATFORMS_HOSTED_REMOTE_SERVER_H
+
+#include <stdint.h>
+
+/*
+ * Serves the remote protocol for the local probe to one client at a time on
+ * the TCP port, for BMDA elsewhere to use as a probe with -d tcp:HOST:PORT.
+ * Only returns on failure to listen.
+ */
+int remote_server_run(uint16_t port);
+
+/* Output for remote.c's responses, flush marks the end of one */
+void remote_server_putchar(unsigned char c, int flush);
+
+#endif /* PLATFORMS_HOSTED_REMOTE_SERVER_H */
@@ -73,7 +73,7 @@ static bool swdptap_seq_in_parity(uint32_t *res, size_t clock_cycles)
 	}
 
 	*res = remotehston(-1, (char *)&construct[1]);
-	DEBUG_PROBE("swdptap_seq_in_parity  %2d clock_cycles: %08" PRIx32 " %s\n", clock_cycles, *res,
+	DEBUG_PROBE("swdptap_seq_in_parity  %2zu clock_cycles: %08" PRIx32 " %s\n", clock_cycles, *res,
 		(construct[0] != REMOTE_RESP_OK) ? "ERR" : "OK");
 	return (construct[0] != REMOTE_RESP_OK);
 }
@@ -91,7 +91,7 @@ static uint32_t swdptap_seq_in(size_t clock_cycles)
 		exit(-1);
 	}
 	uint32_t res = remotehston(-1, (char *)&construct[1]);
-	DEBUG_PROBE("swdptap_seq_in         %2d clock_cycles: %08" PRIx32 "\n", clock_cycles, res);
+	DEBUG_PROBE("swdptap_seq_in         %2zu clock_cycles: %08" PRIx32 "\n", clock_cycles, res);
 	return res;
 }
 
@@ -99,7 +99,7 @@ static void swdptap_seq_out(uint32_t tms_states, size_t clock_cycles)
 {
 	uint8_t construct[REMOTE_MAX_MSG_SIZE];
 
-	DEBUG_PROBE("swdptap_seq_out        %2d clock_cycles: %08" PRIx32 "\n", clock_cycles, tms_states);
+	DEBUG_PROBE("swdptap_seq_out        %2zu clock_cycles: %08" PRIx32 "\n", clock_cycles, tms_states);
 	int s = sprintf((char *)construct, REMOTE_SWDP_OUT_STR, clock_cycles, tms_states);
 	platform_buffer_write(construct, s);
 
@@ -114,7 +114,7 @@ static void swdptap_seq_out_parity(uint32_t tms_states, size_t clock_cycles)
 {
 	uint8_t construct[REMOTE_MAX_MSG_SIZE];
 
-	DEBUG_PROBE("swdptap_seq_out_parity %2d clock_cycles: %08" PRIx32 "\n", clock_cycles, tms_states);
+	DEBUG_PROBE("swdptap_seq_out_parity %2zu clock_cycles: %08" PRIx32 "\n", clock_cycles, tms_states);
 	int s = sprintf((char *)construct, REMOTE_SWDP_OUT_PAR_STR, clock_cycles, tms_states);
 	platform_buffer_write(construct, s);
 
@@ -28,8 +28,41 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <rtt_if.h>
+#include <rtt.h>
+#include "sample.h"
+#include "timeline.h"
+#include "io_sink.h"
 
-/* maybe rewrite this as tcp server */
+/*
+ * By default all rtt output goes to stdout and input comes from stdin. With
+ * rtt_if_port set each channel is instead served on its own tcp port, the
+ * first at rtt_if_port, so every channel can have its own consumer. The
+ * sockets are non-blocking and are waited on by gdb_if alongside gdb's.
+ */
+
+uint16_t rtt_if_port = 0;
+const rtt_if_sink_s *rtt_if_sink = NULL;
+
+/*
+ * The terminal is written by the stdout output thread, so a paused pager or a
+ * slow pipe fills its ring rather than stopping the poll loop, and what doesn't
+ * fit is back-pressure for a blocking channel.
+ */
+static uint32_t rtt_if_terminal_write(const char *const buf, const uint32_t len)
+{
+	io_sink_s *const sink = io_sink_stdout();
+	if (!sink) {
+		write(1, buf, len);
+		return len;
+	}
+	return io_sink_write(sink, buf, len);
+}
+
+static uint32_t rtt_if_terminal_space(void)
+{
+	io_sink_s *const sink = io_sink_stdout();
+	return sink ? MIN(io_sink_space(sink), UINT32_MAX) : UINT32_MAX;
+}
 
 #ifndef WIN32
 #include <termios.h>
@@ -38,10 +71,176 @@
 static struct termios saved_ttystate;
 static bool tty_saved = false;
 
+#ifdef RTT_IF_SELECT
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+typedef struct rtt_if_channel {
+	int serv;                       /* listening socket */
+	int conn;                       /* connected consumer, -1 if none */
+	char rx_buf[RTT_DOWN_BUF_SIZE]; /* host to target data read from the socket */
+	uint32_t rx_len;
+	uint32_t rx_pos;
+	char tx_buf[RTT_UP_BUF_SIZE];   /* target to host data the socket couldn't take yet */
+	uint32_t tx_len;
+} rtt_if_channel_s;
+
+/* the target's channels, then the one samples go out on */
+#define RTT_IF_CHANNELS (MAX_RTT_CHAN + 1U)
+
+static rtt_if_channel_s rtt_if_channels[RTT_IF_CHANNELS];
+
+static void rtt_if_set_nonblocking(const int fd)
+{
+	const int flags = fcntl(fd, F_GETFL, 0);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int rtt_if_listen(const uint16_t port)
+{
+	const int serv = socket(PF_INET, SOCK_STREAM, 0);
+	if (serv == -1)
+		return -1;
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	const int opt = 1;
+	if (setsockopt(serv, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1 ||
+		bind(serv, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(serv, 1) == -1) {
+		DEBUG_WARN("rtt: can not listen on TCP port %u: %s\n", port, strerror(errno));
+		close(serv);
+		return -1;
+	}
+	rtt_if_set_nonblocking(serv);
+	return serv;
+}
+
+static void rtt_if_drop(rtt_if_channel_s *const chan)
+{
+	DEBUG_INFO("rtt: channel %u consumer disconnected\n", (unsigned)(chan - rtt_if_channels));
+	close(chan->conn);
+	chan->conn = -1;
+	chan->rx_len = 0;
+	chan->rx_pos = 0;
+	chan->tx_len = 0;
+}
+
+/* a new consumer takes over the channel from any older one */
+static void rtt_if_accept(rtt_if_channel_s *const chan)
+{
+	const int conn = accept(chan->serv, NULL, NULL);
+	if (conn == -1)
+		return;
+	if (chan->conn != -1)
+		rtt_if_drop(chan);
+	rtt_if_set_nonblocking(conn);
+	const int opt = 1;
+	setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+	chan->conn = conn;
+	DEBUG_INFO("rtt: channel %u consumer connected\n", (unsigned)(chan - rtt_if_channels));
+}
+
+/* refill the receive buffer once it has been used up */
+static void rtt_if_receive(rtt_if_channel_s *const chan)
+{
+	if (chan->conn == -1 || chan->rx_pos < chan->rx_len)
+		return;
+	const ssize_t len = recv(chan->conn, chan->rx_buf, sizeof(chan->rx_buf), 0);
+	chan->rx_pos = 0;
+	chan->rx_len = len > 0 ? (uint32_t)len : 0;
+	if (len == 0 || (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+		rtt_if_drop(chan);
+}
+
+/* send data held back earlier, returns false if some is still left */
+static bool rtt_if_flush(rtt_if_channel_s *const chan)
+{
+	if (chan->conn == -1 || chan->tx_len == 0)
+		return true;
+	const ssize_t sent = send(chan->conn, chan->tx_buf, chan->tx_len, MSG_NOSIGNAL);
+	if (sent < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			rtt_if_drop(chan);
+		return chan->tx_len == 0;
+	}
+	chan->tx_len -= sent;
+	memmove(chan->tx_buf, chan->tx_buf + sent, chan->tx_len);
+	return chan->tx_len == 0;
+}
+
+int rtt_if_fdset(fd_set *const fds)
+{
+	int max_fd = -1;
+	for (size_t i = 0; rtt_if_port && i < RTT_IF_CHANNELS; ++i) {
+		rtt_if_channel_s *const chan = &rtt_if_channels[i];
+		if (chan->serv != -1) {
+			FD_SET(chan->serv, fds);
+			max_fd = MAX(max_fd, chan->serv);
+		}
+		/* only wait for input there's room for */
+		if (chan->conn != -1 && chan->rx_pos >= chan->rx_len) {
+			FD_SET(chan->conn, fds);
+			max_fd = MAX(max_fd, chan->conn);
+		}
+	}
+	return max_fd;
+}
+
+int rtt_if_serve(const fd_set *const fds)
+{
+	int ready = 0;
+	for (size_t i = 0; rtt_if_port && i < RTT_IF_CHANNELS; ++i) {
+		rtt_if_channel_s *const chan = &rtt_if_channels[i];
+		if (chan->serv != -1 && FD_ISSET(chan->serv, fds)) {
+			++ready;
+			rtt_if_accept(chan);
+		} else if (chan->conn != -1 && FD_ISSET(chan->conn, fds)) {
+			++ready;
+			rtt_if_receive(chan);
+		}
+	}
+	return ready;
+}
+
+static int rtt_if_tcp_init(void)
+{
+	for (size_t i = 0; i < RTT_IF_CHANNELS; ++i) {
+		rtt_if_channels[i].serv = rtt_if_listen(rtt_if_port + i);
+		rtt_if_channels[i].conn = -1;
+	}
+	DEBUG_WARN("RTT channels on TCP: %u-%u, samples on %u\n", rtt_if_port, rtt_if_port + MAX_RTT_CHAN - 1U,
+		rtt_if_port + SAMPLE_CHANNEL);
+	return 0;
+}
+
+static void rtt_if_tcp_exit(void)
+{
+	for (size_t i = 0; i < RTT_IF_CHANNELS; ++i) {
+		if (rtt_if_channels[i].conn != -1)
+			close(rtt_if_channels[i].conn);
+		if (rtt_if_channels[i].serv != -1)
+			close(rtt_if_channels[i].serv);
+		rtt_if_channels[i].conn = -1;
+		rtt_if_channels[i].serv = -1;
+	}
+}
+#endif
+
 /* set up and tear down */
 
 int rtt_if_init()
 {
+#ifdef RTT_IF_SELECT
+	if (rtt_if_port)
+		return rtt_if_tcp_init();
+#else
+	if (rtt_if_port)
+		DEBUG_WARN("RTT over TCP is not supported on this platform, using the terminal\n");
+#endif
 	struct termios ttystate;
 	tcgetattr(STDIN_FILENO, &saved_ttystate);
 	tty_saved = true;
@@ -57,23 +256,102 @@ int rtt_if_init()
 
 int rtt_if_exit()
 {
+#ifdef RTT_IF_SELECT
+	if (rtt_if_port)
+		rtt_if_tcp_exit();
+#endif
 	if (tty_saved)
 		tcsetattr(STDIN_FILENO, TCSANOW, &saved_ttystate);
 	return 0;
 }
 
-/* write buffer to terminal */
+/* write buffer to terminal, or the channel's consumer */
+
+static uint32_t rtt_if_write(uint32_t channel, const char *buf, uint32_t len)
+{
+	if (rtt_if_sink)
+		return rtt_if_sink->write(channel, buf, len);
+#ifdef RTT_IF_SELECT
+	if (rtt_if_port) {
+		rtt_if_channel_s *const chan = &rtt_if_channels[channel % RTT_IF_CHANNELS];
+		/* nobody listening, the data is dropped */
+		if (chan->conn == -1)
+			return len;
+		uint32_t sent = 0;
+		if (rtt_if_flush(chan) && chan->conn != -1) {
+			const ssize_t result = send(chan->conn, buf, len, MSG_NOSIGNAL);
+			if (result > 0)
+				sent = result;
+			else if (result < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+				rtt_if_drop(chan);
+				return len;
+			}
+		}
+		if (chan->conn == -1)
+			return len;
+		/* hold back what the socket can't take now, whatever doesn't fit either is lost */
+		const uint32_t held = MIN(len - sent, sizeof(chan->tx_buf) - chan->tx_len);
+		memcpy(chan->tx_buf + chan->tx_len, buf + sent, held);
+		chan->tx_len += held;
+		return sent + held;
+	}
+#else
+	(void)channel;
+#endif
+	return rtt_if_terminal_write(buf, len);
+}
 
-uint32_t rtt_write(const char *buf, uint32_t len)
+/* what the terminal or consumer took is also what the timeline sees */
+uint32_t rtt_write(uint32_t channel, const char *buf, uint32_t len)
 {
-	write(1, buf, len);
-	return len;
+	const uint32_t written = rtt_if_write(channel, buf, len);
+	if (written && timeline_enabled()) {
+		char source[8];
+		if (channel == SAMPLE_CHANNEL)
+			strcpy(source, "SAMPLE");
+		else
+			snprintf(source, sizeof(source), "RTT%" PRIu32, channel);
+		timeline_add(timeline_now(), source, buf, written);
+	}
+	return written;
 }
 
-/* read character from terminal */
+uint32_t rtt_write_space(uint32_t channel)
+{
+	if (rtt_if_sink)
+		return rtt_if_sink->space(channel);
+#ifdef RTT_IF_SELECT
+	if (rtt_if_port) {
+		rtt_if_channel_s *const chan = &rtt_if_channels[channel % RTT_IF_CHANNELS];
+		/* with no consumer a blocking channel's data waits for one on the target */
+		if (chan->conn == -1)
+			return 0;
+		rtt_if_flush(chan);
+		return sizeof(chan->tx_buf) - chan->tx_len;
+	}
+#else
+	(void)channel;
+#endif
+	return rtt_if_terminal_space();
+}
 
-int32_t rtt_getchar()
+/* read character from terminal, or the channel's producer */
+
+int32_t rtt_getchar(uint32_t channel)
 {
+	if (rtt_if_sink)
+		return -1;
+#ifdef RTT_IF_SELECT
+	if (rtt_if_port) {
+		rtt_if_channel_s *const chan = &rtt_if_channels[channel % RTT_IF_CHANNELS];
+		rtt_if_receive(chan);
+		if (chan->rx_pos >= chan->rx_len)
+			return -1;
+		return (uint8_t)chan->rx_buf[chan->rx_pos++];
+	}
+#else
+	(void)channel;
+#endif
 	char ch;
 	int len;
 	len = read(0, &ch, 1);
@@ -83,8 +361,19 @@ int32_t rtt_getchar()
 
 /* true if no characters available */
 
-bool rtt_nodata()
+bool rtt_nodata(uint32_t channel)
 {
+	if (rtt_if_sink)
+		return true;
+#ifdef RTT_IF_SELECT
+	if (rtt_if_port) {
+		rtt_if_channel_s *const chan = &rtt_if_channels[channel % RTT_IF_CHANNELS];
+		rtt_if_receive(chan);
+		return chan->rx_pos >= chan->rx_len;
+	}
+#else
+	(void)channel;
+#endif
 	return false;
 }
 
@@ -94,6 +383,8 @@ bool rtt_nodata()
 
 int rtt_if_init()
 {
+	if (rtt_if_port)
+		DEBUG_WARN("RTT over TCP is not supported on this platform, using the terminal\n");
 	return 0;
 }
 
@@ -104,23 +395,35 @@ int rtt_if_exit()
 
 /* write buffer to terminal */
 
-uint32_t rtt_write(const char *buf, uint32_t len)
+uint32_t rtt_write(uint32_t channel, const char *buf, uint32_t len)
+{
+	if (rtt_if_sink)
+		return rtt_if_sink->write(channel, buf, len);
+	(void)channel;
+	return rtt_if_terminal_write(buf, len);
+}
+
+uint32_t rtt_write_space(uint32_t channel)
 {
-	write(1, buf, len);
-	return len;
+	if (rtt_if_sink)
+		return rtt_if_sink->space(channel);
+	(void)channel;
+	return rtt_if_terminal_space();
 }
 
 /* read character from terminal */
 
-int32_t rtt_getchar()
+int32_t rtt_getchar(uint32_t channel)
 {
+	(void)channel;
 	return -1;
 }
 
 /* true if no characters available */
 
-bool rtt_nodata()
+bool rtt_nodata(uint32_t channel)
 {
+	(void)channel;
 	return false;
 }
 
@@ -25,12 +25,75 @@
 #include <errno.h>
 #include <termios.h>
 #include <unistd.h>
+#include <signal.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
 
 #include "remote.h"
 #include "cli.h"
 #include "cortexm.h"
 
 static int fd;  /* File descriptor for connection to GDB remote */
+/* Connected over TCP to BMDA serving its probe rather than to a tty */
+static bool fd_is_socket;
+
+#define SERIAL_TCP_PREFIX "tcp:"
+
+/*
+ * Responses are framed out of a local buffer filled by reads of whatever the
+ * tty has pending, rather than costing a select() and read() per byte.
+ */
+#define READ_BUFFER_LENGTH 4096U
+
+static uint8_t read_buffer[READ_BUFFER_LENGTH];
+static size_t read_buffer_fill;
+static size_t read_buffer_offset;
+
+/* Connects to BMDA running with --serve at HOST:PORT */
+static int serial_open_tcp(const char *const address)
+{
+	char host[256];
+	const char *const port = strrchr(address, ':');
+	if (!port || (size_t)(port - address) >= sizeof(host)) {
+		DEBUG_WARN("Expected %sHOST:PORT, not %s%s\n", SERIAL_TCP_PREFIX, SERIAL_TCP_PREFIX, address);
+		return -1;
+	}
+	memcpy(host, address, port - address);
+	host[port - address] = '\0';
+
+	const struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+	};
+	struct addrinfo *addrs;
+	const int result = getaddrinfo(host, port + 1, &hints, &addrs);
+	if (result) {
+		DEBUG_WARN("Can not resolve %s: %s\n", address, gai_strerror(result));
+		return -1;
+	}
+	fd = -1;
+	for (const struct addrinfo *addr = addrs; addr && fd == -1; addr = addr->ai_next) {
+		fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+		if (fd != -1 && connect(fd, addr->ai_addr, addr->ai_addrlen) == -1) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(addrs);
+	if (fd == -1) {
+		DEBUG_WARN("Couldn't connect to %s: %s\n", address, strerror(errno));
+		return -1;
+	}
+	/* Requests are small and each is waited on, so don't let Nagle hold them back */
+	int opt = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+	/* A server going away shows as a failed write rather than killing us */
+	signal(SIGPIPE, SIG_IGN);
+	fd_is_socket = true;
+	return 0;
+}
 
 /* A nice routine grabbed from
  * https://stackoverflow.com/questions/6947413/how-to-open-read-and-write-from-serial-port-in-c
@@ -73,6 +136,8 @@ static int set_interface_attribs(void)
 int serial_open(BMP_CL_OPTIONS_t *cl_opts, char *serial)
 {
     char name[4096];
+    if (cl_opts->opt_device && !strncmp(cl_opts->opt_device, SERIAL_TCP_PREFIX, strlen(SERIAL_TCP_PREFIX)))
+        return serial_open_tcp(cl_opts->opt_device + strlen(SERIAL_TCP_PREFIX));
     if (!cl_opts->opt_device) {
         /* Try to find some BMP if0*/
         if (!serial) {
@@ -102,6 +167,8 @@ int serial_open(BMP_CL_OPTIONS_t *cl_opts, char *serial)
 int serial_open(BMP_CL_OPTIONS_t *cl_opts, char *serial)
 {
 	char name[4096];
+	if (cl_opts->opt_device && !strncmp(cl_opts->opt_device, SERIAL_TCP_PREFIX, strlen(SERIAL_TCP_PREFIX)))
+		return serial_open_tcp(cl_opts->opt_device + strlen(SERIAL_TCP_PREFIX));
 	if (!cl_opts->opt_device) {
 		/* Try to find some BMP if0*/
 		struct dirent *dp;
@@ -169,9 +236,12 @@ int serial_open(BMP_CL_OPTIONS_t *cl_opts, char *serial)
 void serial_close(void)
 {
 	close(fd);
+	fd_is_socket = false;
+	read_buffer_fill = 0;
+	read_buffer_offset = 0;
 }
 
-int platform_buffer_write(const uint8_t *data, int size)
+int serial_buffer_write(const uint8_t *data, int size)
 {
 	int s;
 
@@ -185,62 +255,95 @@ int platform_buffer_write(const uint8_t *data, int size)
 	return size;
 }
 
-int platform_buffer_read(uint8_t *data, int maxsize)
+/* Wait until the deadline for more data once the buffer is drained */
+static int read_buffer_refill(const uint32_t deadline)
 {
-	uint8_t *c;
-	int s;
-	int ret;
-	fd_set  rset;
-	struct timeval tv;
-
-	c = data;
-	tv.tv_sec = 0;
-
-	tv.tv_sec = cortexm_wait_timeout / 1000 ;
-	tv.tv_usec = 1000 * (cortexm_wait_timeout % 1000);
-
-	/* Look for start of response */
-	do {
+	read_buffer_offset = 0;
+	read_buffer_fill = 0;
+	while (true) {
+		const uint32_t now = platform_time_ms();
+		if ((int32_t)(deadline - now) <= 0)
+			return 0;
+		const uint32_t remaining = deadline - now;
+		struct timeval tv = {
+			.tv_sec = remaining / 1000U,
+			.tv_usec = 1000U * (remaining % 1000U),
+		};
+		fd_set rset;
 		FD_ZERO(&rset);
 		FD_SET(fd, &rset);
-
-		ret = select(fd + 1, &rset, NULL, NULL, &tv);
+		const int ret = select(fd + 1, &rset, NULL, NULL, &tv);
 		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
 			DEBUG_WARN("Failed on select\n");
-			return(-3);
+			return -1;
+		}
+		if (ret == 0)
+			return 0;
+		/* select() said there's data, so this returns without waiting on VTIME */
+		const ssize_t s = read(fd, read_buffer, sizeof(read_buffer));
+		if (s < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			DEBUG_WARN("Failed to read\n");
+			return -1;
+		}
+		if (s > 0) {
+			read_buffer_fill = (size_t)s;
+			return 1;
+		}
+		if (fd_is_socket) {
+			DEBUG_WARN("Remote closed the connection\n");
+			return -1;
+		}
+	}
+}
+
+int serial_buffer_read(uint8_t *data, int maxsize)
+{
+	const uint32_t deadline = platform_time_ms() + cortexm_wait_timeout;
+
+	/* Look for start of response */
+	while (true) {
+		const uint8_t *const start = read_buffer + read_buffer_offset;
+		const uint8_t *const resp = memchr(start, REMOTE_RESP, read_buffer_fill - read_buffer_offset);
+		if (resp) {
+			read_buffer_offset += (resp - start) + 1U;
+			break;
 		}
-		if(ret == 0) {
+		const int ret = read_buffer_refill(deadline);
+		if (ret < 0)
+			return -3;
+		if (ret == 0) {
 			DEBUG_WARN("Timeout on read RESP\n");
-			return(-4);
+			return -4;
 		}
+	}
 
-		s = read(fd, c, 1);
-    }
-	while ((s > 0) && (*c != REMOTE_RESP));
 	/* Now collect the response */
-	do {
-		FD_ZERO(&rset);
-		FD_SET(fd, &rset);
-		ret = select(fd + 1, &rset, NULL, NULL, &tv);
-		if (ret < 0) {
-			DEBUG_WARN("Failed on select\n");
-			exit(-4);
+	size_t length = 0;
+	while (true) {
+		const uint8_t *const start = read_buffer + read_buffer_offset;
+		const size_t available = read_buffer_fill - read_buffer_offset;
+		const uint8_t *const eom = memchr(start, REMOTE_EOM, available);
+		const size_t count = eom ? (size_t)(eom - start) : available;
+		if (length + count >= (size_t)maxsize) {
+			DEBUG_WARN("Failed to read\n");
+			return -6;
 		}
-		if(ret == 0) {
-			DEBUG_WARN("Timeout on read\n");
-			return(-5);
+		memcpy(data + length, start, count);
+		length += count;
+		read_buffer_offset += count;
+		if (eom) {
+			++read_buffer_offset;
+			data[length] = 0;
+			DEBUG_WIRE("       %s\n", data);
+			return (int)length;
 		}
-		s = read(fd, c, 1);
-		if (*c==REMOTE_EOM) {
-			*c = 0;
-			DEBUG_WIRE("       %s\n",data);
-			return (c - data);
-		} else {
-			c++;
+		if (read_buffer_refill(deadline) <= 0) {
+			DEBUG_WARN("Timeout on read\n");
+			return -5;
 		}
-	}while ((s >= 0) && ((c - data) < maxsize));
-
-	DEBUG_WARN("Failed to read\n");
-	return(-6);
-	return 0;
+	}
 }
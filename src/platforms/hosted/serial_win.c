@@ -24,6 +24,19 @@
 
 static HANDLE hComm;
 
+/*
+ * The port is opened for overlapped I/O, and responses are framed out of a
+ * local buffer filled by reads of whatever the driver has pending rather than
+ * costing a ReadFile() per byte.
+ */
+#define READ_BUFFER_LENGTH 4096U
+
+static uint8_t read_buffer[READ_BUFFER_LENGTH];
+static size_t read_buffer_fill;
+static size_t read_buffer_offset;
+static OVERLAPPED read_overlapped;
+static OVERLAPPED write_overlapped;
+
 static char *find_bmp_by_serial(const char *serial)
 {
 	char regpath[258];
@@ -85,7 +98,7 @@ int serial_open(BMP_CL_OPTIONS_t *cl_opts, char * serial)
                       0,                            // No Sharing
                       NULL,                         // No Security
                       OPEN_EXISTING,// Open existing port only
-                      0,            // Non Overlapped I/O
+                      FILE_FLAG_OVERLAPPED,         // Overlapped I/O
                       NULL);        // Null for Comm Devices}
 	if (hComm == INVALID_HANDLE_VALUE) {
 		DEBUG_WARN("Could not open %s: %ld\n", device,
@@ -104,73 +117,132 @@ int serial_open(BMP_CL_OPTIONS_t *cl_opts, char * serial)
 		DEBUG_WARN("SetCommState failed %ld\n", GetLastError());
 		return -1;
 	}
+	/*
+	 * Have reads complete as soon as any data has arrived, returning all of it.
+	 * How long to wait for the first byte is kept by serial_buffer_read().
+	 */
 	COMMTIMEOUTS timeouts = {0};
-	timeouts.ReadIntervalTimeout         = 10;
-	timeouts.ReadTotalTimeoutConstant    = 10;
-	timeouts.ReadTotalTimeoutMultiplier  = 10;
+	timeouts.ReadIntervalTimeout         = MAXDWORD;
+	timeouts.ReadTotalTimeoutConstant    = MAXDWORD - 1U;
+	timeouts.ReadTotalTimeoutMultiplier  = MAXDWORD;
 	timeouts.WriteTotalTimeoutConstant   = 10;
 	timeouts.WriteTotalTimeoutMultiplier = 10;
 	if (!SetCommTimeouts(hComm, &timeouts)) {
 		DEBUG_WARN("SetCommTimeouts failed %ld\n", GetLastError());
 		return -1;
 	}
+	read_overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	write_overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (!read_overlapped.hEvent || !write_overlapped.hEvent) {
+		DEBUG_WARN("CreateEvent failed %ld\n", GetLastError());
+		return -1;
+	}
+	read_buffer_fill = 0;
+	read_buffer_offset = 0;
 	return 0;
 }
 
 void serial_close(void)
 {
 	CloseHandle(hComm);
+	CloseHandle(read_overlapped.hEvent);
+	CloseHandle(write_overlapped.hEvent);
 }
 
-int platform_buffer_write(const uint8_t *data, int size)
+int serial_buffer_write(const uint8_t *data, int size)
 {
 	DEBUG_WIRE("%s\n",data);
 	int s = 0;
 
 	do {
 		DWORD written;
-		if (!WriteFile(hComm, data + s, size - s, &written, NULL)) {
-			DEBUG_WARN("Serial write failed %ld, written %d\n",
-					GetLastError(), s);
-			return -1;
+		if (!WriteFile(hComm, data + s, size - s, &written, &write_overlapped)) {
+			if (GetLastError() != ERROR_IO_PENDING ||
+				!GetOverlappedResult(hComm, &write_overlapped, &written, TRUE)) {
+				DEBUG_WARN("Serial write failed %ld, written %d\n",
+						GetLastError(), s);
+				return -1;
+			}
 		}
 		s += written;
 	} while (s < size);
 	return 0;
 }
-int platform_buffer_read(uint8_t *data, int maxsize)
+
+/* Wait until the deadline for more data once the buffer is drained */
+static bool read_buffer_refill(const uint32_t deadline)
 {
-	DWORD s;
-	uint8_t response = 0;
-	uint32_t startTime = platform_time_ms();
-	uint32_t endTime = platform_time_ms() + cortexm_wait_timeout;
-	do {
-		if (!ReadFile(hComm, &response, 1, &s, NULL)) {
-			DEBUG_WARN("ERROR on read RESP\n");
-			exit(-3);
+	read_buffer_offset = 0;
+	read_buffer_fill = 0;
+	while (true) {
+		const uint32_t now = platform_time_ms();
+		if ((int32_t)(deadline - now) <= 0)
+			return false;
+		DWORD s = 0;
+		if (!ReadFile(hComm, read_buffer, sizeof(read_buffer), &s, &read_overlapped)) {
+			if (GetLastError() != ERROR_IO_PENDING) {
+				DEBUG_WARN("Error on read\n");
+				exit(-3);
+			}
+			if (WaitForSingleObject(read_overlapped.hEvent, deadline - now) != WAIT_OBJECT_0) {
+				/* Timed out, take back the read before its buffer is touched again */
+				CancelIo(hComm);
+				GetOverlappedResult(hComm, &read_overlapped, &s, TRUE);
+				read_buffer_fill = s;
+				return s > 0;
+			}
+			if (!GetOverlappedResult(hComm, &read_overlapped, &s, FALSE)) {
+				DEBUG_WARN("Error on read\n");
+				exit(-3);
+			}
+		}
+		if (s > 0) {
+			read_buffer_fill = s;
+			return true;
 		}
-		if (platform_time_ms() > endTime) {
+	}
+}
+
+int serial_buffer_read(uint8_t *data, int maxsize)
+{
+	const uint32_t startTime = platform_time_ms();
+	const uint32_t deadline = startTime + cortexm_wait_timeout;
+
+	/* Look for start of response */
+	while (true) {
+		const uint8_t *const start = read_buffer + read_buffer_offset;
+		const uint8_t *const resp = memchr(start, REMOTE_RESP, read_buffer_fill - read_buffer_offset);
+		if (resp) {
+			read_buffer_offset += (resp - start) + 1U;
+			break;
+		}
+		if (!read_buffer_refill(deadline)) {
 			DEBUG_WARN("Timeout on read RESP\n");
 			exit(-4);
 		}
-	} while (response != REMOTE_RESP);
-	uint8_t *c = data;
-	do {
-		if (!ReadFile(hComm, c, 1, &s, NULL)) {
-			DEBUG_WARN("Error on read\n");
-			exit(-3);
-		}
-		if (s > 0 ) {
-			DEBUG_WIRE("%c", *c);
-			if (*c == REMOTE_EOM) {
-				*c = 0;
-				DEBUG_WIRE("\n");
-				return (c - data);
-			} else {
-				c++;
-			}
+	}
+
+	/* Now collect the response */
+	size_t length = 0;
+	while (true) {
+		const uint8_t *const start = read_buffer + read_buffer_offset;
+		const size_t available = read_buffer_fill - read_buffer_offset;
+		const uint8_t *const eom = memchr(start, REMOTE_EOM, available);
+		const size_t count = eom ? (size_t)(eom - start) : available;
+		if (length + count >= (size_t)maxsize)
+			break;
+		memcpy(data + length, start, count);
+		length += count;
+		read_buffer_offset += count;
+		if (eom) {
+			++read_buffer_offset;
+			data[length] = 0;
+			DEBUG_WIRE("%s\n", data);
+			return (int)length;
 		}
-	} while (((c - data) < maxsize) && (platform_time_ms() < endTime));
+		if (!read_buffer_refill(deadline))
+			break;
+	}
 	DEBUG_WARN("Failed to read EOM at %d\n",
 			platform_time_ms() - startTime);
 	exit(-3);
@@ -0,0 +1,1034 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A simulated probe and target, to run the whole stack from adiv5_dp_init()
+ * through the target drivers to the GDB server without hardware, for
+ * benchmarks and tests. It answers DP and AP accesses the way a SW-DP does,
+ * AP reads posted and bus faults turning into FAULT responses until cleared,
+ * in front of the AHB-AP of an STM32F103: a Cortex-M3 with its ROM table,
+ * SCS, FPB and DWT, SRAM, and flash behind a model of the FPEC.
+ *
+ * The same accesses can also be made over a model of the SWD wire protocol,
+ * request, ACK and data phases, for BMDA serving the simulator as a probe.
+ *
+ * The core doesn't execute code. Resuming it runs until a halt request,
+ * except on a BKPT instruction and on the RAM stubs known here, which are
+ * carried out as a whole and then halt on their exit BKPT as they would.
+ *
+ * Options, comma separated:
+ *   dev=ID       DBGMCU device ID, 0x410 (medium density, the default) or
+ *                0x414 (high density), which the driver takes the memory map from
+ *   ram=SIZE     SRAM actually there, K and M suffixes allowed
+ *   flash=SIZE   Flash actually there
+ *   latency=US   Time every DP and AP access takes
+ *   erase=US     Time FLASH_SR reads busy for after a page erase
+ *   program=US   Time FLASH_SR reads busy for after programming a halfword
+ */
+
+#include "general.h"
+#include "target_internal.h"
+#include "adiv5.h"
+#include "cortexm.h"
+#include "crc32.h"
+#include "sim.h"
+
+#define SIM_DPIDR  0x1ba01477U /* SW-DP v1, as on Cortex-M3 */
+#define SIM_AP_IDR 0x14770011U /* AHB-AP, as on Cortex-M3 */
+#define SIM_CPUID  0x411fc231U /* Cortex-M3 r1p1 */
+
+#define SIM_ROM_TABLE 0xe00ff000U
+#define SIM_SCS_BASE  CORTEXM_SCS_BASE
+#define SIM_DWT_BASE  CORTEXM_DWT_BASE
+#define SIM_FPB_BASE  CORTEXM_FPB_BASE
+#define SIM_PPB_BASE  0xe0000000U
+#define SIM_PPB_SIZE  0x00100000U
+
+#define SIM_FLASH_BASE  0x08000000U
+#define SIM_RAM_BASE    0x20000000U
+#define SIM_PERIPH_BASE 0x40000000U
+#define SIM_PERIPH_SIZE 0x20000000U
+#define SIM_SYSMEM_BASE 0x1ffff000U
+#define SIM_SYSMEM_SIZE 0x00000810U
+#define SIM_FLASHSIZE   0x1ffff7e0U
+#define SIM_OPTION_RDP  0x1ffff800U
+
+#define SIM_DBGMCU_IDCODE 0xe0042000U
+#define SIM_DBGMCU_CR     0xe0042004U
+
+#define SIM_FPEC_BASE  0x40022000U
+#define SIM_FLASH_ACR  (SIM_FPEC_BASE + 0x00U)
+#define SIM_FLASH_KEYR (SIM_FPEC_BASE + 0x04U)
+#define SIM_FLASH_SR   (SIM_FPEC_BASE + 0x0cU)
+#define SIM_FLASH_CR   (SIM_FPEC_BASE + 0x10U)
+#define SIM_FLASH_AR   (SIM_FPEC_BASE + 0x14U)
+#define SIM_FLASH_OBR  (SIM_FPEC_BASE + 0x1cU)
+#define SIM_FLASH_WRPR (SIM_FPEC_BASE + 0x20U)
+
+#define SIM_FLASH_KEY1 0x45670123U
+#define SIM_FLASH_KEY2 0xcdef89abU
+
+#define SIM_FLASH_CR_LOCK (1U << 7U)
+#define SIM_FLASH_CR_STRT (1U << 6U)
+#define SIM_FLASH_CR_MER  (1U << 2U)
+#define SIM_FLASH_CR_PER  (1U << 1U)
+#define SIM_FLASH_CR_PG   (1U << 0U)
+
+#define SIM_FLASH_SR_EOP      (1U << 5U)
+#define SIM_FLASH_SR_WRPRTERR (1U << 4U)
+#define SIM_FLASH_SR_PGERR    (1U << 2U)
+#define SIM_FLASH_SR_BSY      (1U << 0U)
+
+#define SIM_FPB_COMPARATORS 8U
+#define SIM_DWT_COMPARATORS 4U
+/* DCRSR REGSEL is 7 bits wide */
+#define SIM_REG_COUNT 128U
+
+#define SIM_DP_CTRLSTAT_STICKY                                                                        \
+	(ADIV5_DP_CTRLSTAT_STICKYORUN | ADIV5_DP_CTRLSTAT_STICKYCMP | ADIV5_DP_CTRLSTAT_STICKYERR | \
+		ADIV5_DP_CTRLSTAT_WDATAERR)
+
+typedef struct sim_device {
+	uint16_t id;
+	uint32_t flash_size;
+	uint32_t page_size;
+	uint32_t ram_size;
+	const char *name;
+} sim_device_s;
+
+static const sim_device_s sim_devices[] = {
+	{0x410U, 128U * 1024U, 1024U, 20U * 1024U, "STM32F103 medium density"},
+	{0x414U, 512U * 1024U, 2048U, 64U * 1024U, "STM32F103 high density"},
+};
+
+/* A RAM routine carried out here when the core is resumed on it, returning the BKPT it exits on */
+typedef struct sim_stub {
+	const uint16_t *code;
+	size_t code_size;
+	uint8_t (*run)(void);
+} sim_stub_s;
+
+typedef struct sim_state {
+	const sim_device_s *device;
+	uint32_t latency_us;
+	uint32_t erase_us;
+	uint32_t program_us;
+	uint32_t ram_size;
+	uint32_t flash_size;
+	uint8_t *ram;
+	uint8_t *flash;
+
+	/* SW-DP and AHB-AP */
+	uint32_t ctrlstat;
+	uint32_t select;
+	uint32_t rdbuff;
+	uint32_t csw;
+	uint32_t tar;
+
+	/* Core and its debug registers */
+	bool nrst;
+	bool halted;
+	bool reset_seen;
+	uint32_t dhcsr;
+	uint32_t dfsr;
+	uint32_t demcr;
+	uint32_t dcrdr;
+	uint32_t regs[SIM_REG_COUNT];
+	bool stub_running;
+	uint32_t stub_exit;
+	bool fpb_enable;
+	uint32_t fpb_comp[SIM_FPB_COMPARATORS];
+	uint32_t dwt_ctrl;
+	uint32_t dwt_comp[SIM_DWT_COMPARATORS][4];
+	uint32_t dbgmcu_cr;
+
+	/* FPEC */
+	uint32_t flash_cr;
+	uint32_t flash_sr;
+	uint32_t flash_ar;
+	uint8_t flash_keys;
+	uint32_t flash_busy_start;
+	uint32_t flash_busy_us;
+} sim_state_s;
+
+static sim_state_s sim;
+
+static const uint16_t sim_stm32f1_stub[] = {
+#include "flashstub/stm32f1.stub"
+};
+
+static const uint16_t sim_crc32_stub[] = {
+#include "flashstub/crc32.stub"
+};
+
+static uint8_t sim_stm32f1_write(void);
+static uint8_t sim_crc32(void);
+
+static const sim_stub_s sim_stubs[] = {
+	{sim_stm32f1_stub, sizeof(sim_stm32f1_stub), sim_stm32f1_write},
+	{sim_crc32_stub, sizeof(sim_crc32_stub), sim_crc32},
+};
+
+static bool sim_flash_busy(void)
+{
+	if (sim.flash_busy_us && platform_time_us() - sim.flash_busy_start >= sim.flash_busy_us)
+		sim.flash_busy_us = 0;
+	return sim.flash_busy_us != 0;
+}
+
+/* Operations queue up behind one still in progress */
+static void sim_flash_busy_for(const uint32_t us)
+{
+	if (!sim_flash_busy())
+		sim.flash_busy_start = platform_time_us();
+	sim.flash_busy_us += us;
+}
+
+/* Byte addressable memory, flash also at its boot alias at 0 */
+static uint8_t *sim_memory(const uint32_t addr, const size_t len)
+{
+	if (addr >= SIM_RAM_BASE && addr - SIM_RAM_BASE + len <= sim.ram_size)
+		return sim.ram + (addr - SIM_RAM_BASE);
+	if (addr >= SIM_FLASH_BASE && addr - SIM_FLASH_BASE + len <= sim.flash_size)
+		return sim.flash + (addr - SIM_FLASH_BASE);
+	if (addr + len <= sim.flash_size)
+		return sim.flash + addr;
+	return NULL;
+}
+
+static bool sim_is_flash(const uint32_t addr)
+{
+	return (addr >= SIM_FLASH_BASE && addr - SIM_FLASH_BASE < sim.flash_size) || addr < sim.flash_size;
+}
+
+static uint32_t sim_read_le(const uint8_t *const data, const size_t size)
+{
+	uint32_t value = 0;
+	for (size_t i = 0; i < size; ++i)
+		value |= (uint32_t)data[i] << (i * 8U);
+	return value;
+}
+
+/* CoreSight ID registers at the top of a 4KiB component */
+static uint32_t sim_component_id(const uint32_t offset, const uint8_t cid_class, const uint16_t designer,
+	const uint16_t partno)
+{
+	const uint8_t jep106 = designer & 0x7fU;
+	switch (offset) {
+	case 0xfd0U: /* PIDR4, JEP106 continuation code */
+		return (designer >> 8U) & 0xfU;
+	case 0xfe0U:
+		return partno & 0xffU;
+	case 0xfe4U:
+		return ((partno >> 8U) & 0xfU) | (jep106 & 0xfU) << 4U;
+	case 0xfe8U: /* JEP106 code used */
+		return (jep106 >> 4U) | 0x08U;
+	case 0xff0U:
+		return 0x0dU;
+	case 0xff4U:
+		return (uint32_t)cid_class << 4U;
+	case 0xff8U:
+		return 0x05U;
+	case 0xffcU:
+		return 0xb1U;
+	default:
+		return 0;
+	}
+}
+
+static uint32_t sim_dhcsr_read(void)
+{
+	uint32_t value = (sim.dhcsr & 0xfU) | CORTEXM_DHCSR_S_REGRDY;
+	if (sim.halted)
+		value |= CORTEXM_DHCSR_S_HALT;
+	/* S_RESET_ST reads set once after a reset, and for as long as nRST is held */
+	if (sim.reset_seen) {
+		value |= CORTEXM_DHCSR_S_RESET_ST;
+		sim.reset_seen = sim.nrst;
+	}
+	return value;
+}
+
+static void sim_core_reset(void)
+{
+	memset(sim.regs, 0, sizeof(sim.regs));
+	sim.regs[13] = sim_read_le(sim.flash, 4U);
+	sim.regs[15] = sim_read_le(sim.flash + 4U, 4U) & ~1U;
+	sim.regs[16] = CORTEXM_XPSR_THUMB;
+	sim.stub_running = false;
+	sim.reset_seen = true;
+	sim.flash_cr = SIM_FLASH_CR_LOCK;
+	sim.flash_sr = 0;
+	sim.flash_keys = 0;
+	sim.halted = (sim.demcr & CORTEXM_DEMCR_VC_CORERESET) && (sim.dhcsr & CORTEXM_DHCSR_C_DEBUGEN);
+	if (sim.halted)
+		sim.dfsr |= CORTEXM_DFSR_VCATCH;
+}
+
+static void sim_core_halt(const uint32_t reason)
+{
+	if (sim.halted)
+		return;
+	sim.halted = true;
+	sim.stub_running = false;
+	sim.dfsr |= reason;
+}
+
+/* A stub halts on its exit BKPT once the flash operations it started are done */
+static void sim_core_update(void)
+{
+	if (sim.stub_running && !sim.halted && !sim_flash_busy()) {
+		sim.regs[15] = sim.stub_exit;
+		sim_core_halt(CORTEXM_DFSR_BKPT);
+	}
+}
+
+static void sim_core_resume(const bool step)
+{
+	sim.halted = false;
+	const uint32_t pc = sim.regs[15];
+	if (step) {
+		sim.regs[15] = pc + 2U;
+		sim_core_halt(CORTEXM_DFSR_HALTED);
+		return;
+	}
+	const uint8_t *const code = sim_memory(pc, 2U);
+	if (code && code[1] == 0xbeU) {
+		sim_core_halt(CORTEXM_DFSR_BKPT);
+		return;
+	}
+	for (size_t i = 0; i < ARRAY_LENGTH(sim_stubs); ++i) {
+		const sim_stub_s *const stub = &sim_stubs[i];
+		const uint8_t *const loaded = sim_memory(pc, stub->code_size);
+		if (!loaded || memcmp(loaded, stub->code, stub->code_size))
+			continue;
+		const uint16_t bkpt = 0xbe00U | stub->run();
+		for (size_t offset = 0; offset < stub->code_size / 2U; ++offset) {
+			if (stub->code[offset] == bkpt) {
+				sim.stub_exit = pc + offset * 2U;
+				sim.stub_running = true;
+				break;
+			}
+		}
+		sim_core_update();
+		return;
+	}
+}
+
+static void sim_dhcsr_write(const uint32_t value)
+{
+	if ((value & 0xffff0000U) != CORTEXM_DHCSR_DBGKEY)
+		return;
+	sim.dhcsr = value & (CORTEXM_DHCSR_C_MASKINTS | CORTEXM_DHCSR_C_STEP | CORTEXM_DHCSR_C_HALT |
+							CORTEXM_DHCSR_C_DEBUGEN);
+	if (sim.nrst)
+		return;
+	if (!(value & CORTEXM_DHCSR_C_DEBUGEN))
+		sim.halted = false;
+	else if (value & CORTEXM_DHCSR_C_HALT)
+		sim_core_halt(CORTEXM_DFSR_HALTED);
+	else if (sim.halted)
+		sim_core_resume(value & CORTEXM_DHCSR_C_STEP);
+}
+
+static void sim_flash_erase(const uint32_t addr, const uint32_t len)
+{
+	const uint32_t offset = (addr - SIM_FLASH_BASE) & ~(len - 1U);
+	if (offset < sim.flash_size)
+		memset(sim.flash + offset, 0xff, MIN(len, sim.flash_size - offset));
+	sim.flash_sr |= SIM_FLASH_SR_EOP;
+	sim_flash_busy_for(sim.erase_us);
+}
+
+/* Writes to flash only do something while FLASH_CR.PG is set, each halfword programs once */
+static void sim_flash_program(const uint32_t addr, const size_t size, const uint32_t value)
+{
+	if (!(sim.flash_cr & SIM_FLASH_CR_PG))
+		return;
+	if (size < 2U) {
+		sim.flash_sr |= SIM_FLASH_SR_PGERR;
+		return;
+	}
+	for (size_t i = 0; i < size; i += 2U) {
+		uint8_t *const data = sim_memory(addr + i, 2U);
+		const uint16_t halfword = value >> (i * 8U);
+		if (!data)
+			continue;
+		if (sim_read_le(data, 2U) != 0xffffU && halfword) {
+			sim.flash_sr |= SIM_FLASH_SR_PGERR;
+			continue;
+		}
+		data[0] = halfword & 0xffU;
+		data[1] = halfword >> 8U;
+		sim.flash_sr |= SIM_FLASH_SR_EOP;
+		sim_flash_busy_for(sim.program_us);
+	}
+}
+
+static void sim_fpec_write(const uint32_t addr, const uint32_t value)
+{
+	switch (addr) {
+	case SIM_FLASH_KEYR:
+		if (sim.flash_keys == 0U && value == SIM_FLASH_KEY1)
+			sim.flash_keys = 1U;
+		else if (sim.flash_keys == 1U && value == SIM_FLASH_KEY2) {
+			sim.flash_keys = 0;
+			sim.flash_cr &= ~SIM_FLASH_CR_LOCK;
+		} else
+			sim.flash_keys = 2U; /* Locked until reset */
+		break;
+	case SIM_FLASH_SR:
+		sim.flash_sr &= ~(value & (SIM_FLASH_SR_EOP | SIM_FLASH_SR_WRPRTERR | SIM_FLASH_SR_PGERR));
+		break;
+	case SIM_FLASH_CR:
+		if (sim.flash_cr & SIM_FLASH_CR_LOCK)
+			break;
+		sim.flash_cr = value & ~SIM_FLASH_CR_STRT;
+		if (!(value & SIM_FLASH_CR_STRT))
+			break;
+		if (value & SIM_FLASH_CR_MER)
+			sim_flash_erase(SIM_FLASH_BASE, sim.flash_size);
+		else if (value & SIM_FLASH_CR_PER)
+			sim_flash_erase(sim.flash_ar, sim.device->page_size);
+		break;
+	case SIM_FLASH_AR:
+		sim.flash_ar = value;
+		break;
+	default:
+		break;
+	}
+}
+
+static bool sim_register_read(const uint32_t addr, uint32_t *const value)
+{
+	*value = 0;
+	if (addr >= SIM_PPB_BASE && addr - SIM_PPB_BASE < SIM_PPB_SIZE) {
+		const uint32_t offset = addr & 0xfffU;
+		switch (addr & ~0xfffU) {
+		case SIM_ROM_TABLE:
+			if (offset < 0xfccU) {
+				static const uint32_t entries[] = {0xfff0f003U, 0xfff02003U, 0xfff03003U};
+				if (offset / 4U < ARRAY_LENGTH(entries))
+					*value = entries[offset / 4U];
+			} else if (offset == 0xfccU)
+				*value = 1U; /* MEMTYPE.SYSMEM */
+			else
+				*value = sim_component_id(offset, 0x1U, JEP106_MANUFACTURER_STM, sim.device->id);
+			return true;
+		case SIM_SCS_BASE:
+			if (offset >= 0xfd0U) {
+				*value = sim_component_id(offset, 0xeU, JEP106_MANUFACTURER_ARM, 0x000U);
+				return true;
+			}
+			break;
+		case SIM_DWT_BASE:
+			if (offset >= 0xfd0U)
+				*value = sim_component_id(offset, 0xeU, JEP106_MANUFACTURER_ARM, 0x002U);
+			else if (offset == 0U)
+				*value = SIM_DWT_COMPARATORS << 28U | sim.dwt_ctrl;
+			else if (offset >= 0x20U && offset < 0x20U + SIM_DWT_COMPARATORS * 0x10U)
+				*value = sim.dwt_comp[(offset - 0x20U) / 0x10U][(offset & 0xfU) / 4U];
+			return true;
+		case SIM_FPB_BASE:
+			if (offset >= 0xfd0U)
+				*value = sim_component_id(offset, 0xeU, JEP106_MANUFACTURER_ARM, 0x003U);
+			else if (offset == 0U) /* 6 code and 2 literal comparators */
+				*value = 2U << 8U | 6U << 4U | (sim.fpb_enable ? 1U : 0U);
+			else if (offset >= 8U && offset < 8U + SIM_FPB_COMPARATORS * 4U)
+				*value = sim.fpb_comp[(offset - 8U) / 4U];
+			return true;
+		default:
+			break;
+		}
+
+		switch (addr) {
+		case CORTEXM_CPUID:
+			*value = SIM_CPUID;
+			break;
+		case CORTEXM_AIRCR:
+			*value = 0xfa050000U;
+			break;
+		case CORTEXM_DFSR:
+			*value = sim.dfsr;
+			break;
+		case CORTEXM_DHCSR:
+			sim_core_update();
+			*value = sim_dhcsr_read();
+			break;
+		case CORTEXM_DCRDR:
+			*value = sim.dcrdr;
+			break;
+		case CORTEXM_DEMCR:
+			*value = sim.demcr;
+			break;
+		case SIM_DBGMCU_IDCODE:
+			*value = 0x20000000U | sim.device->id;
+			break;
+		case SIM_DBGMCU_CR:
+			*value = sim.dbgmcu_cr;
+			break;
+		default:
+			break;
+		}
+		return true;
+	}
+
+	if (addr >= SIM_SYSMEM_BASE && addr - SIM_SYSMEM_BASE < SIM_SYSMEM_SIZE) {
+		if (addr == SIM_FLASHSIZE)
+			*value = 0xffff0000U | (sim.device->flash_size / 1024U);
+		else if (addr == SIM_OPTION_RDP)
+			*value = 0x00ff5aa5U;
+		else
+			*value = 0xffffffffU;
+		return true;
+	}
+
+	if (addr >= SIM_PERIPH_BASE && addr - SIM_PERIPH_BASE < SIM_PERIPH_SIZE) {
+		switch (addr) {
+		case SIM_FLASH_ACR:
+			*value = 0x30U;
+			break;
+		case SIM_FLASH_SR:
+			*value = sim.flash_sr | (sim_flash_busy() ? SIM_FLASH_SR_BSY : 0U);
+			break;
+		case SIM_FLASH_CR:
+			*value = sim.flash_cr;
+			break;
+		case SIM_FLASH_AR:
+			*value = sim.flash_ar;
+			break;
+		case SIM_FLASH_OBR:
+			*value = 0x03fffffcU;
+			break;
+		case SIM_FLASH_WRPR:
+			*value = 0xffffffffU;
+			break;
+		default:
+			break;
+		}
+		return true;
+	}
+	return false;
+}
+
+static bool sim_register_write(const uint32_t addr, const uint32_t value)
+{
+	if (addr >= SIM_PPB_BASE && addr - SIM_PPB_BASE < SIM_PPB_SIZE) {
+		const uint32_t offset = addr & 0xfffU;
+		switch (addr & ~0xfffU) {
+		case SIM_DWT_BASE:
+			if (offset == 0U)
+				sim.dwt_ctrl = value & 0x0fffffffU;
+			else if (offset >= 0x20U && offset < 0x20U + SIM_DWT_COMPARATORS * 0x10U)
+				sim.dwt_comp[(offset - 0x20U) / 0x10U][(offset & 0xfU) / 4U] = value;
+			return true;
+		case SIM_FPB_BASE:
+			if (offset == 0U && (value & CORTEXM_FPB_CTRL_KEY))
+				sim.fpb_enable = value & 1U;
+			else if (offset >= 8U && offset < 8U + SIM_FPB_COMPARATORS * 4U)
+				sim.fpb_comp[(offset - 8U) / 4U] = value;
+			return true;
+		default:
+			break;
+		}
+
+		switch (addr) {
+		case CORTEXM_AIRCR:
+			if ((value & 0xffff0000U) == CORTEXM_AIRCR_VECTKEY && (value & CORTEXM_AIRCR_SYSRESETREQ))
+				sim_core_reset();
+			break;
+		case CORTEXM_DFSR:
+			sim.dfsr &= ~value;
+			break;
+		case CORTEXM_DHCSR:
+			sim_core_update();
+			sim_dhcsr_write(value);
+			break;
+		case CORTEXM_DCRSR:
+			if (!sim.halted)
+				break;
+			if (value & CORTEXM_DCRSR_REGWnR)
+				sim.regs[value & (SIM_REG_COUNT - 1U)] = sim.dcrdr;
+			else
+				sim.dcrdr = sim.regs[value & (SIM_REG_COUNT - 1U)];
+			break;
+		case CORTEXM_DCRDR:
+			sim.dcrdr = value;
+			break;
+		case CORTEXM_DEMCR:
+			sim.demcr = value;
+			break;
+		case SIM_DBGMCU_CR:
+			sim.dbgmcu_cr = value;
+			break;
+		default:
+			break;
+		}
+		return true;
+	}
+	if (addr >= SIM_PERIPH_BASE && addr - SIM_PERIPH_BASE < SIM_PERIPH_SIZE) {
+		if (addr >= SIM_FPEC_BASE && addr < SIM_FPEC_BASE + 0x400U)
+			sim_fpec_write(addr, value);
+		return true;
+	}
+	return addr >= SIM_SYSMEM_BASE && addr - SIM_SYSMEM_BASE < SIM_SYSMEM_SIZE;
+}
+
+/* One naturally aligned bus access of size bytes, value right aligned. Returns false on a bus fault */
+static bool sim_bus_read(const uint32_t addr, const size_t size, uint32_t *const value)
+{
+	const uint8_t *const data = sim_memory(addr, size);
+	if (data) {
+		*value = sim_read_le(data, size);
+		return true;
+	}
+	uint32_t word;
+	if (!sim_register_read(addr & ~3U, &word))
+		return false;
+	*value = size == 4U ? word : (word >> ((addr & 3U) * 8U)) & ((1U << (size * 8U)) - 1U);
+	return true;
+}
+
+static bool sim_bus_write(const uint32_t addr, const size_t size, const uint32_t value)
+{
+	if (sim_is_flash(addr)) {
+		sim_flash_program(addr, size, value);
+		return true;
+	}
+	uint8_t *const data = sim_memory(addr, size);
+	if (data) {
+		for (size_t i = 0; i < size; ++i)
+			data[i] = value >> (i * 8U);
+		return true;
+	}
+	return sim_register_write(addr & ~3U, value << ((addr & 3U) * 8U));
+}
+
+/* The FPEC's halfword programming loop, see flashstub/stm32f1.s */
+static uint8_t sim_stm32f1_write(void)
+{
+	uint32_t dest = sim.regs[0];
+	uint32_t src = sim.regs[1];
+	int32_t len = (int32_t)sim.regs[2];
+	if (sim.regs[3] != SIM_FPEC_BASE)
+		return 1U;
+	sim_fpec_write(SIM_FLASH_SR, SIM_FLASH_SR_EOP | SIM_FLASH_SR_WRPRTERR | SIM_FLASH_SR_PGERR);
+	sim_fpec_write(SIM_FLASH_CR, SIM_FLASH_CR_PG);
+	do {
+		uint32_t halfword;
+		if (!sim_bus_read(src, 2U, &halfword))
+			return 1U;
+		sim_bus_write(dest, 2U, halfword);
+		if (sim.flash_sr & (SIM_FLASH_SR_WRPRTERR | SIM_FLASH_SR_PGERR))
+			return 1U;
+		dest += 2U;
+		src += 2U;
+		len -= 2;
+	} while (len > 0);
+	sim_fpec_write(SIM_FLASH_CR, 0);
+	return 0;
+}
+
+/* CRC32 of r1 bytes at r0 into the running CRC at r2, see flashstub/crc32.s */
+static uint8_t sim_crc32(void)
+{
+	uint32_t crc;
+	if (!sim_bus_read(sim.regs[2], 4U, &crc))
+		return 1U;
+	for (uint32_t i = 0; i < sim.regs[1]; ++i) {
+		uint32_t byte;
+		if (!sim_bus_read(sim.regs[0] + i, 1U, &byte))
+			return 1U;
+		const uint8_t data = byte;
+		crc = generic_crc32_buffer(crc, &data, 1U);
+	}
+	sim_bus_write(sim.regs[2], 4U, crc);
+	return 0;
+}
+
+/* DRW accesses go to TAR, which increments within its 1KiB block, packed ones carry a word of elements */
+static uint32_t sim_ap_drw(const bool read, const uint32_t value)
+{
+	const size_t size = 1U << MIN(sim.csw & ADIV5_AP_CSW_SIZE_MASK, 2U);
+	const uint32_t addrinc = sim.csw & ADIV5_AP_CSW_ADDRINC_MASK;
+	const bool packed = addrinc == ADIV5_AP_CSW_ADDRINC_PACKED && size < 4U;
+	const uint32_t mask = size == 4U ? 0xffffffffU : (1U << (size * 8U)) - 1U;
+	uint32_t addr = sim.tar & ~(uint32_t)(size - 1U);
+	uint32_t result = 0;
+	for (size_t i = 0; i < (packed ? 4U / size : 1U); ++i, addr += size) {
+		const uint32_t lane = (addr & 3U) * 8U;
+		uint32_t element = 0;
+		const bool ok =
+			read ? sim_bus_read(addr, size, &element) : sim_bus_write(addr, size, (value >> lane) & mask);
+		if (!ok) {
+			sim.ctrlstat |= ADIV5_DP_CTRLSTAT_STICKYERR;
+			return 0;
+		}
+		result |= (element & mask) << lane;
+	}
+	if (addrinc != ADIV5_AP_CSW_ADDRINC_NONE)
+		sim.tar = (sim.tar & ~0x3ffU) | ((sim.tar + (packed ? 4U : size)) & 0x3ffU);
+	return result;
+}
+
+static uint32_t sim_ap_access(const bool read, const uint16_t addr, const uint32_t value)
+{
+	/* Only AP 0 is there, the others read as all zero and so end the scan */
+	if (sim.select >> 24U)
+		return 0;
+	const uint8_t reg = (sim.select & 0xf0U) | (addr & 0x0cU);
+	switch (reg) {
+	case ADIV5_AP_CSW & 0xffU:
+		if (read)
+			return sim.csw | ADIV5_AP_CSW_DBGSWENABLE | ADIV5_AP_CSW_DEVICEEN;
+		sim.csw = value & ~(ADIV5_AP_CSW_TRINPROG | ADIV5_AP_CSW_DEVICEEN);
+		return 0;
+	case ADIV5_AP_TAR & 0xffU:
+		if (read)
+			return sim.tar;
+		sim.tar = value;
+		return 0;
+	case ADIV5_AP_DRW & 0xffU:
+		return sim_ap_drw(read, value);
+	case 0x10U:
+	case 0x14U:
+	case 0x18U:
+	case 0x1cU: {
+		/* Banked data registers, a word each from the 16 byte block TAR is in */
+		const uint32_t bd_addr = (sim.tar & ~0xfU) | (reg & 0x0cU);
+		uint32_t result = 0;
+		if (!(read ? sim_bus_read(bd_addr, 4U, &result) : sim_bus_write(bd_addr, 4U, value)))
+			sim.ctrlstat |= ADIV5_DP_CTRLSTAT_STICKYERR;
+		return result;
+	}
+	case ADIV5_AP_BASE & 0xffU:
+		return SIM_ROM_TABLE | 3U;
+	case ADIV5_AP_IDR & 0xffU:
+		return SIM_AP_IDR;
+	default:
+		return 0;
+	}
+}
+
+static void sim_delay(void)
+{
+	if (!sim.latency_us)
+		return;
+	const uint32_t start = platform_time_us();
+	while (platform_time_us() - start < sim.latency_us)
+		continue;
+}
+
+static uint32_t sim_low_access(ADIv5_DP_t *dp, uint8_t RnW, uint16_t addr, uint32_t value)
+{
+	if (((addr & ADIV5_APnDP) && dp->fault) || dp->deferred_error)
+		return 0;
+	sim_delay();
+
+	if (addr & ADIV5_APnDP) {
+		/* A bus fault makes every following AP access FAULT until the sticky flag is cleared */
+		if (sim.ctrlstat & ADIV5_DP_CTRLSTAT_STICKYERR) {
+			dp->fault = 1;
+			return 0;
+		}
+		const uint32_t result = sim_ap_access(RnW, addr, value);
+		if (!RnW)
+			return 0;
+		/* AP reads are posted, each returns the result of the one before */
+		const uint32_t posted = sim.rdbuff;
+		sim.rdbuff = result;
+		return posted;
+	}
+
+	switch (addr & 0x0cU) {
+	case ADIV5_DP_DPIDR:
+		if (RnW)
+			return SIM_DPIDR;
+		if (value & ADIV5_DP_ABORT_STKERRCLR)
+			sim.ctrlstat &= ~ADIV5_DP_CTRLSTAT_STICKYERR;
+		if (value & ADIV5_DP_ABORT_STKCMPCLR)
+			sim.ctrlstat &= ~ADIV5_DP_CTRLSTAT_STICKYCMP;
+		if (value & ADIV5_DP_ABORT_WDERRCLR)
+			sim.ctrlstat &= ~ADIV5_DP_CTRLSTAT_WDATAERR;
+		if (value & ADIV5_DP_ABORT_ORUNERRCLR)
+			sim.ctrlstat &= ~ADIV5_DP_CTRLSTAT_STICKYORUN;
+		return 0;
+	case ADIV5_DP_CTRLSTAT: {
+		if (RnW) {
+			/* Power up and debug reset requests are acknowledged straight away */
+			const uint32_t requests = sim.ctrlstat &
+				(ADIV5_DP_CTRLSTAT_CSYSPWRUPREQ | ADIV5_DP_CTRLSTAT_CDBGPWRUPREQ | ADIV5_DP_CTRLSTAT_CDBGRSTREQ);
+			return sim.ctrlstat | requests << 1U;
+		}
+		const uint32_t sticky = sim.ctrlstat & SIM_DP_CTRLSTAT_STICKY;
+		sim.ctrlstat = (value & ~SIM_DP_CTRLSTAT_STICKY &
+						   ~(ADIV5_DP_CTRLSTAT_CSYSPWRUPACK | ADIV5_DP_CTRLSTAT_CDBGPWRUPACK |
+							   ADIV5_DP_CTRLSTAT_CDBGRSTACK)) |
+			sticky;
+		return 0;
+	}
+	case ADIV5_DP_SELECT:
+		/* Reading here is RESEND */
+		if (RnW)
+			return sim.rdbuff;
+		sim.select = value;
+		return 0;
+	default:
+		/* RDBUFF, writes here are TARGETSEL which a DPv1 ignores */
+		return RnW ? sim.rdbuff : 0;
+	}
+}
+
+static uint32_t sim_dp_read(ADIv5_DP_t *dp, uint16_t addr)
+{
+	if (addr & ADIV5_APnDP) {
+		adiv5_dp_low_access(dp, ADIV5_LOW_READ, addr, 0);
+		return adiv5_dp_low_access(dp, ADIV5_LOW_READ, ADIV5_DP_RDBUFF, 0);
+	}
+	return adiv5_dp_low_access(dp, ADIV5_LOW_READ, addr, 0);
+}
+
+void sim_adiv5_dp_defaults(ADIv5_DP_t *const dp)
+{
+	dp->dp_read = sim_dp_read;
+	dp->error = firmware_swdp_error;
+	dp->low_access = sim_low_access;
+	dp->abort = firmware_swdp_abort;
+}
+
+/*
+ * The SWD wire: an 8 bit request is taken from a sequence out, the ACK read
+ * back carries out the access, or refuses an AP one while STICKYERR is set,
+ * and the data phase that follows transfers the value. Sequences out of any
+ * other length are line resets and idle cycles, which change nothing here.
+ */
+typedef enum sim_swd_phase {
+	SIM_SWD_IDLE,
+	SIM_SWD_ACK,
+	SIM_SWD_READ,
+	SIM_SWD_WRITE,
+} sim_swd_phase_e;
+
+static struct {
+	sim_swd_phase_e phase;
+	uint8_t RnW;
+	uint16_t addr;
+	uint32_t value;
+	/* Carries the fault flag of a single access */
+	ADIv5_DP_t dp;
+} sim_swd;
+
+static void sim_swd_seq_out(const uint32_t tms_states, const size_t clock_cycles)
+{
+	const uint8_t request = tms_states & 0xffU;
+	/* Start and park set, stop clear, and even parity over APnDP, RnW and A[3:2] */
+	const bool valid = clock_cycles == 8U && (request & 0xc1U) == 0x81U &&
+		!(__builtin_popcount(request & 0x3eU) & 1U);
+	if (sim_swd.phase == SIM_SWD_IDLE && valid) {
+		sim_swd.RnW = (request >> 2U) & 1U;
+		sim_swd.addr = (request & 0x02U ? ADIV5_APnDP : 0U) | ((request >> 1U) & 0x0cU);
+		sim_swd.phase = SIM_SWD_ACK;
+	} else
+		sim_swd.phase = SIM_SWD_IDLE;
+}
+
+static uint32_t sim_swd_seq_in(const size_t clock_cycles)
+{
+	if (sim_swd.phase != SIM_SWD_ACK) {
+		/* Nothing drives the line, the pull-up reads back */
+		sim_swd.phase = SIM_SWD_IDLE;
+		return clock_cycles < 32U ? (1U << clock_cycles) - 1U : UINT32_MAX;
+	}
+	sim_swd.dp.fault = 0;
+	if (sim_swd.RnW)
+		sim_swd.value = sim_low_access(&sim_swd.dp, ADIV5_LOW_READ, sim_swd.addr, 0);
+	else if ((sim_swd.addr & ADIV5_APnDP) && (sim.ctrlstat & ADIV5_DP_CTRLSTAT_STICKYERR))
+		sim_swd.dp.fault = 1;
+	if (sim_swd.dp.fault) {
+		sim_swd.phase = SIM_SWD_IDLE;
+		return SWDP_ACK_FAULT;
+	}
+	sim_swd.phase = sim_swd.RnW ? SIM_SWD_READ : SIM_SWD_WRITE;
+	return SWDP_ACK_OK;
+}
+
+static bool sim_swd_seq_in_parity(uint32_t *const ret, const size_t clock_cycles)
+{
+	(void)clock_cycles;
+	const bool valid = sim_swd.phase == SIM_SWD_READ;
+	sim_swd.phase = SIM_SWD_IDLE;
+	*ret = valid ? sim_swd.value : UINT32_MAX;
+	/* The parity error of a line nothing drives */
+	return !valid;
+}
+
+static void sim_swd_seq_out_parity(const uint32_t tms_states, const size_t clock_cycles)
+{
+	(void)clock_cycles;
+	if (sim_swd.phase == SIM_SWD_WRITE)
+		sim_low_access(&sim_swd.dp, ADIV5_LOW_WRITE, sim_swd.addr, tms_states);
+	sim_swd.phase = SIM_SWD_IDLE;
+}
+
+int sim_swdptap_init(ADIv5_DP_t *const dp)
+{
+	sim_swd.phase = SIM_SWD_IDLE;
+	dp->seq_out = sim_swd_seq_out;
+	dp->seq_out_parity = sim_swd_seq_out_parity;
+	dp->seq_in = sim_swd_seq_in;
+	dp->seq_in_parity = sim_swd_seq_in_parity;
+	return 0;
+}
+
+uint32_t sim_swdp_scan(void)
+{
+	target_list_free();
+
+	ADIv5_DP_t *dp = calloc(1, sizeof(*dp));
+	if (!dp) { /* calloc failed: heap exhaustion */
+		DEBUG_WARN("calloc: failed in %s\n", __func__);
+		return 0;
+	}
+
+	sim_adiv5_dp_defaults(dp);
+	dp->retry = adiv5_retry_default;
+
+	firmware_swdp_error(dp);
+
+	adiv5_dp_init(dp, 0);
+
+	return target_list ? 1U : 0U;
+}
+
+void sim_nrst_set_val(const bool assert)
+{
+	if (assert) {
+		sim.nrst = true;
+		sim.reset_seen = true;
+		sim.halted = false;
+		sim.stub_running = false;
+	} else if (sim.nrst) {
+		sim.nrst = false;
+		sim_core_reset();
+	}
+}
+
+bool sim_nrst_get_val(void)
+{
+	return sim.nrst;
+}
+
+const char *sim_target_voltage(void)
+{
+	return "3.3V";
+}
+
+/* Sizes with an optional K or M suffix */
+static bool sim_parse_number(const char *const value, uint32_t *const result)
+{
+	char *end;
+	*result = strtoul(value, &end, 0);
+	if (*end == 'k' || *end == 'K') {
+		*result *= 1024U;
+		++end;
+	} else if (*end == 'm' || *end == 'M') {
+		*result *= 1024U * 1024U;
+		++end;
+	}
+	return end != value && (*end == ',' || *end == '\0');
+}
+
+static bool sim_parse_options(const char *options)
+{
+	uint32_t dev = sim_devices[0].id;
+	uint32_t ram = 0;
+	uint32_t flash = 0;
+	while (*options) {
+		const char *const value = strchr(options, '=');
+		const size_t key_len = value ? (size_t)(value - options) : strlen(options);
+		uint32_t number = 0;
+		if (!value || !sim_parse_number(value + 1U, &number)) {
+			DEBUG_WARN("Simulator option '%.*s' needs a number\n", (int)key_len, options);
+			return false;
+		}
+		if (key_len == 3U && !strncmp(options, "dev", key_len))
+			dev = number;
+		else if (key_len == 3U && !strncmp(options, "ram", key_len))
+			ram = number;
+		else if (key_len == 5U && !strncmp(options, "flash", key_len))
+			flash = number;
+		else if (key_len == 7U && !strncmp(options, "latency", key_len))
+			sim.latency_us = number;
+		else if (key_len == 5U && !strncmp(options, "erase", key_len))
+			sim.erase_us = number;
+		else if (key_len == 7U && !strncmp(options, "program", key_len))
+			sim.program_us = number;
+		else {
+			DEBUG_WARN("Unknown simulator option '%.*s'\n", (int)key_len, options);
+			return false;
+		}
+		options = value + 1U + strcspn(value + 1U, ",");
+		if (*options == ',')
+			++options;
+	}
+
+	for (size_t i = 0; i < ARRAY_LENGTH(sim_devices); ++i) {
+		if (sim_devices[i].id == dev)
+			sim.device = &sim_devices[i];
+	}
+	if (!sim.device) {
+		DEBUG_WARN("Simulator has no device 0x%03" PRIx32 "\n", dev);
+		return false;
+	}
+	sim.ram_size = ram ? ram : sim.device->ram_size;
+	sim.flash_size = flash ? flash : sim.device->flash_size;
+	return true;
+}
+
+bool sim_init(bmp_info_t *const info, const char *const options)
+{
+	memset(&sim, 0, sizeof(sim));
+	if (!sim_parse_options(options))
+		return false;
+	sim.ram = calloc(1, sim.ram_size);
+	sim.flash = malloc(sim.flash_size);
+	if (!sim.ram || !sim.flash) { /* calloc failed: heap exhaustion */
+		DEBUG_WARN("calloc: failed in %s\n", __func__);
+		sim_exit();
+		return false;
+	}
+	memset(sim.flash, 0xff, sim.flash_size);
+	sim_core_reset();
+	sim.halted = false;
+
+	info->bmp_type = BMP_TYPE_SIM;
+	snprintf(info->manufacturer, sizeof(info->manufacturer), "Black Magic Debug");
+	snprintf(info->product, sizeof(info->product), "Simulated %s", sim.device->name);
+	snprintf(info->version, sizeof(info->version), "%" PRIu32 "us", sim.latency_us);
+	info->serial[0] = '\0';
+	DEBUG_INFO("Simulating an %s with %" PRIu32 "KiB RAM and %" PRIu32 "KiB flash\n", sim.device->name,
+		sim.ram_size / 1024U, sim.flash_size / 1024U);
+	return true;
+}
+
+void sim_exit(void)
+{
+	free(sim.ram);
+	free(sim.flash);
+	sim.ram = NULL;
+	sim.flash = NULL;
+}
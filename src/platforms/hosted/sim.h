@@ -0,0 +1,42 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PLATFORMS_HOSTED_SIM_H
+#define PLATFORMS_HOSTED_SIM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bmp_hosted.h"
+#include "adiv5.h"
+
+/*
+ * Set up the simulated probe and target from a comma separated list of
+ * key=value options, see sim.c, and describe it in info.
+ */
+bool sim_init(bmp_info_t *info, const char *options);
+void sim_exit(void);
+
+uint32_t sim_swdp_scan(void);
+/* DP accesses straight to the model, and over its SWD wire for bit level use */
+void sim_adiv5_dp_defaults(ADIv5_DP_t *dp);
+int sim_swdptap_init(ADIv5_DP_t *dp);
+void sim_nrst_set_val(bool assert);
+bool sim_nrst_get_val(void);
+const char *sim_target_voltage(void);
+
+#endif /* PLATFORMS_HOSTED_SIM_H */
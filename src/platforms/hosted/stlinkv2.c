@@ -202,6 +202,8 @@ typedef struct {
 	uint8_t      ver_swim;
 	uint8_t      ver_bridge;
 	uint16_t     block_size;
+	/* READMEM_16BIT/WRITEMEM_16BIT, from V2J26 and on all V3 */
+	bool         has_mem_16bit;
 	bool         ap_error;
 } stlink_t;
 
@@ -360,47 +362,6 @@ static int stlink_send_recv_retry(uint8_t *txbuf, size_t txsize,
 	return res;
 }
 
-static int read_retry(uint8_t *txbuf, size_t txsize,
-					 uint8_t *rxbuf, size_t rxsize)
-{
-	uint32_t start = platform_time_ms();
-	int res;
-	while(1) {
-		send_recv(info.usb_link, txbuf, txsize, rxbuf, rxsize);
-		res = stlink_usb_get_rw_status(false);
-		if (res == STLINK_ERROR_OK)
-			return res;
-		uint32_t now = platform_time_ms();
-		if (((now -start) > 1000) || (res != STLINK_ERROR_WAIT)) {
-			DEBUG_WARN("read_retry failed.\n");
-			stlink_usb_get_rw_status(true);
-			return res;
-		}
-	}
-	return res;
-}
-
-static int write_retry(uint8_t *cmdbuf, size_t cmdsize,
-					 uint8_t *txbuf, size_t txsize)
-{
-	uint32_t start = platform_time_ms();
-	int res;
-	usb_link_t *link = info.usb_link;
-	while(1) {
-		send_recv(link, cmdbuf, cmdsize, NULL, 0);
-		send_recv(link, txbuf, txsize, NULL, 0);
-		res = stlink_usb_get_rw_status(false);
-		if (res == STLINK_ERROR_OK)
-			return res;
-		uint32_t now = platform_time_ms();
-		if (((now - start) > 1000) || (res != STLINK_ERROR_WAIT)) {
-			stlink_usb_get_rw_status(true);
-			return res;
-		}
-	}
-	return res;
-}
-
 /* Version data is at 0x080103f8 with STLINKV3 bootloader flashed with
  * STLinkUpgrade_v3[3|5].jar
  */
@@ -441,6 +402,7 @@ static void stlink_version(bmp_info_t *info)
 			stlink.ver_swim = (version >> 0) & 0x3f;
 		}
 	}
+	stlink.has_mem_16bit = stlink.ver_stlink == 3 || stlink.ver_jtag >= 26;
 	DEBUG_INFO("ST-Link firmware version: V%dJ%d",stlink.ver_stlink, stlink.ver_jtag);
 	if (stlink.ver_hw == 30) {
 		DEBUG_INFO("M%dB%dS%d", stlink.ver_mass, stlink.ver_bridge, stlink.ver_swim);
@@ -610,8 +572,6 @@ int stlink_init(bmp_info_t *info)
 				libusb_strerror(r));
 		return -1;
 	}
-	sl->req_trans = libusb_alloc_transfer(0);
-	sl->rep_trans = libusb_alloc_transfer(0);
 	stlink_version(info);
 	if ((stlink.ver_stlink < 3 && stlink.ver_jtag < 32) ||
 		(stlink.ver_stlink == 3 && stlink.ver_jtag < 3)) {
@@ -789,6 +749,8 @@ uint32_t stlink_dp_low_access(ADIv5_DP_t *dp, uint8_t RnW,
 {
 	uint32_t response = 0;
 	int res;
+	if (dp->deferred_error)
+		return 0;
 	if (RnW) {
 		res = stlink_read_dp_register(
 			(addr < 0x100) ? STLINK_DEBUG_PORT_ACCESS : 0, addr, &response);
@@ -796,15 +758,19 @@ uint32_t stlink_dp_low_access(ADIv5_DP_t *dp, uint8_t RnW,
 		res = stlink_write_dp_register(
 			(addr < 0x100) ? STLINK_DEBUG_PORT_ACCESS : 0, addr, value);
 	}
-	if (res == STLINK_ERROR_WAIT)
-		raise_exception(EXCEPTION_TIMEOUT, "DP ACK timeout");
+	if (res == STLINK_ERROR_WAIT) {
+		adiv5_dp_raise(dp, EXCEPTION_TIMEOUT, "DP ACK timeout");
+		return 0;
+	}
 
 	if(res == STLINK_ERROR_DP_FAULT) {
 		dp->fault = 1;
 		return 0;
 	}
-	if(res == STLINK_ERROR_FAIL)
-		raise_exception(EXCEPTION_ERROR, "SWDP invalid ACK");
+	if(res == STLINK_ERROR_FAIL) {
+		adiv5_dp_raise(dp, EXCEPTION_ERROR, "SWDP invalid ACK");
+		return 0;
+	}
 
 	return response;
 }
@@ -854,32 +820,125 @@ static int stlink_usb_get_rw_status(bool verbose)
 	return stlink_usb_error_check(data, verbose);
 }
 
+/*
+ * The adaptor does not wrap TAR itself, so no single READMEM/WRITEMEM may cross
+ * the 1kiB auto-increment boundary. Byte accesses are further limited by the
+ * firmware to block_size (64 bytes on V2, 512 on V3).
+ */
+#define STLINK_TAR_AUTOINCR_BLOCK 0x400U
+/* Every chunk in a burst costs a command transfer and a data transfer */
+#define STLINK_BURST_DEPTH        (USB_LINK_POOL_SIZE / 2U)
+
+static size_t stlink_mem_chunk(uint8_t type, uint32_t addr, size_t len)
+{
+	size_t chunk = STLINK_TAR_AUTOINCR_BLOCK - (addr & (STLINK_TAR_AUTOINCR_BLOCK - 1U));
+	if ((type == STLINK_DEBUG_READMEM_8BIT || type == STLINK_DEBUG_WRITEMEM_8BIT) &&
+		chunk > stlink.block_size)
+		chunk = stlink.block_size;
+	return MIN(chunk, len);
+}
+
+/*
+ * Reads are split into the widest accesses each part of the range allows: an
+ * unaligned head and tail go byte or halfword wise, everything between them as
+ * words. Returns the command for the next part and trims len to it.
+ */
+static uint8_t stlink_read_type(uint32_t addr, size_t *len)
+{
+	if (!(addr & 3U) && *len >= 4U) {
+		*len &= ~(size_t)3U;
+		return STLINK_DEBUG_READMEM_32BIT;
+	}
+	if (!(addr & 1U) && *len >= 2U && stlink.has_mem_16bit) {
+		*len = 2U;
+		return STLINK_DEBUG_APIV2_READMEM_16BIT;
+	}
+	if (addr & 3U)
+		*len = MIN(*len, 4U - (addr & 3U));
+	return STLINK_DEBUG_READMEM_8BIT;
+}
+
+static void stlink_mem_cmd(uint8_t *cmd, uint8_t type, uint8_t apsel, uint32_t addr, size_t len)
+{
+	memset(cmd, 0, 16);
+	cmd[0] = STLINK_DEBUG_COMMAND;
+	cmd[1] = type;
+	cmd[2] = addr & 0xff;
+	cmd[3] = (addr >> 8) & 0xff;
+	cmd[4] = (addr >> 16) & 0xff;
+	cmd[5] = (addr >> 24) & 0xff;
+	cmd[6] = len & 0xff;
+	cmd[7] = (len >> 8) & 0xff;
+	cmd[8] = apsel;
+}
+
+/*
+ * Stream a memory access as a burst of READMEM/WRITEMEM commands with up to
+ * STLINK_BURST_DEPTH of them queued on the link, asking for the access status
+ * only once the burst has completed. A faulting chunk leaves the AP sticky
+ * error set, which fails every chunk after it, so the last status covers the
+ * whole burst. Writes keep the access size asked for, reads pick theirs per
+ * chunk with stlink_read_type(). The AP is selected in each command, so any AP
+ * streams as fast as AP0.
+ */
+static int stlink_mem_burst(ADIv5_AP_t *ap, uint8_t type, bool write, uint32_t addr, uint8_t *data, size_t len)
+{
+	usb_link_t *link = info.usb_link;
+	uint8_t cmds[STLINK_BURST_DEPTH][16];
+	size_t queued = 0;
+	while (len || usb_link_pending(link)) {
+		if (len && usb_link_pending(link) + 2U <= USB_LINK_POOL_SIZE) {
+			size_t chunk = len;
+			const uint8_t chunk_type = write ? type : stlink_read_type(addr, &chunk);
+			chunk = stlink_mem_chunk(chunk_type, addr, chunk);
+			uint8_t *cmd = cmds[queued++ % STLINK_BURST_DEPTH];
+			stlink_mem_cmd(cmd, chunk_type, ap->apsel, addr, chunk);
+			if (!write && chunk == 1U) {
+				/* A single byte read answers with two bytes, as in openocd */
+				uint8_t odd[2];
+				while (usb_link_pending(link)) {
+					if (usb_link_collect(link) < 0)
+						goto link_error;
+				}
+				if (send_recv(link, cmd, 16, odd, 2) < 0)
+					return STLINK_ERROR_FAIL;
+				*data = odd[0];
+			} else if (usb_link_submit(link, false, cmd, 16) ||
+				usb_link_submit(link, !write, data, chunk))
+				goto link_error;
+			addr += chunk;
+			data += chunk;
+			len -= chunk;
+		} else if (usb_link_collect(link) < 0)
+			goto link_error;
+	}
+	return stlink_usb_get_rw_status(false);
+
+link_error:
+	usb_link_cancel(link);
+	return STLINK_ERROR_FAIL;
+}
+
+/* Repeat a burst for as long as the target only answers with WAIT */
+static int stlink_mem_burst_retry(ADIv5_AP_t *ap, uint8_t type, bool write, uint32_t addr, uint8_t *data, size_t len)
+{
+	const uint32_t start = platform_time_ms();
+	int res;
+	do {
+		res = stlink_mem_burst(ap, type, write, addr, data, len);
+	} while (res == STLINK_ERROR_WAIT && platform_time_ms() - start <= 1000);
+	if (res != STLINK_ERROR_OK)
+		stlink_usb_get_rw_status(true);
+	return res;
+}
+
 static void stlink_readmem(ADIv5_AP_t *ap, void *dest, uint32_t src, size_t len)
 {
+	adiv5_dp_cache_invalidate(ap->dp);
 	if (len == 0)
 		return;
-	size_t read_len = len;
-	uint8_t type;
-	if (src & 1 || len & 1) {
-		type = STLINK_DEBUG_READMEM_8BIT;
-		if (len > stlink.block_size) {
-			DEBUG_WARN("Too large!\n");
-			return;
-		}
-		if (len == 1)
-			read_len ++; /* Fix read length as in openocd*/
-	} else if (src & 3 || len & 3) {
-		type = STLINK_DEBUG_APIV2_READMEM_16BIT;
-	} else {
-		type = STLINK_DEBUG_READMEM_32BIT;
-	}
-	uint8_t cmd[16] = {
-		STLINK_DEBUG_COMMAND,
-		type,
-		src & 0xff, (src >>  8) & 0xff, (src >> 16) & 0xff,
-		(src >> 24) & 0xff,
-		len & 0xff, len >> 8, ap->apsel};
-	int res = read_retry(cmd, 16, dest, read_len);
+	/* Narrowed per chunk where the range is unaligned */
+	int res = stlink_mem_burst_retry(ap, STLINK_DEBUG_READMEM_32BIT, false, src, dest, len);
 	if (res != STLINK_ERROR_OK) {
 		/* FIXME: What is the right measure when failing?
 		 *
@@ -887,67 +946,14 @@ static void stlink_readmem(ADIv5_AP_t *ap, void *dest, uint32_t src, size_t len)
 		 * Approach taken:
 		 * Fill the memory with some fixed pattern so hopefully
 		 * the caller notices the error*/
-		DEBUG_WARN("stlink_readmem from  %" PRIx32 " to %" PRIx32 ", len %"
+		DEBUG_WARN("stlink_readmem from  %" PRIx32 " to %p, len %"
 				   PRIx32 "failed\n", src, dest, (uint32_t) len);
 		memset(dest, 0xff, len);
 	}
-	DEBUG_PROBE("stlink_readmem from %" PRIx32 " to %" PRIx32 ", len %" PRIx32
+	DEBUG_PROBE("stlink_readmem from %" PRIx32 " to %p, len %" PRIx32
 				"\n", src, dest, (uint32_t) len);
 }
 
-static void stlink_writemem8(usb_link_t *link, ADIv5_AP_t *ap, uint32_t addr,
-							 size_t len, uint8_t *buffer)
-{
-	(void)link;
-	while (len) {
-		size_t length;
-		/* OpenOCD has some note about writemem8*/
-		if (len > stlink.block_size)
-			length = stlink.block_size;
-		else
-			length = len;
-		uint8_t cmd[16] = {
-			STLINK_DEBUG_COMMAND,
-			STLINK_DEBUG_WRITEMEM_8BIT,
-			addr & 0xff, (addr >>  8) & 0xff, (addr >> 16) & 0xff,
-			(addr >> 24) & 0xff,
-			length & 0xff, length >> 8, ap->apsel};
-		send_recv(link, cmd, 16, NULL, 0);
-		send_recv(link, (void*)buffer, length, NULL, 0);
-		stlink_usb_get_rw_status(true);
-		len -= length;
-		addr += length;
-	}
-}
-
-static void stlink_writemem16(usb_link_t *link, ADIv5_AP_t *ap, uint32_t addr,
-							  size_t len, uint16_t *buffer)
-{
-	(void)link;
-	uint8_t cmd[16] = {
-		STLINK_DEBUG_COMMAND,
-		STLINK_DEBUG_APIV2_WRITEMEM_16BIT,
-		addr & 0xff, (addr >>  8) & 0xff, (addr >> 16) & 0xff,
-		(addr >> 24) & 0xff,
-		len & 0xff, len >> 8, ap->apsel};
-	send_recv(link, cmd, 16, NULL, 0);
-	send_recv(link, (void*)buffer, len, NULL, 0);
-	stlink_usb_get_rw_status(true);
-}
-
-static void stlink_writemem32(usb_link_t * link, ADIv5_AP_t *ap, uint32_t addr,
-							  size_t len, uint32_t *buffer)
-{
-	(void)link;
-	uint8_t cmd[16] = {
-		STLINK_DEBUG_COMMAND,
-		STLINK_DEBUG_WRITEMEM_32BIT,
-		addr & 0xff, (addr >>  8) & 0xff, (addr >> 16) & 0xff,
-		(addr >> 24) & 0xff,
-		len & 0xff, len >> 8, ap->apsel};
-	write_retry(cmd, 16, (void*)buffer, len);
-}
-
 static void stlink_regs_read(ADIv5_AP_t *ap, void *data)
 {
 	uint8_t cmd[16] = {STLINK_DEBUG_COMMAND, STLINK_DEBUG_APIV2_READALLREGS,
@@ -989,31 +995,37 @@ static void stlink_mem_write_sized(	ADIv5_AP_t *ap, uint32_t dest,
 									const void *src, size_t len,
 									enum align align)
 {
+	adiv5_dp_cache_invalidate(ap->dp);
 	if (len == 0)
 		return;
-	usb_link_t *link = info.usb_link;
+	uint8_t type;
 	switch(align) {
 	case ALIGN_BYTE:
-		stlink_writemem8(link, ap, dest, len, (uint8_t *) src);
+		type = STLINK_DEBUG_WRITEMEM_8BIT;
 		break;
 	case ALIGN_HALFWORD:
-		stlink_writemem16(link,ap, dest, len, (uint16_t *) src);
+		type = STLINK_DEBUG_APIV2_WRITEMEM_16BIT;
 		break;
 	case ALIGN_WORD:
 	case ALIGN_DWORD:
-		stlink_writemem32(link, ap, dest, len, (uint32_t *) src);
+	default:
+		type = STLINK_DEBUG_WRITEMEM_32BIT;
 		break;
 	}
+	if (stlink_mem_burst_retry(ap, type, true, dest, (uint8_t *)src, len) != STLINK_ERROR_OK)
+		DEBUG_WARN("stlink_mem_write to %" PRIx32 ", len %" PRIx32 " failed\n", dest, (uint32_t)len);
 }
 
 static void stlink_ap_write(ADIv5_AP_t *ap, uint16_t addr, uint32_t value)
 {
+	adiv5_dp_cache_invalidate(ap->dp);
        stlink_write_dp_register(ap->apsel, addr, value);
 }
 
 static uint32_t stlink_ap_read(ADIv5_AP_t *ap, uint16_t addr)
 {
 	uint32_t ret;
+	adiv5_dp_cache_invalidate(ap->dp);
 	stlink_read_dp_register(ap->apsel, addr, &ret);
 	return ret;
 }
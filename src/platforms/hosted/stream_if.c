@@ -0,0 +1,356 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Each consumer has a ring the producer appends whole lines to and a scheduler
+ * task drains into its socket, a block at a time. When the ring can't take a
+ * line it is dropped and counted, and once there is room again a "# dropped"
+ * line tells the consumer how many it missed.
+ *
+ * The compressed stream is an LZ4 frame (lz4_Frame_format.md) of independent
+ * 64KiB blocks without checksums, each compressed with a single pass greedy
+ * LZ4 block encoder. A block that doesn't shrink is sent stored.
+ */
+
+#include "general.h"
+#include "stream_if.h"
+#include "scheduler.h"
+
+#if !defined(_WIN32) && !defined(__CYGWIN__)
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define STREAM_IF_CLIENTS    4U
+#define STREAM_IF_RING_SIZE  (256U * 1024U)
+#define STREAM_IF_BLOCK_SIZE 65536U
+/* An LZ4 block can grow by 1/255 on incompressible data, plus the block size */
+#define STREAM_IF_OUT_SIZE (STREAM_IF_BLOCK_SIZE + STREAM_IF_BLOCK_SIZE / 255U + 16U)
+#define STREAM_IF_POLL_US  2000U
+
+/* Version 1, independent blocks, no checksums or content size, 64KiB blocks */
+static const uint8_t stream_lz4_frame_header[] = {0x04, 0x22, 0x4d, 0x18, 0x60, 0x40, 0x82};
+
+#define LZ4_MIN_MATCH     4U
+#define LZ4_LAST_LITERALS 5U
+#define LZ4_MFLIMIT       12U
+#define LZ4_HASH_BITS     12U
+#define LZ4_MAX_OFFSET    65535U
+
+typedef struct stream_if_client {
+	int conn;
+	uint8_t *ring;
+	size_t ring_head;
+	size_t ring_len;
+	uint8_t *out;
+	size_t out_len;
+	size_t out_pos;
+	uint32_t dropped;       /* lines lost since the last "# dropped" */
+	uint64_t dropped_total; /* over the connection */
+} stream_if_client_s;
+
+static int stream_serv = -1;
+static bool stream_lz4;
+static stream_if_client_s stream_clients[STREAM_IF_CLIENTS];
+static uint8_t stream_block[STREAM_IF_BLOCK_SIZE];
+static uint32_t stream_hash[1U << LZ4_HASH_BITS];
+
+static uint32_t lz4_read32(const uint8_t *const data)
+{
+	return data[0] | ((uint32_t)data[1] << 8U) | ((uint32_t)data[2] << 16U) | ((uint32_t)data[3] << 24U);
+}
+
+static size_t lz4_put_length(uint8_t *const dst, size_t len)
+{
+	size_t out = 0;
+	for (; len >= 255U; len -= 255U)
+		dst[out++] = 255U;
+	dst[out++] = len;
+	return out;
+}
+
+/* One sequence: literals, then a match of match_len at offset back unless match_len is 0 */
+static size_t lz4_put_sequence(uint8_t *const dst, const uint8_t *const literals, const size_t literal_len,
+	const size_t offset, const size_t match_len)
+{
+	size_t out = 1;
+	const size_t match_code = match_len ? match_len - LZ4_MIN_MATCH : 0U;
+	dst[0] = (MIN(literal_len, 15U) << 4U) | MIN(match_code, 15U);
+	if (literal_len >= 15U)
+		out += lz4_put_length(dst + out, literal_len - 15U);
+	memcpy(dst + out, literals, literal_len);
+	out += literal_len;
+	if (!match_len)
+		return out;
+	dst[out++] = offset & 0xffU;
+	dst[out++] = offset >> 8U;
+	if (match_code >= 15U)
+		out += lz4_put_length(dst + out, match_code - 15U);
+	return out;
+}
+
+/* Compress src into dst, which must hold STREAM_IF_OUT_SIZE, returns the compressed length */
+static size_t lz4_compress_block(const uint8_t *const src, const size_t len, uint8_t *const dst)
+{
+	memset(stream_hash, 0, sizeof(stream_hash));
+	size_t out = 0;
+	size_t anchor = 0;
+	size_t pos = 0;
+	/* The format wants the last match to start 12 bytes and end 5 bytes before the end */
+	while (len > LZ4_MFLIMIT && pos < len - LZ4_MFLIMIT) {
+		const uint32_t sequence = lz4_read32(src + pos);
+		const uint32_t hash = (sequence * 2654435761U) >> (32U - LZ4_HASH_BITS);
+		const size_t candidate = stream_hash[hash];
+		/* Table entries are position + 1 so that 0 means empty */
+		stream_hash[hash] = pos + 1U;
+		if (!candidate || pos - (candidate - 1U) > LZ4_MAX_OFFSET || lz4_read32(src + candidate - 1U) != sequence) {
+			++pos;
+			continue;
+		}
+		const size_t match = candidate - 1U;
+		size_t match_len = LZ4_MIN_MATCH;
+		while (pos + match_len < len - LZ4_LAST_LITERALS && src[match + match_len] == src[pos + match_len])
+			++match_len;
+		out += lz4_put_sequence(dst + out, src + anchor, pos - anchor, pos - match, match_len);
+		pos += match_len;
+		anchor = pos;
+	}
+	out += lz4_put_sequence(dst + out, src + anchor, len - anchor, 0, 0);
+	return out;
+}
+
+static void stream_if_drop(stream_if_client_s *const client)
+{
+	DEBUG_INFO("stream: consumer disconnected, %" PRIu64 " lines dropped\n", client->dropped_total);
+	close(client->conn);
+	free(client->ring);
+	free(client->out);
+	memset(client, 0, sizeof(*client));
+	client->conn = -1;
+}
+
+static void stream_if_accept(void)
+{
+	const int conn = accept(stream_serv, NULL, NULL);
+	if (conn == -1)
+		return;
+	stream_if_client_s *client = NULL;
+	for (size_t i = 0; i < STREAM_IF_CLIENTS && !client; ++i) {
+		if (stream_clients[i].conn == -1)
+			client = &stream_clients[i];
+	}
+	if (client) {
+		client->ring = malloc(STREAM_IF_RING_SIZE);
+		client->out = malloc(STREAM_IF_OUT_SIZE);
+	}
+	if (!client || !client->ring || !client->out) {
+		DEBUG_WARN("stream: no room for another consumer\n");
+		if (client) {
+			free(client->ring);
+			free(client->out);
+			client->ring = NULL;
+			client->out = NULL;
+		}
+		close(conn);
+		return;
+	}
+	fcntl(conn, F_SETFL, fcntl(conn, F_GETFL, 0) | O_NONBLOCK);
+	const int opt = 1;
+	setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+	client->conn = conn;
+	if (stream_lz4) {
+		memcpy(client->out, stream_lz4_frame_header, sizeof(stream_lz4_frame_header));
+		client->out_len = sizeof(stream_lz4_frame_header);
+	}
+	DEBUG_INFO("stream: consumer connected\n");
+}
+
+static void stream_if_ring_put(stream_if_client_s *const client, const void *const data, const size_t len)
+{
+	const size_t tail = (client->ring_head + client->ring_len) % STREAM_IF_RING_SIZE;
+	const size_t first = MIN(len, STREAM_IF_RING_SIZE - tail);
+	memcpy(client->ring + tail, data, first);
+	memcpy(client->ring, (const uint8_t *)data + first, len - first);
+	client->ring_len += len;
+}
+
+/* Move up to a block out of the ring into the output buffer, encoded for the wire */
+static void stream_if_encode(stream_if_client_s *const client)
+{
+	const size_t len = MIN(client->ring_len, STREAM_IF_BLOCK_SIZE);
+	const size_t first = MIN(len, STREAM_IF_RING_SIZE - client->ring_head);
+	uint8_t *const block = stream_lz4 ? stream_block : client->out;
+	memcpy(block, client->ring + client->ring_head, first);
+	memcpy(block + first, client->ring, len - first);
+	client->ring_head = (client->ring_head + len) % STREAM_IF_RING_SIZE;
+	client->ring_len -= len;
+	client->out_pos = 0;
+	client->out_len = len;
+	if (!stream_lz4)
+		return;
+
+	uint32_t size = lz4_compress_block(block, len, client->out + 4U);
+	if (size >= len) {
+		memcpy(client->out + 4U, block, len);
+		size = len | 0x80000000U;
+	}
+	client->out[0] = size & 0xffU;
+	client->out[1] = (size >> 8U) & 0xffU;
+	client->out[2] = (size >> 16U) & 0xffU;
+	client->out[3] = size >> 24U;
+	client->out_len = 4U + (size & 0x7fffffffU);
+}
+
+/* Send what the socket takes, returns false once the consumer is gone */
+static bool stream_if_flush(stream_if_client_s *const client)
+{
+	while (true) {
+		if (client->out_pos == client->out_len) {
+			if (!client->ring_len)
+				return true;
+			stream_if_encode(client);
+		}
+		const ssize_t sent = send(client->conn, client->out + client->out_pos, client->out_len - client->out_pos,
+			MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return true;
+			stream_if_drop(client);
+			return false;
+		}
+		client->out_pos += sent;
+		if (client->out_pos < client->out_len)
+			return true;
+	}
+}
+
+static uint32_t stream_if_poll(void)
+{
+	stream_if_accept();
+	for (size_t i = 0; i < STREAM_IF_CLIENTS; ++i) {
+		if (stream_clients[i].conn != -1)
+			stream_if_flush(&stream_clients[i]);
+	}
+	return STREAM_IF_POLL_US;
+}
+
+void stream_if_write(const char *const line, const size_t len)
+{
+	for (size_t i = 0; i < STREAM_IF_CLIENTS; ++i) {
+		stream_if_client_s *const client = &stream_clients[i];
+		if (client->conn == -1)
+			continue;
+		size_t space = STREAM_IF_RING_SIZE - client->ring_len;
+		if (client->dropped) {
+			char note[48];
+			const int note_len = snprintf(note, sizeof(note), "# dropped %" PRIu32 " lines\n", client->dropped);
+			if (space < (size_t)note_len + len) {
+				++client->dropped;
+				++client->dropped_total;
+				continue;
+			}
+			stream_if_ring_put(client, note, note_len);
+			space -= note_len;
+			client->dropped = 0;
+		}
+		if (space < len) {
+			++client->dropped;
+			++client->dropped_total;
+			continue;
+		}
+		stream_if_ring_put(client, line, len);
+	}
+}
+
+bool stream_if_init(const uint16_t port, const bool lz4)
+{
+	for (size_t i = 0; i < STREAM_IF_CLIENTS; ++i)
+		stream_clients[i].conn = -1;
+	stream_lz4 = lz4;
+	stream_serv = socket(PF_INET, SOCK_STREAM, 0);
+	if (stream_serv == -1)
+		return false;
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	const int opt = 1;
+	if (setsockopt(stream_serv, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1 ||
+		bind(stream_serv, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(stream_serv, 1) == -1) {
+		DEBUG_WARN("stream: can not listen on TCP port %u: %s\n", port, strerror(errno));
+		close(stream_serv);
+		stream_serv = -1;
+		return false;
+	}
+	fcntl(stream_serv, F_SETFL, fcntl(stream_serv, F_GETFL, 0) | O_NONBLOCK);
+	DEBUG_WARN("Timeline on TCP: %u%s\n", port, lz4 ? ", LZ4 compressed" : "");
+	scheduler_add(stream_if_poll);
+	return true;
+}
+
+/* Give each consumer a second to take what is left, and end the LZ4 frames */
+void stream_if_exit(void)
+{
+	if (stream_serv == -1)
+		return;
+	scheduler_remove(stream_if_poll);
+	for (size_t i = 0; i < STREAM_IF_CLIENTS; ++i) {
+		stream_if_client_s *const client = &stream_clients[i];
+		if (client->conn == -1)
+			continue;
+		fcntl(client->conn, F_SETFL, fcntl(client->conn, F_GETFL, 0) & ~O_NONBLOCK);
+		const struct timeval timeout = {1, 0};
+		setsockopt(client->conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		while (client->conn != -1 && (client->ring_len || client->out_pos < client->out_len)) {
+			if (!stream_if_flush(client) || client->out_pos < client->out_len)
+				break;
+		}
+		if (client->conn == -1)
+			continue;
+		if (stream_lz4) {
+			const uint8_t end_mark[4] = {0};
+			send(client->conn, end_mark, sizeof(end_mark), MSG_NOSIGNAL);
+		}
+		stream_if_drop(client);
+	}
+	close(stream_serv);
+	stream_serv = -1;
+}
+#else
+bool stream_if_init(const uint16_t port, const bool lz4)
+{
+	(void)port;
+	(void)lz4;
+	DEBUG_WARN("Streaming over TCP is not supported on this platform\n");
+	return false;
+}
+
+void stream_if_exit(void)
+{
+}
+
+void stream_if_write(const char *const line, const size_t len)
+{
+	(void)line;
+	(void)len;
+}
+#endif
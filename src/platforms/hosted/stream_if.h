@@ -0,0 +1,38 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PLATFORMS_HOSTED_STREAM_IF_H
+#define PLATFORMS_HOSTED_STREAM_IF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Serve a line based stream on a TCP port to up to STREAM_IF_CLIENTS consumers
+ * at once, each behind its own bounded buffer. A consumer that falls behind
+ * loses whole lines, counted and reported to it in the stream, and never
+ * stalls the producer. With lz4 set every consumer gets an LZ4 frame, which
+ * `lz4 -d` unpacks.
+ */
+bool stream_if_init(uint16_t port, bool lz4);
+void stream_if_exit(void);
+
+/* Queue one complete line for every connected consumer */
+void stream_if_write(const char *line, size_t len);
+
+#endif /* PLATFORMS_HOSTED_STREAM_IF_H */
@@ -0,0 +1,264 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Batched SW-DP transfers for adaptors that take whole transfer sequences.
+ *
+ * Without knowing the ACK the data phase has to be clocked regardless, so each
+ * run goes with CTRL/STAT.ORUNDETECT set: after the first WAIT or FAULT the DP
+ * answers FAULT to everything else and executes nothing, which makes the first
+ * bad ACK the point to resume from.
+ */
+
+#include "general.h"
+#include "exception.h"
+#include "adiv5.h"
+#include "swd_queue.h"
+#include "cli.h"
+
+/* Power request bits the DP is kept at, see adiv5_dp_init() */
+#define SWD_QUEUE_CTRLSTAT (ADIV5_DP_CTRLSTAT_CSYSPWRUPREQ | ADIV5_DP_CTRLSTAT_CDBGPWRUPREQ)
+/* Room for the transfers a run adds to what was queued */
+#define SWD_QUEUE_RESERVED 3U
+
+#define ALIGNOF(x) (((x)&3) == 0 ? ALIGN_WORD : (((x)&1) == 0 ? ALIGN_HALFWORD : ALIGN_BYTE))
+
+static void swd_queue_add(swd_queue_s *queue, uint8_t RnW, uint16_t addr, uint32_t value, uint32_t *result)
+{
+	if (!queue->count) {
+		queue->transfers[queue->count++] = (swd_queue_transfer_s){
+			.RnW = ADIV5_LOW_WRITE,
+			.addr = ADIV5_DP_CTRLSTAT,
+			.value = SWD_QUEUE_CTRLSTAT | ADIV5_DP_CTRLSTAT_ORUNDETECT,
+		};
+	}
+	queue->transfers[queue->count++] = (swd_queue_transfer_s){
+		.RnW = RnW,
+		.addr = addr,
+		.value = value,
+		.result = result,
+	};
+}
+
+/* Clear the overrun the run ran into and leave overrun detection off again */
+static void swd_queue_recover(ADIv5_DP_t *dp)
+{
+	dp->low_access(dp, ADIV5_LOW_WRITE, ADIV5_DP_ABORT, ADIV5_DP_ABORT_ORUNERRCLR);
+	dp->low_access(dp, ADIV5_LOW_WRITE, ADIV5_DP_CTRLSTAT, SWD_QUEUE_CTRLSTAT);
+}
+
+/* Send everything queued as one sequence, returns true if an access failed */
+static bool swd_queue_run(swd_queue_s *queue, ADIv5_DP_t *dp)
+{
+	if (!queue->count)
+		return false;
+	/* The RDBUFF read also waits for the last AP write to complete */
+	swd_queue_add(queue, ADIV5_LOW_READ, ADIV5_DP_RDBUFF, 0, queue->pending);
+	queue->pending = NULL;
+	swd_queue_add(queue, ADIV5_LOW_WRITE, ADIV5_DP_CTRLSTAT, SWD_QUEUE_CTRLSTAT, NULL);
+	const size_t count = queue->count;
+	queue->count = 0;
+
+	DEBUG_PROBE("SWD queue run of %zu transfers\n", count);
+	queue->run(dp, queue->transfers, count);
+
+	size_t i = 0;
+	uint8_t ack = SWDP_ACK_OK;
+	for (; i < count; ++i) {
+		const swd_queue_transfer_s *transfer = &queue->transfers[i];
+		ack = transfer->ack;
+		if (ack != SWDP_ACK_OK)
+			break;
+		adiv5_dp_idle_tune(dp, 0);
+		if (!transfer->RnW)
+			continue;
+		if (transfer->parity_error) {
+			swd_queue_recover(dp);
+			adiv5_dp_raise(dp, EXCEPTION_ERROR, "SWDP Parity error");
+			return true;
+		}
+		if (transfer->result)
+			*transfer->result = transfer->value;
+	}
+	if (i == count)
+		return false;
+
+	if (ack == SWDP_ACK_WAIT || ack == SWDP_ACK_FAULT) {
+		/* Give the transfers of the next runs more time to avoid this */
+		if (ack == SWDP_ACK_WAIT)
+			adiv5_dp_idle_tune(dp, 1);
+		swd_queue_recover(dp);
+		if (ack == SWDP_ACK_FAULT) {
+			if (cl_debuglevel & BMP_DEBUG_TARGET)
+				DEBUG_WARN("Fault in SWD queue at %zu/%zu\n", i, count);
+			return true;
+		}
+		/* Nothing past the WAIT was executed, finish one transfer at a time
+		 * leaving out the CTRL/STAT write recovering already did */
+		for (; i < count - 1U && !dp->fault; ++i) {
+			const swd_queue_transfer_s *transfer = &queue->transfers[i];
+			const uint32_t value = dp->low_access(dp, transfer->RnW, transfer->addr, transfer->value);
+			if (transfer->result)
+				*transfer->result = value;
+		}
+		return dp->fault;
+	}
+
+	if (cl_debuglevel & BMP_DEBUG_TARGET)
+		DEBUG_WARN("Protocol %d in SWD queue\n", ack);
+	queue->line_reset(dp);
+	swd_queue_recover(dp);
+	return true;
+}
+
+static void swd_queue_reserve(swd_queue_s *queue, ADIv5_DP_t *dp)
+{
+	/* A transfer and the RDBUFF read collecting a posted AP read before it */
+	if (queue->count + 2U + SWD_QUEUE_RESERVED > queue->size && swd_queue_run(queue, dp))
+		queue->failed = true;
+}
+
+void swd_queue_read(swd_queue_s *queue, ADIv5_DP_t *dp, uint16_t addr, uint32_t *result)
+{
+	swd_queue_reserve(queue, dp);
+	/* Once a run failed, anything after it would act on the wrong TAR */
+	if (queue->failed)
+		return;
+	if (addr & ADIV5_APnDP) {
+		swd_queue_add(queue, ADIV5_LOW_READ, addr, 0, queue->pending);
+		queue->pending = result;
+		return;
+	}
+	/* A DP read does not return the posted AP read, so collect that first */
+	if (queue->pending) {
+		swd_queue_add(queue, ADIV5_LOW_READ, ADIV5_DP_RDBUFF, 0, queue->pending);
+		queue->pending = NULL;
+	}
+	swd_queue_add(queue, ADIV5_LOW_READ, addr, 0, result);
+}
+
+void swd_queue_write(swd_queue_s *queue, ADIv5_DP_t *dp, uint16_t addr, uint32_t value)
+{
+	swd_queue_reserve(queue, dp);
+	if (queue->failed)
+		return;
+	if (queue->pending) {
+		swd_queue_add(queue, ADIV5_LOW_READ, ADIV5_DP_RDBUFF, 0, queue->pending);
+		queue->pending = NULL;
+	}
+	swd_queue_add(queue, ADIV5_LOW_WRITE, addr, value, NULL);
+}
+
+bool swd_queue_flush(swd_queue_s *queue, ADIv5_DP_t *dp)
+{
+	volatile bool failed = false;
+	volatile struct exception e;
+	TRY_CATCH (e, EXCEPTION_ALL) {
+		failed = swd_queue_run(queue, dp);
+	}
+	/* Never leave a half built queue or stale result pointers behind */
+	queue->count = 0;
+	queue->pending = NULL;
+	failed |= queue->failed;
+	queue->failed = false;
+	if (e.type)
+		raise_exception(e.type, e.msg);
+	if (failed)
+		adiv5_dp_error(dp);
+	return failed;
+}
+
+static uint32_t swd_queue_mem_csw(ADIv5_AP_t *ap, enum align align)
+{
+	const uint32_t csw = ap->csw | ADIV5_AP_CSW_ADDRINC_SINGLE;
+	switch (align) {
+	case ALIGN_BYTE:
+		return csw | ADIV5_AP_CSW_SIZE_BYTE;
+	case ALIGN_HALFWORD:
+		return csw | ADIV5_AP_CSW_SIZE_HALFWORD;
+	case ALIGN_DWORD:
+	case ALIGN_WORD:
+	default:
+		return csw | ADIV5_AP_CSW_SIZE_WORD;
+	}
+}
+
+/* Number of elements up to the end of the 1kiB block TAR auto-increments in */
+static size_t swd_queue_mem_count(uint32_t addr, size_t len, enum align align)
+{
+	return MIN(len, 0x400U - (addr & 0x3ffU)) >> align;
+}
+
+void swd_queue_mem_read(ADIv5_AP_t *ap, void *dest, uint32_t src, size_t len)
+{
+	const enum align align = MIN(ALIGNOF(src), ALIGNOF(len));
+	uint32_t values[0x400U];
+	while (len) {
+		const size_t count = swd_queue_mem_count(src, len, align);
+		adiv5_ap_queue_write(ap, ADIV5_AP_CSW, swd_queue_mem_csw(ap, align));
+		adiv5_ap_queue_write(ap, ADIV5_AP_TAR, src);
+		for (size_t i = 0; i < count; ++i)
+			adiv5_ap_queue_read(ap, ADIV5_AP_DRW, &values[i]);
+		if (adiv5_dp_queue_flush(ap->dp)) {
+			/* Have the caller's error check see the failure */
+			ap->dp->fault = 1;
+			memset(dest, 0xff, len);
+			return;
+		}
+		for (size_t i = 0; i < count; ++i) {
+			dest = extract(dest, src, values[i], align);
+			src += 1U << align;
+		}
+		len -= count << align;
+	}
+}
+
+void swd_queue_mem_write_sized(ADIv5_AP_t *ap, uint32_t dest, const void *src, size_t len, enum align align)
+{
+	const uint8_t *data = src;
+	while (len) {
+		const size_t count = swd_queue_mem_count(dest, len, align);
+		adiv5_ap_queue_write(ap, ADIV5_AP_CSW, swd_queue_mem_csw(ap, align));
+		adiv5_ap_queue_write(ap, ADIV5_AP_TAR, dest);
+		for (size_t i = 0; i < count; ++i) {
+			uint32_t value = 0;
+			/* Pack data into correct data lane */
+			switch (align) {
+			case ALIGN_BYTE:
+				value = (uint32_t)*data << ((dest & 3U) << 3U);
+				break;
+			case ALIGN_HALFWORD: {
+				uint16_t half;
+				memcpy(&half, data, sizeof(half));
+				value = (uint32_t)half << ((dest & 2U) << 3U);
+				break;
+			}
+			case ALIGN_DWORD:
+			case ALIGN_WORD:
+				memcpy(&value, data, sizeof(value));
+				break;
+			}
+			adiv5_ap_queue_write(ap, ADIV5_AP_DRW, value);
+			data += 1U << align;
+			dest += 1U << align;
+		}
+		if (adiv5_dp_queue_flush(ap->dp)) {
+			ap->dp->fault = 1;
+			return;
+		}
+		len -= count << align;
+	}
+}
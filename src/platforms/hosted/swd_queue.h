@@ -0,0 +1,61 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PLATFORMS_HOSTED_SWD_QUEUE_H
+#define PLATFORMS_HOSTED_SWD_QUEUE_H
+
+#include "adiv5.h"
+
+/*
+ * DP queue for adaptors that can clock many SWD transfers in one go without
+ * looking at each ACK first. The adaptor specific part only has to turn a run
+ * of transfers into its own command stream and decode what came back.
+ */
+typedef struct swd_queue_transfer {
+	uint8_t RnW;
+	uint16_t addr;
+	/* Data to write, or the data captured by a read once the queue has run */
+	uint32_t value;
+	/* Where the captured data goes, for AP reads that is the AP read before */
+	uint32_t *result;
+	uint8_t ack;
+	bool parity_error;
+} swd_queue_transfer_s;
+
+typedef struct swd_queue {
+	swd_queue_transfer_s *transfers;
+	size_t size;
+	size_t count;
+	/* AP read whose result arrives with the next AP read or RDBUFF */
+	uint32_t *pending;
+	/* A run that had to be made because the queue was full has failed */
+	bool failed;
+	/* Clock out all transfers as one sequence, filling in each ack and read data */
+	void (*run)(ADIv5_DP_t *dp, swd_queue_transfer_s *transfers, size_t count);
+	/* Recover from a protocol error, leaving the DP ready for a new request */
+	void (*line_reset)(ADIv5_DP_t *dp);
+} swd_queue_s;
+
+void swd_queue_read(swd_queue_s *queue, ADIv5_DP_t *dp, uint16_t addr, uint32_t *result);
+void swd_queue_write(swd_queue_s *queue, ADIv5_DP_t *dp, uint16_t addr, uint32_t value);
+bool swd_queue_flush(swd_queue_s *queue, ADIv5_DP_t *dp);
+
+/* Memory accesses built on the DP queue, one run per 1kiB TAR block */
+void swd_queue_mem_read(ADIv5_AP_t *ap, void *dest, uint32_t src, size_t len);
+void swd_queue_mem_write_sized(ADIv5_AP_t *ap, uint32_t dest, const void *src, size_t len, enum align align);
+
+#endif /* PLATFORMS_HOSTED_SWD_QUEUE_H */
@@ -0,0 +1,467 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * SWO capture for the hosted build, run alongside GDB and RTT. The probe is told
+ * to pass the trace stream through undecoded, and its trace endpoint is read with
+ * a ring of asynchronous bulk transfers, so there is always one queued while the
+ * others are decoded. A scheduler task collects the finished ones in order and
+ * turns the ITM/DWT packets into the same event lines scripts/swolisten writes:
+ * the local timestamp followed by the event, one per line.
+ */
+
+#include "general.h"
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "platform.h"
+#include "swo_if.h"
+#include "bmp_remote.h"
+#include "scheduler.h"
+#include "timeline.h"
+#include "io_sink.h"
+#include "stats.h"
+
+#define SWO_IF_INTERFACE 5U
+#define SWO_IF_ENDPOINT  5U
+
+/* 8 transfers of 4KiB hold over 100ms of trace at the fastest NRZ rate */
+#define SWO_IF_TRANSFER_SIZE 4096U
+#define SWO_IF_POLL_US       1000U
+#define SWO_IF_OUT_SIZE      16384U
+
+typedef enum swo_itm_state {
+	ITM_IDLE,
+	ITM_SYNCING,
+	ITM_TS,
+	ITM_GTS,
+	ITM_EXT,
+	ITM_SWIT,
+	ITM_HWIT,
+} swo_itm_state_e;
+
+typedef struct swo_itm {
+	swo_itm_state_e state;
+	uint8_t packet[7];
+	uint8_t count;
+	uint8_t target;
+	uint8_t addr;
+	uint64_t local_time;
+	uint64_t global_time;
+} swo_itm_s;
+
+static usb_link_t swo_link;
+static uint8_t swo_buf[USB_LINK_POOL_SIZE][SWO_IF_TRANSFER_SIZE];
+static swo_itm_s swo_itm;
+
+static FILE *swo_file;
+static int swo_serv = -1;
+static int swo_conn = -1;
+static char swo_out[SWO_IF_OUT_SIZE];
+static size_t swo_out_len;
+
+/* when the transfer being decoded was collected, for the timeline */
+static uint64_t swo_time;
+
+static uint64_t swo_bytes;
+static uint32_t swo_errors;
+static uint32_t swo_dropped;
+
+/* decoded output, buffered until the end of each poll */
+
+static void swo_if_emit(const char *fmt, ...)
+{
+	char line[128];
+	int len = snprintf(line, sizeof(line), "%" PRIu64 " ", swo_itm.local_time);
+	va_list ap;
+	va_start(ap, fmt);
+	len += vsnprintf(line + len, sizeof(line) - len - 1U, fmt, ap);
+	va_end(ap);
+	if (len > (int)sizeof(line) - 2)
+		len = sizeof(line) - 2;
+	timeline_add(swo_time, "SWO", line, len);
+	line[len++] = '\n';
+
+	/* with no sink of its own the events only go to the timeline */
+	if (!swo_file && swo_serv == -1)
+		return;
+
+	/* a consumer that doesn't keep up loses lines rather than stalling capture */
+	if (swo_out_len + len > sizeof(swo_out)) {
+		++swo_dropped;
+		return;
+	}
+	memcpy(swo_out + swo_out_len, line, len);
+	swo_out_len += len;
+}
+
+static void swo_if_flush(void)
+{
+	io_sink_s *const sink = swo_file == stdout ? io_sink_stdout() : NULL;
+	if (sink) {
+		/* The terminal has its own thread, what its ring can't take now is dropped */
+		if (io_sink_write(sink, swo_out, swo_out_len) != swo_out_len)
+			++swo_dropped;
+		swo_out_len = 0;
+		return;
+	}
+	if (swo_file) {
+		fwrite(swo_out, 1, swo_out_len, swo_file);
+		fflush(swo_file);
+		swo_out_len = 0;
+		return;
+	}
+	if (swo_serv == -1)
+		return;
+	if (swo_conn == -1) {
+		swo_conn = accept(swo_serv, NULL, NULL);
+		if (swo_conn == -1) {
+			swo_out_len = 0;
+			return;
+		}
+		fcntl(swo_conn, F_SETFL, fcntl(swo_conn, F_GETFL, 0) | O_NONBLOCK);
+		DEBUG_INFO("swo: consumer connected\n");
+	}
+	if (!swo_out_len)
+		return;
+	const ssize_t sent = send(swo_conn, swo_out, swo_out_len, MSG_NOSIGNAL);
+	if (sent < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return;
+		DEBUG_INFO("swo: consumer disconnected\n");
+		close(swo_conn);
+		swo_conn = -1;
+		swo_out_len = 0;
+		return;
+	}
+	swo_out_len -= sent;
+	memmove(swo_out, swo_out + sent, swo_out_len);
+}
+
+/* ITM/DWT packet decoding, payloads are little endian */
+
+static uint32_t swo_itm_value(const uint8_t *const data, const size_t len)
+{
+	uint32_t value = 0;
+	for (size_t i = 0; i < len; ++i)
+		value |= (uint32_t)data[i] << (8U * i);
+	return value;
+}
+
+static void swo_itm_hwit(const uint8_t disc, const uint8_t *const data, const size_t len)
+{
+	static const char *const exc_fn[] = {"?", "enter", "exit", "return"};
+	const uint32_t value = swo_itm_value(data, len);
+	if (disc == 0)
+		swo_if_emit("EVT 0x%02" PRIx32, value & 0x3fU);
+	else if (disc == 1)
+		swo_if_emit("EXC %" PRIu32 " %s", value & 0x1ffU, exc_fn[(value >> 12U) & 3U]);
+	else if (disc == 2) {
+		if (len == 1)
+			swo_if_emit("PC sleep");
+		else
+			swo_if_emit("PC 0x%08" PRIx32, value);
+	} else if ((disc & 0x18U) == 0x08U) {
+		/* data trace comparator match, with the PC or the low address bits */
+		if (disc & 1U)
+			swo_if_emit("DADDR %u 0x%04" PRIx32, (disc >> 1U) & 3U, value);
+		else
+			swo_if_emit("DPC %u 0x%08" PRIx32, (disc >> 1U) & 3U, value);
+	} else if ((disc & 0x18U) == 0x10U)
+		swo_if_emit("DVAL %u %c %u 0x%08" PRIx32, (disc >> 1U) & 3U, (disc & 1U) ? 'w' : 'r', (unsigned)len, value);
+	else
+		swo_if_emit("HWIT %u %u 0x%08" PRIx32, disc, (unsigned)len, value);
+}
+
+/* the time since the last local timestamp, in trace clock cycles */
+static void swo_itm_ts(const uint8_t *const data, const size_t len)
+{
+	uint32_t delta = 0;
+	uint8_t tc = 0;
+	if (!(data[0] & 0x80U))
+		delta = (data[0] >> 4U) & 7U;
+	else {
+		tc = (data[0] >> 4U) & 3U;
+		for (size_t i = 1; i < len; ++i)
+			delta |= (uint32_t)(data[i] & 0x7fU) << (7U * (i - 1U));
+	}
+	swo_itm.local_time += delta;
+	swo_if_emit("LTS %" PRIu32 " %u", delta, tc);
+}
+
+/* global timestamps only carry the bits that changed, GTS1 the low 26 and GTS2 the rest */
+static void swo_itm_gts(const uint8_t *const data, const size_t len)
+{
+	uint64_t value = 0;
+	for (size_t i = 1; i < len; ++i)
+		value |= (uint64_t)(data[i] & 0x7fU) << (7U * (i - 1U));
+	if (data[0] != 0x94U) {
+		swo_itm.global_time = (swo_itm.global_time & ((1ULL << 26U) - 1U)) | (value << 26U);
+		return;
+	}
+	size_t bits = (len - 1U) * 7U;
+	bool wrap = false;
+	bool clkch = false;
+	if (len == 5) {
+		bits = 26;
+		wrap = data[4] & 0x40U;
+		clkch = data[4] & 0x20U;
+	}
+	const uint64_t mask = (1ULL << bits) - 1U;
+	swo_itm.global_time = (swo_itm.global_time & ~mask) | (value & mask);
+	swo_if_emit("GTS 0x%012" PRIx64 "%s%s", swo_itm.global_time, wrap ? " wrap" : "", clkch ? " clkch" : "");
+}
+
+static void swo_itm_ext(const uint8_t *const data, const size_t len)
+{
+	uint32_t ext = (data[0] >> 4U) & 7U;
+	for (size_t i = 1; i < len; ++i)
+		ext |= (uint32_t)(data[i] & 0x7fU) << (3U + 7U * (i - 1U));
+	swo_if_emit("EXT %s %" PRIu32, (data[0] & 0x04U) ? "hw" : "page", ext);
+}
+
+static void swo_itm_header(const uint8_t byte)
+{
+	swo_itm.packet[0] = byte;
+	swo_itm.count = 1;
+	if (byte == 0x70U)
+		swo_if_emit("OVF");
+	else if (byte == 0) {
+		/* a sync is at least 47 zero bits followed by a one */
+		swo_itm.count = 0;
+		swo_itm.target = 4;
+		swo_itm.state = ITM_SYNCING;
+	} else if (!(byte & 0x0fU)) {
+		if (byte & 0x80U) {
+			swo_itm.target = 5;
+			swo_itm.state = ITM_TS;
+		} else
+			swo_itm_ts(swo_itm.packet, 1);
+	} else if (byte == 0x94U || byte == 0xb4U) {
+		swo_itm.target = byte == 0x94U ? 5 : 7;
+		swo_itm.state = ITM_GTS;
+	} else if ((byte & 0x0bU) == 0x08U) {
+		if (byte & 0x80U) {
+			swo_itm.target = 5;
+			swo_itm.state = ITM_EXT;
+		} else
+			swo_itm_ext(swo_itm.packet, 1);
+	} else if (byte & 0x03U) {
+		/* a stimulus port write, or a hardware source packet from the DWT */
+		swo_itm.target = (byte & 3U) == 3U ? 4U : (byte & 3U);
+		swo_itm.addr = byte >> 3U;
+		swo_itm.count = 0;
+		swo_itm.state = (byte & 0x04U) ? ITM_HWIT : ITM_SWIT;
+	}
+	/* anything else is a reserved header and skipped */
+}
+
+static void swo_itm_decode(const uint8_t *const data, const size_t len)
+{
+	for (size_t i = 0; i < len; ++i) {
+		const uint8_t byte = data[i];
+		switch (swo_itm.state) {
+		case ITM_IDLE:
+			swo_itm_header(byte);
+			break;
+
+		case ITM_SWIT:
+		case ITM_HWIT:
+			swo_itm.packet[swo_itm.count++] = byte;
+			if (swo_itm.count < swo_itm.target)
+				break;
+			if (swo_itm.state == ITM_SWIT)
+				swo_if_emit("SWIT %u %u 0x%08" PRIx32, swo_itm.addr, swo_itm.target,
+					swo_itm_value(swo_itm.packet, swo_itm.target));
+			else
+				swo_itm_hwit(swo_itm.addr, swo_itm.packet, swo_itm.target);
+			swo_itm.state = ITM_IDLE;
+			break;
+
+		case ITM_TS:
+		case ITM_GTS:
+		case ITM_EXT:
+			/* payload bytes carry a continuation bit, the header counts towards target */
+			swo_itm.packet[swo_itm.count++] = byte;
+			if (!(byte & 0x80U)) {
+				if (swo_itm.state == ITM_TS)
+					swo_itm_ts(swo_itm.packet, swo_itm.count);
+				else if (swo_itm.state == ITM_GTS)
+					swo_itm_gts(swo_itm.packet, swo_itm.count);
+				else
+					swo_itm_ext(swo_itm.packet, swo_itm.count);
+				swo_itm.state = ITM_IDLE;
+			} else if (swo_itm.count >= swo_itm.target)
+				swo_itm.state = ITM_IDLE;
+			break;
+
+		case ITM_SYNCING:
+			if (!byte) {
+				if (swo_itm.count < swo_itm.target)
+					++swo_itm.count;
+				break;
+			}
+			if (byte == 0x80U && swo_itm.count >= swo_itm.target)
+				swo_if_emit("SYNC");
+			swo_itm.state = ITM_IDLE;
+			break;
+		}
+	}
+}
+
+/* capture */
+
+static bool swo_if_submit(void)
+{
+	const size_t slot = (swo_link.pool_head + usb_link_pending(&swo_link)) % USB_LINK_POOL_SIZE;
+	return !usb_link_submit(&swo_link, true, swo_buf[slot], SWO_IF_TRANSFER_SIZE);
+}
+
+static uint32_t swo_if_poll(void)
+{
+	struct timeval timeout = {0, 0};
+	libusb_handle_events_timeout_completed(swo_link.ul_libusb_ctx, &timeout, NULL);
+
+	/* transfers finish in the order they were queued, so the stream stays in order */
+	while (usb_link_ready(&swo_link)) {
+		const uint8_t *const data = swo_buf[swo_link.pool_head];
+		const int len = usb_link_collect(&swo_link);
+		if (len < 0) {
+			++swo_errors;
+			stats_add(STATS_SWO_ERRORS, 1);
+		} else {
+			swo_bytes += len;
+			stats_add(STATS_SWO_BYTES, len);
+			swo_time = timeline_enabled() ? timeline_now() : 0;
+			swo_itm_decode(data, len);
+		}
+		if (!swo_if_submit() && !usb_link_pending(&swo_link)) {
+			DEBUG_WARN("swo: trace endpoint gone, capture stopped\n");
+			swo_if_exit();
+			return UINT32_MAX;
+		}
+	}
+	swo_if_flush();
+	return SWO_IF_POLL_US;
+}
+
+static bool swo_if_open_sink(const char *const sink)
+{
+	if (!sink)
+		return true;
+	if (!strcmp(sink, "-")) {
+		swo_file = stdout;
+		return true;
+	}
+	char *end;
+	const unsigned long port = strtoul(sink, &end, 0);
+	if (*end || !port || port > 65535U) {
+		swo_file = fopen(sink, "w");
+		if (!swo_file)
+			DEBUG_WARN("swo: can not open %s: %s\n", sink, strerror(errno));
+		return swo_file;
+	}
+
+	swo_serv = socket(PF_INET, SOCK_STREAM, 0);
+	if (swo_serv == -1)
+		return false;
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	const int opt = 1;
+	if (setsockopt(swo_serv, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1 ||
+		bind(swo_serv, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(swo_serv, 1) == -1) {
+		DEBUG_WARN("swo: can not listen on TCP port %lu: %s\n", port, strerror(errno));
+		close(swo_serv);
+		swo_serv = -1;
+		return false;
+	}
+	fcntl(swo_serv, F_SETFL, fcntl(swo_serv, F_GETFL, 0) | O_NONBLOCK);
+	DEBUG_WARN("SWO events on TCP: %lu\n", port);
+	return true;
+}
+
+bool swo_if_init(bmp_info_t *const info, const char *const sink, const uint32_t baudrate)
+{
+	if (info->bmp_type != BMP_TYPE_BMP) {
+		DEBUG_WARN("swo: capture needs a Black Magic Probe\n");
+		return false;
+	}
+	libusb_device_handle *const handle = bmp_libusb_open_probe(info);
+	if (!handle) {
+		DEBUG_WARN("swo: can not open the probe's trace interface\n");
+		return false;
+	}
+	if (libusb_claim_interface(handle, SWO_IF_INTERFACE)) {
+		DEBUG_WARN("swo: can not claim the trace interface, is swolisten running?\n");
+		libusb_close(handle);
+		return false;
+	}
+	swo_link.ul_libusb_ctx = info->libusb_ctx;
+	swo_link.ul_libusb_device_handle = handle;
+	swo_link.ep_rx = SWO_IF_ENDPOINT;
+
+	uint32_t actual;
+	if (!swo_if_open_sink(sink) || !remote_traceswo_init(baudrate, &actual)) {
+		swo_if_exit();
+		return false;
+	}
+	if (actual)
+		DEBUG_INFO("swo: capturing at %" PRIu32 " baud\n", actual);
+	while (usb_link_pending(&swo_link) < USB_LINK_POOL_SIZE) {
+		if (!swo_if_submit()) {
+			swo_if_exit();
+			return false;
+		}
+	}
+	scheduler_add(swo_if_poll);
+	return true;
+}
+
+void swo_if_exit(void)
+{
+	if (!swo_link.ul_libusb_device_handle)
+		return;
+	scheduler_remove(swo_if_poll);
+	usb_link_cancel(&swo_link);
+	for (size_t i = 0; i < USB_LINK_POOL_SIZE; ++i) {
+		libusb_free_transfer(swo_link.pool[i]);
+		swo_link.pool[i] = NULL;
+	}
+	libusb_release_interface(swo_link.ul_libusb_device_handle, SWO_IF_INTERFACE);
+	libusb_close(swo_link.ul_libusb_device_handle);
+	swo_link.ul_libusb_device_handle = NULL;
+
+	swo_if_flush();
+	if (swo_file && swo_file != stdout)
+		fclose(swo_file);
+	swo_file = NULL;
+	if (swo_conn != -1)
+		close(swo_conn);
+	if (swo_serv != -1)
+		close(swo_serv);
+	swo_conn = -1;
+	swo_serv = -1;
+	DEBUG_INFO("swo: %" PRIu64 " bytes captured, %" PRIu32 " transfer errors, %" PRIu32 " lines dropped\n", swo_bytes,
+		swo_errors, swo_dropped);
+}
@@ -0,0 +1,36 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PLATFORMS_HOSTED_SWO_IF_H
+#define PLATFORMS_HOSTED_SWO_IF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "bmp_hosted.h"
+
+/*
+ * Start capturing SWO from a Black Magic Probe's trace endpoint. The decoded
+ * ITM/DWT events go to sink, which is "-" for stdout, a TCP port number or a
+ * file name, and to the timeline when that is enabled. sink may be NULL to only
+ * feed the timeline. baudrate is only used by probes sampling SWO as NRZ, 0
+ * picks the firmware default.
+ */
+bool swo_if_init(bmp_info_t *info, const char *sink, uint32_t baudrate);
+void swo_if_exit(void);
+
+#endif /* PLATFORMS_HOSTED_SWO_IF_H */
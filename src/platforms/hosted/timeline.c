@@ -0,0 +1,209 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The sources reach the host by different paths: SWO in batches of USB
+ * transfers, RTT when the target's buffers are polled and GDB's run state as
+ * packets are handled. Each stamps its events when they arrive, and they are
+ * held back for TIMELINE_HOLD_US in a buffer kept sorted by time so that a
+ * late batch still lands in order before anything newer is written out.
+ */
+
+#include "general.h"
+#include <errno.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "timeline.h"
+#include "stream_if.h"
+#include "scheduler.h"
+#include "io_sink.h"
+
+#define TIMELINE_EVENTS  4096U
+#define TIMELINE_TEXT    128U
+#define TIMELINE_SOURCE  8U
+#define TIMELINE_HOLD_US 20000U
+#define TIMELINE_POLL_US 5000U
+
+typedef struct timeline_event {
+	uint64_t time_us;
+	char source[TIMELINE_SOURCE];
+	char text[TIMELINE_TEXT];
+} timeline_event_s;
+
+static timeline_event_s *timeline_events;
+static size_t timeline_count;
+static FILE *timeline_file;
+static bool timeline_stream;
+static uint64_t timeline_origin;
+static bool timeline_running;
+
+/* platform_time_us() wraps after 71 minutes, too soon for a long capture */
+static uint64_t timeline_clock(void)
+{
+#if defined(_WIN32) || defined(__CYGWIN__)
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000U + tv.tv_usec;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000U + ts.tv_nsec / 1000U;
+#endif
+}
+
+uint64_t timeline_now(void)
+{
+	return timeline_clock() - timeline_origin;
+}
+
+bool timeline_enabled(void)
+{
+	return timeline_file || timeline_stream;
+}
+
+/* Write out the count oldest events */
+static void timeline_write(const size_t count)
+{
+	for (size_t i = 0; i < count; ++i) {
+		const timeline_event_s *const event = &timeline_events[i];
+		char line[TIMELINE_TEXT + TIMELINE_SOURCE + 24U];
+		const int len =
+			snprintf(line, sizeof(line), "%" PRIu64 " %s %s\n", event->time_us, event->source, event->text);
+		io_sink_s *const sink = timeline_file == stdout ? io_sink_stdout() : NULL;
+		if (timeline_stream)
+			stream_if_write(line, MIN((size_t)len, sizeof(line) - 1U));
+		/* A line that doesn't fit behind a stalled terminal is lost, not waited for */
+		else if (sink)
+			io_sink_write(sink, line, MIN((size_t)len, sizeof(line) - 1U));
+		else
+			fputs(line, timeline_file);
+	}
+	timeline_count -= count;
+	memmove(timeline_events, timeline_events + count, timeline_count * sizeof(*timeline_events));
+}
+
+static uint32_t timeline_poll(void)
+{
+	const uint64_t now = timeline_now();
+	size_t ready = 0;
+	while (ready < timeline_count && timeline_events[ready].time_us + TIMELINE_HOLD_US <= now)
+		++ready;
+	if (ready) {
+		timeline_write(ready);
+		if (timeline_file)
+			fflush(timeline_file);
+	}
+	return TIMELINE_POLL_US;
+}
+
+/* Copy text with anything unprintable escaped, so every event stays on one line */
+static void timeline_escape(char *const dest, const char *const text, const size_t len)
+{
+	size_t out = 0;
+	for (size_t i = 0; i < len && out + 5U < TIMELINE_TEXT; ++i) {
+		const uint8_t ch = text[i];
+		if (ch == '\n')
+			out += snprintf(dest + out, TIMELINE_TEXT - out, "\\n");
+		else if (ch == '\\' || ch < ' ' || ch > '~')
+			out += snprintf(dest + out, TIMELINE_TEXT - out, ch == '\\' ? "\\\\" : "\\x%02x", ch);
+		else
+			dest[out++] = ch;
+	}
+	dest[out] = '\0';
+}
+
+void timeline_add(const uint64_t time_us, const char *const source, const char *const text, const size_t len)
+{
+	if (!timeline_enabled())
+		return;
+	/* When the hold buffer fills, the oldest events go out early */
+	if (timeline_count == TIMELINE_EVENTS)
+		timeline_write(TIMELINE_EVENTS / 4U);
+	/* Sources deliver almost in order, so the insertion point is nearly always at the end */
+	size_t pos = timeline_count;
+	while (pos && timeline_events[pos - 1U].time_us > time_us)
+		--pos;
+	memmove(timeline_events + pos + 1U, timeline_events + pos, (timeline_count - pos) * sizeof(*timeline_events));
+	++timeline_count;
+
+	timeline_event_s *const event = &timeline_events[pos];
+	event->time_us = time_us;
+	strncpy(event->source, source, sizeof(event->source) - 1U);
+	event->source[sizeof(event->source) - 1U] = '\0';
+	timeline_escape(event->text, text, len);
+}
+
+/* GDB resume and halt, as SET_RUN_STATE() sees them */
+void timeline_run_state(const bool running)
+{
+	if (!timeline_enabled() || running == timeline_running)
+		return;
+	timeline_running = running;
+	const char *const text = running ? "resume" : "halt";
+	timeline_add(timeline_now(), "GDB", text, strlen(text));
+}
+
+bool timeline_init(const char *const sink, const bool lz4)
+{
+	timeline_events = calloc(TIMELINE_EVENTS, sizeof(*timeline_events));
+	if (!timeline_events) { /* calloc failed: heap exhaustion */
+		DEBUG_WARN("calloc: failed in %s\n", __func__);
+		return false;
+	}
+	char *end;
+	const unsigned long port = strtoul(sink, &end, 0);
+	if (!*end && port && port <= 65535U) {
+		timeline_stream = stream_if_init(port, lz4);
+		if (!timeline_stream) {
+			free(timeline_events);
+			timeline_events = NULL;
+			return false;
+		}
+	} else if (!strcmp(sink, "-"))
+		timeline_file = stdout;
+	else {
+		timeline_file = fopen(sink, "w");
+		if (!timeline_file) {
+			DEBUG_WARN("timeline: can not open %s: %s\n", sink, strerror(errno));
+			free(timeline_events);
+			timeline_events = NULL;
+			return false;
+		}
+	}
+	timeline_origin = timeline_clock();
+	scheduler_add(timeline_poll);
+	return true;
+}
+
+void timeline_exit(void)
+{
+	if (!timeline_enabled())
+		return;
+	scheduler_remove(timeline_poll);
+	timeline_write(timeline_count);
+	if (timeline_stream)
+		stream_if_exit();
+	else if (timeline_file != stdout)
+		fclose(timeline_file);
+	else
+		fflush(timeline_file);
+	timeline_file = NULL;
+	timeline_stream = false;
+	free(timeline_events);
+	timeline_events = NULL;
+}
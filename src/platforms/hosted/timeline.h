@@ -0,0 +1,39 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PLATFORMS_HOSTED_TIMELINE_H
+#define PLATFORMS_HOSTED_TIMELINE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Merge SWO events, RTT output and GDB halt/resume into one time ordered
+ * stream of "<us> <source> <text>" lines, written to sink: "-" for stdout, a
+ * TCP port number to serve it on, LZ4 compressed if lz4 is set, or a file name.
+ * Times are microseconds since timeline_init on a monotonic clock.
+ */
+bool timeline_init(const char *sink, bool lz4);
+void timeline_exit(void);
+bool timeline_enabled(void);
+uint64_t timeline_now(void);
+
+/* Add an event stamped at time_us, which may be up to TIMELINE_HOLD_US older than the newest */
+void timeline_add(uint64_t time_us, const char *source, const char *text, size_t len);
+
+#endif /* PLATFORMS_HOSTED_TIMELINE_H */
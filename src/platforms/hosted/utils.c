@@ -24,9 +24,11 @@
 /* This file deduplicates codes used in several pc-hosted platforms
  */
 
+#include "general.h"
 #include <stdint.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <time.h>
 
 #if defined(_WIN32) && !defined(__MINGW32__)
 #warning "This vasprintf() is dubious!"
@@ -54,9 +56,35 @@ void platform_delay(uint32_t ms)
 #endif
 }
 
+void platform_delay_us(uint32_t us)
+{
+#if defined(_WIN32) && !defined(__MINGW32__)
+	Sleep((us + 999U) / 1000U);
+#else
+# if !defined(usleep)
+	int usleep(unsigned int);
+# endif
+	usleep(us);
+#endif
+}
+
 uint32_t platform_time_ms(void)
 {
 	struct timeval tv;
 	gettimeofday(&tv, NULL);
 	return (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
 }
+
+uint32_t platform_time_us(void)
+{
+#if defined(_WIN32) || defined(__CYGWIN__)
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint32_t)((tv.tv_sec * 1000000U) + tv.tv_usec);
+#else
+	/* monotonic, so the scheduler doesn't skip or stall when the wall clock is set */
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)((ts.tv_sec * 1000000U) + (ts.tv_nsec / 1000U));
+#endif
+}
@@ -0,0 +1,362 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Record and replay of the traffic between BMDA and a probe, taken where each
+ * backend hands whole requests to its transport and gets whole responses
+ * back. A trace starts with the magic, a format version, the probe type and
+ * its identification strings. Each exchange after that is one record:
+ *
+ *   kind      1 byte, channel << 1 | 1 for a response
+ *   delta     LEB128, microseconds since the previous record
+ *   length    LEB128, payload bytes
+ *   result    zigzag LEB128, responses only: what the transport returned
+ *   payload
+ *
+ * Replaying answers the remote protocol from the trace with no probe
+ * attached, which makes the round trip count and the host CPU time spent in
+ * the protocol stack for a session repeatable, to catch regressions in either.
+ */
+
+#include "general.h"
+#include "wire_trace.h"
+
+#include <errno.h>
+#include <time.h>
+
+#define WIRE_TRACE_MAGIC   "BMPWIRE"
+#define WIRE_TRACE_VERSION 1U
+
+#define WIRE_TRACE_RESPONSE 1U
+
+typedef struct wire_trace_stats {
+	uint32_t requests;
+	uint32_t responses;
+	uint64_t bytes_out;
+	uint64_t bytes_in;
+} wire_trace_stats_s;
+
+typedef struct wire_trace_record {
+	uint8_t kind;
+	uint32_t delta;
+	int result;
+	size_t length;
+	const uint8_t *payload;
+} wire_trace_record_s;
+
+static const char *const wire_trace_channel_names[WIRE_TRACE_CHANNELS] = {"remote", "DAP", "USB"};
+
+static FILE *record_file;
+static uint32_t record_last_us;
+
+static uint8_t *replay_data;
+static size_t replay_size;
+static size_t replay_offset;
+static size_t replay_records_offset;
+static uint32_t replay_mismatches;
+static clock_t replay_start;
+
+static wire_trace_stats_s stats[WIRE_TRACE_CHANNELS];
+static uint64_t link_us;
+
+bool wire_trace_recording(void)
+{
+	return record_file != NULL;
+}
+
+bool wire_trace_replaying(void)
+{
+	return replay_data != NULL;
+}
+
+static void record_varint(uint64_t value)
+{
+	uint8_t encoded[10];
+	size_t length = 0;
+	do {
+		encoded[length] = value & 0x7fU;
+		value >>= 7U;
+		if (value)
+			encoded[length] |= 0x80U;
+		++length;
+	} while (value);
+	fwrite(encoded, 1, length, record_file);
+}
+
+static void record_string(const char *const value)
+{
+	const size_t length = strlen(value);
+	record_varint(length);
+	fwrite(value, 1, length, record_file);
+}
+
+bool wire_trace_record_open(const char *const path, const bmp_info_t *const info)
+{
+	record_file = fopen(path, "wb");
+	if (!record_file) {
+		DEBUG_WARN("Can not create wire trace %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	fwrite(WIRE_TRACE_MAGIC, 1, sizeof(WIRE_TRACE_MAGIC), record_file);
+	fputc(WIRE_TRACE_VERSION, record_file);
+	fputc(info->bmp_type, record_file);
+	record_string(info->serial);
+	record_string(info->manufacturer);
+	record_string(info->product);
+	record_string(info->version);
+	record_last_us = platform_time_us();
+	DEBUG_INFO("Recording the probe traffic to %s\n", path);
+	return true;
+}
+
+static void record_exchange(const wire_trace_channel_e channel, const bool response, const void *const data,
+	const size_t length, const int result)
+{
+	const uint32_t now = platform_time_us();
+	const uint32_t delta = now - record_last_us;
+	record_last_us = now;
+	link_us += delta;
+	fputc((channel << 1U) | (response ? WIRE_TRACE_RESPONSE : 0U), record_file);
+	record_varint(delta);
+	record_varint(length);
+	if (response)
+		record_varint(((uint32_t)result << 1U) ^ (uint32_t)(result >> 31U));
+	fwrite(data, 1, length, record_file);
+}
+
+void wire_trace_request(const wire_trace_channel_e channel, const void *const data, const size_t length)
+{
+	if (!record_file)
+		return;
+	++stats[channel].requests;
+	stats[channel].bytes_out += length;
+	record_exchange(channel, false, data, length, 0);
+}
+
+void wire_trace_response(
+	const wire_trace_channel_e channel, const void *const data, const size_t length, const int result)
+{
+	if (!record_file)
+		return;
+	++stats[channel].responses;
+	stats[channel].bytes_in += length;
+	record_exchange(channel, true, data, length, result);
+}
+
+static bool replay_varint(uint64_t *const value)
+{
+	*value = 0;
+	for (uint8_t shift = 0; shift < 64U; shift += 7U) {
+		if (replay_offset >= replay_size)
+			return false;
+		const uint8_t byte = replay_data[replay_offset++];
+		*value |= (uint64_t)(byte & 0x7fU) << shift;
+		if (!(byte & 0x80U))
+			return true;
+	}
+	return false;
+}
+
+static bool replay_string(char *const value, const size_t size)
+{
+	uint64_t length;
+	if (!replay_varint(&length) || length > replay_size - replay_offset)
+		return false;
+	const size_t copy = MIN((size_t)length, size - 1U);
+	memcpy(value, replay_data + replay_offset, copy);
+	value[copy] = '\0';
+	replay_offset += length;
+	return true;
+}
+
+/* Decode the record at the replay offset and step over it */
+static bool replay_next(wire_trace_record_s *const record)
+{
+	if (replay_offset >= replay_size)
+		return false;
+	record->kind = replay_data[replay_offset++];
+	uint64_t delta;
+	uint64_t length;
+	if (!replay_varint(&delta) || !replay_varint(&length))
+		return false;
+	record->delta = (uint32_t)delta;
+	record->result = 0;
+	if (record->kind & WIRE_TRACE_RESPONSE) {
+		uint64_t result;
+		if (!replay_varint(&result))
+			return false;
+		record->result = (int)((uint32_t)(result >> 1U) ^ -(uint32_t)(result & 1U));
+	}
+	if ((record->kind >> 1U) >= WIRE_TRACE_CHANNELS || length > replay_size - replay_offset)
+		return false;
+	record->length = (size_t)length;
+	record->payload = replay_data + replay_offset;
+	replay_offset += record->length;
+	return true;
+}
+
+static void print_stats(const char *const what)
+{
+	uint32_t round_trips = 0;
+	uint64_t bytes_out = 0;
+	uint64_t bytes_in = 0;
+	for (size_t i = 0; i < WIRE_TRACE_CHANNELS; ++i) {
+		round_trips += stats[i].responses;
+		bytes_out += stats[i].bytes_out;
+		bytes_in += stats[i].bytes_in;
+	}
+	DEBUG_WARN("%s %" PRIu32 " round trips (", what, round_trips);
+	for (size_t i = 0; i < WIRE_TRACE_CHANNELS; ++i)
+		DEBUG_WARN("%s%" PRIu32 " %s", i ? ", " : "", stats[i].responses, wire_trace_channel_names[i]);
+	DEBUG_WARN("), %" PRIu64 " bytes out, %" PRIu64 " bytes in, %.3fms on the link\n", bytes_out, bytes_in,
+		link_us / 1000.0);
+}
+
+bool wire_trace_replay_open(const char *const path, bmp_info_t *const info)
+{
+	FILE *const file = fopen(path, "rb");
+	if (!file) {
+		DEBUG_WARN("Can not open wire trace %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	fseek(file, 0, SEEK_END);
+	const long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	replay_data = size > 0 ? malloc(size) : NULL;
+	if (!replay_data || fread(replay_data, 1, size, file) != (size_t)size) {
+		DEBUG_WARN("Can not read wire trace %s\n", path);
+		fclose(file);
+		free(replay_data);
+		replay_data = NULL;
+		return false;
+	}
+	fclose(file);
+	replay_size = (size_t)size;
+	replay_offset = sizeof(WIRE_TRACE_MAGIC) + 2U;
+
+	bool valid = replay_size >= replay_offset && !memcmp(replay_data, WIRE_TRACE_MAGIC, sizeof(WIRE_TRACE_MAGIC)) &&
+		replay_data[sizeof(WIRE_TRACE_MAGIC)] == WIRE_TRACE_VERSION;
+	if (valid) {
+		memset(info, 0, sizeof(*info));
+		info->bmp_type = replay_data[sizeof(WIRE_TRACE_MAGIC) + 1U];
+		valid = replay_string(info->serial, sizeof(info->serial)) &&
+			replay_string(info->manufacturer, sizeof(info->manufacturer)) &&
+			replay_string(info->product, sizeof(info->product)) &&
+			replay_string(info->version, sizeof(info->version));
+	}
+	/* Check the records through once, and tally what was recorded */
+	replay_records_offset = replay_offset;
+	wire_trace_record_s record;
+	while (valid && replay_offset < replay_size) {
+		valid = replay_next(&record);
+		if (!valid)
+			break;
+		wire_trace_stats_s *const channel = &stats[record.kind >> 1U];
+		if (record.kind & WIRE_TRACE_RESPONSE) {
+			++channel->responses;
+			channel->bytes_in += record.length;
+		} else {
+			++channel->requests;
+			channel->bytes_out += record.length;
+		}
+		link_us += record.delta;
+	}
+	if (!valid) {
+		DEBUG_WARN("%s is not a wire trace, or is damaged\n", path);
+		free(replay_data);
+		replay_data = NULL;
+		return false;
+	}
+	print_stats("Trace holds");
+	/* Only the remote protocol can stand in for its probe, the other backends set up state from USB descriptors */
+	if (info->bmp_type != BMP_TYPE_BMP) {
+		DEBUG_WARN("Only traces of a Black Magic Probe can be replayed\n");
+		free(replay_data);
+		replay_data = NULL;
+		return false;
+	}
+	memset(stats, 0, sizeof(stats));
+	link_us = 0;
+	replay_offset = replay_records_offset;
+	replay_start = clock();
+	DEBUG_INFO("Replaying the probe traffic from %s\n", path);
+	return true;
+}
+
+/* Find the next record of the given kind, anything skipped on the way means the session went differently */
+static bool replay_find(const uint8_t kind, wire_trace_record_s *const record)
+{
+	while (replay_next(record)) {
+		link_us += record->delta;
+		if (record->kind == kind)
+			return true;
+		++replay_mismatches;
+	}
+	return false;
+}
+
+void wire_trace_replay_request(const wire_trace_channel_e channel, const void *const data, const size_t length)
+{
+	wire_trace_record_s record;
+	if (!replay_find(channel << 1U, &record)) {
+		++replay_mismatches;
+		return;
+	}
+	++stats[channel].requests;
+	stats[channel].bytes_out += length;
+	if (record.length != length || memcmp(record.payload, data, length)) {
+		if (!replay_mismatches)
+			DEBUG_WARN("Replay diverges from the trace at request %" PRIu32 "\n", stats[channel].requests);
+		++replay_mismatches;
+	}
+}
+
+int wire_trace_replay_response(const wire_trace_channel_e channel, void *const data, const size_t maxlength)
+{
+	wire_trace_record_s record;
+	if (!replay_find((channel << 1U) | WIRE_TRACE_RESPONSE, &record)) {
+		DEBUG_WARN("End of wire trace\n");
+		if (maxlength)
+			((uint8_t *)data)[0] = '\0';
+		return -1;
+	}
+	++stats[channel].responses;
+	stats[channel].bytes_in += record.length;
+	const size_t length = MIN(record.length, maxlength);
+	memcpy(data, record.payload, length);
+	/* The remote protocol hands its responses on as strings */
+	if (length < maxlength)
+		((uint8_t *)data)[length] = '\0';
+	return record.result;
+}
+
+void wire_trace_close(void)
+{
+	if (record_file) {
+		print_stats("Recorded");
+		fclose(record_file);
+		record_file = NULL;
+	}
+	if (replay_data) {
+		const double cpu_ms = (double)(clock() - replay_start) * 1000.0 / CLOCKS_PER_SEC;
+		print_stats("Replayed");
+		DEBUG_WARN("%.3fms of host CPU time, %" PRIu32 " exchanges differed from the trace\n", cpu_ms,
+			replay_mismatches);
+		free(replay_data);
+		replay_data = NULL;
+	}
+}
@@ -0,0 +1,60 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PLATFORMS_HOSTED_WIRE_TRACE_H
+#define PLATFORMS_HOSTED_WIRE_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bmp_hosted.h"
+
+/* Where in the stack an exchange with the probe was captured */
+typedef enum wire_trace_channel {
+	WIRE_TRACE_REMOTE, /* platform_buffer_write()/platform_buffer_read() */
+	WIRE_TRACE_DAP,    /* dbg_dap_cmd_send()/dbg_dap_cmd_recv() */
+	WIRE_TRACE_USB,    /* send_recv() */
+	WIRE_TRACE_CHANNELS,
+} wire_trace_channel_e;
+
+/*
+ * Record every request to and response from the probe described by info into
+ * a compact binary trace at path, each with the time since the one before.
+ */
+bool wire_trace_record_open(const char *path, const bmp_info_t *info);
+/*
+ * Load a trace for the remote protocol exchanges in it to be answered from,
+ * in order, instead of a probe. info is filled in from the recorded probe.
+ */
+bool wire_trace_replay_open(const char *path, bmp_info_t *info);
+/* Print the round trip counts and times, and close the trace */
+void wire_trace_close(void);
+
+bool wire_trace_recording(void);
+bool wire_trace_replaying(void);
+
+void wire_trace_request(wire_trace_channel_e channel, const void *data, size_t length);
+/* result is what the transport returned, data holds the length bytes it delivered */
+void wire_trace_response(wire_trace_channel_e channel, const void *data, size_t length, int result);
+
+/* Check a request against the trace, counting it if it differs from the recorded one */
+void wire_trace_replay_request(wire_trace_channel_e channel, const void *data, size_t length);
+/* Deliver the next recorded response into data and return its recorded result */
+int wire_trace_replay_response(wire_trace_channel_e channel, void *data, size_t maxlength);
+
+#endif /* PLATFORMS_HOSTED_WIRE_TRACE_H */
@@ -48,6 +48,11 @@ uint32_t platform_time_ms(void)
 	return time_ms;
 }
 
+uint32_t platform_time_us(void)
+{
+	return time_ms * 1000U;
+}
+
 void platform_init(void)
 {
 	for (int i = 0; i < 1000000; ++i)
@@ -35,6 +35,7 @@
 #include <libopencm3/stm32/usart.h>
 #include <libopencm3/usb/usbd.h>
 #include <libopencm3/stm32/adc.h>
+#include <libopencm3/stm32/dma.h>
 #include <libopencm3/stm32/flash.h>
 
 static void adc_init(void);
@@ -262,18 +263,62 @@ void platform_target_set_power(const bool power)
 	}
 }
 
+/* VREF is on PB0, ADC channel 8, through a divider by 2 */
+#define ADC_VREF_CHANNEL 8U
+/* 16 samples of 252 ADC clocks at 9MHz, the last 450us or so */
+#define ADC_RING_SIZE 16U
+
+static volatile uint16_t adc_ring[ADC_RING_SIZE];
+static volatile bool adc_sagged;
+
+/* 0-4095 to volts scaled by 10 and back */
+static uint32_t adc_to_voltage(const uint32_t value)
+{
+	return (value * 99U) / 8191U;
+}
+
+static uint32_t adc_from_voltage(const uint32_t voltage)
+{
+	return MIN((voltage * 8191U) / 99U, 4095U);
+}
+
 static void adc_init(void)
 {
 	rcc_periph_clock_enable(RCC_ADC1);
+	rcc_periph_clock_enable(ADC_DMA_CLK);
 
 	gpio_set_mode(GPIOB, GPIO_MODE_INPUT, GPIO_CNF_INPUT_ANALOG, GPIO0);
 
+	/* Each conversion lands in the next slot of the ring, round and round */
+	dma_channel_reset(ADC_DMA_BUS, ADC_DMA_CHAN);
+	dma_set_peripheral_address(ADC_DMA_BUS, ADC_DMA_CHAN, (uint32_t)&ADC_DR(ADC1));
+	dma_set_memory_address(ADC_DMA_BUS, ADC_DMA_CHAN, (uint32_t)adc_ring);
+	dma_set_number_of_data(ADC_DMA_BUS, ADC_DMA_CHAN, ADC_RING_SIZE);
+	dma_set_read_from_peripheral(ADC_DMA_BUS, ADC_DMA_CHAN);
+	dma_enable_memory_increment_mode(ADC_DMA_BUS, ADC_DMA_CHAN);
+	dma_set_peripheral_size(ADC_DMA_BUS, ADC_DMA_CHAN, DMA_CCR_PSIZE_16BIT);
+	dma_set_memory_size(ADC_DMA_BUS, ADC_DMA_CHAN, DMA_CCR_MSIZE_16BIT);
+	dma_enable_circular_mode(ADC_DMA_BUS, ADC_DMA_CHAN);
+	dma_set_priority(ADC_DMA_BUS, ADC_DMA_CHAN, DMA_CCR_PL_LOW);
+	dma_enable_channel(ADC_DMA_BUS, ADC_DMA_CHAN);
+
 	adc_power_off(ADC1);
 	adc_disable_scan_mode(ADC1);
-	adc_set_single_conversion_mode(ADC1);
+	adc_set_continuous_conversion_mode(ADC1);
 	adc_disable_external_trigger_regular(ADC1);
 	adc_set_right_aligned(ADC1);
 	adc_set_sample_time_on_all_channels(ADC1, ADC_SMPR_SMP_239DOT5CYC);
+	uint8_t channel = ADC_VREF_CHANNEL;
+	adc_set_regular_sequence(ADC1, 1, &channel);
+	adc_enable_dma(ADC1);
+
+	/* The analog watchdog latches VREF sagging, armed by platform_target_voltage_watch() */
+	adc_enable_analog_watchdog_on_selected_channel(ADC1, ADC_VREF_CHANNEL);
+	adc_set_watchdog_high_threshold(ADC1, 4095U);
+	adc_set_watchdog_low_threshold(ADC1, 0U);
+	adc_enable_analog_watchdog_regular(ADC1);
+	nvic_set_priority(ADC_IRQ, IRQ_PRI_ADC);
+	nvic_enable_irq(ADC_IRQ);
 
 	adc_power_on(ADC1);
 
@@ -283,6 +328,55 @@ static void adc_init(void)
 
 	adc_reset_calibration(ADC1);
 	adc_calibrate(ADC1);
+	adc_start_conversion_direct(ADC1);
+}
+
+void ADC_ISR(void)
+{
+	if (adc_get_flag(ADC1, ADC_SR_AWD)) {
+		/* Below the threshold it would fire on every conversion, once is enough */
+		adc_disable_awd_interrupt(ADC1);
+		adc_clear_flag(ADC1, ADC_SR_AWD);
+		adc_sagged = true;
+	}
+}
+
+void platform_target_voltage_window(platform_voltage_window_s *const window)
+{
+	if (platform_hwversion() == 0) {
+		memset(window, 0, sizeof(*window));
+		return;
+	}
+	/* The slot before the one the DMA fills next holds the latest conversion */
+	const size_t next = ADC_RING_SIZE - dma_get_number_of_data(ADC_DMA_BUS, ADC_DMA_CHAN);
+	const uint32_t last = adc_ring[(next + ADC_RING_SIZE - 1U) % ADC_RING_SIZE];
+	uint32_t min = last;
+	uint32_t max = last;
+	for (size_t i = 0; i < ADC_RING_SIZE; ++i) {
+		min = MIN(min, adc_ring[i]);
+		max = MAX(max, adc_ring[i]);
+	}
+	window->last = adc_to_voltage(last);
+	window->min = adc_to_voltage(min);
+	window->max = adc_to_voltage(max);
+}
+
+void platform_target_voltage_watch(const uint32_t threshold)
+{
+	if (platform_hwversion() == 0)
+		return;
+	adc_disable_awd_interrupt(ADC1);
+	adc_sagged = false;
+	if (!threshold)
+		return;
+	adc_set_watchdog_low_threshold(ADC1, adc_from_voltage(threshold));
+	adc_clear_flag(ADC1, ADC_SR_AWD);
+	adc_enable_awd_interrupt(ADC1);
+}
+
+bool platform_target_voltage_sagged(void)
+{
+	return adc_sagged;
 }
 
 uint32_t platform_target_voltage_sense(void)
@@ -292,21 +386,9 @@ uint32_t platform_target_voltage_sense(void)
 	 * this function is only needed for implementations that allow the
 	 * target to be powered from the debug probe
 	 */
-	if (platform_hwversion() == 0)
-		return 0;
-
-	const uint8_t channel = 8;
-	adc_set_regular_sequence(ADC1, 1, (uint8_t*)&channel);
-
-	adc_start_conversion_direct(ADC1);
-
-	/* Wait for end of conversion. */
-	while (!adc_eoc(ADC1));
-
-	uint32_t val = adc_read_regular(ADC1); /* 0-4095 */
-	/* Clear EOC bit. The GD32F103 does not automatically reset it on ADC read. */
-	ADC_SR(ADC1) &= ~ADC_SR_EOC;
-	return (val * 99) / 8191;
+	platform_voltage_window_s window;
+	platform_target_voltage_window(&window);
+	return window.last;
 }
 
 const char *platform_target_voltage(void)
@@ -332,6 +414,36 @@ void platform_request_boot(void)
 	gpio_clear(GPIOB, GPIO12);
 }
 
+#define SETTINGS_PAGE 0x0801fc00U
+#define SETTINGS_SIZE 1024U
+
+bool platform_settings_read(void *const data, const size_t len)
+{
+	if (len > SETTINGS_SIZE)
+		return false;
+	memcpy(data, (const void *)SETTINGS_PAGE, len);
+	/* An erased page reads back as all ones */
+	const uint8_t *const bytes = (const uint8_t *)data;
+	for (size_t i = 0; i < len; ++i) {
+		if (bytes[i] != 0xffU)
+			return true;
+	}
+	return false;
+}
+
+bool platform_settings_write(const void *const data, const size_t len)
+{
+	if (len > SETTINGS_SIZE || (len & 1U))
+		return false;
+	const uint16_t *const halfwords = (const uint16_t *)data;
+	flash_unlock();
+	flash_erase_page(SETTINGS_PAGE);
+	for (size_t i = 0; i < len / 2U; ++i)
+		flash_program_half_word(SETTINGS_PAGE + i * 2U, halfwords[i]);
+	flash_lock();
+	return !memcmp((const void *)SETTINGS_PAGE, data, len);
+}
+
 void platform_target_clk_output_enable(bool enable)
 {
 	if (platform_hwversion() >= 6) {
@@ -31,7 +31,12 @@
 
 #define PLATFORM_HAS_TRACESWO
 #define PLATFORM_HAS_POWER_SWITCH
+#define PLATFORM_HAS_VOLTAGE_MONITOR
 #define PLATFORM_HAS_USBUART
+/* SWDIO and SWCLK share a port, clock SWD bits with combined BSRR writes */
+#define PLATFORM_HAS_FAST_SWD
+/* The last 1kiB page of flash holds settings, see platform_settings_write() */
+#define PLATFORM_HAS_SETTINGS
 
 #ifdef ENABLE_DEBUG
 #define PLATFORM_HAS_DEBUG
@@ -188,6 +193,16 @@ extern bool debug_bmp;
 #define AUX_BTN2       GPIO9
 #define AUX_VBAT       GPIO0
 
+/* From hardware 6 on, TCK, TDO and TDI sit on SPI1 SCK, MISO and MOSI */
+#define PLATFORM_HAS_JTAG_SPI
+#define JTAG_SPI             SPI1
+#define JTAG_SPI_RCC         RCC_SPI1
+#define JTAG_SPI_AVAILABLE() (platform_hwversion() >= 6)
+#define JTAG_SPI_PINS_SPI() \
+	gpio_set_mode(JTAG_PORT, GPIO_MODE_OUTPUT_50_MHZ, GPIO_CNF_OUTPUT_ALTFN_PUSHPULL, TCK_PIN | TDI_PIN)
+#define JTAG_SPI_PINS_GPIO() \
+	gpio_set_mode(JTAG_PORT, GPIO_MODE_OUTPUT_50_MHZ, GPIO_CNF_OUTPUT_PUSHPULL, TCK_PIN | TDI_PIN)
+
 #define SWD_CR       GPIO_CRL(SWDIO_PORT)
 #define SWD_CR_SHIFT (4U << 2U)
 
@@ -226,13 +241,14 @@ extern bool debug_bmp;
 #define USB_IRQ    NVIC_USB_LP_CAN_RX0_IRQ
 #define USB_ISR(x) usb_lp_can_rx0_isr(x)
 /* Interrupt priorities.  Low numbers are high priority.
- * TIM3 is used for traceswo capture and must be highest priority.
+ * TIM3 captures traceswo into a DMA ring, so decoding it can wait for USB.
  */
 #define IRQ_PRI_USB             (1 << 4)
 #define IRQ_PRI_USBUSART        (2 << 4)
 #define IRQ_PRI_USBUSART_DMA 	(2 << 4)
 #define IRQ_PRI_USB_VBUS        (14 << 4)
-#define IRQ_PRI_TRACE           (0 << 4)
+#define IRQ_PRI_TRACE           (3 << 4)
+#define IRQ_PRI_ADC             (4 << 4)
 
 #define USBUSART HW_SWITCH(6, USBUSART1, USBUSART2)
 #define USBUSART_IRQ HW_SWITCH(6, NVIC_USART1_IRQ, NVIC_USART2_IRQ)
@@ -272,6 +288,19 @@ extern bool debug_bmp;
 #define TRACE_TIM_CLK_EN() rcc_periph_clock_enable(RCC_TIM3)
 #define TRACE_IRQ   NVIC_TIM3_IRQ
 #define TRACE_ISR(x)  tim3_isr(x)
+/* TIM3_UP, the update event of each capture reset */
+#define TRACE_DMA_BUS DMA1
+#define TRACE_DMA_CLK RCC_DMA1
+#define TRACE_DMA_CHAN DMA_CHANNEL3
+#define TRACE_DMA_IRQ NVIC_DMA1_CHANNEL3_IRQ
+#define TRACE_DMA_ISR(x) dma1_channel3_isr(x)
+
+/* ADC1 converts VREF continuously into a DMA ring, its request is fixed to channel 1 */
+#define ADC_DMA_BUS DMA1
+#define ADC_DMA_CLK RCC_DMA1
+#define ADC_DMA_CHAN DMA_CHANNEL1
+#define ADC_IRQ NVIC_ADC1_2_IRQ
+#define ADC_ISR(x) adc1_2_isr(x)
 
 #define SET_RUN_STATE(state)	{running_status = (state);}
 #define SET_IDLE_STATE(state)	{gpio_set_val(LED_PORT, LED_IDLE_RUN, state);}
@@ -151,6 +151,9 @@ extern bool debug_bmp;
 #define SWO_UART_CLK			RCC_USART1
 #define SWO_UART_PORT			GPIOA
 #define SWO_UART_RX_PIN			GPIO10
+#define SWO_UART_IRQ			NVIC_USART1_IRQ
+#define SWO_UART_ISR(x)			usart1_isr(x)
+#define SWO_UART_PCLK			rcc_apb2_frequency
 
 /* This DMA channel is set by the USART in use */
 #define SWO_DMA_BUS				DMA1
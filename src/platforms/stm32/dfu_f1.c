@@ -44,8 +44,25 @@ void dfu_check_and_do_sector_erase(uint32_t sector)
 	}
 }
 
+/* Erase and half word programming times, typical from the datasheets */
+#define FLASH_ERASE_TIME_MS 20U
+#define FLASH_PROGRAM_TIME_NS 53000U
+
+/*
+ * A block starting a page that isn't blank yet erases it first, saving the
+ * host an erase request and its status polls for every page. Pages the host
+ * already erased, or that are still blank, are left alone.
+ */
+static bool page_needs_erase(uint32_t addr)
+{
+	return !(addr & (FLASHBLOCKSIZE - 1)) && addr != last_erased_page &&
+		!dfu_flash_blank(addr, FLASHBLOCKSIZE);
+}
+
 void dfu_flash_program_buffer(uint32_t baseaddr, void *buf, int len)
 {
+	if (page_needs_erase(baseaddr))
+		dfu_check_and_do_sector_erase(baseaddr);
 	for(int i = 0; i < len; i += 2)
 		flash_program_half_word(baseaddr + i,
 				*(uint16_t*)(buf+i));
@@ -54,12 +71,18 @@ void dfu_flash_program_buffer(uint32_t baseaddr, void *buf, int len)
 	dfu_event();
 }
 
-uint32_t dfu_poll_timeout(uint8_t cmd, uint32_t addr, uint16_t blocknum)
+uint32_t dfu_poll_timeout(uint8_t cmd, uint32_t addr, uint16_t blocknum, uint16_t len)
 {
-	(void)cmd;
-	(void)addr;
-	(void)blocknum;
-	return 100;
+	/*
+	 * A host that asks again too early is only answered once the flash is done,
+	 * so the typical times serve better than the worst case it would sleep for.
+	 */
+	if (blocknum == 0)
+		return cmd == CMD_ERASE ? FLASH_ERASE_TIME_MS : 0;
+	uint32_t timeout = ((len / 2U) * FLASH_PROGRAM_TIME_NS + 999999U) / 1000000U;
+	if (page_needs_erase(addr))
+		timeout += FLASH_ERASE_TIME_MS;
+	return timeout;
 }
 
 void dfu_protect(bool enable)
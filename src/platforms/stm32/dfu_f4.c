@@ -57,13 +57,29 @@ void dfu_check_and_do_sector_erase(uint32_t addr)
 	}
 }
 
+/* Word programming time, typical from the datasheet */
+#define FLASH_PROGRAM_TIME_NS 16000U
+
+/*
+ * A block starting a sector that isn't blank yet erases it first, saving the
+ * host an erase request and its status polls for every sector.
+ */
+static bool sector_needs_erase(uint32_t addr)
+{
+	get_sector_num(addr);
+	return sector_num < ARRAY_LENGTH(sector_erase_time) && addr == sector_addr[sector_num] &&
+		!dfu_flash_blank(addr, sector_addr[sector_num + 1] - addr);
+}
+
 void dfu_flash_program_buffer(uint32_t baseaddr, void *buf, int len)
 {
+	if (sector_needs_erase(baseaddr))
+		dfu_check_and_do_sector_erase(baseaddr);
 	for(int i = 0; i < len; i += 4)
 		flash_program_word(baseaddr + i, *(uint32_t*)(buf+i));
 }
 
-uint32_t dfu_poll_timeout(uint8_t cmd, uint32_t addr, uint16_t blocknum)
+uint32_t dfu_poll_timeout(uint8_t cmd, uint32_t addr, uint16_t blocknum, uint16_t len)
 {
 	/* Erase for big pages on STM2/4 needs "long" time
 	   Try not to hit USB timeouts*/
@@ -72,9 +88,14 @@ uint32_t dfu_poll_timeout(uint8_t cmd, uint32_t addr, uint16_t blocknum)
 		if(addr == sector_addr[sector_num])
 			return sector_erase_time[sector_num];
 	}
+	if (blocknum == 0)
+		return 0;
 
-	/* Programming 256 word with 100 us(max) per word*/
-	return 26;
+	/* A host asking again too early is only answered once programming is done */
+	uint32_t timeout = ((len / 4U) * FLASH_PROGRAM_TIME_NS + 999999U) / 1000000U;
+	if (sector_needs_erase(addr))
+		timeout += sector_erase_time[sector_num];
+	return timeout;
 }
 
 void dfu_protect(bool enable)
@@ -24,19 +24,27 @@
 
 #include <libopencm3/stm32/desig.h>
 
+/*
+ * Each download block is programmed in one go, so the larger the blocks the fewer
+ * the requests and status polls. On F1 a block is a page, on F4 and F7 a quarter of
+ * the smallest sector, as much as the control buffer and prog.buf can take in RAM.
+ */
 #if defined(STM32F1HD)
 #	define DFU_IFACE_STRING  "@Internal Flash   /0x08000000/4*002Ka,000*002Kg"
 #   define DFU_IFACE_STRING_OFFSET 38
 #   define DFU_IFACE_PAGESIZE 2
+#   define DFU_TRANSFER_SIZE 2048U
 #elif defined(STM32F1)
 #	define DFU_IFACE_STRING  "@Internal Flash   /0x08000000/8*001Ka,000*001Kg"
 #   define DFU_IFACE_STRING_OFFSET 38
 #   define DFU_IFACE_PAGESIZE 1
+#   define DFU_TRANSFER_SIZE 1024U
 #elif defined(STM32F4) ||  defined(STM32F7)
 #   define FLASH_BASE         0x08000000U
 #   define DFU_IFACE_PAGESIZE 128
 #   define DFU_IFACE_STRING_OFFSET 54
 #	define DFU_IFACE_STRING  "@Internal Flash   /0x08000000/1*016Ka,3*016Kg,1*064Kg,000*128Kg"
+#   define DFU_TRANSFER_SIZE 4096U
 #endif
 #include <libopencm3/stm32/flash.h>
 
@@ -47,7 +55,7 @@
 
 usbd_device *usbdev;
 /* We need a special large control buffer for this device: */
-uint8_t usbd_control_buffer[1024];
+uint8_t usbd_control_buffer[DFU_TRANSFER_SIZE];
 
 static uint32_t max_address;
 
@@ -85,7 +93,7 @@ const struct usb_dfu_descriptor dfu_function = {
 	.bDescriptorType = DFU_FUNCTIONAL,
 	.bmAttributes = USB_DFU_CAN_DOWNLOAD | USB_DFU_CAN_UPLOAD | USB_DFU_WILL_DETACH,
 	.wDetachTimeout = 255,
-	.wTransferSize = 1024,
+	.wTransferSize = DFU_TRANSFER_SIZE,
 	.bcdDFUVersion = 0x011A,
 };
 
@@ -142,14 +150,32 @@ static uint32_t get_le32(const void *vp)
 	return ((uint32_t)p[3] << 24) + ((uint32_t)p[2] << 16) + (p[1] << 8) + p[0];
 }
 
+bool dfu_flash_blank(uint32_t addr, uint32_t len)
+{
+	for (uint32_t i = 0; i < len; i += 4) {
+		if (*(volatile uint32_t *)(addr + i) != 0xffffffffU)
+			return false;
+	}
+	return true;
+}
+
+/* Flash address of the data block being downloaded or uploaded, blocks count from 2 */
+static uint32_t prog_block_address(void)
+{
+	return prog.addr + ((prog.blocknum - 2) * dfu_function.wTransferSize);
+}
+
 static uint8_t usbdfu_getstatus(uint32_t *bwPollTimeout)
 {
 	switch(usbdfu_state) {
 	case STATE_DFU_DNLOAD_SYNC:
 		usbdfu_state = STATE_DFU_DNBUSY;
-		*bwPollTimeout = dfu_poll_timeout(prog.buf[0],
-					get_le32(prog.buf + 1),
-					prog.blocknum);
+		if (prog.blocknum == 0)
+			*bwPollTimeout = dfu_poll_timeout(prog.buf[0],
+						get_le32(prog.buf + 1), 0, 0);
+		else
+			*bwPollTimeout = dfu_poll_timeout(0, prog_block_address(),
+						prog.blocknum, prog.len);
 		return DFU_STATUS_OK;
 
 	case STATE_DFU_MANIFEST_SYNC:
@@ -185,10 +211,14 @@ usbdfu_getstatus_complete(usbd_device *dev, struct usb_setup_data *req)
 				dfu_check_and_do_sector_erase(addr);
 			}
 		} else {
-			uint32_t baseaddr = prog.addr +
-				((prog.blocknum - 2) *
-					dfu_function.wTransferSize);
-			dfu_flash_program_buffer(baseaddr, prog.buf, prog.len);
+			/* Programming may erase the page it starts, so it must stay clear of the bootloader too */
+			const uint32_t addr = prog_block_address();
+			if ((addr < app_address) || (addr + prog.len > max_address)) {
+				usbdfu_state = STATE_DFU_ERROR;
+				flash_lock();
+				return;
+			}
+			dfu_flash_program_buffer(addr, prog.buf, prog.len);
 		}
 		flash_lock();
 
@@ -252,12 +282,8 @@ static enum usbd_request_return_codes usbdfu_control_request(usbd_device *dev,
 			(usbdfu_state == STATE_DFU_UPLOAD_IDLE)) {
 			prog.blocknum = req->wValue;
 			usbdfu_state = STATE_DFU_UPLOAD_IDLE;
-			if(prog.blocknum > 1) {
-				uint32_t baseaddr = prog.addr +
-					((prog.blocknum - 2) *
-					 dfu_function.wTransferSize);
-				memcpy(*buf, (void*)baseaddr, *len);
-			}
+			if(prog.blocknum > 1)
+				memcpy(*buf, (void*)prog_block_address(), *len);
 			return USBD_REQ_HANDLED;
 		} else {
 			usbd_ep_stall_set(dev, 0, 1);
@@ -24,47 +24,112 @@
  */
 
 #include <libopencmsis/core_cm3.h>
+#include <libopencm3/cm3/nvic.h>
 
 #include "general.h"
 #include "usb_serial.h"
 #include "gdb_if.h"
+#include "scheduler.h"
 
 static uint32_t count_out;
-static uint32_t count_in;
 static uint32_t out_ptr;
 static uint8_t buffer_out[CDCACM_PACKET_SIZE];
-static uint8_t buffer_in[CDCACM_PACKET_SIZE];
 #ifdef STM32F4
 static volatile uint32_t count_new;
 static uint8_t double_buffer_out[CDCACM_PACKET_SIZE];
 #endif
 
+/*
+ * Packets to the host queue up in a ring of endpoint sized slots. gdb_if_putchar()
+ * fills the slot at tx_head, and the IN endpoint's completion callback hands the
+ * one at tx_tail over as soon as the previous packet is gone, so a long reply
+ * goes out at the USB frame rate while the next part of it is being written.
+ */
+#define GDB_TX_SLOTS 8U
+
+static uint8_t tx_buffer[GDB_TX_SLOTS][CDCACM_PACKET_SIZE];
+static uint16_t tx_length[GDB_TX_SLOTS];
+/* The slot ends a flushed reply, so if it is a full packet a ZLP has to follow it */
+static bool tx_end[GDB_TX_SLOTS];
+static volatile uint32_t tx_head;
+static volatile uint32_t tx_tail;
+static uint32_t tx_fill;
+static volatile bool tx_busy;
+static volatile bool tx_zlp;
+
+/* Hand the endpoint its next packet, called in the USB IRQ or with it masked */
+static void gdb_if_tx_next(usbd_device *dev)
+{
+	if (tx_zlp) {
+		tx_zlp = false;
+		usbd_ep_write_packet(dev, CDCACM_GDB_ENDPOINT | USB_REQ_TYPE_IN, NULL, 0);
+		tx_busy = true;
+		return;
+	}
+	const uint32_t slot = tx_tail % GDB_TX_SLOTS;
+	/* Nothing queued, or the endpoint is still busy and this is tried again on the next kick */
+	if (tx_tail == tx_head ||
+		!usbd_ep_write_packet(dev, CDCACM_GDB_ENDPOINT | USB_REQ_TYPE_IN, tx_buffer[slot], tx_length[slot])) {
+		tx_busy = false;
+		return;
+	}
+	tx_zlp = tx_end[slot] && tx_length[slot] == CDCACM_PACKET_SIZE;
+	++tx_tail;
+	tx_busy = true;
+}
+
+void gdb_usb_in_cb(usbd_device *dev, uint8_t ep)
+{
+	(void)ep;
+	gdb_if_tx_next(dev);
+}
+
+/* Start sending if the endpoint is idle */
+static void gdb_if_tx_kick(void)
+{
+	nvic_disable_irq(USB_IRQ);
+	if (!tx_busy)
+		gdb_if_tx_next(usbdev);
+	nvic_enable_irq(USB_IRQ);
+}
+
+void gdb_if_tx_reset(void)
+{
+	nvic_disable_irq(USB_IRQ);
+	tx_head = 0;
+	tx_tail = 0;
+	tx_fill = 0;
+	tx_busy = false;
+	tx_zlp = false;
+	nvic_enable_irq(USB_IRQ);
+}
+
 void gdb_if_putchar(unsigned char c, int flush)
 {
-	buffer_in[count_in++] = c;
-	if (flush || (count_in == CDCACM_PACKET_SIZE)) {
-		/* Refuse to send if USB isn't configured, and
-		 * don't bother if nobody's listening */
+	/* Wait for the USB IRQ to free a slot when the ring is full */
+	while (tx_head - tx_tail == GDB_TX_SLOTS) {
 		if (usb_get_config() != 1 || !gdb_serial_get_dtr()) {
-			count_in = 0;
+			gdb_if_tx_reset();
 			return;
 		}
-		while (usbd_ep_write_packet(usbdev, CDCACM_GDB_ENDPOINT, buffer_in, count_in) <= 0)
-			continue;
-
-		if (flush && (count_in == CDCACM_PACKET_SIZE)) {
-			/* We need to send an empty packet for some hosts
-			 * to accept this as a complete transfer. */
-			/* libopencm3 needs a change for us to confirm when
-			 * that transfer is complete, so we just send a packet
-			 * containing a null byte for now.
-			 */
-			while (usbd_ep_write_packet(usbdev, CDCACM_GDB_ENDPOINT, "\0", 1) <= 0)
-				continue;
-		}
+		gdb_if_tx_kick();
+	}
 
-		count_in = 0;
+	const uint32_t slot = tx_head % GDB_TX_SLOTS;
+	tx_buffer[slot][tx_fill++] = c;
+	if (!flush && tx_fill < CDCACM_PACKET_SIZE)
+		return;
+	/* Refuse to send if USB isn't configured, and
+	 * don't bother if nobody's listening */
+	if (usb_get_config() != 1 || !gdb_serial_get_dtr()) {
+		gdb_if_tx_reset();
+		return;
 	}
+	tx_length[slot] = tx_fill;
+	tx_end[slot] = flush;
+	tx_fill = 0;
+	++tx_head;
+	gdb_if_tx_kick();
 }
 
 #ifdef STM32F4
@@ -98,7 +163,8 @@ static void gdb_if_update_buf(void)
 	                                buffer_out, CDCACM_PACKET_SIZE);
 	out_ptr = 0;
 #endif
-	if (!count_out)
+	/* Nothing from GDB, give the background tasks their turn and only sleep if none is due soon */
+	if (!count_out && scheduler_yield())
 		__WFI();
 }
 
@@ -118,6 +184,26 @@ unsigned char gdb_if_getchar(void)
 	return buffer_out[out_ptr++];
 }
 
+size_t gdb_if_read(void *const buf, const size_t max)
+{
+	while (!(out_ptr < count_out)) {
+		/* Detach if port closed */
+		if (!gdb_serial_get_dtr()) {
+			__WFI();
+			*(uint8_t *)buf = 0x04;
+			return 1;
+		}
+
+		gdb_if_update_buf();
+	}
+
+	/* Hand over the rest of the current USB packet in one go */
+	const size_t count = MIN(count_out - out_ptr, max);
+	memcpy(buf, buffer_out + out_ptr, count);
+	out_ptr += count;
+	return count;
+}
+
 unsigned char gdb_if_getchar_to(int timeout)
 {
 	platform_timeout t;
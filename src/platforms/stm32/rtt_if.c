@@ -75,6 +75,7 @@ void debug_serial_receive_callback(usbd_device *dev, uint8_t ep)
 
 	/* skip flag: drop packet if not enough free buffer space */
 	if (rtt_flag_skip && len > recv_bytes_free()) {
+		rtt_host_overflow(RTT_DOWN_ANY);
 		usbd_ep_nak_set(usbdev, CDCACM_UART_ENDPOINT, 0);
 		return;
 	}
@@ -82,8 +83,10 @@ void debug_serial_receive_callback(usbd_device *dev, uint8_t ep)
 	/* copy data to recv_buf */
 	for (int i = 0; i < len; i++) {
 		uint32_t next_recv_head = (recv_head + 1) % sizeof(recv_buf);
-		if (next_recv_head == recv_tail)
+		if (next_recv_head == recv_tail) {
+			rtt_host_overflow(RTT_DOWN_ANY);
 			break; /* overflow */
+		}
 		recv_buf[recv_head] = usb_buf[i];
 		recv_head = next_recv_head;
 	}
@@ -96,8 +99,9 @@ void debug_serial_receive_callback(usbd_device *dev, uint8_t ep)
 }
 
 /* rtt host to target: read one character */
-int32_t rtt_getchar()
+int32_t rtt_getchar(uint32_t channel)
 {
+	(void)channel;
 	int retval;
 
 	if (recv_head == recv_tail)
@@ -113,14 +117,23 @@ int32_t rtt_getchar()
 }
 
 /* rtt host to target: true if no characters available for reading */
-bool rtt_nodata()
+bool rtt_nodata(uint32_t channel)
 {
+	(void)channel;
 	return recv_head == recv_tail;
 }
 
+/* rtt target to host: usb writes wait for the host, so nothing is dropped */
+uint32_t rtt_write_space(uint32_t channel)
+{
+	(void)channel;
+	return UINT32_MAX;
+}
+
 /* rtt target to host: write string */
-uint32_t rtt_write(const char *buf, uint32_t len)
+uint32_t rtt_write(uint32_t channel, const char *buf, uint32_t len)
 {
+	(void)channel;
 	if (len != 0 && usbdev && usb_get_config() && gdb_serial_get_dtr()) {
 		for (uint32_t p = 0; p < len; p += CDCACM_PACKET_SIZE) {
 			uint32_t plen = MIN(CDCACM_PACKET_SIZE, len - p);
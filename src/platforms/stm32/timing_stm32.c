@@ -21,7 +21,11 @@
 
 #include <libopencm3/cm3/systick.h>
 #include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/scb.h>
 #include <libopencm3/stm32/rcc.h>
+#if defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__)
+#include <libopencm3/cm3/dwt.h>
+#endif
 
 uint8_t running_status;
 static volatile uint32_t time_ms;
@@ -67,6 +71,60 @@ uint32_t platform_time_ms(void)
 	return time_ms;
 }
 
+#if defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__)
+/*
+ * The DWT cycle counter wraps long before a 32 bit microsecond count would,
+ * so elapsed cycles are folded into the count on each call. Callers poll often
+ * enough for the counter not to wrap twice in between.
+ */
+uint32_t platform_time_us(void)
+{
+	static bool counter_running = false;
+	static uint32_t last_cycles;
+	static uint32_t cycles_left;
+	static uint32_t time_us;
+	if (!counter_running) {
+		counter_running = dwt_enable_cycle_counter();
+		if (!counter_running)
+			return time_ms * 1000U;
+		last_cycles = dwt_read_cycle_counter();
+		time_us = time_ms * 1000U;
+	}
+	const uint32_t cycles_per_us = rcc_ahb_frequency / 1000000U;
+	const uint32_t cycles = dwt_read_cycle_counter();
+	cycles_left += cycles - last_cycles;
+	last_cycles = cycles;
+	time_us += cycles_left / cycles_per_us;
+	cycles_left %= cycles_per_us;
+	return time_us;
+}
+#else
+/*
+ * No cycle counter on ARMv6-M, so interpolate within the current tick from how far SysTick has
+ * counted down. A reload the handler hasn't accounted for yet, as when called from an interrupt
+ * outranking it, shows as SysTick pending and counts as one more tick.
+ */
+uint32_t platform_time_us(void)
+{
+	const uint32_t reload = systick_get_reload() + 1U;
+	uint32_t base;
+	uint32_t ms;
+	uint32_t count;
+	/* Retry if the handler ran while we looked */
+	do {
+		base = time_ms;
+		ms = base;
+		count = systick_get_value();
+		if (SCB_ICSR & SCB_ICSR_PENDSTSET) {
+			ms += SYSTICKMS;
+			count = systick_get_value();
+		}
+	} while (base != time_ms);
+	const uint32_t elapsed = reload - 1U - count;
+	return (ms * 1000U) + ((elapsed * SYSTICKMS * 1000U) / reload);
+}
+#endif
+
 /* Assume some USED_SWD_CYCLES per clock
  * and  CYCLES_PER_CNT Cycles per delay loop cnt with 2 delay loops per clock
  */
@@ -30,6 +30,12 @@
  * The idea is to use TIM3 input capture modes to capture pulse timings.
  * These can be capture directly to RAM by DMA.
  * The core can then process the buffer to extract the frame.
+ *
+ * Platforms that define TRACE_DMA_BUS do just that: each rising edge resets the
+ * counter, and the update event that comes with it has the DMA burst read the
+ * cycle and high time into a ring. That is decoded in batches from the DMA half
+ * and full transfer interrupts, and when the line has been idle for a while.
+ * Elsewhere the capture interrupt decodes edge by edge.
  */
 #include "general.h"
 #include "usb.h"
@@ -38,6 +44,16 @@
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/stm32/timer.h>
 #include <libopencm3/stm32/rcc.h>
+#ifdef TRACE_DMA_BUS
+#include <libopencm3/stm32/dma.h>
+
+/* Captured cycle and high time pairs, a power of two of them */
+#define TRACE_DMA_PAIRS 256U
+static uint16_t trace_dma_buf[TRACE_DMA_PAIRS * 2U];
+static uint32_t trace_dma_read;
+/* Counter ticks without a rising edge that end a frame, well short of the counter overflowing */
+#define TRACE_IDLE_TICKS 0x8000U
+#endif
 
 /* SWO decoding */
 static bool decoding = false;
@@ -66,10 +82,39 @@ void traceswo_init(uint32_t swo_chan_bitmask)
 	/* Slave reset mode: reset counter on trigger */
 	timer_slave_set_mode(TRACE_TIM, TIM_SMCR_SMS_RM);
 
+#ifdef TRACE_DMA_BUS
+	/* The update event of each reset has the DMA burst read CCR1 and CCR2,
+	 * DBA is the word offset of CCR1 and DBL one less than the transfer count */
+	TIM_DCR(TRACE_TIM) = (1U << 8U) | ((uint32_t)(&TIM_CCR1(TRACE_TIM) - &TIM_CR1(TRACE_TIM)));
+	rcc_periph_clock_enable(TRACE_DMA_CLK);
+	dma_channel_reset(TRACE_DMA_BUS, TRACE_DMA_CHAN);
+	dma_set_peripheral_address(TRACE_DMA_BUS, TRACE_DMA_CHAN, (uint32_t)&TIM_DMAR(TRACE_TIM));
+	dma_set_read_from_peripheral(TRACE_DMA_BUS, TRACE_DMA_CHAN);
+	dma_enable_memory_increment_mode(TRACE_DMA_BUS, TRACE_DMA_CHAN);
+	dma_set_peripheral_size(TRACE_DMA_BUS, TRACE_DMA_CHAN, DMA_CCR_PSIZE_16BIT);
+	dma_set_memory_size(TRACE_DMA_BUS, TRACE_DMA_CHAN, DMA_CCR_MSIZE_16BIT);
+	dma_set_priority(TRACE_DMA_BUS, TRACE_DMA_CHAN, DMA_CCR_PL_VERY_HIGH);
+	dma_enable_circular_mode(TRACE_DMA_BUS, TRACE_DMA_CHAN);
+	dma_enable_half_transfer_interrupt(TRACE_DMA_BUS, TRACE_DMA_CHAN);
+	dma_enable_transfer_complete_interrupt(TRACE_DMA_BUS, TRACE_DMA_CHAN);
+	dma_set_memory_address(TRACE_DMA_BUS, TRACE_DMA_CHAN, (uint32_t)trace_dma_buf);
+	dma_set_number_of_data(TRACE_DMA_BUS, TRACE_DMA_CHAN, TRACE_DMA_PAIRS * 2U);
+	trace_dma_read = 0;
+	dma_enable_channel(TRACE_DMA_BUS, TRACE_DMA_CHAN);
+	nvic_set_priority(TRACE_DMA_IRQ, IRQ_PRI_TRACE);
+	nvic_enable_irq(TRACE_DMA_IRQ);
+
+	/* Compare on CH3 tells a frame has ended */
+	timer_set_oc_value(TRACE_TIM, TIM_OC3, TRACE_IDLE_TICKS);
+	nvic_set_priority(TRACE_IRQ, IRQ_PRI_TRACE);
+	nvic_enable_irq(TRACE_IRQ);
+	timer_enable_irq(TRACE_TIM, TIM_DIER_UDE | TIM_DIER_CC3IE);
+#else
 	/* Enable capture interrupt */
 	nvic_set_priority(TRACE_IRQ, IRQ_PRI_TRACE);
 	nvic_enable_irq(TRACE_IRQ);
 	timer_enable_irq(TRACE_TIM, TIM_DIER_CC1IE);
+#endif
 
 	/* Enable the capture channels */
 	timer_ic_enable(TRACE_TIM, TIM_IC1);
@@ -81,15 +126,15 @@ void traceswo_init(uint32_t swo_chan_bitmask)
 	decoding = (swo_chan_bitmask != 0);
 }
 
-static uint8_t trace_usb_buf[64];
-static uint8_t trace_usb_buf_size;
+static uint8_t trace_usb_buf[TRACE_ENDPOINT_SIZE];
+static uint16_t trace_usb_buf_size;
 
 void trace_buf_push(uint8_t *buf, int len)
 {
 	if (decoding)
 		traceswo_decode(usbdev, CDCACM_UART_ENDPOINT, buf, len);
 	else if (usbd_ep_write_packet(usbdev, USB_REQ_TYPE_IN | TRACE_ENDPOINT, buf, len) != len) {
-		if (trace_usb_buf_size + len > 64) {
+		if (trace_usb_buf_size + len > TRACE_ENDPOINT_SIZE) {
 			/* Stall if upstream to too slow. */
 			usbd_ep_stall_set(usbdev, USB_REQ_TYPE_IN | TRACE_ENDPOINT, 1);
 			trace_usb_buf_size = 0;
@@ -114,54 +159,61 @@ void trace_buf_drain(usbd_device *dev, uint8_t ep)
 
 #define ALLOWED_DUTY_ERROR 5
 
-void TRACE_ISR(void)
-{
-	uint16_t sr = TIM_SR(TRACE_TIM);
-	uint16_t duty, cycle;
-	static uint16_t bt;
-	static uint8_t lastbit;
-	static uint8_t decbuf[17];
-	static uint8_t decbuf_pos;
-	static uint8_t halfbit;
-	static uint8_t notstart;
-
-	/* Reset decoder state if capture overflowed */
-	if (sr & (TIM_SR_CC1OF | TIM_SR_UIF)) {
-		timer_clear_flag(TRACE_TIM, TIM_SR_CC1OF | TIM_SR_UIF);
-		if (!(sr & (TIM_SR_CC2IF | TIM_SR_CC1IF)))
-			goto flush_and_reset;
-	}
+/* Manchester decoder state */
+static uint16_t bt;
+static uint8_t lastbit;
+static uint8_t decbuf[17];
+static uint8_t decbuf_pos;
+static uint8_t halfbit;
+static uint8_t notstart;
 
-	cycle = TIM_CCR1(TRACE_TIM);
-	duty = TIM_CCR2(TRACE_TIM);
+/* Send what was decoded and start looking for the next frame */
+static void trace_flush_and_reset(void)
+{
+#ifndef TRACE_DMA_BUS
+	timer_set_period(TRACE_TIM, -1);
+	timer_disable_irq(TRACE_TIM, TIM_DIER_UIE);
+#endif
+	if (decbuf_pos >> 3)
+		trace_buf_push(decbuf, decbuf_pos >> 3);
+	bt = 0;
+	decbuf_pos = 0;
+	memset(decbuf, 0, sizeof(decbuf));
+}
 
+/* Decode one captured cycle, complete is false for a last high time with no
+ * rising edge after it. Returns false when the decoder is to be flushed and reset. */
+static bool trace_decode_cycle(const uint16_t cycle, uint16_t duty, const bool complete)
+{
 	/* Reset decoder state if crazy shit happened */
 	if ((bt && (((duty / bt) > 2) || ((duty / bt) == 0))) || (duty == 0))
-		goto flush_and_reset;
+		return false;
 
-	if(!(sr & TIM_SR_CC1IF)) notstart = 1;
+	if (!complete) notstart = 1;
 
 	if (!bt) {
 		if (notstart) {
 			notstart = 0;
-			return;
+			return true;
 		}
 		/* First bit, sync decoder */
 		duty -= ALLOWED_DUTY_ERROR;
 		if (((cycle / duty) != 2) &&
 		    ((cycle / duty) != 3))
-			return;
+			return true;
 		bt = duty;
 		lastbit = 1;
 		halfbit = 0;
+#ifndef TRACE_DMA_BUS
 		timer_set_period(TRACE_TIM, duty * 6);
 		timer_clear_flag(TRACE_TIM, TIM_SR_UIF);
 		timer_enable_irq(TRACE_TIM, TIM_DIER_UIE);
+#endif
 	} else {
 		/* If high time is extended we need to flip the bit */
 		if ((duty / bt) > 1) {
 			if (!halfbit) /* lost sync somehow */
-				goto flush_and_reset;
+				return false;
 			halfbit = 0;
 			lastbit ^= 1;
 		}
@@ -169,27 +221,78 @@ void TRACE_ISR(void)
 		decbuf_pos++;
 	}
 
-	if (!(sr & TIM_SR_CC1IF) || (((cycle - duty) / bt) > 2))
-		goto flush_and_reset;
+	if (!complete || (((cycle - duty) / bt) > 2))
+		return false;
 
 	if (((cycle - duty) / bt) > 1) {
 		/* If low time extended we need to pack another bit. */
 		if (halfbit) /* this is a valid stop-bit or we lost sync */
-			goto flush_and_reset;
+			return false;
 		halfbit = 1;
 		lastbit ^= 1;
 		decbuf[decbuf_pos >> 3] |= lastbit << (decbuf_pos & 7);
 		decbuf_pos++;
 	}
 
-	if (decbuf_pos < 128)
+	return decbuf_pos < 128;
+}
+
+#ifdef TRACE_DMA_BUS
+/* Decode the cycles the DMA has captured since last time */
+static void trace_dma_decode(void)
+{
+	const uint32_t written = TRACE_DMA_PAIRS * 2U - dma_get_number_of_data(TRACE_DMA_BUS, TRACE_DMA_CHAN);
+	const uint32_t pairs = (written / 2U) % TRACE_DMA_PAIRS;
+	while (trace_dma_read != pairs) {
+		const uint16_t *const pair = &trace_dma_buf[trace_dma_read * 2U];
+		trace_dma_read = (trace_dma_read + 1U) % TRACE_DMA_PAIRS;
+		if (!trace_decode_cycle(pair[0], pair[1], true))
+			trace_flush_and_reset();
+	}
+}
+
+void TRACE_DMA_ISR(void)
+{
+	if (DMA_ISR(TRACE_DMA_BUS) & DMA_ISR_HTIF(TRACE_DMA_CHAN))
+		DMA_IFCR(TRACE_DMA_BUS) |= DMA_ISR_HTIF(TRACE_DMA_CHAN);
+	if (DMA_ISR(TRACE_DMA_BUS) & DMA_ISR_TCIF(TRACE_DMA_CHAN))
+		DMA_IFCR(TRACE_DMA_BUS) |= DMA_ISR_TCIF(TRACE_DMA_CHAN);
+	trace_dma_decode();
+}
+
+void TRACE_ISR(void)
+{
+	const uint16_t sr = TIM_SR(TRACE_TIM);
+	if (!(sr & TIM_SR_CC3IF))
 		return;
+	timer_clear_flag(TRACE_TIM, TIM_SR_CC3IF);
+	/* Keep the counter from overflowing while the line is idle, the update event would be captured */
+	timer_set_counter(TRACE_TIM, 0);
 
-flush_and_reset:
-	timer_set_period(TRACE_TIM, -1);
-	timer_disable_irq(TRACE_TIM, TIM_DIER_UIE);
-	trace_buf_push(decbuf, decbuf_pos >> 3);
-	bt = 0;
-	decbuf_pos = 0;
-	memset(decbuf, 0, sizeof(decbuf));
+	trace_dma_decode();
+	/* A falling edge since the last capture is the high time of the last pulse */
+	if (bt && (sr & TIM_SR_CC2IF))
+		trace_decode_cycle(TIM_CCR1(TRACE_TIM), TIM_CCR2(TRACE_TIM), false);
+	if (bt || decbuf_pos)
+		trace_flush_and_reset();
+}
+#else
+void TRACE_ISR(void)
+{
+	uint16_t sr = TIM_SR(TRACE_TIM);
+
+	/* Reset decoder state if capture overflowed */
+	if (sr & (TIM_SR_CC1OF | TIM_SR_UIF)) {
+		timer_clear_flag(TRACE_TIM, TIM_SR_CC1OF | TIM_SR_UIF);
+		if (!(sr & (TIM_SR_CC2IF | TIM_SR_CC1IF))) {
+			trace_flush_and_reset();
+			return;
+		}
+	}
+
+	const uint16_t cycle = TIM_CCR1(TRACE_TIM);
+	const uint16_t duty = TIM_CCR2(TRACE_TIM);
+	if (!trace_decode_cycle(cycle, duty, sr & TIM_SR_CC1IF))
+		trace_flush_and_reset();
 }
+#endif
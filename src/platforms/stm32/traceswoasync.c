@@ -33,6 +33,7 @@
 #include "traceswo.h"
 
 #include <libopencmsis/core_cm3.h>
+#include <libopencm3/cm3/cortex.h>
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/stm32/timer.h>
 #include <libopencm3/stm32/rcc.h>
@@ -40,16 +41,38 @@
 #include <libopencm3/stm32/dma.h>
 
 /* For speed this is set to the USB transfer size */
-#define FULL_SWO_PACKET	(64)
-
-static volatile uint32_t w;	/* Packet currently received via UART */
-static volatile uint32_t r;	/* Packet currently waiting to transmit to USB */
-/* Packets arrived from the SWO interface */
-static uint8_t trace_rx_buf[NUM_TRACE_PACKETS * FULL_SWO_PACKET];
-/* Packet pingpong buffer used for receiving packets */
-static uint8_t pingpong_buf[2 * FULL_SWO_PACKET];
+#define FULL_SWO_PACKET	TRACE_ENDPOINT_SIZE
+/* The DMA runs round this buffer on its own, a power of two so the totals below wrap with it */
+#define TRACE_BUF_SIZE	(NUM_TRACE_PACKETS * FULL_SWO_PACKET)
+
+/* Data arrived from the SWO interface */
+static uint8_t trace_rx_buf[TRACE_BUF_SIZE];
+/* Free running byte counts, written by the DMA and taken by USB */
+static volatile uint32_t write_total;
+static volatile uint32_t read_total;
+/* Where the DMA was in trace_rx_buf when last looked at */
+static uint32_t dma_pos;
+/* The line went idle, so a partial packet is sent rather than held back */
+static volatile bool idle;
 /* SWO decoding */
 static bool decoding = false;
+static uint32_t baud;
+/* Data lost because USB didn't keep up, or the DMA didn't */
+static volatile uint32_t overrun_bytes;
+static volatile uint32_t uart_overruns;
+static volatile uint32_t bytes_sent;
+
+/* Account what the DMA has written since last time. The half and full transfer
+ * interrupts make sure this is done at least every half trip round the buffer,
+ * so a lap is never missed. */
+static void trace_buf_update(void)
+{
+	const bool masked = cm_mask_interrupts(true);
+	const uint32_t pos = (TRACE_BUF_SIZE - dma_get_number_of_data(SWO_DMA_BUS, SWO_DMA_CHAN)) % TRACE_BUF_SIZE;
+	write_total += (pos - dma_pos) % TRACE_BUF_SIZE;
+	dma_pos = pos;
+	cm_mask_interrupts(masked);
+}
 
 void trace_buf_drain(usbd_device *dev, uint8_t ep)
 {
@@ -58,26 +81,40 @@ void trace_buf_drain(usbd_device *dev, uint8_t ep)
 	/* If we are already in this routine then we don't need to come in again */
 	if (__atomic_test_and_set (&inBufDrain, __ATOMIC_RELAXED))
 		return;
-	/* Attempt to write everything we buffered */
-	if (w != r) {
+	trace_buf_update();
+	uint32_t avail = write_total - read_total;
+	/* The packet being written by the DMA can't be sent, anything it has come round onto is lost */
+	if (avail > TRACE_BUF_SIZE - FULL_SWO_PACKET) {
+		const uint32_t lost = avail - (TRACE_BUF_SIZE - FULL_SWO_PACKET);
+		overrun_bytes += lost;
+		read_total += lost;
+		avail -= lost;
+	}
+	/* Attempt to write everything we buffered, in full packets unless the line has gone idle */
+	if (avail >= FULL_SWO_PACKET || (avail && idle)) {
+		const uint32_t offset = read_total % TRACE_BUF_SIZE;
+		const uint16_t len = MIN(MIN(avail, FULL_SWO_PACKET), TRACE_BUF_SIZE - offset);
 		uint16_t rc;
 		if (decoding)
 			/* write decoded swo packets to the uart port */
-			rc = traceswo_decode(dev, CDCACM_UART_ENDPOINT,
-										  &trace_rx_buf[r * FULL_SWO_PACKET],
-										  FULL_SWO_PACKET);
+			rc = traceswo_decode(dev, CDCACM_UART_ENDPOINT, &trace_rx_buf[offset], len);
 		else
 			/* write raw swo packets to the trace port */
-			rc = usbd_ep_write_packet(dev, ep,
-										  &trace_rx_buf[r * FULL_SWO_PACKET],
-										  FULL_SWO_PACKET);
-		if (rc) r = (r + 1) % NUM_TRACE_PACKETS;
-	}
+			rc = usbd_ep_write_packet(dev, ep, &trace_rx_buf[offset], len);
+		if (rc) {
+			read_total += len;
+			bytes_sent += len;
+		}
+	} else if (!avail)
+		idle = false;
 	__atomic_clear (&inBufDrain, __ATOMIC_RELAXED);
 }
 
-void traceswo_setspeed(uint32_t baudrate)
+uint32_t traceswo_setspeed(uint32_t baudrate)
 {
+	/* With 16x oversampling the USART can't go faster than a sixteenth of its clock */
+	baudrate = MIN(baudrate, SWO_UART_PCLK / 16U);
+
 	dma_disable_channel(SWO_DMA_BUS, SWO_DMA_CHAN);
 	usart_disable(SWO_UART);
 	usart_set_baudrate(SWO_UART, baudrate);
@@ -86,6 +123,8 @@ void traceswo_setspeed(uint32_t baudrate)
 	usart_set_mode(SWO_UART, USART_MODE_RX);
 	usart_set_parity(SWO_UART, USART_PARITY_NONE);
 	usart_set_flow_control(SWO_UART, USART_FLOWCONTROL_NONE);
+	/* Flush what has come in when the line goes idle */
+	USART_CR1(SWO_UART) |= USART_CR1_IDLEIE;
 
 	/* Set up DMA channel*/
 	dma_channel_reset(SWO_DMA_BUS, SWO_DMA_CHAN);
@@ -102,30 +141,54 @@ void traceswo_setspeed(uint32_t baudrate)
 
 	usart_enable(SWO_UART);
 	nvic_enable_irq(SWO_DMA_IRQ);
-	w = r = 0;
-	dma_set_memory_address(SWO_DMA_BUS, SWO_DMA_CHAN, (uint32_t)pingpong_buf);
-	dma_set_number_of_data(SWO_DMA_BUS, SWO_DMA_CHAN, 2 * FULL_SWO_PACKET);
+	nvic_enable_irq(SWO_UART_IRQ);
+	write_total = read_total = dma_pos = 0;
+	overrun_bytes = uart_overruns = bytes_sent = 0;
+	idle = false;
+	dma_set_memory_address(SWO_DMA_BUS, SWO_DMA_CHAN, (uint32_t)trace_rx_buf);
+	dma_set_number_of_data(SWO_DMA_BUS, SWO_DMA_CHAN, TRACE_BUF_SIZE);
 	dma_enable_channel(SWO_DMA_BUS, SWO_DMA_CHAN);
 	usart_enable_rx_dma(SWO_UART);
+	baud = baudrate;
+	return baudrate;
 }
 
 void SWO_DMA_ISR(void)
 {
-	if (DMA_ISR(SWO_DMA_BUS) & DMA_ISR_HTIF(SWO_DMA_CHAN)) {
+	if (DMA_ISR(SWO_DMA_BUS) & DMA_ISR_HTIF(SWO_DMA_CHAN))
 		DMA_IFCR(SWO_DMA_BUS) |= DMA_ISR_HTIF(SWO_DMA_CHAN);
-		memcpy(&trace_rx_buf[w * FULL_SWO_PACKET], pingpong_buf,
-			   FULL_SWO_PACKET);
-	}
-	if (DMA_ISR(SWO_DMA_BUS) & DMA_ISR_TCIF(SWO_DMA_CHAN)) {
+	if (DMA_ISR(SWO_DMA_BUS) & DMA_ISR_TCIF(SWO_DMA_CHAN))
 		DMA_IFCR(SWO_DMA_BUS) |= DMA_ISR_TCIF(SWO_DMA_CHAN);
-		memcpy(&trace_rx_buf[w * FULL_SWO_PACKET],
-			   &pingpong_buf[FULL_SWO_PACKET], FULL_SWO_PACKET);
-	}
-	w = (w + 1) % NUM_TRACE_PACKETS;
+	/* Even if USB is in the middle of a drain, which this one then leaves to it */
+	trace_buf_update();
 	trace_buf_drain(usbdev, 0x85);
 }
 
-void traceswo_init(uint32_t baudrate, uint32_t swo_chan_bitmask)
+void SWO_UART_ISR(void)
+{
+	const uint32_t sr = USART_SR(SWO_UART);
+	if (!(sr & USART_SR_IDLE))
+		return;
+	/* Reading the data register after the status register clears idle, and overrun with it */
+	(void)USART_DR(SWO_UART);
+	if (sr & USART_SR_ORE)
+		uart_overruns++;
+	idle = true;
+	trace_buf_drain(usbdev, 0x85);
+}
+
+void traceswo_get_stats(traceswo_stats_s *const stats)
+{
+	trace_buf_update();
+	stats->baudrate = baud;
+	stats->max_baudrate = SWO_UART_PCLK / 16U;
+	stats->bytes_received = write_total;
+	stats->bytes_sent = bytes_sent;
+	stats->overrun_bytes = overrun_bytes;
+	stats->uart_overruns = uart_overruns;
+}
+
+uint32_t traceswo_init(uint32_t baudrate, uint32_t swo_chan_bitmask)
 {
 	if (!baudrate)
 		baudrate = SWO_DEFAULT_BAUD;
@@ -138,8 +201,10 @@ void traceswo_init(uint32_t baudrate, uint32_t swo_chan_bitmask)
 	/* Pull SWO pin high to keep open SWO line ind uart idle state!*/
 	gpio_set(SWO_UART_PORT, SWO_UART_RX_PIN);
 	nvic_set_priority(SWO_DMA_IRQ, IRQ_PRI_SWO_DMA);
+	nvic_set_priority(SWO_UART_IRQ, IRQ_PRI_SWO_DMA);
 	nvic_enable_irq(SWO_DMA_IRQ);
-	traceswo_setspeed(baudrate);
+	baudrate = traceswo_setspeed(baudrate);
 	traceswo_setmask(swo_chan_bitmask);
 	decoding = (swo_chan_bitmask != 0);
+	return baudrate;
 }
@@ -22,6 +22,8 @@
 #include "usb_serial.h"
 #include "traceswo.h"
 
+#include <stdio.h>
+
 /* SWO decoding */
 /* data is static in case swo packet is astride two buffers */
 static uint8_t swo_buf[CDCACM_PACKET_SIZE];
@@ -30,6 +32,69 @@ static uint32_t swo_decode = 0; /* bitmask of channels to print */
 static int swo_pkt_len = 0; /* decoder state */
 static bool swo_print = false;
 
+/*
+ * Aggregated channels are not forwarded, instead a summary line per channel
+ * that saw traffic is printed once per window.
+ */
+typedef struct swo_aggregate {
+	uint32_t count;
+	uint32_t last;
+	uint32_t min;
+	uint32_t max;
+} swo_aggregate_s;
+
+static uint32_t swo_aggregate_mask = 0; /* bitmask of channels to summarise */
+static uint32_t swo_aggregate_window = 0; /* ms */
+static uint32_t swo_aggregate_start = 0;
+static swo_aggregate_s swo_aggregate[32];
+static uint32_t swo_channel = 0;
+static uint32_t swo_value = 0;
+static int swo_value_len = 0;
+
+static void swo_flush(usbd_device *usbd_dev, uint8_t addr)
+{
+	if (swo_buf_len && usb_get_config() && gdb_serial_get_dtr()) /* silently drop if usb not ready */
+		usbd_ep_write_packet(usbd_dev, addr, swo_buf, swo_buf_len);
+	swo_buf_len = 0;
+}
+
+static void swo_out(usbd_device *usbd_dev, uint8_t addr, const char *data, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		swo_buf[swo_buf_len++] = data[i];
+		if (swo_buf_len == sizeof(swo_buf))
+			swo_flush(usbd_dev, addr);
+	}
+}
+
+static void swo_aggregate_add(uint32_t channel, uint32_t value)
+{
+	swo_aggregate_s *const stats = &swo_aggregate[channel];
+	if (!stats->count || value < stats->min)
+		stats->min = value;
+	if (!stats->count || value > stats->max)
+		stats->max = value;
+	stats->last = value;
+	++stats->count;
+}
+
+/* Print and reset the summary of every channel that saw traffic in the window */
+static void swo_aggregate_emit(usbd_device *usbd_dev, uint8_t addr)
+{
+	char line[80];
+	for (uint32_t channel = 0; channel < 32; channel++) {
+		swo_aggregate_s *const stats = &swo_aggregate[channel];
+		if (!stats->count)
+			continue;
+		const int len = snprintf(line, sizeof(line), "ch%" PRIu32 " n=%" PRIu32 " last=%" PRIu32 " min=%" PRIu32
+			" max=%" PRIu32 "\r\n", channel, stats->count, stats->last, stats->min, stats->max);
+		swo_out(usbd_dev, addr, line, MIN((size_t)len, sizeof(line) - 1U));
+		stats->count = 0;
+	}
+	/* Summaries go out as soon as they are complete rather than wait for a full packet */
+	swo_flush(usbd_dev, addr);
+}
+
 /* print decoded swo packet on usb serial */
 uint16_t traceswo_decode(usbd_device *usbd_dev, uint8_t addr,
 				const void *buf, uint16_t len) {
@@ -43,14 +108,18 @@ uint16_t traceswo_decode(usbd_device *usbd_dev, uint8_t addr,
 			else if (size == 0x02) swo_pkt_len = 2; /* SWO packet 0x02XXXX */
 			else if (size == 0x03) swo_pkt_len = 4; /* SWO packet 0x03XXXXXXXX */
 			swo_print = (swo_pkt_len != 0) && ((swo_decode & (1UL << channel)) != 0UL);
+			swo_channel = channel;
+			swo_value = 0;
+			swo_value_len = 0;
 		} else if (swo_pkt_len <= 4) { /* data */
-			if (swo_print) {
+			if (swo_print && (swo_aggregate_mask & (1UL << swo_channel))) {
+				swo_value |= (uint32_t)ch << (8 * swo_value_len++);
+				if (swo_pkt_len == 1)
+					swo_aggregate_add(swo_channel, swo_value);
+			} else if (swo_print) {
 				swo_buf[swo_buf_len++]=ch;
-				if (swo_buf_len == sizeof(swo_buf)) {
-					if (usb_get_config() && gdb_serial_get_dtr()) /* silently drop if usb not ready */
-						usbd_ep_write_packet(usbd_dev, addr, swo_buf, swo_buf_len);
-					swo_buf_len=0;
-				}
+				if (swo_buf_len == sizeof(swo_buf))
+					swo_flush(usbd_dev, addr);
 			}
 			--swo_pkt_len;
 		} else { /* recover */
@@ -58,6 +127,10 @@ uint16_t traceswo_decode(usbd_device *usbd_dev, uint8_t addr,
 			swo_pkt_len=0;
 		}
 	}
+	if (swo_aggregate_mask && platform_time_ms() - swo_aggregate_start >= swo_aggregate_window) {
+		swo_aggregate_emit(usbd_dev, addr);
+		swo_aggregate_start = platform_time_ms();
+	}
 	return len;
 }
 
@@ -66,4 +139,12 @@ void traceswo_setmask(uint32_t mask) {
 	swo_decode = mask;
 }
 
+/* set bitmask of decoded channels to be summarised every window_ms instead of forwarded */
+void traceswo_setaggregate(uint32_t mask, uint32_t window_ms) {
+	memset(swo_aggregate, 0, sizeof(swo_aggregate));
+	swo_aggregate_mask = mask;
+	swo_aggregate_window = window_ms ? window_ms : SWO_AGGREGATE_DEFAULT_MS;
+	swo_aggregate_start = platform_time_ms();
+}
+
 /* not truncated */
@@ -33,8 +33,15 @@ void dfu_main(void);
 
 /* Device specific functions */
 void dfu_check_and_do_sector_erase(uint32_t sector);
+/* Whether the flash from addr reads erased, so the page or sector it starts needn't be */
+bool dfu_flash_blank(uint32_t addr, uint32_t len);
+/* Programs a block, erasing its page or sector first when it starts one not erased yet */
 void dfu_flash_program_buffer(uint32_t baseaddr, void *buf, int len);
-uint32_t dfu_poll_timeout(uint8_t cmd, uint32_t addr, uint16_t blocknum);
+/*
+ * How long the host is to wait before asking for the status again. For blocknum 0
+ * cmd and addr are the command's, otherwise addr and len are the data block's.
+ */
+uint32_t dfu_poll_timeout(uint8_t cmd, uint32_t addr, uint16_t blocknum, uint16_t len);
 void dfu_protect(bool enable);
 void dfu_jump_app_if_valid(void);
 void dfu_event(void);
@@ -137,6 +137,9 @@ extern bool debug_bmp;
 #define SWO_UART_CLK			RCC_USART2
 #define SWO_UART_PORT			GPIOA
 #define SWO_UART_RX_PIN			GPIO3
+#define SWO_UART_IRQ			NVIC_USART2_IRQ
+#define SWO_UART_ISR(x)			usart2_isr(x)
+#define SWO_UART_PCLK			rcc_apb1_frequency
 
 /* This DMA channel is set by the USART in use */
 #define SWO_DMA_BUS				DMA1
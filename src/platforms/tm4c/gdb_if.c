@@ -78,6 +78,17 @@ unsigned char gdb_if_getchar(void)
 	return buffer_out[tail_out++ % sizeof(buffer_out)];
 }
 
+size_t gdb_if_read(void *const buf, const size_t max)
+{
+	uint8_t *const data = buf;
+	data[0] = gdb_if_getchar();
+	size_t count = 1;
+	/* Drain whatever else the USB callback has already queued up */
+	for (; count < max && tail_out != head_out; ++count)
+		data[count] = buffer_out[tail_out++ % sizeof(buffer_out)];
+	return count;
+}
+
 unsigned char gdb_if_getchar_to(int timeout)
 {
 	platform_timeout t;
@@ -30,6 +30,9 @@
 #include "target/adiv5.h"
 #include "target.h"
 #include "hex_utils.h"
+#ifdef PLATFORM_HAS_TRACESWO
+#include "traceswo.h"
+#endif
 
 #define NTOH(x)    (((x) <= 9) ? (x) + '0' : 'a' + (x) - 10)
 #define HTON(x)    (((x) <= '9') ? (x) - '0' : ((TOUPPER(x)) - 'A' + 10))
@@ -49,7 +52,51 @@ uint64_t remotehston(const uint32_t max, const char *const str)
 	return ret;
 }
 
-#if PC_HOSTED == 0
+/* True if a binary payload byte would be mistaken for packet framing */
+bool remote_needs_escape(const uint8_t value)
+{
+	return value == REMOTE_SOM || value == REMOTE_EOM || value == REMOTE_RESP || value == '$' ||
+		value == REMOTE_ESCAPE;
+}
+
+/* Escape len bytes of binary payload into dest, which must hold up to 2 * len characters */
+size_t remote_escape(char *const dest, const uint8_t *const src, const size_t len)
+{
+	size_t offset = 0;
+	for (size_t i = 0; i < len; ++i) {
+		if (remote_needs_escape(src[i])) {
+			dest[offset++] = (char)REMOTE_ESCAPE;
+			dest[offset++] = (char)(src[i] ^ REMOTE_ESCAPE_XOR);
+		} else
+			dest[offset++] = (char)src[i];
+	}
+	return offset;
+}
+
+/*
+ * Undo remote_escape() on len characters, returning the number of bytes decoded.
+ * dest may alias src as decoding never writes ahead of what it has read.
+ */
+size_t remote_unescape(uint8_t *const dest, const char *const src, const size_t len)
+{
+	size_t offset = 0;
+	for (size_t i = 0; i < len; ++i) {
+		uint8_t value = (uint8_t)src[i];
+		if (value == REMOTE_ESCAPE && i + 1U < len)
+			value = (uint8_t)src[++i] ^ REMOTE_ESCAPE_XOR;
+		dest[offset++] = value;
+	}
+	return offset;
+}
+
+#if PC_HOSTED == 1
+/* Hosted serves the protocol to another BMDA over TCP rather than to GDB */
+#include "remote_server.h"
+#define remote_putchar(c, flush) remote_server_putchar(c, flush)
+#else
+#define remote_putchar(c, flush) gdb_if_putchar(c, flush)
+#endif
+
 static void remote_send_buf(uint8_t *buffer, size_t len)
 {
 	uint8_t *p = buffer;
@@ -57,20 +104,36 @@ static void remote_send_buf(uint8_t *buffer, size_t len)
 	do {
 		hexify(hex, (const void *)p++, 1);
 
-		gdb_if_putchar(hex[0], 0);
-		gdb_if_putchar(hex[1], 0);
+		remote_putchar(hex[0], 0);
+		remote_putchar(hex[1], 0);
 
 	} while (p < (buffer + len));
 }
 
 static void remote_respond_buf(char respCode, uint8_t *buffer, size_t len)
 {
-	gdb_if_putchar(REMOTE_RESP, 0);
-	gdb_if_putchar(respCode, 0);
+	remote_putchar(REMOTE_RESP, 0);
+	remote_putchar(respCode, 0);
 
 	remote_send_buf(buffer, len);
 
-	gdb_if_putchar(REMOTE_EOM, 1);
+	remote_putchar(REMOTE_EOM, 1);
+}
+
+static void remote_respond_bin(char respCode, const uint8_t *buffer, size_t len)
+{
+	remote_putchar(REMOTE_RESP, 0);
+	remote_putchar(respCode, 0);
+
+	for (size_t i = 0; i < len; ++i) {
+		if (remote_needs_escape(buffer[i])) {
+			remote_putchar(REMOTE_ESCAPE, 0);
+			remote_putchar(buffer[i] ^ REMOTE_ESCAPE_XOR, 0);
+		} else
+			remote_putchar(buffer[i], 0);
+	}
+
+	remote_putchar(REMOTE_EOM, 1);
 }
 
 /* Send response to far end */
@@ -79,8 +142,8 @@ static void remote_respond(char respCode, uint64_t param)
 	char buf[35]; /*Response, code, EOM and 2*16 hex nibbles*/
 	char *p = buf;
 
-	gdb_if_putchar(REMOTE_RESP, 0);
-	gdb_if_putchar(respCode, 0);
+	remote_putchar(REMOTE_RESP, 0);
+	remote_putchar(respCode, 0);
 
 	do {
 		*p++ = NTOH((param & 0x0f));
@@ -89,47 +152,63 @@ static void remote_respond(char respCode, uint64_t param)
 
 	/* At this point the number to print is the buf, but backwards, so spool it out */
 	do {
-		gdb_if_putchar(*--p, 0);
+		remote_putchar(*--p, 0);
 	} while (p > buf);
-	gdb_if_putchar(REMOTE_EOM, 1);
+	remote_putchar(REMOTE_EOM, 1);
 }
 
 static void remote_respond_string(char respCode, const char *s)
 /* Send response to far end */
 {
-	gdb_if_putchar(REMOTE_RESP, 0);
-	gdb_if_putchar(respCode, 0);
+	remote_putchar(REMOTE_RESP, 0);
+	remote_putchar(respCode, 0);
 	while (*s) {
 		/* Just clobber illegal characters so they don't disturb the protocol */
 		if ((*s == '$') || (*s == REMOTE_SOM) || (*s == REMOTE_EOM))
-			gdb_if_putchar(' ', 0);
+			remote_putchar(' ', 0);
 		else
-			gdb_if_putchar(*s, 0);
+			remote_putchar(*s, 0);
 		s++;
 	}
-	gdb_if_putchar(REMOTE_EOM, 1);
+	remote_putchar(REMOTE_EOM, 1);
 }
 
-static ADIv5_DP_t remote_dp = {
+static const ADIv5_DP_t remote_dp_generic = {
 	.ap_read = firmware_ap_read,
 	.ap_write = firmware_ap_write,
 	.mem_read = firmware_mem_read,
 	.mem_write_sized = firmware_mem_write_sized,
+	.queue_read = firmware_queue_read,
+	.queue_write = firmware_queue_write,
+	.queue_flush = firmware_queue_flush,
 };
 
+/* Set up by the SWD or JTAG initialise packet, which has to come first */
+static ADIv5_DP_t remote_dp;
+
 static void remote_packet_process_swd(unsigned i, char *packet)
 {
 	uint8_t ticks;
 	uint32_t param;
 	bool badParity;
 
+	if (packet[1] != REMOTE_INIT && !remote_dp.seq_out) {
+		remote_respond(REMOTE_RESP_ERR, REMOTE_ERROR_UNRECOGNISED);
+		return;
+	}
 	switch (packet[1]) {
 	case REMOTE_INIT: /* SS = initialise =============================== */
 		if (i == 2) {
+			remote_dp = remote_dp_generic;
 			remote_dp.dp_read = firmware_swdp_read;
+			remote_dp.error = firmware_swdp_error;
 			remote_dp.low_access = firmware_swdp_low_access;
 			remote_dp.abort = firmware_swdp_abort;
 			swdptap_init(&remote_dp);
+#if PC_HOSTED == 1
+			/* The local probe takes over whatever DP accesses it does better itself */
+			platform_adiv5_dp_defaults(&remote_dp);
+#endif
 			remote_respond(REMOTE_RESP_OK, 0);
 		} else {
 			remote_respond(REMOTE_RESP_ERR, REMOTE_ERROR_WRONGLEN);
@@ -177,10 +256,16 @@ static void remote_packet_process_jtag(unsigned i, char *packet)
 	jtag_dev_t jtag_dev;
 	switch (packet[1]) {
 	case REMOTE_INIT: /* JS = initialise ============================= */
+		remote_dp = remote_dp_generic;
 		remote_dp.dp_read = fw_adiv5_jtagdp_read;
+		remote_dp.error = adiv5_jtagdp_error;
 		remote_dp.low_access = fw_adiv5_jtagdp_low_access;
 		remote_dp.abort = adiv5_jtagdp_abort;
+#if PC_HOSTED == 1
+		platform_jtagtap_init();
+#else
 		jtagtap_init();
+#endif
 		remote_respond(REMOTE_RESP_OK, 0);
 		break;
 
@@ -226,6 +311,29 @@ static void remote_packet_process_jtag(unsigned i, char *packet)
 		}
 		break;
 
+	case REMOTE_TDITDO_LONG: { /* JL = TDI/TDO of any length ====================== */
+		const uint8_t flags = remotehston(2, &packet[2]);
+		const size_t cycles = remotehston(8, &packet[4]);
+		const size_t bytes = (cycles + 7U) >> 3U;
+		/* TDI is unescaped to the start of the packet buffer and TDO goes after it */
+		uint8_t *const data_in = (uint8_t *)packet;
+		uint8_t *const data_out = data_in + bytes;
+		if (i < 12 || !cycles || bytes > GDB_PACKET_BUFFER_SIZE / 2U ||
+			remote_unescape(data_in, packet + 12, i - 12U) != bytes) {
+			remote_respond(REMOTE_RESP_ERR, REMOTE_ERROR_WRONGLEN);
+			break;
+		}
+		const bool final_tms = flags & REMOTE_JTAG_LONG_TMS;
+		if (flags & REMOTE_JTAG_LONG_TDO) {
+			jtag_proc.jtagtap_tdi_tdo_seq(data_out, final_tms, data_in, cycles);
+			remote_respond_bin(REMOTE_RESP_OK, data_out, bytes);
+		} else {
+			jtag_proc.jtagtap_tdi_seq(final_tms, data_in, cycles);
+			remote_respond(REMOTE_RESP_OK, 0);
+		}
+		break;
+	}
+
 	case REMOTE_NEXT: /* JN = NEXT ======================================== */
 		if (i != 4)
 			remote_respond(REMOTE_RESP_ERR, REMOTE_ERROR_WRONGLEN);
@@ -236,7 +344,7 @@ static void remote_packet_process_jtag(unsigned i, char *packet)
 		break;
 
 	case REMOTE_ADD_JTAG_DEV: /* JJ = fill firmware jtag_devs */
-		if (i < 22) {
+		if (i < 22 || remotehston(2, &packet[2]) >= JTAG_MAX_DEVS) {
 			remote_respond(REMOTE_RESP_ERR, REMOTE_ERROR_WRONGLEN);
 		} else {
 			memset(&jtag_dev, 0, sizeof(jtag_dev));
@@ -248,6 +356,10 @@ static void remote_packet_process_jtag(unsigned i, char *packet)
 			jtag_dev.ir_postscan = remotehston(2, &packet[12]);
 			jtag_dev.current_ir = remotehston(8, &packet[14]);
 			jtag_add_device(index, &jtag_dev);
+#if PC_HOSTED == 1
+			/* A probe running the JTAG-DP itself needs to know the chain as well */
+			platform_add_jtag_dev(index, &jtag_dev);
+#endif
 			remote_respond(REMOTE_RESP_OK, 0);
 		}
 		break;
@@ -322,26 +434,90 @@ static void remotePacketProcessGEN(unsigned i, char *packet)
 		remote_respond(REMOTE_RESP_OK, 0);
 		break;
 
+	case REMOTE_TRACESWO: {
+#ifdef PLATFORM_HAS_TRACESWO
+		/* No channels decoded, everything goes to the trace endpoint for the host to decode */
+#if defined TRACESWO_PROTOCOL && TRACESWO_PROTOCOL == 2
+		const uint32_t baudrate = remotehston(8, packet + 2);
+		uint32_t actual = traceswo_init(baudrate ? baudrate : SWO_DEFAULT_BAUD, 0);
+#else
+		traceswo_init(0);
+		uint32_t actual = 0;
+#endif
+		remote_respond_buf(REMOTE_RESP_OK, (uint8_t *)&actual, 4);
+#else
+		remote_respond(REMOTE_RESP_NOTSUP, 0);
+#endif
+		break;
+	}
+
     default:
 		remote_respond(REMOTE_RESP_ERR, REMOTE_ERROR_UNRECOGNISED);
 		break;
     }
 }
 
+/* HB = Run a batch of DP/AP accesses through the DP queue, responding with what the reads returned */
+static void remote_packet_process_batch(const unsigned i, const char *packet)
+{
+	uint32_t results[REMOTE_BATCH_MAX];
+	size_t reads = 0;
+	const char *const end = packet + i;
+	remote_dp.dp_jd_index = remotehston(2, packet + 2);
+	packet += 4;
+	bool malformed = false;
+	while (packet < end && !malformed) {
+		const char access = *packet++;
+		if (access == REMOTE_BATCH_READ && end - packet >= 4 && reads < REMOTE_BATCH_MAX) {
+			adiv5_dp_queue_read(&remote_dp, remotehston(4, packet), &results[reads++]);
+			packet += 4;
+		} else if (access == REMOTE_BATCH_WRITE && end - packet >= 12) {
+			adiv5_dp_queue_write(&remote_dp, remotehston(4, packet), remotehston(8, packet + 4));
+			packet += 12;
+		} else
+			malformed = true;
+	}
+	/* Whatever did run is flushed either way, to leave the DP without errors pending */
+	const bool failed = adiv5_dp_queue_flush(&remote_dp);
+	/* The SELECT, CSW and TAR writes went past the cached copies of them */
+	adiv5_dp_cache_invalidate(&remote_dp);
+	if (malformed)
+		remote_respond(REMOTE_RESP_ERR, REMOTE_ERROR_WRONGLEN);
+	else if (failed)
+		remote_respond(REMOTE_RESP_ERR, 0);
+	else if (reads)
+		remote_respond_buf(REMOTE_RESP_OK, (uint8_t *)results, reads * 4U);
+	else
+		remote_respond(REMOTE_RESP_OK, 0);
+}
+
 static void remotePacketProcessHL(unsigned i, char *packet)
 
 {
-	(void)i;
+	char *const start = packet;
 	SET_IDLE_STATE(0);
 
 	ADIv5_AP_t remote_ap;
 	/* Re-use packet buffer. Align to DWORD! */
-	void *src = (void *)(((uint32_t)packet + 7) & ~7);
+	void *src = (void *)(((uintptr_t)packet + 7U) & ~(uintptr_t)7U);
 	char index = packet[1];
 	if (index == REMOTE_HL_CHECK) {
 		remote_respond(REMOTE_RESP_OK, REMOTE_HL_VERSION);
 		return;
 	}
+	if (index == REMOTE_HL_PACKET_SIZE) {
+		remote_respond(REMOTE_RESP_OK, GDB_PACKET_BUFFER_SIZE);
+		return;
+	}
+	if (!remote_dp.low_access) {
+		remote_respond(REMOTE_RESP_ERR, REMOTE_ERROR_UNRECOGNISED);
+		return;
+	}
+	if (index == REMOTE_HL_BATCH) {
+		remote_packet_process_batch(i, packet);
+		SET_IDLE_STATE(1);
+		return;
+	}
 	packet += 2;
 	remote_dp.dp_jd_index = remotehston(2, packet);
 	packet += 2;
@@ -424,6 +600,50 @@ static void remotePacketProcessHL(unsigned i, char *packet)
 		}
 		remote_respond(REMOTE_RESP_OK, 0);
 		break;
+	case REMOTE_AP_MEM_READ_BIN: /* HR = Read from Mem and set csw, binary response */
+		packet += 2;
+		remote_ap.csw = remotehston(8, packet);
+		packet += 8;
+		address = remotehston(8, packet);
+		packet += 8;
+		count = remotehston(8, packet);
+		/* The packet buffer holds the data, less what aligning it cost */
+		if (count > GDB_PACKET_BUFFER_SIZE - 8U) {
+			remote_respond(REMOTE_RESP_ERR, REMOTE_ERROR_WRONGLEN);
+			break;
+		}
+		adiv5_mem_read(&remote_ap, src, address, count);
+		if (remote_ap.dp->fault == 0) {
+			remote_respond_bin(REMOTE_RESP_OK, src, count);
+			break;
+		}
+		remote_respond(REMOTE_RESP_ERR, 0);
+		remote_ap.dp->fault = 0;
+		break;
+	case REMOTE_AP_MEM_WRITE_BIN: /* HW = Write to memory and set csw, binary data */
+		packet += 2;
+		remote_ap.csw = remotehston(8, packet);
+		packet += 8;
+		align = remotehston(2, packet);
+		packet += 2;
+		dest = remotehston(8, packet);
+		packet += 8;
+		len = remotehston(8, packet);
+		packet += 8;
+		/* The data may contain NULs, so its extent comes from the packet length */
+		if ((len & ((1 << align) - 1)) ||
+			remote_unescape(src, packet, i - (size_t)(packet - start)) != len) {
+			remote_respond(REMOTE_RESP_ERR, REMOTE_ERROR_WRONGLEN);
+			break;
+		}
+		adiv5_mem_write_sized(&remote_ap, dest, src, len, align);
+		if (remote_ap.dp->fault) {
+			remote_respond(REMOTE_RESP_ERR, 0);
+			remote_ap.dp->fault = 0;
+			break;
+		}
+		remote_respond(REMOTE_RESP_OK, 0);
+		break;
 	default:
 		remote_respond(REMOTE_RESP_ERR,REMOTE_ERROR_UNRECOGNISED);
 		break;
@@ -456,4 +676,3 @@ void remotePacketProcess(unsigned i, char *packet)
 		break;
     }
 }
-#endif
@@ -24,7 +24,16 @@
 #include <inttypes.h>
 #include "general.h"
 
-#define REMOTE_HL_VERSION 2
+/*
+ * Version 3 adds the binary memory transfers (HR/HW) and the packet size
+ * query (HP), hosted falls back to the hex encoded transfers for older firmware.
+ * Version 4 adds batches of queued DP/AP accesses (HB).
+ * Version 5 adds TDI/TDO sequences of any length up to the packet size (JL).
+ */
+#define REMOTE_HL_VERSION           5
+#define REMOTE_HL_VERSION_BINARY    3
+#define REMOTE_HL_VERSION_BATCH     4
+#define REMOTE_HL_VERSION_JTAG_LONG 5
 
 /*
  * Commands to remote end, and responses
@@ -46,6 +55,10 @@
  *       resp: F<PARAM> - hex value returned, bad parity.
  *             X<err>   - error occured
  *
+ * The binary memory transfers carry raw data instead of hex digits. Any data
+ * byte that would be taken as framing (!, #, $, & or the escape itself) is
+ * sent as REMOTE_ESCAPE followed by the byte XOR REMOTE_ESCAPE_XOR.
+ *
  * The whole protocol is defined in this header file. Parameters have
  * to be marshalled in remote.c, swdptap.c and jtagtap.c, so be
  * careful to ensure the parameter handling matches the protocol
@@ -55,12 +68,17 @@
 /* Protocol error messages */
 #define REMOTE_ERROR_UNRECOGNISED 1
 #define REMOTE_ERROR_WRONGLEN     2
+#define REMOTE_ERROR_EXCEPTION    3
 
 /* Start and end of message identifiers */
 #define REMOTE_SOM  '!'
 #define REMOTE_EOM  '#'
 #define REMOTE_RESP '&'
 
+/* Binary payload escaping */
+#define REMOTE_ESCAPE     0x7dU
+#define REMOTE_ESCAPE_XOR 0x20U
+
 /* Generic protocol elements */
 #define REMOTE_START         'A'
 #define REMOTE_TDITDO_TMS    'D'
@@ -83,6 +101,7 @@
 #define REMOTE_NRST_SET      'Z'
 #define REMOTE_NRST_GET      'z'
 #define REMOTE_ADD_JTAG_DEV  'J'
+#define REMOTE_TRACESWO      'W'
 
 /* Protocol response options */
 #define REMOTE_RESP_OK     'K'
@@ -101,6 +120,20 @@
 #define REMOTE_MEM_READ           'h'
 #define REMOTE_MEM_WRITE_SIZED    'H'
 #define REMOTE_AP_MEM_WRITE_SIZED 'm'
+#define REMOTE_HL_PACKET_SIZE     'P'
+#define REMOTE_AP_MEM_READ_BIN    'R'
+#define REMOTE_AP_MEM_WRITE_BIN   'W'
+#define REMOTE_HL_BATCH           'B'
+
+/*
+ * A batch runs its accesses in order through the probe's DP queue. Each is a
+ * DP address, with APnDP for AP registers, and for writes the value. The
+ * response carries every read's result in order, or an error if any failed.
+ */
+#define REMOTE_BATCH_READ  'r'
+#define REMOTE_BATCH_WRITE 'w'
+/* Most accesses one batch may hold, sized for the smallest firmware packet buffer */
+#define REMOTE_BATCH_MAX 64U
 
 /* Generic protocol elements */
 #define REMOTE_GEN_PACKET  'G'
@@ -149,6 +182,12 @@
 	{                                                                                \
 		REMOTE_SOM, REMOTE_GEN_PACKET, REMOTE_TARGET_CLK_OE, '%', 'c', REMOTE_EOM, 0 \
 	}
+/* Start raw trace capture to the trace endpoint at the given baudrate, 0 for the default */
+#define REMOTE_TRACESWO_STR                                                               \
+	(char[])                                                                              \
+	{                                                                                     \
+		REMOTE_SOM, REMOTE_GEN_PACKET, REMOTE_TRACESWO, '%', '0', '8', 'x', REMOTE_EOM, 0 \
+	}
 
 /* SWDP protocol elements */
 #define REMOTE_SWDP_PACKET 'S'
@@ -220,6 +259,21 @@
 		REMOTE_SOM, REMOTE_JTAG_PACKET, REMOTE_NEXT, '%', 'u', '%', 'u', REMOTE_EOM, 0 \
 	}
 
+/*
+ * A TDI/TDO sequence of any length, the flags then the clock cycles, followed
+ * by the TDI bits as binary data packed LSB first, then REMOTE_EOM. With
+ * REMOTE_JTAG_LONG_TDO the response carries the TDO bits the same way, each
+ * direction taking at most half the packet size of data.
+ */
+#define REMOTE_TDITDO_LONG       'L'
+#define REMOTE_JTAG_LONG_TMS     0x01U
+#define REMOTE_JTAG_LONG_TDO     0x02U
+#define REMOTE_JTAG_TDITDO_LONG_STR                                                               \
+	(char[])                                                                                      \
+	{                                                                                             \
+		REMOTE_SOM, REMOTE_JTAG_PACKET, REMOTE_TDITDO_LONG, '%', '0', '2', 'x', HEX_U32(cycles), 0 \
+	}
+
 /* HL protocol elements */
 #define HEX '%', '0', '2', 'x'
 #define HEX_U32(x) '%', '0', '8', 'x'
@@ -241,6 +295,11 @@
 	{                                                                \
 		REMOTE_SOM, REMOTE_HL_PACKET, REMOTE_HL_CHECK, REMOTE_EOM, 0 \
 	}
+#define REMOTE_HL_PACKET_SIZE_STR                                          \
+	(char[])                                                               \
+	{                                                                      \
+		REMOTE_SOM, REMOTE_HL_PACKET, REMOTE_HL_PACKET_SIZE, REMOTE_EOM, 0 \
+	}
 #define REMOTE_DP_READ_STR                                                                                            \
 	(char[])                                                                                                          \
 	{                                                                                                                 \
@@ -276,6 +335,34 @@
 		REMOTE_SOM, REMOTE_HL_PACKET, REMOTE_AP_MEM_WRITE_SIZED, '%', '0', '2', 'x', '%', '0', '2', 'x', HEX_U32(csw), \
 			'%', '0', '2', 'x', HEX_U32(address), HEX_U32(count), 0                                                    \
 	}
+#define REMOTE_AP_MEM_READ_BIN_STR                                                                                  \
+	(char[])                                                                                                        \
+	{                                                                                                               \
+		REMOTE_SOM, REMOTE_HL_PACKET, REMOTE_AP_MEM_READ_BIN, '%', '0', '2', 'x', '%', '0', '2', 'x', HEX_U32(csw), \
+			HEX_U32(address), HEX_U32(count), REMOTE_EOM, 0                                                         \
+	}
+#define REMOTE_AP_MEM_WRITE_BIN_STR                                                                                  \
+	(char[])                                                                                                         \
+	{                                                                                                                \
+		REMOTE_SOM, REMOTE_HL_PACKET, REMOTE_AP_MEM_WRITE_BIN, '%', '0', '2', 'x', '%', '0', '2', 'x', HEX_U32(csw), \
+			'%', '0', '2', 'x', HEX_U32(address), HEX_U32(count), 0                                                  \
+	}
+/* Followed by the accesses, then REMOTE_EOM */
+#define REMOTE_HL_BATCH_STR                                                  \
+	(char[])                                                                 \
+	{                                                                        \
+		REMOTE_SOM, REMOTE_HL_PACKET, REMOTE_HL_BATCH, '%', '0', '2', 'x', 0 \
+	}
+#define REMOTE_BATCH_READ_STR                    \
+	(char[])                                     \
+	{                                            \
+		REMOTE_BATCH_READ, '%', '0', '4', 'x', 0 \
+	}
+#define REMOTE_BATCH_WRITE_STR                                    \
+	(char[])                                                      \
+	{                                                             \
+		REMOTE_BATCH_WRITE, '%', '0', '4', 'x', HEX_U32(value), 0 \
+	}
 #define REMOTE_MEM_WRITE_SIZED_STR                                                                       \
 	(char[])                                                                                             \
 	{                                                                                                    \
@@ -285,5 +372,8 @@
 
 uint64_t remotehston(uint32_t limit, const char *s);
 void remotePacketProcess(unsigned int i, char *packet);
+bool remote_needs_escape(uint8_t value);
+size_t remote_escape(char *dest, const uint8_t *src, size_t len);
+size_t remote_unescape(uint8_t *dest, const char *src, size_t len);
 
 #endif /* REMOTE_H */
@@ -0,0 +1,341 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * FreeRTOS task lists, read the way the kernel keeps them. Every list header
+ * comes in one target_mem_readv() batch, then the lists are walked side by side
+ * with one batch per step taking the next item of each, and a last batch reads
+ * the stack pointer and name out of every TCB found. What that finds is kept
+ * until the target runs again, so GDB's thread queries after a stop cost one
+ * scan. The layouts are those of a 32-bit port without the MPU or list
+ * integrity checks, which is what the Cortex-M ports build by default.
+ */
+
+#include "general.h"
+#include "target.h"
+#include "rtos.h"
+
+enum {
+	FREERTOS_CURRENT_TCB,
+	FREERTOS_READY_LISTS,
+	FREERTOS_TOP_PRIORITY,
+	FREERTOS_DELAYED_LIST_1,
+	FREERTOS_DELAYED_LIST_2,
+	FREERTOS_PENDING_READY_LIST,
+	FREERTOS_SUSPENDED_LIST,
+	FREERTOS_SYMBOL_COUNT,
+};
+
+static const char *const freertos_symbol_name[FREERTOS_SYMBOL_COUNT] = {
+	"pxCurrentTCB",
+	"pxReadyTasksLists",
+	"uxTopUsedPriority",
+	"xDelayedTaskList1",
+	"xDelayedTaskList2",
+	"xPendingReadyList",
+	"xSuspendedTaskList",
+};
+
+/* The lists other than the ready ones, and the state of the tasks on them */
+static const struct {
+	uint8_t symbol;
+	rtos_task_state_e state;
+} freertos_other_lists[] = {
+	{FREERTOS_PENDING_READY_LIST, RTOS_TASK_READY},
+	{FREERTOS_DELAYED_LIST_1, RTOS_TASK_BLOCKED},
+	{FREERTOS_DELAYED_LIST_2, RTOS_TASK_BLOCKED},
+	{FREERTOS_SUSPENDED_LIST, RTOS_TASK_SUSPENDED},
+};
+
+/* List_t: uxNumberOfItems, pxIndex and the xListEnd marker item of xItemValue, pxNext and pxPrevious */
+#define FREERTOS_LIST_SIZE     20U
+#define FREERTOS_LIST_ITEMS    0U
+#define FREERTOS_LIST_END      8U
+#define FREERTOS_LIST_END_NEXT 12U
+/* ListItem_t: xItemValue, pxNext, pxPrevious, pvOwner and pvContainer, of which the first four are read */
+#define FREERTOS_ITEM_READ  16U
+#define FREERTOS_ITEM_NEXT  4U
+#define FREERTOS_ITEM_OWNER 12U
+/* TCB_t: pxTopOfStack, xStateListItem, xEventListItem, uxPriority, pxStack and then pcTaskName */
+#define FREERTOS_TCB_TOP_OF_STACK 0U
+#define FREERTOS_TCB_NAME         52U
+
+#define FREERTOS_MAX_PRIORITIES 32U
+#define FREERTOS_MAX_LISTS      (FREERTOS_MAX_PRIORITIES + ARRAY_LENGTH(freertos_other_lists))
+
+/*
+ * The context a port saves on a task's stack when it's switched out: r4-r11,
+ * with PSPLIM and EXC_RETURN ahead of them on the ARMv8-M ports and EXC_RETURN
+ * after them on the ARMv7-M FPU ports, then s16-s31 when the task used the FPU,
+ * and last the frame the exception entry stacked, itself followed by s0-s15,
+ * FPSCR and a reserved word in that case.
+ */
+#define CORTEXM_SW_FRAME_WORDS        8U
+#define CORTEXM_HW_FRAME_WORDS        8U
+#define CORTEXM_SW_FP_FRAME_WORDS     16U
+#define CORTEXM_HW_FP_FRAME_WORDS     18U
+#define CORTEXM_EXC_RETURN_MASK       0xffffff00U
+#define CORTEXM_EXC_RETURN_STD_FRAME  (1U << 4U)
+#define CORTEXM_XPSR_STACK_ALIGN      (1U << 9U)
+#define CORTEXM_STACKED_WORDS_MAX     (2U + CORTEXM_SW_FRAME_WORDS + CORTEXM_SW_FP_FRAME_WORDS + CORTEXM_HW_FRAME_WORDS)
+
+static uint32_t freertos_symbol_addr[FREERTOS_SYMBOL_COUNT];
+
+/* What the last scan found, for rtos_target until the target runs again */
+static target *rtos_target;
+static bool rtos_scanned;
+static rtos_task_s rtos_task[RTOS_MAX_TASKS];
+static size_t rtos_task_count;
+static rtos_task_s rtos_running;
+/* The registers of the last task asked for, 0 when there are none */
+static uint32_t rtos_regs_tcb;
+static uint32_t rtos_regs[RTOS_TASK_REGS];
+
+/* Scratch for a scan, kept off the stack as it runs to a couple of KiB */
+static struct {
+	uint32_t list_addr[FREERTOS_MAX_LISTS];
+	rtos_task_state_e list_state[FREERTOS_MAX_LISTS];
+	uint32_t list[FREERTOS_MAX_LISTS][FREERTOS_LIST_SIZE / 4U];
+	uint32_t item[FREERTOS_MAX_LISTS][FREERTOS_ITEM_READ / 4U];
+	size_t item_list[FREERTOS_MAX_LISTS];
+	target_iovec_s iov[MAX(FREERTOS_MAX_LISTS, 2U * (RTOS_MAX_TASKS + 1U))];
+} freertos_scan;
+
+const char *rtos_symbol(const size_t index)
+{
+	return index < FREERTOS_SYMBOL_COUNT ? freertos_symbol_name[index] : NULL;
+}
+
+void rtos_symbol_set(const char *const name, const uint32_t addr)
+{
+	for (size_t i = 0; i < FREERTOS_SYMBOL_COUNT; ++i) {
+		if (!strcmp(name, freertos_symbol_name[i])) {
+			freertos_symbol_addr[i] = addr;
+			rtos_scanned = false;
+			return;
+		}
+	}
+}
+
+void rtos_symbols_reset(void)
+{
+	memset(freertos_symbol_addr, 0, sizeof(freertos_symbol_addr));
+	rtos_scanned = false;
+}
+
+void rtos_invalidate(void)
+{
+	rtos_scanned = false;
+}
+
+/* Adds the ready lists up to the top priority in use and then the others the kernel has */
+static size_t freertos_lists(const uint32_t top_priority)
+{
+	size_t lists = 0;
+	for (uint32_t priority = 0; priority <= top_priority; ++priority) {
+		freertos_scan.list_addr[lists] =
+			freertos_symbol_addr[FREERTOS_READY_LISTS] + priority * FREERTOS_LIST_SIZE;
+		freertos_scan.list_state[lists++] = RTOS_TASK_READY;
+	}
+	for (size_t i = 0; i < ARRAY_LENGTH(freertos_other_lists); ++i) {
+		const uint32_t addr = freertos_symbol_addr[freertos_other_lists[i].symbol];
+		if (!addr)
+			continue;
+		freertos_scan.list_addr[lists] = addr;
+		freertos_scan.list_state[lists++] = freertos_other_lists[i].state;
+	}
+	for (size_t i = 0; i < lists; ++i) {
+		freertos_scan.iov[i].dest = freertos_scan.list[i];
+		freertos_scan.iov[i].src = freertos_scan.list_addr[i];
+		freertos_scan.iov[i].len = FREERTOS_LIST_SIZE;
+	}
+	return lists;
+}
+
+/*
+ * Walks the lists in step, each batch reading the next item of every list not
+ * done yet. A list is done at its end marker or once it gave as many items as
+ * its header counts, so one the target is halfway through changing still ends.
+ */
+static bool freertos_walk(target *const t, const size_t lists, const uint32_t current)
+{
+	uint32_t left[FREERTOS_MAX_LISTS];
+	uint32_t cursor[FREERTOS_MAX_LISTS];
+	for (size_t i = 0; i < lists; ++i) {
+		left[i] = MIN(freertos_scan.list[i][FREERTOS_LIST_ITEMS / 4U], RTOS_MAX_TASKS + 1U);
+		cursor[i] = freertos_scan.list[i][FREERTOS_LIST_END_NEXT / 4U];
+	}
+
+	while (rtos_task_count < RTOS_MAX_TASKS) {
+		size_t count = 0;
+		for (size_t i = 0; i < lists; ++i) {
+			if (!left[i] || !cursor[i] || cursor[i] == freertos_scan.list_addr[i] + FREERTOS_LIST_END)
+				continue;
+			freertos_scan.iov[count].dest = freertos_scan.item[count];
+			freertos_scan.iov[count].src = cursor[i];
+			freertos_scan.iov[count].len = FREERTOS_ITEM_READ;
+			freertos_scan.item_list[count++] = i;
+		}
+		if (!count)
+			return true;
+		if (target_mem_readv(t, freertos_scan.iov, count))
+			return false;
+		for (size_t j = 0; j < count && rtos_task_count < RTOS_MAX_TASKS; ++j) {
+			const size_t i = freertos_scan.item_list[j];
+			--left[i];
+			cursor[i] = freertos_scan.item[j][FREERTOS_ITEM_NEXT / 4U];
+			const uint32_t tcb = freertos_scan.item[j][FREERTOS_ITEM_OWNER / 4U];
+			/* The running task sits in its ready list too, but is shown as the core */
+			if (!tcb || tcb == current)
+				continue;
+			rtos_task_s *const task = &rtos_task[rtos_task_count++];
+			task->tcb = tcb;
+			task->state = freertos_scan.list_state[i];
+		}
+	}
+	return true;
+}
+
+/* Reads the stack pointer and name of every task found, and of the running one, in one batch */
+static bool freertos_tcbs_read(target *const t)
+{
+	size_t count = 0;
+	for (size_t i = 0; i <= rtos_task_count; ++i) {
+		rtos_task_s *const task = i < rtos_task_count ? &rtos_task[i] : &rtos_running;
+		freertos_scan.iov[count].dest = &task->top_of_stack;
+		freertos_scan.iov[count].src = task->tcb + FREERTOS_TCB_TOP_OF_STACK;
+		freertos_scan.iov[count++].len = sizeof(task->top_of_stack);
+		freertos_scan.iov[count].dest = task->name;
+		freertos_scan.iov[count].src = task->tcb + FREERTOS_TCB_NAME;
+		freertos_scan.iov[count++].len = RTOS_TASK_NAME_LEN;
+	}
+	if (target_mem_readv(t, freertos_scan.iov, count))
+		return false;
+	for (size_t i = 0; i < rtos_task_count; ++i)
+		rtos_task[i].name[RTOS_TASK_NAME_LEN] = '\0';
+	rtos_running.name[RTOS_TASK_NAME_LEN] = '\0';
+	return true;
+}
+
+static void rtos_scan(target *const t)
+{
+	if (rtos_scanned && rtos_target == t)
+		return;
+	rtos_scanned = true;
+	rtos_target = t;
+	rtos_task_count = 0;
+	rtos_running.tcb = 0;
+	rtos_regs_tcb = 0;
+
+	/* The stacked register decode is for the Cortex-M ports */
+	const char *const core = target_core_name(t);
+	if (!core || core[0] != 'M' || !freertos_symbol_addr[FREERTOS_CURRENT_TCB] ||
+		!freertos_symbol_addr[FREERTOS_READY_LISTS] || !freertos_symbol_addr[FREERTOS_TOP_PRIORITY])
+		return;
+
+	uint32_t current = 0;
+	uint32_t top_priority = 0;
+	const target_iovec_s kernel[] = {
+		{&current, freertos_symbol_addr[FREERTOS_CURRENT_TCB], sizeof(current)},
+		{&top_priority, freertos_symbol_addr[FREERTOS_TOP_PRIORITY], sizeof(top_priority)},
+	};
+	/* No current task means the scheduler isn't started yet */
+	if (target_mem_readv(t, kernel, ARRAY_LENGTH(kernel)) || !current || top_priority >= FREERTOS_MAX_PRIORITIES)
+		return;
+
+	const size_t lists = freertos_lists(top_priority);
+	rtos_running.tcb = current;
+	rtos_running.state = RTOS_TASK_READY;
+	if (target_mem_readv(t, freertos_scan.iov, lists) || !freertos_walk(t, lists, current) ||
+		!freertos_tcbs_read(t)) {
+		DEBUG_WARN("rtos: reading the FreeRTOS task lists failed\n");
+		rtos_task_count = 0;
+		rtos_running.tcb = 0;
+	}
+}
+
+size_t rtos_tasks(target *const t, const rtos_task_s **const tasks)
+{
+	rtos_scan(t);
+	*tasks = rtos_task;
+	return rtos_task_count;
+}
+
+const rtos_task_s *rtos_task_find(target *const t, const uint32_t tcb)
+{
+	rtos_scan(t);
+	for (size_t i = 0; i < rtos_task_count; ++i) {
+		if (rtos_task[i].tcb == tcb)
+			return &rtos_task[i];
+	}
+	return NULL;
+}
+
+const char *rtos_current_task(target *const t)
+{
+	rtos_scan(t);
+	return rtos_running.tcb ? rtos_running.name : NULL;
+}
+
+/* Takes the registers a Cortex-M port saved apart again, see CORTEXM_STACKED_WORDS_MAX */
+static bool freertos_unstack(target *const t, const uint32_t sp, uint32_t *const regs)
+{
+	uint32_t frame[CORTEXM_STACKED_WORDS_MAX];
+	const char *const core = target_core_name(t);
+	const bool armv8m = !strncmp(core, "M33", 3U) || !strncmp(core, "M23", 3U);
+	size_t words = (armv8m ? 2U : 1U) + CORTEXM_SW_FRAME_WORDS + CORTEXM_HW_FRAME_WORDS;
+	if (target_mem_read(t, frame, sp, words * 4U))
+		return false;
+
+	size_t offset = armv8m ? 2U : 0U;
+	memcpy(regs + 4U, frame + offset, CORTEXM_SW_FRAME_WORDS * 4U);
+	offset += CORTEXM_SW_FRAME_WORDS;
+	/* The ports without an FPU have nothing after r11, where r0 of the exception frame never looks like this */
+	uint32_t exc_return = armv8m ? frame[1] : 0U;
+	if (!armv8m && (frame[offset] & CORTEXM_EXC_RETURN_MASK) == CORTEXM_EXC_RETURN_MASK)
+		exc_return = frame[offset++];
+	const bool fp_frame = exc_return && !(exc_return & CORTEXM_EXC_RETURN_STD_FRAME);
+	if (fp_frame) {
+		offset += CORTEXM_SW_FP_FRAME_WORDS;
+		words = offset + CORTEXM_HW_FRAME_WORDS;
+		if (target_mem_read(t, frame, sp, words * 4U))
+			return false;
+	}
+
+	memcpy(regs, frame + offset, 4U * 4U);
+	regs[12] = frame[offset + 4U];
+	regs[14] = frame[offset + 5U];
+	regs[15] = frame[offset + 6U];
+	regs[16] = frame[offset + 7U];
+	offset += CORTEXM_HW_FRAME_WORDS + (fp_frame ? CORTEXM_HW_FP_FRAME_WORDS : 0U);
+	regs[13] = sp + offset * 4U + (regs[16] & CORTEXM_XPSR_STACK_ALIGN ? 4U : 0U);
+	return true;
+}
+
+bool rtos_task_regs(target *const t, const uint32_t tcb, uint32_t *const regs)
+{
+	const rtos_task_s *const task = rtos_task_find(t, tcb);
+	if (!task)
+		return false;
+	if (rtos_regs_tcb != tcb) {
+		if (!freertos_unstack(t, task->top_of_stack, rtos_regs))
+			return false;
+		rtos_regs_tcb = tcb;
+	}
+	memcpy(regs, rtos_regs, sizeof(rtos_regs));
+	return true;
+}
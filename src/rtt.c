@@ -31,23 +31,43 @@
 #include "target/target_internal.h"
 #include "rtt.h"
 #include "rtt_if.h"
+#include "stats.h"
 
 bool rtt_enabled = false;
 bool rtt_found = false;
 static bool rtt_halt = false; // true if rtt needs to halt target to access memory
+static target *halt_target = NULL; // target found to need halting, as rtt memory access failed while it ran
 uint32_t rtt_cbaddr = 0;
+uint32_t rtt_symbol_addr = 0;
 bool rtt_auto_channel = true;
 struct rtt_channel_struct rtt_channel[MAX_RTT_CHAN];
 
 uint32_t rtt_min_poll_ms = 8;    /* 8 ms */
 uint32_t rtt_max_poll_ms = 256;  /* 0.256 s */
 uint32_t rtt_max_poll_errs = 10;
-static uint32_t poll_ms;
+/* shortest poll interval, what a min poll ms of 0 gets */
+#ifndef RTT_MIN_POLL_US
+#define RTT_MIN_POLL_US 100U
+#endif
+static uint32_t poll_us;
 static uint32_t poll_errs;
-static uint32_t last_poll_ms;
 /* flags for data from host to target */
 bool rtt_flag_skip = false;
 bool rtt_flag_block = false;
+/* data watchpoints on the up buffer write offsets */
+bool rtt_watch = false;
+static uint32_t watch_addr[MAX_RTT_CHAN];
+static uint32_t watch_count;
+static bool watch_tried;
+static bool polling_stopped; // polling from a watchpoint hit, with the target stopped
+/* throughput and loss, for sizing target buffers and poll intervals */
+struct rtt_stats_struct rtt_stats[MAX_RTT_CHAN];
+uint32_t rtt_polls;
+uint64_t rtt_poll_time_us;
+static uint32_t stats_last_poll_us;
+
+/* operating mode in the low bits of a channel's flags */
+#define RTT_MODE_BLOCK 2U
 
 typedef enum rtt_retval {
 	RTT_OK,
@@ -65,6 +85,24 @@ char rtt_ident[16] = {0};
 
 /* usb uart transmit buffer */
 static char xmit_buf[RTT_UP_BUF_SIZE];
+/* most an up channel is drained by in one poll, so a fast stream doesn't keep gdb waiting */
+#ifndef RTT_UP_DRAIN_MAX
+#define RTT_UP_DRAIN_MAX (16U * (RTT_UP_BUF_SIZE - 8U))
+#endif
+
+/* control block search reads, as big as the probe can comfortably spare */
+#ifndef RTT_SCAN_BUF_SIZE
+#if PC_HOSTED == 1
+#define RTT_SCAN_BUF_SIZE 4096U
+#else
+#define RTT_SCAN_BUF_SIZE 512U
+#endif
+#endif
+static uint32_t scan_buf[RTT_SCAN_BUF_SIZE / 4U];
+/* host input on its way to the target 'down' buffer */
+static char recv_buf[RTT_DOWN_BUF_SIZE];
+/* channel descriptors, as read in one go by each poll */
+static uint32_t chan_desc[MAX_RTT_CHAN * 6];
 
 /*********************************************************************
 *
@@ -73,98 +111,102 @@ static char xmit_buf[RTT_UP_BUF_SIZE];
 **********************************************************************
 */
 
-uint32_t fastsrch(target *cur_target)
+/* control block id when no rtt_ident is given, as the 16 byte acID field holds it */
+static const char rtt_default_id[16] = "SEGGER RTT";
+
+/* search one ram region for the pattern, which the control block always has 4 byte aligned */
+static uint32_t rtt_scan_region(target *cur_target, const struct target_ram *r, const uint8_t *pattern, size_t len)
 {
-	const uint32_t m = 16;
-	const uint64_t q = 0x797a9691; /* prime */
-	const uint64_t rm = 0x73b07d01;
-	const uint64_t p = 0x444110cd;
-	const uint32_t stride = 128;
-	uint64_t t = 0;
-	uint8_t srch_buf[m+stride];
-
-	for (struct target_ram *r = cur_target->ram; r; r = r->next) {
-		const uint32_t ram_start = r->start;
-		const uint32_t ram_end = r->start + r->length;
-
-		t = 0;
-		memset(srch_buf, 0, sizeof(srch_buf));
-
-		for (uint32_t addr = ram_start; addr < ram_end; addr += stride) {
-			uint32_t buf_siz = MIN(stride, ram_end - addr);
-			memcpy(srch_buf, srch_buf + stride, m);
-			if (target_mem_read(cur_target, srch_buf + m, addr, buf_siz)) {
-				gdb_outf("rtt: read fail at 0x%" PRIx32 "\r\n", addr);
-				return 0;
-			}
-			for (uint32_t i = 0; i < buf_siz; i++) {
-				t = (t + q - rm * srch_buf[i] % q) % q;
-				t = ((t << 8) + srch_buf[i + m]) % q;
-				if (p == t) {
-					uint32_t offset =  i - m + 1;
-					return addr + offset;
-				}
-			}
+	const uint32_t ram_start = (r->start + 3U) & ~3U;
+	const uint32_t ram_end = r->start + r->length;
+	/* consecutive reads overlap by the pattern length, so a match across them isn't missed */
+	const uint32_t step = sizeof(scan_buf) - ((len + 3U) & ~3U);
+	uint32_t first_word;
+	memcpy(&first_word, pattern, sizeof(first_word));
+
+	for (uint32_t addr = ram_start; addr < ram_end && ram_end - addr >= len; addr += step) {
+		const uint32_t buf_siz = MIN(ram_end - addr, sizeof(scan_buf));
+		if (target_background_mem_read(cur_target, scan_buf, addr, buf_siz)) {
+			gdb_outf("rtt: read fail at 0x%" PRIx32 "\r\n", addr);
+			continue;
+		}
+		const uint8_t *const bytes = (const uint8_t *)scan_buf;
+		for (uint32_t offset = 0; offset + len <= buf_siz; offset += 4U) {
+			if ((len < 4U || scan_buf[offset / 4U] == first_word) && memcmp(bytes + offset, pattern, len) == 0)
+				return addr + offset;
 		}
+		if (buf_siz < sizeof(scan_buf))
+			break;
 	}
-	/* no match */
 	return 0;
 }
 
-uint32_t memsrch(target *cur_target)
+/* search ram for the control block, starting with the region it was last found in */
+static uint32_t rtt_scan(target *cur_target)
 {
-	char *srch_str = rtt_ident;
-	uint32_t srch_str_len = strlen(srch_str);
-	uint8_t srch_buf[128];
-
-	if (srch_str_len == 0 || srch_str_len > sizeof(srch_buf) / 2)
-		return 0;
+	uint8_t pattern[sizeof(rtt_default_id)] = {0};
+	size_t len;
+	if (rtt_ident[0] == 0) {
+		memcpy(pattern, rtt_default_id, sizeof(pattern));
+		len = sizeof(pattern);
+	} else {
+		len = strnlen(rtt_ident, sizeof(rtt_ident));
+		memcpy(pattern, rtt_ident, len);
+	}
 
-	if (rtt_cbaddr && !target_mem_read(cur_target, srch_buf, rtt_cbaddr, srch_str_len)
-		&& strncmp((const char *)(srch_buf), srch_str, srch_str_len) == 0)
+	if (rtt_cbaddr && !target_background_mem_read(cur_target, scan_buf, rtt_cbaddr, len) && memcmp(scan_buf, pattern, len) == 0)
 		/* still at same place */
 		return rtt_cbaddr;
 
-	for (struct target_ram *r = cur_target->ram; r; r = r->next) {
-		uint32_t ram_end = r->start + r->length;
-		for (uint32_t addr = r->start; addr < ram_end; addr += sizeof(srch_buf) - srch_str_len - 1) {
-			uint32_t buf_siz = MIN(ram_end - addr, sizeof(srch_buf));
-			if (target_mem_read(cur_target, srch_buf, addr, buf_siz)) {
-				gdb_outf("rtt: read fail at 0x%" PRIx32 "\r\n", addr);
-				continue;
-			}
-			for (uint32_t offset = 0; offset + srch_str_len + 1 < buf_siz; offset++) {
-				if (strncmp((const char *)(srch_buf + offset), srch_str, srch_str_len) == 0) {
-					uint32_t cb_addr = addr + offset;
-					return cb_addr;
-				}
-			}
-		}
+	const struct target_ram *last = NULL;
+	for (const struct target_ram *r = cur_target->ram; r; r = r->next) {
+		if (rtt_cbaddr >= r->start && rtt_cbaddr - r->start < r->length)
+			last = r;
 	}
-	return 0;
+	uint32_t cb_addr = last ? rtt_scan_region(cur_target, last, pattern, len) : 0;
+	for (const struct target_ram *r = cur_target->ram; r && !cb_addr; r = r->next) {
+		if (r != last)
+			cb_addr = rtt_scan_region(cur_target, r, pattern, len);
+	}
+	return cb_addr;
+}
+
+/* check the control block is where GDB's symbol lookup said, once the target has set it up */
+static uint32_t symsrch(target *cur_target)
+{
+	const char *srch_str = rtt_ident[0] ? rtt_ident : rtt_default_id;
+	const size_t srch_str_len = strlen(srch_str);
+	char srch_buf[sizeof(rtt_ident)];
+
+	if (target_background_mem_read(cur_target, srch_buf, rtt_symbol_addr, srch_str_len) ||
+		strncmp(srch_buf, srch_str, srch_str_len) != 0)
+		return 0;
+	return rtt_symbol_addr;
 }
 
 static void find_rtt(target *cur_target)
 {
 	rtt_found = false;
-	poll_ms = rtt_max_poll_ms;
+	/* the control block may have moved, so may the write offsets */
+	rtt_watch_disarm(cur_target);
+	poll_us = rtt_max_poll_ms * 1000U;
 	poll_errs = 0;
-	last_poll_ms = 0;
 
 	if (!cur_target || !rtt_enabled)
 		return;
 
-	if (rtt_ident[0] == 0)
-		rtt_cbaddr = fastsrch(cur_target);
+	/* only scan memory when GDB couldn't tell us where the control block is */
+	if (rtt_symbol_addr)
+		rtt_cbaddr = symsrch(cur_target);
 	else
-		rtt_cbaddr = memsrch(cur_target);
+		rtt_cbaddr = rtt_scan(cur_target);
 	DEBUG_INFO("rtt: match at 0x%" PRIx32 "\r\n", rtt_cbaddr);
 
 	if (rtt_cbaddr) {
 		uint32_t num_buf[2];
 		int32_t num_up_buf;
 		int32_t num_down_buf;
-		if (target_mem_read(cur_target, num_buf, rtt_cbaddr + 16, sizeof(num_buf)))
+		if (target_background_mem_read(cur_target, num_buf, rtt_cbaddr + 16, sizeof(num_buf)))
 			return;
 		num_up_buf = num_buf[0];
 		num_down_buf = num_buf[1];
@@ -189,7 +231,7 @@ static void find_rtt(target *cur_target)
 
 			if (i >= num_up_buf + num_down_buf)
 				continue;
-			if (target_mem_read(cur_target, buf_desc, rtt_cbaddr + 24 + i * 24, sizeof(buf_desc)))
+			if (target_background_mem_read(cur_target, buf_desc, rtt_cbaddr + 24 + i * 24, sizeof(buf_desc)))
 				return;
 			rtt_channel[i].is_output = i < num_up_buf;
 			rtt_channel[i].buf_addr = buf_desc[1];
@@ -233,44 +275,47 @@ static void find_rtt(target *cur_target)
 **********************************************************************
 */
 
-/* poll if host has new data for target */
-static rtt_retval read_rtt(target *cur_target, uint32_t i)
+/* poll if host has new data for target, head_tail is as read from the channel's descriptor */
+static rtt_retval read_rtt(target *cur_target, uint32_t i, const uint32_t *head_tail)
 {
-	uint32_t head_tail[2];
 	uint32_t buf_head;
 	uint32_t buf_tail;
-	uint32_t next_head;
 	int ch;
 
 	/* copy data from recv_buf to target rtt 'down' buffer */
-	if (rtt_nodata())
+	if (rtt_nodata(i))
 		return RTT_IDLE;
 
 	if (cur_target == NULL || rtt_channel[i].is_output || rtt_channel[i].buf_addr == 0 || rtt_channel[i].buf_size == 0)
 		return RTT_IDLE;
 
-	/* read down buffer head and tail from target */
-	if (target_mem_read(cur_target, head_tail, rtt_channel[i].head_addr, sizeof(head_tail)))
-		return RTT_ERR;
-
 	buf_head = head_tail[0];
 	buf_tail = head_tail[1];
 
 	if (buf_head >= rtt_channel[i].buf_size || buf_tail >= rtt_channel[i].buf_size)
 		return RTT_ERR;
 
-	/* write recv_buf to target rtt 'down' buf */
-	while ((next_head = ((buf_head + 1) % rtt_channel[i].buf_size)) != buf_tail && (ch = rtt_getchar()) != -1) {
-		if (target_mem_write(cur_target, rtt_channel[i].buf_addr + buf_head, &ch, 1))
-			return RTT_ERR;
+	/* gather as much host input as the 'down' buffer has room for */
+	const uint32_t bytes_free = (buf_tail + rtt_channel[i].buf_size - buf_head - 1) % rtt_channel[i].buf_size;
+	uint32_t bytes_recv = 0;
+	while (bytes_recv < MIN(bytes_free, sizeof(recv_buf)) && (ch = rtt_getchar(i)) != -1)
+		recv_buf[bytes_recv++] = ch;
+	if (bytes_recv == 0)
+		return RTT_IDLE;
 
-		/* advance pointers */
-		buf_head = next_head;
-	}
+	/* write it to target rtt 'down' buf, in two pieces if it wraps */
+	const uint32_t len = MIN(bytes_recv, rtt_channel[i].buf_size - buf_head);
+	if (target_background_mem_write(cur_target, rtt_channel[i].buf_addr + buf_head, recv_buf, len))
+		return RTT_ERR;
+	if (len < bytes_recv && target_background_mem_write(cur_target, rtt_channel[i].buf_addr, recv_buf + len, bytes_recv - len))
+		return RTT_ERR;
+	buf_head = (buf_head + bytes_recv) % rtt_channel[i].buf_size;
 
 	/* update head of target 'down' buffer */
-	if (target_mem_write(cur_target, rtt_channel[i].head_addr, &buf_head, sizeof(buf_head)))
+	if (target_background_mem_write(cur_target, rtt_channel[i].head_addr, &buf_head, sizeof(buf_head)))
 		return RTT_ERR;
+	rtt_stats[i].bytes += bytes_recv;
+	stats_add(STATS_RTT_DOWN_BYTES, bytes_recv);
 	return RTT_OK;
 }
 
@@ -282,30 +327,8 @@ static rtt_retval read_rtt(target *cur_target, uint32_t i)
 **********************************************************************
 */
 
-/* target_mem_read, word aligned for speed.
-   note: dest has to be len + 8 bytes, to allow for alignment and padding.
- */
-int target_aligned_mem_read(target *t, void *dest, target_addr_t src, size_t len)
-{
-	uint32_t src0 = src;
-	uint32_t len0 = len;
-	uint32_t offset = src & 0x3;
-	src0 -= offset;
-	len0 += offset;
-	if ((len0 & 0x3) != 0)
-		len0 = (len0 + 4) & ~0x3;
-
-	if (src0 == src && len0 == len)
-		return target_mem_read(t, dest, src, len);
-	else {
-		uint32_t retval = target_mem_read(t, dest, src0, len0);
-		memmove(dest, dest + offset, len);
-		return retval;
-	}
-}
-
-/* poll if target has new data for host */
-static rtt_retval print_rtt(target *cur_target, uint32_t i)
+/* poll if target has new data for host, head_tail is as read from the channel's descriptor */
+static rtt_retval print_rtt(target *cur_target, uint32_t i, const uint32_t *head_tail)
 {
 	uint32_t head;
 	uint32_t tail;
@@ -313,9 +336,6 @@ static rtt_retval print_rtt(target *cur_target, uint32_t i)
 	if (!cur_target || !rtt_channel[i].is_output || rtt_channel[i].buf_addr == 0 || rtt_channel[i].head_addr == 0)
 		return RTT_IDLE;
 
-	uint32_t head_tail[2];
-	if (target_mem_read(cur_target, head_tail, rtt_channel[i].head_addr, sizeof(head_tail)))
-		return RTT_ERR;
 	head = head_tail[0];
 	tail = head_tail[1];
 
@@ -324,37 +344,48 @@ static rtt_retval print_rtt(target *cur_target, uint32_t i)
 	else if (head == tail)
 		return RTT_IDLE;
 
-	uint32_t bytes_free = sizeof(xmit_buf) - 8; /* need 8 bytes for alignment and padding */
-	uint32_t bytes_read = 0;
+	const bool blocking = (rtt_channel[i].flag & 3U) == RTT_MODE_BLOCK;
+	uint32_t bytes_total = 0;
+
+	/* keep draining while the target has data and the host can take it, xmit_buf at a time */
+	while (head != tail && bytes_total < RTT_UP_DRAIN_MAX) {
+		uint32_t bytes_free = sizeof(xmit_buf);
+		/* a channel in blocking mode keeps its data until the host can take it, so the target waits.
+		   once something went out, the other modes stop at a full host side too rather than drop */
+		if (blocking || bytes_total != 0) {
+			bytes_free = MIN(bytes_free, rtt_write_space(i));
+			if (bytes_free == 0)
+				break;
+		}
 
-	if (tail > head) {
-		uint32_t len = rtt_channel[i].buf_size - tail;
+		/* up to the end of the buffer if the data wraps, the next round gets the rest */
+		uint32_t len = (tail > head ? rtt_channel[i].buf_size : head) - tail;
 		if (len > bytes_free)
 			len = bytes_free;
-		if (target_aligned_mem_read(cur_target, xmit_buf + bytes_read, rtt_channel[i].buf_addr + tail, len))
+		if (target_background_mem_read(cur_target, xmit_buf, rtt_channel[i].buf_addr + tail, len))
 			return RTT_ERR;
-		bytes_free -= len;
-		bytes_read += len;
 		tail = (tail + len) % rtt_channel[i].buf_size;
-	}
 
-	if (head > tail && bytes_free > 0) {
-		uint32_t len = head - tail;
-		if (len > bytes_free)
-			len = bytes_free;
-		if (target_aligned_mem_read(cur_target, xmit_buf + bytes_read, rtt_channel[i].buf_addr + tail, len))
+		/* update tail on target, so it can refill what was taken while the host gets it */
+		if (target_background_mem_write(cur_target, rtt_channel[i].tail_addr, &tail, sizeof(tail)))
 			return RTT_ERR;
-		bytes_read += len;
-		tail = (tail + len) % rtt_channel[i].buf_size;
-	}
-
-	/* update tail on target */
-	if (target_mem_write(cur_target, rtt_channel[i].tail_addr, &tail, sizeof(tail)))
-		return RTT_ERR;
 
-	/* write buffer to usb */
-	rtt_write(xmit_buf, bytes_read);
+		/* write buffer to usb */
+		if (rtt_write(i, xmit_buf, len) < len)
+			rtt_host_overflow(i);
+		rtt_stats[i].bytes += len;
+		stats_add(STATS_RTT_UP_BYTES, len);
+		bytes_total += len;
+
+		/* caught up, see if the target has written more meanwhile */
+		if (head == tail && bytes_total < RTT_UP_DRAIN_MAX &&
+			(target_background_mem_read(cur_target, &head, rtt_channel[i].head_addr, sizeof(head)) ||
+			head >= rtt_channel[i].buf_size))
+			break;
+	}
 
+	if (bytes_total == 0)
+		return RTT_IDLE;
 	return RTT_OK;
 }
 
@@ -371,10 +402,96 @@ static rtt_retval print_rtt(target *cur_target, uint32_t i)
 
 bool target_no_background_memory_access(target *cur_target)
 {
-	/* if error message is 'rtt: read fail at' add target to expression below.
-	   As a first approximation, assume all arm processors allow memory access while running, and no riscv does. */
-	bool riscv_core = cur_target && target_core_name(cur_target) && strstr(target_core_name(cur_target), "RVDBG");
-	return riscv_core;
+	if (!cur_target)
+		return false;
+	/* a target with a second way into memory, such as a system AP, is read through that instead */
+	if (target_has_background_mem_access(cur_target))
+		return false;
+	/* As a first approximation, assume all arm processors allow memory access while running, and no riscv does.
+	   Anything else found to fail while running is halted for as a last resort, see poll_rtt(). */
+	bool riscv_core = target_core_name(cur_target) && strstr(target_core_name(cur_target), "RVDBG");
+	return riscv_core || cur_target == halt_target;
+}
+
+/*********************************************************************
+*
+*       rtt watchpoints
+*
+**********************************************************************
+*/
+
+/* rtt_watch arms a write watchpoint on each enabled up channel's write offset, so rather than
+   waiting for the next poll, the target stops as soon as it has logged something. The poll
+   then only has to pick up host to target data, and goes at the slowest rate. */
+
+void rtt_watch_disarm(target *cur_target)
+{
+	for (uint32_t i = 0; cur_target && i < watch_count; i++)
+		target_breakwatch_clear(cur_target, TARGET_WATCH_WRITE, watch_addr[i], sizeof(uint32_t));
+	watch_count = 0;
+	watch_tried = false;
+}
+
+static void rtt_watch_arm(target *cur_target)
+{
+	watch_tried = true;
+	for (uint32_t i = 0; i < MAX_RTT_CHAN; i++) {
+		if (!rtt_channel[i].is_enabled || !rtt_channel[i].is_configured || !rtt_channel[i].is_output)
+			continue;
+		if (target_breakwatch_set(cur_target, TARGET_WATCH_WRITE, rtt_channel[i].head_addr, sizeof(uint32_t))) {
+			gdb_out("rtt: out of watchpoints, polling\r\n");
+			rtt_watch_disarm(cur_target);
+			/* don't keep trying until the control block is found anew */
+			watch_tried = true;
+			return;
+		}
+		watch_addr[watch_count++] = rtt_channel[i].head_addr;
+	}
+}
+
+/* called when the target stops on a watchpoint: if it is one of ours, service rtt and let the
+   target carry on, returning true so the stop isn't reported */
+bool rtt_watch_hit(target *cur_target, target_addr_t watch)
+{
+	if (!rtt_enabled || !rtt_found)
+		return false;
+	uint32_t i = 0;
+	while (i < watch_count && watch_addr[i] != watch)
+		i++;
+	if (i == watch_count)
+		return false;
+	polling_stopped = true;
+	poll_rtt(cur_target);
+	polling_stopped = false;
+	target_halt_resume(cur_target, false);
+	return true;
+}
+
+/*********************************************************************
+*
+*       rtt statistics
+*
+**********************************************************************
+*/
+
+void rtt_host_overflow(uint32_t channel)
+{
+	/* host input isn't split by channel everywhere, count it against the first down channel in use */
+	for (uint32_t i = 0; channel == RTT_DOWN_ANY && i < MAX_RTT_CHAN; i++) {
+		if (rtt_channel[i].is_enabled && rtt_channel[i].is_configured && !rtt_channel[i].is_output)
+			channel = i;
+	}
+	if (channel < MAX_RTT_CHAN)
+		rtt_stats[channel].overflows++;
+	stats_add(STATS_RTT_HOST_OVERFLOWS, 1);
+}
+
+void rtt_stats_reset(void)
+{
+	memset(rtt_stats, 0, sizeof(rtt_stats));
+	rtt_polls = 0;
+	rtt_poll_time_us = 0;
+	stats_last_poll_us = 0;
 }
 
 /*********************************************************************
@@ -384,73 +501,109 @@ bool target_no_background_memory_access(target *cur_target)
 **********************************************************************
 */
 
-void poll_rtt(target *cur_target)
+uint32_t poll_rtt(target *cur_target)
 {
 	/* rtt off */
 	if (!cur_target || !rtt_enabled)
-		return;
+		return RTT_MIN_POLL_US;
 	/* target present and rtt enabled */
-	uint32_t now = platform_time_ms();
+	const uint32_t now = platform_time_us();
 	bool rtt_err = false;
 	bool rtt_busy = false;
 
-	if (last_poll_ms + poll_ms <= now || now < last_poll_ms) {
-		target_addr_t watch;
-		enum target_halt_reason reason;
-		bool resume_target = false;
-		if (!rtt_found)
-			/* check if target needs to be halted during memory access */
-			rtt_halt = target_no_background_memory_access(cur_target);
-		if (rtt_halt && target_halt_poll(cur_target, &watch) == TARGET_HALT_RUNNING) {
-			/* briefly halt target during target memory access */
-			target_halt_request(cur_target);
-			while((reason = target_halt_poll(cur_target, &watch)) == TARGET_HALT_RUNNING)
-				continue;
-			resume_target = reason == TARGET_HALT_REQUEST;
+	target_addr_t watch;
+	enum target_halt_reason reason;
+	bool resume_target = false;
+	if (!rtt_found)
+		/* check if target needs to be halted during memory access */
+		rtt_halt = target_no_background_memory_access(cur_target);
+	if (rtt_halt && target_halt_poll(cur_target, &watch) == TARGET_HALT_RUNNING) {
+		/* briefly halt target during target memory access */
+		target_halt_request(cur_target);
+		while((reason = target_halt_poll(cur_target, &watch)) == TARGET_HALT_RUNNING)
+			continue;
+		resume_target = reason == TARGET_HALT_REQUEST;
+	}
+	if (!rtt_found)
+		/* find rtt control block in target memory */
+		find_rtt(cur_target);
+	if (rtt_found && rtt_watch && !watch_tried)
+		rtt_watch_arm(cur_target);
+	/* do rtt i/o if control block found */
+	if (rtt_found) {
+		/* one read of the descriptors of all channels in use gets every head and tail */
+		uint32_t first = MAX_RTT_CHAN;
+		uint32_t last = 0;
+		for (uint32_t i = 0; i < MAX_RTT_CHAN; i++) {
+			if (rtt_channel[i].is_enabled && rtt_channel[i].is_configured) {
+				first = MIN(first, i);
+				last = i;
+			}
 		}
-		if (!rtt_found)
-			/* find rtt control block in target memory */
-			find_rtt(cur_target);
-		/* do rtt i/o if control block found */
-		if (rtt_found) {
-			for (uint32_t i = 0; i < MAX_RTT_CHAN; i++) {
+		if (first <= last &&
+			target_background_mem_read(cur_target, chan_desc, rtt_cbaddr + 24 + first * 24, (last - first + 1) * 24)) {
+			rtt_err = true;
+			rtt_stats[first].errors++;
+		} else {
+			for (uint32_t i = first; i <= last && i < MAX_RTT_CHAN; i++) {
 				rtt_retval v;
 				if (rtt_channel[i].is_enabled && rtt_channel[i].is_configured) {
+					/* WrOff and RdOff, words 3 and 4 of the 6 word descriptor */
+					const uint32_t *head_tail = chan_desc + (i - first) * 6 + 3;
 					if (rtt_channel[i].is_output)
-						v = print_rtt(cur_target, i);
+						v = print_rtt(cur_target, i, head_tail);
 					else
-						v = read_rtt(cur_target, i);
+						v = read_rtt(cur_target, i, head_tail);
+					rtt_stats[i].polls++;
 					if (v == RTT_OK) rtt_busy = true;
-					else if (v == RTT_ERR) rtt_err = true;
+					else if (v == RTT_ERR) {
+						rtt_err = true;
+						rtt_stats[i].errors++;
+					} else
+						rtt_stats[i].empty_polls++;
 				}
 			}
 		}
-		/* continue target if halted */
-		if (resume_target)
-			target_halt_resume(cur_target, false);
-
-		/* update last poll time */
-		last_poll_ms = now;
-
-		/* rtt polling frequency goes up and down with rtt activity */
-		if (rtt_busy && !rtt_err)
-			poll_ms /= 2;
-		else
-			poll_ms *= 2;
-
-		if (poll_ms > rtt_max_poll_ms)
-			poll_ms = rtt_max_poll_ms;
-		else if (poll_ms < rtt_min_poll_ms)
-			poll_ms = rtt_min_poll_ms;
-
-		if (rtt_err) {
-			gdb_out("rtt: err\r\n");
-			poll_errs++;
-			if (rtt_max_poll_errs != 0 && poll_errs > rtt_max_poll_errs) {
-				gdb_out("\r\nrtt lost\r\n");
-				rtt_enabled = false;
-			}
+	}
+	/* continue target if halted */
+	if (resume_target)
+		target_halt_resume(cur_target, false);
+
+	if (rtt_found) {
+		if (rtt_polls)
+			rtt_poll_time_us += now - stats_last_poll_us;
+		stats_last_poll_us = now;
+		rtt_polls++;
+		stats_add(STATS_RTT_POLLS, 1);
+	}
+
+	/* rtt polling frequency goes up and down with rtt activity */
+	if (rtt_busy && !rtt_err)
+		poll_us /= 2;
+	else
+		poll_us *= 2;
+
+	/* with watchpoints armed, up data doesn't wait for the next poll */
+	const uint32_t min_poll_us = MAX(rtt_min_poll_ms * 1000U, RTT_MIN_POLL_US);
+	if (poll_us > rtt_max_poll_ms * 1000U || watch_count)
+		poll_us = rtt_max_poll_ms * 1000U;
+	else if (poll_us < min_poll_us)
+		poll_us = min_poll_us;
+
+	if (rtt_err && !rtt_halt && !polling_stopped && !target_has_background_mem_access(cur_target)) {
+		/* memory could not be accessed with the target running, halt it for the polls from now on */
+		gdb_out("rtt: memory access failed while running, halting target to poll\r\n");
+		halt_target = cur_target;
+		rtt_halt = true;
+	}
+	if (rtt_err) {
+		gdb_out("rtt: err\r\n");
+		poll_errs++;
+		if (rtt_max_poll_errs != 0 && poll_errs > rtt_max_poll_errs) {
+			gdb_out("\r\nrtt lost\r\n");
+			rtt_enabled = false;
 		}
 	}
-	return;
+	/* poll again sooner with a channel busy, later with every channel idle */
+	return poll_us;
 }
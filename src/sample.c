@@ -0,0 +1,153 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * IDE live watch windows poll variables with GDB m packets, each a round trip
+ * through GDB and the probe. Here the probe keeps the list of ranges and reads
+ * them on its own schedule while the target runs, all that are due in one
+ * target_mem_readv() batch, and streams the values out timestamped.
+ */
+
+#include "general.h"
+#include "platform.h"
+#include "target.h"
+#include "hex_utils.h"
+#include "rtt_if.h"
+#include "sample.h"
+
+/* How often to look for work with no ranges, and the shortest period taken */
+#define SAMPLE_IDLE_US       10000U
+#define SAMPLE_MIN_PERIOD_US 100U
+
+static sample_range_s sample_range[SAMPLE_MAX_RANGES];
+static uint32_t sample_due[SAMPLE_MAX_RANGES];
+static uint8_t sample_data[SAMPLE_MAX_RANGES][SAMPLE_MAX_LEN];
+static size_t sample_count;
+
+bool sample_add(const target_addr_t addr, const size_t len, const uint32_t period_us)
+{
+	if (!len || len > SAMPLE_MAX_LEN)
+		return false;
+	size_t i = 0;
+	while (i < sample_count && (sample_range[i].addr != addr || sample_range[i].len != len))
+		++i;
+	if (i == SAMPLE_MAX_RANGES)
+		return false;
+	if (i == sample_count) {
+		memset(&sample_range[i], 0, sizeof(sample_range[i]));
+		sample_range[i].addr = addr;
+		sample_range[i].len = len;
+		++sample_count;
+	}
+	sample_range[i].period_us = MAX(period_us, SAMPLE_MIN_PERIOD_US);
+	sample_due[i] = platform_time_us();
+	return true;
+}
+
+void sample_clear(void)
+{
+	sample_count = 0;
+}
+
+size_t sample_ranges(const sample_range_s **const ranges)
+{
+	*ranges = sample_range;
+	return sample_count;
+}
+
+static void sample_send(sample_range_s *const range, const uint8_t *const data, const uint32_t time_us)
+{
+	char line[32U + SAMPLE_MAX_LEN * 2U];
+	int len = snprintf(line, sizeof(line), "%" PRIu32 " %08" PRIx32 " ", time_us, range->addr);
+	hexify(line + len, data, range->len);
+	len += (int)range->len * 2;
+	line[len++] = '\n';
+	/* A line that can't go out whole is lost rather than waited for */
+	if (rtt_write_space(SAMPLE_CHANNEL) < (uint32_t)len || rtt_write(SAMPLE_CHANNEL, line, len) < (uint32_t)len)
+		++range->dropped;
+	else
+		++range->samples;
+}
+
+/* Reads the ranges listed in index, briefly halting the target if it can't be read while running */
+static void sample_read(target *const t, const target_iovec_s *const iov, const size_t *const index,
+	const size_t count, const uint32_t time_us)
+{
+	bool resume = false;
+	if (target_no_background_memory_access(t)) {
+		target_addr_t watch;
+		if (target_halt_poll(t, &watch) == TARGET_HALT_RUNNING) {
+			target_halt_request(t);
+			enum target_halt_reason reason;
+			while ((reason = target_halt_poll(t, &watch)) == TARGET_HALT_RUNNING)
+				continue;
+			resume = reason == TARGET_HALT_REQUEST;
+		}
+	}
+
+	bool failed[SAMPLE_MAX_RANGES] = {false};
+	if (target_has_background_mem_access(t)) {
+		for (size_t i = 0; i < count; ++i)
+			failed[i] = target_background_mem_read(t, iov[i].dest, iov[i].src, iov[i].len) != 0;
+	} else if (target_mem_readv(t, iov, count)) {
+		for (size_t i = 0; i < count; ++i)
+			failed[i] = true;
+	}
+
+	if (resume)
+		target_halt_resume(t, false);
+
+	for (size_t i = 0; i < count; ++i) {
+		sample_range_s *const range = &sample_range[index[i]];
+		if (failed[i])
+			++range->errors;
+		else
+			sample_send(range, iov[i].dest, time_us);
+	}
+}
+
+uint32_t poll_sample(target *const t)
+{
+	if (!t || !sample_count)
+		return SAMPLE_IDLE_US;
+
+	const uint32_t now = platform_time_us();
+	target_iovec_s iov[SAMPLE_MAX_RANGES];
+	size_t index[SAMPLE_MAX_RANGES];
+	size_t count = 0;
+	for (size_t i = 0; i < sample_count; ++i) {
+		if ((int32_t)(sample_due[i] - now) > 0)
+			continue;
+		iov[count].dest = sample_data[i];
+		iov[count].src = sample_range[i].addr;
+		iov[count].len = sample_range[i].len;
+		index[count++] = i;
+		/* Keep to the schedule, but a late poll doesn't make up for the samples it missed */
+		const uint32_t next = sample_due[i] + sample_range[i].period_us;
+		sample_due[i] = (int32_t)(next - now) > 0 ? next : now + sample_range[i].period_us;
+	}
+	if (count)
+		sample_read(t, iov, index, count, now);
+
+	const uint32_t after = platform_time_us();
+	uint32_t wait = SAMPLE_IDLE_US;
+	for (size_t i = 0; i < sample_count; ++i) {
+		const int32_t left = (int32_t)(sample_due[i] - after);
+		wait = MIN(wait, left > 0 ? (uint32_t)left : 0U);
+	}
+	return wait;
+}
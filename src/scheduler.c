@@ -0,0 +1,108 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * Copyright (C) 2022  Black Sphere Technologies Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* This file implements a small cooperative scheduler for the work done in the
+ * background of the GDB server. Tasks are run from the loops that wait on the
+ * target or on GDB, each one at the cadence it asks for, timed in microseconds
+ * so that fast pollers aren't held to the millisecond tick.
+ */
+
+#include "general.h"
+#include "scheduler.h"
+
+typedef struct scheduler_task {
+	scheduler_task_fn run;
+	uint32_t due_us;
+} scheduler_task_s;
+
+static scheduler_task_s scheduler_tasks[SCHEDULER_MAX_TASKS];
+
+void scheduler_add(const scheduler_task_fn task)
+{
+	scheduler_task_s *slot = NULL;
+	for (size_t i = 0; i < SCHEDULER_MAX_TASKS; ++i) {
+		if (scheduler_tasks[i].run == task) {
+			slot = &scheduler_tasks[i];
+			break;
+		}
+		if (!slot && !scheduler_tasks[i].run)
+			slot = &scheduler_tasks[i];
+	}
+	if (!slot)
+		return;
+	slot->run = task;
+	slot->due_us = platform_time_us();
+}
+
+void scheduler_remove(const scheduler_task_fn task)
+{
+	for (size_t i = 0; i < SCHEDULER_MAX_TASKS; ++i) {
+		if (scheduler_tasks[i].run == task)
+			scheduler_tasks[i].run = NULL;
+	}
+}
+
+/*
+ * Most overdue task first, so under load the one that's been kept waiting longest goes next.
+ * Each task runs at most once per call, one asking to run again right away can't starve the rest.
+ */
+void scheduler_run(void)
+{
+	bool ran[SCHEDULER_MAX_TASKS] = {false};
+	while (true) {
+		const uint32_t now = platform_time_us();
+		size_t next = SCHEDULER_MAX_TASKS;
+		int32_t next_overdue = 0;
+		for (size_t i = 0; i < SCHEDULER_MAX_TASKS; ++i) {
+			/* the difference taken as signed keeps the comparison right across the wrap */
+			const int32_t overdue = (int32_t)(now - scheduler_tasks[i].due_us);
+			if (!scheduler_tasks[i].run || ran[i] || overdue < 0)
+				continue;
+			if (next == SCHEDULER_MAX_TASKS || overdue > next_overdue) {
+				next = i;
+				next_overdue = overdue;
+			}
+		}
+		if (next == SCHEDULER_MAX_TASKS)
+			return;
+		ran[next] = true;
+		scheduler_task_s *const task = &scheduler_tasks[next];
+		const uint32_t delay_us = task->run();
+		task->due_us = platform_time_us() + MIN(delay_us, (uint32_t)INT32_MAX);
+	}
+}
+
+bool scheduler_yield(void)
+{
+	scheduler_run();
+	return scheduler_next_us() >= SYSTICKMS * 1000U;
+}
+
+uint32_t scheduler_next_us(void)
+{
+	const uint32_t now = platform_time_us();
+	uint32_t next = UINT32_MAX;
+	for (size_t i = 0; i < SCHEDULER_MAX_TASKS; ++i) {
+		if (!scheduler_tasks[i].run)
+			continue;
+		const int32_t left = (int32_t)(scheduler_tasks[i].due_us - now);
+		next = MIN(next, left > 0 ? (uint32_t)left : 0U);
+	}
+	return next;
+}
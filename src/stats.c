@@ -0,0 +1,199 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * Copyright (C) 2022  Black Sphere Technologies Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* This file implements lightweight performance counters for the GDB server:
+ * per packet type counts, latencies and a latency histogram, plus the number
+ * of bytes moved over the GDB link, to and from target memory and into flash.
+ */
+
+#include "general.h"
+#include "gdb_packet.h"
+#include "stats.h"
+
+#if PC_HOSTED == 1
+#include "metrics_if.h"
+#define STATS_TIMESTAMP_UNIT "us"
+#elif defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__)
+#include <libopencm3/cm3/dwt.h>
+#define STATS_TIMESTAMP_UNIT "cycles"
+#else
+/* No cycle counter on ARMv6-M, fall back to the interpolated microsecond count */
+#define STATS_TIMESTAMP_UNIT "us"
+#endif
+
+static stats_s stats;
+
+/* The packet being handled, the handler reuses the packet buffer so keep its name here */
+static char stats_current_name[STATS_PACKET_NAME_LENGTH];
+static size_t stats_current_length;
+static uint32_t stats_current_start;
+
+static const char *const stats_counter_names[STATS_COUNTER_COUNT] = {
+	[STATS_GDB_RX_BYTES] = "GDB bytes received",
+	[STATS_GDB_TX_BYTES] = "GDB bytes sent",
+	[STATS_MEM_READ_BYTES] = "Memory bytes read",
+	[STATS_MEM_WRITE_BYTES] = "Memory bytes written",
+	[STATS_MEM_CACHED_BYTES] = "Memory bytes cached",
+	[STATS_FLASH_ERASE_BYTES] = "Flash bytes erased",
+	[STATS_FLASH_WRITE_BYTES] = "Flash bytes written",
+	[STATS_FLASH_SKIPPED_BYTES] = "Flash bytes left unchanged",
+	[STATS_FLASH_VERIFY_BYTES] = "Flash bytes verified",
+	[STATS_FLASH_BUSY_POLLS] = "Flash status polls",
+	[STATS_FLASH_BUSY_US] = "Flash busy wait in us",
+	[STATS_DP_WAIT] = "DP WAIT responses",
+	[STATS_DP_FAULT] = "DP FAULT responses",
+	[STATS_DP_RETRY_EXHAUSTED] = "DP retries exhausted",
+	[STATS_RTT_UP_BYTES] = "RTT bytes up",
+	[STATS_RTT_DOWN_BYTES] = "RTT bytes down",
+	[STATS_RTT_POLLS] = "RTT polls",
+	[STATS_RTT_HOST_OVERFLOWS] = "RTT host overflows",
+	[STATS_AUX_UART_RX_BYTES] = "Aux UART bytes received",
+	[STATS_AUX_UART_OVERRUNS] = "Aux UART overruns",
+	[STATS_AUX_UART_DROPPED_BYTES] = "Aux UART bytes dropped",
+	[STATS_SWO_BYTES] = "SWO bytes captured",
+	[STATS_SWO_ERRORS] = "SWO transfer errors",
+};
+
+uint32_t stats_timestamp(void)
+{
+#if PC_HOSTED == 1
+	return platform_time_us();
+#elif defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__)
+	static bool counter_running = false;
+	if (!counter_running)
+		counter_running = dwt_enable_cycle_counter();
+	return dwt_read_cycle_counter();
+#else
+	return platform_time_us();
+#endif
+}
+
+void stats_add(const stats_counter_e counter, const uint32_t value)
+{
+	stats.counters[counter] += value;
+}
+
+/*
+ * Packets are grouped by their letter, q/Q/v packets by their name up to the first
+ * separator so that qXfer or vFlashWrite get their own entry.
+ */
+static size_t stats_packet_name(char *const name, const char *const packet, const size_t length)
+{
+	if (!length)
+		return 0;
+	if (packet[0] != 'q' && packet[0] != 'Q' && packet[0] != 'v') {
+		name[0] = packet[0];
+		return 1;
+	}
+	size_t name_length = 0;
+	while (name_length < length && name_length < STATS_PACKET_NAME_LENGTH - 1U &&
+		!strchr(":,;?", packet[name_length]))
+		++name_length;
+	memcpy(name, packet, name_length);
+	return name_length;
+}
+
+void stats_packet_begin(const char *const packet, const size_t length)
+{
+	memset(stats_current_name, 0, sizeof(stats_current_name));
+	stats_packet_name(stats_current_name, packet, length);
+	stats_current_length = length;
+	stats_current_start = stats_timestamp();
+}
+
+void stats_packet_end(void)
+{
+	const uint32_t elapsed = stats_timestamp() - stats_current_start;
+	if (!stats_current_name[0])
+		return;
+	/* Clearing the current name marks the packet as accounted, so keep a copy of it */
+	char name[STATS_PACKET_NAME_LENGTH];
+	memcpy(name, stats_current_name, sizeof(name));
+	stats_current_name[0] = '\0';
+
+	stats_packet_s *entry = NULL;
+	for (size_t i = 0; i < STATS_MAX_PACKET_TYPES; ++i) {
+		if (!stats.packets[i].count) {
+			entry = &stats.packets[i];
+			memcpy(entry->name, name, sizeof(entry->name));
+			break;
+		}
+		if (!strcmp(stats.packets[i].name, name)) {
+			entry = &stats.packets[i];
+			break;
+		}
+	}
+	if (!entry) {
+		++stats.dropped_packets;
+#if PC_HOSTED == 1
+		metrics_if_publish();
+#endif
+		return;
+	}
+
+	++entry->count;
+	entry->total_time += elapsed;
+	entry->total_bytes += stats_current_length;
+	entry->max_time = MAX(entry->max_time, elapsed);
+	size_t bucket = 0;
+	for (uint32_t limit = 1U << STATS_HISTOGRAM_SHIFT; bucket < STATS_HISTOGRAM_BUCKETS - 1U && elapsed >= limit;
+		 limit <<= STATS_HISTOGRAM_SHIFT)
+		++bucket;
+	++entry->histogram[bucket];
+#if PC_HOSTED == 1
+	metrics_if_publish();
+#endif
+}
+
+void stats_print(void)
+{
+	for (size_t i = 0; i < STATS_COUNTER_COUNT; ++i)
+		gdb_outf("%-22s %" PRIu32 "\n", stats_counter_names[i], (uint32_t)stats.counters[i]);
+
+	gdb_out("Packet latency in " STATS_TIMESTAMP_UNIT ", histogram buckets are <8, <64, <512 ...\n");
+	gdb_out("Packet       Count      Bytes        Avg        Max  Histogram\n");
+	for (size_t i = 0; i < STATS_MAX_PACKET_TYPES && stats.packets[i].count; ++i) {
+		const stats_packet_s *const entry = &stats.packets[i];
+		gdb_outf("%-11s %6" PRIu32 " %10" PRIu32 " %10" PRIu32 " %10" PRIu32 " ", entry->name, entry->count,
+			(uint32_t)entry->total_bytes, (uint32_t)(entry->total_time / entry->count), entry->max_time);
+		for (size_t bucket = 0; bucket < STATS_HISTOGRAM_BUCKETS; ++bucket)
+			gdb_outf(" %" PRIu32, entry->histogram[bucket]);
+		gdb_out("\n");
+	}
+	if (stats.dropped_packets)
+		gdb_outf("%" PRIu32 " packets of other types not tracked\n", stats.dropped_packets);
+}
+
+void stats_reset(void)
+{
+	memset(&stats, 0, sizeof(stats));
+#if PC_HOSTED == 1
+	metrics_if_publish();
+#endif
+}
+
+const stats_s *stats_get(void)
+{
+	return &stats;
+}
+
+const char *stats_counter_name(const stats_counter_e counter)
+{
+	return stats_counter_names[counter];
+}
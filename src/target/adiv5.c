@@ -132,6 +132,12 @@ enum arm_arch {
 	aa_nosupport,
 	aa_cortexm,
 	aa_cortexa,
+	/* trace components, noted for the trace buffer commands */
+	aa_etm3,
+	aa_etm4,
+	aa_funnel,
+	aa_etb,
+	aa_tmc,
 	aa_end
 };
 
@@ -210,8 +216,8 @@ static const struct {
 		ARM_COMPONENT_STR("Cortex-M7 PPB", "(Cortex-M7 Private Peripheral Bus ROM Table)")},
 	{0x4c8, 0x00, 0, aa_nosupport, cidc_unknown, ARM_COMPONENT_STR("Cortex-M7 ROM", "(Cortex-M7 ROM)")},
 	{0x906, 0x14, 0, aa_nosupport, cidc_unknown, ARM_COMPONENT_STR("CoreSight CTI", "(Cross Trigger)")},
-	{0x907, 0x21, 0, aa_nosupport, cidc_unknown, ARM_COMPONENT_STR("CoreSight ETB", "(Trace Buffer)")},
-	{0x908, 0x12, 0, aa_nosupport, cidc_unknown, ARM_COMPONENT_STR("CoreSight CSTF", "(Trace Funnel)")},
+	{0x907, 0x21, 0, aa_etb, cidc_unknown, ARM_COMPONENT_STR("CoreSight ETB", "(Trace Buffer)")},
+	{0x908, 0x12, 0, aa_funnel, cidc_unknown, ARM_COMPONENT_STR("CoreSight CSTF", "(Trace Funnel)")},
 	{0x910, 0x00, 0, aa_nosupport, cidc_unknown, ARM_COMPONENT_STR("CoreSight ETM9", "(Embedded Trace)")},
 	{0x912, 0x11, 0, aa_nosupport, cidc_unknown, ARM_COMPONENT_STR("CoreSight TPIU", "(Trace Port Interface Unit)")},
 	{0x913, 0x00, 0, aa_nosupport, cidc_unknown,
@@ -219,32 +225,31 @@ static const struct {
 	{0x914, 0x11, 0, aa_nosupport, cidc_unknown, ARM_COMPONENT_STR("CoreSight SWO", "(Single Wire Output)")},
 	{0x917, 0x00, 0, aa_nosupport, cidc_unknown, ARM_COMPONENT_STR("CoreSight HTM", "(AHB Trace Macrocell)")},
 	{0x920, 0x00, 0, aa_nosupport, cidc_unknown, ARM_COMPONENT_STR("CoreSight ETM11", "(Embedded Trace)")},
-	{0x921, 0x00, 0, aa_nosupport, cidc_unknown, ARM_COMPONENT_STR("Cortex-A8 ETM", "(Embedded Trace)")},
+	{0x921, 0x00, 0, aa_etm3, cidc_unknown, ARM_COMPONENT_STR("Cortex-A8 ETM", "(Embedded Trace)")},
 	{0x922, 0x00, 0, aa_nosupport, cidc_unknown, ARM_COMPONENT_STR("Cortex-A8 CTI", "(Cross Trigger)")},
 	{0x923, 0x11, 0, aa_nosupport, cidc_unknown, ARM_COMPONENT_STR("Cortex-M3 TPIU", "(Trace Port Interface Unit)")},
-	{0x924, 0x13, 0, aa_nosupport, cidc_unknown, ARM_COMPONENT_STR("Cortex-M3 ETM", "(Embedded Trace)")},
-	{0x925, 0x13, 0, aa_nosupport, cidc_unknown, ARM_COMPONENT_STR("Cortex-M4 ETM", "(Embedded Trace)")},
+	{0x924, 0x13, 0, aa_etm3, cidc_unknown, ARM_COMPONENT_STR("Cortex-M3 ETM", "(Embedded Trace)")},
+	{0x925, 0x13, 0, aa_etm3, cidc_unknown, ARM_COMPONENT_STR("Cortex-M4 ETM", "(Embedded Trace)")},
 	{0x930, 0x00, 0, aa_nosupport, cidc_unknown, ARM_COMPONENT_STR("Cortex-R4 ETM", "(Embedded Trace)")},
 	{0x932, 0x31, 0x0a31, aa_nosupport, cidc_unknown,
 		ARM_COMPONENT_STR("CoreSight MTB-M0+", "(Simple Execution Trace)")},
 	{0x941, 0x00, 0, aa_nosupport, cidc_unknown,
 		ARM_COMPONENT_STR("CoreSight TPIU-Lite", "(Trace Port Interface Unit)")},
-	{0x950, 0x00, 0, aa_nosupport, cidc_unknown,
-		ARM_COMPONENT_STR("CoreSight Component", "(unidentified Cortex-A9 component)")},
+	{0x950, 0x00, 0, aa_etm3, cidc_unknown, ARM_COMPONENT_STR("Cortex-A9 PTM", "(Program Trace Macrocell)")},
 	{0x955, 0x00, 0, aa_nosupport, cidc_unknown,
 		ARM_COMPONENT_STR("CoreSight Component", "(unidentified Cortex-A5 component)")},
-	{0x956, 0x13, 0, aa_nosupport, cidc_unknown, ARM_COMPONENT_STR("Cortex-A7 ETM", "(Embedded Trace)")},
-	{0x95f, 0x00, 0, aa_nosupport, cidc_unknown, ARM_COMPONENT_STR("Cortex-A15 PTM", "(Program Trace Macrocell)")},
-	{0x961, 0x32, 0, aa_nosupport, cidc_unknown, ARM_COMPONENT_STR("CoreSight TMC", "(Trace Memory Controller)")},
-	{0x961, 0x21, 0, aa_nosupport, cidc_unknown, ARM_COMPONENT_STR("CoreSight TMC", "(Trace Buffer)")},
+	{0x956, 0x13, 0, aa_etm3, cidc_unknown, ARM_COMPONENT_STR("Cortex-A7 ETM", "(Embedded Trace)")},
+	{0x95f, 0x00, 0, aa_etm3, cidc_unknown, ARM_COMPONENT_STR("Cortex-A15 PTM", "(Program Trace Macrocell)")},
+	{0x961, 0x32, 0, aa_tmc, cidc_unknown, ARM_COMPONENT_STR("CoreSight TMC", "(Trace Memory Controller)")},
+	{0x961, 0x21, 0, aa_tmc, cidc_unknown, ARM_COMPONENT_STR("CoreSight TMC", "(Trace Buffer)")},
 	{0x962, 0x00, 0, aa_nosupport, cidc_unknown, ARM_COMPONENT_STR("CoreSight STM", "(System Trace Macrocell)")},
 	{0x963, 0x63, 0x0a63, aa_nosupport, cidc_unknown, ARM_COMPONENT_STR("CoreSight STM", "(System Trace Macrocell)")},
-	{0x975, 0x13, 0x4a13, aa_nosupport, cidc_unknown, ARM_COMPONENT_STR("Cortex-M7 ETM", "(Embedded Trace)")},
+	{0x975, 0x13, 0x4a13, aa_etm4, cidc_unknown, ARM_COMPONENT_STR("Cortex-M7 ETM", "(Embedded Trace)")},
 	{0x9a0, 0x00, 0, aa_nosupport, cidc_unknown, ARM_COMPONENT_STR("CoreSight PMU", "(Performance Monitoring Unit)")},
 	{0x9a1, 0x11, 0, aa_nosupport, cidc_unknown, ARM_COMPONENT_STR("Cortex-M4 TPIU", "(Trace Port Interface Unit)")},
 	{0x9a6, 0x14, 0x1a14, aa_nosupport, cidc_dc, ARM_COMPONENT_STR("Cortex-M0+ CTI", "(Cross Trigger Interface)")},
 	{0x9a9, 0x11, 0, aa_nosupport, cidc_unknown, ARM_COMPONENT_STR("Cortex-M7 TPIU", "(Trace Port Interface Unit)")},
-	{0x9a5, 0x00, 0, aa_nosupport, cidc_unknown, ARM_COMPONENT_STR("Cortex-A5 ETM", "(Embedded Trace)")},
+	{0x9a5, 0x00, 0, aa_etm3, cidc_unknown, ARM_COMPONENT_STR("Cortex-A5 ETM", "(Embedded Trace)")},
 	{0x9a7, 0x16, 0, aa_nosupport, cidc_unknown, ARM_COMPONENT_STR("Cortex-A7 PMU", "(Performance Monitor Unit)")},
 	{0x9af, 0x00, 0, aa_nosupport, cidc_unknown, ARM_COMPONENT_STR("Cortex-A15 PMU", "(Performance Monitor Unit)")},
 	{0xc05, 0x00, 0, aa_cortexa, cidc_dc, ARM_COMPONENT_STR("Cortex-A5 Debug", "(Debug Unit)")},
@@ -256,7 +261,7 @@ static const struct {
 	{0xcd0, 0x00, 0, aa_nosupport, cidc_unknown, ARM_COMPONENT_STR("Atmel DSU", "(Device Service Unit)")},
 	{0xd20, 0x00, 0x2a04, aa_cortexm, cidc_gipc, ARM_COMPONENT_STR("Cortex-M23", "(System Control Space)")},
 	{0xd20, 0x11, 0, aa_nosupport, cidc_dc, ARM_COMPONENT_STR("Cortex-M23", "(Trace Port Interface Unit)")},
-	{0xd20, 0x13, 0, aa_nosupport, cidc_dc, ARM_COMPONENT_STR("Cortex-M23", "(Embedded Trace)")},
+	{0xd20, 0x13, 0, aa_etm4, cidc_dc, ARM_COMPONENT_STR("Cortex-M23", "(Embedded Trace)")},
 	{0xd20, 0x31, 0x0a31, aa_nosupport, cidc_dc, ARM_COMPONENT_STR("Cortex-M23", "(Micro Trace Buffer)")},
 	{0xd20, 0x00, 0x1a02, aa_nosupport, cidc_dc, ARM_COMPONENT_STR("Cortex-M23", "(Data Watchpoint and Trace)")},
 	{0xd20, 0x00, 0x1a03, aa_nosupport, cidc_dc, ARM_COMPONENT_STR("Cortex-M23", "(Breakpoint Unit)")},
@@ -267,7 +272,7 @@ static const struct {
 	{0xd21, 0x00, 0x1a02, aa_nosupport, cidc_dc, ARM_COMPONENT_STR("Cortex-M33", "(Data Watchpoint and Trace)")},
 	{0xd21, 0x00, 0x1a03, aa_nosupport, cidc_dc, ARM_COMPONENT_STR("Cortex-M33", "(Breakpoint Unit)")},
 	{0xd21, 0x14, 0x1a14, aa_nosupport, cidc_dc, ARM_COMPONENT_STR("Cortex-M33", "(Cross Trigger)")},
-	{0xd21, 0x13, 0x4a13, aa_nosupport, cidc_dc, ARM_COMPONENT_STR("Cortex-M33", "(Embedded Trace)")},
+	{0xd21, 0x13, 0x4a13, aa_etm4, cidc_dc, ARM_COMPONENT_STR("Cortex-M33", "(Embedded Trace)")},
 	{0xd21, 0x11, 0, aa_nosupport, cidc_dc, ARM_COMPONENT_STR("Cortex-M33", "(Trace Port Interface Unit)")},
 	{0xfff, 0x00, 0, aa_end, cidc_unknown, ARM_COMPONENT_STR("end", "end")},
 };
@@ -276,6 +281,14 @@ static const struct {
 #define SAMX5X_DSU_CTRLSTAT 0x41002100U
 #define SAMX5X_STATUSB_PROT (1U << 16U)
 
+adiv5_retry_policy_s adiv5_retry_default = {
+	.wait_retries = ADIV5_RETRY_WAIT_DEFAULT,
+	.fault_retries = ADIV5_RETRY_FAULT_DEFAULT,
+	.idle_cycles = ADIV5_RETRY_IDLE_DEFAULT,
+	.idle_cycles_max = ADIV5_RETRY_IDLE_MAX_DEFAULT,
+	.idle_after = ADIV5_RETRY_IDLE_AFTER_DEFAULT,
+};
+
 void adiv5_ap_ref(ADIv5_AP_t *ap)
 {
 	if (ap->refcnt == 0)
@@ -342,6 +355,8 @@ static uint32_t cortexm_initial_halt(ADIv5_AP_t *ap)
 		/* ap_mem_access_setup() sets ADIV5_AP_CSW_ADDRINC_SINGLE -> unusable!*/
 		adiv5_ap_write(ap, ADIV5_AP_CSW, ap->csw | ADIV5_AP_CSW_SIZE_WORD);
 		adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE, ADIV5_AP_TAR, CORTEXM_DHCSR);
+		/* The raw accesses below bypass the CSW/TAR cache */
+		adiv5_dp_cache_invalidate(ap->dp);
 	}
 
 	/* Workaround for CMSIS-DAP Bulk orbtrace
@@ -453,6 +468,161 @@ static cid_class_e adiv5_class_from_cid(const uint16_t part_number, const uint16
 	return cid_class;
 }
 
+/*
+ * The outcome of a ROM table walk is remembered per AP so a rescan of the same
+ * device only has to re-read the CIDRs of the ROM table and of the components
+ * that were probed, instead of walking every entry. Hosted keeps the cache in
+ * a file between runs, native only in RAM.
+ */
+#if PC_HOSTED == 1
+#define ADIV5_ROM_CACHE_APS 16U
+#else
+#define ADIV5_ROM_CACHE_APS 4U
+#endif
+#define ADIV5_ROM_CACHE_COMPONENTS 8U
+#define ADIV5_ROM_CACHE_MAGIC      0x524f4d32U /* "ROM2" */
+
+typedef struct adiv5_rom_cache_component {
+	uint32_t addr;
+	uint32_t cidr;
+	uint32_t arch;
+} adiv5_rom_cache_component_s;
+
+typedef struct adiv5_rom_cache_entry {
+	uint32_t key; /* Hash of DPIDR, TARGETSEL, APSEL, and the AP's IDR and BASE, 0 when unused */
+	uint32_t rom_cidr;
+	uint16_t designer_code;
+	uint16_t partno;
+	uint32_t count;
+	adiv5_rom_cache_component_s components[ADIV5_ROM_CACHE_COMPONENTS];
+} adiv5_rom_cache_entry_s;
+
+typedef struct adiv5_rom_cache {
+	uint32_t magic;
+	uint32_t next; /* Round robin replacement index */
+	adiv5_rom_cache_entry_s entries[ADIV5_ROM_CACHE_APS];
+} adiv5_rom_cache_s;
+
+static adiv5_rom_cache_s adiv5_rom_cache;
+static adiv5_rom_cache_entry_s adiv5_rom_cache_recording;
+static bool adiv5_rom_cache_cacheable;
+
+static uint32_t adiv5_rom_cache_key(const ADIv5_AP_t *ap, const uint32_t dpidr)
+{
+	const uint32_t words[] = {dpidr, ap->dp->targetsel, ap->apsel, ap->idr, ap->base};
+	/* FNV-1a */
+	uint32_t hash = 0x811c9dc5U;
+	for (size_t i = 0; i < ARRAY_LENGTH(words); ++i) {
+		for (size_t shift = 0; shift < 32U; shift += 8U) {
+			hash ^= (words[i] >> shift) & 0xffU;
+			hash *= 0x01000193U;
+		}
+	}
+	return hash ? hash : 1U;
+}
+
+static void adiv5_rom_cache_load(void)
+{
+	if (adiv5_rom_cache.magic == ADIV5_ROM_CACHE_MAGIC)
+		return;
+#if PC_HOSTED == 1
+	if (platform_rom_cache_load(&adiv5_rom_cache, sizeof(adiv5_rom_cache)) &&
+		adiv5_rom_cache.magic == ADIV5_ROM_CACHE_MAGIC && adiv5_rom_cache.next < ADIV5_ROM_CACHE_APS)
+		return;
+#endif
+	memset(&adiv5_rom_cache, 0, sizeof(adiv5_rom_cache));
+	adiv5_rom_cache.magic = ADIV5_ROM_CACHE_MAGIC;
+}
+
+static adiv5_rom_cache_entry_s *adiv5_rom_cache_find(const uint32_t key)
+{
+	for (size_t i = 0; i < ADIV5_ROM_CACHE_APS; ++i) {
+		if (adiv5_rom_cache.entries[i].key == key)
+			return &adiv5_rom_cache.entries[i];
+	}
+	return NULL;
+}
+
+static void adiv5_rom_cache_add(const uint32_t addr, const uint32_t cidr, const uint32_t arch)
+{
+	adiv5_rom_cache_entry_s *const entry = &adiv5_rom_cache_recording;
+	if (entry->count == ADIV5_ROM_CACHE_COMPONENTS) {
+		adiv5_rom_cache_cacheable = false;
+		return;
+	}
+	entry->components[entry->count].addr = addr;
+	entry->components[entry->count].cidr = cidr;
+	entry->components[entry->count].arch = arch;
+	++entry->count;
+}
+
+static void adiv5_trace_add(ADIv5_AP_t *ap, const uint32_t addr, const uint32_t arch)
+{
+	ADIv5_DP_t *const dp = ap->dp;
+	if (dp->trace_count == ADIV5_TRACE_COMPONENTS)
+		return;
+	adiv5_trace_component_s *const component = &dp->trace[dp->trace_count++];
+	component->addr = addr;
+	component->apsel = ap->apsel;
+	component->kind = ADIV5_TRACE_ETM3 + (arch - aa_etm3);
+}
+
+/* Re-run the probes of a cached walk, returns false if the device no longer matches it */
+static bool adiv5_rom_cache_replay(ADIv5_AP_t *ap, const uint32_t key)
+{
+	adiv5_rom_cache_entry_s *const entry = adiv5_rom_cache_find(key);
+	if (!entry)
+		return false;
+
+	const uint32_t base = ap->base & 0xfffff000U;
+	bool valid = adiv5_ap_read_id(ap, base + CIDR0_OFFSET) == entry->rom_cidr;
+	for (size_t i = 0; valid && i < entry->count; ++i)
+		valid = adiv5_ap_read_id(ap, entry->components[i].addr + CIDR0_OFFSET) == entry->components[i].cidr;
+	if (adiv5_dp_error(ap->dp) || !valid) {
+		DEBUG_INFO("AP %d: cached ROM table is stale\n", ap->apsel);
+		entry->key = 0;
+		return false;
+	}
+
+	DEBUG_INFO("AP %d: using cached ROM table, %" PRIu32 " components\n", ap->apsel, entry->count);
+	ap->designer_code = entry->designer_code;
+	ap->partno = entry->partno;
+	for (size_t i = 0; i < entry->count; ++i) {
+		if (entry->components[i].arch == aa_cortexm)
+			cortexm_probe(ap);
+		else if (entry->components[i].arch == aa_cortexa)
+			cortexa_probe(ap, entry->components[i].addr);
+		else if (entry->components[i].arch >= aa_etm3)
+			adiv5_trace_add(ap, entry->components[i].addr, entry->components[i].arch);
+	}
+	return true;
+}
+
+static void adiv5_rom_cache_begin(ADIv5_AP_t *ap)
+{
+	memset(&adiv5_rom_cache_recording, 0, sizeof(adiv5_rom_cache_recording));
+	/* rom_cidr is filled in by the top level adiv5_component_probe() */
+	adiv5_rom_cache_cacheable = (ap->base & 0xfffff000U) != 0;
+}
+
+static void adiv5_rom_cache_end(ADIv5_AP_t *ap, const uint32_t key)
+{
+	if (!adiv5_rom_cache_cacheable || !adiv5_rom_cache_recording.rom_cidr)
+		return;
+	adiv5_rom_cache_entry_s *entry = adiv5_rom_cache_find(key);
+	if (!entry) {
+		entry = &adiv5_rom_cache.entries[adiv5_rom_cache.next];
+		adiv5_rom_cache.next = (adiv5_rom_cache.next + 1U) % ADIV5_ROM_CACHE_APS;
+	}
+	adiv5_rom_cache_recording.key = key;
+	adiv5_rom_cache_recording.designer_code = ap->designer_code;
+	adiv5_rom_cache_recording.partno = ap->partno;
+	memcpy(entry, &adiv5_rom_cache_recording, sizeof(*entry));
+#if PC_HOSTED == 1
+	platform_rom_cache_save(&adiv5_rom_cache, sizeof(adiv5_rom_cache));
+#endif
+}
+
 /*
  * Return true if we find a debuggable device.
  * NOLINTNEXTLINE(misc-no-recursion) */
@@ -467,10 +637,13 @@ static void adiv5_component_probe(ADIv5_AP_t *ap, uint32_t addr, const size_t re
 	const volatile uint32_t cidr = adiv5_ap_read_id(ap, addr + CIDR0_OFFSET);
 	if (ap->dp->fault) {
 		DEBUG_WARN("CIDR read timeout on AP%d, aborting.\n", ap->apsel);
+		adiv5_rom_cache_cacheable = false;
 		return;
 	}
 	if ((cidr & ~CID_CLASS_MASK) != CID_PREAMBLE)
 		return;
+	if (recursion == 0)
+		adiv5_rom_cache_recording.rom_cidr = cidr;
 
 #if defined(ENABLE_DEBUG)
 	char indent[recursion + 1];
@@ -482,6 +655,7 @@ static void adiv5_component_probe(ADIv5_AP_t *ap, uint32_t addr, const size_t re
 
 	if (adiv5_dp_error(ap->dp)) {
 		DEBUG_WARN("%sFault reading ID registers\n", indent);
+		adiv5_rom_cache_cacheable = false;
 		return;
 	}
 
@@ -532,6 +706,7 @@ static void adiv5_component_probe(ADIv5_AP_t *ap, uint32_t addr, const size_t re
 					 * Handle it here, as access only to limited memory region
 					 * is allowed
 					 */
+					adiv5_rom_cache_cacheable = false;
 					cortexm_probe(ap);
 					return;
 				}
@@ -554,7 +729,8 @@ static void adiv5_component_probe(ADIv5_AP_t *ap, uint32_t addr, const size_t re
 
 			uint32_t entry = adiv5_mem_read32(ap, addr + i * 4);
 			if (adiv5_dp_error(ap->dp)) {
-				DEBUG_WARN("%sFault reading ROM table entry %d\n", indent, i);
+				DEBUG_WARN("%sFault reading ROM table entry %zu\n", indent, i);
+				adiv5_rom_cache_cacheable = false;
 				break;
 			}
 
@@ -562,7 +738,7 @@ static void adiv5_component_probe(ADIv5_AP_t *ap, uint32_t addr, const size_t re
 				break;
 
 			if (!(entry & ADIV5_ROM_ROMENTRY_PRESENT)) {
-				DEBUG_INFO("%s%d Entry 0x%" PRIx32 " -> Not present\n", indent, i, entry);
+				DEBUG_INFO("%s%zu Entry 0x%" PRIx32 " -> Not present\n", indent, i, entry);
 				continue;
 			}
 
@@ -613,12 +789,22 @@ static void adiv5_component_probe(ADIv5_AP_t *ap, uint32_t addr, const size_t re
 			switch (arm_component_lut[i].arch) {
 			case aa_cortexm:
 				DEBUG_INFO("%s-> cortexm_probe\n", indent + 1);
+				adiv5_rom_cache_add(addr, cidr, aa_cortexm);
 				cortexm_probe(ap);
 				break;
 			case aa_cortexa:
 				DEBUG_INFO("%s-> cortexa_probe\n", indent + 1);
+				adiv5_rom_cache_add(addr, cidr, aa_cortexa);
 				cortexa_probe(ap, addr);
 				break;
+			case aa_etm3:
+			case aa_etm4:
+			case aa_funnel:
+			case aa_etb:
+			case aa_tmc:
+				adiv5_rom_cache_add(addr, cidr, arm_component_lut[i].arch);
+				adiv5_trace_add(ap, addr, arm_component_lut[i].arch);
+				break;
 			default:
 				break;
 			}
@@ -661,6 +847,17 @@ ADIv5_AP_t *adiv5_new_ap(ADIv5_DP_t *dp, uint8_t apsel)
 		return NULL;
 	}
 
+	/*
+	 * Packed transfer support is optional, the AddrInc field of a MEM-AP that doesn't
+	 * implement it won't read back as packed (ADIv5.2 C2.6.4).
+	 */
+	if (((tmpap.idr >> 13U) & 0xfU) == 0x8U) {
+		adiv5_ap_write(&tmpap, ADIV5_AP_CSW, tmpap.csw | ADIV5_AP_CSW_ADDRINC_PACKED);
+		tmpap.packed_transfers =
+			(adiv5_ap_read(&tmpap, ADIV5_AP_CSW) & ADIV5_AP_CSW_ADDRINC_MASK) == ADIV5_AP_CSW_ADDRINC_PACKED;
+		adiv5_ap_write(&tmpap, ADIV5_AP_CSW, tmpap.csw | ADIV5_AP_CSW_ADDRINC_SINGLE | ADIV5_AP_CSW_SIZE_WORD);
+	}
+
 	/* It's valid to so create a heap copy */
 	ap = malloc(sizeof(*ap));
 	if (!ap) { /* malloc failed: heap exhaustion */
@@ -693,8 +890,94 @@ static void rp_rescue_setup(ADIv5_DP_t *dp)
 	rp_rescue_probe(ap);
 }
 
+/* Remember the best system bus MEM-AP found so far, AXI before AHB */
+static void adiv5_sysmem_ap_note(const ADIv5_AP_t *const ap)
+{
+	ADIv5_DP_t *const dp = ap->dp;
+	if (((ap->idr >> 13U) & 0xfU) != 0x8U)
+		return;
+	const uint8_t type = ap->idr & 0xfU;
+	const bool axi = type == ARM_AP_TYPE_AXI;
+	if (!axi && type != ARM_AP_TYPE_AHB && type != ARM_AP_TYPE_AHB5)
+		return;
+	if (dp->sysmem_ap_valid && (dp->sysmem_ap_axi || !axi))
+		return;
+	dp->sysmem_ap_valid = true;
+	dp->sysmem_ap_axi = axi;
+	dp->sysmem_apsel = ap->apsel;
+}
+
+/* A new reference to the system bus MEM-AP of this DP, or NULL if there isn't one */
+ADIv5_AP_t *adiv5_sysmem_ap(ADIv5_DP_t *const dp)
+{
+	if (!dp->sysmem_ap_valid)
+		return NULL;
+#if PC_HOSTED == 1
+	if (dp->ap_setup && !dp->ap_setup(dp->sysmem_apsel))
+		return NULL;
+#endif
+	return adiv5_new_ap(dp, dp->sysmem_apsel);
+}
+
+#define ADIV5_DP_CTRLSTAT_PWRUPACK (ADIV5_DP_CTRLSTAT_CSYSPWRUPACK | ADIV5_DP_CTRLSTAT_CDBGPWRUPACK)
+
+/*
+ * Get the link to an AP back after a DP error, without a rescan: resync the
+ * wire, clear the sticky errors and re-request the power-up a sleeping target
+ * may have dropped. True if the AP then reads back the IDR it was found with,
+ * in which case targets on it, and their breakpoints, are still good.
+ */
+bool adiv5_ap_recover(ADIv5_AP_t *ap)
+{
+	ADIv5_DP_t *dp = ap->dp;
+	volatile uint32_t idr = 0;
+	volatile struct exception e;
+	TRY_CATCH (e, EXCEPTION_ALL) {
+		if (dp->line_reset)
+			dp->line_reset(dp);
+		adiv5_dp_error(dp);
+		dp->fault = 0;
+		const uint32_t ctrlstat = adiv5_dp_read(dp, ADIV5_DP_CTRLSTAT);
+		if ((ctrlstat & ADIV5_DP_CTRLSTAT_PWRUPACK) != ADIV5_DP_CTRLSTAT_PWRUPACK) {
+			adiv5_dp_write(dp, ADIV5_DP_CTRLSTAT, ADIV5_DP_CTRLSTAT_CSYSPWRUPREQ | ADIV5_DP_CTRLSTAT_CDBGPWRUPREQ);
+			platform_timeout timeout;
+			platform_timeout_set(&timeout, 20);
+			while ((adiv5_dp_read(dp, ADIV5_DP_CTRLSTAT) & ADIV5_DP_CTRLSTAT_PWRUPACK) != ADIV5_DP_CTRLSTAT_PWRUPACK) {
+				if (platform_timeout_is_expired(&timeout))
+					raise_exception(EXCEPTION_TIMEOUT, "DP power-up");
+			}
+		}
+		/* SELECT and the AP's CSW and TAR go out again on the next access */
+		adiv5_dp_cache_invalidate(dp);
+		idr = adiv5_ap_read(ap, ADIV5_AP_IDR);
+	}
+	if (e.type || dp->fault || idr != ap->idr) {
+		DEBUG_WARN("AP %u recovery failed\n", ap->apsel);
+		return false;
+	}
+	DEBUG_INFO("AP %u recovered\n", ap->apsel);
+	return true;
+}
+
+/*
+ * Number the device each DP belongs to: every DP is its own, except that the
+ * instances of a multidrop part (like the two RP2040 cores) are scanned one
+ * after the other with the same TARGETSEL save for TINSTANCE.
+ */
+static void adiv5_dp_group(ADIv5_DP_t *const dp)
+{
+	static uint32_t group_count;
+	static uint32_t group_targetsel;
+	const uint32_t targetsel = dp->targetsel & ~ADIV5_DP_TARGETSEL_TINSTANCE_MASK;
+	if (!targetsel || targetsel != group_targetsel)
+		++group_count;
+	group_targetsel = targetsel;
+	dp->group = group_count;
+}
+
 void adiv5_dp_init(ADIv5_DP_t *dp, const uint32_t idcode)
 {
+	adiv5_dp_group(dp);
 	/*
 	 * Assume DP v1 or later.
 	 * this may not be true for JTAG-DP
@@ -786,11 +1069,21 @@ void adiv5_dp_init(ADIv5_DP_t *dp, const uint32_t idcode)
 		dp->mem_read = firmware_mem_read;
 	if (!dp->mem_write_sized)
 		dp->mem_write_sized = firmware_mem_write_sized;
+	if (!dp->queue_flush) {
+		dp->queue_read = firmware_queue_read;
+		dp->queue_write = firmware_queue_write;
+		dp->queue_flush = firmware_queue_flush;
+	}
 #else
 	dp->ap_write = firmware_ap_write;
 	dp->ap_read = firmware_ap_read;
 	dp->mem_read = firmware_mem_read;
 	dp->mem_write_sized = firmware_mem_write_sized;
+	if (!dp->queue_flush) {
+		dp->queue_read = firmware_queue_read;
+		dp->queue_write = firmware_queue_write;
+		dp->queue_flush = firmware_queue_flush;
+	}
 #endif
 
 	volatile uint32_t ctrlstat = 0;
@@ -842,6 +1135,8 @@ void adiv5_dp_init(ADIv5_DP_t *dp, const uint32_t idcode)
 	adiv5_dp_write(dp, ADIV5_DP_CTRLSTAT, ctrlstat &= ~ADIV5_DP_CTRLSTAT_CDBGRSTREQ);
 
 	/* Probe for APs on this DP */
+	adiv5_rom_cache_load();
+	dp->sysmem_ap_valid = false;
 	size_t invalid_aps = 0;
 	dp->refcnt++;
 	for (size_t i = 0; i < 256 && invalid_aps < 8; ++i) {
@@ -866,6 +1161,16 @@ void adiv5_dp_init(ADIv5_DP_t *dp, const uint32_t idcode)
 			continue;
 		}
 
+		/* A protected part that was just erased exposes its cores to a fresh walk of the APs */
+		if (nrf51_mdm_recover(ap)) {
+			adiv5_ap_unref(ap);
+			dp->sysmem_ap_valid = false;
+			invalid_aps = 0;
+			i = SIZE_MAX;
+			continue;
+		}
+
+		adiv5_sysmem_ap_note(ap);
 		kinetis_mdm_probe(ap);
 		nrf51_mdm_probe(ap);
 		efm32_aap_probe(ap);
@@ -878,7 +1183,12 @@ void adiv5_dp_init(ADIv5_DP_t *dp, const uint32_t idcode)
 		 */
 
 		/* The rest should only be added after checking ROM table */
-		adiv5_component_probe(ap, ap->base, 0, 0);
+		const uint32_t rom_cache_key = adiv5_rom_cache_key(ap, dpidr);
+		if (!adiv5_rom_cache_replay(ap, rom_cache_key)) {
+			adiv5_rom_cache_begin(ap);
+			adiv5_component_probe(ap, ap->base, 0, 0);
+			adiv5_rom_cache_end(ap, rom_cache_key);
+		}
 		adiv5_ap_unref(ap);
 	}
 	/* We halted at least CortexM for Romtable scan.
@@ -896,10 +1206,83 @@ void adiv5_dp_init(ADIv5_DP_t *dp, const uint32_t idcode)
 
 #define ALIGNOF(x) (((x)&3) == 0 ? ALIGN_WORD : (((x)&1) == 0 ? ALIGN_HALFWORD : ALIGN_BYTE))
 
-/* Program the CSW and TAR for sequencial access at a given width */
-static void ap_mem_access_setup(ADIv5_AP_t *ap, uint32_t addr, enum align align)
+/* Write SELECT unless it already holds this value */
+static void adiv5_dp_select(ADIv5_DP_t *dp, uint32_t select)
+{
+	if (dp->select_valid && dp->select == select)
+		return;
+	adiv5_dp_write(dp, ADIV5_DP_SELECT, select);
+	dp->select = select;
+	dp->select_valid = true;
+}
+
+static bool ap_cache_valid(ADIv5_AP_t *ap, uint8_t which)
+{
+	if (ap->cache_epoch != ap->dp->cache_epoch) {
+		ap->cache_epoch = ap->dp->cache_epoch;
+		ap->cache_valid = 0;
+	}
+	return ap->cache_valid & which;
+}
+
+static void ap_cache_set(ADIv5_AP_t *ap, uint8_t which, uint32_t value)
 {
-	uint32_t csw = ap->csw | ADIV5_AP_CSW_ADDRINC_SINGLE;
+	ap_cache_valid(ap, which);
+	ap->cache_valid |= which;
+	if (which == ADIV5_AP_CACHE_CSW)
+		ap->csw_cache = value;
+	else
+		ap->tar_cache = value;
+}
+
+static void ap_cache_clear(ADIv5_AP_t *ap, uint8_t which)
+{
+	ap_cache_valid(ap, which);
+	ap->cache_valid &= ~which;
+}
+
+/* Check whether writing value to an AP register would be redundant */
+static bool ap_cache_hit(ADIv5_AP_t *ap, uint16_t addr, uint32_t value)
+{
+	if (addr == ADIV5_AP_CSW)
+		return ap_cache_valid(ap, ADIV5_AP_CACHE_CSW) && ap->csw_cache == value;
+	if (addr == ADIV5_AP_TAR)
+		return ap_cache_valid(ap, ADIV5_AP_CACHE_TAR) && ap->tar_cache == value;
+	return false;
+}
+
+/* Track the effect of an AP register access on the cached CSW and TAR */
+static void ap_cache_note(ADIv5_AP_t *ap, uint16_t addr, uint32_t value)
+{
+	if (addr == ADIV5_AP_CSW)
+		ap_cache_set(ap, ADIV5_AP_CACHE_CSW, value);
+	else if (addr == ADIV5_AP_TAR)
+		ap_cache_set(ap, ADIV5_AP_CACHE_TAR, value);
+	else if (addr == ADIV5_AP_DRW &&
+		(!ap_cache_valid(ap, ADIV5_AP_CACHE_CSW) || (ap->csw_cache & ADIV5_AP_CSW_ADDRINC_MASK)))
+		ap_cache_clear(ap, ADIV5_AP_CACHE_TAR);
+	if (ap->dp->fault)
+		adiv5_dp_cache_invalidate(ap->dp);
+}
+
+/*
+ * After an auto-incrementing stream TAR holds the address past the last access,
+ * but only while that stays in the 1kiB block TAR was last written in.
+ */
+static void ap_cache_tar_stream(ADIv5_AP_t *ap, uint32_t tar, uint32_t end)
+{
+	if (ap->dp->fault)
+		adiv5_dp_cache_invalidate(ap->dp);
+	else if ((end ^ tar) & 0xfffffc00U)
+		ap_cache_clear(ap, ADIV5_AP_CACHE_TAR);
+	else
+		ap_cache_set(ap, ADIV5_AP_CACHE_TAR, end);
+}
+
+/* Program the CSW and TAR for sequencial access at a given width, skipping what's unchanged */
+static void ap_mem_access_setup_inc(ADIv5_AP_t *ap, uint32_t addr, enum align align, uint32_t addrinc)
+{
+	uint32_t csw = ap->csw | addrinc;
 
 	switch (align) {
 	case ALIGN_BYTE:
@@ -913,8 +1296,81 @@ static void ap_mem_access_setup(ADIv5_AP_t *ap, uint32_t addr, enum align align)
 		csw |= ADIV5_AP_CSW_SIZE_WORD;
 		break;
 	}
-	adiv5_ap_write(ap, ADIV5_AP_CSW, csw);
-	adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE, ADIV5_AP_TAR, addr);
+	adiv5_dp_select(ap->dp, (uint32_t)ap->apsel << 24U);
+	if (!ap_cache_hit(ap, ADIV5_AP_CSW, csw)) {
+		adiv5_dp_write(ap->dp, ADIV5_AP_CSW, csw);
+		ap_cache_note(ap, ADIV5_AP_CSW, csw);
+	}
+	if (!ap_cache_hit(ap, ADIV5_AP_TAR, addr)) {
+		adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE, ADIV5_AP_TAR, addr);
+		ap_cache_note(ap, ADIV5_AP_TAR, addr);
+	}
+}
+
+/* A single element access doesn't increment, so TAR can be reused by the next one */
+static void ap_mem_access_setup(ADIv5_AP_t *ap, uint32_t addr, enum align align, size_t count)
+{
+	ap_mem_access_setup_inc(
+		ap, addr, align, count > 1U ? ADIV5_AP_CSW_ADDRINC_SINGLE : ADIV5_AP_CSW_ADDRINC_NONE);
+}
+
+/*
+ * Returns the length of the word aligned middle of a byte or halfword access that can
+ * be done with packed transfers, 4 bytes per DRW access. An unaligned head is left
+ * to the caller to do one element at a time.
+ */
+static size_t ap_mem_packed_length(ADIv5_AP_t *ap, uint32_t addr, size_t len, enum align align)
+{
+	if (!ap->packed_transfers || align >= ALIGN_WORD || (addr & 3U))
+		return 0;
+	return len & ~3U;
+}
+
+/* Read a word aligned block as packed bytes or halfwords, each DRW read carries 4 bytes */
+static void firmware_mem_read_packed(ADIv5_AP_t *ap, uint8_t *dest, uint32_t src, size_t len, enum align align)
+{
+	uint32_t osrc = src;
+	size_t words = len >> 2U;
+
+	ap_mem_access_setup_inc(ap, src, align, ADIV5_AP_CSW_ADDRINC_PACKED);
+	adiv5_dp_low_access(ap->dp, ADIV5_LOW_READ, ADIV5_AP_DRW, 0);
+	while (--words) {
+		const uint32_t tmp = adiv5_dp_low_access(ap->dp, ADIV5_LOW_READ, ADIV5_AP_DRW, 0);
+		/* Packed lanes are in address order, so the word lands in memory order as is */
+		memcpy(dest, &tmp, 4U);
+		dest += 4U;
+
+		src += 4U;
+		/* Check for 10 bit address overflow */
+		if ((src ^ osrc) & 0xfffffc00U) {
+			osrc = src;
+			adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE, ADIV5_AP_TAR, src);
+			adiv5_dp_low_access(ap->dp, ADIV5_LOW_READ, ADIV5_AP_DRW, 0);
+		}
+	}
+	const uint32_t tmp = adiv5_dp_low_access(ap->dp, ADIV5_LOW_READ, ADIV5_DP_RDBUFF, 0);
+	memcpy(dest, &tmp, 4U);
+	ap_cache_tar_stream(ap, osrc, src + 4U);
+}
+
+static void firmware_mem_write_packed(ADIv5_AP_t *ap, uint32_t dest, const uint8_t *src, size_t len, enum align align)
+{
+	uint32_t odest = dest;
+
+	ap_mem_access_setup_inc(ap, dest, align, ADIV5_AP_CSW_ADDRINC_PACKED);
+	for (size_t offset = 0; offset < len; offset += 4U) {
+		uint32_t tmp;
+		memcpy(&tmp, src + offset, 4U);
+		adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE, ADIV5_AP_DRW, tmp);
+
+		dest += 4U;
+		/* Check for 10 bit address overflow */
+		if ((dest ^ odest) & 0xfffffc00U) {
+			odest = dest;
+			adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE, ADIV5_AP_TAR, dest);
+		}
+	}
+	ap_cache_tar_stream(ap, odest, dest);
 }
 
 /* Extract read data from data lane based on align and src address */
@@ -944,8 +1400,23 @@ void firmware_mem_read(ADIv5_AP_t *ap, void *dest, uint32_t src, size_t len)
 	if (len == 0)
 		return;
 
+	/* Do the unaligned head one element at a time, then as much as possible packed */
+	if (ap->packed_transfers && align < ALIGN_WORD && len >= 8U) {
+		const size_t head = (4U - (src & 3U)) & 3U;
+		const size_t packed = ap_mem_packed_length(ap, src + head, len - head, align);
+		if (packed) {
+			if (head)
+				firmware_mem_read(ap, dest, src, head);
+			firmware_mem_read_packed(ap, (uint8_t *)dest + head, src + head, packed, align);
+			if (len - head - packed)
+				firmware_mem_read(ap, (uint8_t *)dest + head + packed, src + head + packed, len - head - packed);
+			return;
+		}
+	}
+
 	len >>= align;
-	ap_mem_access_setup(ap, src, align);
+	const bool stream = len > 1U;
+	ap_mem_access_setup(ap, src, align, len);
 	adiv5_dp_low_access(ap->dp, ADIV5_LOW_READ, ADIV5_AP_DRW, 0);
 	while (--len) {
 		tmp = adiv5_dp_low_access(ap->dp, ADIV5_LOW_READ, ADIV5_AP_DRW, 0);
@@ -961,14 +1432,56 @@ void firmware_mem_read(ADIv5_AP_t *ap, void *dest, uint32_t src, size_t len)
 	}
 	tmp = adiv5_dp_low_access(ap->dp, ADIV5_LOW_READ, ADIV5_DP_RDBUFF, 0);
 	extract(dest, src, tmp, align);
+	if (stream)
+		ap_cache_tar_stream(ap, osrc, src + (1U << align));
+	else if (ap->dp->fault)
+		adiv5_dp_cache_invalidate(ap->dp);
+}
+
+/*
+ * Shorter ranges keep the access size their alignment gives, as a register read
+ * of a few bytes may have to be done at that width.
+ */
+#define ADIV5_MEM_SPLIT_MIN 8U
+
+void adiv5_mem_read_split(ADIv5_AP_t *ap, void *dest, uint32_t src, size_t len)
+{
+	if (len < ADIV5_MEM_SPLIT_MIN || !((src | len) & 3U)) {
+		ap->dp->mem_read(ap, dest, src, len);
+		return;
+	}
+	const size_t head = (4U - (src & 3U)) & 3U;
+	const size_t body = (len - head) & ~3U;
+	if (head)
+		ap->dp->mem_read(ap, dest, src, head);
+	ap->dp->mem_read(ap, (uint8_t *)dest + head, src + head, body);
+	if (len - head - body)
+		ap->dp->mem_read(ap, (uint8_t *)dest + head + body, src + head + body, len - head - body);
 }
 
 void firmware_mem_write_sized(ADIv5_AP_t *ap, uint32_t dest, const void *src, size_t len, enum align align)
 {
 	uint32_t odest = dest;
 
+	if (ap->packed_transfers && align < ALIGN_WORD && len >= 8U) {
+		const size_t head = (4U - (dest & 3U)) & 3U;
+		const size_t packed = ap_mem_packed_length(ap, dest + head, len - head, align);
+		if (packed) {
+			if (head)
+				firmware_mem_write_sized(ap, dest, src, head, align);
+			firmware_mem_write_packed(ap, dest + head, (const uint8_t *)src + head, packed, align);
+			if (len - head - packed)
+				firmware_mem_write_sized(ap, dest + head + packed, (const uint8_t *)src + head + packed,
+					len - head - packed, align);
+			else
+				adiv5_dp_read(ap->dp, ADIV5_DP_RDBUFF);
+			return;
+		}
+	}
+
 	len >>= align;
-	ap_mem_access_setup(ap, dest, align);
+	const bool stream = len > 1U;
+	ap_mem_access_setup(ap, dest, align, len);
 	while (len--) {
 		uint32_t tmp = 0;
 		/* Pack data into correct data lane */
@@ -988,32 +1501,300 @@ void firmware_mem_write_sized(ADIv5_AP_t *ap, uint32_t dest, const void *src, si
 		dest += (1 << align);
 		adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE, ADIV5_AP_DRW, tmp);
 
-		/* Check for 10 bit address overflow */
-		if ((dest ^ odest) & 0xfffffc00U) {
+		/* Check for 10 bit address overflow, there's no need to move TAR after the last element */
+		if (len && ((dest ^ odest) & 0xfffffc00U)) {
 			odest = dest;
 			adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE, ADIV5_AP_TAR, dest);
 		}
 	}
 	/* Make sure this write is complete by doing a dummy read */
 	adiv5_dp_read(ap->dp, ADIV5_DP_RDBUFF);
+	if (stream)
+		ap_cache_tar_stream(ap, odest, dest);
+	else if (ap->dp->fault)
+		adiv5_dp_cache_invalidate(ap->dp);
 }
 
 void firmware_ap_write(ADIv5_AP_t *ap, uint16_t addr, uint32_t value)
 {
-	adiv5_dp_write(ap->dp, ADIV5_DP_SELECT, ((uint32_t)ap->apsel << 24) | (addr & 0xF0));
+	/* SELECT must be right even when the write itself is skipped, callers may follow up with raw accesses */
+	adiv5_dp_select(ap->dp, ((uint32_t)ap->apsel << 24) | (addr & 0xF0));
+	if (ap_cache_hit(ap, addr, value))
+		return;
 	adiv5_dp_write(ap->dp, addr, value);
+	ap_cache_note(ap, addr, value);
 }
 
 uint32_t firmware_ap_read(ADIv5_AP_t *ap, uint16_t addr)
 {
 	uint32_t ret;
-	adiv5_dp_write(ap->dp, ADIV5_DP_SELECT, ((uint32_t)ap->apsel << 24) | (addr & 0xF0));
+	adiv5_dp_select(ap->dp, ((uint32_t)ap->apsel << 24) | (addr & 0xF0));
 	ret = adiv5_dp_read(ap->dp, addr);
+	if (addr == ADIV5_AP_DRW)
+		ap_cache_note(ap, addr, 0);
+	else if (ap->dp->fault)
+		adiv5_dp_cache_invalidate(ap->dp);
 	return ret;
 }
 
+static void adiv5_dp_queue_select(ADIv5_DP_t *dp, uint32_t select)
+{
+	if (dp->select_valid && dp->select == select)
+		return;
+	adiv5_dp_queue_write(dp, ADIV5_DP_SELECT, select);
+	dp->select = select;
+	dp->select_valid = true;
+}
+
+/* Queued AP accesses share the SELECT/CSW/TAR cache, a failed flush invalidates it */
+void adiv5_ap_queue_read(ADIv5_AP_t *ap, uint16_t addr, uint32_t *result)
+{
+	adiv5_dp_queue_select(ap->dp, ((uint32_t)ap->apsel << 24U) | (addr & 0xf0U));
+	adiv5_dp_queue_read(ap->dp, addr, result);
+	if (addr == ADIV5_AP_DRW)
+		ap_cache_note(ap, addr, 0);
+}
+
+void adiv5_ap_queue_write(ADIv5_AP_t *ap, uint16_t addr, uint32_t value)
+{
+	adiv5_dp_queue_select(ap->dp, ((uint32_t)ap->apsel << 24U) | (addr & 0xf0U));
+	if (ap_cache_hit(ap, addr, value))
+		return;
+	adiv5_dp_queue_write(ap->dp, addr, value);
+	ap_cache_note(ap, addr, value);
+}
+
+/* Up to this many elements of one range are queued, longer ones are streamed by adiv5_mem_read */
+#define ADIV5_READV_ELEMENTS 8U
+/* The results one flush collects */
+#define ADIV5_READV_BATCH 64U
+
+static size_t adiv5_readv_elements(const target_iovec_s *iov)
+{
+	return iov->len >> MIN(ALIGNOF(iov->src), ALIGNOF(iov->len));
+}
+
+/* Queues the reads of one range, each element at its natural size like adiv5_mem_read */
+static void adiv5_readv_queue(ADIv5_AP_t *ap, const target_iovec_s *iov, uint32_t *results)
+{
+	const enum align align = MIN(ALIGNOF(iov->src), ALIGNOF(iov->len));
+	const size_t elements = iov->len >> align;
+	static const uint32_t size[] = {ADIV5_AP_CSW_SIZE_BYTE, ADIV5_AP_CSW_SIZE_HALFWORD, ADIV5_AP_CSW_SIZE_WORD};
+	adiv5_ap_queue_write(ap, ADIV5_AP_CSW,
+		ap->csw | size[align] | (elements > 1U ? ADIV5_AP_CSW_ADDRINC_SINGLE : ADIV5_AP_CSW_ADDRINC_NONE));
+	uint32_t addr = iov->src;
+	for (size_t i = 0; i < elements; ++i, addr += 1U << align) {
+		/* TAR only increments within a 1kiB block */
+		if (!i || !(addr & 0x3ffU))
+			adiv5_ap_queue_write(ap, ADIV5_AP_TAR, addr);
+		adiv5_ap_queue_read(ap, ADIV5_AP_DRW, results + i);
+	}
+}
+
+static void adiv5_readv_extract(const target_iovec_s *iov, const uint32_t *results)
+{
+	const enum align align = MIN(ALIGNOF(iov->src), ALIGNOF(iov->len));
+	uint8_t *dest = iov->dest;
+	uint32_t addr = iov->src;
+	for (size_t i = 0; i < iov->len >> align; ++i, addr += 1U << align)
+		dest = extract(dest, addr, results[i], align);
+}
+
+/*
+ * Each range costs a TAR write and a DRW read per element, and a CSW write when
+ * its access size changes, all of which go out together on the next flush. On
+ * a probe that batches its queue that is one transfer for the lot.
+ */
+bool adiv5_mem_readv(ADIv5_AP_t *ap, const target_iovec_s *iov, size_t count)
+{
+	uint32_t results[ADIV5_READV_BATCH];
+	size_t queued = 0;
+	size_t first = 0;
+	for (size_t i = 0; i <= count; ++i) {
+		const size_t elements = i < count ? adiv5_readv_elements(iov + i) : 0;
+		const bool streamed = elements > ADIV5_READV_ELEMENTS;
+		/* Collect what is queued before a streamed range, at the end, or when results are full */
+		if (queued && (i == count || streamed || queued + elements > ADIV5_READV_BATCH)) {
+			if (adiv5_dp_queue_flush(ap->dp))
+				return true;
+			for (size_t offset = 0; first < i; ++first) {
+				adiv5_readv_extract(iov + first, results + offset);
+				offset += adiv5_readv_elements(iov + first);
+			}
+			queued = 0;
+		}
+		if (i == count)
+			break;
+		if (streamed) {
+			adiv5_mem_read(ap, iov[i].dest, iov[i].src, iov[i].len);
+			first = i + 1U;
+		} else {
+			if (!queued)
+				first = i;
+			adiv5_readv_queue(ap, iov + i, results + queued);
+			queued += elements;
+		}
+	}
+	return false;
+}
+
+void adiv5_dp_raise(ADIv5_DP_t *dp, uint32_t type, const char *msg)
+{
+	if (!dp->errors_deferred)
+		raise_exception(type, msg);
+	if (!dp->deferred_error) {
+		DEBUG_WARN("Deferred error: %s\n", msg);
+		dp->deferred_error = type;
+	}
+}
+
+/*
+ * The low level accessors differ in whether AP reads are posted, so the
+ * default queue simply performs each access as it is submitted. Errors are
+ * only collected on flush, which costs a single CTRL/STAT read per batch.
+ */
+void firmware_queue_read(ADIv5_DP_t *dp, uint16_t addr, uint32_t *result)
+{
+	*result = adiv5_dp_read(dp, addr);
+}
+
+void firmware_queue_write(ADIv5_DP_t *dp, uint16_t addr, uint32_t value)
+{
+	adiv5_dp_write(dp, addr, value);
+}
+
+bool firmware_queue_flush(ADIv5_DP_t *dp)
+{
+	const uint32_t ctrlstat = adiv5_dp_read(dp, ADIV5_DP_CTRLSTAT);
+	if (!dp->fault && !(ctrlstat & (ADIV5_DP_CTRLSTAT_STICKYORUN | ADIV5_DP_CTRLSTAT_STICKYCMP |
+									   ADIV5_DP_CTRLSTAT_STICKYERR | ADIV5_DP_CTRLSTAT_WDATAERR)))
+		return false;
+	adiv5_dp_error(dp);
+	return true;
+}
+
 void adiv5_mem_write(ADIv5_AP_t *ap, uint32_t dest, const void *src, size_t len)
 {
 	enum align align = MIN(ALIGNOF(dest), ALIGNOF(len));
 	adiv5_mem_write_sized(ap, dest, src, len, align);
 }
+
+#define SWJ_FREQ_AUTO_MIN    100000U
+#define SWJ_FREQ_AUTO_MAX    100000000U
+#define SWJ_FREQ_AUTO_ROUNDS 16U
+#define SWJ_FREQ_AUTO_STEPS  12U
+
+/* Get the DP back into a known state after a test at a frequency that was too fast */
+static void adiv5_swj_frequency_recover(ADIv5_DP_t *dp)
+{
+	volatile struct exception e;
+	TRY_CATCH (e, EXCEPTION_ALL) {
+		/* SW-DP may have lost sync, a line reset is only needed by hand below DPv2 */
+		if (dp->seq_out && dp->version < 2) {
+			dp->seq_out(0xffffffffU, 32U);
+			dp->seq_out(0x0fffffffU, 32U);
+		}
+		dp->fault = 0;
+		adiv5_dp_error(dp);
+		adiv5_dp_read(dp, ADIV5_DP_DPIDR);
+		adiv5_dp_error(dp);
+	}
+	dp->fault = 0;
+	adiv5_dp_cache_invalidate(dp);
+}
+
+/*
+ * Hammer the DP with IDCODE and RDBUFF reads and the AP with reads of the
+ * ROM table CIDR words, whose preamble is fixed, checking everything read
+ * matches what was seen at the known good frequency.
+ */
+static bool adiv5_swj_frequency_test(ADIv5_AP_t *ap, const uint32_t dpidr, const uint32_t cidr_addr)
+{
+	ADIv5_DP_t *dp = ap->dp;
+	volatile bool pass = true;
+	volatile struct exception e;
+	TRY_CATCH (e, EXCEPTION_ALL) {
+		for (size_t i = 0; pass && i < SWJ_FREQ_AUTO_ROUNDS; ++i) {
+			if (adiv5_dp_read(dp, ADIV5_DP_DPIDR) != dpidr)
+				pass = false;
+			adiv5_dp_read(dp, ADIV5_DP_RDBUFF);
+			adiv5_dp_cache_invalidate(dp);
+			if ((adiv5_ap_read_id(ap, cidr_addr) & ~CID_CLASS_MASK) != CID_PREAMBLE)
+				pass = false;
+			if (dp->fault)
+				pass = false;
+		}
+		if (pass && adiv5_dp_error(dp))
+			pass = false;
+	}
+	if (e.type)
+		pass = false;
+	if (!pass)
+		adiv5_swj_frequency_recover(ap->dp);
+	return pass;
+}
+
+/*
+ * Binary search for the highest SWJ clock at which the link to the target is
+ * clean, then back off by a quarter to leave some margin. Returns the new
+ * frequency, or 0 when the search was not possible and the old one was restored.
+ */
+uint32_t adiv5_swj_frequency_auto(ADIv5_AP_t *ap)
+{
+	ADIv5_DP_t *dp = ap->dp;
+	const uint32_t original = platform_max_frequency_get();
+	if (original == FREQ_FIXED)
+		return 0;
+
+	const uint32_t cidr_addr = (ap->base & ~0xfffU) + CIDR0_OFFSET;
+	volatile uint32_t dpidr = 0;
+	volatile struct exception e;
+	TRY_CATCH (e, EXCEPTION_ALL) {
+		dpidr = adiv5_dp_read(dp, ADIV5_DP_DPIDR);
+	}
+	if (e.type || dp->fault) {
+		adiv5_swj_frequency_recover(dp);
+		return 0;
+	}
+
+	/* Find a frequency that works to start from */
+	uint32_t good = original;
+	if (!adiv5_swj_frequency_test(ap, dpidr, cidr_addr)) {
+		platform_max_frequency_set(SWJ_FREQ_AUTO_MIN);
+		good = platform_max_frequency_get();
+		if (!adiv5_swj_frequency_test(ap, dpidr, cidr_addr)) {
+			DEBUG_WARN("SWJ link unreliable even at %" PRIu32 "Hz\n", good);
+			platform_max_frequency_set(original);
+			adiv5_swj_frequency_recover(dp);
+			return 0;
+		}
+	}
+
+	/* The interface clamps requests to what it can do, so ask it for its ceiling */
+	platform_max_frequency_set(SWJ_FREQ_AUTO_MAX);
+	uint32_t bad = platform_max_frequency_get();
+	if (bad <= good || adiv5_swj_frequency_test(ap, dpidr, cidr_addr)) {
+		/* The interface runs out of speed before the link does, no margin needed */
+		DEBUG_INFO("SWJ link clean up to the interface maximum of %" PRIu32 "Hz\n", MAX(bad, good));
+		platform_max_frequency_set(MAX(bad, good));
+		return platform_max_frequency_get();
+	}
+
+	for (size_t step = 0; step < SWJ_FREQ_AUTO_STEPS && bad - good > good / 16U; ++step) {
+		const uint32_t candidate = good + (bad - good) / 2U;
+		platform_max_frequency_set(candidate);
+		const uint32_t actual = platform_max_frequency_get();
+		/* Stop once the interface can not resolve anything between the bounds */
+		if (actual <= good || actual >= bad)
+			break;
+		if (adiv5_swj_frequency_test(ap, dpidr, cidr_addr))
+			good = actual;
+		else
+			bad = actual;
+		DEBUG_INFO("SWJ frequency search: %" PRIu32 "Hz %s\n", actual, good == actual ? "passed" : "failed");
+	}
+
+	platform_max_frequency_set(good - good / 4U);
+	adiv5_swj_frequency_recover(dp);
+	return platform_max_frequency_get();
+}
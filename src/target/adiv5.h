@@ -22,6 +22,7 @@
 #define TARGET_ADIV5_H
 
 #include "jtag_scan.h"
+#include "target.h"
 
 #if PC_HOSTED == 1
 #include "platform.h"
@@ -236,6 +237,47 @@ enum align {
 typedef struct ADIv5_AP_s ADIv5_AP_t;
 
 /* Try to keep this somewhat absract for later adding SW-DP */
+/* How hard to try when the target answers WAIT or FAULT before giving up on a transaction */
+typedef struct adiv5_retry_policy {
+	uint16_t wait_retries;
+	uint16_t fault_retries;
+	/* Idle cycles inserted after the first WAIT, doubled on each further WAIT up to the maximum */
+	uint8_t idle_cycles;
+	uint8_t idle_cycles_max;
+	/* Idle cycles clocked after every transfer, the least the DP tunes itself down to */
+	uint8_t idle_after;
+} adiv5_retry_policy_s;
+
+#define ADIV5_RETRY_WAIT_DEFAULT       4096U
+#define ADIV5_RETRY_FAULT_DEFAULT      8U
+#define ADIV5_RETRY_IDLE_DEFAULT       2U
+#define ADIV5_RETRY_IDLE_MAX_DEFAULT   64U
+#define ADIV5_RETRY_IDLE_AFTER_DEFAULT 0U
+/* Transfers without a WAIT it takes to halve the learned idle cycles again */
+#define ADIV5_IDLE_CLEAN_TRANSFERS     256U
+/* Idle cycles hinted for parts that come out of reset running from a slow low-power clock */
+#define ADIV5_IDLE_AFTER_LOW_POWER     4U
+
+/* Policy copied into each DP when it is created by a scan */
+extern adiv5_retry_policy_s adiv5_retry_default;
+
+/* CoreSight trace components found by the ROM table walk, for the trace buffer commands */
+#define ADIV5_TRACE_COMPONENTS 8U
+
+typedef enum adiv5_trace_kind {
+	ADIV5_TRACE_ETM3,   /* ETMv3 and PTM, which share the programming model */
+	ADIV5_TRACE_ETM4,
+	ADIV5_TRACE_FUNNEL,
+	ADIV5_TRACE_ETB,
+	ADIV5_TRACE_TMC,
+} adiv5_trace_kind_e;
+
+typedef struct adiv5_trace_component {
+	uint32_t addr;
+	uint8_t apsel;
+	uint8_t kind;
+} adiv5_trace_component_s;
+
 typedef struct ADIv5_DP_s {
 	int refcnt;
 
@@ -249,6 +291,8 @@ typedef struct ADIv5_DP_s {
 	uint32_t (*error)(struct ADIv5_DP_s *dp);
 	uint32_t (*low_access)(struct ADIv5_DP_s *dp, uint8_t RnW, uint16_t addr, uint32_t value);
 	void (*abort)(struct ADIv5_DP_s *dp, uint32_t abort);
+	/* Resynchronise the wire protocol after it was lost, NULL where not needed */
+	void (*line_reset)(struct ADIv5_DP_s *dp);
 
 #if PC_HOSTED == 1
 	bmp_type_t dp_bmp_type;
@@ -263,14 +307,46 @@ typedef struct ADIv5_DP_s {
 	uint32_t (*ap_read)(ADIv5_AP_t *ap, uint16_t addr);
 	void (*ap_write)(ADIv5_AP_t *ap, uint16_t addr, uint32_t value);
 
+	/* Deferred DP/AP accesses. Read results are only valid once queue_flush
+	 * has returned, which checks the sticky error bits once for the whole
+	 * batch and returns true if any access failed */
+	void (*queue_read)(struct ADIv5_DP_s *dp, uint16_t addr, uint32_t *result);
+	void (*queue_write)(struct ADIv5_DP_s *dp, uint16_t addr, uint32_t value);
+	bool (*queue_flush)(struct ADIv5_DP_s *dp);
+
 	void (*mem_read)(ADIv5_AP_t *ap, void *dest, uint32_t src, size_t len);
 	void (*mem_write_sized)(ADIv5_AP_t *ap, uint32_t dest, const void *src, size_t len, enum align align);
 	uint8_t dp_jd_index;
 	uint8_t fault;
+	/* Wire errors held rather than raised while deferred, see adiv5_dp_raise() */
+	bool errors_deferred;
+	uint32_t deferred_error;
+	adiv5_retry_policy_s retry;
+	/* Idle cycles learned on top of retry.idle_after, see adiv5_dp_idle_tune() */
+	uint8_t idle_learned;
+	uint16_t idle_clean;
+
+	/* Last SELECT written, and a counter bumped whenever the cached
+	 * SELECT and AP CSW/TAR values can no longer be trusted */
+	bool select_valid;
+	uint32_t select;
+	uint32_t cache_epoch;
+
+	/* AXI-AP, or failing that AHB-AP, seen on this DP: the system bus view
+	 * used for bulk memory access by cores debugged through an APB-AP */
+	bool sysmem_ap_valid;
+	bool sysmem_ap_axi;
+	uint8_t sysmem_apsel;
+
+	adiv5_trace_component_s trace[ADIV5_TRACE_COMPONENTS];
+	uint8_t trace_count;
+	bool trace_running;
 
 	/* targetsel DPv2 */
 	uint8_t instance;
 	uint32_t targetsel;
+	/* Device this DP belongs to, shared by the DPs of one multidrop part */
+	uint32_t group;
 
 	uint8_t version;
 
@@ -294,6 +370,12 @@ struct ADIv5_AP_s {
 	uint32_t idr;
 	uint32_t base;
 	uint32_t csw;
+	bool packed_transfers;     /* MEM-AP supports CSW.AddrInc packed mode */
+	/* Last CSW and TAR written, valid while cache_epoch matches the DP's */
+	uint8_t cache_valid;
+	uint32_t cache_epoch;
+	uint32_t csw_cache;
+	uint32_t tar_cache;
 	uint32_t ap_cortexm_demcr; /* Copy of demcr when starting */
 	uint32_t ap_storage;       /* E.g to hold STM32F7 initial DBGMCU_CR value.*/
 
@@ -304,6 +386,53 @@ struct ADIv5_AP_s {
 
 uint8_t make_packet_request(uint8_t RnW, uint16_t addr);
 
+#define ADIV5_AP_CACHE_CSW (1U << 0U)
+#define ADIV5_AP_CACHE_TAR (1U << 1U)
+
+/* Forget the cached SELECT of this DP and the CSW/TAR of all its APs */
+static inline void adiv5_dp_cache_invalidate(ADIv5_DP_t *dp)
+{
+	dp->select_valid = false;
+	++dp->cache_epoch;
+}
+
+/* Idle cycles to clock after each transfer on this DP */
+static inline size_t adiv5_dp_idle_after(const ADIv5_DP_t *dp)
+{
+	return (size_t)dp->retry.idle_after + dp->idle_learned;
+}
+
+/*
+ * Called after each transfer with the WAITs it met. A transfer that had to wait
+ * doubles the learned idle cycles, so a slow AHB gets its time up front rather
+ * than through far costlier WAIT round trips, and a long run without any halves
+ * them again so a fast target isn't slowed down for good.
+ */
+static inline void adiv5_dp_idle_tune(ADIv5_DP_t *dp, size_t waits)
+{
+	if (waits) {
+		dp->idle_clean = 0;
+		const unsigned int idle = dp->idle_learned ? (unsigned int)dp->idle_learned << 1U : 1U;
+		dp->idle_learned = idle < dp->retry.idle_cycles_max ? idle : dp->retry.idle_cycles_max;
+	} else if (dp->idle_learned && ++dp->idle_clean >= ADIV5_IDLE_CLEAN_TRANSFERS) {
+		dp->idle_clean = 0;
+		dp->idle_learned >>= 1U;
+	}
+}
+
+/* For target drivers that know the part answers slowly, e.g. running from a low-power clock after reset */
+static inline void adiv5_dp_idle_hint(ADIv5_DP_t *dp, uint8_t idle_after)
+{
+	if (idle_after > dp->retry.idle_after)
+		dp->retry.idle_after = idle_after;
+}
+
+/*
+ * Reads through dp->mem_read with an unaligned head and tail done on their own,
+ * so the middle of a longer range goes at word width whatever its alignment.
+ */
+void adiv5_mem_read_split(ADIv5_AP_t *ap, void *dest, uint32_t src, size_t len);
+
 #if PC_HOSTED == 0
 static inline uint32_t adiv5_dp_read(ADIv5_DP_t *dp, uint16_t addr)
 {
@@ -312,6 +441,7 @@ static inline uint32_t adiv5_dp_read(ADIv5_DP_t *dp, uint16_t addr)
 
 static inline uint32_t adiv5_dp_error(ADIv5_DP_t *dp)
 {
+	adiv5_dp_cache_invalidate(dp);
 	return dp->error(dp);
 }
 
@@ -322,6 +452,7 @@ static inline uint32_t adiv5_dp_low_access(struct ADIv5_DP_s *dp, uint8_t RnW, u
 
 static inline void adiv5_dp_abort(struct ADIv5_DP_s *dp, uint32_t abort)
 {
+	adiv5_dp_cache_invalidate(dp);
 	return dp->abort(dp, abort);
 }
 
@@ -337,7 +468,7 @@ static inline void adiv5_ap_write(ADIv5_AP_t *ap, uint16_t addr, uint32_t value)
 
 static inline void adiv5_mem_read(ADIv5_AP_t *ap, void *dest, uint32_t src, size_t len)
 {
-	return ap->dp->mem_read(ap, dest, src, len);
+	adiv5_mem_read_split(ap, dest, src, len);
 }
 
 static inline void adiv5_mem_write_sized(ADIv5_AP_t *ap, uint32_t dest, const void *src, size_t len, enum align align)
@@ -362,9 +493,58 @@ void adiv5_mem_write_sized(ADIv5_AP_t *ap, uint32_t dest, const void *src, size_
 void adiv5_dp_write(ADIv5_DP_t *dp, uint16_t addr, uint32_t value);
 #endif
 
+static inline void adiv5_dp_queue_read(ADIv5_DP_t *dp, uint16_t addr, uint32_t *result)
+{
+	dp->queue_read(dp, addr, result);
+}
+
+static inline void adiv5_dp_queue_write(ADIv5_DP_t *dp, uint16_t addr, uint32_t value)
+{
+	dp->queue_write(dp, addr, value);
+}
+
+static inline bool adiv5_dp_queue_flush(ADIv5_DP_t *dp)
+{
+	return dp->queue_flush(dp);
+}
+
+/*
+ * Hot loops such as halt polling can have the wire layer hold its errors in the
+ * DP instead of raising them, saving a setjmp() per access. The first error is
+ * kept, the low level accessors do nothing more until it is collected, and
+ * collecting returns its EXCEPTION_ type, or 0 if there was none, and stops
+ * deferring. Accessors report errors through adiv5_dp_raise() for this to work.
+ */
+static inline void adiv5_dp_errors_defer(ADIv5_DP_t *dp)
+{
+	dp->errors_deferred = true;
+	dp->deferred_error = 0;
+}
+
+static inline uint32_t adiv5_dp_errors_collect(ADIv5_DP_t *dp)
+{
+	dp->errors_deferred = false;
+	const uint32_t error = dp->deferred_error;
+	dp->deferred_error = 0;
+	return error;
+}
+
+void adiv5_dp_raise(ADIv5_DP_t *dp, uint32_t type, const char *msg);
+
+void adiv5_ap_queue_read(ADIv5_AP_t *ap, uint16_t addr, uint32_t *result);
+void adiv5_ap_queue_write(ADIv5_AP_t *ap, uint16_t addr, uint32_t value);
+/* Reads the small ranges of iov through the queue, flushing as few times as it can, true on error */
+bool adiv5_mem_readv(ADIv5_AP_t *ap, const target_iovec_s *iov, size_t count);
+
 void adiv5_dp_init(ADIv5_DP_t *dp, uint32_t idcode);
 void platform_adiv5_dp_defaults(ADIv5_DP_t *dp);
+#if PC_HOSTED == 1
+bool platform_rom_cache_load(void *data, size_t size);
+void platform_rom_cache_save(const void *data, size_t size);
+#endif
 ADIv5_AP_t *adiv5_new_ap(ADIv5_DP_t *dp, uint8_t apsel);
+ADIv5_AP_t *adiv5_sysmem_ap(ADIv5_DP_t *dp);
+bool adiv5_ap_recover(ADIv5_AP_t *ap);
 void remote_jtag_dev(const jtag_dev_t *jtag_dev);
 void adiv5_ap_ref(ADIv5_AP_t *ap);
 void adiv5_ap_unref(ADIv5_AP_t *ap);
@@ -376,18 +556,25 @@ int swdptap_init(ADIv5_DP_t *dp);
 
 void adiv5_mem_write(ADIv5_AP_t *ap, uint32_t dest, const void *src, size_t len);
 uint64_t adiv5_ap_read_pidr(ADIv5_AP_t *ap, uint32_t addr);
+uint32_t adiv5_swj_frequency_auto(ADIv5_AP_t *ap);
 void *extract(void *dest, uint32_t src, uint32_t val, enum align align);
 
 void firmware_mem_write_sized(ADIv5_AP_t *ap, uint32_t dest, const void *src, size_t len, enum align align);
 void firmware_mem_read(ADIv5_AP_t *ap, void *dest, uint32_t src, size_t len);
 void firmware_ap_write(ADIv5_AP_t *ap, uint16_t addr, uint32_t value);
 uint32_t firmware_ap_read(ADIv5_AP_t *ap, uint16_t addr);
+void firmware_queue_read(ADIv5_DP_t *dp, uint16_t addr, uint32_t *result);
+void firmware_queue_write(ADIv5_DP_t *dp, uint16_t addr, uint32_t value);
+bool firmware_queue_flush(ADIv5_DP_t *dp);
 uint32_t firmware_swdp_low_access(ADIv5_DP_t *dp, uint8_t RnW, uint16_t addr, uint32_t value);
 uint32_t fw_adiv5_jtagdp_low_access(ADIv5_DP_t *dp, uint8_t RnW, uint16_t addr, uint32_t value);
 uint32_t firmware_swdp_read(ADIv5_DP_t *dp, uint16_t addr);
 uint32_t fw_adiv5_jtagdp_read(ADIv5_DP_t *dp, uint16_t addr);
 
 uint32_t firmware_swdp_error(ADIv5_DP_t *dp);
+uint32_t adiv5_jtagdp_error(ADIv5_DP_t *dp);
+void firmware_swdp_select(ADIv5_DP_t *dp);
+void firmware_swdp_line_reset(ADIv5_DP_t *dp);
 
 void firmware_swdp_abort(ADIv5_DP_t *dp, uint32_t abort);
 void adiv5_jtagdp_abort(ADIv5_DP_t *dp, uint32_t abort);
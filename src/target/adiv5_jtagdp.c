@@ -28,6 +28,7 @@
 #include "jtag_scan.h"
 #include "jtagtap.h"
 #include "morse.h"
+#include "stats.h"
 
 #define JTAGDP_ACK_OK   0x02U
 #define JTAGDP_ACK_WAIT 0x01U
@@ -37,7 +38,16 @@
 #define IR_DPACC 0xAU
 #define IR_APACC 0xBU
 
-static uint32_t adiv5_jtagdp_error(ADIv5_DP_t *dp);
+static void adiv5_jtagdp_queue_read(ADIv5_DP_t *dp, uint16_t addr, uint32_t *result);
+static void adiv5_jtagdp_queue_write(ADIv5_DP_t *dp, uint16_t addr, uint32_t value);
+static bool adiv5_jtagdp_queue_flush(ADIv5_DP_t *dp);
+
+/*
+ * Every JTAG-DP scan captures the result of the read before it, so queued reads
+ * are collected from the next scan instead of each costing a RDBUFF read and
+ * two IR changes. This is where the result of the last read issued goes.
+ */
+static uint32_t *jtagdp_queue_pending;
 
 void adiv5_jtag_dp_handler(uint8_t jd_index)
 {
@@ -48,12 +58,16 @@ void adiv5_jtag_dp_handler(uint8_t jd_index)
 	}
 
 	dp->dp_jd_index = jd_index;
+	dp->retry = adiv5_retry_default;
 
 	if ((PC_HOSTED == 0) || (!platform_jtag_dp_init(dp))) {
 		dp->dp_read = fw_adiv5_jtagdp_read;
 		dp->error = adiv5_jtagdp_error;
 		dp->low_access = fw_adiv5_jtagdp_low_access;
 		dp->abort = adiv5_jtagdp_abort;
+		dp->queue_read = adiv5_jtagdp_queue_read;
+		dp->queue_write = adiv5_jtagdp_queue_write;
+		dp->queue_flush = adiv5_jtagdp_queue_flush;
 	}
 
 	adiv5_dp_init(dp, jtag_devs[jd_index].jd_idcode);
@@ -65,21 +79,32 @@ uint32_t fw_adiv5_jtagdp_read(ADIv5_DP_t *dp, uint16_t addr)
 	return fw_adiv5_jtagdp_low_access(dp, ADIV5_LOW_READ, ADIV5_DP_RDBUFF, 0);
 }
 
-static uint32_t adiv5_jtagdp_error(ADIv5_DP_t *dp)
+uint32_t adiv5_jtagdp_error(ADIv5_DP_t *dp)
 {
 	fw_adiv5_jtagdp_low_access(dp, ADIV5_LOW_READ, ADIV5_DP_CTRLSTAT, 0);
 	return fw_adiv5_jtagdp_low_access(dp, ADIV5_LOW_WRITE, ADIV5_DP_CTRLSTAT, 0xf0000032U) & 0x32U;
 }
 
+/* Clock cycles in Run-Test/Idle, at most 32 to a sequence */
+static void adiv5_jtagdp_idle(const size_t idle_cycles)
+{
+	for (size_t cycles = 0; cycles < idle_cycles; cycles += 32U)
+		jtag_proc.jtagtap_tms_seq(0, MIN(idle_cycles - cycles, 32U));
+}
+
 uint32_t fw_adiv5_jtagdp_low_access(ADIv5_DP_t *dp, uint8_t RnW, uint16_t addr, uint32_t value)
 {
 	const bool APnDP = addr & ADIV5_APnDP;
 	addr &= 0xff;
+	if (dp->deferred_error)
+		return 0;
 
 	const uint64_t request = ((uint64_t)value << 3U) | ((addr >> 1U) & 0x06U) | (RnW ? 1U : 0U);
 
 	uint64_t response;
 	uint8_t ack;
+	size_t waits = 0;
+	size_t idle_cycles = dp->retry.idle_cycles;
 
 	jtag_dev_write_ir(&jtag_proc, dp->dp_jd_index, APnDP ? IR_APACC : IR_DPACC);
 
@@ -88,15 +113,29 @@ uint32_t fw_adiv5_jtagdp_low_access(ADIv5_DP_t *dp, uint8_t RnW, uint16_t addr,
 	do {
 		jtag_dev_shift_dr(&jtag_proc, dp->dp_jd_index, (uint8_t *)&response, (uint8_t *)&request, 35);
 		ack = response & 0x07;
-	} while (!platform_timeout_is_expired(&timeout) && ack == JTAGDP_ACK_WAIT);
+		if (ack != JTAGDP_ACK_WAIT)
+			break;
+		stats_add(STATS_DP_WAIT, 1);
+		if (++waits > dp->retry.wait_retries)
+			break;
+		/* Spend extra cycles in Run-Test/Idle before retrying */
+		adiv5_jtagdp_idle(idle_cycles);
+		idle_cycles = MIN(idle_cycles ? idle_cycles << 1U : 1U, dp->retry.idle_cycles_max);
+	} while (!platform_timeout_is_expired(&timeout));
+	adiv5_dp_idle_tune(dp, waits);
 
 	if (ack == JTAGDP_ACK_WAIT) {
+		stats_add(STATS_DP_RETRY_EXHAUSTED, 1);
+		adiv5_dp_cache_invalidate(dp);
 		dp->abort(dp, ADIV5_DP_ABORT_DAPABORT);
 		dp->fault = 1;
 		return 0;
 	}
-	if (ack != JTAGDP_ACK_OK)
-		raise_exception(EXCEPTION_ERROR, "JTAG-DP invalid ACK");
+	if (ack != JTAGDP_ACK_OK) {
+		adiv5_dp_raise(dp, EXCEPTION_ERROR, "JTAG-DP invalid ACK");
+		return 0;
+	}
+	adiv5_jtagdp_idle(adiv5_dp_idle_after(dp));
 
 	return (uint32_t)(response >> 3);
 }
@@ -107,3 +146,38 @@ void adiv5_jtagdp_abort(ADIv5_DP_t *dp, uint32_t abort)
 	jtag_dev_write_ir(&jtag_proc, dp->dp_jd_index, IR_ABORT);
 	jtag_dev_shift_dr(&jtag_proc, dp->dp_jd_index, NULL, (const uint8_t *)&request, 35);
 }
+
+/* Issue one scan of a queued access, handing what it captured to the read before it */
+static void adiv5_jtagdp_queue_access(ADIv5_DP_t *dp, uint8_t RnW, uint16_t addr, uint32_t value, uint32_t *result)
+{
+	volatile uint32_t captured = 0;
+	volatile struct exception e;
+	TRY_CATCH (e, EXCEPTION_ALL) {
+		captured = fw_adiv5_jtagdp_low_access(dp, RnW, addr, value);
+	}
+	if (e.type) {
+		/* Do not leave a pointer into a frame the exception is unwinding */
+		jtagdp_queue_pending = NULL;
+		raise_exception(e.type, e.msg);
+	}
+	if (jtagdp_queue_pending)
+		*jtagdp_queue_pending = captured;
+	jtagdp_queue_pending = result;
+}
+
+static void adiv5_jtagdp_queue_read(ADIv5_DP_t *dp, uint16_t addr, uint32_t *result)
+{
+	adiv5_jtagdp_queue_access(dp, ADIV5_LOW_READ, addr, 0, result);
+}
+
+static void adiv5_jtagdp_queue_write(ADIv5_DP_t *dp, uint16_t addr, uint32_t value)
+{
+	adiv5_jtagdp_queue_access(dp, ADIV5_LOW_WRITE, addr, value, NULL);
+}
+
+static bool adiv5_jtagdp_queue_flush(ADIv5_DP_t *dp)
+{
+	if (jtagdp_queue_pending)
+		adiv5_jtagdp_queue_access(dp, ADIV5_LOW_READ, ADIV5_DP_RDBUFF, 0, NULL);
+	return firmware_queue_flush(dp);
+}
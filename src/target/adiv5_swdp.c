@@ -28,6 +28,7 @@
 #include "adiv5.h"
 #include "target.h"
 #include "target_internal.h"
+#include "stats.h"
 
 uint8_t make_packet_request(uint8_t RnW, uint16_t addr)
 {
@@ -50,12 +51,63 @@ uint8_t make_packet_request(uint8_t RnW, uint16_t addr)
 	return request;
 }
 
+/*
+ * TARGETSEL value of the multi-drop DP currently listening on the bus, 0 when
+ * none is (bit 0 of a valid TARGETSEL is always set). Lets each DP found by the
+ * scan stay in the target list and be switched to on first access.
+ */
+static uint32_t swdp_selected_targetsel;
+
 /* Provide bare DP access functions without timeout and exception */
 
-static void dp_line_reset(ADIv5_DP_t *dp)
+static void dp_line_reset_sequence(ADIv5_DP_t *dp)
 {
 	dp->seq_out(0xFFFFFFFFU, 32U);
 	dp->seq_out(0x0FFFFFFFU, 32U);
+	/* A line reset deselects all multi-drop DPs */
+	swdp_selected_targetsel = 0;
+}
+
+static void dp_line_reset(ADIv5_DP_t *dp)
+{
+	dp_line_reset_sequence(dp);
+	adiv5_dp_cache_invalidate(dp);
+}
+
+static void dp_targetsel(ADIv5_DP_t *dp, const uint32_t targetsel)
+{
+	dp_line_reset(dp);
+	dp->dp_low_write(dp, ADIV5_DP_TARGETSEL, targetsel);
+	swdp_selected_targetsel = targetsel;
+}
+
+/* Switch the bus over to this DP if another multi-drop DP was used last */
+void firmware_swdp_select(ADIv5_DP_t *dp)
+{
+	if (dp->version < 2 || !dp->targetsel || !dp->dp_low_write || swdp_selected_targetsel == dp->targetsel)
+		return;
+	DEBUG_PROBE("Switching to DP instance %u\n", dp->instance);
+	/*
+	 * Unlike recovering from an error, switching DP leaves the AP registers as
+	 * they were when this DP was last used, so its cached CSW and TAR values stay
+	 * good and only SELECT is written again. Going back and forth between the
+	 * two RP2040 cores costs the line reset, TARGETSEL and DPIDR read alone.
+	 */
+	dp_line_reset_sequence(dp);
+	dp->select_valid = false;
+	dp->dp_low_write(dp, ADIV5_DP_TARGETSEL, dp->targetsel);
+	swdp_selected_targetsel = dp->targetsel;
+	/* A DP only becomes active after reading DPIDR following TARGETSEL */
+	firmware_swdp_low_access(dp, ADIV5_LOW_READ, ADIV5_DP_DPIDR, 0);
+}
+
+/* Get back in sync after a protocol error, leaving the DP selected and out of reset */
+void firmware_swdp_line_reset(ADIv5_DP_t *dp)
+{
+	dp_line_reset(dp);
+	if (dp->version >= 2 && dp->targetsel && dp->dp_low_write)
+		dp_targetsel(dp, dp->targetsel);
+	dp->dp_read(dp, ADIV5_DP_DPIDR);
 }
 
 bool firmware_dp_low_write(ADIv5_DP_t *dp, uint16_t addr, const uint32_t data)
@@ -83,6 +135,8 @@ uint32_t adiv5_swdp_scan(uint32_t targetid)
 		.dp_read = firmware_swdp_read,
 		.low_access = firmware_swdp_low_access,
 		.abort = firmware_swdp_abort,
+		.line_reset = firmware_swdp_line_reset,
+		.retry = adiv5_retry_default,
 	};
 	ADIv5_DP_t *initial_dp = &idp;
 
@@ -158,12 +212,10 @@ uint32_t adiv5_swdp_scan(uint32_t targetid)
 
 	const volatile size_t max_dp = (scan_multidrop) ? 16U : 1U;
 	for (volatile size_t i = 0; i < max_dp; i++) {
+		const uint32_t targetsel = (i << ADIV5_DP_TARGETSEL_TINSTANCE_OFFSET) |
+			(dp_targetid & (ADIV5_DP_TARGETSEL_TPARTNO_MASK | ADIV5_DP_TARGETSEL_TDESIGNER_MASK | 1U));
 		if (scan_multidrop) {
-			dp_line_reset(initial_dp);
-
-			initial_dp->dp_low_write(initial_dp, ADIV5_DP_TARGETSEL,
-				(i << ADIV5_DP_TARGETSEL_TINSTANCE_OFFSET) |
-					(dp_targetid & (ADIV5_DP_TARGETSEL_TPARTNO_MASK | ADIV5_DP_TARGETSEL_TDESIGNER_MASK | 1U)));
+			dp_targetsel(initial_dp, targetsel);
 
 			TRY_CATCH (e, EXCEPTION_ALL) {
 				initial_dp->dp_read(initial_dp, ADIV5_DP_DPIDR);
@@ -180,6 +232,9 @@ uint32_t adiv5_swdp_scan(uint32_t targetid)
 
 		memcpy(dp, initial_dp, sizeof(ADIv5_DP_t));
 		dp->instance = i;
+		/* Until adiv5_dp_init() reads TARGETID and the version, this is what selected the DP */
+		if (scan_multidrop)
+			dp->targetsel = targetsel;
 
 		adiv5_dp_init(dp, 0);
 	}
@@ -201,8 +256,7 @@ uint32_t firmware_swdp_error(ADIv5_DP_t *dp)
 		/* On protocol error target gets deselected.
 		 * With DP Change, another target needs selection.
 		 * => Reselect with right target! */
-		dp_line_reset(dp);
-		dp->dp_low_write(dp, ADIV5_DP_TARGETSEL, dp->targetsel);
+		dp_targetsel(dp, dp->targetsel);
 		dp->dp_read(dp, ADIV5_DP_DPIDR);
 		/* Exception here is unexpected, so do not catch */
 	}
@@ -225,27 +279,55 @@ uint32_t firmware_swdp_error(ADIv5_DP_t *dp)
 	return err;
 }
 
+/* Clock idle cycles with SWDIO low, at most 32 to a sequence */
+static void firmware_swdp_idle(ADIv5_DP_t *dp, const size_t idle_cycles)
+{
+	for (size_t cycles = 0; cycles < idle_cycles; cycles += 32U)
+		dp->seq_out(0, MIN(idle_cycles - cycles, 32U));
+}
+
 uint32_t firmware_swdp_low_access(ADIv5_DP_t *dp, uint8_t RnW, uint16_t addr, uint32_t value)
 {
 	uint8_t request = make_packet_request(RnW, addr);
 	uint32_t response = 0;
 	uint32_t ack = SWDP_ACK_WAIT;
 	platform_timeout timeout;
+	size_t waits = 0;
+	size_t faults = 0;
+	size_t idle_cycles = dp->retry.idle_cycles;
 
-	if ((addr & ADIV5_APnDP) && dp->fault)
+	if (((addr & ADIV5_APnDP) && dp->fault) || dp->deferred_error)
 		return 0;
 
+	firmware_swdp_select(dp);
+
 	platform_timeout_set(&timeout, 250);
 	do {
 		dp->seq_out(request, 8);
 		ack = dp->seq_in(3);
-		if (ack == SWDP_ACK_FAULT) {
+		if (ack == SWDP_ACK_WAIT) {
+			stats_add(STATS_DP_WAIT, 1);
+			if (++waits > dp->retry.wait_retries)
+				break;
+			/* Give a slow AHB more time on each WAIT rather than hammering it */
+			firmware_swdp_idle(dp, idle_cycles);
+			idle_cycles = MIN(idle_cycles ? idle_cycles << 1U : 1U, dp->retry.idle_cycles_max);
+		} else if (ack == SWDP_ACK_FAULT) {
+			stats_add(STATS_DP_FAULT, 1);
+			if (++faults > dp->retry.fault_retries)
+				break;
 			/* On fault, abort the request and repeat */
+			adiv5_dp_cache_invalidate(dp);
 			dp->error(dp);
 		}
 	} while ((ack == SWDP_ACK_WAIT || ack == SWDP_ACK_FAULT) && !platform_timeout_is_expired(&timeout));
 
+	if (ack == SWDP_ACK_WAIT || ack == SWDP_ACK_FAULT)
+		stats_add(STATS_DP_RETRY_EXHAUSTED, 1);
+	adiv5_dp_idle_tune(dp, waits);
+
 	if (ack == SWDP_ACK_WAIT) {
+		adiv5_dp_cache_invalidate(dp);
 		dp->abort(dp, ADIV5_DP_ABORT_DAPABORT);
 		dp->fault = 1;
 		return 0;
@@ -257,13 +339,17 @@ uint32_t firmware_swdp_low_access(ADIv5_DP_t *dp, uint8_t RnW, uint16_t addr, ui
 	}
 
 	if (ack != SWDP_ACK_OK)
-		raise_exception(EXCEPTION_ERROR, "SWDP invalid ACK");
+		adiv5_dp_raise(dp, EXCEPTION_ERROR, "SWDP invalid ACK");
+	if (dp->deferred_error)
+		return 0;
 
 	if (RnW) {
 		if (dp->seq_in_parity(&response, 32)) { /* Give up on parity error */
 			dp->fault = 1;
-			raise_exception(EXCEPTION_ERROR, "SWDP Parity error");
+			adiv5_dp_raise(dp, EXCEPTION_ERROR, "SWDP Parity error");
+			return 0;
 		}
+		firmware_swdp_idle(dp, adiv5_dp_idle_after(dp));
 	} else {
 		dp->seq_out_parity(value, 32);
 		/* ARM Debug Interface Architecture Specification ADIv5.0 to ADIv5.2
@@ -275,7 +361,7 @@ uint32_t firmware_swdp_low_access(ADIv5_DP_t *dp, uint8_t RnW, uint16_t addr, ui
 		 * Implement last option to favour correctness over
 		 *   slight speed decrease
 		 */
-		dp->seq_out(0, 8);
+		firmware_swdp_idle(dp, MAX(adiv5_dp_idle_after(dp), 8U));
 	}
 	return response;
 }
@@ -36,6 +36,8 @@ extern const struct command_s stm32f1_cmd_list[]; // Reuse stm32f1 stuff
 
 static bool ch32f1_flash_erase(target_flash_s *f, target_addr_t addr, size_t len);
 static bool ch32f1_flash_write(target_flash_s *f, target_addr_t dest, const void *src, size_t len);
+static bool ch32f1_flash_prepare(target_flash_s *f);
+static bool ch32f1_flash_done(target_flash_s *f);
 
 // these are common with stm32f1/gd32f1/...
 #define FPEC_BASE						0x40022000
@@ -64,6 +66,17 @@ static bool ch32f1_flash_write(target_flash_s *f, target_addr_t dest, const void
 #define FLASH_CR_BUF_RESET_CH32   		(1 << 19) // Buffer reset
 #define FLASH_SR_EOP			  		(1 << 5)  // End of programming
 #define FLASH_BEGIN_ADDRESS_CH32  		0x8000000
+#define CH32F1_PAGE_SIZE				128U
+#define CH32F1_WRITE_SIZE				1024U // Pages handed to the stub at a time
+
+static const uint16_t ch32f1_flash_write_stub[] = {
+#include "flashstub/ch32f1.stub"
+};
+
+static const target_flash_stub_s ch32f1_flash_stub = {
+	.code = ch32f1_flash_write_stub,
+	.code_size = sizeof(ch32f1_flash_write_stub),
+};
 
 /**
 		\fn ch32f1_add_flash
@@ -71,7 +84,7 @@ static bool ch32f1_flash_write(target_flash_s *f, target_addr_t dest, const void
 */
 static void ch32f1_add_flash(target *t, uint32_t addr, size_t length, size_t erasesize)
 {
-	target_flash_s *f = calloc(1, sizeof(*f));
+	target_flash_s *f = target_arena_calloc(sizeof(*f));
 	if (!f) { /* calloc failed: heap exhaustion */
 		DEBUG_WARN("calloc: failed in %s\n", __func__);
 		return;
@@ -82,7 +95,10 @@ static void ch32f1_add_flash(target *t, uint32_t addr, size_t length, size_t era
 	f->blocksize = erasesize;
 	f->erase = ch32f1_flash_erase;
 	f->write = ch32f1_flash_write;
-	f->writesize = erasesize;
+	f->prepare = ch32f1_flash_prepare;
+	f->done = ch32f1_flash_done;
+	f->writesize = CH32F1_WRITE_SIZE;
+	f->stub = &ch32f1_flash_stub;
 	f->erased = 0xff;
 	target_add_flash(t, f);
 }
@@ -157,6 +173,27 @@ static bool ch32f1_flash_lock(target *t)
 	return false;
 }
 
+/**
+  \fn ch32f1_flash_prepare
+  \brief unlock once for the whole flash session, the probe may have left it unlocked already
+*/
+static bool ch32f1_flash_prepare(target_flash_s *f)
+{
+	target *t = f->t;
+	const uint32_t cr = target_mem_read32(t, FLASH_CR);
+	if ((cr & (FLASH_CR_LOCK | FLASH_CR_FLOCK_CH32)) && ch32f1_flash_unlock(t)) {
+		DEBUG_WARN("CH32: Unlock failed\n");
+		return false;
+	}
+	return true;
+}
+
+static bool ch32f1_flash_done(target_flash_s *f)
+{
+	ch32f1_flash_lock(f->t);
+	return true;
+}
+
 /**
 	\brief identify the ch32f1 chip
 				Actually grab all cortex m3 with designer = arm not caught earlier...
@@ -206,10 +243,6 @@ bool ch32f1_flash_erase(target_flash_s *f, target_addr_t addr, size_t len)
 	target *t = f->t;
 	DEBUG_INFO("CH32: flash erase \n");
 
-	if (ch32f1_flash_unlock(t)) {
-		DEBUG_WARN("CH32: Unlock failed\n");
-		return false;
-	}
 	// Fast Erase 128 bytes pages (ch32 mode)
 	while (len) {
 		SET_CR(FLASH_CR_FTER_CH32);// CH32 PAGE_ER
@@ -229,7 +262,6 @@ bool ch32f1_flash_erase(target_flash_s *f, target_addr_t addr, size_t len)
 		addr += 128;
 	}
 	sr = target_mem_read32(t, FLASH_SR);
-	ch32f1_flash_lock(t);
 	if (sr & SR_ERROR_MASK) {
 		DEBUG_WARN("ch32f1 flash erase error 0x%" PRIx32 "\n", sr);
 		return false;
@@ -292,10 +324,25 @@ static int ch32f1_buffer_clear(target *t)
 	CLEAR_CR(FLASH_CR_FTPG_CH32); // Fast page program 4-
 	return 0;
 }
+/**
+	\fn ch32f1_page_erased
+	\brief true if the write buffer leaves this page erased, as it does past the end of the image
+*/
+static bool ch32f1_page_erased(const void *src)
+{
+	const uint8_t *data = (const uint8_t *)src;
+	for (size_t i = 0; i < CH32F1_PAGE_SIZE; ++i) {
+		if (data[i] != 0xffU)
+			return false;
+	}
+	return true;
+}
 //#define CH32_VERIFY
 
 /**
-
+	\fn ch32f1_flash_write
+	\brief program up to CH32F1_WRITE_SIZE bytes, a page at a time.
+			The stub runs the whole page loop on-target, the SWD path below is the fallback.
 */
 static bool ch32f1_flash_write(target_flash_s *f, target_addr_t dest, const void *src, size_t len)
 {
@@ -308,12 +355,13 @@ static bool ch32f1_flash_write(target_flash_s *f, target_addr_t dest, const void
 #endif
 	DEBUG_INFO("CH32: flash write 0x%" PRIx32 " ,size=%" PRIu32 "\n", dest, (uint32_t)len);
 
-	while (length > 0)
+	if (f->stub && cortexm_flash_stub_load(f))
+		return cortexm_flash_stub_write(f, dest, src, len, FPEC_BASE);
+
+	for (; length > 0; length -= MIN(length, CH32F1_PAGE_SIZE), dest += CH32F1_PAGE_SIZE, src += CH32F1_PAGE_SIZE)
 	{
-		if (ch32f1_flash_unlock(t)) {
-			DEBUG_WARN("ch32f1 cannot fast unlock\n");
-			return false;
-		}
+		if (ch32f1_page_erased(src))
+			continue;
 		WAIT_BUSY();
 
 		// Buffer reset...
@@ -338,16 +386,7 @@ static bool ch32f1_flash_write(target_flash_s *f, target_addr_t dest, const void
 
 		MAGIC(dest);
 
-		// next
-		if (length > 128)
-			length -=128;
-		else
-			length = 0;
-		dest += 128;
-		src += 128;
-
 		sr = target_mem_read32(t, FLASH_SR); // 13
-		ch32f1_flash_lock(t);
 		if (sr & SR_ERROR_MASK) {
 			DEBUG_WARN("ch32f1 flash write error 0x%" PRIx32 "\n", sr);
 			return false;
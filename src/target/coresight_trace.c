@@ -0,0 +1,762 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * On-chip trace capture: the ETMs and PTMs found by the ROM table walk are
+ * programmed to trace every branch, the funnels pass everything through and
+ * the first ETB or ETF collects it in a circular buffer. Once the target has
+ * halted the buffer is drained with queued AP reads, and the hosted build
+ * deformats it and decodes the ETMv4 streams into the branch history leading
+ * up to the halt.
+ *
+ * References:
+ * ARM IHI 0029 - CoreSight Architecture Specification (trace formatter)
+ * ARM DDI 0461 - CoreSight Trace Memory Controller
+ * ARM IHI 0014 - Embedded Trace Macrocell Architecture Specification (ETMv3)
+ * ARM IHI 0064 - ETM Architecture Specification ETMv4
+ */
+
+#include "general.h"
+#include "target.h"
+#include "target_internal.h"
+#include "adiv5.h"
+#include "coresight_trace.h"
+
+#if PC_HOSTED == 1
+#include <stdio.h>
+#endif
+
+#define CORESIGHT_LAR     0xfb0U
+#define CORESIGHT_LAR_KEY 0xc5acce55U
+#define CORESIGHT_DEVID   0xfc8U
+
+#define CORESIGHT_TIMEOUT_MS 100U
+
+/* Funnel, all slave ports enabled */
+#define FUNNEL_CTRL       0x000U
+#define FUNNEL_CTRL_PORTS 0xffU
+
+/* ETB and TMC share the layout of the registers used here */
+#define ETB_RDP  0x004U /* RSZ on the TMC, both in words */
+#define ETB_STS  0x00cU
+#define ETB_RRD  0x010U
+#define ETB_RRP  0x014U
+#define ETB_RWP  0x018U
+#define ETB_CTL  0x020U
+#define TMC_MODE 0x028U
+#define ETB_FFSR 0x300U
+#define ETB_FFCR 0x304U
+
+#define ETB_STS_FULL        (1U << 0U)
+#define TMC_STS_READY       (1U << 2U)
+#define ETB_FFSR_FT_STOPPED (1U << 1U)
+#define ETB_FFCR_EN_FTC     (1U << 0U)
+#define TMC_FFCR_EN_TI      (1U << 1U)
+#define ETB_FFCR_FLUSHMAN   (1U << 6U)
+#define ETB_FFCR_STOP_FL    (1U << 12U)
+#define ETB_CTL_CAPTURE     (1U << 0U)
+#define TMC_MODE_CB         0U
+
+#define TMC_DEVID_CONFIG_MASK (3U << 6U)
+#define TMC_DEVID_CONFIG_ETR  (1U << 6U)
+
+/* Largest buffer the drain will allocate for, well above any ETB or ETF seen */
+#define CORESIGHT_TRACE_MAX_WORDS (1U << 20U)
+/* Queued reads per flush while draining */
+#define CORESIGHT_TRACE_BURST 256U
+
+/* ETMv3 and PTM */
+#define ETM_OSLAR             0x300U
+#define ETM3_CR               0x000U
+#define ETM3_TRIGGER          0x008U
+#define ETM3_SR               0x010U
+#define ETM3_TEEVR            0x020U
+#define ETM3_TECR1            0x024U
+#define ETM3_TRACEIDR         0x200U
+#define ETM3_CR_POWERDOWN     (1U << 0U)
+#define ETM3_CR_BRANCH_OUTPUT (1U << 8U)
+#define ETM3_CR_PROG          (1U << 10U)
+#define ETM3_SR_PROG          (1U << 1U)
+#define ETM3_EVENT_ALWAYS     0x006fU
+#define ETM3_EVENT_NEVER      0x406fU
+#define ETM3_TECR1_EXCLUDE    (1U << 24U)
+
+/* ETMv4 */
+#define ETM4_PRGCTLR      0x004U
+#define ETM4_STATR        0x00cU
+#define ETM4_CONFIGR      0x010U
+#define ETM4_EVENTCTL0R   0x020U
+#define ETM4_EVENTCTL1R   0x024U
+#define ETM4_STALLCTLR    0x02cU
+#define ETM4_TSCTLR       0x030U
+#define ETM4_SYNCPR       0x034U
+#define ETM4_CCCTLR       0x038U
+#define ETM4_BBCTLR       0x03cU
+#define ETM4_TRACEIDR     0x040U
+#define ETM4_VICTLR       0x080U
+#define ETM4_VIIECTLR     0x084U
+#define ETM4_VISSCTLR     0x088U
+#define ETM4_STATR_IDLE   (1U << 0U)
+#define ETM4_CONFIGR_BB   (1U << 3U)
+#define ETM4_SYNCPR_256   8U
+/* ViewInst always on: event on resource 1 (always true), start/stop logic started */
+#define ETM4_VICTLR_ALWAYS 0x201U
+
+static const char *const coresight_trace_kind_str[] = {
+	[ADIV5_TRACE_ETM3] = "ETMv3/PTM",
+	[ADIV5_TRACE_ETM4] = "ETMv4",
+	[ADIV5_TRACE_FUNNEL] = "Funnel",
+	[ADIV5_TRACE_ETB] = "ETB",
+	[ADIV5_TRACE_TMC] = "TMC",
+};
+
+static uint32_t coresight_read(ADIv5_AP_t *ap, const uint32_t addr)
+{
+	uint32_t value = 0;
+	adiv5_mem_read(ap, &value, addr, sizeof(value));
+	return value;
+}
+
+static void coresight_write(ADIv5_AP_t *ap, const uint32_t addr, const uint32_t value)
+{
+	adiv5_mem_write(ap, addr, &value, sizeof(value));
+}
+
+static bool coresight_wait(ADIv5_AP_t *ap, const uint32_t addr, const uint32_t mask, const uint32_t value)
+{
+	platform_timeout timeout;
+	platform_timeout_set(&timeout, CORESIGHT_TIMEOUT_MS);
+	while ((coresight_read(ap, addr) & mask) != value) {
+		if (platform_timeout_is_expired(&timeout))
+			return false;
+	}
+	return true;
+}
+
+/* The AP a component sits behind, ap itself when it is on the same one */
+static ADIv5_AP_t *coresight_trace_ap_get(ADIv5_AP_t *ap, const adiv5_trace_component_s *component)
+{
+	if (component->apsel == ap->apsel)
+		return ap;
+	return adiv5_new_ap(ap->dp, component->apsel);
+}
+
+static void coresight_trace_ap_put(ADIv5_AP_t *ap, ADIv5_AP_t *component_ap)
+{
+	if (!component_ap || component_ap == ap)
+		return;
+	adiv5_ap_unref(component_ap);
+	/* The temporary AP moved CSW and TAR behind the back of the DP's other APs */
+	adiv5_dp_cache_invalidate(ap->dp);
+}
+
+static void coresight_unlock(ADIv5_AP_t *ap, const uint32_t base)
+{
+	coresight_write(ap, base + CORESIGHT_LAR, CORESIGHT_LAR_KEY);
+}
+
+/* The first ETB, or TMC configured as ETB or ETF, the TMC as ETR writes to system memory */
+static const adiv5_trace_component_s *coresight_trace_sink(ADIv5_AP_t *ap)
+{
+	ADIv5_DP_t *const dp = ap->dp;
+	for (size_t i = 0; i < dp->trace_count; ++i) {
+		const adiv5_trace_component_s *const component = &dp->trace[i];
+		if (component->kind == ADIV5_TRACE_ETB)
+			return component;
+		if (component->kind != ADIV5_TRACE_TMC)
+			continue;
+		ADIv5_AP_t *const component_ap = coresight_trace_ap_get(ap, component);
+		if (!component_ap)
+			continue;
+		const uint32_t devid = coresight_read(component_ap, component->addr + CORESIGHT_DEVID);
+		coresight_trace_ap_put(ap, component_ap);
+		if ((devid & TMC_DEVID_CONFIG_MASK) != TMC_DEVID_CONFIG_ETR)
+			return component;
+	}
+	return NULL;
+}
+
+static void coresight_trace_etm3_start(ADIv5_AP_t *ap, const uint32_t base, const uint8_t trace_id)
+{
+	coresight_write(ap, base + ETM_OSLAR, 0);
+	uint32_t ctrl = coresight_read(ap, base + ETM3_CR) & ~ETM3_CR_POWERDOWN;
+	coresight_write(ap, base + ETM3_CR, ctrl | ETM3_CR_PROG);
+	if (!coresight_wait(ap, base + ETM3_SR, ETM3_SR_PROG, ETM3_SR_PROG))
+		DEBUG_WARN("ETM at 0x%08" PRIx32 " did not enter programming mode\n", base);
+	coresight_write(ap, base + ETM3_TRIGGER, ETM3_EVENT_NEVER);
+	coresight_write(ap, base + ETM3_TEEVR, ETM3_EVENT_ALWAYS);
+	/* Exclude nothing, so trace everywhere */
+	coresight_write(ap, base + ETM3_TECR1, ETM3_TECR1_EXCLUDE);
+	coresight_write(ap, base + ETM3_TRACEIDR, trace_id);
+	ctrl |= ETM3_CR_BRANCH_OUTPUT;
+	coresight_write(ap, base + ETM3_CR, ctrl);
+	coresight_wait(ap, base + ETM3_SR, ETM3_SR_PROG, 0);
+}
+
+static void coresight_trace_etm3_stop(ADIv5_AP_t *ap, const uint32_t base)
+{
+	const uint32_t ctrl = coresight_read(ap, base + ETM3_CR);
+	coresight_write(ap, base + ETM3_CR, ctrl | ETM3_CR_PROG);
+	coresight_wait(ap, base + ETM3_SR, ETM3_SR_PROG, ETM3_SR_PROG);
+	coresight_write(ap, base + ETM3_CR, ctrl | ETM3_CR_PROG | ETM3_CR_POWERDOWN);
+}
+
+static void coresight_trace_etm4_start(ADIv5_AP_t *ap, const uint32_t base, const uint8_t trace_id)
+{
+	coresight_write(ap, base + ETM_OSLAR, 0);
+	coresight_write(ap, base + ETM4_PRGCTLR, 0);
+	if (!coresight_wait(ap, base + ETM4_STATR, ETM4_STATR_IDLE, ETM4_STATR_IDLE))
+		DEBUG_WARN("ETM at 0x%08" PRIx32 " did not go idle\n", base);
+	/* Branch broadcast everywhere, so each taken branch carries its target address */
+	coresight_write(ap, base + ETM4_CONFIGR, ETM4_CONFIGR_BB);
+	coresight_write(ap, base + ETM4_BBCTLR, 0);
+	coresight_write(ap, base + ETM4_EVENTCTL0R, 0);
+	coresight_write(ap, base + ETM4_EVENTCTL1R, 0);
+	coresight_write(ap, base + ETM4_STALLCTLR, 0);
+	coresight_write(ap, base + ETM4_TSCTLR, 0);
+	coresight_write(ap, base + ETM4_CCCTLR, 0);
+	coresight_write(ap, base + ETM4_SYNCPR, ETM4_SYNCPR_256);
+	coresight_write(ap, base + ETM4_TRACEIDR, trace_id);
+	coresight_write(ap, base + ETM4_VICTLR, ETM4_VICTLR_ALWAYS);
+	coresight_write(ap, base + ETM4_VIIECTLR, 0);
+	coresight_write(ap, base + ETM4_VISSCTLR, 0);
+	coresight_write(ap, base + ETM4_PRGCTLR, 1);
+}
+
+static void coresight_trace_etm4_stop(ADIv5_AP_t *ap, const uint32_t base)
+{
+	coresight_write(ap, base + ETM4_PRGCTLR, 0);
+	coresight_wait(ap, base + ETM4_STATR, ETM4_STATR_IDLE, ETM4_STATR_IDLE);
+}
+
+/* Sources get trace IDs 1 upwards in ROM table order, the decoder relies on the same numbering */
+static void coresight_trace_sources(ADIv5_AP_t *ap, const bool enable)
+{
+	ADIv5_DP_t *const dp = ap->dp;
+	uint8_t trace_id = 0;
+	for (size_t i = 0; i < dp->trace_count; ++i) {
+		const adiv5_trace_component_s *const component = &dp->trace[i];
+		if (component->kind != ADIV5_TRACE_ETM3 && component->kind != ADIV5_TRACE_ETM4 &&
+			component->kind != ADIV5_TRACE_FUNNEL)
+			continue;
+		if (component->kind != ADIV5_TRACE_FUNNEL)
+			++trace_id;
+		ADIv5_AP_t *const component_ap = coresight_trace_ap_get(ap, component);
+		if (!component_ap)
+			continue;
+		coresight_unlock(component_ap, component->addr);
+		if (component->kind == ADIV5_TRACE_FUNNEL) {
+			if (enable) {
+				const uint32_t ctrl = coresight_read(component_ap, component->addr + FUNNEL_CTRL);
+				coresight_write(component_ap, component->addr + FUNNEL_CTRL, ctrl | FUNNEL_CTRL_PORTS);
+			}
+		} else if (component->kind == ADIV5_TRACE_ETM3) {
+			if (enable)
+				coresight_trace_etm3_start(component_ap, component->addr, trace_id);
+			else
+				coresight_trace_etm3_stop(component_ap, component->addr);
+		} else {
+			if (enable)
+				coresight_trace_etm4_start(component_ap, component->addr, trace_id);
+			else
+				coresight_trace_etm4_stop(component_ap, component->addr);
+		}
+		coresight_trace_ap_put(ap, component_ap);
+	}
+}
+
+static void coresight_trace_sink_start(ADIv5_AP_t *ap, const adiv5_trace_component_s *sink)
+{
+	const uint32_t base = sink->addr;
+	coresight_unlock(ap, base);
+	coresight_write(ap, base + ETB_CTL, 0);
+	if (sink->kind == ADIV5_TRACE_ETB) {
+		coresight_write(ap, base + ETB_RWP, 0);
+		coresight_write(ap, base + ETB_FFCR, ETB_FFCR_EN_FTC);
+	} else {
+		coresight_write(ap, base + TMC_MODE, TMC_MODE_CB);
+		coresight_write(ap, base + ETB_FFCR, ETB_FFCR_EN_FTC | TMC_FFCR_EN_TI);
+	}
+	coresight_write(ap, base + ETB_CTL, ETB_CTL_CAPTURE);
+}
+
+/* Flush the formatter so the last partial frame lands in the buffer, then stop capture */
+static bool coresight_trace_sink_stop(ADIv5_AP_t *ap, const adiv5_trace_component_s *sink)
+{
+	const uint32_t base = sink->addr;
+	coresight_unlock(ap, base);
+	const uint32_t ffcr = coresight_read(ap, base + ETB_FFCR) | ETB_FFCR_STOP_FL;
+	coresight_write(ap, base + ETB_FFCR, ffcr);
+	coresight_write(ap, base + ETB_FFCR, ffcr | ETB_FFCR_FLUSHMAN);
+	bool stopped = coresight_wait(ap, base + ETB_FFCR, ETB_FFCR_FLUSHMAN, 0);
+	if (sink->kind == ADIV5_TRACE_ETB)
+		stopped &= coresight_wait(ap, base + ETB_FFSR, ETB_FFSR_FT_STOPPED, ETB_FFSR_FT_STOPPED);
+	else
+		stopped &= coresight_wait(ap, base + ETB_STS, TMC_STS_READY, TMC_STS_READY);
+	coresight_write(ap, base + ETB_CTL, 0);
+	return stopped;
+}
+
+static bool coresight_trace_stop(target *t, ADIv5_AP_t *ap, const adiv5_trace_component_s *sink)
+{
+	ADIv5_DP_t *const dp = ap->dp;
+	if (!dp->trace_running)
+		return true;
+	coresight_trace_sources(ap, false);
+	ADIv5_AP_t *const sink_ap = coresight_trace_ap_get(ap, sink);
+	if (!sink_ap)
+		return false;
+	const bool stopped = coresight_trace_sink_stop(sink_ap, sink);
+	coresight_trace_ap_put(ap, sink_ap);
+	dp->trace_running = false;
+	if (!stopped)
+		tc_printf(t, "%s did not flush, the end of the trace may be missing\n", coresight_trace_kind_str[sink->kind]);
+	return true;
+}
+
+static bool coresight_trace_start(target *t, ADIv5_AP_t *ap, const adiv5_trace_component_s *sink)
+{
+	ADIv5_DP_t *const dp = ap->dp;
+	coresight_trace_stop(t, ap, sink);
+	ADIv5_AP_t *const sink_ap = coresight_trace_ap_get(ap, sink);
+	if (!sink_ap)
+		return false;
+	/* Sink first so nothing the sources emit is dropped */
+	coresight_trace_sink_start(sink_ap, sink);
+	const uint32_t depth = coresight_read(sink_ap, sink->addr + ETB_RDP);
+	coresight_trace_ap_put(ap, sink_ap);
+	coresight_trace_sources(ap, true);
+	dp->trace_running = true;
+	tc_printf(t, "Tracing into %s at 0x%08" PRIx32 ", %" PRIu32 " words\n", coresight_trace_kind_str[sink->kind],
+		sink->addr, depth);
+	return true;
+}
+
+static bool coresight_trace_status(target *t, ADIv5_AP_t *ap, const adiv5_trace_component_s *sink)
+{
+	ADIv5_DP_t *const dp = ap->dp;
+	for (size_t i = 0; i < dp->trace_count; ++i) {
+		tc_printf(t, "%-10s AP%u 0x%08" PRIx32 "\n", coresight_trace_kind_str[dp->trace[i].kind], dp->trace[i].apsel,
+			dp->trace[i].addr);
+	}
+	ADIv5_AP_t *const sink_ap = coresight_trace_ap_get(ap, sink);
+	if (!sink_ap)
+		return false;
+	const uint32_t depth = coresight_read(sink_ap, sink->addr + ETB_RDP);
+	const uint32_t status = coresight_read(sink_ap, sink->addr + ETB_STS);
+	uint32_t written = coresight_read(sink_ap, sink->addr + ETB_RWP);
+	coresight_trace_ap_put(ap, sink_ap);
+	/* The TMC write pointer counts bytes */
+	if (sink->kind == ADIV5_TRACE_TMC)
+		written /= 4U;
+	if (status & ETB_STS_FULL)
+		written = depth;
+	tc_printf(t, "Trace %s, %" PRIu32 " of %" PRIu32 " words%s\n", dp->trace_running ? "running" : "stopped", written,
+		depth, status & ETB_STS_FULL ? " (wrapped)" : "");
+	return true;
+}
+
+#if PC_HOSTED == 1
+/*
+ * Read count words from the buffer's read data register, CORESIGHT_TRACE_BURST
+ * at a time in one queue flush. A TMC reads as all ones once it runs dry.
+ */
+static size_t coresight_trace_read_burst(ADIv5_AP_t *ap, const adiv5_trace_component_s *sink, uint32_t *data, size_t count)
+{
+	adiv5_ap_queue_write(ap, ADIV5_AP_CSW, ap->csw | ADIV5_AP_CSW_SIZE_WORD | ADIV5_AP_CSW_ADDRINC_NONE);
+	adiv5_ap_queue_write(ap, ADIV5_AP_TAR, sink->addr + ETB_RRD);
+	size_t done = 0;
+	while (done < count) {
+		const size_t burst = MIN(count - done, CORESIGHT_TRACE_BURST);
+		for (size_t i = 0; i < burst; ++i)
+			adiv5_ap_queue_read(ap, ADIV5_AP_DRW, &data[done + i]);
+		if (!adiv5_dp_queue_flush(ap->dp))
+			return done;
+		for (size_t i = 0; i < burst; ++i) {
+			if (sink->kind == ADIV5_TRACE_TMC && data[done + i] == 0xffffffffU)
+				return done + i;
+		}
+		done += burst;
+	}
+	return done;
+}
+
+/* Drain the stopped sink oldest word first, returns the number of words read into *words */
+static size_t coresight_trace_drain(ADIv5_AP_t *ap, const adiv5_trace_component_s *sink, uint32_t **words)
+{
+	const uint32_t base = sink->addr;
+	const uint32_t depth = coresight_read(ap, base + ETB_RDP);
+	if (!depth || depth > CORESIGHT_TRACE_MAX_WORDS)
+		return 0;
+	uint32_t *const data = malloc(depth * sizeof(*data));
+	if (!data) { /* malloc failed: heap exhaustion */
+		DEBUG_WARN("malloc: failed in %s\n", __func__);
+		return 0;
+	}
+	size_t count = depth;
+	if (sink->kind == ADIV5_TRACE_ETB) {
+		/* The ETB pointers count words and wrap at the depth */
+		const uint32_t write_ptr = coresight_read(ap, base + ETB_RWP) % depth;
+		const bool full = coresight_read(ap, base + ETB_STS) & ETB_STS_FULL;
+		if (!full)
+			count = write_ptr;
+		coresight_write(ap, base + ETB_RRP, full ? write_ptr : 0U);
+	}
+	count = coresight_trace_read_burst(ap, sink, data, count);
+	*words = data;
+	return count;
+}
+
+#define ETM4_ADDR_HISTORY 3U
+#define ETM4_BRANCHES     16U
+
+typedef struct coresight_trace_etm4 {
+	FILE *out;
+	uint32_t history[ETM4_ADDR_HISTORY];
+	uint32_t branches[ETM4_BRANCHES];
+	size_t branch_count;
+	uint32_t atoms;
+} coresight_trace_etm4_s;
+
+/* Skip a field whose bytes carry a continuation flag in bit 7, at most max bytes long */
+static size_t etm4_skip_field(const uint8_t *data, const size_t len, size_t offset, const size_t max)
+{
+	for (size_t i = 0; i < max && offset < len; ++i) {
+		if (!(data[offset++] & 0x80U))
+			break;
+	}
+	return offset;
+}
+
+/* Context information byte, then VMID and Context ID if it flags them */
+static size_t etm4_skip_context(const uint8_t *data, const size_t len, size_t offset)
+{
+	if (offset >= len)
+		return len + 1U;
+	const uint8_t info = data[offset++];
+	if (info & 0x40U)
+		offset += 1U;
+	if (info & 0x80U)
+		offset += 4U;
+	return offset;
+}
+
+static void etm4_branch(coresight_trace_etm4_s *etm, const uint32_t addr, const bool exact)
+{
+	if (!exact) {
+		memmove(&etm->history[1], &etm->history[0], sizeof(etm->history) - sizeof(etm->history[0]));
+		etm->history[0] = addr;
+	}
+	etm->branches[etm->branch_count++ % ETM4_BRANCHES] = addr;
+	fprintf(etm->out, "%8" PRIu32 " atoms, to 0x%08" PRIx32 "\n", etm->atoms, addr);
+	etm->atoms = 0;
+}
+
+/* Long address, 4 bytes for a 32-bit address or 8 for a 64-bit one of which the low half is kept */
+static uint32_t etm4_long_address(const uint8_t *data, const bool is1)
+{
+	if (is1)
+		return ((data[0] & 0x7fU) << 1U) | ((uint32_t)data[1] << 8U) | ((uint32_t)data[2] << 16U) |
+			((uint32_t)data[3] << 24U);
+	return ((data[0] & 0x7fU) << 2U) | ((data[1] & 0x7fU) << 9U) | ((uint32_t)data[2] << 16U) |
+		((uint32_t)data[3] << 24U);
+}
+
+static uint32_t etm4_atoms(const uint8_t header)
+{
+	if (header >= 0xf8U)
+		return 3U; /* Format 3 */
+	if (header >= 0xf6U)
+		return 1U; /* Format 1 */
+	if (header == 0xf5U || (header >= 0xd5U && header <= 0xd7U))
+		return 5U; /* Format 5 */
+	if (header >= 0xdcU && header <= 0xdfU)
+		return 4U; /* Format 4 */
+	if (header >= 0xd8U && header <= 0xdbU)
+		return 2U; /* Format 2 */
+	if ((header >= 0xc0U && header <= 0xd4U) || (header >= 0xe0U && header <= 0xf4U))
+		return (header & 0x1fU) + 4U; /* Format 6 */
+	return 0;
+}
+
+/*
+ * Decode the instruction trace packets of one ETMv4 stream, as configured by
+ * coresight_trace_etm4_start(): no cycle counts, timestamps or conditional
+ * instruction tracing. Anything not understood drops back to waiting for the
+ * next A-sync.
+ */
+static void coresight_trace_etm4_decode(coresight_trace_etm4_s *etm, const uint8_t *data, const size_t len)
+{
+	bool synced = false;
+	size_t zeros = 0;
+	size_t offset = 0;
+	while (offset < len) {
+		if (!synced) {
+			const uint8_t byte = data[offset++];
+			if (byte == 0x80U && zeros >= 11U) {
+				synced = true;
+				fprintf(etm->out, "sync\n");
+			}
+			zeros = byte ? 0U : zeros + 1U;
+			continue;
+		}
+
+		const uint8_t header = data[offset++];
+		size_t next = offset;
+		if (header == 0x00U) {
+			/* Extension: A-sync, discard or overflow */
+			const uint8_t kind = next < len ? data[next] : 0U;
+			if (kind == 0x00U) {
+				while (next < len && !data[next])
+					++next;
+				++next;
+			} else if (kind == 0x03U || kind == 0x05U) {
+				fprintf(etm->out, "%s\n", kind == 0x03U ? "discard" : "overflow");
+				++next;
+			} else
+				next = SIZE_MAX;
+		} else if (header == 0x01U) {
+			/* Trace info, PLCTL says which of INFO, KEY, SPEC and CYCT follow */
+			const uint8_t plctl = next < len ? data[next] : 0U;
+			next = etm4_skip_field(data, len, next, 1U);
+			for (uint8_t section = 0; section < 4U; ++section) {
+				if (plctl & (1U << section))
+					next = etm4_skip_field(data, len, next, 5U);
+			}
+		} else if (header == 0x02U || header == 0x03U) {
+			/* Timestamp, with a cycle count if bit 0 is set */
+			next = etm4_skip_field(data, len, next, 9U);
+			if (header & 1U)
+				next = etm4_skip_field(data, len, next, 3U);
+		} else if (header == 0x04U)
+			fprintf(etm->out, "trace on\n");
+		else if (header == 0x05U)
+			fprintf(etm->out, "function return\n");
+		else if (header == 0x06U) {
+			if (next < len) {
+				uint32_t type = (data[next] >> 1U) & 0x1fU;
+				if (data[next++] & 0x80U && next < len)
+					type |= (data[next++] & 0x1fU) << 5U;
+				fprintf(etm->out, "exception %" PRIu32 "\n", type);
+			}
+		} else if (header == 0x07U)
+			fprintf(etm->out, "exception return\n");
+		else if (header == 0x2dU)
+			next = etm4_skip_field(data, len, next, 5U); /* Commit */
+		else if (header == 0x70U)
+			; /* Ignore */
+		else if (header > 0x70U && header < 0x80U)
+			fprintf(etm->out, "event 0x%x\n", header & 0xfU);
+		else if (header == 0x80U)
+			; /* Context unchanged */
+		else if (header == 0x81U)
+			next = etm4_skip_context(data, len, next);
+		else if (header == 0x82U || header == 0x83U || header == 0x85U || header == 0x86U ||
+			(header >= 0x9aU && header <= 0x9eU && header != 0x9cU)) {
+			/* Long address, with context for 0x8x */
+			const bool wide = header == 0x85U || header == 0x86U || header == 0x9dU || header == 0x9eU;
+			const bool is1 = header == 0x83U || header == 0x86U || header == 0x9bU || header == 0x9eU;
+			next += wide ? 8U : 4U;
+			if (next <= len)
+				etm4_branch(etm, etm4_long_address(data + offset, is1), false);
+			if (header < 0x90U)
+				next = etm4_skip_context(data, len, next);
+		} else if (header >= 0x90U && header <= 0x92U)
+			etm4_branch(etm, etm->history[header & 3U], true);
+		else if (header == 0x95U || header == 0x96U) {
+			/* Short address, replacing the low bits of the last one */
+			const bool is1 = header == 0x96U;
+			const uint32_t shift = is1 ? 1U : 2U;
+			if (next < len) {
+				uint32_t bits = (data[next] & 0x7fU) << shift;
+				uint32_t mask = 0x7fU << shift;
+				if (data[next++] & 0x80U && next < len) {
+					bits |= (uint32_t)data[next++] << (shift + 7U);
+					mask |= 0xffU << (shift + 7U);
+				}
+				etm4_branch(etm, (etm->history[0] & ~mask) | bits, false);
+			}
+		} else if (etm4_atoms(header))
+			etm->atoms += etm4_atoms(header);
+		else
+			next = SIZE_MAX;
+
+		if (next == SIZE_MAX) {
+			fprintf(etm->out, "unknown packet 0x%02x, waiting for sync\n", header);
+			synced = false;
+			zeros = 0;
+			continue;
+		}
+		offset = next;
+	}
+}
+
+/*
+ * Split the formatter's 16 byte frames into per source streams. Even bytes
+ * are either data, with bit 0 held in the last byte, or an ID change which
+ * that bit says takes effect before or after the following byte.
+ */
+static void coresight_trace_deformat(
+	const uint32_t *words, const size_t count, uint8_t **streams, size_t *lengths, const uint8_t sources)
+{
+	uint8_t frame[16];
+	uint8_t trace_id = 0;
+	for (size_t word = 0; word + 4U <= count; word += 4U) {
+		for (size_t i = 0; i < sizeof(frame); ++i)
+			frame[i] = words[word + i / 4U] >> (8U * (i % 4U));
+		const uint8_t aux = frame[15];
+		for (size_t i = 0; i < 15U; ++i) {
+			uint8_t byte = frame[i];
+			if (!(i & 1U)) {
+				const bool aux_bit = aux & (1U << (i / 2U));
+				if (byte & 1U) {
+					const uint8_t new_id = byte >> 1U;
+					if (aux_bit && i < 14U) {
+						byte = frame[++i];
+						if (trace_id && trace_id <= sources)
+							streams[trace_id - 1U][lengths[trace_id - 1U]++] = byte;
+					}
+					trace_id = new_id;
+					continue;
+				}
+				byte = (byte & 0xfeU) | aux_bit;
+			}
+			if (trace_id && trace_id <= sources)
+				streams[trace_id - 1U][lengths[trace_id - 1U]++] = byte;
+		}
+	}
+}
+
+static bool coresight_trace_decode(target *t, ADIv5_DP_t *dp, const uint32_t *words, const size_t count, FILE *out)
+{
+	uint8_t *streams[ADIV5_TRACE_COMPONENTS] = {NULL};
+	size_t lengths[ADIV5_TRACE_COMPONENTS] = {0};
+	uint8_t kinds[ADIV5_TRACE_COMPONENTS];
+	uint8_t sources = 0;
+	bool result = true;
+	for (size_t i = 0; i < dp->trace_count; ++i) {
+		if (dp->trace[i].kind != ADIV5_TRACE_ETM3 && dp->trace[i].kind != ADIV5_TRACE_ETM4)
+			continue;
+		kinds[sources] = dp->trace[i].kind;
+		streams[sources] = malloc(count * 4U);
+		if (!streams[sources]) { /* malloc failed: heap exhaustion */
+			DEBUG_WARN("malloc: failed in %s\n", __func__);
+			result = false;
+			break;
+		}
+		++sources;
+	}
+
+	if (result) {
+		coresight_trace_deformat(words, count, streams, lengths, sources);
+		for (uint8_t i = 0; i < sources; ++i) {
+			fprintf(out, "# trace ID %u, %s, %zu bytes\n", i + 1U, coresight_trace_kind_str[kinds[i]], lengths[i]);
+			if (kinds[i] != ADIV5_TRACE_ETM4) {
+				fprintf(out, "# not decoded, see the raw capture\n");
+				continue;
+			}
+			coresight_trace_etm4_s etm = {.out = out};
+			coresight_trace_etm4_decode(&etm, streams[i], lengths[i]);
+			if (etm.atoms)
+				fprintf(out, "%8" PRIu32 " atoms\n", etm.atoms);
+			const size_t shown = MIN(etm.branch_count, ETM4_BRANCHES);
+			if (shown)
+				tc_printf(t, "Trace ID %u, last %zu of %zu branches, oldest first:\n", i + 1U, shown, etm.branch_count);
+			for (size_t j = etm.branch_count - shown; j < etm.branch_count; ++j)
+				tc_printf(t, "  0x%08" PRIx32 "\n", etm.branches[j % ETM4_BRANCHES]);
+		}
+	}
+
+	for (uint8_t i = 0; i < sources; ++i)
+		free(streams[i]);
+	return result;
+}
+
+static bool coresight_trace_dump(
+	target *t, ADIv5_AP_t *ap, const adiv5_trace_component_s *sink, const char *const filename)
+{
+	coresight_trace_stop(t, ap, sink);
+	ADIv5_AP_t *const sink_ap = coresight_trace_ap_get(ap, sink);
+	if (!sink_ap)
+		return false;
+	uint32_t *words = NULL;
+	const size_t count = coresight_trace_drain(sink_ap, sink, &words);
+	coresight_trace_ap_put(ap, sink_ap);
+	if (!count) {
+		free(words);
+		tc_printf(t, "Trace buffer is empty\n");
+		return true;
+	}
+
+	const size_t name_len = strlen(filename);
+	char *const raw_name = malloc(name_len + 5U);
+	if (!raw_name) { /* malloc failed: heap exhaustion */
+		DEBUG_WARN("malloc: failed in %s\n", __func__);
+		free(words);
+		return false;
+	}
+	memcpy(raw_name, filename, name_len);
+	memcpy(raw_name + name_len, ".bin", 5U);
+
+	bool result = false;
+	FILE *const raw = fopen(raw_name, "wb");
+	FILE *const out = fopen(filename, "w");
+	if (!raw || !out)
+		tc_printf(t, "Could not open %s\n", !raw ? raw_name : filename);
+	else {
+		/* The raw capture is the formatter's byte stream, which is little endian */
+		for (size_t i = 0; i < count; ++i) {
+			const uint8_t bytes[4] = {words[i], words[i] >> 8U, words[i] >> 16U, words[i] >> 24U};
+			fwrite(bytes, 1, sizeof(bytes), raw);
+		}
+		result = coresight_trace_decode(t, ap->dp, words, count, out);
+		tc_printf(t, "%zu words written to %s, decoded into %s\n", count, raw_name, filename);
+	}
+	if (raw)
+		fclose(raw);
+	if (out)
+		fclose(out);
+	free(raw_name);
+	free(words);
+	return result;
+}
+#endif
+
+bool coresight_trace_cmd(target *t, ADIv5_AP_t *ap, int argc, const char **argv)
+{
+	const adiv5_trace_component_s *const sink = coresight_trace_sink(ap);
+	if (!sink) {
+		tc_printf(t, "No ETB or ETF found\n");
+		return false;
+	}
+	if (argc > 1 && !strcmp(argv[1], "start"))
+		return coresight_trace_start(t, ap, sink);
+	if (argc > 1 && !strcmp(argv[1], "stop"))
+		return coresight_trace_stop(t, ap, sink);
+#if PC_HOSTED == 1
+	if (argc > 2 && !strcmp(argv[1], "dump"))
+		return coresight_trace_dump(t, ap, sink, argv[2]);
+#endif
+	if (argc < 2 || !strcmp(argv[1], "status"))
+		return coresight_trace_status(t, ap, sink);
+#if PC_HOSTED == 1
+	tc_printf(t, "usage: monitor etb start|stop|status|dump <file>\n");
+#else
+	tc_printf(t, "usage: monitor etb start|stop|status\n");
+#endif
+	return false;
+}
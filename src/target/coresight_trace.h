@@ -0,0 +1,31 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TARGET_CORESIGHT_TRACE_H
+#define TARGET_CORESIGHT_TRACE_H
+
+#include "target.h"
+#include "adiv5.h"
+
+/*
+ * monitor etb start|stop|status|dump <file>, over the ETM/PTM, funnel and
+ * ETB/TMC components the ROM table walk found on the DP behind ap. Components
+ * on other APs of that DP are reached through temporary APs.
+ */
+bool coresight_trace_cmd(target *t, ADIv5_AP_t *ap, int argc, const char **argv);
+
+#endif /* TARGET_CORESIGHT_TRACE_H */
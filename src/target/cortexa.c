@@ -33,6 +33,7 @@
 #include "target.h"
 #include "gdb_reg.h"
 #include "target_internal.h"
+#include "coresight_trace.h"
 
 #include <assert.h>
 
@@ -62,9 +63,19 @@ static uint32_t apb_read(target *t, uint16_t reg);
 static void write_gpreg(target *t, uint8_t regno, uint32_t val);
 static uint32_t read_gpreg(target *t, uint8_t regno);
 
+static bool cortexa_etb(target *t, int argc, const char **argv);
+
+static const struct command_s cortexa_cmd_list[] = {
+	{"etb", (cmd_handler)cortexa_etb, "Capture ETM/PTM trace on chip: start|stop|status|dump <file>"},
+	{NULL, NULL, NULL},
+};
+
+#define CORTEXA_TLB_ENTRIES 4U
+
 struct cortexa_priv {
 	uint32_t base;
 	ADIv5_AP_t *apb;
+	ADIv5_AP_t *mem_ap;
 	struct {
 		uint32_t r[16];
 		uint32_t cpsr;
@@ -78,11 +89,23 @@ struct cortexa_priv {
 	unsigned hw_watchpoint_max;
 	uint16_t hw_watchpoint_mask;
 	bool mmu_fault;
+	/* Pages translated by va_to_pa() since the core last ran */
+	struct {
+		uint32_t va_page;
+		uint32_t pa_page;
+	} tlb[CORTEXA_TLB_ENTRIES];
+	uint8_t tlb_count;
+	uint8_t tlb_next;
 };
 
 /* This may be specific to Cortex-A9 */
 #define CACHE_LINE_LENGTH (8 * 4)
 
+/* Smallest access worth the translation and cache maintenance of the system MEM-AP path */
+#define CORTEXA_SYSMEM_MIN_LEN 64U
+/* Granule va_to_pa() translates, the smallest page the short descriptor format maps */
+#define CORTEXA_PAGE_SIZE 4096U
+
 /* Debug APB registers */
 #define DBGDIDR 0
 
@@ -152,164 +175,26 @@ struct cortexa_priv {
 #define DCCIMVAC CPREG(15, 0, 0, 7, 14, 1)
 #define DCCMVAC  CPREG(15, 0, 0, 7, 10, 1)
 
-/* Thumb mode bit in CPSR */
-#define CPSR_THUMB (1 << 5)
+#define SCTLR   CPREG(15, 0, 0, 1, 0, 0)
+#define SCTLR_C (1 << 2)
 
-/**
- * Fields for Cortex-A special purpose registers, used in the generation of GDB's target description XML.
- * The general purpose registers r0-r12 and the vector floating point registers d0-d15 all follow a very
- * regular format, so we only need to store fields for the special purpose registers.
- * The arrays for each SPR field have the same order as each other, making each of them as pseduo
- * 'associative array'.
- */
+/* add r0, r0, #CACHE_LINE_LENGTH */
+#define ADD_R0_LINE (0xe2800000 | CACHE_LINE_LENGTH)
 
-// Strings for the names of the Cortex-A's special purpose registers.
-static const char *cortex_a_spr_names[] = {"sp", "lr", "pc", "cpsr"};
-
-// The "type" field for each Cortex-A special purpose register.
-static const gdb_reg_type_e cortex_a_spr_types[] = {
-	GDB_TYPE_DATA_PTR,   // sp
-	GDB_TYPE_CODE_PTR,   // lr
-	GDB_TYPE_CODE_PTR,   // pc
-	GDB_TYPE_UNSPECIFIED // cpsr
-};
+/* Thumb mode bit in CPSR */
+#define CPSR_THUMB (1 << 5)
 
-static_assert(ARRAY_LENGTH(cortex_a_spr_types) == ARRAY_LENGTH(cortex_a_spr_names), "SPR array length mixmatch! SPR type "
-                                                                                "array should have the same length as "
-                                                                                "SPR name array.");
-
-// Creates the target description XML string for a Cortex-A. Like snprintf(), this function
-// will write no more than max_len and returns the amount of bytes written. Or, if max_len is 0,
-// then this function will return the amount of bytes that _would_ be necessary to create this
-// string.
-//
-// This function is hand-optimized to decrease string duplication and thus code size, making it
-// Unfortunately much less readable than the string literal it is equivalent to.
-//
-// The string it creates is XML-equivalent to the following:
-/*
-	"<?xml version=\"1.0\"?>"
-	"<!DOCTYPE feature SYSTEM \"gdb-target.dtd\">"
-	"<target>"
-	"  <architecture>arm</architecture>"
-	"  <feature name=\"org.gnu.gdb.arm.core\">"
-	"    <reg name=\"r0\" bitsize=\"32\"/>"
-	"    <reg name=\"r1\" bitsize=\"32\"/>"
-	"    <reg name=\"r2\" bitsize=\"32\"/>"
-	"    <reg name=\"r3\" bitsize=\"32\"/>"
-	"    <reg name=\"r4\" bitsize=\"32\"/>"
-	"    <reg name=\"r5\" bitsize=\"32\"/>"
-	"    <reg name=\"r6\" bitsize=\"32\"/>"
-	"    <reg name=\"r7\" bitsize=\"32\"/>"
-	"    <reg name=\"r8\" bitsize=\"32\"/>"
-	"    <reg name=\"r9\" bitsize=\"32\"/>"
-	"    <reg name=\"r10\" bitsize=\"32\"/>"
-	"    <reg name=\"r11\" bitsize=\"32\"/>"
-	"    <reg name=\"r12\" bitsize=\"32\"/>"
-	"    <reg name=\"sp\" bitsize=\"32\" type=\"data_ptr\"/>"
-	"    <reg name=\"lr\" bitsize=\"32\" type=\"code_ptr\"/>"
-	"    <reg name=\"pc\" bitsize=\"32\" type=\"code_ptr\"/>"
-	"    <reg name=\"cpsr\" bitsize=\"32\"/>"
-	"  </feature>"
-	"  <feature name=\"org.gnu.gdb.arm.vfp\">"
-	"    <reg name=\"fpscr\" bitsize=\"32\"/>"
-	"    <reg name=\"d0\" bitsize=\"64\" type=\"float\"/>"
-	"    <reg name=\"d1\" bitsize=\"64\" type=\"float\"/>"
-	"    <reg name=\"d2\" bitsize=\"64\" type=\"float\"/>"
-	"    <reg name=\"d3\" bitsize=\"64\" type=\"float\"/>"
-	"    <reg name=\"d4\" bitsize=\"64\" type=\"float\"/>"
-	"    <reg name=\"d5\" bitsize=\"64\" type=\"float\"/>"
-	"    <reg name=\"d6\" bitsize=\"64\" type=\"float\"/>"
-	"    <reg name=\"d7\" bitsize=\"64\" type=\"float\"/>"
-	"    <reg name=\"d8\" bitsize=\"64\" type=\"float\"/>"
-	"    <reg name=\"d9\" bitsize=\"64\" type=\"float\"/>"
-	"    <reg name=\"d10\" bitsize=\"64\" type=\"float\"/>"
-	"    <reg name=\"d11\" bitsize=\"64\" type=\"float\"/>"
-	"    <reg name=\"d12\" bitsize=\"64\" type=\"float\"/>"
-	"    <reg name=\"d13\" bitsize=\"64\" type=\"float\"/>"
-	"    <reg name=\"d14\" bitsize=\"64\" type=\"float\"/>"
-	"    <reg name=\"d15\" bitsize=\"64\" type=\"float\"/>"
-	"  </feature>"
+/* GDB's target description for a Cortex-A: the core registers and the VFP */
+static const char tdesc_cortex_a[] = GDB_ARM_PREAMBLE("feature")
+	"<feature name=\"org.gnu.gdb.arm.core\">"
+	GDB_ARM_GPRS
+	GDB_REG_ATTR("sp", 32, GDB_TYPE_DATA_PTR)
+	GDB_REG_ATTR("lr", 32, GDB_TYPE_CODE_PTR)
+	GDB_REG_ATTR("pc", 32, GDB_TYPE_CODE_PTR)
+	GDB_REG("cpsr", 32)
+	"</feature>"
+	GDB_ARM_VFP_FEATURE
 	"</target>";
-*/
-// Returns the amount of characters written to the buffer.
-static size_t create_tdesc_cortex_a(char *buffer, size_t max_len)
-{
-	// Minor hack: technically snprintf returns an int for possibility of error, but in this case
-	// these functions are given static input that should not be able to fail -- and if it does,
-	// then there's nothing we can do about it, so we'll repatedly cast this variable to a size_t
-	// when calculating printsz (see below).
-	int total = 0;
-
-	// We can't just repeatedly pass max_len to snprintf, because we keep changing the start
-	// of buffer (effectively changing its size), so we have to repeatedly compute the size
-	// passed to snprintf by subtracting the current total from max_len.
-	// ...Unless max_len is 0, in which case that subtraction will result in an (underflowed)
-	// negative number. So we also have to repeatedly check if max_len is 0 before performing
-	// that subtraction.
-	size_t printsz = max_len;
-
-	// Start with the "preamble", which is generic across ARM targets,
-	// ...save for one word, so we'll have to do the preamble in halves, and then we'll
-	// follow it with the GDB ARM Core feature tag.
-	total += snprintf(buffer, printsz,
-		"%s feature %s "
-		"<feature name=\"org.gnu.gdb.arm.core\">",
-		gdb_arm_preamble_first, gdb_arm_preamble_second);
-
-	// Then the general purpose registers, which have names of r0 to r12.
-	for (uint8_t i = 0; i <= 12; ++i) {
-		if (max_len != 0)
-			printsz = max_len - (size_t)total;
-
-		total += snprintf(buffer + total, printsz, "<reg name=\"r%u\" bitsize=\"32\"/>", i);
-	}
-
-	// The special purpose registers are a slightly more complicated.
-	// Some of them have different types specified, however unlike the Cortex-M SPRs,
-	// all of the Cortex-A target description SPRs have the same bitsize, and none of them
-	// have a specified save-restore value. So we only need one "associative array" here.
-	// NOTE: unlike the other loops, this loop uses a size_t for its counter, as it's used to index into arrays.
-	for (size_t i = 0; i < ARRAY_LENGTH(cortex_a_spr_names); ++i) {
-		gdb_reg_type_e type = cortex_a_spr_types[i];
-
-		if (max_len != 0)
-			printsz = max_len - (size_t)total;
-
-		total += snprintf(buffer + total, printsz, "<reg name=\"%s\" bitsize=\"32\"%s/>", cortex_a_spr_names[i],
-			gdb_reg_type_strings[type]);
-	}
-
-	if (max_len != 0)
-		printsz = max_len - (size_t)total;
-
-	// Now onto the floating point registers.
-	// The first register is unique; the rest all follow the same format.
-	total += snprintf(buffer + total, printsz,
-		"</feature>"
-		"<feature name=\"org.gnu.gdb.arm.vfp\">"
-		"<reg name=\"fpscr\" bitsize=\"32\"/>");
-
-	// Now onto the simple ones.
-	for (uint8_t i = 0; i <= 15; ++i) {
-		if (max_len != 0)
-			printsz = max_len - (size_t)total;
-
-		total += snprintf(buffer + total, printsz, "<reg name=\"d%u\" bitsize=\"64\" type=\"float\"/>", i);
-	}
-
-	if (max_len != 0)
-		printsz = max_len - (size_t)total;
-
-	total += snprintf(buffer + total, printsz, "</feature></target>");
-
-	// Minor hack: technically snprintf returns an int for possibility of error, but in this case
-	// these functions are given static input that should not ever be able to fail -- and if it
-	// does, then there's nothing we can do about it, so we'll just discard the signedness
-	// of total when we return it.
-	return (size_t)total;
-}
-
 static void apb_write(target *t, uint16_t reg, uint32_t val)
 {
 	struct cortexa_priv *priv = t->priv;
@@ -329,9 +214,27 @@ static uint32_t apb_read(target *t, uint16_t reg)
 	return adiv5_dp_low_access(ap->dp, ADIV5_LOW_READ, ADIV5_DP_RDBUFF, 0);
 }
 
+/*
+ * Translations stay valid while the core is halted: only the core itself
+ * changes TTBR, CONTEXTIDR or the page tables, so the cache is dropped
+ * whenever it is let go.
+ */
+static void cortexa_tlb_flush(target *t)
+{
+	struct cortexa_priv *priv = t->priv;
+	priv->tlb_count = 0;
+	priv->tlb_next = 0;
+}
+
 static uint32_t va_to_pa(target *t, uint32_t va)
 {
 	struct cortexa_priv *priv = t->priv;
+	const uint32_t va_page = va & ~0xfffU;
+	for (size_t i = 0; i < priv->tlb_count; ++i) {
+		if (priv->tlb[i].va_page == va_page)
+			return priv->tlb[i].pa_page | (va & 0xfffU);
+	}
+
 	write_gpreg(t, 0, va);
 	apb_write(t, DBGITR, MCR | ATS1CPR);
 	apb_write(t, DBGITR, MRC | PAR);
@@ -340,6 +243,13 @@ static uint32_t va_to_pa(target *t, uint32_t va)
 		priv->mmu_fault = true;
 	uint32_t pa = (par & ~0xfff) | (va & 0xfff);
 	DEBUG_INFO("%s: VA = 0x%08" PRIx32 ", PAR = 0x%08" PRIx32 ", PA = 0x%08" PRIX32 "\n", __func__, va, par, pa);
+	if (!(par & 1)) {
+		priv->tlb[priv->tlb_next].va_page = va_page;
+		priv->tlb[priv->tlb_next].pa_page = par & ~0xfffU;
+		priv->tlb_next = (priv->tlb_next + 1U) % CORTEXA_TLB_ENTRIES;
+		if (priv->tlb_count < CORTEXA_TLB_ENTRIES)
+			++priv->tlb_count;
+	}
 	return pa;
 }
 
@@ -436,6 +346,103 @@ static void cortexa_slow_mem_write(target *t, target_addr_t dest, const void *sr
 	}
 }
 
+/*
+ * The system MEM-AP sees physical memory behind the core's MMU and caches, so
+ * each page is translated by the core and the data cache lines covered are
+ * cleaned before reading, or cleaned and invalidated before writing. The
+ * instruction cache is invalidated on resume as for the slow path.
+ */
+static bool cortexa_dcache_enabled(target *t)
+{
+	apb_write(t, DBGITR, MRC | SCTLR);
+	return read_gpreg(t, 0) & SCTLR_C;
+}
+
+static void cortexa_dcache_op(target *t, uint32_t op, target_addr_t addr, size_t len)
+{
+	const target_addr_t end = addr + len;
+	addr &= ~(CACHE_LINE_LENGTH - 1U);
+	write_gpreg(t, 0, addr);
+	for (; addr < end; addr += CACHE_LINE_LENGTH) {
+		apb_write(t, DBGITR, MCR | op);
+		apb_write(t, DBGITR, ADD_R0_LINE);
+	}
+}
+
+static void cortexa_sysmem_check(target *t)
+{
+	struct cortexa_priv *priv = t->priv;
+	if (adiv5_dp_error(priv->mem_ap->dp))
+		priv->mmu_fault = true;
+}
+
+static void cortexa_sysmem_read(target *t, void *dest, target_addr_t src, size_t len)
+{
+	struct cortexa_priv *priv = t->priv;
+	if (cortexa_dcache_enabled(t))
+		cortexa_dcache_op(t, DCCMVAC, src, len);
+
+	uint8_t *data = dest;
+	while (len && !priv->mmu_fault) {
+		const size_t chunk = MIN(len, CORTEXA_PAGE_SIZE - (src & (CORTEXA_PAGE_SIZE - 1U)));
+		const uint32_t pa = va_to_pa(t, src);
+		if (priv->mmu_fault)
+			break;
+		adiv5_mem_read(priv->mem_ap, data, pa, chunk);
+		cortexa_sysmem_check(t);
+		data += chunk;
+		src += chunk;
+		len -= chunk;
+	}
+}
+
+static void cortexa_sysmem_write(target *t, target_addr_t dest, const void *src, size_t len)
+{
+	struct cortexa_priv *priv = t->priv;
+	if (cortexa_dcache_enabled(t))
+		cortexa_dcache_op(t, DCCIMVAC, dest, len);
+
+	const uint8_t *data = src;
+	while (len && !priv->mmu_fault) {
+		const size_t chunk = MIN(len, CORTEXA_PAGE_SIZE - (dest & (CORTEXA_PAGE_SIZE - 1U)));
+		const uint32_t pa = va_to_pa(t, dest);
+		if (priv->mmu_fault)
+			break;
+		adiv5_mem_write(priv->mem_ap, pa, data, chunk);
+		cortexa_sysmem_check(t);
+		data += chunk;
+		dest += chunk;
+		len -= chunk;
+	}
+}
+
+static void cortexa_mem_read(target *t, void *dest, target_addr_t src, size_t len)
+{
+	struct cortexa_priv *priv = t->priv;
+	if (priv->mem_ap && len >= CORTEXA_SYSMEM_MIN_LEN)
+		cortexa_sysmem_read(t, dest, src, len);
+	else
+		cortexa_slow_mem_read(t, dest, src, len);
+}
+
+static void cortexa_mem_write(target *t, target_addr_t dest, const void *src, size_t len)
+{
+	struct cortexa_priv *priv = t->priv;
+	if (priv->mem_ap && len >= CORTEXA_SYSMEM_MIN_LEN)
+		cortexa_sysmem_write(t, dest, src, len);
+	else
+		cortexa_slow_mem_write(t, dest, src, len);
+}
+
+static void cortexa_priv_free(void *priv_)
+{
+	struct cortexa_priv *priv = priv_;
+	if (priv->mem_ap)
+		adiv5_ap_unref(priv->mem_ap);
+	adiv5_ap_unref(priv->apb);
+	target_arena_free(priv);
+}
+
 static bool cortexa_check_error(target *t)
 {
 	struct cortexa_priv *priv = t->priv;
@@ -454,17 +461,18 @@ bool cortexa_probe(ADIv5_AP_t *apb, uint32_t debug_base)
 	}
 
 	adiv5_ap_ref(apb);
-	struct cortexa_priv *priv = calloc(1, sizeof(*priv));
+	t->group = apb->dp->group;
+	struct cortexa_priv *priv = target_arena_calloc(sizeof(*priv));
 	if (!priv) { /* calloc failed: heap exhaustion */
 		DEBUG_WARN("calloc: failed in %s\n", __func__);
 		return false;
 	}
 
 	t->priv = priv;
-	t->priv_free = free;
+	t->priv_free = cortexa_priv_free;
 	priv->apb = apb;
-	t->mem_read = cortexa_slow_mem_read;
-	t->mem_write = cortexa_slow_mem_write;
+	t->mem_read = cortexa_mem_read;
+	t->mem_write = cortexa_mem_write;
 
 	priv->base = debug_base;
 	/* Set up APB CSW, we won't touch this again */
@@ -495,26 +503,34 @@ bool cortexa_probe(ADIv5_AP_t *apb, uint32_t debug_base)
 	t->breakwatch_set = cortexa_breakwatch_set;
 	t->breakwatch_clear = cortexa_breakwatch_clear;
 
+	target_add_commands(t, cortexa_cmd_list, cortexa_driver_str);
+
 	return true;
 }
 
+static bool cortexa_etb(target *t, int argc, const char **argv)
+{
+	struct cortexa_priv *priv = t->priv;
+	return coresight_trace_cmd(t, priv->apb, argc, argv);
+}
+
 bool cortexa_attach(target *t)
 {
 	struct cortexa_priv *priv = t->priv;
 	int tries;
 
-	if (!t->tdesc) {
-		// Find the buffer size needed for the target description string we need to send to GDB,
-		// and then compute the string itself.
-		size_t size_needed = create_tdesc_cortex_a(NULL, 0) + 1;
-		t->tdesc = calloc(1, size_needed);
-		create_tdesc_cortex_a(t->tdesc, size_needed);
-	} else {
-		DEBUG_WARN("Cortex-A: target description already allocated before attach");
-	}
+	t->tdesc = tdesc_cortex_a;
 
 	/* Clear any pending fault condition */
 	target_check_error(t);
+	cortexa_tlb_flush(t);
+
+	/* Bulk memory access goes through the system bus if there is a MEM-AP for it */
+	if (!priv->mem_ap && priv->apb->dp->sysmem_ap_valid && priv->apb->dp->sysmem_apsel != priv->apb->apsel) {
+		priv->mem_ap = adiv5_sysmem_ap(priv->apb->dp);
+		if (priv->mem_ap)
+			DEBUG_INFO("Cortex-A: bulk memory access through AP %u\n", priv->mem_ap->apsel);
+	}
 
 	/* Enable halting debug mode */
 	uint32_t dbgdscr = apb_read(t, DBGDSCR);
@@ -546,14 +562,6 @@ void cortexa_detach(target *t)
 {
 	struct cortexa_priv *priv = t->priv;
 
-	if (t->tdesc) {
-		// Free the target description string that was allocated in cortexa_attach().
-		free(t->tdesc);
-		t->tdesc = NULL;
-	} else {
-		DEBUG_WARN("Cortex-A: target description already NULL before detach");
-	}
-
 	/* Clear any stale breakpoints */
 	for (unsigned i = 0; i < priv->hw_breakpoint_max; i++) {
 		apb_write(t, DBGBCR(i), 0);
@@ -561,6 +569,7 @@ void cortexa_detach(target *t)
 
 	/* Restore any clobbered registers */
 	cortexa_regs_write_internal(t);
+	cortexa_tlb_flush(t);
 	/* Invalidate cache */
 	apb_write(t, DBGITR, MCR | ICIALLU);
 
@@ -823,6 +832,7 @@ void cortexa_halt_resume(target *t, bool step)
 
 	/* Write back register cache */
 	cortexa_regs_write_internal(t);
+	cortexa_tlb_flush(t);
 
 	apb_write(t, DBGITR, MCR | ICIALLU); /* invalidate cache */
 
@@ -34,11 +34,13 @@
 #include "target_internal.h"
 #include "target_probe.h"
 #include "cortexm.h"
+#include "coresight_trace.h"
 #include "gdb_reg.h"
 #include "command.h"
 #include "gdb_packet.h"
 #include "semihosting.h"
 #include "platform.h"
+#include "scheduler.h"
 
 #include <string.h>
 #include <assert.h>
@@ -69,13 +71,40 @@
 
 static const char cortexm_driver_str[] = "ARM Cortex-M";
 
+static const uint16_t cortexm_crc32_stub[] = {
+#include "flashstub/crc32.stub"
+};
+
+static const uint16_t cortexm_memtest_stub[] = {
+#include "flashstub/memtest.stub"
+};
+
+/* Stub runs are bounded by the 5 s stub timeout, keep chunks small enough for slow cores */
+#define CORTEXM_CRC32_CHUNK_SIZE   0x8000U
+#define CORTEXM_MEMFILL_CHUNK_SIZE 0x40000U
+#define CORTEXM_MEMTEST_CHUNK_SIZE 0x10000U
+
+#define CORTEXM_MEMTEST_MODE_FILL 0U
+#define CORTEXM_MEMTEST_MODE_TEST 1U
+
 static bool cortexm_vector_catch(target *t, int argc, char *argv[]);
+static bool cortexm_mem_fill(target *t, int argc, const char **argv);
+static bool cortexm_mem_test(target *t, int argc, const char **argv);
+static bool cortexm_profile_cmd(target *t, int argc, const char **argv);
+static bool cortexm_cycles(target *t, int argc, const char **argv);
+static bool cortexm_etb(target *t, int argc, const char **argv);
+static void cortexm_profile_release(const void *priv);
 #ifdef PLATFORM_HAS_USBUART
 static bool cortexm_redirect_stdout(target *t, int argc, const char **argv);
 #endif
 
 const struct command_s cortexm_cmd_list[] = {
 	{"vector_catch", (cmd_handler)cortexm_vector_catch, "Catch exception vectors"},
+	{"mem_fill", (cmd_handler)cortexm_mem_fill, "Fill memory on the target: <addr> <len> <pattern>"},
+	{"mem_test", (cmd_handler)cortexm_mem_test, "Pattern test memory on the target: <addr> <len> [seed]"},
+	{"cycles", (cmd_handler)cortexm_cycles, "Time a code region in CPU cycles: <start> <end> [iterations] [timeout_ms]"},
+	{"profile", (cmd_handler)cortexm_profile_cmd, "Sample the PC while running: start [interval_us]|stop [file]|status|reset"},
+	{"etb", (cmd_handler)cortexm_etb, "Capture ETM trace on chip: start|stop|status|dump <file>"},
 #ifdef PLATFORM_HAS_USBUART
 	{"redirect_stdout", (cmd_handler)cortexm_redirect_stdout, "Redirect semihosting stdout to USB UART"},
 #endif
@@ -91,6 +120,7 @@ static void cortexm_regs_write(target *t, const void *data);
 static uint32_t cortexm_pc_read(target *t);
 static ssize_t cortexm_reg_read(target *t, int reg, void *data, size_t max);
 static ssize_t cortexm_reg_write(target *t, int reg, const void *data, size_t max);
+static uint32_t cortexm_pc_read(target *t);
 
 static void cortexm_reset(target *t);
 static enum target_halt_reason cortexm_halt_poll(target *t, target_addr_t *watch);
@@ -100,15 +130,43 @@ static int cortexm_fault_unwind(target *t);
 
 static int cortexm_breakwatch_set(target *t, struct breakwatch *);
 static int cortexm_breakwatch_clear(target *t, struct breakwatch *);
+static void cortexm_breakwatch_flush(target *t);
+static bool cortexm_sw_breakpoint_at(target *t, uint32_t addr);
 static target_addr_t cortexm_check_watch(target *t);
+static bool cortexm_mem_crc32(target *t, uint32_t *crc, target_addr_t base, size_t len);
+static void cortexm_regs_cache_flush(target *t);
+static void cortexm_regs_cache_invalidate(target *t);
+static void cortexm_reg_write_uncached(target *t, unsigned reg, uint32_t value);
+static void cortexm_priv_free(void *priv);
+static void cortexm_call_release(target *t);
+static void cortexm_call_check_access(target *t, target_addr_t addr, size_t len);
 
 #define CORTEXM_MAX_WATCHPOINTS 4U /* architecture says up to 15, no implementation has > 4 */
 #define CORTEXM_MAX_BREAKPOINTS 8U /* architecture says up to 127, no implementation has > 8 */
+#define CORTEXM_MAX_SW_BREAKPOINTS 32U
+/* r0-r15, xpsr, msp, psp, special + fpscr, s0-s31 */
+#define CORTEXM_GENERAL_REG_COUNT 20U
+#define CORTEXM_FLOAT_REG_COUNT   33U
+#define CORTEXM_MAX_REG_COUNT     (CORTEXM_GENERAL_REG_COUNT + CORTEXM_FLOAT_REG_COUNT)
 
 static int cortexm_hostio_request(target *t);
 
 static uint32_t time0_sec = UINT32_MAX; /* sys_clock time origin */
 
+/* A software breakpoint waiting for, or left by, cortexm_breakwatch_flush */
+enum cortexm_sw_breakpoint_state {
+	SW_BREAKPOINT_FREE,
+	SW_BREAKPOINT_INSERT, /* BKPT still to be written */
+	SW_BREAKPOINT_SET,    /* BKPT in place, saved holds what it replaced */
+	SW_BREAKPOINT_REMOVE, /* saved still to be written back */
+};
+
+struct cortexm_sw_breakpoint {
+	uint32_t addr;
+	uint16_t saved;
+	uint8_t state;
+};
+
 struct cortexm_priv {
 	ADIv5_AP_t *ap;
 	bool stepping;
@@ -117,14 +175,54 @@ struct cortexm_priv {
 	bool hw_watchpoint[CORTEXM_MAX_WATCHPOINTS];
 	unsigned flash_patch_revision;
 	unsigned hw_watchpoint_max;
+	/* The FPB and DWT have been sized, which need not be done again on re-attach */
+	bool breakwatch_sized;
 	/* Breakpoint unit status */
 	bool hw_breakpoint[CORTEXM_MAX_BREAKPOINTS];
 	unsigned hw_breakpoint_max;
+	/* Comparator settings not yet written to the FPB/DWT, see cortexm_breakwatch_flush() */
+	uint32_t hw_breakpoint_comp[CORTEXM_MAX_BREAKPOINTS];
+	uint32_t hw_breakpoint_dirty;
+	uint32_t hw_watchpoint_comp[CORTEXM_MAX_WATCHPOINTS];
+	uint32_t hw_watchpoint_mask[CORTEXM_MAX_WATCHPOINTS];
+	uint32_t hw_watchpoint_func[CORTEXM_MAX_WATCHPOINTS];
+	uint32_t hw_watchpoint_dirty;
+	/* What the comparators hold, for the slots whose known bit is set, so unchanged ones aren't rewritten */
+	uint32_t hw_breakpoint_written[CORTEXM_MAX_BREAKPOINTS];
+	uint32_t hw_breakpoint_known;
+	uint32_t hw_watchpoint_written_comp[CORTEXM_MAX_WATCHPOINTS];
+	uint32_t hw_watchpoint_written_mask[CORTEXM_MAX_WATCHPOINTS];
+	uint32_t hw_watchpoint_written_func[CORTEXM_MAX_WATCHPOINTS];
+	uint32_t hw_watchpoint_known;
+	/* BKPT instructions placed in RAM */
+	struct cortexm_sw_breakpoint sw_breakpoint[CORTEXM_MAX_SW_BREAKPOINTS];
 	/* Copy of DEMCR for vector-catch */
 	uint32_t demcr;
 	/* Cache parameters */
 	bool has_cache;
 	uint32_t dcache_minline;
+	/* L1 D-cache geometry, for cleaning all of it by set/way */
+	uint16_t dcache_sets;
+	uint16_t dcache_ways;
+	uint8_t dcache_line_shift;
+	/* Set while the core is halted, and once all of the D-cache was cleaned and invalidated in that halt */
+	bool dcache_halted;
+	bool dcache_empty;
+	/* Core register cache, valid only while halted */
+	bool regs_cached;
+	uint64_t regs_dirty; /* Bitmask of cached registers not yet written back to the core */
+	uint32_t regs_cache[CORTEXM_MAX_REG_COUNT];
+	/* RAM borrowed for target calls, see cortexm_call_load() */
+	const cortexm_call_code_s *call_code;
+	target_addr_t call_base; /* 0 when nothing is borrowed */
+	size_t call_size;
+	uint8_t *call_saved; /* What the program had there */
+	bool call_running;
+	bool call_on_bkpt;
+	uint32_t call_regs[CORTEXM_MAX_REG_COUNT];
+	/* Who this is, see cortexm_identity() */
+	uint32_t fingerprint;
+	uint8_t probe_index;
 };
 
 /* Register number tables */
@@ -144,336 +242,172 @@ static const uint32_t regnum_cortex_mf[] = {
 	0x58, 0x59, 0x5a, 0x5b, 0x5c, 0x5d, 0x5e, 0x5f, /* s24-s31 */
 };
 
-/**
- * Fields for Cortex-M special purpose registers, used in the generation of GDB's target description XML.
- * The general purpose registers r0-r12 and the vector floating point registers d0-d15 all follow a very
- * regular format, so we only need to store fields for the special purpose registers.
- * The arrays for each SPR field have the same order as each other, making each of them a pseudo
- * 'associative array'.
- */
-
-// Strings for the names of the Cortex-M's special purpose registers.
-static const char *cortex_m_spr_names[] = {
-	"sp",
-	"lr",
-	"pc",
-	"xpsr",
-	"msp",
-	"psp",
-	"primask",
-	"basepri",
-	"faultmask",
-	"control",
-};
+static_assert(ARRAY_LENGTH(regnum_cortex_m) == CORTEXM_GENERAL_REG_COUNT, "Cortex-M register cache size mismatch");
+static_assert(ARRAY_LENGTH(regnum_cortex_mf) == CORTEXM_FLOAT_REG_COUNT, "Cortex-M FPU register cache size mismatch");
+
+/* GDB's target description for a Cortex-M, the m-profile core registers only */
+#define CORTEX_M_TDESC_CORE                                        \
+	"<feature name=\"org.gnu.gdb.arm.m-profile\">"                 \
+	GDB_ARM_GPRS                                                   \
+	GDB_REG_ATTR("sp", 32, GDB_TYPE_DATA_PTR)                      \
+	GDB_REG_ATTR("lr", 32, GDB_TYPE_CODE_PTR)                      \
+	GDB_REG_ATTR("pc", 32, GDB_TYPE_CODE_PTR)                      \
+	GDB_REG("xpsr", 32)                                            \
+	GDB_REG_ATTR("msp", 32, GDB_SAVE_RESTORE_NO GDB_TYPE_DATA_PTR) \
+	GDB_REG_ATTR("psp", 32, GDB_SAVE_RESTORE_NO GDB_TYPE_DATA_PTR) \
+	GDB_REG_ATTR("primask", 8, GDB_SAVE_RESTORE_NO)                \
+	GDB_REG_ATTR("basepri", 8, GDB_SAVE_RESTORE_NO)                \
+	GDB_REG_ATTR("faultmask", 8, GDB_SAVE_RESTORE_NO)              \
+	GDB_REG_ATTR("control", 8, GDB_SAVE_RESTORE_NO)                \
+	"</feature>"
+
+static const char tdesc_cortex_m[] = GDB_ARM_PREAMBLE("target") CORTEX_M_TDESC_CORE "</target>";
+/* Cortex-M with an FPU, which adds the VFP registers */
+static const char tdesc_cortex_mf[] = GDB_ARM_PREAMBLE("target") CORTEX_M_TDESC_CORE GDB_ARM_VFP_FEATURE "</target>";
 
-// The "type" field for each Cortex-M special purpose register.
-static const gdb_reg_type_e cortex_m_spr_types[] = {
-	GDB_TYPE_DATA_PTR,    // sp
-	GDB_TYPE_CODE_PTR,    // lr
-	GDB_TYPE_CODE_PTR,    // pc
-	GDB_TYPE_UNSPECIFIED, // xpsr
-	GDB_TYPE_DATA_PTR,    // msp
-	GDB_TYPE_DATA_PTR,    // psp
-	GDB_TYPE_UNSPECIFIED, // primask
-	GDB_TYPE_UNSPECIFIED, // basepri
-	GDB_TYPE_UNSPECIFIED, // faultmask
-	GDB_TYPE_UNSPECIFIED, // control
-};
+ADIv5_AP_t *cortexm_ap(target *t)
+{
+	return ((struct cortexm_priv *)t->priv)->ap;
+}
 
-static_assert(ARRAY_LENGTH(cortex_m_spr_types) == ARRAY_LENGTH(cortex_m_spr_names), "SPR array length mismatch! SPR type "
-                                                                                "array should have the same length as "
-                                                                                "SPR name array.");
-
-// The "save-restore" field of each SPR.
-static const gdb_reg_save_restore_e cortex_m_spr_save_restores[] = {
-	GDB_SAVE_RESTORE_UNSPECIFIED, // sp
-	GDB_SAVE_RESTORE_UNSPECIFIED, // lr
-	GDB_SAVE_RESTORE_UNSPECIFIED, // pc
-	GDB_SAVE_RESTORE_UNSPECIFIED, // xpsr
-	GDB_SAVE_RESTORE_NO,          // msp
-	GDB_SAVE_RESTORE_NO,          // psp
-	GDB_SAVE_RESTORE_NO,          // primask
-	GDB_SAVE_RESTORE_NO,          // basepri
-	GDB_SAVE_RESTORE_NO,          // faultmask
-	GDB_SAVE_RESTORE_NO,          // control
-};
+bool target_is_cortexm(const target *t)
+{
+	return t->priv_free == cortexm_priv_free;
+}
 
-static_assert(ARRAY_LENGTH(cortex_m_spr_save_restores) == ARRAY_LENGTH(cortex_m_spr_names), "SPR array length mismatch! "
-                                                                                        "SPR save-restore array should "
-                                                                                        "have the same length as SPR "
-                                                                                        "name array.");
-
-// The "bitsize" field of each SPR.
-static const uint8_t cortex_m_spr_bitsizes[] = {
-	32, // sp
-	32, // lr
-	32, // pc
-	32, // xpsr
-	32, // msp
-	32, // psp
-	8,  // primask
-	8,  // basepri
-	8,  // faultmask
-	8,  // control
-};
+/* Cache maintenance operations queued per flush */
+#define CORTEXM_CACHE_OP_BATCH 64U
 
-static_assert(ARRAY_LENGTH(cortex_m_spr_bitsizes) == ARRAY_LENGTH(cortex_m_spr_names), "SPR array length mismatch! SPR "
-                                                                                   "bitsize array should have the same "
-                                                                                   "length as SPR name array.");
-
-// Creates the target description XML string for a Cortex-M. Like snprintf(), this function
-// will write no more than max_len and returns the amount of bytes written. Or, if max_len is 0,
-// then this function will return the amount of bytes that _would_ be necessary to create this
-// string.
-//
-// This function is hand-optimized to decrease string duplication and thus code size, making it
-// unforunately much less readable than the string literal it is equivalent to.
-//
-// The string it creates is XML-equivalent to the following:
-/*
-	"<?xml version=\"1.0\"?>"
-	"<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
-	"<target>"
-	"  <architecture>arm</architecture>"
-	"  <feature name=\"org.gnu.gdb.arm.m-profile\">"
-	"    <reg name=\"r0\" bitsize=\"32\"/>"
-	"    <reg name=\"r1\" bitsize=\"32\"/>"
-	"    <reg name=\"r2\" bitsize=\"32\"/>"
-	"    <reg name=\"r3\" bitsize=\"32\"/>"
-	"    <reg name=\"r4\" bitsize=\"32\"/>"
-	"    <reg name=\"r5\" bitsize=\"32\"/>"
-	"    <reg name=\"r6\" bitsize=\"32\"/>"
-	"    <reg name=\"r7\" bitsize=\"32\"/>"
-	"    <reg name=\"r8\" bitsize=\"32\"/>"
-	"    <reg name=\"r9\" bitsize=\"32\"/>"
-	"    <reg name=\"r10\" bitsize=\"32\"/>"
-	"    <reg name=\"r11\" bitsize=\"32\"/>"
-	"    <reg name=\"r12\" bitsize=\"32\"/>"
-	"    <reg name=\"sp\" bitsize=\"32\" type=\"data_ptr\"/>"
-	"    <reg name=\"lr\" bitsize=\"32\" type=\"code_ptr\"/>"
-	"    <reg name=\"pc\" bitsize=\"32\" type=\"code_ptr\"/>"
-	"    <reg name=\"xpsr\" bitsize=\"32\"/>"
-	"    <reg name=\"msp\" bitsize=\"32\" save-restore=\"no\" type=\"data_ptr\"/>"
-	"    <reg name=\"psp\" bitsize=\"32\" save-restore=\"no\" type=\"data_ptr\"/>"
-	"    <reg name=\"primask\" bitsize=\"8\" save-restore=\"no\"/>"
-	"    <reg name=\"basepri\" bitsize=\"8\" save-restore=\"no\"/>"
-	"    <reg name=\"faultmask\" bitsize=\"8\" save-restore=\"no\"/>"
-	"    <reg name=\"control\" bitsize=\"8\" save-restore=\"no\"/>"
-	"  </feature>"
-	"</target>"
-*/
-static size_t create_tdesc_cortex_m(char *buffer, size_t max_len)
-{
-	// Minor hack: technically snprintf returns an int for possibility of error, but in this case
-	// these functions are given static input that should not be able to fail -- and if it does,
-	// then there's nothing we can do about it, so we'll repatedly cast this variable to a size_t
-	// when calculating printsz (see below).
-	int total = 0;
-
-	// We can't just repeatedly pass max_len to snprintf, because we keep changing the start
-	// of buffer (effectively changing its size), so we have to repeatedly compute the size
-	// passed to snprintf by subtracting the current total from max_len.
-	// ...Unless max_len is 0, in which case that subtraction will result in an (underflowed)
-	// negative number. So we also have to repatedly check if max_len is 0 before performing
-	// that subtraction.
-	size_t printsz = max_len;
-
-	// Start with the "preamble", which is generic across ARM targets,
-	// ...save for one word, so we'll have to do the preamble in halves.
-	total += snprintf(buffer, printsz,
-		"%s target %s "
-		"<feature name=\"org.gnu.gdb.arm.m-profile\">",
-		gdb_arm_preamble_first, gdb_arm_preamble_second);
-
-	// Then the general purpose registers, which have names of r0 to r12,
-	// and all the same bitsize.
-	for (uint8_t i = 0; i <= 12; ++i) {
-		if (max_len != 0)
-			printsz = max_len - (size_t)total;
-
-		total += snprintf(buffer + total, printsz, "<reg name=\"r%u\" bitsize=\"32\"/>", i);
-	}
-
-	// Now for sp, lr, pc, xpsr, msp, psp, primask, basepri, faultmask, and control.
-	// These special purpose registers are a little more complicated.
-	// Some of them have different bitsizes, specified types, or specified save-restore values.
-	// We'll use the 'associative arrays' defined for those values.
-	// NOTE: unlike the other loops, this loop uses a size_t for its counter, as it's used to index into arrays.
-	for (size_t i = 0; i < ARRAY_LENGTH(cortex_m_spr_names); ++i) {
-		if (max_len != 0)
-			printsz = max_len - (size_t)total;
-
-		gdb_reg_type_e type = cortex_m_spr_types[i];
-		gdb_reg_save_restore_e save_restore = cortex_m_spr_save_restores[i];
-
-		total += snprintf(buffer + total, printsz, "<reg name=\"%s\" bitsize=\"%u\"%s%s/>", cortex_m_spr_names[i],
-			cortex_m_spr_bitsizes[i], gdb_reg_save_restore_strings[save_restore], gdb_reg_type_strings[type]);
-	}
-
-	if (max_len != 0)
-		printsz = max_len - (size_t)total;
-
-	total += snprintf(buffer + total, printsz, "</feature></target>");
-
-	// Minor hack: technically snprintf returns an int for possibility of error, but in this case
-	// these functions are given static input that should not ever be able to fail -- and if it
-	// does, then there's nothing we can do about it, so we'll just discard the signedness
-	// of total when we return it.
-	return (size_t)total;
-}
-
-// Creates the target description XML string for a Cortex-MF. Like snprintf(), this function
-// will write no more than max_len and returns the amount of bytes written. Or, if max_len is 0,
-// then this function will return the amount of bytes that _would_ be necessary to create this
-// string.
-//
-// This function is hand-optimized to decrease string duplication and thus code size, making it
-// unforunately much less readable than the string literal it is equivalent to.
-//
-// The string it creates is XML-equivalent to the following:
 /*
-	"<?xml version=\"1.0\"?>"
-	"<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
-	"<target>"
-	"  <architecture>arm</architecture>"
-	"  <feature name=\"org.gnu.gdb.arm.m-profile\">"
-	"    <reg name=\"r0\" bitsize=\"32\"/>"
-	"    <reg name=\"r1\" bitsize=\"32\"/>"
-	"    <reg name=\"r2\" bitsize=\"32\"/>"
-	"    <reg name=\"r3\" bitsize=\"32\"/>"
-	"    <reg name=\"r4\" bitsize=\"32\"/>"
-	"    <reg name=\"r5\" bitsize=\"32\"/>"
-	"    <reg name=\"r6\" bitsize=\"32\"/>"
-	"    <reg name=\"r7\" bitsize=\"32\"/>"
-	"    <reg name=\"r8\" bitsize=\"32\"/>"
-	"    <reg name=\"r9\" bitsize=\"32\"/>"
-	"    <reg name=\"r10\" bitsize=\"32\"/>"
-	"    <reg name=\"r11\" bitsize=\"32\"/>"
-	"    <reg name=\"r12\" bitsize=\"32\"/>"
-	"    <reg name=\"sp\" bitsize=\"32\" type=\"data_ptr\"/>"
-	"    <reg name=\"lr\" bitsize=\"32\" type=\"code_ptr\"/>"
-	"    <reg name=\"pc\" bitsize=\"32\" type=\"code_ptr\"/>"
-	"    <reg name=\"xpsr\" bitsize=\"32\"/>"
-	"    <reg name=\"msp\" bitsize=\"32\" save-restore=\"no\" type=\"data_ptr\"/>"
-	"    <reg name=\"psp\" bitsize=\"32\" save-restore=\"no\" type=\"data_ptr\"/>"
-	"    <reg name=\"primask\" bitsize=\"8\" save-restore=\"no\"/>"
-	"    <reg name=\"basepri\" bitsize=\"8\" save-restore=\"no\"/>"
-	"    <reg name=\"faultmask\" bitsize=\"8\" save-restore=\"no\"/>"
-	"    <reg name=\"control\" bitsize=\"8\" save-restore=\"no\"/>"
-	"  </feature>"
-	"  <feature name=\"org.gnu.gdb.arm.vfp\">"
-	"    <reg name=\"fpscr\" bitsize=\"32\"/>"
-	"    <reg name=\"d0\" bitsize=\"64\" type=\"float\"/>"
-	"    <reg name=\"d1\" bitsize=\"64\" type=\"float\"/>"
-	"    <reg name=\"d2\" bitsize=\"64\" type=\"float\"/>"
-	"    <reg name=\"d3\" bitsize=\"64\" type=\"float\"/>"
-	"    <reg name=\"d4\" bitsize=\"64\" type=\"float\"/>"
-	"    <reg name=\"d5\" bitsize=\"64\" type=\"float\"/>"
-	"    <reg name=\"d6\" bitsize=\"64\" type=\"float\"/>"
-	"    <reg name=\"d7\" bitsize=\"64\" type=\"float\"/>"
-	"    <reg name=\"d8\" bitsize=\"64\" type=\"float\"/>"
-	"    <reg name=\"d9\" bitsize=\"64\" type=\"float\"/>"
-	"    <reg name=\"d10\" bitsize=\"64\" type=\"float\"/>"
-	"    <reg name=\"d11\" bitsize=\"64\" type=\"float\"/>"
-	"    <reg name=\"d12\" bitsize=\"64\" type=\"float\"/>"
-	"    <reg name=\"d13\" bitsize=\"64\" type=\"float\"/>"
-	"    <reg name=\"d14\" bitsize=\"64\" type=\"float\"/>"
-	"    <reg name=\"d15\" bitsize=\"64\" type=\"float\"/>"
-	"  </feature>"
-	"</target>"
-*/
-static size_t create_tdesc_cortex_mf(char *buffer, size_t max_len)
-{
-	// Minor hack: technically snprintf returns an int for possibility of error, but in this case
-	// these functions are given static input that should not be able to fail -- and if it does,
-	// then there's not really anything we can do about it, so we repatedly cast this variable
-	// to a size_t when calculating printsz (see below). Likewise, create_tdesc_cortex_m()
-	// has static inputs and shouldn't ever return a value large enough for casting it to a
-	// signed int to change its value, and if it does, then again there's something wrong that
-	// we can't really do anything about.
-	int total = 0;
-
-	// The first part of the target description for the Cortex-MF is identical to the Cortex-M
-	// target description.
-	total = (int)create_tdesc_cortex_m(buffer, max_len);
-
-	// We can't just repeatedly pass max_len to snprintf, because we keep changing the start
-	// of buffer (effectively changing its size), so we have to repeatedly compute the size
-	// passed to snprintf by subtracting the current total from max_len.
-	// ...Unless max_len is 0, in which case that subtraction will result in an (underflowed)
-	// negative number. So we also have to repatedly check if max_len is 0 before perofmring
-	// that subtraction.
-	size_t printsz = max_len;
-
-	if (max_len != 0) {
-		// Minor hack: subtract the target closing tag, since we have a bit more to add.
-		total -= strlen("</target>");
-
-		printsz = max_len - (size_t)total;
-	}
-
-	total += snprintf(buffer + total, printsz,
-		"<feature name=\"org.gnu.gdb.arm.vfp\">"
-		"<reg name=\"fpscr\" bitsize=\"32\"/>");
-
-	// After fpscr, the rest of the vfp registers follow a regular format: d0-d15, bitsize 64, type float.
-	for (uint8_t i = 0; i <= 15; ++i) {
-		if (max_len != 0)
-			printsz = max_len - (size_t)total;
-
-		total += snprintf(buffer + total, printsz, "<reg name=\"d%u\" bitsize=\"64\" type=\"float\"/>", i);
-	}
-
-	if (max_len != 0)
-		printsz = max_len - (size_t)total;
-
-	total += snprintf(buffer + total, printsz, "</feature></target>");
-
-	// Minor hack: technically snprintf returns an int for possibility of error, but in this case
-	// these functions are given static input that should not ever be able to fail -- and if it
-	// does, then there's nothing we can do about it, so we'll just discard the signedness
-	// of total when we return it.
-	return (size_t)total;
+ * Cache maintenance goes out as queued bursts of DRW writes, TAR held on the
+ * maintenance register by not incrementing, instead of a memory write each
+ */
+static void cortexm_cache_op(ADIv5_AP_t *ap, const uint32_t reg, const uint32_t value, size_t *const queued)
+{
+	/* Only goes on the wire at the start of a batch, or if a failed flush dropped the cached CSW and TAR */
+	adiv5_ap_queue_write(ap, ADIV5_AP_CSW, ap->csw | ADIV5_AP_CSW_SIZE_WORD | ADIV5_AP_CSW_ADDRINC_NONE);
+	adiv5_ap_queue_write(ap, ADIV5_AP_TAR, reg);
+	adiv5_ap_queue_write(ap, ADIV5_AP_DRW, value);
+	if (++*queued % CORTEXM_CACHE_OP_BATCH == 0U && adiv5_dp_queue_flush(ap->dp))
+		DEBUG_WARN("Cortex-M cache maintenance failed\n");
 }
 
-ADIv5_AP_t *cortexm_ap(target *t)
+static void cortexm_cache_op_flush(ADIv5_AP_t *ap, const size_t queued)
 {
-	return ((struct cortexm_priv *)t->priv)->ap;
+	if (queued % CORTEXM_CACHE_OP_BATCH != 0U && adiv5_dp_queue_flush(ap->dp))
+		DEBUG_WARN("Cortex-M cache maintenance failed\n");
+}
+
+/* The part of RAM region r in [addr, end), false if there is none */
+static bool cortexm_cache_range(const struct target_ram *r, const target_addr_t addr, const target_addr_t end,
+	const size_t minline, target_addr_t *const start, target_addr_t *const stop)
+{
+	*start = MAX(addr, r->start) & ~(minline - 1U);
+	*stop = MIN(end, r->start + r->length);
+	return *start < *stop;
+}
+
+/* Clean and invalidate every line of the D-cache by set/way, which leaves it empty until the core runs */
+static void cortexm_cache_clean_all(target *t)
+{
+	struct cortexm_priv *priv = t->priv;
+	ADIv5_AP_t *ap = cortexm_ap(t);
+	unsigned way_shift = 32U;
+	while (way_shift > 0U && (1UL << (32U - way_shift)) < priv->dcache_ways)
+		--way_shift;
+	size_t queued = 0;
+	for (uint32_t way = 0; way < priv->dcache_ways; ++way) {
+		const uint32_t way_bits = way_shift < 32U ? way << way_shift : 0U;
+		for (uint32_t set = 0; set < priv->dcache_sets; ++set)
+			cortexm_cache_op(ap, CORTEXM_DCCISW, way_bits | (set << priv->dcache_line_shift), &queued);
+	}
+	cortexm_cache_op_flush(ap, queued);
+	priv->dcache_empty = true;
 }
 
 static void cortexm_cache_clean(target *t, target_addr_t addr, size_t len, bool invalidate)
 {
 	struct cortexm_priv *priv = t->priv;
-	if (!priv->has_cache || (priv->dcache_minline == 0))
+	if (!priv->has_cache || (priv->dcache_minline == 0) || priv->dcache_empty)
 		return;
 	uint32_t cache_reg = invalidate ? CORTEXM_DCCIMVAC : CORTEXM_DCCMVAC;
 	size_t minline = priv->dcache_minline;
 
 	/* flush data cache for RAM regions that intersect requested region */
 	target_addr_t mem_end = addr + len; /* following code is NOP if wraparound */
-	/* requested region is [src, src_end) */
-	for (struct target_ram *r = t->ram; r; r = r->next) {
-		target_addr_t ram = r->start;
-		target_addr_t ram_end = r->start + r->length;
-		/* RAM region is [ram, ram_end) */
-		if (addr > ram)
-			ram = addr;
-		if (mem_end < ram_end)
-			ram_end = mem_end;
-		/* intersection is [ram, ram_end) */
-		for (ram &= ~(minline - 1); ram < ram_end; ram += minline)
-			adiv5_mem_write(cortexm_ap(t), cache_reg, &ram, 4);
+	size_t lines = 0;
+	target_addr_t ram;
+	target_addr_t ram_end;
+	for (const struct target_ram *r = t->ram; r; r = r->next) {
+		if (cortexm_cache_range(r, addr, mem_end, minline, &ram, &ram_end))
+			lines += (ram_end - ram + minline - 1U) / minline;
+	}
+	if (!lines)
+		return;
+
+	/* Past the number of lines the cache has, walking all of it is cheaper, and with the core halted it stays clean */
+	const size_t cache_lines = (size_t)priv->dcache_sets * priv->dcache_ways;
+	if (priv->dcache_halted && cache_lines && lines >= cache_lines) {
+		cortexm_cache_clean_all(t);
+		return;
+	}
+
+	ADIv5_AP_t *ap = cortexm_ap(t);
+	size_t queued = 0;
+	for (const struct target_ram *r = t->ram; r; r = r->next) {
+		if (!cortexm_cache_range(r, addr, mem_end, minline, &ram, &ram_end))
+			continue;
+		for (; ram < ram_end; ram += minline)
+			cortexm_cache_op(ap, cache_reg, ram, &queued);
 	}
+	cortexm_cache_op_flush(ap, queued);
+}
+
+/* The core is about to run, or may have: the D-cache can be holding new data */
+static void cortexm_cache_running(target *t)
+{
+	struct cortexm_priv *priv = t->priv;
+	priv->dcache_halted = false;
+	priv->dcache_empty = false;
 }
 
+static bool cortexm_probe_id_lookup(const target *t, target_addr_t addr, uint32_t *value);
+
 static void cortexm_mem_read(target *t, void *dest, target_addr_t src, size_t len)
 {
+	uint32_t id;
+	if (len == 4U && cortexm_probe_id_lookup(t, src, &id)) {
+		memcpy(dest, &id, sizeof(id));
+		return;
+	}
+	cortexm_call_check_access(t, src, len);
 	cortexm_cache_clean(t, src, len, false);
 	adiv5_mem_read(cortexm_ap(t), dest, src, len);
 }
 
+static bool cortexm_mem_readv(target *t, const target_iovec_s *iov, size_t count)
+{
+	/* A range the probe ID cache answers splits the batch there */
+	size_t first = 0;
+	for (size_t i = 0; i <= count; ++i) {
+		uint32_t id = 0;
+		if (i < count && !(iov[i].len == 4U && cortexm_probe_id_lookup(t, iov[i].src, &id))) {
+			cortexm_call_check_access(t, iov[i].src, iov[i].len);
+			cortexm_cache_clean(t, iov[i].src, iov[i].len, false);
+			continue;
+		}
+		if (i > first && adiv5_mem_readv(cortexm_ap(t), iov + first, i - first))
+			return true;
+		if (i < count)
+			memcpy(iov[i].dest, &id, sizeof(id));
+		first = i + 1U;
+	}
+	return false;
+}
+
 static void cortexm_mem_write(target *t, target_addr_t dest, const void *src, size_t len)
 {
+	cortexm_call_check_access(t, dest, len);
 	cortexm_cache_clean(t, dest, len, true);
 	adiv5_mem_write(cortexm_ap(t), dest, src, len);
 }
@@ -486,8 +420,10 @@ static bool cortexm_check_error(target *t)
 
 static void cortexm_priv_free(void *priv)
 {
+	cortexm_profile_release(priv);
+	free(((struct cortexm_priv *)priv)->call_saved);
 	adiv5_ap_unref(((struct cortexm_priv *)priv)->ap);
-	free(priv);
+	target_arena_free(priv);
 }
 
 static void cortexm_read_cpuid(target *const t, const ADIv5_AP_t *const ap)
@@ -532,6 +468,251 @@ static void cortexm_read_cpuid(target *const t, const ADIv5_AP_t *const ap)
 		(t->cpuid & CPUID_REVISION_MASK) >> 20, t->cpuid & CPUID_PATCH_MASK);
 }
 
+/*
+ * The driver probe that claimed each recently seen core, so that a rescan of an
+ * unchanged device asks that driver first instead of working down the list.
+ * The driver still checks its own ID registers, the fingerprint only picks it.
+ */
+#define CORTEXM_PROBE_MEMO_ENTRIES 4U
+
+typedef bool (*cortexm_probe_func)(target *t);
+
+typedef struct cortexm_probe_memo {
+	uint32_t fingerprint;
+	cortexm_probe_func probe;
+} cortexm_probe_memo_s;
+
+static cortexm_probe_memo_s cortexm_probe_memo[CORTEXM_PROBE_MEMO_ENTRIES];
+static size_t cortexm_probe_memo_next;
+
+/* Hash of the DP and TARGETID identity, the AP and its ROM table base, and CPUID */
+static uint32_t cortexm_fingerprint(const target *const t, const ADIv5_AP_t *const ap)
+{
+	const ADIv5_DP_t *const dp = ap->dp;
+	const uint32_t words[] = {
+		(uint32_t)dp->designer_code << 16U | dp->partno,
+		(uint32_t)dp->target_designer_code << 16U | dp->target_partno,
+		dp->targetsel,
+		ap->apsel,
+		ap->idr,
+		ap->base,
+		t->cpuid,
+	};
+	/* FNV-1a */
+	uint32_t hash = 0x811c9dc5U;
+	for (size_t i = 0; i < ARRAY_LENGTH(words); ++i) {
+		for (size_t shift = 0; shift < 32U; shift += 8U) {
+			hash ^= (words[i] >> shift) & 0xffU;
+			hash *= 0x01000193U;
+		}
+	}
+	return hash;
+}
+
+static cortexm_probe_func cortexm_probe_memo_find(const uint32_t fingerprint)
+{
+	for (size_t i = 0; i < CORTEXM_PROBE_MEMO_ENTRIES; ++i) {
+		if (cortexm_probe_memo[i].probe && cortexm_probe_memo[i].fingerprint == fingerprint)
+			return cortexm_probe_memo[i].probe;
+	}
+	return NULL;
+}
+
+static void cortexm_probe_memo_add(const uint32_t fingerprint, const cortexm_probe_func probe)
+{
+	for (size_t i = 0; i < CORTEXM_PROBE_MEMO_ENTRIES; ++i) {
+		if (cortexm_probe_memo[i].fingerprint == fingerprint) {
+			cortexm_probe_memo[i].probe = probe;
+			return;
+		}
+	}
+	cortexm_probe_memo[cortexm_probe_memo_next].fingerprint = fingerprint;
+	cortexm_probe_memo[cortexm_probe_memo_next].probe = probe;
+	cortexm_probe_memo_next = (cortexm_probe_memo_next + 1U) % CORTEXM_PROBE_MEMO_ENTRIES;
+}
+
+/*
+ * The driver probes to try for each designer, and for ARM's own ROM tables the
+ * part, in order. id_addr is the ID register the driver keys on: it is read
+ * once before the first driver that needs it is called, and while the probes
+ * run every driver that reads it again gets that value without a bus access.
+ */
+#define CORTEXM_PART_ANY    0xffffU
+#define CORTEXM_ID_NONE     0U
+#define CORTEXM_ID_DBGMCU   0xe0042000U /* STM32 DBGMCU_IDCODE, also on the clones */
+#define CORTEXM_ID_LMI_DID0 0x400fe000U
+#define CORTEXM_ID_LPC11XX  0x400483f4U
+#define CORTEXM_ID_LPC546XX 0x40000ff8U
+#define CORTEXM_ID_LPC43XX  0x40043200U
+
+typedef struct cortexm_probe_entry {
+	uint16_t designer_code;
+	uint16_t part_id;
+	cortexm_probe_func probe;
+	target_addr_t id_addr;
+} cortexm_probe_entry_s;
+
+static const cortexm_probe_entry_s cortexm_probe_table[] = {
+	{JEP106_MANUFACTURER_FREESCALE, CORTEXM_PART_ANY, kinetis_probe, CORTEXM_ID_NONE},
+	{JEP106_MANUFACTURER_GIGADEVICE, CORTEXM_PART_ANY, gd32f1_probe, CORTEXM_ID_NONE},
+	{JEP106_MANUFACTURER_STM, CORTEXM_PART_ANY, stm32f1_probe, CORTEXM_ID_DBGMCU},
+	{JEP106_MANUFACTURER_STM, CORTEXM_PART_ANY, stm32f4_probe, CORTEXM_ID_DBGMCU},
+	{JEP106_MANUFACTURER_STM, CORTEXM_PART_ANY, stm32h7_probe, CORTEXM_ID_NONE},
+	{JEP106_MANUFACTURER_STM, CORTEXM_PART_ANY, stm32l0_probe, CORTEXM_ID_NONE},
+	{JEP106_MANUFACTURER_STM, CORTEXM_PART_ANY, stm32l4_probe, CORTEXM_ID_NONE},
+	{JEP106_MANUFACTURER_STM, CORTEXM_PART_ANY, stm32g0_probe, CORTEXM_ID_NONE},
+	{JEP106_MANUFACTURER_NORDIC, CORTEXM_PART_ANY, nrf51_probe, CORTEXM_ID_NONE},
+	{JEP106_MANUFACTURER_ATMEL, CORTEXM_PART_ANY, samx7x_probe, CORTEXM_ID_NONE},
+	{JEP106_MANUFACTURER_ATMEL, CORTEXM_PART_ANY, sam4l_probe, CORTEXM_ID_NONE},
+	{JEP106_MANUFACTURER_ATMEL, CORTEXM_PART_ANY, samd_probe, CORTEXM_ID_NONE},
+	{JEP106_MANUFACTURER_ATMEL, CORTEXM_PART_ANY, samx5x_probe, CORTEXM_ID_NONE},
+	{JEP106_MANUFACTURER_ENERGY_MICRO, CORTEXM_PART_ANY, efm32_probe, CORTEXM_ID_NONE},
+	{JEP106_MANUFACTURER_TEXAS, CORTEXM_PART_ANY, msp432_probe, CORTEXM_ID_NONE},
+	{JEP106_MANUFACTURER_SPECULAR, CORTEXM_PART_ANY, lpc11xx_probe, CORTEXM_ID_NONE}, /* LPC845 */
+	{JEP106_MANUFACTURER_RASPBERRY, CORTEXM_PART_ANY, rp_probe, CORTEXM_ID_NONE},
+	{JEP106_MANUFACTURER_RENESAS, CORTEXM_PART_ANY, renesas_probe, CORTEXM_ID_NONE},
+	/* Cortex-M0+ ROM: LPC8 and newer LPC11U6x */
+	{JEP106_MANUFACTURER_ARM, 0x4c0U, lpc11xx_probe, CORTEXM_ID_NONE},
+	{JEP106_MANUFACTURER_ARM, 0x4c1U, lpc11xx_probe, CORTEXM_ID_NONE},
+	/* Cortex-M3 ROM */
+	{JEP106_MANUFACTURER_ARM, 0x4c3U, lmi_probe, CORTEXM_ID_LMI_DID0},
+	{JEP106_MANUFACTURER_ARM, 0x4c3U, ch32f1_probe, CORTEXM_ID_DBGMCU},
+	{JEP106_MANUFACTURER_ARM, 0x4c3U, stm32f1_probe, CORTEXM_ID_DBGMCU}, /* Care for other STM32F1 clones (?) */
+	{JEP106_MANUFACTURER_ARM, 0x4c3U, lpc15xx_probe, CORTEXM_ID_NONE},   /* Thanks to JojoS for testing */
+	/* Cortex-M0 ROM */
+	{JEP106_MANUFACTURER_ARM, 0x471U, lpc11xx_probe, CORTEXM_ID_LPC11XX}, /* LPC24C11 */
+	{JEP106_MANUFACTURER_ARM, 0x471U, lpc43xx_probe, CORTEXM_ID_LPC43XX},
+	/* Cortex-M4 ROM */
+	{JEP106_MANUFACTURER_ARM, 0x4c4U, lmi_probe, CORTEXM_ID_LMI_DID0},
+	/*
+	 * The LPC546xx and LPC43xx parts present with the same AP ROM Part Number,
+	 * so we need to probe both. Reading the LPC43xx CHIPID on an LPC546xx is an
+	 * illegal access that puts the chip into Lockup, requiring a RST pulse to
+	 * recover, so the LPC546xx must be probed first, which experimentally
+	 * doesn't harm LPC43xx detection.
+	 */
+	{JEP106_MANUFACTURER_ARM, 0x4c4U, lpc546xx_probe, CORTEXM_ID_LPC546XX},
+	{JEP106_MANUFACTURER_ARM, 0x4c4U, lpc43xx_probe, CORTEXM_ID_LPC43XX},
+	{JEP106_MANUFACTURER_ARM, 0x4c4U, kinetis_probe, CORTEXM_ID_NONE}, /* Older K-series */
+	{JEP106_MANUFACTURER_ARM, 0x4c4U, at32fxx_probe, CORTEXM_ID_DBGMCU},
+	/* Cortex-M23 ROM: GD32E23x uses GD32F1 peripherals */
+	{JEP106_MANUFACTURER_ARM, 0x4cbU, gd32f1_probe, CORTEXM_ID_NONE},
+	/* These devices enumerate an AP with an empty ascii code, and have no available designer code elsewhere */
+	{ASCII_CODE_FLAG, CORTEXM_PART_ANY, sam3x_probe, CORTEXM_ID_NONE},
+	{ASCII_CODE_FLAG, CORTEXM_PART_ANY, ke04_probe, CORTEXM_ID_NONE},
+	{ASCII_CODE_FLAG, CORTEXM_PART_ANY, lpc17xx_probe, CORTEXM_ID_NONE},
+	{ASCII_CODE_FLAG, CORTEXM_PART_ANY, lpc11xx_probe, CORTEXM_ID_NONE}, /* LPC1343 */
+};
+
+#define CORTEXM_PROBE_ID_ENTRIES 4U
+
+typedef struct cortexm_probe_id {
+	target_addr_t addr;
+	uint32_t value;
+	bool valid;
+} cortexm_probe_id_s;
+
+/* ID registers read for the target being probed, NULL outside cortexm_probe() */
+static const target *cortexm_probe_id_target;
+static cortexm_probe_id_s cortexm_probe_ids[CORTEXM_PROBE_ID_ENTRIES];
+static size_t cortexm_probe_id_count;
+
+static bool cortexm_probe_id_lookup(const target *const t, const target_addr_t addr, uint32_t *const value)
+{
+	if (t != cortexm_probe_id_target)
+		return false;
+	for (size_t i = 0; i < cortexm_probe_id_count; ++i) {
+		if (cortexm_probe_ids[i].addr == addr) {
+			if (!cortexm_probe_ids[i].valid)
+				return false;
+			*value = cortexm_probe_ids[i].value;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Read an ID register for the probes once; one that faults is left for each driver to read and handle */
+static void cortexm_probe_id_read(target *const t, const target_addr_t addr)
+{
+	if (addr == CORTEXM_ID_NONE || cortexm_probe_id_count == CORTEXM_PROBE_ID_ENTRIES)
+		return;
+	for (size_t i = 0; i < cortexm_probe_id_count; ++i) {
+		if (cortexm_probe_ids[i].addr == addr)
+			return;
+	}
+	cortexm_probe_id_s *const id = &cortexm_probe_ids[cortexm_probe_id_count++];
+	id->addr = addr;
+	id->value = target_mem_read32(t, addr);
+	id->valid = !target_check_error(t);
+}
+
+static bool cortexm_probe_call(target *const t, const cortexm_probe_func probe)
+{
+	if (probe(t))
+		return true;
+	target_check_error(t);
+	return false;
+}
+
+static uint8_t cortexm_probe_index(const cortexm_probe_func probe)
+{
+	for (size_t i = 0; i < ARRAY_LENGTH(cortexm_probe_table); ++i) {
+		if (cortexm_probe_table[i].probe == probe)
+			return i;
+	}
+	return CORTEXM_PROBE_NONE;
+}
+
+/* Hand the target to the first driver that claims it, trying the one that did last time first */
+static bool cortexm_probe_dispatch(target *const t, const uint32_t fingerprint)
+{
+	struct cortexm_priv *const priv = t->priv;
+	priv->fingerprint = fingerprint;
+	/* lpc43xx_probe() locks up an LPC546xx, which has the same fingerprint, so it keeps its place */
+	const cortexm_probe_func memo = cortexm_probe_memo_find(fingerprint);
+	if (memo && memo != lpc43xx_probe && cortexm_probe_call(t, memo)) {
+		priv->probe_index = cortexm_probe_index(memo);
+		return true;
+	}
+
+	for (size_t i = 0; i < ARRAY_LENGTH(cortexm_probe_table); ++i) {
+		const cortexm_probe_entry_s *const entry = &cortexm_probe_table[i];
+		if (entry->designer_code != t->designer_code ||
+			(entry->part_id != CORTEXM_PART_ANY && entry->part_id != t->part_id))
+			continue;
+		/* A driver left out of the build costs no ID register reads */
+		if (!target_probe_linked(entry->probe))
+			continue;
+		cortexm_probe_id_read(t, entry->id_addr);
+#if PC_HOSTED
+		DEBUG_INFO("Calling probe %zu for designer 0x%x\n", i, t->designer_code);
+#endif
+		if (cortexm_probe_call(t, entry->probe)) {
+			cortexm_probe_memo_add(fingerprint, entry->probe);
+			priv->probe_index = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+void cortexm_probe_hint(const uint32_t fingerprint, const uint8_t probe)
+{
+	if (probe < ARRAY_LENGTH(cortexm_probe_table))
+		cortexm_probe_memo_add(fingerprint, cortexm_probe_table[probe].probe);
+}
+
+bool cortexm_identity(const target *const t, uint32_t *const fingerprint, uint8_t *const probe)
+{
+	if (!target_is_cortexm(t))
+		return false;
+	const struct cortexm_priv *const priv = t->priv;
+	*fingerprint = priv->fingerprint;
+	*probe = priv->probe_index;
+	return true;
+}
+
 bool cortexm_probe(ADIv5_AP_t *ap)
 {
 	target *t;
@@ -541,6 +722,7 @@ bool cortexm_probe(ADIv5_AP_t *ap)
 		return false;
 
 	adiv5_ap_ref(ap);
+	t->group = ap->dp->group;
 	if (ap->dp->version >= 2 && ap->dp->target_designer_code != 0) {
 		/* Use TARGETID register to identify target */
 		t->designer_code = ap->dp->target_designer_code;
@@ -551,7 +733,7 @@ bool cortexm_probe(ADIv5_AP_t *ap)
 		t->part_id = ap->partno;
 	}
 
-	struct cortexm_priv *priv = calloc(1, sizeof(*priv));
+	struct cortexm_priv *priv = target_arena_calloc(sizeof(*priv));
 	if (!priv) { /* calloc failed: heap exhaustion */
 		DEBUG_WARN("calloc: failed in %s\n", __func__);
 		return false;
@@ -560,10 +742,13 @@ bool cortexm_probe(ADIv5_AP_t *ap)
 	t->priv = priv;
 	t->priv_free = cortexm_priv_free;
 	priv->ap = ap;
+	priv->probe_index = CORTEXM_PROBE_NONE;
 
 	t->check_error = cortexm_check_error;
 	t->mem_read = cortexm_mem_read;
+	t->mem_readv = cortexm_mem_readv;
 	t->mem_write = cortexm_mem_write;
+	t->mem_crc32 = cortexm_mem_crc32;
 
 	t->driver = cortexm_driver_str;
 
@@ -611,150 +796,46 @@ bool cortexm_probe(ADIv5_AP_t *ap)
 	if ((ctr >> 29) == 4) {
 		priv->has_cache = true;
 		priv->dcache_minline = 4 << (ctr & 0xf);
+		/* Level 1 data cache */
+		target_mem_write32(t, CORTEXM_CSSELR, 0);
+		const uint32_t ccsidr = target_mem_read32(t, CORTEXM_CCSIDR);
+		priv->dcache_sets = ((ccsidr >> 13U) & 0x7fffU) + 1U;
+		priv->dcache_ways = ((ccsidr >> 3U) & 0x3ffU) + 1U;
+		priv->dcache_line_shift = (ccsidr & 7U) + 4U;
 	} else {
 		target_check_error(t);
 	}
-#if PC_HOSTED
-#define STRINGIFY(x) #x
-#define PROBE(x)                                  \
-	do {                                          \
-		DEBUG_INFO("Calling " STRINGIFY(x) "\n"); \
-		if ((x)(t))                               \
-			return true;                          \
-		target_check_error(t);                    \
-	} while (0)
-#else
-#define PROBE(x)               \
-	do {                       \
-		if ((x)(t))            \
-			return true;       \
-		target_check_error(t); \
-	} while (0)
-#endif
-
-	switch (t->designer_code) {
-	case JEP106_MANUFACTURER_FREESCALE:
-		PROBE(kinetis_probe);
-		if (t->part_id == 0x88c) {
-			t->driver = "MIMXRT10xx(no flash)";
-			target_halt_resume(t, 0);
-		}
-		break;
-	case JEP106_MANUFACTURER_GIGADEVICE:
-		PROBE(gd32f1_probe);
-		break;
-	case JEP106_MANUFACTURER_STM:
-		PROBE(stm32f1_probe);
-		PROBE(stm32f4_probe);
-		PROBE(stm32h7_probe);
-		PROBE(stm32l0_probe);
-		PROBE(stm32l4_probe);
-		PROBE(stm32g0_probe);
-		break;
-	case JEP106_MANUFACTURER_CYPRESS:
+	cortexm_probe_id_target = t;
+	cortexm_probe_id_count = 0;
+	const bool claimed = cortexm_probe_dispatch(t, cortexm_fingerprint(t, ap));
+	cortexm_probe_id_target = NULL;
+	if (claimed)
+		return true;
+
+	if (t->designer_code == JEP106_MANUFACTURER_FREESCALE && t->part_id == 0x88c) {
+		t->driver = "MIMXRT10xx(no flash)";
+		target_halt_resume(t, 0);
+	} else if (t->designer_code == JEP106_MANUFACTURER_CYPRESS)
 		DEBUG_WARN("Unhandled Cypress device\n");
-		break;
-	case JEP106_MANUFACTURER_INFINEON:
+	else if (t->designer_code == JEP106_MANUFACTURER_INFINEON)
 		DEBUG_WARN("Unhandled Infineon device\n");
-		break;
-	case JEP106_MANUFACTURER_NORDIC:
-		PROBE(nrf51_probe);
-		break;
-	case JEP106_MANUFACTURER_ATMEL:
-		PROBE(samx7x_probe);
-		PROBE(sam4l_probe);
-		PROBE(samd_probe);
-		PROBE(samx5x_probe);
-		break;
-	case JEP106_MANUFACTURER_ENERGY_MICRO:
-		PROBE(efm32_probe);
-		break;
-	case JEP106_MANUFACTURER_TEXAS:
-		PROBE(msp432_probe);
-		break;
-	case JEP106_MANUFACTURER_SPECULAR:
-		PROBE(lpc11xx_probe); /* LPC845 */
-		break;
-	case JEP106_MANUFACTURER_RASPBERRY:
-		PROBE(rp_probe);
-		break;
-	case JEP106_MANUFACTURER_RENESAS:
-		PROBE(renesas_probe);
-		break;
-	case JEP106_MANUFACTURER_ARM:
-		if (t->part_id == 0x4c0) {        /* Cortex-M0+ ROM */
-			PROBE(lpc11xx_probe);         /* LPC8 */
-		}else if (  t->part_id == 0x4c1) { /* Cortex-M0+ ROM */
-			PROBE(lpc11xx_probe);         /* newer LPC11U6x */
-		} else if (t->part_id == 0x4c3) { /* Cortex-M3 ROM */
-			PROBE(lmi_probe);
-			PROBE(ch32f1_probe);
-			PROBE(stm32f1_probe);         /* Care for other STM32F1 clones (?) */
-			PROBE(lpc15xx_probe);         /* Thanks to JojoS for testing */
-		} else if (t->part_id == 0x471) { /* Cortex-M0 ROM */
-			PROBE(lpc11xx_probe);         /* LPC24C11 */
-			PROBE(lpc43xx_probe);
-		} else if (t->part_id == 0x4c4) { /* Cortex-M4 ROM */
-			PROBE(lmi_probe);
-			/* The LPC546xx and LPC43xx parts present with the same AP ROM Part
-			Number, so we need to probe both. Unfortunately, when probing for
-			the LPC43xx when the target is actually an LPC546xx, the memory
-			location checked is illegal for the LPC546xx and puts the chip into
-			Lockup, requiring a RST pulse to recover. Instead, make sure to
-			probe for the LPC546xx first, which experimentally doesn't harm
-			LPC43xx detection. */
-			PROBE(lpc546xx_probe);
-			PROBE(lpc43xx_probe);
-			PROBE(kinetis_probe); /* Older K-series */
-			PROBE(at32fxx_probe);
-		} else if (t->part_id == 0x4cb) { /* Cortex-M23 ROM */
-			PROBE(gd32f1_probe);          /* GD32E23x uses GD32F1 peripherals */
-		}
-		break;
-	case ASCII_CODE_FLAG:
-		/*
-		 * these devices enumerate an AP with an empty ascii code,
-		 * and have no available designer code elsewhere
-		 */
-		PROBE(sam3x_probe);
-		PROBE(ke04_probe);
-		PROBE(lpc17xx_probe);
-		PROBE(lpc11xx_probe); /* LPC1343 */
-		break;
-	}
 #if PC_HOSTED == 0
 	gdb_outf("Please report unknown device with Designer 0x%x Part ID 0x%x\n", t->designer_code, t->part_id);
 #else
 	DEBUG_WARN("Please report unknown device with Designer 0x%x Part ID 0x%x\n", t->designer_code, t->part_id);
 #endif
-#undef PROBE
 	return true;
 }
 
 bool cortexm_attach(target *t)
 {
-	bool is_cortexmf = (t->target_options & TOPT_FLAVOUR_V7MF) == TOPT_FLAVOUR_V7MF;
-
-	if (!t->tdesc) {
-		// Find the buffer size needed for the target description string we need to send to GDB,
-		// and then compute the string itself.
-		size_t size_needed;
-		if (!is_cortexmf) {
-			size_needed = create_tdesc_cortex_m(NULL, 0) + 1;
-			t->tdesc = calloc(1, size_needed);
-			create_tdesc_cortex_m(t->tdesc, size_needed);
-		} else {
-			size_needed = create_tdesc_cortex_mf(NULL, 0) + 1;
-			t->tdesc = calloc(1, size_needed);
-			create_tdesc_cortex_mf(t->tdesc, size_needed);
-		}
-	} else {
-		DEBUG_WARN("Cortex-M: target description already allocated before attach");
-	}
+	const bool is_cortexmf = (t->target_options & TOPT_FLAVOUR_V7MF) == TOPT_FLAVOUR_V7MF;
+	t->tdesc = is_cortexmf ? tdesc_cortex_mf : tdesc_cortex_m;
 
 	ADIv5_AP_t *ap = cortexm_ap(t);
 	ap->dp->fault = 1; /* Force switch to this multi-drop device*/
 	struct cortexm_priv *priv = t->priv;
+	cortexm_regs_cache_invalidate(t);
 
 	/* Clear any pending fault condition */
 	target_check_error(t);
@@ -767,29 +848,39 @@ bool cortexm_attach(target *t)
 	target_mem_write32(t, CORTEXM_DFSR, CORTEXM_DFSR_RESETALL);
 
 	/* size the break/watchpoint units */
-	priv->hw_breakpoint_max = CORTEXM_MAX_BREAKPOINTS;
-	const uint32_t flash_break_cfg = target_mem_read32(t, CORTEXM_FPB_CTRL);
-	const uint32_t breakpoints = ((flash_break_cfg >> 4U) & 0xf);
-	if (breakpoints < priv->hw_breakpoint_max) /* only look at NUM_COMP1 */
-		priv->hw_breakpoint_max = breakpoints;
-	priv->flash_patch_revision = flash_break_cfg >> 28U;
-
-	priv->hw_watchpoint_max = CORTEXM_MAX_WATCHPOINTS;
-	const uint32_t watchpoints = target_mem_read32(t, CORTEXM_DWT_CTRL);
-	if ((watchpoints >> 28) < priv->hw_watchpoint_max)
-		priv->hw_watchpoint_max = watchpoints >> 28U;
+	if (!priv->breakwatch_sized) {
+		priv->hw_breakpoint_max = CORTEXM_MAX_BREAKPOINTS;
+		const uint32_t flash_break_cfg = target_mem_read32(t, CORTEXM_FPB_CTRL);
+		const uint32_t breakpoints = ((flash_break_cfg >> 4U) & 0xf);
+		if (breakpoints < priv->hw_breakpoint_max) /* only look at NUM_COMP1 */
+			priv->hw_breakpoint_max = breakpoints;
+		priv->flash_patch_revision = flash_break_cfg >> 28U;
+
+		priv->hw_watchpoint_max = CORTEXM_MAX_WATCHPOINTS;
+		const uint32_t watchpoints = target_mem_read32(t, CORTEXM_DWT_CTRL);
+		if ((watchpoints >> 28) < priv->hw_watchpoint_max)
+			priv->hw_watchpoint_max = watchpoints >> 28U;
+		priv->breakwatch_sized = !target_check_error(t);
+	}
 
 	/* Clear any stale breakpoints */
 	for (size_t i = 0; i < priv->hw_breakpoint_max; i++) {
 		target_mem_write32(t, CORTEXM_FPB_COMP(i), 0);
 		priv->hw_breakpoint[i] = 0;
+		priv->hw_breakpoint_written[i] = 0;
 	}
+	priv->hw_breakpoint_dirty = 0;
+	priv->hw_breakpoint_known = (1U << priv->hw_breakpoint_max) - 1U;
 
-	/* Clear any stale watchpoints */
+	/* Clear any stale watchpoints, their COMP and MASK are left unknown */
 	for (size_t i = 0; i < priv->hw_watchpoint_max; i++) {
 		target_mem_write32(t, CORTEXM_DWT_FUNC(i), 0);
 		priv->hw_watchpoint[i] = 0;
 	}
+	priv->hw_watchpoint_dirty = 0;
+	priv->hw_watchpoint_known = 0;
+	/* Software breakpoints are put back on detach, anything left over is stale */
+	memset(priv->sw_breakpoint, 0, sizeof(priv->sw_breakpoint));
 
 	/* Flash Patch Control Register: set ENABLE */
 	target_mem_write32(t, CORTEXM_FPB_CTRL, CORTEXM_FPB_CTRL_KEY | CORTEXM_FPB_CTRL_ENABLE);
@@ -816,14 +907,19 @@ void cortexm_detach(target *t)
 {
 	struct cortexm_priv *priv = t->priv;
 	unsigned i;
+	cortexm_cache_running(t);
 
-	if (t->tdesc) {
-		// Free the target description string that was allocated in cortexm_attach().
-		free(t->tdesc);
-		t->tdesc = NULL;
-	} else {
-		DEBUG_WARN("Cortex-M: target description already NULL before detach");
+	cortexm_call_release(t);
+
+	/* Put back what software breakpoints replaced, dropping any not yet written */
+	for (i = 0; i < CORTEXM_MAX_SW_BREAKPOINTS; i++) {
+		struct cortexm_sw_breakpoint *const bp = &priv->sw_breakpoint[i];
+		if (bp->state == SW_BREAKPOINT_SET)
+			bp->state = SW_BREAKPOINT_REMOVE;
+		else if (bp->state == SW_BREAKPOINT_INSERT)
+			bp->state = SW_BREAKPOINT_FREE;
 	}
+	cortexm_breakwatch_flush(t);
 
 	/* Clear any stale breakpoints */
 	for (i = 0; i < priv->hw_breakpoint_max; i++)
@@ -833,6 +929,10 @@ void cortexm_detach(target *t)
 	for (i = 0; i < priv->hw_watchpoint_max; i++)
 		target_mem_write32(t, CORTEXM_DWT_FUNC(i), 0);
 
+	/* Write back any register changes before letting the core go */
+	cortexm_regs_cache_flush(t);
+	cortexm_regs_cache_invalidate(t);
+
 	/* Restort DEMCR*/
 	ADIv5_AP_t *ap = cortexm_ap(t);
 	target_mem_write32(t, CORTEXM_DEMCR, ap->ap_cortexm_demcr);
@@ -847,7 +947,7 @@ enum {
 	DB_DEMCR
 };
 
-static void cortexm_regs_read(target *t, void *data)
+static void cortexm_regs_read_uncached(target *t, void *data)
 {
 	uint32_t *regs = data;
 	ADIv5_AP_t *ap = cortexm_ap(t);
@@ -864,31 +964,34 @@ static void cortexm_regs_read(target *t, void *data)
 	} else
 #endif
 	{
-		/* FIXME: Describe what's really going on here */
-		adiv5_ap_write(ap, ADIV5_AP_CSW, ap->csw | ADIV5_AP_CSW_SIZE_WORD);
+		/* Queue the whole register walk so probes that can batch
+		 * accesses only need a single round trip */
+		adiv5_ap_queue_write(ap, ADIV5_AP_CSW, ap->csw | ADIV5_AP_CSW_SIZE_WORD);
 
 		/* Map the banked data registers (0x10-0x1c) to the
 		 * debug registers DHCSR, DCRSR, DCRDR and DEMCR respectively */
-		adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE, ADIV5_AP_TAR, CORTEXM_DHCSR);
+		adiv5_ap_queue_write(ap, ADIV5_AP_TAR, CORTEXM_DHCSR);
 
 		/* Walk the regnum_cortex_m array, reading the registers it
 		 * calls out. */
-		adiv5_ap_write(ap, ADIV5_AP_DB(DB_DCRSR), regnum_cortex_m[0]);
+		adiv5_ap_queue_write(ap, ADIV5_AP_DB(DB_DCRSR), regnum_cortex_m[0]);
 		/* Required to switch banks */
-		*regs++ = adiv5_dp_read(ap->dp, ADIV5_AP_DB(DB_DCRDR));
+		adiv5_dp_queue_read(ap->dp, ADIV5_AP_DB(DB_DCRDR), regs++);
 		for (i = 1; i < sizeof(regnum_cortex_m) / 4; i++) {
-			adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE, ADIV5_AP_DB(DB_DCRSR), regnum_cortex_m[i]);
-			*regs++ = adiv5_dp_read(ap->dp, ADIV5_AP_DB(DB_DCRDR));
+			adiv5_dp_queue_write(ap->dp, ADIV5_AP_DB(DB_DCRSR), regnum_cortex_m[i]);
+			adiv5_dp_queue_read(ap->dp, ADIV5_AP_DB(DB_DCRDR), regs++);
 		}
 		if (t->target_options & TOPT_FLAVOUR_V7MF)
 			for (i = 0; i < sizeof(regnum_cortex_mf) / 4; i++) {
-				adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE, ADIV5_AP_DB(DB_DCRSR), regnum_cortex_mf[i]);
-				*regs++ = adiv5_dp_read(ap->dp, ADIV5_AP_DB(DB_DCRDR));
+				adiv5_dp_queue_write(ap->dp, ADIV5_AP_DB(DB_DCRSR), regnum_cortex_mf[i]);
+				adiv5_dp_queue_read(ap->dp, ADIV5_AP_DB(DB_DCRDR), regs++);
 			}
+		if (adiv5_dp_queue_flush(ap->dp))
+			DEBUG_WARN("Cortex-M register read failed\n");
 	}
 }
 
-static void cortexm_regs_write(target *t, const void *data)
+static void cortexm_regs_write_uncached(target *t, const void *data)
 {
 	const uint32_t *regs = data;
 	ADIv5_AP_t *ap = cortexm_ap(t);
@@ -908,27 +1011,95 @@ static void cortexm_regs_write(target *t, const void *data)
 	{
 		size_t i;
 
-		/* FIXME: Describe what's really going on here */
-		adiv5_ap_write(ap, ADIV5_AP_CSW, ap->csw | ADIV5_AP_CSW_SIZE_WORD);
+		adiv5_ap_queue_write(ap, ADIV5_AP_CSW, ap->csw | ADIV5_AP_CSW_SIZE_WORD);
 
 		/* Map the banked data registers (0x10-0x1c) to the
 		 * debug registers DHCSR, DCRSR, DCRDR and DEMCR respectively */
-		adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE, ADIV5_AP_TAR, CORTEXM_DHCSR);
+		adiv5_ap_queue_write(ap, ADIV5_AP_TAR, CORTEXM_DHCSR);
 		/* Walk the regnum_cortex_m array, writing the registers it
 		 * calls out. */
-		adiv5_ap_write(ap, ADIV5_AP_DB(DB_DCRDR), *regs++);
+		adiv5_ap_queue_write(ap, ADIV5_AP_DB(DB_DCRDR), *regs++);
 		/* Required to switch banks */
-		adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE, ADIV5_AP_DB(DB_DCRSR), 0x10000 | regnum_cortex_m[0]);
+		adiv5_dp_queue_write(ap->dp, ADIV5_AP_DB(DB_DCRSR), 0x10000 | regnum_cortex_m[0]);
 		for (i = 1; i < sizeof(regnum_cortex_m) / 4; i++) {
-			adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE, ADIV5_AP_DB(DB_DCRDR), *regs++);
-			adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE, ADIV5_AP_DB(DB_DCRSR), 0x10000 | regnum_cortex_m[i]);
+			adiv5_dp_queue_write(ap->dp, ADIV5_AP_DB(DB_DCRDR), *regs++);
+			adiv5_dp_queue_write(ap->dp, ADIV5_AP_DB(DB_DCRSR), 0x10000 | regnum_cortex_m[i]);
 		}
 		if (t->target_options & TOPT_FLAVOUR_V7MF)
 			for (i = 0; i < sizeof(regnum_cortex_mf) / 4; i++) {
-				adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE, ADIV5_AP_DB(DB_DCRDR), *regs++);
-				adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE, ADIV5_AP_DB(DB_DCRSR), 0x10000 | regnum_cortex_mf[i]);
+				adiv5_dp_queue_write(ap->dp, ADIV5_AP_DB(DB_DCRDR), *regs++);
+				adiv5_dp_queue_write(ap->dp, ADIV5_AP_DB(DB_DCRSR), 0x10000 | regnum_cortex_mf[i]);
 			}
+		if (adiv5_dp_queue_flush(ap->dp))
+			DEBUG_WARN("Cortex-M register write failed\n");
+	}
+}
+
+/*
+ * The register cache is filled on the first register access after a halt and serves
+ * all further g/p/PC reads from RAM. Writes only update the cache and mark the register
+ * dirty; dirty registers are written back just before the core is resumed or detached.
+ */
+static size_t cortexm_reg_count(target *t)
+{
+	return t->regs_size / 4U;
+}
+
+static bool cortexm_regs_cache_fill(target *t)
+{
+	struct cortexm_priv *priv = t->priv;
+	if (priv->regs_cached)
+		return true;
+	cortexm_regs_read_uncached(t, priv->regs_cache);
+	if (target_check_error(t))
+		return false;
+	priv->regs_cached = true;
+	priv->regs_dirty = 0;
+	return true;
+}
+
+static void cortexm_regs_cache_flush(target *t)
+{
+	struct cortexm_priv *priv = t->priv;
+	if (!priv->regs_cached || !priv->regs_dirty)
+		return;
+	const size_t count = cortexm_reg_count(t);
+	const uint64_t all_regs = count < 64U ? (UINT64_C(1) << count) - 1U : UINT64_MAX;
+	/* A 'G' packet dirties everything, which the banked-register bulk path does best */
+	if ((priv->regs_dirty & all_regs) == all_regs)
+		cortexm_regs_write_uncached(t, priv->regs_cache);
+	else {
+		for (size_t i = 0; i < count; ++i) {
+			if (priv->regs_dirty & (UINT64_C(1) << i))
+				cortexm_reg_write_uncached(t, i, priv->regs_cache[i]);
+		}
 	}
+	priv->regs_dirty = 0;
+}
+
+static void cortexm_regs_cache_invalidate(target *t)
+{
+	struct cortexm_priv *priv = t->priv;
+	priv->regs_cached = false;
+	priv->regs_dirty = 0;
+}
+
+static void cortexm_regs_read(target *t, void *data)
+{
+	struct cortexm_priv *priv = t->priv;
+	if (cortexm_regs_cache_fill(t))
+		memcpy(data, priv->regs_cache, t->regs_size);
+	else
+		cortexm_regs_read_uncached(t, data);
+}
+
+static void cortexm_regs_write(target *t, const void *data)
+{
+	struct cortexm_priv *priv = t->priv;
+	const size_t count = cortexm_reg_count(t);
+	memcpy(priv->regs_cache, data, t->regs_size);
+	priv->regs_cached = true;
+	priv->regs_dirty = count < 64U ? (UINT64_C(1) << count) - 1U : UINT64_MAX;
 }
 
 int cortexm_mem_write_sized(target *t, target_addr_t dest, const void *src, size_t len, enum align align)
@@ -949,11 +1120,27 @@ static int dcrsr_regnum(target *t, unsigned reg)
 		return -1;
 	}
 }
+static void cortexm_reg_write_uncached(target *t, const unsigned reg, const uint32_t value)
+{
+	target_mem_write32(t, CORTEXM_DCRDR, value);
+	target_mem_write32(t, CORTEXM_DCRSR, CORTEXM_DCRSR_REGWnR | dcrsr_regnum(t, reg));
+}
+
 static ssize_t cortexm_reg_read(target *t, int reg, void *data, size_t max)
 {
 	if (max < 4)
 		return -1;
+	struct cortexm_priv *priv = t->priv;
 	uint32_t *r = data;
+	/* A lone PC read (as done when range stepping) doesn't need the whole register file */
+	if (reg == REG_PC && !priv->regs_cached) {
+		*r = cortexm_pc_read(t);
+		return 4;
+	}
+	if (reg >= 0 && (size_t)reg < cortexm_reg_count(t) && cortexm_regs_cache_fill(t)) {
+		*r = priv->regs_cache[reg];
+		return 4;
+	}
 	target_mem_write32(t, CORTEXM_DCRSR, dcrsr_regnum(t, reg));
 	*r = target_mem_read32(t, CORTEXM_DCRDR);
 	return 4;
@@ -963,28 +1150,51 @@ static ssize_t cortexm_reg_write(target *t, int reg, const void *data, size_t ma
 {
 	if (max < 4)
 		return -1;
+	struct cortexm_priv *priv = t->priv;
 	const uint32_t *r = data;
-	target_mem_write32(t, CORTEXM_DCRDR, *r);
-	target_mem_write32(t, CORTEXM_DCRSR, CORTEXM_DCRSR_REGWnR | dcrsr_regnum(t, reg));
+	if (reg >= 0 && (size_t)reg < cortexm_reg_count(t) && cortexm_regs_cache_fill(t)) {
+		priv->regs_cache[reg] = *r;
+		priv->regs_dirty |= UINT64_C(1) << (unsigned)reg;
+		return 4;
+	}
+	cortexm_reg_write_uncached(t, reg, *r);
 	return 4;
 }
 
 static uint32_t cortexm_pc_read(target *t)
 {
+	struct cortexm_priv *priv = t->priv;
+	/* Don't fill the whole cache just for the PC, flash stubs and semihosting only need this */
+	if (priv->regs_cached)
+		return priv->regs_cache[REG_PC];
 	target_mem_write32(t, CORTEXM_DCRSR, 0x0F);
 	return target_mem_read32(t, CORTEXM_DCRDR);
 }
 
 static void cortexm_pc_write(target *t, const uint32_t val)
 {
-	target_mem_write32(t, CORTEXM_DCRDR, val);
-	target_mem_write32(t, CORTEXM_DCRSR, CORTEXM_DCRSR_REGWnR | 0x0F);
+	struct cortexm_priv *priv = t->priv;
+	if (priv->regs_cached) {
+		priv->regs_cache[REG_PC] = val;
+		priv->regs_dirty |= UINT64_C(1) << REG_PC;
+		return;
+	}
+	cortexm_reg_write_uncached(t, REG_PC, val);
 }
 
 /* The following three routines implement target halt/resume
  * using the core debug registers in the NVIC. */
 static void cortexm_reset(target *t)
 {
+	/* Hand back RAM borrowed for target calls while it still means something */
+	cortexm_call_release(t);
+	/* Whatever was cached (or pending write-back) is meaningless after a reset */
+	cortexm_regs_cache_invalidate(t);
+	cortexm_cache_running(t);
+	/* Some parts reset the FPB and DWT along with the core, so don't trust what they held */
+	struct cortexm_priv *priv = t->priv;
+	priv->hw_breakpoint_known = 0;
+	priv->hw_watchpoint_known = 0;
 	/* Read DHCSR here to clear S_RESET_ST bit before reset */
 	target_mem_read32(t, CORTEXM_DHCSR);
 	platform_timeout reset_timeout;
@@ -1035,22 +1245,150 @@ static void cortexm_halt_request(target *t)
 	}
 }
 
+/*
+ * Halt polling and break/watchpoint updates go through the AP queue where the
+ * probe's memory accesses use the MEM-AP directly, so the CSW/TAR cache
+ * applies. High level probes that hide CSW/TAR get plain memory accesses.
+ */
+static bool cortexm_ap_queued(ADIv5_AP_t *ap)
+{
+#if PC_HOSTED == 1
+	if (ap->dp->ap_regs_read)
+		return false;
+#else
+	(void)ap;
+#endif
+	return true;
+}
+
+/*
+ * Read DHCSR with CSW and TAR left pointing at it and not incrementing, so
+ * while the core runs each poll after the first is a single DRW read.
+ * Returns true if the access failed.
+ */
+static bool cortexm_dhcsr_queue_read(ADIv5_AP_t *ap, uint32_t *dhcsr)
+{
+	adiv5_ap_queue_write(ap, ADIV5_AP_CSW, ap->csw | ADIV5_AP_CSW_SIZE_WORD | ADIV5_AP_CSW_ADDRINC_NONE);
+	adiv5_ap_queue_write(ap, ADIV5_AP_TAR, CORTEXM_DHCSR);
+	adiv5_ap_queue_read(ap, ADIV5_AP_DRW, dhcsr);
+	return adiv5_dp_queue_flush(ap->dp);
+}
+
+/*
+ * Once halted, fetch the PC and DFSR in one batch: the PC by DCRSR/DCRDR through
+ * the banked view of the debug registers, with DHCSR read between them to check
+ * the transfer completed, then DFSR read and cleared. Returns true if the batch
+ * failed, in which case nothing it read can be trusted.
+ */
+static bool cortexm_halt_state_queue_read(target *t, uint32_t *dfsr, uint32_t *pc)
+{
+	ADIv5_AP_t *ap = cortexm_ap(t);
+	uint32_t dhcsr = 0;
+	adiv5_ap_queue_write(ap, ADIV5_AP_CSW, ap->csw | ADIV5_AP_CSW_SIZE_WORD | ADIV5_AP_CSW_ADDRINC_NONE);
+	adiv5_ap_queue_write(ap, ADIV5_AP_TAR, CORTEXM_DHCSR);
+	adiv5_ap_queue_write(ap, ADIV5_AP_DB(DB_DCRSR), 0x0fU);
+	adiv5_ap_queue_read(ap, ADIV5_AP_DB(DB_DHCSR), &dhcsr);
+	adiv5_ap_queue_read(ap, ADIV5_AP_DB(DB_DCRDR), pc);
+	adiv5_ap_queue_write(ap, ADIV5_AP_TAR, CORTEXM_DFSR);
+	adiv5_ap_queue_read(ap, ADIV5_AP_DRW, dfsr);
+	adiv5_ap_queue_write(ap, ADIV5_AP_DRW, CORTEXM_DFSR_RESETALL);
+	if (adiv5_dp_queue_flush(ap->dp))
+		return true;
+	/* The register transfer outran a slow core, so the PC has to be asked for again */
+	if (!(dhcsr & CORTEXM_DHCSR_S_REGRDY))
+		*pc = cortexm_pc_read(t);
+	return false;
+}
+
+/*
+ * Revalidate the target after a DP error in place of a rescan. If the core went
+ * through a power-down or reset meanwhile, its debug setup went with it, so the
+ * halting debug enable, DEMCR and every break/watchpoint GDB still has are put back.
+ */
+bool cortexm_recover(target *t)
+{
+	struct cortexm_priv *priv = t->priv;
+	if (!adiv5_ap_recover(cortexm_ap(t)))
+		return false;
+	cortexm_cache_running(t);
+	cortexm_regs_cache_invalidate(t);
+	const uint32_t dhcsr = target_mem_read32(t, CORTEXM_DHCSR);
+	if (target_check_error(t))
+		return false;
+	if (dhcsr & CORTEXM_DHCSR_C_DEBUGEN)
+		return true;
+
+	DEBUG_WARN("Cortex-M lost its debug state, restoring it\n");
+	target_mem_write32(t, CORTEXM_DHCSR, CORTEXM_DHCSR_DBGKEY | CORTEXM_DHCSR_C_DEBUGEN);
+	target_mem_write32(t, CORTEXM_DEMCR, priv->demcr);
+	target_mem_write32(t, CORTEXM_FPB_CTRL, CORTEXM_FPB_CTRL_KEY | CORTEXM_FPB_CTRL_ENABLE);
+	for (size_t i = 0; i < priv->hw_breakpoint_max; i++) {
+		if (priv->hw_breakpoint[i])
+			priv->hw_breakpoint_dirty |= 1U << i;
+	}
+	for (size_t i = 0; i < priv->hw_watchpoint_max; i++) {
+		if (priv->hw_watchpoint[i])
+			priv->hw_watchpoint_dirty |= 1U << i;
+	}
+	priv->hw_breakpoint_known = 0;
+	priv->hw_watchpoint_known = 0;
+	/* Any BKPT that RAM did not hold on to goes back in over what is there now */
+	for (size_t i = 0; i < CORTEXM_MAX_SW_BREAKPOINTS; i++) {
+		struct cortexm_sw_breakpoint *const bp = &priv->sw_breakpoint[i];
+		if (bp->state == SW_BREAKPOINT_SET && (target_mem_read16(t, bp->addr) & 0xff00U) != 0xbe00U)
+			bp->state = SW_BREAKPOINT_INSERT;
+	}
+	cortexm_breakwatch_flush(t);
+	return !target_check_error(t);
+}
+
+/*
+ * Read DHCSR with the DP's errors deferred rather than raised, as this runs
+ * continuously while the target does, and return the EXCEPTION_ type of any
+ * that happened. A timeout because the target is in WFI means it is still running.
+ */
+static uint32_t cortexm_dhcsr_poll(target *t, const bool queued, uint32_t *dhcsr)
+{
+	ADIv5_AP_t *ap = cortexm_ap(t);
+	adiv5_dp_errors_defer(ap->dp);
+	uint32_t value = 0;
+	if (!queued || cortexm_dhcsr_queue_read(ap, &value))
+		value = target_mem_read32(t, CORTEXM_DHCSR);
+	*dhcsr = value;
+	return adiv5_dp_errors_collect(ap->dp);
+}
+
 static enum target_halt_reason cortexm_halt_poll(target *t, target_addr_t *watch)
 {
 	struct cortexm_priv *priv = t->priv;
+	ADIv5_AP_t *ap = cortexm_ap(t);
+	const bool queued = cortexm_ap_queued(ap);
 
+#if PC_HOSTED == 1
+	/* Some adaptors still raise from below the DP, past adiv5_dp_raise() */
 	volatile uint32_t dhcsr = 0;
+	volatile uint32_t error = 0;
 	volatile struct exception e;
 	TRY_CATCH (e, EXCEPTION_ALL) {
-		/* If this times out because the target is in WFI then
-		 * the target is still running. */
-		dhcsr = target_mem_read32(t, CORTEXM_DHCSR);
+		uint32_t value = 0;
+		error = cortexm_dhcsr_poll(t, queued, &value);
+		dhcsr = value;
 	}
-	switch (e.type) {
-	case EXCEPTION_ERROR:
-		/* Oh crap, there's no recovery from this... */
-		target_list_free();
-		return TARGET_HALT_ERROR;
+	if (e.type) {
+		adiv5_dp_errors_collect(ap->dp);
+		error = e.type;
+	}
+#else
+	uint32_t dhcsr = 0;
+	const uint32_t error = cortexm_dhcsr_poll(t, queued, &dhcsr);
+#endif
+	switch (error) {
+	case EXCEPTION_ERROR:
+		/* Try to get the link back before giving up on every target */
+		if (cortexm_recover(t))
+			return TARGET_HALT_RUNNING;
+		target_list_free();
+		return TARGET_HALT_ERROR;
 	case EXCEPTION_TIMEOUT:
 		/* Timeout isn't a problem, target could be in WFI */
 		return TARGET_HALT_RUNNING;
@@ -1058,10 +1396,16 @@ static enum target_halt_reason cortexm_halt_poll(target *t, target_addr_t *watch
 
 	if (!(dhcsr & CORTEXM_DHCSR_S_HALT))
 		return TARGET_HALT_RUNNING;
+	priv->dcache_halted = true;
 
 	/* We've halted.  Let's find out why. */
-	uint32_t dfsr = target_mem_read32(t, CORTEXM_DFSR);
-	target_mem_write32(t, CORTEXM_DFSR, dfsr); /* write back to reset */
+	uint32_t dfsr = 0;
+	uint32_t pc = 0;
+	const bool have_pc = queued && !cortexm_halt_state_queue_read(t, &dfsr, &pc);
+	if (!have_pc) {
+		dfsr = target_mem_read32(t, CORTEXM_DFSR);
+		target_mem_write32(t, CORTEXM_DFSR, dfsr); /* write back to reset */
+	}
 
 	if ((dfsr & CORTEXM_DFSR_VCATCH) && cortexm_fault_unwind(t))
 		return TARGET_HALT_FAULT;
@@ -1071,7 +1415,8 @@ static enum target_halt_reason cortexm_halt_poll(target *t, target_addr_t *watch
 	if (priv->on_bkpt) {
 		/* If we've hit a programmed breakpoint, check for semihosting
 		 * call. */
-		uint32_t pc = cortexm_pc_read(t);
+		if (!have_pc)
+			pc = cortexm_pc_read(t);
 		uint16_t bkpt_instr;
 		bkpt_instr = target_mem_read16(t, pc);
 		if (bkpt_instr == 0xbeabU) {
@@ -1098,150 +1443,956 @@ static enum target_halt_reason cortexm_halt_poll(target *t, target_addr_t *watch
 	return TARGET_HALT_BREAKPOINT;
 }
 
-static void cortexm_halt_resume(target *t, bool step)
-{
-	struct cortexm_priv *priv = t->priv;
-	uint32_t dhcsr = CORTEXM_DHCSR_DBGKEY | CORTEXM_DHCSR_C_DEBUGEN;
+static void cortexm_halt_resume(target *t, bool step)
+{
+	struct cortexm_priv *priv = t->priv;
+	uint32_t dhcsr = CORTEXM_DHCSR_DBGKEY | CORTEXM_DHCSR_C_DEBUGEN;
+	cortexm_cache_running(t);
+
+	if (step)
+		dhcsr |= CORTEXM_DHCSR_C_STEP | CORTEXM_DHCSR_C_MASKINTS;
+
+	/* Disable interrupts while single stepping... */
+	if (step != priv->stepping) {
+		target_mem_write32(t, CORTEXM_DHCSR, dhcsr | CORTEXM_DHCSR_C_HALT);
+		priv->stepping = step;
+	}
+
+	/* The program gets its RAM back before it runs again */
+	if (!priv->call_running)
+		cortexm_call_release(t);
+	cortexm_breakwatch_flush(t);
+
+	/* Step over a BKPT compiled into the program, but not one of ours, which GDB must have asked for */
+	if (priv->on_bkpt) {
+		uint32_t pc = cortexm_pc_read(t);
+		if ((target_mem_read16(t, pc) & 0xff00U) == 0xbe00U && !cortexm_sw_breakpoint_at(t, pc))
+			cortexm_pc_write(t, pc + 2);
+	}
+
+	if (priv->has_cache)
+		target_mem_write32(t, CORTEXM_ICIALLU, 0);
+
+	cortexm_regs_cache_flush(t);
+	cortexm_regs_cache_invalidate(t);
+	target_mem_write32(t, CORTEXM_DHCSR, dhcsr);
+}
+
+/* The exception stack frame, and the extended one that adds S0-S15 and FPSCR after it */
+#define CORTEXM_FRAME_WORDS          8U
+#define CORTEXM_FRAME_EXTENDED_WORDS 26U
+#define CORTEXM_FRAME_S0             8U
+#define CORTEXM_FRAME_FPSCR          24U
+
+/* Change a cached register, marking it dirty only if the value moved */
+static void cortexm_regs_cache_set(target *t, const unsigned reg, const uint32_t value)
+{
+	struct cortexm_priv *priv = t->priv;
+	if (priv->regs_cache[reg] == value)
+		return;
+	priv->regs_cache[reg] = value;
+	priv->regs_dirty |= UINT64_C(1) << reg;
+}
+
+/*
+ * The pre-exception state is worked out into the register cache, so the stop reply
+ * and GDB's g that follow need nothing more from the target and only the registers
+ * that change are written back on resume.
+ */
+static int cortexm_fault_unwind(target *t)
+{
+	/* CFSR and HFSR are adjacent, read them and write them back to reset in one go */
+	uint32_t fault_status[2];
+	target_mem_read(t, fault_status, CORTEXM_CFSR, sizeof(fault_status));
+	const uint32_t cfsr = fault_status[0];
+	const uint32_t hfsr = fault_status[1];
+	target_mem_write(t, CORTEXM_CFSR, fault_status, sizeof(fault_status));
+	/* We check for FORCED in the HardFault Status Register or
+	 * for a configurable fault to avoid catching core resets */
+	if (!(hfsr & CORTEXM_HFSR_FORCED) && !cfsr)
+		return 0;
+
+	/* Unwind exception, from the registers for the post-exception stack pointer */
+	const struct cortexm_priv *priv = t->priv;
+	if (!cortexm_regs_cache_fill(t))
+		return 0;
+	const uint32_t *const regs = priv->regs_cache;
+	/* The retcode currently in lr */
+	const uint32_t retcode = regs[REG_LR];
+	const bool spsel = retcode & (1U << 2U);
+	const bool fpca = !(retcode & (1U << 4U));
+
+	/* Read the whole stack frame, FP state included, for pre-exception registers */
+	uint32_t frame[CORTEXM_FRAME_EXTENDED_WORDS];
+	const uint32_t sp = spsel ? regs[REG_PSP] : regs[REG_MSP];
+	target_mem_read(t, frame, sp, (fpca ? CORTEXM_FRAME_EXTENDED_WORDS : CORTEXM_FRAME_WORDS) * 4U);
+	if (target_check_error(t))
+		return 0;
+	cortexm_regs_cache_set(t, REG_LR, frame[5]); /* restore LR to pre-exception state */
+	cortexm_regs_cache_set(t, REG_PC, frame[6]); /* restore PC to pre-exception state */
+
+	/* adjust stack to pop exception state */
+	uint32_t framesize = fpca ? 0x68U : 0x20U; /* check for basic vs. extended frame */
+	if (frame[7] & (1U << 9U))                 /* check for stack alignment fixup */
+		framesize += 4U;
+
+	uint32_t special = regs[REG_SPECIAL];
+	if (spsel)
+		special |= 0x4000000U;
+	cortexm_regs_cache_set(t, spsel ? REG_PSP : REG_MSP, sp + framesize);
+	cortexm_regs_cache_set(t, REG_SP, sp + framesize);
+
+	if (fpca) {
+		special |= 0x2000000U;
+		/*
+		 * Unless lazy stacking is still pending, in which case the frame is only
+		 * reserved and the FP registers are as the program left them, the handler
+		 * may have changed them since they were stacked.
+		 */
+		if ((t->target_options & TOPT_FLAVOUR_V7MF) &&
+			!(target_mem_read32(t, CORTEXM_FPCCR) & CORTEXM_FPCCR_LSPACT)) {
+			cortexm_regs_cache_set(t, CORTEXM_GENERAL_REG_COUNT, frame[CORTEXM_FRAME_FPSCR]);
+			for (size_t i = 0; i < 16U; ++i)
+				cortexm_regs_cache_set(t, CORTEXM_GENERAL_REG_COUNT + 1U + i, frame[CORTEXM_FRAME_S0 + i]);
+		}
+	}
+	cortexm_regs_cache_set(t, REG_SPECIAL, special);
+
+	/* FIXME: frame[7] contains xPSR when this is supported */
+	/* although, if we caught the exception it will be unchanged */
+
+	/* Reset exception state to allow resuming from restored
+	 * state.
+	 */
+	target_mem_write32(t, CORTEXM_AIRCR, CORTEXM_AIRCR_VECTKEY | CORTEXM_AIRCR_VECTCLRACTIVE);
+	return 1;
+}
+
+/* Point the core at a stub in RAM with its arguments in r0-r3 and let it run */
+static bool cortexm_stub_start(target *t, uint32_t loadaddr, uint32_t r0, uint32_t r1, uint32_t r2, uint32_t r3)
+{
+	uint32_t regs[t->regs_size / 4U];
+
+	memset(regs, 0, sizeof(regs));
+	regs[0] = r0;
+	regs[1] = r1;
+	regs[2] = r2;
+	regs[3] = r3;
+	regs[15] = loadaddr;
+	regs[REG_XPSR] = CORTEXM_XPSR_THUMB;
+	regs[19] = 0;
+
+	/*
+	 * A stub loaded with ordinary writes may have had a target call's routine
+	 * put over it since, giving the RAM back puts the stub back. While a call
+	 * is starting this leaves its own routine alone.
+	 */
+	cortexm_call_check_access(t, loadaddr, sizeof(uint16_t));
+	cortexm_regs_write(t, regs);
+
+	if (target_check_error(t))
+		return false;
+
+	/* Execute the stub */
+	cortexm_halt_resume(t, 0);
+	return true;
+}
+
+/* Wait for a stub started by cortexm_stub_start() to exit, returning its bkpt code */
+static int cortexm_stub_wait(target *t)
+{
+	enum target_halt_reason reason;
+	platform_timeout timeout;
+	platform_timeout_set(&timeout, 5000);
+	/* Stubs run for anything from microseconds to a whole erase, so space the polls out as it goes on */
+	platform_backoff backoff;
+	platform_backoff_init(&backoff, 500U);
+	do {
+		platform_backoff_wait(&backoff);
+		if (platform_timeout_is_expired(&timeout)) {
+			cortexm_halt_request(t);
+#if defined(PLATFORM_HAS_DEBUG)
+			DEBUG_WARN("Stub hangs\n");
+			uint32_t arm_regs[t->regs_size];
+			target_regs_read(t, arm_regs);
+			for (size_t i = 0; i < 20; i++) {
+				DEBUG_WARN("%2zu: %08" PRIx32 "\n", i, arm_regs[i]);
+			}
+#endif
+			return -3;
+		}
+	} while ((reason = cortexm_halt_poll(t, NULL)) == TARGET_HALT_RUNNING);
+
+	if (reason == TARGET_HALT_ERROR)
+		raise_exception(EXCEPTION_ERROR, "Target lost in stub");
+
+	if (reason != TARGET_HALT_BREAKPOINT) {
+		DEBUG_WARN(" Reasone %d\n", reason);
+		return -2;
+	}
+	uint32_t pc = cortexm_pc_read(t);
+	uint16_t bkpt_instr = target_mem_read16(t, pc);
+	if (bkpt_instr >> 8U != 0xbeU)
+		return -2;
+
+	return bkpt_instr & 0xffU;
+}
+
+int cortexm_run_stub(target *t, uint32_t loadaddr, uint32_t r0, uint32_t r1, uint32_t r2, uint32_t r3)
+{
+	if (!cortexm_stub_start(t, loadaddr, r0, r1, r2, r3))
+		return -1;
+	return cortexm_stub_wait(t);
+}
+
+/*
+ * Target calls run a routine from RAM borrowed from the program. The routine is
+ * uploaded by the first call after a halt and stays resident for the ones that
+ * follow, which is what makes a loop of calls cheap. What the program had in
+ * that RAM is saved and written back before the core runs anything else, or
+ * when the debugger touches it. The core registers are put back after every
+ * call so GDB never sees the routine's.
+ */
+static bool cortexm_call_overlaps(target_addr_t base, size_t size, target_addr_t avoid, size_t avoid_len)
+{
+	return base < avoid + avoid_len && avoid < base + size;
+}
+
+static void cortexm_call_release(target *t)
+{
+	struct cortexm_priv *priv = t->priv;
+	if (!priv->call_base || priv->call_running)
+		return;
+	cortexm_call_mem_write(t, priv->call_base, priv->call_saved, priv->call_size);
+	free(priv->call_saved);
+	priv->call_saved = NULL;
+	priv->call_base = 0;
+	priv->call_code = NULL;
+}
+
+static void cortexm_call_check_access(target *t, target_addr_t addr, size_t len)
+{
+	const struct cortexm_priv *priv = t->priv;
+	if (priv->call_base && cortexm_call_overlaps(priv->call_base, priv->call_size, addr, len))
+		cortexm_call_release(t);
+}
+
+/* Access to the borrowed RAM that leaves it borrowed, for a routine's arguments and results */
+void cortexm_call_mem_read(target *t, void *dest, target_addr_t src, size_t len)
+{
+	cortexm_cache_clean(t, src, len, false);
+	adiv5_mem_read(cortexm_ap(t), dest, src, len);
+}
+
+void cortexm_call_mem_write(target *t, target_addr_t dest, const void *src, size_t len)
+{
+	cortexm_cache_clean(t, dest, len, true);
+	adiv5_mem_write(cortexm_ap(t), dest, src, len);
+}
+
+/*
+ * Makes code resident in RAM clear of [avoid, avoid + avoid_len), which is left
+ * for the memory the routine works on. The core must be halted. Returns the
+ * address of the routine's arena, or 0 if there's no usable RAM.
+ */
+target_addr_t cortexm_call_load(target *t, const cortexm_call_code_s *code, target_addr_t avoid, size_t avoid_len)
+{
+	struct cortexm_priv *priv = t->priv;
+	const size_t code_size = ALIGN(code->code_size, 4U);
+	const size_t size = code_size + ALIGN(code->arena_size, 4U);
+	if (priv->call_base && priv->call_code == code &&
+		!cortexm_call_overlaps(priv->call_base, size, avoid, avoid_len))
+		return priv->call_base + code_size;
+	cortexm_call_release(t);
+
+	target_addr_t base = 0;
+	for (struct target_ram *r = t->ram; r && !base; r = r->next) {
+		const target_addr_t start = ALIGN(r->start, 4U);
+		if (!start || r->length < size + (start - r->start))
+			continue;
+		/* Try both ends of the region */
+		const target_addr_t candidates[2] = {start, (r->start + r->length - size) & ~3U};
+		for (size_t i = 0; i < 2U && !base; ++i) {
+			if (!cortexm_call_overlaps(candidates[i], size, avoid, avoid_len))
+				base = candidates[i];
+		}
+	}
+	if (!base || !(target_mem_read32(t, CORTEXM_DHCSR) & CORTEXM_DHCSR_S_HALT))
+		return 0;
+
+	priv->call_saved = malloc(size);
+	if (!priv->call_saved) { /* malloc failed: heap exhaustion */
+		DEBUG_WARN("malloc: failed in %s\n", __func__);
+		return 0;
+	}
+	cortexm_call_mem_read(t, priv->call_saved, base, size);
+	cortexm_call_mem_write(t, base, code->code, code->code_size);
+	if (target_check_error(t)) {
+		/* What was read can't be trusted to be written back */
+		free(priv->call_saved);
+		priv->call_saved = NULL;
+		return 0;
+	}
+	priv->call_code = code;
+	priv->call_base = base;
+	priv->call_size = size;
+	return base + code_size;
+}
+
+/* Start the resident routine, cortexm_call_poll() or cortexm_call_wait() collect its result */
+bool cortexm_call_start(target *t, uint32_t r0, uint32_t r1, uint32_t r2, uint32_t r3)
+{
+	struct cortexm_priv *priv = t->priv;
+	if (!priv->call_base || priv->call_running)
+		return false;
+	/* The first call after a halt fills the register cache, after that this is free */
+	target_regs_read(t, priv->call_regs);
+	priv->call_on_bkpt = priv->on_bkpt;
+	priv->call_running = true;
+	if (!cortexm_stub_start(t, priv->call_base, r0, r1, r2, r3)) {
+		priv->call_running = false;
+		target_regs_write(t, priv->call_regs);
+		return false;
+	}
+	return true;
+}
+
+/* Collect a call once the core has halted, copying r0-r7 to regs if given */
+static int cortexm_call_finish(target *t, const enum target_halt_reason reason, uint32_t *regs)
+{
+	struct cortexm_priv *priv = t->priv;
+	priv->call_running = false;
+	if (reason == TARGET_HALT_ERROR)
+		raise_exception(EXCEPTION_ERROR, "Target lost in stub");
+
+	int result = -2;
+	if (reason == TARGET_HALT_BREAKPOINT) {
+		/* The BKPT is in the borrowed RAM, which an ordinary read would give back first */
+		uint16_t bkpt_instr = 0;
+		cortexm_call_mem_read(t, &bkpt_instr, cortexm_pc_read(t), sizeof(bkpt_instr));
+		if (bkpt_instr >> 8U == 0xbeU)
+			result = bkpt_instr & 0xffU;
+	}
+	if (regs) {
+		uint32_t call_regs[t->regs_size / 4U];
+		target_regs_read(t, call_regs);
+		memcpy(regs, call_regs, 8U * sizeof(*regs));
+	}
+	target_regs_write(t, priv->call_regs);
+	priv->on_bkpt = priv->call_on_bkpt;
+	return result;
+}
+
+/* Returns CORTEXM_CALL_RUNNING until the routine exits, then its result as cortexm_run_stub() does */
+int cortexm_call_poll(target *t, uint32_t *regs)
+{
+	const struct cortexm_priv *priv = t->priv;
+	if (!priv->call_running)
+		return -1;
+	const enum target_halt_reason reason = cortexm_halt_poll(t, NULL);
+	if (reason == TARGET_HALT_RUNNING)
+		return CORTEXM_CALL_RUNNING;
+	return cortexm_call_finish(t, reason, regs);
+}
+
+int cortexm_call_wait(target *t, uint32_t timeout_ms, uint32_t *regs)
+{
+	platform_timeout timeout;
+	platform_timeout_set(&timeout, timeout_ms);
+	platform_backoff backoff;
+	platform_backoff_init(&backoff, 500U);
+	int result;
+	while ((result = cortexm_call_poll(t, regs)) == CORTEXM_CALL_RUNNING) {
+		platform_backoff_wait(&backoff);
+		if (platform_timeout_is_expired(&timeout)) {
+			DEBUG_WARN("Stub hangs\n");
+			cortexm_halt_request(t);
+			enum target_halt_reason reason;
+			platform_timeout_set(&timeout, 100U);
+			while ((reason = cortexm_halt_poll(t, NULL)) == TARGET_HALT_RUNNING &&
+				!platform_timeout_is_expired(&timeout))
+				continue;
+			cortexm_call_finish(t, reason, NULL);
+			return -3;
+		}
+	}
+	return result;
+}
+
+int cortexm_call(target *t, uint32_t r0, uint32_t r1, uint32_t r2, uint32_t r3)
+{
+	if (!cortexm_call_start(t, r0, r1, r2, r3))
+		return -1;
+	return cortexm_call_wait(t, CORTEXM_CALL_TIMEOUT, NULL);
+}
+
+/*
+ * Loads a flash's RAM loader into the first RAM region with room for it and two
+ * writesize buffers after it, or failing that one. This happens once per flash
+ * session, flash_done() forgets the load. Returns false if there's no usable RAM
+ * region, in which case the driver has to program the flash by itself.
+ */
+bool cortexm_flash_stub_load(target_flash_s *f)
+{
+	if (f->stub_addr)
+		return true;
+	target *t = f->t;
+	const size_t code_size = ALIGN(f->stub->code_size, 4U);
+	for (uint8_t buffers = 2U; buffers; --buffers) {
+		for (struct target_ram *r = t->ram; r; r = r->next) {
+			const target_addr_t start = ALIGN(r->start, 4U);
+			if (!start || r->length < code_size + buffers * f->writesize + (start - r->start))
+				continue;
+			if (target_mem_write(t, start, f->stub->code, f->stub->code_size))
+				return false;
+			f->stub_addr = start;
+			f->stub_buffers = buffers;
+			f->stub_buffer = 0;
+			f->stub_running = false;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Wait for the loader to finish the last buffer handed to it, returning whether that worked */
+bool cortexm_flash_stub_wait(target_flash_s *f)
+{
+	if (!f->stub_running)
+		return true;
+	f->stub_running = false;
+	const int result = cortexm_stub_wait(f->t);
+	if (result)
+		DEBUG_WARN("Flash stub failed (%d) around address 0x%08" PRIx32 "\n", result, f->stub_dest);
+	return result == 0;
+}
+
+/*
+ * Programs up to writesize bytes through the flash's RAM loader, so the whole
+ * programming loop and its status polling happen on the target rather than
+ * costing debug link round trips. param is handed to the loader in r3.
+ *
+ * When there's room for two buffers they are used ping-pong: this write's data
+ * streams into one while the loader is still programming the other, and the
+ * loader is left running on it when this returns. Its result is collected by
+ * the next write or by cortexm_flash_stub_wait(), which flash_done() calls.
+ */
+bool cortexm_flash_stub_write(target_flash_s *f, target_addr_t dest, const void *src, size_t len, uint32_t param)
+{
+	if (len > f->writesize || !cortexm_flash_stub_load(f))
+		return false;
+	target *t = f->t;
+	const target_addr_t buffer =
+		f->stub_addr + ALIGN(f->stub->code_size, 4U) + f->stub_buffer * f->writesize;
+	const bool written = !target_mem_write(t, buffer, src, len);
+	/* Always collect the previous buffer's result, the core has to be halted to go on */
+	if (!cortexm_flash_stub_wait(f) || !written)
+		return false;
+	if (!cortexm_stub_start(t, f->stub_addr, dest, buffer, len, param))
+		return false;
+	f->stub_running = true;
+	f->stub_dest = dest;
+	if (f->stub_buffers == 1U)
+		return cortexm_flash_stub_wait(f);
+	f->stub_buffer ^= 1U;
+	return true;
+}
+
+/*
+ * Computes the CRC32 of a region by running a small stub from target RAM, so only the
+ * result has to come back over the wire. It runs as a target call, so a run of these
+ * uploads the stub once and the program's RAM and registers are untouched after.
+ * Returns false if there's no usable RAM or the stub fails, the caller then falls back
+ * to reading the region back.
+ */
+static const cortexm_call_code_s cortexm_crc32_call = {
+	.code = cortexm_crc32_stub,
+	.code_size = sizeof(cortexm_crc32_stub),
+	.arena_size = 4U, /* The CRC word */
+};
+
+static bool cortexm_mem_crc32(target *t, uint32_t *crc, target_addr_t base, size_t len)
+{
+	const target_addr_t crc_addr = cortexm_call_load(t, &cortexm_crc32_call, base, len);
+	if (!crc_addr)
+		return false;
+
+	const uint32_t crc_init = 0xffffffffU;
+	cortexm_call_mem_write(t, crc_addr, &crc_init, sizeof(crc_init));
+	bool result = !target_check_error(t);
+	while (result && len) {
+		const size_t chunk = MIN(len, CORTEXM_CRC32_CHUNK_SIZE);
+		if (cortexm_call(t, base, chunk, crc_addr, 0) != 0) {
+			DEBUG_WARN("CRC stub failed around address 0x%08" PRIx32 "\n", base);
+			result = false;
+		}
+		base += chunk;
+		len -= chunk;
+	}
+	if (result)
+		cortexm_call_mem_read(t, crc, crc_addr, sizeof(*crc));
+	return result && !target_check_error(t);
+}
+
+/*
+ * Runs the memory fill/test stub over a region as a target call from RAM outside it,
+ * in chunks that keep each run inside the call timeout. Returns true if the whole
+ * region was done, *failed is then set if the test found a mismatch, which is
+ * reported via tc_printf.
+ */
+static const cortexm_call_code_s cortexm_memtest_call = {
+	.code = cortexm_memtest_stub,
+	.code_size = sizeof(cortexm_memtest_stub),
+	.arena_size = 0U,
+};
+
+static bool cortexm_mem_pattern(
+	target *t, target_addr_t base, size_t len, uint32_t pattern, uint32_t mode, bool *failed)
+{
+	if (!(target_mem_read32(t, CORTEXM_DHCSR) & CORTEXM_DHCSR_S_HALT)) {
+		tc_printf(t, "Target must be halted\n");
+		return false;
+	}
+	if (!cortexm_call_load(t, &cortexm_memtest_call, base, len)) {
+		tc_printf(t, "No RAM outside the region to run from\n");
+		return false;
+	}
+
+	bool result = true;
+	const size_t chunk_size =
+		mode == CORTEXM_MEMTEST_MODE_FILL ? CORTEXM_MEMFILL_CHUNK_SIZE : CORTEXM_MEMTEST_CHUNK_SIZE;
+	*failed = false;
+	while (result && len) {
+		const size_t chunk = MIN(len, chunk_size);
+		uint32_t regs[8];
+		const int status = cortexm_call_start(t, base, chunk, pattern, mode) ?
+			cortexm_call_wait(t, CORTEXM_CALL_TIMEOUT, regs) :
+			-1;
+		if (status == 1) {
+			tc_printf(t, "Mismatch at 0x%08" PRIx32 ": read 0x%08" PRIx32 ", expected 0x%08" PRIx32 "\n", regs[0],
+				regs[4], regs[7]);
+			*failed = true;
+			break;
+		}
+		if (status != 0) {
+			tc_printf(t, "Memory stub failed (%d) around address 0x%08" PRIx32 "\n", status, base);
+			result = false;
+		}
+		base += chunk;
+		len -= chunk;
+	}
+	return result && !target_check_error(t);
+}
+
+static bool cortexm_mem_pattern_args(target *t, int argc, const char **argv, target_addr_t *addr, size_t *len)
+{
+	if (argc < 3)
+		return false;
+	*addr = strtoul(argv[1], NULL, 0);
+	*len = strtoul(argv[2], NULL, 0);
+	if ((*addr | *len) & 3U || !*len) {
+		tc_printf(t, "Address and length must be non-zero multiples of 4\n");
+		return false;
+	}
+	return true;
+}
+
+static bool cortexm_mem_fill(target *t, int argc, const char **argv)
+{
+	target_addr_t addr;
+	size_t len;
+	if (argc < 4) {
+		tc_printf(t, "usage: monitor mem_fill <addr> <len> <pattern>\n");
+		return false;
+	}
+	if (!cortexm_mem_pattern_args(t, argc, argv, &addr, &len))
+		return false;
+	const uint32_t pattern = strtoul(argv[3], NULL, 0);
+	const uint32_t start_time = platform_time_ms();
+	bool failed;
+	if (!cortexm_mem_pattern(t, addr, len, pattern, CORTEXM_MEMTEST_MODE_FILL, &failed))
+		return false;
+	tc_printf(t, "Filled %zu bytes in %" PRIu32 "ms\n", len, platform_time_ms() - start_time);
+	return true;
+}
+
+/*
+ * Writes every word with its address XORed with the seed, checks it, then repeats
+ * with the inverted pattern. This destroys the region's contents.
+ */
+static bool cortexm_mem_test(target *t, int argc, const char **argv)
+{
+	target_addr_t addr;
+	size_t len;
+	if (argc < 3) {
+		tc_printf(t, "usage: monitor mem_test <addr> <len> [seed]\n");
+		return false;
+	}
+	if (!cortexm_mem_pattern_args(t, argc, argv, &addr, &len))
+		return false;
+	const uint32_t seed = argc > 3 ? strtoul(argv[3], NULL, 0) : 0U;
+	const uint32_t start_time = platform_time_ms();
+	bool failed;
+	if (!cortexm_mem_pattern(t, addr, len, seed, CORTEXM_MEMTEST_MODE_TEST, &failed))
+		return false;
+	if (failed)
+		return false;
+	tc_printf(t, "Tested %zu bytes OK in %" PRIu32 "ms\n", len, platform_time_ms() - start_time);
+	return true;
+}
+
+/*
+ * Statistical profiling by sampling DWT_PCSR, which holds the address of a recently
+ * executed instruction and can be read through the AP without halting the core.
+ * The samples are taken by a scheduler task while GDB waits on the running target
+ * and are counted per address in an open addressed table, so only the summary
+ * has to leave the probe. ARMv6-M has no PCSR.
+ */
+#if PC_HOSTED == 1
+#define CORTEXM_PROFILE_SLOTS 65536U
+#define CORTEXM_PROFILE_BURST 8U
+#else
+#define CORTEXM_PROFILE_SLOTS 512U
+#define CORTEXM_PROFILE_BURST 32U
+#endif
+#define CORTEXM_PROFILE_PROBES 16U
+#define CORTEXM_PROFILE_TOP    10U
 
-	if (step)
-		dhcsr |= CORTEXM_DHCSR_C_STEP | CORTEXM_DHCSR_C_MASKINTS;
+typedef struct cortexm_profile_slot {
+	uint32_t pc;
+	uint32_t hits;
+} cortexm_profile_slot_s;
 
-	/* Disable interrupts while single stepping... */
-	if (step != priv->stepping) {
-		target_mem_write32(t, CORTEXM_DHCSR, dhcsr | CORTEXM_DHCSR_C_HALT);
-		priv->stepping = step;
+static struct {
+	target *t;
+	void *priv;
+	bool running;
+	uint32_t interval_us;
+	cortexm_profile_slot_s *slots;
+	uint32_t samples;
+	uint32_t distinct;
+	uint32_t lost;
+	uint32_t idle; /* core halted or sleeping, PCSR reads all ones */
+	uint64_t elapsed_us;
+	uint32_t start_us;
+} cortexm_profile;
+
+static void cortexm_profile_count(const uint32_t pc)
+{
+	uint32_t index = ((pc >> 1U) * 2654435761U) % CORTEXM_PROFILE_SLOTS;
+	for (size_t i = 0; i < CORTEXM_PROFILE_PROBES; ++i) {
+		cortexm_profile_slot_s *const slot = &cortexm_profile.slots[index];
+		if (!slot->hits) {
+			slot->pc = pc;
+			++cortexm_profile.distinct;
+		}
+		if (slot->pc == pc) {
+			++slot->hits;
+			++cortexm_profile.samples;
+			return;
+		}
+		index = (index + 1U) % CORTEXM_PROFILE_SLOTS;
 	}
+	/* the neighbourhood is full of other addresses */
+	++cortexm_profile.lost;
+}
 
-	if (priv->on_bkpt) {
-		uint32_t pc = cortexm_pc_read(t);
-		if ((target_mem_read16(t, pc) & 0xff00U) == 0xbe00U)
-			cortexm_pc_write(t, pc + 2);
+static uint32_t cortexm_profile_task(void)
+{
+	target *const t = cortexm_profile.t;
+	for (size_t i = 0; i < CORTEXM_PROFILE_BURST; ++i) {
+		const uint32_t pc = target_mem_read32(t, CORTEXM_DWT_PCSR);
+		if (pc == 0xffffffffU || pc == 0)
+			++cortexm_profile.idle;
+		else
+			cortexm_profile_count(pc & ~1U);
 	}
+	return cortexm_profile.interval_us;
+}
 
-	if (priv->has_cache)
-		target_mem_write32(t, CORTEXM_ICIALLU, 0);
+static void cortexm_profile_stop(void)
+{
+	if (!cortexm_profile.running)
+		return;
+	scheduler_remove(cortexm_profile_task);
+	cortexm_profile.elapsed_us += platform_time_us() - cortexm_profile.start_us;
+	cortexm_profile.running = false;
+}
 
-	target_mem_write32(t, CORTEXM_DHCSR, dhcsr);
+static void cortexm_profile_free(void)
+{
+	cortexm_profile_stop();
+	free(cortexm_profile.slots);
+	memset(&cortexm_profile, 0, sizeof(cortexm_profile));
 }
 
-static int cortexm_fault_unwind(target *t)
+/* the target being freed can't be sampled any more */
+static void cortexm_profile_release(const void *const priv)
 {
-	uint32_t hfsr = target_mem_read32(t, CORTEXM_HFSR);
-	uint32_t cfsr = target_mem_read32(t, CORTEXM_CFSR);
-	target_mem_write32(t, CORTEXM_HFSR, hfsr); /* write back to reset */
-	target_mem_write32(t, CORTEXM_CFSR, cfsr); /* write back to reset */
-	/* We check for FORCED in the HardFault Status Register or
-	 * for a configurable fault to avoid catching core resets */
-	if ((hfsr & CORTEXM_HFSR_FORCED) || cfsr) {
-		/* Unwind exception */
-		uint32_t regs[t->regs_size / 4];
-		uint32_t stack[8];
-		uint32_t retcode, framesize;
-		/* Read registers for post-exception stack pointer */
-		target_regs_read(t, regs);
-		/* save retcode currently in lr */
-		retcode = regs[REG_LR];
-		bool spsel = retcode & (1U << 2U);
-		bool fpca = !(retcode & (1U << 4U));
-		/* Read stack for pre-exception registers */
-		uint32_t sp = spsel ? regs[REG_PSP] : regs[REG_MSP];
-		target_mem_read(t, stack, sp, sizeof(stack));
-		if (target_check_error(t))
-			return 0;
-		regs[REG_LR] = stack[5]; /* restore LR to pre-exception state */
-		regs[REG_PC] = stack[6]; /* restore PC to pre-exception state */
-
-		/* adjust stack to pop exception state */
-		framesize = fpca ? 0x68U : 0x20U; /* check for basic vs. extended frame */
-		if (stack[7] & (1U << 9U))        /* check for stack alignment fixup */
-			framesize += 4U;
-
-		if (spsel) {
-			regs[REG_SPECIAL] |= 0x4000000U;
-			regs[REG_SP] = regs[REG_PSP] += framesize;
-		} else {
-			regs[REG_SP] = regs[REG_MSP] += framesize;
-		}
+	if (cortexm_profile.slots && cortexm_profile.priv == priv)
+		cortexm_profile_free();
+}
 
-		if (fpca)
-			regs[REG_SPECIAL] |= 0x2000000U;
+static uint64_t cortexm_profile_elapsed_us(void)
+{
+	if (cortexm_profile.running)
+		return cortexm_profile.elapsed_us + (platform_time_us() - cortexm_profile.start_us);
+	return cortexm_profile.elapsed_us;
+}
 
-		/* FIXME: stack[7] contains xPSR when this is supported */
-		/* although, if we caught the exception it will be unchanged */
+static void cortexm_profile_summary(target *const t)
+{
+	const uint64_t elapsed_us = cortexm_profile_elapsed_us();
+	const uint32_t total = cortexm_profile.samples + cortexm_profile.idle + cortexm_profile.lost;
+	tc_printf(t, "%s, %" PRIu32 " samples in %" PRIu32 "ms (%" PRIu32 "/s)\n",
+		cortexm_profile.running ? "Running" : "Stopped", total, (uint32_t)(elapsed_us / 1000U),
+		elapsed_us ? (uint32_t)(total * 1000000ULL / elapsed_us) : 0U);
+	tc_printf(t, "%" PRIu32 " addresses, %" PRIu32 " samples halted or asleep, %" PRIu32 " not counted (table full)\n",
+		cortexm_profile.distinct, cortexm_profile.idle, cortexm_profile.lost);
+
+	/* pick the busiest addresses, each pass finding the next one down */
+	uint32_t last_hits = UINT32_MAX;
+	uint32_t last_pc = 0;
+	for (size_t n = 0; n < CORTEXM_PROFILE_TOP; ++n) {
+		const cortexm_profile_slot_s *best = NULL;
+		for (size_t i = 0; i < CORTEXM_PROFILE_SLOTS; ++i) {
+			const cortexm_profile_slot_s *const slot = &cortexm_profile.slots[i];
+			if (!slot->hits || slot->hits > last_hits || (slot->hits == last_hits && slot->pc <= last_pc))
+				continue;
+			if (!best || slot->hits > best->hits || (slot->hits == best->hits && slot->pc < best->pc))
+				best = slot;
+		}
+		if (!best)
+			break;
+		tc_printf(t, "  0x%08" PRIx32 " %8" PRIu32 " %3" PRIu32 "%%\n", best->pc, best->hits,
+			(uint32_t)(best->hits * 100ULL / cortexm_profile.samples));
+		last_hits = best->hits;
+		last_pc = best->pc;
+	}
+}
 
-		/* Reset exception state to allow resuming from restored
-		 * state.
-		 */
-		target_mem_write32(t, CORTEXM_AIRCR, CORTEXM_AIRCR_VECTKEY | CORTEXM_AIRCR_VECTCLRACTIVE);
+#if PC_HOSTED == 1
+static void cortexm_profile_write32(FILE *const file, const uint32_t value)
+{
+	const uint8_t bytes[4] = {value & 0xffU, (value >> 8U) & 0xffU, (value >> 16U) & 0xffU, value >> 24U};
+	fwrite(bytes, 1, sizeof(bytes), file);
+}
 
-		/* Write pre-exception registers back to core */
-		target_regs_write(t, regs);
+/*
+ * Write the histogram as a gprof gmon.out holding a single time histogram record,
+ * so `gprof -b firmware.elf <file>` gives the flat profile of the sampled code.
+ */
+static bool cortexm_profile_write_gmon(target *const t, const char *const name)
+{
+	uint32_t low = UINT32_MAX;
+	uint32_t high = 0;
+	for (size_t i = 0; i < CORTEXM_PROFILE_SLOTS; ++i) {
+		if (!cortexm_profile.slots[i].hits)
+			continue;
+		low = MIN(low, cortexm_profile.slots[i].pc);
+		high = MAX(high, cortexm_profile.slots[i].pc);
+	}
+	if (low > high) {
+		tc_printf(t, "No samples to write\n");
+		return false;
+	}
+	/* one bin per halfword, coarser if the samples are spread over a lot of memory */
+	uint32_t bin_size = 2;
+	while ((high - low) / bin_size >= 1048576U)
+		bin_size <<= 1U;
+	high += bin_size;
+	const uint32_t bins = (high - low) / bin_size;
+	uint16_t *const hist = calloc(bins, sizeof(*hist));
+	if (!hist) {
+		DEBUG_WARN("calloc: failed in %s\n", __func__);
+		return false;
+	}
+	for (size_t i = 0; i < CORTEXM_PROFILE_SLOTS; ++i) {
+		const cortexm_profile_slot_s *const slot = &cortexm_profile.slots[i];
+		if (!slot->hits)
+			continue;
+		uint16_t *const bin = &hist[(slot->pc - low) / bin_size];
+		*bin = MIN((uint32_t)*bin + slot->hits, (uint32_t)UINT16_MAX);
+	}
 
-		return 1;
+	FILE *const file = fopen(name, "wb");
+	if (!file) {
+		tc_printf(t, "Can not open %s\n", name);
+		free(hist);
+		return false;
 	}
-	return 0;
+	const uint64_t elapsed_us = cortexm_profile_elapsed_us();
+	const uint32_t rate = elapsed_us ? (uint32_t)((cortexm_profile.samples + cortexm_profile.idle) * 1000000ULL / elapsed_us) : 1U;
+	static const char header[16] = {'g', 'm', 'o', 'n', 1};
+	static const char dimen[15] = "seconds";
+	fwrite(header, 1, sizeof(header), file);
+	fputc(0, file); /* GMON_TAG_TIME_HIST */
+	cortexm_profile_write32(file, low);
+	cortexm_profile_write32(file, high);
+	cortexm_profile_write32(file, bins);
+	cortexm_profile_write32(file, MAX(rate, 1U));
+	fwrite(dimen, 1, sizeof(dimen), file);
+	fputc('s', file);
+	for (size_t i = 0; i < bins; ++i) {
+		const uint8_t bytes[2] = {hist[i] & 0xffU, hist[i] >> 8U};
+		fwrite(bytes, 1, sizeof(bytes), file);
+	}
+	const bool ok = !ferror(file);
+	fclose(file);
+	free(hist);
+	tc_printf(t, "Wrote %" PRIu32 " bins of %" PRIu32 " bytes from 0x%08" PRIx32 " to %s\n", bins, bin_size, low, name);
+	return ok;
 }
+#endif
 
-int cortexm_run_stub(target *t, uint32_t loadaddr, uint32_t r0, uint32_t r1, uint32_t r2, uint32_t r3)
+static bool cortexm_profile_cmd(target *t, int argc, const char **argv)
 {
-	uint32_t regs[t->regs_size / 4U];
-
-	memset(regs, 0, sizeof(regs));
-	regs[0] = r0;
-	regs[1] = r1;
-	regs[2] = r2;
-	regs[3] = r3;
-	regs[15] = loadaddr;
-	regs[REG_XPSR] = CORTEXM_XPSR_THUMB;
-	regs[19] = 0;
-
-	cortexm_regs_write(t, regs);
+	if (argc > 1 && !strcmp(argv[1], "start")) {
+		if (t->target_options & TOPT_FLAVOUR_V6M) {
+			tc_printf(t, "ARMv6-M has no PC sampling register\n");
+			return false;
+		}
+		if (cortexm_profile.t != t)
+			cortexm_profile_free();
+		if (!cortexm_profile.slots) {
+			cortexm_profile.slots = calloc(CORTEXM_PROFILE_SLOTS, sizeof(*cortexm_profile.slots));
+			if (!cortexm_profile.slots) {
+				DEBUG_WARN("calloc: failed in %s\n", __func__);
+				return false;
+			}
+		}
+		cortexm_profile.t = t;
+		cortexm_profile.priv = t->priv;
+		cortexm_profile.interval_us = argc > 2 ? strtoul(argv[2], NULL, 0) : 0U;
+		if (!cortexm_profile.running) {
+			cortexm_profile.start_us = platform_time_us();
+			cortexm_profile.running = true;
+			scheduler_add(cortexm_profile_task);
+		}
+		tc_printf(t, "Sampling the PC while the target runs\n");
+		return true;
+	}
+	if (!cortexm_profile.slots || cortexm_profile.t != t) {
+		tc_printf(t, "usage: monitor profile start [interval_us]|stop [file]|status|reset\n");
+		return argc < 2;
+	}
+	if (argc > 1 && !strcmp(argv[1], "reset")) {
+		cortexm_profile_free();
+		return true;
+	}
+	if (argc > 1 && !strcmp(argv[1], "stop")) {
+		cortexm_profile_stop();
+		cortexm_profile_summary(t);
+#if PC_HOSTED == 1
+		if (argc > 2)
+			return cortexm_profile_write_gmon(t, argv[2]);
+#endif
+		return true;
+	}
+	cortexm_profile_summary(t);
+	return true;
+}
 
-	if (target_check_error(t))
-		return -1;
+/*
+ * Time a code region in core clock cycles: run to a hardware breakpoint on start,
+ * read CYCCNT, run to one on end and read it again. CYCCNT doesn't count while
+ * the core is halted, so the halts don't show up in the result, but interrupts
+ * taken inside the region do, which is what the maximum is there to show.
+ */
+#define CORTEXM_CYCLES_ITERATIONS 10U
+#define CORTEXM_CYCLES_TIMEOUT    2000U
 
-	/* Execute the stub */
-	enum target_halt_reason reason;
-#if defined(PLATFORM_HAS_DEBUG)
-	uint32_t arm_regs_start[t->regs_size];
-	target_regs_read(t, arm_regs_start);
-#endif
-	cortexm_halt_resume(t, 0);
+static bool cortexm_cycles_run_to(target *const t, const target_addr_t addr, const uint32_t timeout_ms)
+{
+	if (target_breakwatch_set(t, TARGET_BREAK_HARD, addr, 2) != 0) {
+		tc_printf(t, "Can not set a breakpoint at 0x%08" PRIx32 "\n", addr);
+		return false;
+	}
+	target_halt_resume(t, false);
 	platform_timeout timeout;
-	platform_timeout_set(&timeout, 5000);
-	do {
+	platform_timeout_set(&timeout, timeout_ms);
+	target_addr_t watch;
+	enum target_halt_reason reason;
+	while ((reason = target_halt_poll(t, &watch)) == TARGET_HALT_RUNNING) {
 		if (platform_timeout_is_expired(&timeout)) {
-			cortexm_halt_request(t);
-#if defined(PLATFORM_HAS_DEBUG)
-			DEBUG_WARN("Stub hangs\n");
-			uint32_t arm_regs[t->regs_size];
-			target_regs_read(t, arm_regs);
-			for (size_t i = 0; i < 20; i++) {
-				DEBUG_WARN("%2d: %08" PRIx32 ", %08" PRIx32 "\n", i, arm_regs_start[i], arm_regs[i]);
-			}
-#endif
-			return -3;
+			target_halt_request(t);
+			while ((reason = target_halt_poll(t, &watch)) == TARGET_HALT_RUNNING)
+				continue;
+			reason = TARGET_HALT_REQUEST;
+			break;
 		}
-	} while ((reason = cortexm_halt_poll(t, NULL)) == TARGET_HALT_RUNNING);
+	}
+	target_breakwatch_clear(t, TARGET_BREAK_HARD, addr, 2);
+	if (reason != TARGET_HALT_BREAKPOINT || cortexm_pc_read(t) != addr) {
+		tc_printf(t, "Target stopped at 0x%08" PRIx32 " before reaching 0x%08" PRIx32 "\n", cortexm_pc_read(t), addr);
+		return false;
+	}
+	return true;
+}
 
-	if (reason == TARGET_HALT_ERROR)
-		raise_exception(EXCEPTION_ERROR, "Target lost in stub");
+static bool cortexm_cycles(target *t, int argc, const char **argv)
+{
+	if (argc < 3) {
+		tc_printf(t, "usage: monitor cycles <start> <end> [iterations] [timeout_ms]\n");
+		return false;
+	}
+	if (t->target_options & TOPT_FLAVOUR_V6M) {
+		tc_printf(t, "ARMv6-M has no cycle counter\n");
+		return false;
+	}
+	const target_addr_t start = strtoul(argv[1], NULL, 0) & ~1U;
+	const target_addr_t end = strtoul(argv[2], NULL, 0) & ~1U;
+	const uint32_t iterations = argc > 3 ? strtoul(argv[3], NULL, 0) : CORTEXM_CYCLES_ITERATIONS;
+	const uint32_t timeout_ms = argc > 4 ? strtoul(argv[4], NULL, 0) : CORTEXM_CYCLES_TIMEOUT;
+	if (start == end || !iterations) {
+		tc_printf(t, "Start and end must differ and iterations can't be 0\n");
+		return false;
+	}
 
-	if (reason != TARGET_HALT_BREAKPOINT) {
-		DEBUG_WARN(" Reasone %d\n", reason);
-		return -2;
+	const uint32_t dwt_ctrl = target_mem_read32(t, CORTEXM_DWT_CTRL);
+	if (dwt_ctrl & CORTEXM_DWT_CTRL_NOCYCCNT) {
+		tc_printf(t, "This core has no cycle counter\n");
+		return false;
 	}
-	uint32_t pc = cortexm_pc_read(t);
-	uint16_t bkpt_instr = target_mem_read16(t, pc);
-	if (bkpt_instr >> 8U != 0xbeU)
-		return -2;
+	target_mem_write32(t, CORTEXM_DWT_CTRL, dwt_ctrl | CORTEXM_DWT_CTRL_CYCCNTENA);
+
+	uint32_t min = UINT32_MAX;
+	uint32_t max = 0;
+	uint64_t total = 0;
+	uint32_t done = 0;
+	for (; done < iterations; ++done) {
+		if (!cortexm_cycles_run_to(t, start, timeout_ms))
+			break;
+		const uint32_t begin = target_mem_read32(t, CORTEXM_DWT_CYCCNT);
+		if (!cortexm_cycles_run_to(t, end, timeout_ms))
+			break;
+		/* the unsigned difference is right across a single wrap */
+		const uint32_t cycles = target_mem_read32(t, CORTEXM_DWT_CYCCNT) - begin;
+		min = MIN(min, cycles);
+		max = MAX(max, cycles);
+		total += cycles;
+	}
+	if (!(dwt_ctrl & CORTEXM_DWT_CTRL_CYCCNTENA))
+		target_mem_write32(t, CORTEXM_DWT_CTRL, dwt_ctrl);
 
-	return bkpt_instr & 0xffU;
+	if (!done)
+		return false;
+	tc_printf(t, "%" PRIu32 " runs of 0x%08" PRIx32 "..0x%08" PRIx32 ": min %" PRIu32 " avg %" PRIu32 " max %" PRIu32
+				 " cycles\n",
+		done, start, end, min, (uint32_t)(total / done), max);
+	tc_printf(t, "Target left halted at 0x%08" PRIx32 "\n", cortexm_pc_read(t));
+	return done == iterations;
 }
 
-/* The following routines implement hardware breakpoints and watchpoints.
+/* DEMCR.TRCENA, which powers the ETM, is already set by attach */
+static bool cortexm_etb(target *t, int argc, const char **argv)
+{
+	return coresight_trace_cmd(t, cortexm_ap(t), argc, argv);
+}
+
+/* The following routines implement breakpoints and watchpoints.
  * The Flash Patch and Breakpoint (FPB) and Data Watch and Trace (DWT)
- * systems are used. */
+ * systems are used, and BKPT instructions for software breakpoints in RAM. */
 
 static uint32_t dwt_mask(size_t len)
 {
@@ -1276,6 +2427,92 @@ static uint32_t dwt_func(target *t, enum target_breakwatch type)
 	}
 }
 
+static bool cortexm_addr_in_ram(target *t, target_addr_t addr, size_t len)
+{
+	for (struct target_ram *r = t->ram; r; r = r->next)
+		if (addr >= r->start && addr - r->start + len <= r->length)
+			return true;
+	return false;
+}
+
+static bool cortexm_sw_breakpoint_at(target *t, uint32_t addr)
+{
+	const struct cortexm_priv *priv = t->priv;
+	for (size_t i = 0; i < CORTEXM_MAX_SW_BREAKPOINTS; i++)
+		if (priv->sw_breakpoint[i].state == SW_BREAKPOINT_SET && priv->sw_breakpoint[i].addr == addr)
+			return true;
+	return false;
+}
+
+/* Software breakpoints replace the first halfword of the instruction with a BKPT, so are RAM only */
+static int cortexm_sw_breakpoint_set(target *t, struct breakwatch *bw)
+{
+	struct cortexm_priv *priv = t->priv;
+	if (bw->size < 2 || bw->size > 4 || (bw->addr & 1U) || !cortexm_addr_in_ram(t, bw->addr, 2))
+		return -1;
+
+	size_t i;
+	/* Cleared and set again before the core ran, the BKPT is simply left in place */
+	for (i = 0; i < CORTEXM_MAX_SW_BREAKPOINTS; i++) {
+		if (priv->sw_breakpoint[i].state == SW_BREAKPOINT_REMOVE && priv->sw_breakpoint[i].addr == bw->addr) {
+			priv->sw_breakpoint[i].state = SW_BREAKPOINT_SET;
+			bw->reserved[0] = i;
+			return 0;
+		}
+	}
+	for (i = 0; i < CORTEXM_MAX_SW_BREAKPOINTS; i++)
+		if (priv->sw_breakpoint[i].state == SW_BREAKPOINT_FREE)
+			break;
+	if (i == CORTEXM_MAX_SW_BREAKPOINTS)
+		return -1;
+
+	priv->sw_breakpoint[i].addr = bw->addr;
+	priv->sw_breakpoint[i].state = SW_BREAKPOINT_INSERT;
+	bw->reserved[0] = i;
+	return 0;
+}
+
+/*
+ * GDB takes every breakpoint out when the core stops and puts them back before it
+ * resumes, not necessarily in the same order. A free comparator that still holds
+ * the same setting is picked first, so a breakpoint put back costs no write.
+ */
+static size_t cortexm_hw_breakpoint_slot(const struct cortexm_priv *priv, const uint32_t comp)
+{
+	size_t slot = priv->hw_breakpoint_max;
+	for (size_t i = 0; i < priv->hw_breakpoint_max; i++) {
+		if (priv->hw_breakpoint[i])
+			continue;
+		if ((priv->hw_breakpoint_known & (1U << i)) && priv->hw_breakpoint_written[i] == comp)
+			return i;
+		if (slot == priv->hw_breakpoint_max)
+			slot = i;
+	}
+	return slot;
+}
+
+static size_t cortexm_hw_watchpoint_slot(
+	const struct cortexm_priv *priv, const uint32_t comp, const uint32_t mask, const uint32_t func)
+{
+	size_t slot = priv->hw_watchpoint_max;
+	for (size_t i = 0; i < priv->hw_watchpoint_max; i++) {
+		if (priv->hw_watchpoint[i])
+			continue;
+		if ((priv->hw_watchpoint_known & (1U << i)) && priv->hw_watchpoint_written_comp[i] == comp &&
+			priv->hw_watchpoint_written_mask[i] == mask && priv->hw_watchpoint_written_func[i] == func)
+			return i;
+		if (slot == priv->hw_watchpoint_max)
+			slot = i;
+	}
+	return slot;
+}
+
+/*
+ * Setting and clearing break/watchpoints only updates priv, the FPB, DWT and
+ * RAM are brought in line by cortexm_breakwatch_flush() when the core resumes.
+ * GDB sends a Z packet per breakpoint on every continue, so this turns a
+ * round trip per packet into a single batch.
+ */
 static int cortexm_breakwatch_set(target *t, struct breakwatch *bw)
 {
 	struct cortexm_priv *priv = t->priv;
@@ -1283,6 +2520,9 @@ static int cortexm_breakwatch_set(target *t, struct breakwatch *bw)
 	uint32_t val = bw->addr;
 
 	switch (bw->type) {
+	case TARGET_BREAK_SOFT:
+		return cortexm_sw_breakpoint_set(t, bw);
+
 	case TARGET_BREAK_HARD:
 		if (priv->flash_patch_revision == 0) {
 			val &= 0x1ffffffcU;
@@ -1290,36 +2530,34 @@ static int cortexm_breakwatch_set(target *t, struct breakwatch *bw)
 		}
 		val |= 1U;
 
-		for (i = 0; i < priv->hw_breakpoint_max; i++)
-			if (!priv->hw_breakpoint[i])
-				break;
-
+		i = cortexm_hw_breakpoint_slot(priv, val);
 		if (i == priv->hw_breakpoint_max)
 			return -1;
 
 		priv->hw_breakpoint[i] = true;
-		target_mem_write32(t, CORTEXM_FPB_COMP(i), val);
+		priv->hw_breakpoint_comp[i] = val;
+		priv->hw_breakpoint_dirty |= 1U << i;
 		bw->reserved[0] = i;
 		return 0;
 
 	case TARGET_WATCH_WRITE:
 	case TARGET_WATCH_READ:
-	case TARGET_WATCH_ACCESS:
-		for (i = 0; i < priv->hw_watchpoint_max; i++)
-			if (!priv->hw_watchpoint[i])
-				break;
-
+	case TARGET_WATCH_ACCESS: {
+		const uint32_t mask = dwt_mask(bw->size);
+		const uint32_t func = dwt_func(t, bw->type);
+		i = cortexm_hw_watchpoint_slot(priv, val, mask, func);
 		if (i == priv->hw_watchpoint_max)
 			return -1;
 
 		priv->hw_watchpoint[i] = true;
-
-		target_mem_write32(t, CORTEXM_DWT_COMP(i), val);
-		target_mem_write32(t, CORTEXM_DWT_MASK(i), dwt_mask(bw->size));
-		target_mem_write32(t, CORTEXM_DWT_FUNC(i), dwt_func(t, bw->type));
+		priv->hw_watchpoint_comp[i] = val;
+		priv->hw_watchpoint_mask[i] = mask;
+		priv->hw_watchpoint_func[i] = func;
+		priv->hw_watchpoint_dirty |= 1U << i;
 
 		bw->reserved[0] = i;
 		return 0;
+	}
 	default:
 		return 1;
 	}
@@ -1330,21 +2568,138 @@ static int cortexm_breakwatch_clear(target *t, struct breakwatch *bw)
 	struct cortexm_priv *priv = t->priv;
 	unsigned i = bw->reserved[0];
 	switch (bw->type) {
+	case TARGET_BREAK_SOFT:
+		if (priv->sw_breakpoint[i].state == SW_BREAKPOINT_SET)
+			priv->sw_breakpoint[i].state = SW_BREAKPOINT_REMOVE;
+		else
+			priv->sw_breakpoint[i].state = SW_BREAKPOINT_FREE;
+		return 0;
 	case TARGET_BREAK_HARD:
 		priv->hw_breakpoint[i] = false;
-		target_mem_write32(t, CORTEXM_FPB_COMP(i), 0);
+		priv->hw_breakpoint_comp[i] = 0;
+		priv->hw_breakpoint_dirty |= 1U << i;
 		return 0;
 	case TARGET_WATCH_WRITE:
 	case TARGET_WATCH_READ:
 	case TARGET_WATCH_ACCESS:
 		priv->hw_watchpoint[i] = false;
-		target_mem_write32(t, CORTEXM_DWT_FUNC(i), 0);
+		priv->hw_watchpoint_func[i] = 0;
+		priv->hw_watchpoint_dirty |= 1U << i;
 		return 0;
 	default:
 		return 1;
 	}
 }
 
+static void cortexm_batch_write(
+	target *t, const bool queued, const uint32_t addr, const uint32_t value, const enum align align)
+{
+	if (!queued) {
+		if (align == ALIGN_HALFWORD)
+			target_mem_write16(t, addr, value);
+		else
+			target_mem_write32(t, addr, value);
+		return;
+	}
+	ADIv5_AP_t *ap = cortexm_ap(t);
+	const uint32_t size = align == ALIGN_HALFWORD ? ADIV5_AP_CSW_SIZE_HALFWORD : ADIV5_AP_CSW_SIZE_WORD;
+	adiv5_ap_queue_write(ap, ADIV5_AP_CSW, ap->csw | size | ADIV5_AP_CSW_ADDRINC_NONE);
+	adiv5_ap_queue_write(ap, ADIV5_AP_TAR, addr);
+	/* Halfwords travel in the byte lanes of their address */
+	adiv5_ap_queue_write(ap, ADIV5_AP_DRW, value << ((addr & 2U) * 8U));
+}
+
+/* Write out the break/watchpoint changes recorded since the last flush */
+static void cortexm_breakwatch_flush(target *t)
+{
+	struct cortexm_priv *priv = t->priv;
+	ADIv5_AP_t *ap = cortexm_ap(t);
+	const bool queued = cortexm_ap_queued(ap);
+	bool pending = priv->hw_breakpoint_dirty || priv->hw_watchpoint_dirty;
+
+	/* Fetch what every new software breakpoint will replace in one batch first */
+	uint32_t saved[CORTEXM_MAX_SW_BREAKPOINTS];
+	bool inserting = false;
+	for (size_t i = 0; i < CORTEXM_MAX_SW_BREAKPOINTS; i++) {
+		const struct cortexm_sw_breakpoint *const bp = &priv->sw_breakpoint[i];
+		if (bp->state == SW_BREAKPOINT_REMOVE)
+			pending = true;
+		if (bp->state != SW_BREAKPOINT_INSERT)
+			continue;
+		inserting = true;
+		if (!queued) {
+			saved[i] = target_mem_read16(t, bp->addr);
+			continue;
+		}
+		adiv5_ap_queue_write(ap, ADIV5_AP_CSW, ap->csw | ADIV5_AP_CSW_SIZE_HALFWORD | ADIV5_AP_CSW_ADDRINC_NONE);
+		adiv5_ap_queue_write(ap, ADIV5_AP_TAR, bp->addr);
+		adiv5_ap_queue_read(ap, ADIV5_AP_DRW, &saved[i]);
+	}
+	if (!pending && !inserting)
+		return;
+	if (inserting && queued && adiv5_dp_queue_flush(ap->dp)) {
+		/* Without the original instructions none of the new BKPTs can go in */
+		DEBUG_WARN("Cortex-M software breakpoint read failed\n");
+		for (size_t i = 0; i < CORTEXM_MAX_SW_BREAKPOINTS; i++)
+			if (priv->sw_breakpoint[i].state == SW_BREAKPOINT_INSERT)
+				priv->sw_breakpoint[i].state = SW_BREAKPOINT_FREE;
+		inserting = false;
+	}
+	/* As for any memory write, a D-cache must not be holding on to the old contents */
+	for (size_t i = 0; i < CORTEXM_MAX_SW_BREAKPOINTS; i++) {
+		const struct cortexm_sw_breakpoint *const bp = &priv->sw_breakpoint[i];
+		if (bp->state == SW_BREAKPOINT_REMOVE || (inserting && bp->state == SW_BREAKPOINT_INSERT))
+			cortexm_cache_clean(t, bp->addr, 2, true);
+	}
+
+	/* Comparators are only written where they don't already hold the setting */
+	for (size_t i = 0; i < priv->hw_breakpoint_max; i++) {
+		const uint32_t bit = 1U << i;
+		if (!(priv->hw_breakpoint_dirty & bit) ||
+			((priv->hw_breakpoint_known & bit) && priv->hw_breakpoint_written[i] == priv->hw_breakpoint_comp[i]))
+			continue;
+		cortexm_batch_write(t, queued, CORTEXM_FPB_COMP(i), priv->hw_breakpoint_comp[i], ALIGN_WORD);
+		priv->hw_breakpoint_written[i] = priv->hw_breakpoint_comp[i];
+		priv->hw_breakpoint_known |= bit;
+	}
+	for (size_t i = 0; i < priv->hw_watchpoint_max; i++) {
+		const uint32_t bit = 1U << i;
+		if (!(priv->hw_watchpoint_dirty & bit))
+			continue;
+		const bool known = priv->hw_watchpoint_known & bit;
+		if (priv->hw_watchpoint[i]) {
+			if (!known || priv->hw_watchpoint_written_comp[i] != priv->hw_watchpoint_comp[i])
+				cortexm_batch_write(t, queued, CORTEXM_DWT_COMP(i), priv->hw_watchpoint_comp[i], ALIGN_WORD);
+			if (!known || priv->hw_watchpoint_written_mask[i] != priv->hw_watchpoint_mask[i])
+				cortexm_batch_write(t, queued, CORTEXM_DWT_MASK(i), priv->hw_watchpoint_mask[i], ALIGN_WORD);
+			priv->hw_watchpoint_written_comp[i] = priv->hw_watchpoint_comp[i];
+			priv->hw_watchpoint_written_mask[i] = priv->hw_watchpoint_mask[i];
+		}
+		if (!known || priv->hw_watchpoint_written_func[i] != priv->hw_watchpoint_func[i])
+			cortexm_batch_write(t, queued, CORTEXM_DWT_FUNC(i), priv->hw_watchpoint_func[i], ALIGN_WORD);
+		priv->hw_watchpoint_written_func[i] = priv->hw_watchpoint_func[i];
+		/* A slot only switched off has had its FUNC written, COMP and MASK stay as unknown as they were */
+		if (priv->hw_watchpoint[i])
+			priv->hw_watchpoint_known |= bit;
+	}
+	priv->hw_breakpoint_dirty = 0;
+	priv->hw_watchpoint_dirty = 0;
+
+	for (size_t i = 0; i < CORTEXM_MAX_SW_BREAKPOINTS; i++) {
+		struct cortexm_sw_breakpoint *const bp = &priv->sw_breakpoint[i];
+		if (bp->state == SW_BREAKPOINT_REMOVE) {
+			cortexm_batch_write(t, queued, bp->addr, bp->saved, ALIGN_HALFWORD);
+			bp->state = SW_BREAKPOINT_FREE;
+		} else if (inserting && bp->state == SW_BREAKPOINT_INSERT) {
+			bp->saved = queued ? saved[i] >> ((bp->addr & 2U) * 8U) : saved[i];
+			cortexm_batch_write(t, queued, bp->addr, 0xbe00U, ALIGN_HALFWORD);
+			bp->state = SW_BREAKPOINT_SET;
+		}
+	}
+	if (queued && adiv5_dp_queue_flush(ap->dp))
+		DEBUG_WARN("Cortex-M break/watchpoint update failed\n");
+}
+
 static target_addr_t cortexm_check_watch(target *t)
 {
 	struct cortexm_priv *priv = t->priv;
@@ -1435,6 +2790,38 @@ static void probe_mem_write(
 }
 #endif
 
+/* Semihosting console output, sent out from here instead of through GDB File-I/O */
+static void cortexm_hostio_console(target *t, const void *data, size_t len)
+{
+#if PC_HOSTED == 1
+	(void)t;
+	fwrite(data, 1, len, stderr);
+#else
+	tc_console_write(t, data, len);
+#endif
+}
+
+/*
+ * SYS_WRITE0: print the NUL terminated string at str. It is read an aligned
+ * block at a time, so a read never strays past the block the string ends in.
+ */
+static bool cortexm_hostio_write0(target *t, target_addr_t str)
+{
+	uint8_t block[32];
+	for (target_addr_t offset = str & (sizeof(block) - 1U);; offset = 0) {
+		const target_addr_t block_addr = str - offset;
+		if (target_mem_read(t, block, block_addr, sizeof(block)))
+			return false;
+		const uint8_t *const end = memchr(block + offset, '\0', sizeof(block) - offset);
+		const size_t len = (end ? (size_t)(end - block) : sizeof(block)) - offset;
+		if (len)
+			cortexm_hostio_console(t, block + offset, len);
+		if (end)
+			return true;
+		str = block_addr + sizeof(block);
+	}
+}
+
 static int cortexm_hostio_request(target *t)
 {
 	uint32_t arm_regs[t->regs_size];
@@ -1570,20 +2957,12 @@ static int cortexm_hostio_request(target *t)
 		break;
 	}
 
-	case SEMIHOSTING_SYS_WRITE0: { /* write0 */
+	case SEMIHOSTING_SYS_WRITE0: /* write0 */
 		ret = -1;
-		uint8_t ch;
-		target_addr_t str = arm_regs[1];
-		if (str == TARGET_NULL)
+		if (arm_regs[1] == TARGET_NULL || !cortexm_hostio_write0(t, arm_regs[1]))
 			break;
-		while ((ch = target_mem_read8(t, str++)) != '\0') {
-			if (target_check_error(t))
-				break;
-			fputc(ch, stderr);
-		}
 		ret = 0;
 		break;
-	}
 
 	case SEMIHOSTING_SYS_ISTTY: /* isatty */
 		ret = isatty(params[0] - 1);
@@ -1773,27 +3152,21 @@ static int cortexm_hostio_request(target *t)
 		if (ret >= 0)
 			ret = params[2] - ret;
 		break;
-	case SEMIHOSTING_SYS_WRITEC: /* writec */
-		ret = tc_write(t, STDERR_FILENO, arm_regs[1], 1);
-		break;
-	case SEMIHOSTING_SYS_WRITE0: { /* write0 */
+	case SEMIHOSTING_SYS_WRITEC: { /* writec */
 		ret = -1;
-		target_addr_t str_begin = arm_regs[1];
-		target_addr_t str_end = str_begin;
-		while (target_mem_read8(t, str_end) != 0) {
-			if (target_check_error(t))
-				break;
-			str_end++;
-		}
-		int len = str_end - str_begin;
-		if (len != 0) {
-			int rc = tc_write(t, STDERR_FILENO, str_begin, len);
-			if (rc != len)
-				break;
-		}
+		const uint8_t ch = target_mem_read8(t, arm_regs[1]);
+		if (target_check_error(t))
+			break;
+		cortexm_hostio_console(t, &ch, 1);
 		ret = 0;
 		break;
 	}
+	case SEMIHOSTING_SYS_WRITE0: /* write0 */
+		ret = -1;
+		if (!cortexm_hostio_write0(t, arm_regs[1]))
+			break;
+		ret = 0;
+		break;
 	case SEMIHOSTING_SYS_ISTTY: /* isatty */
 		ret = tc_isatty(t, params[0] - 1);
 		break;
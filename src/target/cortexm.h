@@ -34,6 +34,7 @@ extern unsigned cortexm_wait_timeout;
 #define CORTEXM_CFSR  (CORTEXM_SCS_BASE + 0xd28U)
 #define CORTEXM_HFSR  (CORTEXM_SCS_BASE + 0xd2cU)
 #define CORTEXM_DFSR  (CORTEXM_SCS_BASE + 0xd30U)
+#define CORTEXM_FPCCR (CORTEXM_SCS_BASE + 0xf34U)
 #define CORTEXM_CPACR (CORTEXM_SCS_BASE + 0xd88U)
 #define CORTEXM_DHCSR (CORTEXM_SCS_BASE + 0xdf0U)
 #define CORTEXM_DCRSR (CORTEXM_SCS_BASE + 0xdf4U)
@@ -50,6 +51,7 @@ extern unsigned cortexm_wait_timeout;
 #define CORTEXM_ICIALLU  (CORTEXM_SCS_BASE + 0xf50U)
 #define CORTEXM_DCCMVAC  (CORTEXM_SCS_BASE + 0xf68U)
 #define CORTEXM_DCCIMVAC (CORTEXM_SCS_BASE + 0xf70U)
+#define CORTEXM_DCCISW   (CORTEXM_SCS_BASE + 0xf74U)
 
 #define CORTEXM_FPB_BASE (CORTEXM_PPB_BASE + 0x2000U)
 
@@ -61,6 +63,8 @@ extern unsigned cortexm_wait_timeout;
 #define CORTEXM_DWT_BASE (CORTEXM_PPB_BASE + 0x1000U)
 
 #define CORTEXM_DWT_CTRL    (CORTEXM_DWT_BASE + 0x000U)
+#define CORTEXM_DWT_CYCCNT  (CORTEXM_DWT_BASE + 0x004U)
+#define CORTEXM_DWT_PCSR    (CORTEXM_DWT_BASE + 0x01cU)
 #define CORTEXM_DWT_COMP(i) (CORTEXM_DWT_BASE + 0x020U + (0x10U * (i)))
 #define CORTEXM_DWT_MASK(i) (CORTEXM_DWT_BASE + 0x024U + (0x10U * (i)))
 #define CORTEXM_DWT_FUNC(i) (CORTEXM_DWT_BASE + 0x028U + (0x10U * (i)))
@@ -81,6 +85,9 @@ extern unsigned cortexm_wait_timeout;
 #define CORTEXM_HFSR_FORCED   (1U << 30U)
 /* Bits 29:2 - Not specified */
 #define CORTEXM_HFSR_VECTTBL (1U << 1U)
+
+/* Floating Point Context Control Register (FPCCR) */
+#define CORTEXM_FPCCR_LSPACT (1U << 0U)
 /* Bits 0 - Reserved */
 
 /* Debug Fault Status Register (DFSR) */
@@ -146,6 +153,10 @@ extern unsigned cortexm_wait_timeout;
 #define CORTEXM_FPB_CTRL_KEY    (1U << 1U)
 #define CORTEXM_FPB_CTRL_ENABLE (1U << 0U)
 
+/* Data Watchpoint and Trace Control Register (DWT_CTRL) */
+#define CORTEXM_DWT_CTRL_NOCYCCNT  (1U << 25U)
+#define CORTEXM_DWT_CTRL_CYCCNTENA (1U << 0U)
+
 /* Data Watchpoint and Trace Mask Register (DWT_MASKx)
 *  The value here is the number of address bits we mask out */
 #define CORTEXM_DWT_MASK_BYTE     (0U)
@@ -186,10 +197,48 @@ extern unsigned cortexm_wait_timeout;
 #define CPUID_PATCH_MASK    0xfU
 
 ADIv5_AP_t *cortexm_ap(target *t);
+bool target_is_cortexm(const target *t);
+
+/*
+ * A Cortex-M target's fingerprint (DP, AP, ROM table and CPUID) and the index
+ * of the driver probe that claimed it, CORTEXM_PROBE_NONE if none did. Handing
+ * both back to cortexm_probe_hint() before a scan has that driver tried first.
+ */
+#define CORTEXM_PROBE_NONE 0xffU
+bool cortexm_identity(const target *t, uint32_t *fingerprint, uint8_t *probe);
+void cortexm_probe_hint(uint32_t fingerprint, uint8_t probe);
 
 bool cortexm_attach(target *t);
+/* Get the link and the debug setup back after the core went through a reset the probe didn't do */
+bool cortexm_recover(target *t);
 void cortexm_detach(target *t);
 int cortexm_run_stub(target *t, uint32_t loadaddr, uint32_t r0, uint32_t r1, uint32_t r2, uint32_t r3);
+
+/*
+ * A routine run on the target as a function call. It is entered with its
+ * arguments in r0-r3 and must exit with bkpt #result. arena_size bytes of RAM
+ * follow the code for the caller's argument and result structures.
+ */
+typedef struct cortexm_call_code {
+	const void *code;
+	size_t code_size;
+	size_t arena_size;
+} cortexm_call_code_s;
+
+#define CORTEXM_CALL_RUNNING (-4)
+#define CORTEXM_CALL_TIMEOUT 5000U
+
+target_addr_t cortexm_call_load(target *t, const cortexm_call_code_s *code, target_addr_t avoid, size_t avoid_len);
+bool cortexm_call_start(target *t, uint32_t r0, uint32_t r1, uint32_t r2, uint32_t r3);
+int cortexm_call_poll(target *t, uint32_t *regs);
+int cortexm_call_wait(target *t, uint32_t timeout_ms, uint32_t *regs);
+int cortexm_call(target *t, uint32_t r0, uint32_t r1, uint32_t r2, uint32_t r3);
+void cortexm_call_mem_read(target *t, void *dest, target_addr_t src, size_t len);
+void cortexm_call_mem_write(target *t, target_addr_t dest, const void *src, size_t len);
+struct target_flash;
+bool cortexm_flash_stub_load(struct target_flash *f);
+bool cortexm_flash_stub_write(struct target_flash *f, target_addr_t dest, const void *src, size_t len, uint32_t param);
+bool cortexm_flash_stub_wait(struct target_flash *f);
 int cortexm_mem_write_sized(target *t, target_addr_t dest, const void *src, size_t len, enum align align);
 
 #endif /* TARGET_CORTEXM_H */
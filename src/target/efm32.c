@@ -43,7 +43,6 @@
 #include "adiv5.h"
 
 #define SRAM_BASE        0x20000000
-#define STUB_BUFFER_BASE ALIGN(SRAM_BASE + sizeof(efm32_flash_write_stub), 4)
 
 static bool efm32_flash_erase(target_flash_s *f, target_addr_t addr, size_t len);
 static bool efm32_flash_write(target_flash_s *f, target_addr_t dest, const void *src, size_t len);
@@ -53,6 +52,11 @@ static const uint16_t efm32_flash_write_stub[] = {
 #include "flashstub/efm32.stub"
 };
 
+static const target_flash_stub_s efm32_flash_stub = {
+	.code = efm32_flash_write_stub,
+	.code_size = sizeof(efm32_flash_write_stub),
+};
+
 static bool efm32_cmd_serial(target *t, int argc, const char **argv);
 static bool efm32_cmd_efm_info(target *t, int argc, const char **argv);
 static bool efm32_cmd_bootloader(target *t, int argc, const char **argv);
@@ -496,7 +500,7 @@ static efm32_v2_di_miscchip_t efm32_v2_read_miscchip(target *t, uint8_t di_versi
 
 static void efm32_add_flash(target *t, target_addr_t addr, size_t length, size_t page_size)
 {
-	target_flash_s *f = calloc(1, sizeof(*f));
+	target_flash_s *f = target_arena_calloc(sizeof(*f));
 	if (!f) { /* calloc failed: heap exhaustion */
 		DEBUG_WARN("calloc: failed in %s\n", __func__);
 		return;
@@ -507,6 +511,7 @@ static void efm32_add_flash(target *t, target_addr_t addr, size_t length, size_t
 	f->blocksize = page_size;
 	f->erase = efm32_flash_erase;
 	f->write = efm32_flash_write;
+	f->stub = &efm32_flash_stub;
 	f->writesize = page_size;
 	target_add_flash(t, f);
 }
@@ -566,7 +571,7 @@ bool efm32_probe(target *t)
 	uint32_t ram_size = ram_kib * 0x400U;
 	uint32_t flash_page_size = device->flash_page_size;
 
-	struct efm32_priv_s *priv_storage = calloc(1, sizeof(*priv_storage));
+	struct efm32_priv_s *priv_storage = target_arena_calloc(sizeof(*priv_storage));
 	t->target_storage = (void *)priv_storage;
 
 	priv_storage->di_version = di_version;
@@ -638,20 +643,14 @@ static bool efm32_flash_erase(target_flash_s *f, target_addr_t addr, size_t len)
 /* Write flash page by page */
 static bool efm32_flash_write(target_flash_s *f, target_addr_t dest, const void *src, size_t len)
 {
-	(void)len;
-
 	target *t = f->t;
 
 	struct efm32_priv_s *priv_storage = (struct efm32_priv_s *)t->target_storage;
 	if (!priv_storage || !priv_storage->device)
 		return false;
 
-	/* Write flashloader */
-	target_mem_write(t, SRAM_BASE, efm32_flash_write_stub, sizeof(efm32_flash_write_stub));
-	/* Write Buffer */
-	target_mem_write(t, STUB_BUFFER_BASE, src, len);
-	/* Run flashloader */
-	const bool ret = cortexm_run_stub(t, SRAM_BASE, dest, STUB_BUFFER_BASE, len, priv_storage->device->msc_addr) == 0;
+	/* Run the flashloader over this page */
+	const bool ret = cortexm_flash_stub_write(f, dest, src, len, priv_storage->device->msc_addr);
 
 #ifdef ENABLE_DEBUG
 	/* Check the MSC_IF */
@@ -956,7 +955,7 @@ bool efm32_aap_probe(ADIv5_AP_t *ap)
 	/* Read status */
 	DEBUG_INFO("EFM32: AAP STATUS=%08" PRIx32 "\n", adiv5_ap_read(ap, AAP_STATUS));
 
-	struct efm32_aap_priv_s *priv_storage = calloc(1, sizeof(*priv_storage));
+	struct efm32_aap_priv_s *priv_storage = target_arena_calloc(sizeof(*priv_storage));
 	sprintf(priv_storage->aap_driver_string, "EFM32 Authentication Access Port rev.%hu", aap_revision);
 	t->driver = priv_storage->aap_driver_string;
 	t->regs_size = 4;
@@ -0,0 +1,140 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * Copyright (C) 2022  Black Sphere Technologies Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Fast page programming loop for the CH32F1 flash controller.
+ *
+ * r0 = flash destination (128 byte page aligned), r1 = source buffer, r2 =
+ * length in bytes (a multiple of 128), r3 = base of the flash registers (SR at
+ * +0x0C, CR at +0x10, AR at +0x14, MAGIC at +0x34). The controller must already
+ * be unlocked for fast programming.
+ *
+ * Each page goes through the same buffer reset, 8 x 16 byte buffer loads and
+ * page program sequence the host side of ch32f1.c uses, including the reads that
+ * let the flash settle and the magic register writes. Pages the buffer leaves
+ * all erased are skipped, so a buffer padded past the end of the image never
+ * touches pages that weren't erased. Exits with bkpt #0 once done, bkpt #1 if
+ * SR reports an error, or bkpt #2 if a page to program doesn't read erased.
+ */
+	.syntax unified
+	.thumb
+	.text
+	.global ch32f1_flash_write_stub
+	.type ch32f1_flash_write_stub, %function
+ch32f1_flash_write_stub:
+	movs r4, #1
+	lsls r4, r4, #16 /* FLASH_CR_FTPG_CH32 */
+page:
+	movs r5, #0
+blank:
+	ldr r6, [r1, r5]
+	adds r6, #1
+	bne settle
+	adds r5, #4
+	cmp r5, #128
+	bne blank
+	b next
+settle:
+	movs r5, #32
+wait_ready:
+	ldr r6, [r0]
+	subs r5, #1
+	bne wait_ready
+	adds r6, #1
+	bne not_erased
+	/* Buffer reset */
+	str r4, [r3, #0x10]
+	lsls r5, r4, #3 /* FLASH_CR_BUF_RESET_CH32 */
+	orrs r5, r4
+	str r5, [r3, #0x10]
+buffer_busy:
+	ldr r5, [r3, #0x0C]
+	lsls r5, r5, #31 /* FLASH_SR_BSY */
+	bmi buffer_busy
+	movs r5, #0
+	str r5, [r3, #0x10]
+	/* Load the page 16 bytes at a time */
+	movs r7, #0
+load:
+	str r4, [r3, #0x10]
+	ldr r5, [r1, r7]
+	str r5, [r0, r7]
+	adds r7, #4
+	ldr r5, [r1, r7]
+	str r5, [r0, r7]
+	adds r7, #4
+	ldr r5, [r1, r7]
+	str r5, [r0, r7]
+	adds r7, #4
+	ldr r5, [r1, r7]
+	str r5, [r0, r7]
+	adds r7, #4
+	lsls r5, r4, #2 /* FLASH_CR_BUF_LOAD_CH32 */
+	orrs r5, r4
+	str r5, [r3, #0x10]
+load_eop:
+	ldr r5, [r3, #0x0C]
+	lsls r5, r5, #26 /* FLASH_SR_EOP */
+	bpl load_eop
+	movs r5, #0x20
+	str r5, [r3, #0x0C]
+	movs r5, #0
+	str r5, [r3, #0x10]
+	adds r6, r0, r7
+	subs r6, #16
+	movs r5, #1
+	lsls r5, r5, #8 /* MAGIC_WORD */
+	eors r6, r5
+	ldr r6, [r6]
+	str r6, [r3, #0x34]
+	cmp r7, #128
+	bne load
+	/* Program the page */
+	str r4, [r3, #0x10]
+	str r0, [r3, #0x14]
+	movs r5, #0x40 /* FLASH_CR_STRT */
+	orrs r5, r4
+	str r5, [r3, #0x10]
+program_eop:
+	ldr r5, [r3, #0x0C]
+	lsls r5, r5, #26 /* FLASH_SR_EOP */
+	bpl program_eop
+	movs r5, #0x20
+	str r5, [r3, #0x0C]
+	movs r5, #0
+	str r5, [r3, #0x10]
+	movs r5, #1
+	lsls r5, r5, #8 /* MAGIC_WORD */
+	eors r5, r0
+	ldr r5, [r5]
+	str r5, [r3, #0x34]
+	ldr r5, [r3, #0x0C]
+	movs r6, #0x14 /* SR_ERROR_MASK */
+	tst r5, r6
+	bne error
+next:
+	adds r0, #128
+	adds r1, #128
+	subs r2, #128
+	bhi page
+	bkpt #0
+error:
+	bkpt #1
+not_erased:
+	bkpt #2
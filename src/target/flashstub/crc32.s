@@ -0,0 +1,72 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * Copyright (C) 2022  Black Sphere Technologies Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * CRC32 (polynomial 0x04C11DB7, MSB first, no reflection, no final XOR) of a
+ * memory region, matching generic_crc32() in src/crc32.c.
+ *
+ * r0 = data, r1 = length in bytes, r2 = address of the running CRC, which is
+ * read on entry and written back on exit so a region can be done in chunks.
+ *
+ * Uses a 16 entry nibble table to stay small and ARMv6-M compatible.
+ * Interrupts are masked, the caller restores PRIMASK with the other registers.
+ */
+	.syntax unified
+	.thumb
+	.text
+	.global crc32_stub
+	.type crc32_stub, %function
+crc32_stub:
+	cpsid i
+	ldr r3, [r2]
+	adr r4, crc32_table
+loop:
+	cmp r1, #0
+	beq done
+	ldrb r5, [r0]
+	adds r0, #1
+	subs r1, #1
+	/* High nibble */
+	lsrs r6, r3, #28
+	lsrs r7, r5, #4
+	eors r6, r7
+	lsls r6, r6, #2
+	ldr r6, [r4, r6]
+	lsls r3, r3, #4
+	eors r3, r6
+	/* Low nibble */
+	lsrs r6, r3, #28
+	lsls r7, r5, #28
+	lsrs r7, r7, #28
+	eors r6, r7
+	lsls r6, r6, #2
+	ldr r6, [r4, r6]
+	lsls r3, r3, #4
+	eors r3, r6
+	b loop
+done:
+	str r3, [r2]
+	bkpt #0
+
+	.align 2
+crc32_table:
+	.word 0x00000000, 0x04C11DB7, 0x09823B6E, 0x0D4326D9
+	.word 0x130476DC, 0x17C56B6B, 0x1A864DB2, 0x1E475005
+	.word 0x2608EDB8, 0x22C9F00F, 0x2F8AD6D6, 0x2B4BCB61
+	.word 0x350C9B64, 0x31CD86D3, 0x3C8EA00A, 0x384FBDBD
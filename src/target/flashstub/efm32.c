@@ -42,6 +42,14 @@
 #define EFM32_MSC_STATUS_WDATAREADY     (1<<3)
 #define EFM32_MSC_STATUS_WORDTIMEOUT	(1<<4)
 
+/*
+ * Programs a buffer that doesn't cross a page in one write sequence: the address
+ * is loaded once and then increments by itself, and after WRITETRIG each word
+ * is programmed as soon as it lands in WDATA. That keeps the flash programming
+ * back to back, which is as fast as a DMA fed sequence as the CPU keeps ahead
+ * of the flash from RAM. Exits with 1 if the address is refused or the sequence
+ * ran into WORDTIMEOUT.
+ */
 void __attribute__((naked))
 efm32_flash_write_stub(uint32_t *dest, uint32_t *src, uint32_t size, uint32_t msc)
 {
@@ -50,19 +58,25 @@ efm32_flash_write_stub(uint32_t *dest, uint32_t *src, uint32_t size, uint32_t ms
 	EFM32_MSC_LOCK(msc) = EFM32_MSC_LOCK_LOCKKEY;
 	EFM32_MSC_WRITECTRL(msc) = 1;
 
-	for (i = 0; i < size/4; i++) {
-		EFM32_MSC_ADDRB(msc) = (uint32_t)&dest[i];
-		EFM32_MSC_WRITECMD(msc) = EFM32_MSC_WRITECMD_LADDRIM;
+	EFM32_MSC_ADDRB(msc) = (uint32_t)dest;
+	EFM32_MSC_WRITECMD(msc) = EFM32_MSC_WRITECMD_LADDRIM;
+	if (EFM32_MSC_STATUS(msc) & (EFM32_MSC_STATUS_INVADDR | EFM32_MSC_STATUS_LOCKED))
+		stub_exit(1);
 
+	for (i = 0; i < size/4; i++) {
 		/* Wait for WDATAREADY */
 		while ((EFM32_MSC_STATUS(msc) & EFM32_MSC_STATUS_WDATAREADY) == 0);
 
 		EFM32_MSC_WDATA(msc) = src[i];
-		EFM32_MSC_WRITECMD(msc) = EFM32_MSC_WRITECMD_WRITEONCE;
-
-		/* Wait for BUSY */
-		while ((EFM32_MSC_STATUS(msc) & EFM32_MSC_STATUS_BUSY));
+		if (i == 0)
+			EFM32_MSC_WRITECMD(msc) = EFM32_MSC_WRITECMD_WRITETRIG;
 	}
 
+	/* Wait for BUSY */
+	while ((EFM32_MSC_STATUS(msc) & EFM32_MSC_STATUS_BUSY));
+	EFM32_MSC_WRITECMD(msc) = EFM32_MSC_WRITECMD_WRITEEND;
+
+	if (EFM32_MSC_STATUS(msc) & EFM32_MSC_STATUS_WORDTIMEOUT)
+		stub_exit(1);
 	stub_exit(0);
 }
@@ -0,0 +1,72 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * Copyright (C) 2022  Black Sphere Technologies Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * SPI NOR page programming loop for the LPC43xx SPIFI controller.
+ *
+ * r0 = flash offset (page aligned), r1 = source buffer, r2 = length in bytes
+ * (a non-zero multiple of the 256 byte page), r3 = SPIFI base address.
+ *
+ * The controller has to be in command mode already. Each page gets a write
+ * enable and a page program, then a read status command with the POLL bit
+ * set has the SPIFI itself read the status register until WIP clears. Exits
+ * with bkpt #0 once everything is programmed.
+ */
+	.syntax unified
+	.thumb
+	.text
+	.global lpc43xx_spifi_write_stub
+	.type lpc43xx_spifi_write_stub, %function
+lpc43xx_spifi_write_stub:
+page:
+	ldr r4, =0x06200000 /* Write enable, opcode only */
+	str r4, [r3, #0x04] /* SPIFI_CMD */
+wren:
+	ldr r4, [r3, #0x1c]
+	lsrs r4, r4, #2 /* SPIFI_STAT_CMD */
+	bcs wren
+	str r0, [r3, #0x08] /* SPIFI_ADDR */
+	ldr r4, =0x02808100 /* Page program, 24 bit address, 256 bytes out */
+	str r4, [r3, #0x04]
+	movs r5, #64
+copy:
+	ldr r6, [r1]
+	str r6, [r3, #0x14] /* SPIFI_DATA stalls while the FIFO is full */
+	adds r1, #4
+	subs r5, #1
+	bne copy
+program:
+	ldr r4, [r3, #0x1c]
+	lsrs r4, r4, #2
+	bcs program
+	ldr r4, =0x05204000 /* Read status, polled until bit 0 reads 0 */
+	str r4, [r3, #0x04]
+poll:
+	ldr r4, [r3, #0x1c]
+	lsrs r4, r4, #2
+	bcs poll
+	ldrb r4, [r3, #0x14] /* The status byte the poll ended on */
+	movs r5, #1
+	lsls r5, r5, #8
+	adds r0, r0, r5
+	subs r2, r2, r5
+	bne page
+	bkpt #0
+	.align 2
+	.pool
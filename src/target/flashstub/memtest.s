@@ -0,0 +1,86 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * Copyright (C) 2022  Black Sphere Technologies Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Memory fill and pattern test, run on the target so only the result has to
+ * come back over the wire.
+ *
+ * r0 = start (word aligned), r1 = length in bytes (a multiple of 4), r2 =
+ * pattern, r3 = 0 to fill the region with the pattern, or 1 to test it.
+ *
+ * The test writes each word with its own address XORed with the pattern and
+ * reads the region back, then does the same with the inverse, so every data
+ * bit is seen both ways and aliased address lines show up as mismatches.
+ * Exits with bkpt #0 when done, or bkpt #1 on a mismatch with the address in
+ * r0, the value read in r4 and the value expected in r7.
+ *
+ * Interrupts are masked, the caller restores PRIMASK with the other registers.
+ */
+	.syntax unified
+	.thumb
+	.text
+	.global memtest_stub
+	.type memtest_stub, %function
+memtest_stub:
+	cpsid i
+	adds r5, r0, r1
+	movs r1, r0
+	cmp r3, #0
+	bne test
+fill:
+	cmp r0, r5
+	beq done
+	str r2, [r0]
+	adds r0, #4
+	b fill
+test:
+	movs r6, #0
+pass:
+	movs r0, r1
+write:
+	cmp r0, r5
+	beq check
+	movs r4, r0
+	eors r4, r2
+	eors r4, r6
+	str r4, [r0]
+	adds r0, #4
+	b write
+check:
+	movs r0, r1
+verify:
+	cmp r0, r5
+	beq next_pass
+	ldr r4, [r0]
+	movs r7, r0
+	eors r7, r2
+	eors r7, r6
+	cmp r4, r7
+	bne fail
+	adds r0, #4
+	b verify
+next_pass:
+	cmp r6, #0
+	bne done
+	mvns r6, r6
+	b pass
+done:
+	bkpt #0
+fail:
+	bkpt #1
@@ -0,0 +1,84 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * Copyright (C) 2022  Black Sphere Technologies Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Erase, program and verify loop for the nRF51/nRF52 NVMC.
+ *
+ * r0 = flash destination, r1 = source buffer, r2 = length in bytes (a non-zero
+ * multiple of 4), r3 = NVMC base + 0x500 (CONFIG at +0x04, ERASEPAGE at +0x08,
+ * READY at -0x100), with bit 0 set to have the page at r0 erased first. The
+ * page size doesn't matter here, so the same stub serves both families.
+ *
+ * NVMC READY is polled after the erase and after every word written, words that
+ * are to stay erased are skipped. Once done CONFIG is put back to read-only and
+ * the data read back, exiting with bkpt #0 if it all matches or bkpt #1 on the
+ * first word that doesn't.
+ */
+	.syntax unified
+	.thumb
+	.text
+	.global nrf51_flash_write_stub
+	.type nrf51_flash_write_stub, %function
+nrf51_flash_write_stub:
+	movs r4, #1
+	ands r4, r3 /* Erase first? */
+	subs r3, r3, r4
+	movs r5, #1
+	lsls r5, r5, #8
+	subs r5, r3, r5 /* NVMC_READY */
+	cmp r4, #0
+	beq program
+	movs r4, #2 /* NVMC_CONFIG_EEN */
+	str r4, [r3, #0x04]
+	str r0, [r3, #0x08] /* NVMC_ERASEPAGE */
+erase_busy:
+	ldr r4, [r5]
+	cmp r4, #0
+	beq erase_busy
+program:
+	movs r4, #1 /* NVMC_CONFIG_WEN */
+	str r4, [r3, #0x04]
+	movs r6, #0
+loop:
+	ldr r4, [r1, r6]
+	adds r7, r4, #1 /* Erased words needn't be written */
+	beq next
+	str r4, [r0, r6]
+busy:
+	ldr r7, [r5]
+	cmp r7, #0
+	beq busy
+next:
+	adds r6, #4
+	cmp r6, r2
+	blo loop
+	movs r4, #0 /* NVMC_CONFIG_REN */
+	str r4, [r3, #0x04]
+	movs r6, #0
+verify:
+	ldr r4, [r1, r6]
+	ldr r7, [r0, r6]
+	cmp r4, r7
+	bne error
+	adds r6, #4
+	cmp r6, r2
+	blo verify
+	bkpt #0
+error:
+	bkpt #1
@@ -0,0 +1,74 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * Copyright (C) 2022  Black Sphere Technologies Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Programming loop for the Renesas RA RV40 flash (FACI), for code and data flash.
+ *
+ * r0 = flash destination, r1 = source buffer, r2 = length in bytes (a non-zero
+ * multiple of the write unit), r3 = write unit in bytes (128 for code flash, 4
+ * for data flash). The flash must already be in the matching P/E mode.
+ *
+ * Each unit gets its program command, has its data fed in as the data buffer
+ * frees up, and is waited on with FRDY before the next one. Exits with bkpt #0
+ * once everything is programmed, or bkpt #1 as soon as FSTATR reports PRGERR
+ * or ILGLERR, leaving the recovery to the debugger.
+ */
+	.syntax unified
+	.thumb
+	.text
+	.global renesas_rv40_flash_write_stub
+	.type renesas_rv40_flash_write_stub, %function
+renesas_rv40_flash_write_stub:
+	ldr r4, =0x407e0000 /* FACI command issuing area */
+	ldr r5, =0x407fe080 /* FSTATR */
+unit:
+	movs r7, r5
+	subs r7, #0x50 /* FSADDR */
+	str r0, [r7]
+	movs r7, #0xe8 /* Program */
+	strb r7, [r4]
+	lsrs r6, r3, #1 /* Half words in the unit */
+	strb r6, [r4]
+data:
+	ldr r7, [r5]
+	lsls r7, r7, #21 /* FSTATR_DBFULL */
+	bmi data
+	ldrh r7, [r1]
+	strh r7, [r4]
+	adds r1, #2
+	subs r6, #1
+	bne data
+	movs r7, #0xd0 /* Final */
+	strb r7, [r4]
+ready:
+	ldr r7, [r5]
+	lsls r6, r7, #16 /* FSTATR_RDY */
+	bpl ready
+	lsls r6, r7, #17 /* FSTATR_ILGLERR */
+	bmi error
+	lsls r6, r7, #19 /* FSTATR_PRGERR */
+	bmi error
+	adds r0, r0, r3
+	subs r2, r2, r3
+	bne unit
+	bkpt #0
+error:
+	bkpt #1
+	.align 2
+	.pool
@@ -0,0 +1,119 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * Copyright (C) 2022  Black Sphere Technologies Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * SPI NOR page programming loop for the STM32 OCTOSPI controller.
+ *
+ * r0 = flash offset (page aligned), r1 = source buffer, r2 = length in bytes
+ * (a non-zero multiple of the 256 byte page), r3 = OCTOSPI base address.
+ *
+ * As the QUADSPI loop, with the OCTOSPI's register layout: the functional
+ * mode lives in OCTOSPI_CR and commands start on the write to OCTOSPI_IR.
+ * The controller has to be in indirect mode with no dummy cycles set in
+ * OCTOSPI_TCR already. Exits with bkpt #0 once everything is programmed, or
+ * bkpt #1 if the controller reports a transfer error.
+ */
+	.syntax unified
+	.thumb
+	.text
+	.global stm32_octospi_write_stub
+	.type stm32_octospi_write_stub, %function
+stm32_octospi_write_stub:
+	movs r7, #0x80
+	lsls r7, r7, #1
+	adds r7, r7, r3 /* OCTOSPI_CCR and up are out of reach of an immediate offset */
+	movs r4, #0x80
+	adds r4, r4, r3
+	movs r5, #1
+	str r5, [r4] /* OCTOSPI_PSMKR: the status register's WIP bit */
+	movs r5, #0
+	str r5, [r4, #0x08] /* OCTOSPI_PSMAR: until it reads back clear */
+	movs r5, #0x10
+	str r5, [r4, #0x10] /* OCTOSPI_PIR */
+page:
+	ldr r4, [r3]
+	ldr r5, =0x30000000 /* OCTOSPI_CR_FMODE */
+	bics r4, r5 /* Indirect write */
+	str r4, [r3]
+	movs r4, #0x1b
+	str r4, [r3, #0x24] /* Clear OCTOSPI_SR's flags */
+	movs r4, #0x01 /* Instruction only, on one line */
+	str r4, [r7]
+	movs r4, #0x06 /* Write enable */
+	str r4, [r7, #0x10]
+wren:
+	ldr r4, [r3, #0x20]
+	lsrs r5, r4, #1 /* OCTOSPI_SR_TEF */
+	bcs error
+	lsrs r5, r4, #2 /* OCTOSPI_SR_TCF */
+	bcc wren
+	movs r4, #0x1b
+	str r4, [r3, #0x24]
+	movs r4, #0xff
+	str r4, [r3, #0x40] /* OCTOSPI_DLR: one page */
+	ldr r4, =0x01002101 /* 24 bit address and data on one line */
+	str r4, [r7]
+	movs r4, #0x02 /* Page program */
+	str r4, [r7, #0x10]
+	str r0, [r3, #0x48]
+	movs r5, #64
+copy:
+	ldr r6, [r1]
+	str r6, [r3, #0x50] /* OCTOSPI_DR stalls while the FIFO is full */
+	adds r1, #4
+	subs r5, #1
+	bne copy
+program:
+	ldr r4, [r3, #0x20]
+	lsrs r5, r4, #1
+	bcs error
+	lsrs r5, r4, #2
+	bcc program
+	movs r4, #0x1b
+	str r4, [r3, #0x24]
+	ldr r4, [r3]
+	ldr r5, =0x20400000 /* OCTOSPI_CR_FMODE_AUTOPOLL | OCTOSPI_CR_APMS */
+	orrs r4, r5
+	str r4, [r3]
+	movs r4, #0
+	str r4, [r3, #0x40] /* OCTOSPI_DLR: one status byte */
+	ldr r4, =0x01000001 /* Instruction and data on one line */
+	str r4, [r7]
+	movs r4, #0x05 /* Read status */
+	str r4, [r7, #0x10]
+poll:
+	ldr r4, [r3, #0x20]
+	lsrs r5, r4, #1
+	bcs error
+	lsrs r5, r4, #4 /* OCTOSPI_SR_SMF */
+	bcc poll
+	movs r5, #1
+	lsls r5, r5, #8
+	adds r0, r0, r5
+	subs r2, r2, r5
+	bne page
+	ldr r4, [r3]
+	ldr r5, =0x30000000
+	bics r4, r5
+	str r4, [r3]
+	bkpt #0
+error:
+	bkpt #1
+	.align 2
+	.pool
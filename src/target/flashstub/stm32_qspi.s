@@ -0,0 +1,100 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * Copyright (C) 2022  Black Sphere Technologies Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * SPI NOR page programming loop for the STM32 QUADSPI controller.
+ *
+ * r0 = flash offset (page aligned), r1 = source buffer, r2 = length in bytes
+ * (a non-zero multiple of the 256 byte page), r3 = QUADSPI base address.
+ *
+ * The controller has to be in indirect mode already. Each page gets a write
+ * enable and a page program, then the controller's automatic polling mode
+ * reads the status register until WIP clears, so nothing goes back over the
+ * wire until the whole buffer is in. Exits with bkpt #0 once everything is
+ * programmed, or bkpt #1 if the controller reports a transfer error.
+ */
+	.syntax unified
+	.thumb
+	.text
+	.global stm32_qspi_write_stub
+	.type stm32_qspi_write_stub, %function
+stm32_qspi_write_stub:
+	movs r4, #1
+	str r4, [r3, #0x24] /* QUADSPI_PSMKR: the status register's WIP bit */
+	movs r4, #0
+	str r4, [r3, #0x28] /* QUADSPI_PSMAR: until it reads back clear */
+	movs r4, #0x10
+	str r4, [r3, #0x2c] /* QUADSPI_PIR */
+	ldr r4, [r3]
+	ldr r5, =0x00400000 /* QUADSPI_CR_APMS */
+	orrs r4, r5
+	str r4, [r3]
+page:
+	movs r4, #0x1b
+	str r4, [r3, #0x0c] /* Clear QUADSPI_SR's flags */
+	ldr r4, =0x00000106 /* Write enable, instruction only */
+	str r4, [r3, #0x14]
+wren:
+	ldr r4, [r3, #0x08]
+	lsrs r5, r4, #1 /* QUADSPI_SR_TEF */
+	bcs error
+	lsrs r5, r4, #2 /* QUADSPI_SR_TCF */
+	bcc wren
+	movs r4, #0x1b
+	str r4, [r3, #0x0c]
+	movs r4, #0xff
+	str r4, [r3, #0x10] /* QUADSPI_DLR: one page */
+	ldr r4, =0x01002502 /* Page program, 24 bit address, data on one line */
+	str r4, [r3, #0x14]
+	str r0, [r3, #0x18]
+	movs r5, #64
+copy:
+	ldr r6, [r1]
+	str r6, [r3, #0x20] /* QUADSPI_DR stalls while the FIFO is full */
+	adds r1, #4
+	subs r5, #1
+	bne copy
+program:
+	ldr r4, [r3, #0x08]
+	lsrs r5, r4, #1
+	bcs error
+	lsrs r5, r4, #2
+	bcc program
+	movs r4, #0x1b
+	str r4, [r3, #0x0c]
+	movs r4, #0
+	str r4, [r3, #0x10] /* QUADSPI_DLR: one status byte */
+	ldr r4, =0x09000105 /* Automatic polling with read status */
+	str r4, [r3, #0x14]
+poll:
+	ldr r4, [r3, #0x08]
+	lsrs r5, r4, #1
+	bcs error
+	lsrs r5, r4, #4 /* QUADSPI_SR_SMF */
+	bcc poll
+	movs r5, #1
+	lsls r5, r5, #8
+	adds r0, r0, r5
+	subs r2, r2, r5
+	bne page
+	bkpt #0
+error:
+	bkpt #1
+	.align 2
+	.pool
@@ -0,0 +1,60 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * Copyright (C) 2022  Black Sphere Technologies Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Half-word programming loop for the STM32F0/F1/F3 FPEC.
+ *
+ * r0 = flash destination, r1 = source buffer, r2 = length in bytes (a non-zero
+ * multiple of 2), r3 = base of the bank's FPEC registers (FLASH_SR at +0x0c,
+ * FLASH_CR at +0x10).
+ *
+ * Exits with bkpt #0 once everything is programmed, or bkpt #1 as soon as
+ * FLASH_SR reports PGERR or WRPRTERR. Those and EOP are cleared on entry, so the
+ * caller needn't touch FLASH_SR between buffers.
+ */
+	.syntax unified
+	.thumb
+	.text
+	.global stm32f1_flash_write_stub
+	.type stm32f1_flash_write_stub, %function
+stm32f1_flash_write_stub:
+	movs r4, #0x34 /* FLASH_SR_EOP | FLASH_SR_WRPRTERR | FLASH_SR_PGERR */
+	str r4, [r3, #0x0c]
+	movs r4, #1 /* FLASH_CR_PG */
+	str r4, [r3, #0x10]
+loop:
+	ldrh r4, [r1]
+	strh r4, [r0]
+busy:
+	ldr r4, [r3, #0x0c]
+	movs r5, #1 /* FLASH_SR_BSY */
+	tst r4, r5
+	bne busy
+	movs r5, #0x14 /* FLASH_SR_WRPRTERR | FLASH_SR_PGERR */
+	tst r4, r5
+	bne error
+	adds r0, #2
+	adds r1, #2
+	subs r2, #2
+	bgt loop
+	movs r4, #0
+	str r4, [r3, #0x10]
+	bkpt #0
+error:
+	bkpt #1
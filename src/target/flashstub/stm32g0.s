@@ -0,0 +1,73 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * Copyright (C) 2022  Black Sphere Technologies Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Fast (FSTPG) row programming loop for the STM32G0 flash.
+ *
+ * r0 = flash destination (row aligned), r1 = source buffer, r2 = length in
+ * bytes (a non-zero multiple of the 256 byte row), r3 = address of FLASH_SR
+ * (FLASH_CR at +0x04).
+ *
+ * As on the STM32L4 this only works after a mass erase and needs each row's 32
+ * double words without gaps. The difference is the busy flag, the G0B/C has one
+ * per bank. Errors left in FLASH_SR are cleared on entry. Exits with bkpt #0
+ * once everything is programmed, or bkpt #1 as soon as FLASH_SR reports an
+ * error, with FSTPG cleared again either way.
+ */
+	.syntax unified
+	.thumb
+	.text
+	.global stm32g0_flash_write_stub
+	.type stm32g0_flash_write_stub, %function
+stm32g0_flash_write_stub:
+	ldr r7, =0xc3fa /* FLASH_SR_ERROR_MASK */
+	lsrs r2, r2, #8 /* Rows to program */
+	ldr r4, [r3]
+	str r4, [r3]
+row:
+	movs r4, #1
+	lsls r4, r4, #18 /* FLASH_CR_FSTPG */
+	str r4, [r3, #0x04]
+	movs r5, #64
+copy:
+	ldr r6, [r1]
+	str r6, [r0]
+	adds r0, #4
+	adds r1, #4
+	subs r5, #1
+	bne copy
+	movs r5, #3
+	lsls r5, r5, #16 /* FLASH_SR_BSY2 | FLASH_SR_BSY1 */
+busy:
+	ldr r4, [r3]
+	tst r4, r5
+	bne busy
+	tst r4, r7
+	bne error
+	subs r2, #1
+	bne row
+	movs r4, #0
+	str r4, [r3, #0x04]
+	bkpt #0
+error:
+	movs r4, #0
+	str r4, [r3, #0x04]
+	bkpt #1
+	.align 2
+	.pool
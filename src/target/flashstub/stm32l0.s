@@ -0,0 +1,67 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * Copyright (C) 2022  Black Sphere Technologies Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Half-page programming loop for the STM32L0/L1 NVM.
+ *
+ * r0 = flash destination (half-page aligned), r1 = source buffer, r2 = length
+ * in bytes (one half page), r3 = base of the NVM registers (PECR at +0x04, SR at
+ * +0x18). PECR must already be unlocked for programming.
+ *
+ * The half page has to be written as one uninterrupted burst once PROG and
+ * FPRG are set, which only running from target RAM can guarantee. Errors left in
+ * SR are cleared on entry, and PECR goes back to no operation at the end. Exits
+ * with bkpt #0 once the half page is programmed, or bkpt #1 if SR reports an
+ * error.
+ */
+	.syntax unified
+	.thumb
+	.text
+	.global stm32l0_flash_write_stub
+	.type stm32l0_flash_write_stub, %function
+stm32l0_flash_write_stub:
+	ldr r7, =0x10700 /* STM32Lx_NVM_SR_ERR_M */
+idle:
+	ldr r4, [r3, #0x18]
+	lsls r5, r4, #31 /* STM32Lx_NVM_SR_BSY */
+	bmi idle
+	str r7, [r3, #0x18]
+	movs r4, #0x81
+	lsls r4, r4, #3 /* STM32Lx_NVM_PECR_FPRG | STM32Lx_NVM_PECR_PROG */
+	str r4, [r3, #0x04]
+copy:
+	ldr r6, [r1]
+	str r6, [r0]
+	adds r0, #4
+	adds r1, #4
+	subs r2, #4
+	bne copy
+busy:
+	ldr r4, [r3, #0x18]
+	lsls r5, r4, #31 /* STM32Lx_NVM_SR_BSY */
+	bmi busy
+	movs r5, #0
+	str r5, [r3, #0x04]
+	tst r4, r7
+	bne error
+	bkpt #0
+error:
+	bkpt #1
+	.align 2
+	.pool
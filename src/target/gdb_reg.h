@@ -21,35 +21,66 @@
 #ifndef TARGET_GDB_REG_H
 #define TARGET_GDB_REG_H
 
-// The beginning XML for GDB target descriptions that are common to ARM targets,
-// save for one word: the word after DOCTYPE, which is "target" for Cortex-M, and "feature"
-// for Cortex-A. The "preamble" is thus split into two halves, with this single word missing
-// and as the split point.
-extern const char *gdb_arm_preamble_first;
-
-// The beginning XML for GDB target descriptions that are common to ARM targets,
-// save for one word: the word after DOCTYPE, which is "target" for Cortex-M, and "feature"
-// for Cortex-A. The "preamble" is thus split into two halves, with this single word missing
-// and as the split point.
-extern const char *gdb_arm_preamble_second;
-
-// The "type" field of a register tag.
-typedef enum gdb_reg_type {
-	GDB_TYPE_UNSPECIFIED = 0,
-	GDB_TYPE_DATA_PTR,
-	GDB_TYPE_CODE_PTR,
-} gdb_reg_type_e;
-
-// The strings for the "type" field of a register tag, respective to its gdb_reg_type_e value.
-extern const char *gdb_reg_type_strings[];
-
-// The "save-restore" field of a register tag.
-typedef enum gdb_reg_save_restore {
-	GDB_SAVE_RESTORE_UNSPECIFIED = 0,
-	GDB_SAVE_RESTORE_NO,
-} gdb_reg_save_restore_e;
-
-// The strings for the "save-restore" field of a register tag, respective to its gdb_reg_save_restore_e value.
-extern const char *gdb_reg_save_restore_strings[];
+/*
+ * Building blocks for GDB target description XML. These are all string literals,
+ * so a target description made from them is put together by the compiler and
+ * sits in flash, ready to be handed out in slices by qXfer:features:read.
+ */
+
+// The beginning XML common to ARM targets. The word after DOCTYPE is "target"
+// for Cortex-M and "feature" for Cortex-A.
+#define GDB_ARM_PREAMBLE(doctype)                       \
+	"<?xml version=\"1.0\"?>"                           \
+	"<!DOCTYPE " doctype " SYSTEM \"gdb-target.dtd\">" \
+	"<target>"                                          \
+	"<architecture>arm</architecture>"
+
+// The optional "type" and "save-restore" fields of a register tag
+#define GDB_TYPE_DATA_PTR   " type=\"data_ptr\""
+#define GDB_TYPE_CODE_PTR   " type=\"code_ptr\""
+#define GDB_TYPE_FLOAT      " type=\"float\""
+#define GDB_SAVE_RESTORE_NO " save-restore=\"no\""
+
+// A register tag, plain or with further fields
+#define GDB_REG(name, bitsize)             "<reg name=\"" name "\" bitsize=\"" #bitsize "\"/>"
+#define GDB_REG_ATTR(name, bitsize, attrs) "<reg name=\"" name "\" bitsize=\"" #bitsize "\"" attrs "/>"
+
+// r0-r12, which every ARM core has in the same form
+#define GDB_ARM_GPRS   \
+	GDB_REG("r0", 32)  \
+	GDB_REG("r1", 32)  \
+	GDB_REG("r2", 32)  \
+	GDB_REG("r3", 32)  \
+	GDB_REG("r4", 32)  \
+	GDB_REG("r5", 32)  \
+	GDB_REG("r6", 32)  \
+	GDB_REG("r7", 32)  \
+	GDB_REG("r8", 32)  \
+	GDB_REG("r9", 32)  \
+	GDB_REG("r10", 32) \
+	GDB_REG("r11", 32) \
+	GDB_REG("r12", 32)
+
+// The VFP feature with fpscr and d0-d15
+#define GDB_ARM_VFP_FEATURE                  \
+	"<feature name=\"org.gnu.gdb.arm.vfp\">" \
+	GDB_REG("fpscr", 32)                     \
+	GDB_REG_ATTR("d0", 64, GDB_TYPE_FLOAT)   \
+	GDB_REG_ATTR("d1", 64, GDB_TYPE_FLOAT)   \
+	GDB_REG_ATTR("d2", 64, GDB_TYPE_FLOAT)   \
+	GDB_REG_ATTR("d3", 64, GDB_TYPE_FLOAT)   \
+	GDB_REG_ATTR("d4", 64, GDB_TYPE_FLOAT)   \
+	GDB_REG_ATTR("d5", 64, GDB_TYPE_FLOAT)   \
+	GDB_REG_ATTR("d6", 64, GDB_TYPE_FLOAT)   \
+	GDB_REG_ATTR("d7", 64, GDB_TYPE_FLOAT)   \
+	GDB_REG_ATTR("d8", 64, GDB_TYPE_FLOAT)   \
+	GDB_REG_ATTR("d9", 64, GDB_TYPE_FLOAT)   \
+	GDB_REG_ATTR("d10", 64, GDB_TYPE_FLOAT)  \
+	GDB_REG_ATTR("d11", 64, GDB_TYPE_FLOAT)  \
+	GDB_REG_ATTR("d12", 64, GDB_TYPE_FLOAT)  \
+	GDB_REG_ATTR("d13", 64, GDB_TYPE_FLOAT)  \
+	GDB_REG_ATTR("d14", 64, GDB_TYPE_FLOAT)  \
+	GDB_REG_ATTR("d15", 64, GDB_TYPE_FLOAT)  \
+	"</feature>"
 
 #endif /* TARGET_GDB_REG_H */
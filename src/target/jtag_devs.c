@@ -70,3 +70,63 @@ jtag_dev_descr_t dev_descr[] = {
 	{.idcode = 0x4BA00477, .idmask = 0xFFFFFFFF, .descr = "BCM2836."},
 	{.idcode = 0, .idmask = 0, .descr = "Unknown"},
 };
+
+#define DEV_DESCR_COUNT (ARRAY_LENGTH(dev_descr) - 1U)
+
+/*
+ * dev_descr[] ordered by mask then masked IDCODE, with ties kept in table
+ * order, built on first use. A lookup is a binary search per distinct mask
+ * rather than a compare per entry, and since the masks overlap (the ADIv5
+ * entry also matches LPC17xx parts) the earliest table entry still wins.
+ */
+static uint8_t dev_descr_sorted[DEV_DESCR_COUNT];
+static bool dev_descr_sorted_valid;
+
+static bool dev_descr_before(const size_t a, const size_t b)
+{
+	if (dev_descr[a].idmask != dev_descr[b].idmask)
+		return dev_descr[a].idmask < dev_descr[b].idmask;
+	if (dev_descr[a].idcode != dev_descr[b].idcode)
+		return dev_descr[a].idcode < dev_descr[b].idcode;
+	return a < b;
+}
+
+static void dev_descr_sort(void)
+{
+	/* Insertion sort, the table is short and this runs once */
+	for (size_t i = 0; i < DEV_DESCR_COUNT; ++i) {
+		size_t pos = i;
+		for (; pos && dev_descr_before(i, dev_descr_sorted[pos - 1U]); --pos)
+			dev_descr_sorted[pos] = dev_descr_sorted[pos - 1U];
+		dev_descr_sorted[pos] = i;
+	}
+	dev_descr_sorted_valid = true;
+}
+
+jtag_dev_descr_t *jtag_dev_descr_find(const uint32_t idcode)
+{
+	if (!dev_descr_sorted_valid)
+		dev_descr_sort();
+	size_t match = DEV_DESCR_COUNT;
+	for (size_t group = 0; group < DEV_DESCR_COUNT;) {
+		const uint32_t mask = dev_descr[dev_descr_sorted[group]].idmask;
+		size_t group_end = group + 1U;
+		while (group_end < DEV_DESCR_COUNT && dev_descr[dev_descr_sorted[group_end]].idmask == mask)
+			++group_end;
+		/* Lower bound of the masked IDCODE in this mask's run */
+		size_t low = group;
+		size_t high = group_end;
+		while (low < high) {
+			const size_t mid = (low + high) / 2U;
+			if (dev_descr[dev_descr_sorted[mid]].idcode < (idcode & mask))
+				low = mid + 1U;
+			else
+				high = mid;
+		}
+		if (low < group_end && dev_descr[dev_descr_sorted[low]].idcode == (idcode & mask) &&
+			dev_descr_sorted[low] < match)
+			match = dev_descr_sorted[low];
+		group = group_end;
+	}
+	return match < DEV_DESCR_COUNT ? &dev_descr[match] : NULL;
+}
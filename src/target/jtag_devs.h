@@ -29,4 +29,7 @@ typedef const struct jtag_dev_descr_s {
 } jtag_dev_descr_t;
 extern jtag_dev_descr_t dev_descr[];
 
+/* The first entry of dev_descr[] the IDCODE matches, or NULL */
+jtag_dev_descr_t *jtag_dev_descr_find(uint32_t idcode);
+
 #endif /* TARGET_JTAG_DEVS_H */
@@ -37,15 +37,38 @@ uint32_t jtag_dev_count = 0;
 /* bucket of ones for don't care TDI */
 static const uint8_t ones[] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
 
-#if PC_HOSTED == 0
+/*
+ * An IR or DR access as one sequence with TMS for every cycle: from
+ * Run-Test/Idle to Shift-IR or Shift-DR, the bypass bits of the devices
+ * before the one accessed, its own bits, the bypass bits of those after and
+ * back to Run-Test/Idle. Everything but the device's own TDI bits depends only
+ * on the device and the access, so the last template built is kept and the
+ * run of accesses to one DP that is the norm only fills those bits in.
+ */
+#define JTAG_SCAN_MAX_CYCLES 512U
+
+typedef struct jtag_scan_template {
+	uint8_t tms[JTAG_SCAN_MAX_CYCLES / 8U];
+	uint8_t tdi[JTAG_SCAN_MAX_CYCLES / 8U];
+	size_t cycles;
+	/* Where the device's own bits start, and the access the template is for */
+	size_t offset;
+	size_t length;
+	uint8_t jd_index;
+	bool ir;
+	bool valid;
+} jtag_scan_template_s;
+
+static jtag_scan_template_s jtag_scan_template;
+
 void jtag_add_device(const uint32_t dev_index, const jtag_dev_t *jtag_dev)
 {
 	if (dev_index == 0)
 		memset(&jtag_devs, 0, sizeof(jtag_devs));
 	memcpy(&jtag_devs[dev_index], jtag_dev, sizeof(jtag_dev_t));
 	jtag_dev_count = dev_index + 1;
+	jtag_scan_template.valid = false;
 }
-#endif
 
 /* Scan JTAG chain for devices, store IR length and IDCODE (if present).
  * Reset TAP state machine.
@@ -60,9 +83,10 @@ void jtag_add_device(const uint32_t dev_index, const jtag_dev_t *jtag_dev)
  * Check this against device count obtained by IR scan above.
  *
  * Reset the TAP state machine again. This should load all IRs with IDCODE.
- * For each device, shift out one bit. If this is zero IDCODE isn't present,
- *	continue to next device. If this is one shift out the remaining 31 bits
- *	of the IDCODE register.
+ * Shift out enough of the DR chain for every device to have an IDCODE in one
+ *	go, then walk the bits: for each device, if the first bit is zero IDCODE
+ *	isn't present and the device took one bit of BYPASS, otherwise it and the
+ *	next 31 bits are the IDCODE register.
  */
 uint32_t jtag_scan(const uint8_t *irlens)
 {
@@ -70,6 +94,7 @@ uint32_t jtag_scan(const uint8_t *irlens)
 
 	jtag_dev_count = 0;
 	memset(&jtag_devs, 0, sizeof(jtag_devs));
+	jtag_scan_template.valid = false;
 
 	/* Run throught the SWD to JTAG sequence for the case where an attached SWJ-DP is
 	 * in SW-DP mode.
@@ -85,6 +110,30 @@ uint32_t jtag_scan(const uint8_t *irlens)
 #endif
 	jtag_proc.jtagtap_reset();
 
+	/*
+	 * After reset every TAP holds IDCODE or BYPASS in DR, so the first 64 bits
+	 * out of the chain start with a 0 (BYPASS) or an IDCODE, which is neither
+	 * all ones nor all zeros. A line stuck either way means nothing is there,
+	 * and saves the IR scan walking its full length one bit at a time.
+	 */
+	if (!irlens) {
+		uint8_t signature[sizeof(ones)];
+		jtagtap_shift_dr();
+		jtag_proc.jtagtap_tdi_tdo_seq(signature, true, ones, sizeof(ones) * 8U);
+		jtagtap_return_idle(1);
+		bool all_ones = true;
+		bool all_zeros = true;
+		for (size_t i = 0; i < sizeof(signature); ++i) {
+			all_ones &= signature[i] == 0xffU;
+			all_zeros &= signature[i] == 0U;
+		}
+		if (all_ones || all_zeros) {
+			DEBUG_WARN("jtag_scan: TDO stuck %s, no devices\n", all_ones ? "high" : "low");
+			return 0;
+		}
+		jtag_proc.jtagtap_reset();
+	}
+
 	if (irlens) {
 		DEBUG_WARN("Given list of IR lengths, skipping probe\n");
 		DEBUG_INFO("Change state to Shift-IR\n");
@@ -184,15 +233,21 @@ uint32_t jtag_scan(const uint8_t *irlens)
 	jtag_proc.jtagtap_reset();
 	jtagtap_shift_dr();
 	/* Now shift out the ID codes for all the attached devices. */
-	for (size_t device = 0; device < jtag_dev_count; ++device) {
-		if (!jtag_proc.jtagtap_next(false, true))
+	uint8_t idcode_tdi[JTAG_MAX_DEVS * 4U];
+	uint8_t idcodes[JTAG_MAX_DEVS * 4U];
+	memset(idcode_tdi, 0xff, sizeof(idcode_tdi));
+	jtag_proc.jtagtap_tdi_tdo_seq(idcodes, false, idcode_tdi, jtag_dev_count * 32U);
+	for (size_t device = 0, bit = 0; device < jtag_dev_count; ++device) {
+		if (!(idcodes[bit >> 3U] & (1U << (bit & 7U)))) {
+			++bit;
 			continue;
-		jtag_devs[device].jd_idcode = 1U;
-		for (size_t bit = 1; bit < 32; ++bit) {
-			if (jtag_proc.jtagtap_next(false, true))
-				jtag_devs[device].jd_idcode |= 1U << bit;
 		}
-
+		uint32_t idcode = 0;
+		for (size_t idcode_bit = 0; idcode_bit < 32U; ++idcode_bit, ++bit) {
+			if (idcodes[bit >> 3U] & (1U << (bit & 7U)))
+				idcode |= 1U << idcode_bit;
+		}
+		jtag_devs[device].jd_idcode = idcode;
 	}
 	DEBUG_INFO("Return to Run-Test/Idle\n");
 	jtag_proc.jtagtap_next(true, true);
@@ -204,33 +259,105 @@ uint32_t jtag_scan(const uint8_t *irlens)
 		platform_add_jtag_dev(device, jtag_devs + device);
 #endif
 
-	for (size_t device = 0; device < jtag_dev_count; ++device) {
+	/* Check for known devices and handle accordingly */
+	for (size_t device = 0; device < jtag_dev_count; device++) {
 		DEBUG_INFO("IDCode 0x%08" PRIx32, jtag_devs[device].jd_idcode);
-		for (size_t descr = 0; dev_descr[descr].idcode; ++descr) {
-			if ((jtag_devs[device].jd_idcode & dev_descr[descr].idmask) == dev_descr[descr].idcode) {
-				DEBUG_INFO(": %s", dev_descr[descr].descr ? dev_descr[descr].descr : "Unknown");
-				break;
-			}
-		}
+		jtag_dev_descr_t *const descr = jtag_dev_descr_find(jtag_devs[device].jd_idcode);
+		if (descr)
+			DEBUG_INFO(": %s", descr->descr ? descr->descr : "Unknown");
 		DEBUG_INFO("\n");
+		if (!descr)
+			continue;
+		jtag_devs[device].current_ir = UINT32_MAX;
+		/* Save description in table */
+		jtag_devs[device].jd_descr = descr->descr;
+		/* Call handler to initialise/probe device further */
+		if (descr->handler)
+			descr->handler(device);
 	}
 
-	/* Check for known devices and handle accordingly */
-	for (size_t device = 0; device < jtag_dev_count; device++) {
-		for (size_t descr = 0; dev_descr[descr].idcode; descr++) {
-			if ((jtag_devs[device].jd_idcode & dev_descr[descr].idmask) == dev_descr[descr].idcode) {
-				jtag_devs[device].current_ir = UINT32_MAX;
-				/* Save description in table */
-				jtag_devs[device].jd_descr = dev_descr[descr].descr;
-				/* Call handler to initialise/probe device further */
-				if (dev_descr[descr].handler)
-					dev_descr[descr].handler(device);
-				break;
-			}
-		}
+	return jtag_dev_count;
+}
+
+static void jtag_scan_bit_set(uint8_t *const data, const size_t bit, const bool value)
+{
+	if (value)
+		data[bit >> 3U] |= 1U << (bit & 7U);
+	else
+		data[bit >> 3U] &= ~(1U << (bit & 7U));
+}
+
+/* Appends count cycles of the TMS states, LSB first, with TDI high */
+static void jtag_scan_tms(jtag_scan_template_s *const scan, const uint32_t tms_states, const size_t count)
+{
+	for (size_t i = 0; i < count; ++i, ++scan->cycles) {
+		jtag_scan_bit_set(scan->tms, scan->cycles, tms_states & (1U << i));
+		jtag_scan_bit_set(scan->tdi, scan->cycles, true);
 	}
+}
 
-	return jtag_dev_count;
+/* Appends count cycles of shifting ones, TMS high on the last if final_tms */
+static void jtag_scan_bypass(jtag_scan_template_s *const scan, const size_t count, const bool final_tms)
+{
+	for (size_t i = 0; i < count; ++i, ++scan->cycles) {
+		jtag_scan_bit_set(scan->tms, scan->cycles, final_tms && i == count - 1U);
+		jtag_scan_bit_set(scan->tdi, scan->cycles, true);
+	}
+}
+
+static const jtag_scan_template_s *jtag_scan_template_get(const uint8_t jd_index, const bool ir, const size_t length)
+{
+	jtag_scan_template_s *const scan = &jtag_scan_template;
+	if (scan->valid && scan->jd_index == jd_index && scan->ir == ir && scan->length == length)
+		return scan;
+	const jtag_dev_t *const d = &jtag_devs[jd_index];
+	const size_t prescan = ir ? d->ir_prescan : d->dr_prescan;
+	const size_t postscan = ir ? d->ir_postscan : d->dr_postscan;
+	/* Shift-IR is 4 cycles away, Shift-DR 3, and Run-Test/Idle 2 from the end of the shift */
+	if (!length || (ir ? 4U : 3U) + prescan + length + postscan + 2U > JTAG_SCAN_MAX_CYCLES)
+		return NULL;
+
+	memset(scan, 0, sizeof(*scan));
+	if (ir)
+		jtag_scan_tms(scan, 0x03U, 4U);
+	else
+		jtag_scan_tms(scan, 0x01U, 3U);
+	jtag_scan_bypass(scan, prescan, false);
+	scan->offset = scan->cycles;
+	jtag_scan_bypass(scan, length, !postscan);
+	jtag_scan_bypass(scan, postscan, true);
+	jtag_scan_tms(scan, 0x01U, 2U);
+	scan->length = length;
+	scan->jd_index = jd_index;
+	scan->ir = ir;
+	scan->valid = true;
+	return scan;
+}
+
+/* Runs an access through jtagtap_tms_tdi_tdo_seq(), false if the adaptor or the template can't take it */
+static bool jtag_scan_access(jtag_proc_t *const jp, const uint8_t jd_index, const bool ir, uint8_t *const dout,
+	const uint8_t *const din, const size_t length)
+{
+	if (!jp->jtagtap_tms_tdi_tdo_seq)
+		return false;
+	const jtag_scan_template_s *const scan = jtag_scan_template_get(jd_index, ir, length);
+	if (!scan)
+		return false;
+
+	uint8_t tdi[JTAG_SCAN_MAX_CYCLES / 8U];
+	memcpy(tdi, scan->tdi, sizeof(tdi));
+	for (size_t i = 0; i < length; ++i)
+		jtag_scan_bit_set(tdi, scan->offset + i, !din || din[i >> 3U] & (1U << (i & 7U)));
+	uint8_t tdo[JTAG_SCAN_MAX_CYCLES / 8U];
+	jp->jtagtap_tms_tdi_tdo_seq(dout ? tdo : NULL, scan->tms, tdi, scan->cycles);
+	if (dout) {
+		memset(dout, 0, (length + 7U) >> 3U);
+		for (size_t i = 0; i < length; ++i) {
+			const size_t bit = scan->offset + i;
+			jtag_scan_bit_set(dout, i, tdo[bit >> 3U] & (1U << (bit & 7U)));
+		}
+	}
+	return true;
 }
 
 void jtag_dev_write_ir(jtag_proc_t *jp, const uint8_t jd_index, const uint32_t ir)
@@ -243,6 +370,8 @@ void jtag_dev_write_ir(jtag_proc_t *jp, const uint8_t jd_index, const uint32_t i
 		jtag_devs[device].current_ir = -1;
 	d->current_ir = ir;
 
+	if (jtag_scan_access(jp, jd_index, true, NULL, (const uint8_t *)&ir, d->ir_len))
+		return;
 	jtagtap_shift_ir();
 	jp->jtagtap_tdi_seq(false, ones, d->ir_prescan);
 	jp->jtagtap_tdi_seq(!d->ir_postscan, (const uint8_t *)&ir, d->ir_len);
@@ -254,6 +383,8 @@ void jtag_dev_shift_dr(
 	jtag_proc_t *jp, const uint8_t jd_index, uint8_t *dout, const uint8_t *din, const size_t clock_cycles)
 {
 	jtag_dev_t *d = &jtag_devs[jd_index];
+	if (jtag_scan_access(jp, jd_index, false, dout, din, clock_cycles))
+		return;
 	jtagtap_shift_dr();
 	jp->jtagtap_tdi_seq(false, ones, d->dr_prescan);
 	if (dout)
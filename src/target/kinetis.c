@@ -38,6 +38,7 @@
 #include "target.h"
 #include "target_internal.h"
 #include "adiv5.h"
+#include "cortexm.h"
 
 #define KINETIS_MDM_IDR_K22F 0x1c0000
 #define KINETIS_MDM_IDR_KZ03 0x1c0020
@@ -53,6 +54,20 @@
 #define MDM_CONTROL_MASS_ERASE (1 << 0)
 #define MDM_CONTROL_SYS_RESET  (1 << 3)
 
+/*
+ * Erase All Blocks timing from the Kinetis datasheets: around 70ms typical per
+ * 256kiB of flash, the worst case up to 8 times that. When the flash size can't
+ * be told the wait starts from a small part's time, the timeout from the largest.
+ */
+#define KINETIS_MDM_ERASE_BLOCK        0x40000U
+#define KINETIS_MDM_ERASE_US_PER_BLOCK 70000U
+#define KINETIS_MDM_ERASE_MARGIN       8U
+#define KINETIS_MDM_FLASH_TYPICAL      0x40000U
+#define KINETIS_MDM_FLASH_MAX          0x200000U
+/* The request is acknowledged within a few cycles of the MDM-AP clock */
+#define KINETIS_MDM_ACK_US             100U
+#define KINETIS_MDM_ACK_TIMEOUT_MS     500U
+
 #define SIM_SDID  0x40048024
 #define SIM_FCFG1 0x4004804C
 
@@ -74,6 +89,8 @@
 #define FTFx_FSTAT_FPVIOL   (1 << 4)
 #define FTFx_FSTAT_MGSTAT0  (1 << 0)
 
+#define FTFx_FCNFG_RAMRDY (1 << 1)
+
 #define FTFx_FSEC_KEYEN_MSK (0b11 << 6)
 #define FTFx_FSEC_KEYEN     (0b10 << 6)
 
@@ -84,6 +101,8 @@
 /* Part of the FTFE module for K64 */
 #define FTFx_CMD_PROGRAM_PHRASE  0x07
 #define FTFx_CMD_ERASE_SECTOR    0x09
+/* Programs from FlexRAM, FTFL and FTFE only */
+#define FTFx_CMD_PROGRAM_SECTION 0x0B
 #define FTFx_CMD_CHECK_ERASE_ALL 0x40
 #define FTFx_CMD_READ_ONCE       0x41
 #define FTFx_CMD_PROGRAM_ONCE    0x43
@@ -94,6 +113,13 @@
 /* 8 byte phrases need to be written to the k64 flash */
 #define K64_WRITE_LEN 8
 
+/*
+ * When FlexRAM is set up as RAM, Program Section programs a whole run of data staged
+ * in it with one command. Every part with FlexRAM has at least 1 KiB of it there.
+ */
+#define KINETIS_FLEXRAM_BASE           0x14000000U
+#define KINETIS_PROGRAM_SECTION_LENGTH 1024U
+
 static bool kinetis_cmd_unsafe(target *t, int argc, char **argv);
 
 const struct command_s kinetis_cmd_list[] = {
@@ -113,6 +139,7 @@ static bool kinetis_cmd_unsafe(target *t, int argc, char **argv)
 
 static bool kinetis_flash_cmd_erase(target_flash_s *f, target_addr_t addr, size_t len);
 static bool kinetis_flash_cmd_write(target_flash_s *f, target_addr_t dest, const void *src, size_t len);
+static bool kinetis_flash_cmd_blank(target_flash_s *f, target_addr_t addr, size_t len);
 static bool kinetis_flash_done(target_flash_s *f);
 
 struct kinetis_flash {
@@ -123,7 +150,7 @@ struct kinetis_flash {
 static void kinetis_add_flash(
 	target *const t, const uint32_t addr, const size_t length, const size_t erasesize, const size_t write_len)
 {
-	struct kinetis_flash *kf = calloc(1, sizeof(*kf));
+	struct kinetis_flash *kf = target_arena_calloc(sizeof(*kf));
 	target_flash_s *f;
 
 	if (!kf) { /* calloc failed: heap exhaustion */
@@ -137,6 +164,7 @@ static void kinetis_add_flash(
 	f->blocksize = erasesize;
 	f->erase = kinetis_flash_cmd_erase;
 	f->write = kinetis_flash_cmd_write;
+	f->blank_check = kinetis_flash_cmd_blank;
 	f->done = kinetis_flash_done;
 	f->erased = 0xff;
 	kf->write_len = write_len;
@@ -448,6 +476,18 @@ static bool kinetis_flash_cmd_erase(target_flash_s *const f, target_addr_t addr,
 	return true;
 }
 
+/* Have the controller check a sector reads all 1s, at normal read margin */
+static bool kinetis_flash_cmd_blank(target_flash_s *const f, const target_addr_t addr, const size_t len)
+{
+	const struct kinetis_flash *const kf = (struct kinetis_flash *)f;
+	/* The count of write units goes in FCCOB4:5, the margin choice in FCCOB6 */
+	const uint32_t units = (len / kf->write_len) << 16U;
+	if (!kinetis_fccob_cmd(f->t, FTFx_CMD_CHECK_ERASE, addr, &units, 1))
+		return false;
+	/* MGSTAT0 flags a location that isn't erased */
+	return !(target_mem_read8(f->t, FTFx_FSTAT) & FTFx_FSTAT_MGSTAT0);
+}
+
 static bool kinetis_flash_cmd_write(target_flash_s *f, target_addr_t dest, const void *src, size_t len)
 {
 	struct kinetis_flash *const kf = (struct kinetis_flash *)f;
@@ -464,6 +504,22 @@ static bool kinetis_flash_cmd_write(target_flash_s *f, target_addr_t dest, const
 	else
 		write_cmd = FTFx_CMD_PROGRAM_LONGWORD;
 
+	/* FTFA parts have no FlexRAM and read RAMRDY as 0, as do parts using it for EEPROM */
+	if (len % kf->write_len == 0 && (target_mem_read8(f->t, FTFx_FCNFG) & FTFx_FCNFG_RAMRDY)) {
+		while (len) {
+			const size_t section_len = MIN(len, KINETIS_PROGRAM_SECTION_LENGTH);
+			target_mem_write(f->t, KINETIS_FLEXRAM_BASE, src, section_len);
+			/* The count of write units goes in FCCOB4:5 */
+			const uint32_t units = (section_len / kf->write_len) << 16U;
+			if (!kinetis_fccob_cmd(f->t, FTFx_CMD_PROGRAM_SECTION, dest, &units, 1))
+				return false;
+			len -= section_len;
+			dest += section_len;
+			src += section_len;
+		}
+		return true;
+	}
+
 	while (len) {
 		if (!kinetis_fccob_cmd(f->t, write_cmd, dest, src, kf->write_len >> 2U))
 			return false;
@@ -570,6 +626,49 @@ static bool kinetis_mdm_cmd_ke04_mode(target *t, int argc, const char **argv)
 	return true;
 }
 
+/* Flash found on the core behind the same DP, 0 if it wasn't probed, e.g. because the part is secured */
+static size_t kinetis_mdm_flash_size(const ADIv5_AP_t *const ap)
+{
+	size_t size = 0;
+	for (target *t = target_list; t; t = t->next) {
+		if (!target_is_cortexm(t) || cortexm_ap(t)->dp != ap->dp)
+			continue;
+		for (const target_flash_s *f = t->flash; f; f = f->next)
+			size += f->length;
+	}
+	return size;
+}
+
+static uint32_t kinetis_mdm_erase_us(const size_t flash_size)
+{
+	const size_t blocks = (flash_size + KINETIS_MDM_ERASE_BLOCK - 1U) / KINETIS_MDM_ERASE_BLOCK;
+	return MAX(blocks, 1U) * KINETIS_MDM_ERASE_US_PER_BLOCK;
+}
+
+/*
+ * Wait for the bits in mask of an MDM-AP register to read as value. The first
+ * poll comes after most of the expected time has passed, later ones back off
+ * from a fraction of it, so a long erase isn't hammered with SWD reads and a
+ * short one isn't overslept.
+ */
+static bool kinetis_mdm_wait(ADIv5_AP_t *const ap, const uint16_t reg, const uint32_t mask, const uint32_t value,
+	const uint32_t expected_us, const uint32_t timeout_ms)
+{
+	flash_wait_s wait;
+	target_flash_wait_init(&wait, expected_us);
+	platform_timeout timeout;
+	platform_timeout_set(&timeout, timeout_ms);
+	platform_timeout progress;
+	platform_timeout_set(&progress, 500);
+	while ((adiv5_ap_read(ap, reg) & mask) != value) {
+		if (platform_timeout_is_expired(&timeout))
+			return false;
+		target_flash_wait_poll(&wait);
+		target_print_progress(&progress);
+	}
+	return true;
+}
+
 static bool kinetis_mdm_mass_erase(target *t)
 {
 	ADIv5_AP_t *ap = t->priv;
@@ -578,8 +677,7 @@ static bool kinetis_mdm_mass_erase(target *t)
 	if (t->ke04_mode)
 		adiv5_ap_write(ap, MDM_CONTROL, MDM_CONTROL_SYS_RESET);
 
-	uint32_t status = adiv5_ap_read(ap, MDM_STATUS);
-	uint32_t control = adiv5_ap_read(ap, MDM_CONTROL);
+	const uint32_t status = adiv5_ap_read(ap, MDM_STATUS);
 	tc_printf(t, "Requesting mass erase (status = 0x%" PRIx32 ")\n", status);
 
 	/* This flag does not exist on KE04 */
@@ -601,20 +699,24 @@ static bool kinetis_mdm_mass_erase(target *t)
 		return false;
 	}
 
-	adiv5_ap_write(ap, MDM_CONTROL, MDM_CONTROL_MASS_ERASE);
-	platform_timeout timeout;
-	platform_timeout_set(&timeout, 500);
+	const size_t flash_size = kinetis_mdm_flash_size(ap);
+	const uint32_t erase_us = kinetis_mdm_erase_us(flash_size ? flash_size : KINETIS_MDM_FLASH_TYPICAL);
+	const uint32_t erase_timeout_ms =
+		(kinetis_mdm_erase_us(flash_size ? flash_size : KINETIS_MDM_FLASH_MAX) / 1000U) * KINETIS_MDM_ERASE_MARGIN;
 
-	do {
-		status = adiv5_ap_read(ap, MDM_STATUS);
-		target_print_progress(&timeout);
-	} while (!(status & MDM_STATUS_MASS_ERASE_ACK));
+	adiv5_ap_write(ap, MDM_CONTROL, MDM_CONTROL_MASS_ERASE);
+	if (!kinetis_mdm_wait(ap, MDM_STATUS, MDM_STATUS_MASS_ERASE_ACK, MDM_STATUS_MASS_ERASE_ACK,
+			KINETIS_MDM_ACK_US, KINETIS_MDM_ACK_TIMEOUT_MS)) {
+		tc_printf(t, "ERROR: Mass erase not acknowledged!\n");
+		return false;
+	}
 	tc_printf(t, "Mass erase acknowledged\n");
 
-	do {
-		control = adiv5_ap_read(ap, MDM_CONTROL);
-		target_print_progress(&timeout);
-	} while (!(control & MDM_CONTROL_MASS_ERASE));
+	/* The request bit stays set for as long as the erase runs */
+	if (!kinetis_mdm_wait(ap, MDM_CONTROL, MDM_CONTROL_MASS_ERASE, 0, erase_us, erase_timeout_ms)) {
+		tc_printf(t, "ERROR: Mass erase timed out!\n");
+		return false;
+	}
 	tc_printf(t, "Mass erase complete\n");
 
 	return true;
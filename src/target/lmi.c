@@ -29,8 +29,6 @@
 #include "target_internal.h"
 #include "cortexm.h"
 
-#define SRAM_BASE            0x20000000
-#define STUB_BUFFER_BASE     ALIGN(SRAM_BASE + sizeof(lmi_flash_write_stub), 4)
 
 #define BLOCK_SIZE           0x400
 
@@ -70,9 +68,14 @@ static const uint16_t lmi_flash_write_stub[] = {
 #include "flashstub/lmi.stub"
 };
 
+static const target_flash_stub_s lmi_flash_stub = {
+	.code = lmi_flash_write_stub,
+	.code_size = sizeof(lmi_flash_write_stub),
+};
+
 static void lmi_add_flash(target *t, size_t length)
 {
-	target_flash_s *f = calloc(1, sizeof(*f));
+	target_flash_s *f = target_arena_calloc(sizeof(*f));
 	if (!f) {			/* calloc failed: heap exhaustion */
 		DEBUG_WARN("calloc: failed in %s\n", __func__);
 		return;
@@ -83,6 +86,7 @@ static void lmi_add_flash(target *t, size_t length)
 	f->blocksize = 0x400;
 	f->erase = lmi_flash_erase;
 	f->write = lmi_flash_write;
+	f->stub = &lmi_flash_stub;
 	f->erased = 0xff;
 	target_add_flash(t, f);
 }
@@ -184,14 +188,8 @@ static bool lmi_flash_erase(target_flash_s *f, target_addr_t addr, const size_t
 
 static bool lmi_flash_write(target_flash_s *f, target_addr_t dest, const void *src, size_t len)
 {
-	target  *t = f->t;
-	target_check_error(t);
-	target_mem_write(t, SRAM_BASE, lmi_flash_write_stub, sizeof(lmi_flash_write_stub));
-	target_mem_write(t, STUB_BUFFER_BASE, src, len);
-	if (target_check_error(t))
-		return false;
-
-	return cortexm_run_stub(t, SRAM_BASE, dest, STUB_BUFFER_BASE, len, 0) == 0;
+	target_check_error(f->t);
+	return cortexm_flash_stub_write(f, dest, src, len, 0);
 }
 
 static bool lmi_mass_erase(target *t)
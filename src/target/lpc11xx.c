@@ -70,6 +70,8 @@ static void lpc11xx_add_flash(target *t, const uint32_t addr, const size_t len,
 	lf->iap_ram = IAP_RAM_BASE;
 	lf->iap_msp = IAP_RAM_BASE + MIN_RAM_SIZE - RAM_USAGE_FOR_IAP_ROUTINES;
 	lf->reserved_pages = reserved_pages;
+	/* Parts with more RAM can take bigger writes */
+	lpc_flash_fit_write_buffer(lf, RAM_USAGE_FOR_IAP_ROUTINES);
 }
 
 bool lpc11xx_probe(target *t)
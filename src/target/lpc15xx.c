@@ -64,6 +64,8 @@ static void lpc15xx_add_flash(target *t, uint32_t addr, size_t len, size_t erase
 	lf->iap_entry = IAP_ENTRYPOINT;
 	lf->iap_ram = IAP_RAM_BASE;
 	lf->iap_msp = IAP_RAM_BASE + MIN_RAM_SIZE - RAM_USAGE_FOR_IAP_ROUTINES;
+	/* Parts with more RAM can take bigger writes */
+	lpc_flash_fit_write_buffer(lf, RAM_USAGE_FOR_IAP_ROUTINES);
 }
 
 bool
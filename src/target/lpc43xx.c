@@ -23,6 +23,7 @@
 #include "target_internal.h"
 #include "cortexm.h"
 #include "lpc_common.h"
+#include "spi_nor.h"
 
 #define LPC43XX_CHIPID	0x40043200
 
@@ -45,15 +46,57 @@
 #define FLASH_NUM_BANK		2
 #define FLASH_NUM_SECTOR	15
 
+#define LPC43XX_SPIFI_BASE        0x40003000
+#define LPC43XX_SPIFI_CMD         (LPC43XX_SPIFI_BASE + 0x04)
+#define LPC43XX_SPIFI_ADDR        (LPC43XX_SPIFI_BASE + 0x08)
+#define LPC43XX_SPIFI_IDATA       (LPC43XX_SPIFI_BASE + 0x0c)
+#define LPC43XX_SPIFI_DATA        (LPC43XX_SPIFI_BASE + 0x14)
+#define LPC43XX_SPIFI_MCMD        (LPC43XX_SPIFI_BASE + 0x18)
+#define LPC43XX_SPIFI_STAT        (LPC43XX_SPIFI_BASE + 0x1c)
+#define LPC43XX_SPIFI_STAT_MCINIT (1U << 0)
+#define LPC43XX_SPIFI_STAT_CMD    (1U << 1)
+#define LPC43XX_SPIFI_STAT_RESET  (1U << 4)
+#define LPC43XX_SPIFI_CMD_DATALEN(x)        ((x) & 0x3fffU)
+#define LPC43XX_SPIFI_CMD_DOUT              (1U << 15)
+#define LPC43XX_SPIFI_CMD_INTLEN(x)         ((x) << 16)
+#define LPC43XX_SPIFI_CMD_FRAME_OPCODE_ONLY (1U << 21)
+#define LPC43XX_SPIFI_CMD_FRAME_3B_ADDR     (4U << 21)
+#define LPC43XX_SPIFI_CMD_OPCODE(x)         ((uint32_t)(x) << 24)
+#define LPC43XX_SPIFI_TIMEOUT     100U
+
+#define LPC43XX_SPIFI_MEMORY_BASE 0x14000000
+#define LPC43XX_CCU1_CLK_SPIFI_STAT 0x40051304
+#define LPC43XX_CCU_CLK_RUN         (1U << 0)
+
 static bool lpc43xx_cmd_reset(target *t, int argc, const char *argv[]);
 static bool lpc43xx_cmd_mkboot(target *t, int argc, const char *argv[]);
 static int lpc43xx_flash_init(target *t);
 static bool lpc43xx_flash_erase(target_flash_s *f, target_addr_t addr, size_t len);
 static bool lpc43xx_mass_erase(target *t);
+static bool lpc43xx_spifi_mass_erase(target *t);
+static bool lpc43xx_flashless_attach(target *t);
+static bool lpc43xx_enter_flash_mode(target *t);
+static bool lpc43xx_flashless_enter_flash_mode(target *t);
 static void lpc43xx_set_internal_clock(target *t);
 static void lpc43xx_wdt_set_period(target *t);
 static void lpc43xx_wdt_pet(target *t);
 
+/* What the SPIFI was doing in memory mode, to go back to it after flashing */
+typedef struct lpc43xx_spifi_flash {
+	spi_nor_flash_s nor;
+	uint32_t mcmd;
+	uint32_t idata;
+} lpc43xx_spifi_flash_s;
+
+static const uint16_t lpc43xx_spifi_write_stub[] = {
+#include "flashstub/lpc43xx_spifi.stub"
+};
+
+static const target_flash_stub_s lpc43xx_spifi_flash_stub = {
+	.code = lpc43xx_spifi_write_stub,
+	.code_size = sizeof(lpc43xx_spifi_write_stub),
+};
+
 const struct command_s lpc43xx_cmd_list[] = {
 	{"reset", lpc43xx_cmd_reset, "Reset target"},
 	{"mkboot", lpc43xx_cmd_mkboot, "Make flash bank bootable"},
@@ -106,6 +149,7 @@ bool lpc43xx_probe(target *t)
 				target_add_commands(t, lpc43xx_cmd_list, "LPC43xx");
 				target_add_ram(t, 0x1B080000, 0xE4F80000UL);
 				t->target_options |= CORTEXM_TOPT_INHIBIT_NRST;
+				t->enter_flash_mode = lpc43xx_enter_flash_mode;
 			}
 			break;
 		case 0x4100C200:
@@ -128,13 +172,144 @@ bool lpc43xx_probe(target *t)
 		default:
 			t->driver = "LPC43xx <Unknown>";
 		}
-		t->mass_erase = lpc43xx_mass_erase;
+		/* Enough of the local SRAM for the SPIFI loader, on the smallest parts too */
+		target_add_ram(t, 0x10000000, 0x18000);
+		target_add_ram(t, 0x10080000, 0xA000);
+		t->attach = lpc43xx_flashless_attach;
+		t->enter_flash_mode = lpc43xx_flashless_enter_flash_mode;
+		t->mass_erase = lpc43xx_spifi_mass_erase;
 		return true;
 	}
 
 	return false;
 }
 
+static bool lpc43xx_spifi_wait(target *const t, const uint32_t mask)
+{
+	platform_timeout timeout;
+	platform_timeout_set(&timeout, LPC43XX_SPIFI_TIMEOUT);
+	while (target_mem_read32(t, LPC43XX_SPIFI_STAT) & mask) {
+		if (target_check_error(t) || platform_timeout_is_expired(&timeout)) {
+			DEBUG_WARN("SPIFI: timed out with STAT %08" PRIx32 "\n", target_mem_read32(t, LPC43XX_SPIFI_STAT));
+			return false;
+		}
+	}
+	return true;
+}
+
+static void lpc43xx_spifi_command(target *const t, const uint16_t command, const target_addr_t address,
+	const uint8_t *const tx, uint8_t *const rx, const size_t length)
+{
+	uint32_t cmd = LPC43XX_SPIFI_CMD_OPCODE(command & SPI_NOR_OPCODE_MASK) | LPC43XX_SPIFI_CMD_DATALEN(length) |
+		LPC43XX_SPIFI_CMD_INTLEN((command & SPI_NOR_DUMMY_MASK) >> SPI_NOR_DUMMY_SHIFT);
+	if ((command & SPI_NOR_FRAME_MASK) == SPI_NOR_FRAME_OPCODE_3B_ADDR) {
+		target_mem_write32(t, LPC43XX_SPIFI_ADDR, address);
+		cmd |= LPC43XX_SPIFI_CMD_FRAME_3B_ADDR;
+	} else
+		cmd |= LPC43XX_SPIFI_CMD_FRAME_OPCODE_ONLY;
+	if (tx)
+		cmd |= LPC43XX_SPIFI_CMD_DOUT;
+	/* Dummy bytes are sent from IDATA */
+	target_mem_write32(t, LPC43XX_SPIFI_IDATA, 0);
+	target_mem_write32(t, LPC43XX_SPIFI_CMD, cmd);
+	for (size_t i = 0; i < length; ++i) {
+		if (tx)
+			target_mem_write8(t, LPC43XX_SPIFI_DATA, tx[i]);
+		else
+			rx[i] = target_mem_read8(t, LPC43XX_SPIFI_DATA);
+	}
+	lpc43xx_spifi_wait(t, LPC43XX_SPIFI_STAT_CMD);
+}
+
+static void lpc43xx_spifi_read(spi_nor_flash_s *const flash, const uint16_t command, const target_addr_t address,
+	void *const buffer, const size_t length)
+{
+	lpc43xx_spifi_command(flash->f.t, command, address, NULL, (uint8_t *)buffer, length);
+}
+
+static void lpc43xx_spifi_write(spi_nor_flash_s *const flash, const uint16_t command, const target_addr_t address,
+	const void *const buffer, const size_t length)
+{
+	lpc43xx_spifi_command(flash->f.t, command, address, (const uint8_t *)buffer, NULL, length);
+}
+
+/* Commands can only be sent once memory mode is left, which takes a reset of the controller */
+static bool lpc43xx_spifi_prepare(spi_nor_flash_s *const flash)
+{
+	target *const t = flash->f.t;
+	target_mem_write32(t, LPC43XX_SPIFI_STAT, LPC43XX_SPIFI_STAT_RESET);
+	return lpc43xx_spifi_wait(t, LPC43XX_SPIFI_STAT_RESET);
+}
+
+static bool lpc43xx_spifi_done(spi_nor_flash_s *const flash)
+{
+	const lpc43xx_spifi_flash_s *const spifi = (lpc43xx_spifi_flash_s *)flash;
+	target *const t = flash->f.t;
+	const bool result = lpc43xx_spifi_wait(t, LPC43XX_SPIFI_STAT_CMD);
+	/* Writing MCMD is what puts the controller back in memory mode */
+	target_mem_write32(t, LPC43XX_SPIFI_IDATA, spifi->idata);
+	target_mem_write32(t, LPC43XX_SPIFI_MCMD, spifi->mcmd);
+	return result && !target_check_error(t);
+}
+
+static const spi_nor_bus_s lpc43xx_spifi_bus = {
+	.read = lpc43xx_spifi_read,
+	.write = lpc43xx_spifi_write,
+	.prepare = lpc43xx_spifi_prepare,
+	.done = lpc43xx_spifi_done,
+	.stub = &lpc43xx_spifi_flash_stub,
+};
+
+/*
+ * The pins, clock and read command are board specific, so the SPIFI is only
+ * used when the boot ROM or firmware has put it in memory mode already.
+ */
+static void lpc43xx_spifi_add_flash(target *const t)
+{
+	if (!(target_mem_read32(t, LPC43XX_CCU1_CLK_SPIFI_STAT) & LPC43XX_CCU_CLK_RUN) ||
+		!(target_mem_read32(t, LPC43XX_SPIFI_STAT) & LPC43XX_SPIFI_STAT_MCINIT) ||
+		target_flash_for_addr(t, LPC43XX_SPIFI_MEMORY_BASE))
+		return;
+
+	lpc43xx_spifi_flash_s *const spifi = target_arena_calloc(sizeof(*spifi));
+	if (!spifi) { /* calloc failed: heap exhaustion */
+		DEBUG_WARN("calloc: failed in %s\n", __func__);
+		return;
+	}
+	spifi->nor.bus = &lpc43xx_spifi_bus;
+	spifi->nor.regbase = LPC43XX_SPIFI_BASE;
+	spifi->mcmd = target_mem_read32(t, LPC43XX_SPIFI_MCMD);
+	spifi->idata = target_mem_read32(t, LPC43XX_SPIFI_IDATA);
+	if (!spi_nor_add_flash(t, &spifi->nor, LPC43XX_SPIFI_MEMORY_BASE, 0))
+		target_arena_free(spifi);
+}
+
+static bool lpc43xx_flashless_attach(target *const t)
+{
+	if (!cortexm_attach(t))
+		return false;
+	lpc43xx_spifi_add_flash(t);
+	return true;
+}
+
+/*
+ * Flashless parts run from the SPIFI, which a reset leaves to the boot ROM to
+ * set up again, so flashing starts from the halted core as it is.
+ */
+static bool lpc43xx_flashless_enter_flash_mode(target *const t)
+{
+	lpc43xx_wdt_set_period(t);
+	return true;
+}
+
+static bool lpc43xx_spifi_mass_erase(target *const t)
+{
+	const target_flash_s *const f = target_flash_for_addr(t, LPC43XX_SPIFI_MEMORY_BASE);
+	if (!f)
+		return false;
+	return target_flash_erase(t, f->start, f->length) && target_flash_complete(t);
+}
+
 /* Reset all major systems _except_ debug */
 static bool lpc43xx_cmd_reset(target *t, int argc, const char *argv[])
 {
@@ -170,6 +345,16 @@ static bool lpc43xx_mass_erase(target *t)
 	return true;
 }
 
+/*
+ * The IAP environment is set up once for the whole flash session: the reset
+ * that starts it is the only thing that undoes it.
+ */
+static bool lpc43xx_enter_flash_mode(target *const t)
+{
+	target_reset(t);
+	return lpc43xx_flash_init(t) == 0;
+}
+
 static int lpc43xx_flash_init(target *t)
 {
 	/* Deal with WDT */
@@ -188,7 +373,7 @@ static int lpc43xx_flash_init(target *t)
 
 static bool lpc43xx_flash_erase(target_flash_s *f, target_addr_t addr, size_t len)
 {
-	if (lpc43xx_flash_init(f->t))
+	if (!f->t->flash_mode && lpc43xx_flash_init(f->t))
 		return false;
 
 	return lpc_flash_erase(f, addr, len);
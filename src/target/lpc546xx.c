@@ -59,6 +59,7 @@ static bool lpc546xx_cmd_write_sector(target *t, int argc, const char *argv[]);
 
 static void lpc546xx_reset_attach(target *t);
 static int lpc546xx_flash_init(target *t);
+static bool lpc546xx_enter_flash_mode(target *t);
 static bool lpc546xx_flash_erase(target_flash_s *f, target_addr_t addr, size_t len);
 static bool lpc546xx_mass_erase(target *t);
 static void lpc546xx_wdt_set_period(target *t);
@@ -155,6 +156,7 @@ bool lpc546xx_probe(target *t)
 	}
 
 	t->mass_erase = lpc546xx_mass_erase;
+	t->enter_flash_mode = lpc546xx_enter_flash_mode;
 	lpc546xx_add_flash(t, IAP_ENTRYPOINT_LOCATION, 0, 0x0, flash_size, 0x8000);
 
 	/* Note: upper 96kB is only usable after enabling the appropriate control
@@ -301,9 +303,18 @@ static int lpc546xx_flash_init(target *t)
 	return 0;
 }
 
+/*
+ * The reset and clock setup the IAP needs are done once for the whole flash
+ * session, instead of ahead of every erase
+ */
+static bool lpc546xx_enter_flash_mode(target *t)
+{
+	return lpc546xx_flash_init(t) == 0;
+}
+
 static bool lpc546xx_flash_erase(target_flash_s *tf, target_addr_t addr, size_t len)
 {
-	if (lpc546xx_flash_init(tf->t))
+	if (!tf->t->flash_mode && lpc546xx_flash_init(tf->t))
 		return false;
 
 	return lpc_flash_erase(tf, addr, len);
@@ -74,7 +74,7 @@ static bool lpc_flash_write(target_flash_s *tf, target_addr_t dest, const void *
 
 struct lpc_flash *lpc_add_flash(target *t, target_addr_t addr, size_t length)
 {
-	struct lpc_flash *lf = calloc(1, sizeof(*lf));
+	struct lpc_flash *lf = target_arena_calloc(sizeof(*lf));
 	target_flash_s *f;
 
 	if (!lf) {			/* calloc failed: heap exhaustion */
@@ -92,6 +92,32 @@ struct lpc_flash *lpc_add_flash(target *t, target_addr_t addr, size_t length)
 	return lf;
 }
 
+/*
+ * Use the largest program size IAP accepts that fits in the RAM holding iap_ram,
+ * between the parameter block and the IAP stack below the RAM the ROM reserves.
+ * The RAM has to have been added to the target already.
+ */
+void lpc_flash_fit_write_buffer(struct lpc_flash *lf, const size_t iap_reserved_ram)
+{
+	static const size_t program_sizes[] = {4096U, 1024U, 512U, 256U};
+	const target *const t = lf->f.t;
+	for (const struct target_ram *r = t->ram; r; r = r->next) {
+		if (lf->iap_ram < r->start || lf->iap_ram >= r->start + r->length)
+			continue;
+		const uint32_t ram_end = r->start + r->length - iap_reserved_ram;
+		const uint32_t bufaddr = ALIGN(lf->iap_ram + sizeof(struct flash_param), 4);
+		for (size_t i = 0; i < ARRAY_LENGTH(program_sizes); ++i) {
+			const size_t size = program_sizes[i];
+			if (size > lf->f.blocksize || bufaddr + size + LPC_IAP_STACK_SIZE > ram_end)
+				continue;
+			lf->f.writesize = size;
+			lf->f.writebufsize = size;
+			lf->iap_msp = ram_end;
+			return;
+		}
+	}
+}
+
 static uint8_t lpc_sector_for_addr(struct lpc_flash *f, uint32_t addr)
 {
 	return f->base_sector + (addr - f->f.start) / f->f.blocksize;
@@ -113,17 +139,24 @@ enum iap_status lpc_iap_call(struct lpc_flash *f, void *result, enum iap_cmd cmd
 		.status = 0xdeadbeef, // to help us see if the IAP didn't execute
 	};
 
-	/* Pet WDT before each IAP call, if it is on */
-	if (f->wdt_kick)
+	/* In a flash session the WDT is pet once per erase or write instead, see lpc_flash_wdt_kick() */
+	if (f->wdt_kick && !t->flash_mode)
 		f->wdt_kick(t);
 
+	/*
+	 * The target is reset at the end of a flash session, so while in one there
+	 * is no need to save and restore the IAP RAM and registers around every call
+	 */
+	const bool preserve = !t->flash_mode;
+
 	/* save IAP RAM to restore after IAP call */
 	struct flash_param backup_param;
-	target_mem_read(t, &backup_param, f->iap_ram, sizeof(backup_param));
-
-	/* save registers to restore after IAP call */
 	uint32_t backup_regs[t->regs_size / sizeof(uint32_t)];
-	target_regs_read(t, backup_regs);
+	if (preserve) {
+		target_mem_read(t, &backup_param, f->iap_ram, sizeof(backup_param));
+		/* save registers to restore after IAP call */
+		target_regs_read(t, backup_regs);
+	}
 
 	/* fill out the remainder of the parameters */
 	va_list ap;
@@ -137,7 +170,12 @@ enum iap_status lpc_iap_call(struct lpc_flash *f, void *result, enum iap_cmd cmd
 
 	/* set up for the call to the IAP ROM */
 	uint32_t regs[t->regs_size / sizeof(uint32_t)];
-	target_regs_read(t, regs);
+	if (preserve)
+		target_regs_read(t, regs);
+	else {
+		memset(regs, 0, sizeof(regs));
+		regs[REG_XPSR] = CORTEXM_XPSR_THUMB;
+	}
 	regs[0] = f->iap_ram + offsetof(struct flash_param, command);
 	regs[1] = f->iap_ram + offsetof(struct flash_param, status);
 	regs[REG_MSP] = f->iap_msp;
@@ -159,8 +197,10 @@ enum iap_status lpc_iap_call(struct lpc_flash *f, void *result, enum iap_cmd cmd
 	target_mem_read(t, &param, f->iap_ram, sizeof(param));
 
 	/* restore the original data in RAM and registers */
-	target_mem_write(t, f->iap_ram, &backup_param, sizeof(param));
-	target_regs_write(t, backup_regs);
+	if (preserve) {
+		target_mem_write(t, f->iap_ram, &backup_param, sizeof(param));
+		target_regs_write(t, backup_regs);
+	}
 
 	/* if the user expected a result, set the result (16 bytes). */
 	if (result != NULL)
@@ -180,6 +220,17 @@ enum iap_status lpc_iap_call(struct lpc_flash *f, void *result, enum iap_cmd cmd
 	return param.status;
 }
 
+/*
+ * Pet the WDT, if it is on, ahead of the IAP calls making up one erase or write.
+ * The driver set its longest period when the flash session started, so a
+ * whole batch of calls fits in it.
+ */
+static void lpc_flash_wdt_kick(struct lpc_flash *f)
+{
+	if (f->wdt_kick && f->f.t->flash_mode)
+		f->wdt_kick(f->f.t);
+}
+
 #define LPX80X_SECTOR_SIZE 0x400
 #define LPX80X_PAGE_SIZE    0x40
 
@@ -190,6 +241,7 @@ bool lpc_flash_erase(target_flash_s *tf, target_addr_t addr, size_t len)
 	const uint32_t end = lpc_sector_for_addr(f, addr + len - 1U);
 	uint32_t last_full_sector = end;
 
+	lpc_flash_wdt_kick(f);
 	if (lpc_iap_call(f, NULL, IAP_CMD_PREPARE, start, end, f->bank))
 		return false;
 
@@ -224,6 +276,7 @@ bool lpc_flash_erase(target_flash_s *tf, target_addr_t addr, size_t len)
 static bool lpc_flash_write(target_flash_s *tf, target_addr_t dest, const void *src, size_t len)
 {
 	struct lpc_flash *f = (struct lpc_flash *)tf;
+	lpc_flash_wdt_kick(f);
 	/* prepare... */
 	uint32_t sector = lpc_sector_for_addr(f, dest);
 	if (lpc_iap_call(f, NULL, IAP_CMD_PREPARE, sector, sector, f->bank)) {
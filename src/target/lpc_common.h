@@ -68,6 +68,9 @@ enum iap_status {
 /* CPU Frequency */
 #define CPU_CLK_KHZ 12000
 
+/* Stack the IAP routines are given below their own reserved RAM */
+#define LPC_IAP_STACK_SIZE 128U
+
 struct lpc_flash {
 	target_flash_s f;
 	uint8_t base_sector;
@@ -81,6 +84,7 @@ struct lpc_flash {
 };
 
 struct lpc_flash *lpc_add_flash(target *t, target_addr_t addr, size_t length);
+void lpc_flash_fit_write_buffer(struct lpc_flash *lf, size_t iap_reserved_ram);
 enum iap_status lpc_iap_call(struct lpc_flash *f, void *result, enum iap_cmd cmd, ...);
 bool lpc_flash_erase(target_flash_s *f, target_addr_t addr, size_t len);
 bool lpc_flash_write_magic_vect(target_flash_s *f, target_addr_t dest, const void *src, size_t len);
@@ -92,7 +92,7 @@
 #define SRAM_STACK_OFFSET 0x00000200u /* A bit less than 512 stack room */
 #define SRAM_STACK_PTR (SRAM_BASE + SRAM_STACK_OFFSET)
 #define SRAM_WRITE_BUFFER SRAM_STACK_PTR /* Buffer right above stack */
-#define SRAM_WRITE_BUF_SIZE 0x00000400u  /* Write 1024 bytes at a tima */
+#define SRAM_WRITE_BUF_SIZE SECTOR_SIZE  /* Write a whole sector at a time */
 
 /* Watchdog */
 #define WDT_A_WTDCTL 0x4000480Cu /* Control register for watchdog */
@@ -104,12 +104,16 @@ struct msp432_flash {
 	target_addr_t flash_protect_register; /* Address of the WEPROT register*/
 	target_addr_t FlashCtl_eraseSector;   /* Erase flash sector routine in ROM*/
 	target_addr_t FlashCtl_programMemory; /* Flash programming routine in ROM */
+	uint32_t saved_protect;               /* WEPROT before the flash session unprotected the bank */
+	uint32_t *regs;                       /* Core registers to call ROM with, set up once per flash session */
 };
 
 /* Flash operations */
 static bool msp432_sector_erase(target_flash_s *f, target_addr_t addr);
 static bool msp432_flash_erase(target_flash_s *f, target_addr_t addr, size_t len);
 static bool msp432_flash_write(target_flash_s *f, target_addr_t dest, const void *src, size_t len);
+static bool msp432_flash_prepare(target_flash_s *f);
+static bool msp432_flash_done(target_flash_s *f);
 
 /* Utility functions */
 /* Find the the target flash that conatins a specific address */
@@ -117,6 +121,10 @@ static target_flash_s *get_target_flash(target *t, target_addr_t addr);
 
 /* Call a subroutine in the MSP432 ROM (or anywhere else...)*/
 static void msp432_call_ROM(target *t, uint32_t address, uint32_t regs[]);
+/* Set up the watchdog, return breakpoint and stack for ROM calls */
+static void msp432_setup_ROM(target *t, uint32_t regs[]);
+/* Run a ROM routine with the registers and return set up by msp432_setup_ROM() */
+static void msp432_run_ROM(target *t, uint32_t address, uint32_t regs[]);
 
 /* Protect or unprotect the sector containing address */
 static inline uint32_t msp432_sector_unprotect(struct msp432_flash *mf, target_addr_t addr)
@@ -145,7 +153,7 @@ const struct command_s msp432_cmd_list[] = {
 
 static void msp432_add_flash(target *t, uint32_t addr, size_t length, target_addr_t prot_reg)
 {
-	struct msp432_flash *mf = calloc(1, sizeof(*mf));
+	struct msp432_flash *mf = target_arena_calloc(sizeof(*mf));
 	target_flash_s *f;
 	if (!mf) { /* calloc failed: heap exhaustion */
 		DEBUG_WARN("calloc: failed in %s\n", __func__);
@@ -158,6 +166,8 @@ static void msp432_add_flash(target *t, uint32_t addr, size_t length, target_add
 	f->blocksize = SECTOR_SIZE;
 	f->erase = msp432_flash_erase;
 	f->write = msp432_flash_write;
+	f->prepare = msp432_flash_prepare;
+	f->done = msp432_flash_done;
 	f->writesize = SRAM_WRITE_BUF_SIZE;
 	f->erased = 0xff;
 	target_add_flash(t, f);
@@ -221,6 +231,9 @@ bool msp432_probe(target *t)
 	/* Connect the optional commands */
 	target_add_commands(t, msp432_cmd_list, "MSP432P401x");
 
+	/* Out of reset the core runs from the 3MHz DCO */
+	adiv5_dp_idle_hint(cortexm_ap(t)->dp, ADIV5_IDLE_AFTER_LOW_POWER);
+
 	/* All done */
 	return true;
 }
@@ -274,7 +287,45 @@ static bool msp432_flash_erase(target_flash_s *f, target_addr_t addr, size_t len
 	return ret;
 }
 
-/* Program flash */
+/*
+ * Set up for a flash session: the watchdog and the ROM return breakpoint are
+ * seen to, the core registers read, and the whole bank unprotected, so each
+ * write is just its buffer and the ROM call.
+ */
+static bool msp432_flash_prepare(target_flash_s *f)
+{
+	struct msp432_flash *mf = (struct msp432_flash *)f;
+	target *t = f->t;
+
+	mf->regs = malloc(t->regs_size);
+	if (!mf->regs) { /* malloc failed: heap exhaustion */
+		DEBUG_WARN("malloc: failed in %s\n", __func__);
+		return false;
+	}
+	target_regs_read(t, mf->regs);
+	msp432_setup_ROM(t, mf->regs);
+
+	mf->saved_protect = target_mem_read32(t, mf->flash_protect_register);
+	target_mem_write32(t, mf->flash_protect_register, 0);
+	return true;
+}
+
+static bool msp432_flash_done(target_flash_s *f)
+{
+	struct msp432_flash *mf = (struct msp432_flash *)f;
+
+	/* Restore original protection */
+	target_mem_write32(f->t, mf->flash_protect_register, mf->saved_protect);
+	free(mf->regs);
+	mf->regs = NULL;
+	return true;
+}
+
+/*
+ * Program flash, a sector at a time. The ROM routine burst programs the
+ * buffer 16 bytes at a time when source and destination are aligned for it,
+ * which whole sectors always are.
+ */
 static bool msp432_flash_write(target_flash_s *f, target_addr_t dest, const void *src, size_t len)
 {
 	struct msp432_flash *mf = (struct msp432_flash *)f;
@@ -283,25 +334,15 @@ static bool msp432_flash_write(target_flash_s *f, target_addr_t dest, const void
 	/* Prepare RAM buffer in target */
 	target_mem_write(t, SRAM_WRITE_BUFFER, src, len);
 
-	/* Unprotect sector, len is always < SECTOR_SIZE */
-	uint32_t old_prot = msp432_sector_unprotect(mf, dest);
-
-	DEBUG_WARN("Flash protect: 0x%08"PRIX32"\n",
-			   target_mem_read32(t, mf->flash_protect_register));
-
 	/* Prepare input data */
-	uint32_t regs[t->regs_size / sizeof(uint32_t)]; // Use of VLA
-	target_regs_read(t, regs);
+	uint32_t *const regs = mf->regs;
 	regs[0] = SRAM_WRITE_BUFFER; // Address of buffer to be flashed in R0
 	regs[1] = dest;              // Flash address to be write to in R1
 	regs[2] = len;               // Size of buffer to be flashed in R2
 
-	DEBUG_INFO("Writing 0x%04" PRIX32 " bytes at 0x%08zu\n", dest, len);
+	DEBUG_INFO("Writing 0x%04zx bytes at 0x%08" PRIX32 "\n", len, dest);
 	/* Call ROM */
-	msp432_call_ROM(t, mf->FlashCtl_programMemory, regs);
-
-	/* Restore original protection */
-	target_mem_write32(t, mf->flash_protect_register, old_prot);
+	msp432_run_ROM(t, mf->FlashCtl_programMemory, regs);
 
 	DEBUG_INFO("ROM return value: %"PRIu32"\n", regs[0]);
 
@@ -359,8 +400,8 @@ static target_flash_s *get_target_flash(target *t, target_addr_t addr)
 	return f;
 }
 
-/* MSP432 ROM routine invocation */
-static void msp432_call_ROM(target *t, uint32_t address, uint32_t regs[])
+/* Everything a ROM call needs apart from its arguments */
+static void msp432_setup_ROM(target *t, uint32_t regs[])
 {
 	/* Kill watchdog */
 	target_mem_write16(t, WDT_A_WTDCTL, WDT_A_HOLD);
@@ -371,7 +412,21 @@ static void msp432_call_ROM(target *t, uint32_t address, uint32_t regs[])
 	/* Prepare registers */
 	regs[REG_MSP] = SRAM_STACK_PTR;    /* Stack space */
 	regs[REG_LR] = SRAM_CODE_BASE | 1; /* Return to beginning of SRAM CODE alias */
-	regs[REG_PC] = address;            /* Start at given address */
+}
+
+/* MSP432 ROM routine invocation */
+static void msp432_call_ROM(target *t, uint32_t address, uint32_t regs[])
+{
+	msp432_setup_ROM(t, regs);
+	msp432_run_ROM(t, address, regs);
+}
+
+static void msp432_run_ROM(target *t, uint32_t address, uint32_t regs[])
+{
+	regs[REG_PC] = address; /* Start at given address */
+	/* The ROM routines return to the breakpoint, so the stack and LR need putting back */
+	regs[REG_MSP] = SRAM_STACK_PTR;
+	regs[REG_LR] = SRAM_CODE_BASE | 1;
 	target_regs_write(t, regs);
 
 	/* Call ROM */
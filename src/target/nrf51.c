@@ -29,6 +29,7 @@
 
 static bool nrf51_flash_erase(target_flash_s *f, target_addr_t addr, size_t len);
 static bool nrf51_flash_write(target_flash_s *f, target_addr_t dest, const void *src, size_t len);
+static bool nrf51_flash_erase_write(target_flash_s *f, target_addr_t dest, const void *src, size_t len);
 static bool nrf51_mass_erase(target *t);
 
 static bool nrf51_cmd_erase_uicr(target *t, int argc, const char **argv);
@@ -100,10 +101,23 @@ const struct command_s nrf51_read_cmd_list[] = {
 #define NRF51_PAGE_SIZE 1024
 #define NRF52_PAGE_SIZE 4096
 
+/* Erased words are skipped, bit 0 of the parameter has the page at dest erased first */
+static const uint16_t nrf51_flash_write_stub[] = {
+#include "flashstub/nrf51.stub"
+};
+
+static const target_flash_stub_s nrf51_flash_stub = {
+	.code = nrf51_flash_write_stub,
+	.code_size = sizeof(nrf51_flash_write_stub),
+};
+
+#define NRF51_STUB_PARAM       (NRF51_NVMC + 0x500)
+#define NRF51_STUB_ERASE_FIRST 1U
+
 static void nrf51_add_flash(target *t,
                             uint32_t addr, size_t length, size_t erasesize)
 {
-	target_flash_s *f = calloc(1, sizeof(*f));
+	target_flash_s *f = target_arena_calloc(sizeof(*f));
 	if (!f) {			/* calloc failed: heap exhaustion */
 		DEBUG_WARN("calloc: failed in %s\n", __func__);
 		return;
@@ -114,6 +128,10 @@ static void nrf51_add_flash(target *t,
 	f->blocksize = erasesize;
 	f->erase = nrf51_flash_erase;
 	f->write = nrf51_flash_write;
+	/* The UICR is erased through its own register, not ERASEPAGE */
+	if (addr != NRF51_UICR)
+		f->erase_write = nrf51_flash_erase_write;
+	f->stub = &nrf51_flash_stub;
 	f->erased = 0xff;
 	target_add_flash(t, f);
 }
@@ -207,6 +225,10 @@ static bool nrf51_flash_write(target_flash_s *f, target_addr_t dest, const void
 {
 	target *t = f->t;
 
+	/* The stub runs the NVMC itself, READY included, and reads the data back */
+	if (cortexm_flash_stub_load(f))
+		return cortexm_flash_stub_write(f, dest, src, len, NRF51_STUB_PARAM);
+
 	/* Enable write */
 	target_mem_write32(t, NRF51_NVMC_CONFIG, NRF51_NVMC_CONFIG_WEN);
 	/* Poll for NVMC_READY */
@@ -223,6 +245,17 @@ static bool nrf51_flash_write(target_flash_s *f, target_addr_t dest, const void
 	return true;
 }
 
+/*
+ * Called for a page whose erase was put off until its data was known, so the
+ * erase, programming and verify of the page all happen in one stub run.
+ */
+static bool nrf51_flash_erase_write(target_flash_s *f, target_addr_t dest, const void *src, size_t len)
+{
+	if (cortexm_flash_stub_load(f))
+		return cortexm_flash_stub_write(f, dest, src, len, NRF51_STUB_PARAM | NRF51_STUB_ERASE_FIRST);
+	return nrf51_flash_erase(f, dest, len) && nrf51_flash_write(f, dest, src, len);
+}
+
 static bool nrf51_mass_erase(target *t)
 {
 	target_reset(t);
@@ -430,12 +463,22 @@ static bool nrf51_cmd_read(target *t, int argc, const char **argv)
 
 static bool nrf51_mdm_mass_erase(target *t);
 
-#define MDM_POWER_EN ADIV5_DP_REG(0x01)
-#define MDM_SELECT_AP ADIV5_DP_REG(0x02)
-#define MDM_STATUS  ADIV5_AP_REG(0x08)
-#define MDM_CONTROL ADIV5_AP_REG(0x04)
+/* CTRL-AP registers */
+#define MDM_RESET    ADIV5_AP_REG(0x00)
+#define MDM_CONTROL  ADIV5_AP_REG(0x04)
+#define MDM_STATUS   ADIV5_AP_REG(0x08)
 #define MDM_PROT_EN  ADIV5_AP_REG(0x0C)
 
+/* ERASEALL takes a few hundred ms, this leaves room for the slowest parts */
+#define MDM_ERASEALL_TIMEOUT_MS 10000U
+
+static bool nrf51_mdm_protected(ADIv5_AP_t *ap)
+{
+	/* The second read provides the true protection status */
+	adiv5_ap_read(ap, MDM_PROT_EN);
+	return !adiv5_ap_read(ap, MDM_PROT_EN);
+}
+
 bool nrf51_mdm_probe(ADIv5_AP_t *ap)
 {
 	switch(ap->idr) {
@@ -455,38 +498,62 @@ bool nrf51_mdm_probe(ADIv5_AP_t *ap)
 	t->priv = ap;
 	t->priv_free = (void*)adiv5_ap_unref;
 
-	uint32_t status = adiv5_ap_read(ap, MDM_PROT_EN);
-	status = adiv5_ap_read(ap, MDM_PROT_EN);
-	if (status)
-		t->driver = "Nordic nRF52 Access Port";
-	else
+	if (nrf51_mdm_protected(ap))
 		t->driver = "Nordic nRF52 Access Port (protected)";
+	else
+		t->driver = "Nordic nRF52 Access Port";
 	t->regs_size = 4;
 
 	return true;
 }
 
-static bool nrf51_mdm_mass_erase(target *t)
+/*
+ * Erase all of flash, UICR and RAM through the CTRL-AP, then pulse its soft
+ * reset so the part comes back up without APPROTECT and the AHB-AP works.
+ * Returns whether it came back unprotected.
+ */
+static bool nrf51_mdm_erase_all(ADIv5_AP_t *ap)
 {
-	ADIv5_AP_t *ap = t->priv;
-
-	uint32_t status = adiv5_ap_read(ap, MDM_STATUS);
-	adiv5_dp_write(ap->dp, MDM_POWER_EN, 0x50000000);
-	adiv5_dp_write(ap->dp, MDM_SELECT_AP, 0x01000000);
-	adiv5_ap_write(ap, MDM_CONTROL, 0x00000001);
+	adiv5_ap_write(ap, MDM_CONTROL, 1);
 
 	platform_timeout timeout;
-	platform_timeout_set(&timeout, 500);
-	// Read until 0, probably should have a timeout here...
-	do {
-		status = adiv5_ap_read(ap, MDM_STATUS);
-		target_print_progress(&timeout);
-	} while (status);
+	platform_timeout_set(&timeout, MDM_ERASEALL_TIMEOUT_MS);
+	platform_timeout progress;
+	platform_timeout_set(&progress, 500);
+	while (adiv5_ap_read(ap, MDM_STATUS)) {
+		if (platform_timeout_is_expired(&timeout)) {
+			DEBUG_WARN("nRF52: ERASEALL timed out\n");
+			return false;
+		}
+		target_print_progress(&progress);
+	}
 
-	// The second read will provide true prot status
-	status = adiv5_ap_read(ap, MDM_PROT_EN);
-	status = adiv5_ap_read(ap, MDM_PROT_EN);
+	adiv5_ap_write(ap, MDM_RESET, 1);
+	adiv5_ap_write(ap, MDM_RESET, 0);
+	adiv5_ap_write(ap, MDM_CONTROL, 0);
+	return !nrf51_mdm_protected(ap);
+}
 
-	// should we return the prot status here?
+static bool nrf51_mdm_mass_erase(target *t)
+{
+	return nrf51_mdm_erase_all(t->priv);
+}
+
+/*
+ * With scan_recover set, a protected part found while scanning is erased on
+ * the spot. The caller then walks the APs again, finding the now readable
+ * core as a normal target. The erase is only done once per request.
+ */
+bool nrf51_mdm_recover(ADIv5_AP_t *ap)
+{
+	if (!scan_recover || ap->idr != NRF52_MDM_IDR || !nrf51_mdm_protected(ap))
+		return false;
+	scan_recover = false;
+	DEBUG_WARN("nRF52: APPROTECT set, erasing all to recover\n");
+	if (!nrf51_mdm_erase_all(ap)) {
+		DEBUG_WARN("nRF52: still protected after ERASEALL\n");
+		return false;
+	}
+	DEBUG_INFO("nRF52: erased and unprotected, scanning again\n");
 	return true;
 }
@@ -103,6 +103,13 @@
 #define KE04_WRITE_LEN   8
 #define KE04_SECTOR_SIZE 0x200u
 
+/* Typical command times from the datasheet, to pace the status polls */
+#define KE04_PROGRAM_US      100u
+#define KE04_ERASE_SECTOR_US 5000u
+#define KE04_ERASE_ALL_US    5000u
+#define KE04_TIMEOUT_MARGIN  20u
+#define KE04_TIMEOUT_MIN_MS  100u
+
 /* Security byte */
 #define FLASH_SECURITY_BYTE_ADDRESS   0x0000040Eu
 #define FLASH_SECURITY_BYTE_UNSECURED 0xFEu
@@ -223,7 +230,7 @@ bool ke04_probe(target *t)
 	target_add_ram(t, RAM_BASE_ADDR, ramsize);           /* Higher RAM */
 
 	/* Add flash, all KE04 have same write and erase size */
-	target_flash_s *f = calloc(1, sizeof(*f));
+	target_flash_s *f = target_arena_calloc(sizeof(*f));
 	if (!f) { /* calloc failed: heap exhaustion */
 		DEBUG_WARN("calloc: failed in %s\n", __func__);
 		return false;
@@ -306,10 +313,27 @@ static bool ke04_command(target *t, uint8_t cmd, uint32_t addr, const uint8_t da
 	/* Enable execution by clearing CCIF */
 	target_mem_write8(t, FTMRE_FSTAT, FTMRE_FSTAT_CCIF);
 
+	uint32_t expected_us = 0;
+	if (cmd == CMD_PROGRAM_FLASH)
+		expected_us = KE04_PROGRAM_US;
+	else if (cmd == CMD_ERASE_FLASH_SECTOR)
+		expected_us = KE04_ERASE_SECTOR_US;
+	else if (cmd == CMD_ERASE_ALL_BLOCKS)
+		expected_us = KE04_ERASE_ALL_US;
+	flash_wait_s wait;
+	target_flash_wait_init(&wait, expected_us);
 	platform_timeout timeout;
 	platform_timeout_set(&timeout, 500);
+	/* Give up on a command that takes far longer than the datasheet allows for */
+	platform_timeout deadline;
+	platform_timeout_set(&deadline, MAX((expected_us / 1000U) * KE04_TIMEOUT_MARGIN, KE04_TIMEOUT_MIN_MS));
 	/* Wait for execution to complete */
 	do {
+		if (platform_timeout_is_expired(&deadline)) {
+			DEBUG_WARN("KE04 flash command 0x%02x timed out\n", cmd);
+			return false;
+		}
+		target_flash_wait_poll(&wait);
 		fstat = target_mem_read8(t, FTMRE_FSTAT);
 		/* Check ACCERR and FPVIOL are zero in FSTAT */
 		if (fstat & (FTMRE_FSTAT_ACCERR | FTMRE_FSTAT_FPVIOL))
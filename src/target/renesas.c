@@ -500,8 +500,13 @@ static bool renesas_rv40_done(target_flash_s *f)
 {
 	target *t = f->t;
 
+	/* A stub that stopped on an error leaves the sequencer to be recovered */
+	bool result = true;
+	if (f->stub_addr)
+		result = !renesas_rv40_error_check(t, RV40_FSTATR_PRGERR | RV40_FSTATR_ILGLERR);
+
 	/* return to read mode */
-	return renesas_rv40_pe_mode(t, PE_MODE_READ);
+	return renesas_rv40_pe_mode(t, PE_MODE_READ) && result;
 }
 
 /* !TODO: implement blank check */
@@ -563,6 +568,11 @@ static bool renesas_rv40_flash_write(target_flash_s *f, target_addr_t dest, cons
 	/* write size for code flash / data flash */
 	const uint8_t write_size = code_flash ? RV40_CF_WRITE_SIZE : RV40_DF_WRITE_SIZE;
 
+	/* The stub issues the FACI commands on the target, unit after unit */
+	if (f->stub && cortexm_flash_stub_load(f))
+		return cortexm_flash_stub_write(f, dest, src, len, write_size);
+
+	/* Otherwise stay in the P/E mode entered by prepare, checking for errors once at the end */
 	while (len) {
 		/* set block start address */
 		target_mem_write32(t, RV40_FSADDR, dest);
@@ -605,9 +615,18 @@ static bool renesas_rv40_flash_write(target_flash_s *f, target_addr_t dest, cons
 	return !renesas_rv40_error_check(t, RV40_FSTATR_PRGERR | RV40_FSTATR_ILGLERR);
 }
 
+static const uint16_t renesas_rv40_flash_write_stub[] = {
+#include "flashstub/renesas.stub"
+};
+
+static const target_flash_stub_s renesas_rv40_flash_stub = {
+	.code = renesas_rv40_flash_write_stub,
+	.code_size = sizeof(renesas_rv40_flash_write_stub),
+};
+
 static void renesas_add_rv40_flash(target *t, target_addr_t addr, size_t length)
 {
-	target_flash_s *f = calloc(1, sizeof(*f));
+	target_flash_s *f = target_arena_calloc(sizeof(*f));
 	if (!f) /* calloc failed: heap exhaustion */
 		return;
 
@@ -624,8 +643,11 @@ static void renesas_add_rv40_flash(target *t, target_addr_t addr, size_t length)
 	if (code_flash) {
 		f->blocksize = RV40_CF_REGION1_BLOCK_SIZE;
 		f->writebufsize = RV40_CF_WRITE_SIZE * 8U;
-		f->writesize = RV40_CF_WRITE_SIZE;
+		/* Whole buffers go to the stub, which splits them into write units */
+		f->writesize = f->writebufsize;
+		f->stub = &renesas_rv40_flash_stub;
 	} else {
+		/* Data flash buffers span several blocks, so only write what is there */
 		f->blocksize = RV40_DF_BLOCK_SIZE;
 		f->writebufsize = RV40_DF_BLOCK_SIZE * 8U;
 		f->writesize = RV40_DF_WRITE_SIZE;
@@ -754,14 +776,14 @@ bool renesas_probe(target *t)
 		if (renesas_pnr_read(t, RENESAS_FIXED2_PNR, pnr)) {
 			DEBUG_WARN("Found renesas chip (%.*s) with pnr location RENESAS_FIXED2_PNR and unsupported Part ID %" PRIx16
 					   " please report it\n",
-				sizeof(pnr), pnr, t->part_id);
+				(int)sizeof(pnr), pnr, t->part_id);
 			break;
 		}
 
 		if (renesas_pnr_read(t, RENESAS_FIXED1_PNR, pnr)) {
 			DEBUG_WARN("Found renesas chip (%.*s) with pnr location RENESAS_FIXED1_PNR and unsupported Part ID "
 					   "0x%" PRIx16 " please report it\n",
-				sizeof(pnr), pnr, t->part_id);
+				(int)sizeof(pnr), pnr, t->part_id);
 			break;
 		}
 
@@ -769,14 +791,14 @@ bool renesas_probe(target *t)
 		if (renesas_pnr_read(t, RENESAS_FMIFRT_PNR(flash_root_table), pnr)) {
 			DEBUG_WARN("Found renesas chip (%.*s) with Flash Root Table and unsupported Part ID 0x%" PRIx16 " "
 					   "please report it\n",
-				sizeof(pnr), pnr, t->part_id);
+				(int)sizeof(pnr), pnr, t->part_id);
 			break;
 		}
 
 		return false;
 	}
 
-	renesas_priv_s *priv_storage = calloc(1, sizeof(renesas_priv_s));
+	renesas_priv_s *priv_storage = target_arena_calloc(sizeof(renesas_priv_s));
 	if (!priv_storage) /* calloc failed: heap exhaustion */
 		return false;
 	memcpy(priv_storage->pnr, pnr, sizeof(pnr));
@@ -44,7 +44,7 @@
 #include "target.h"
 #include "target_internal.h"
 #include "cortexm.h"
-#include "sfdp.h"
+#include "spi_nor.h"
 
 #define RP_ID                 "Raspberry RP2040"
 #define RP_MAX_TABLE_SIZE     0x80U
@@ -55,6 +55,7 @@
 #define RP_XIP_FLASH_BASE     0x10000000U
 #define RP_SRAM_BASE          0x20000000U
 #define RP_SRAM_SIZE          0x42000U
+#define RP_CORES              2U
 
 #define RP_GPIO_QSPI_BASE_ADDR            0x40018000U
 #define RP_GPIO_QSPI_SCLK_CTRL            (RP_GPIO_QSPI_BASE_ADDR + 0x04U)
@@ -102,6 +103,7 @@
 #define RP_SSI_XIP_SPI_CTRL0_ADDRESS_LENGTH(x) (((x)*2U) << 2U)
 #define RP_SSI_XIP_SPI_CTRL0_INSTR_LENGTH_8b   (2U << 8U)
 #define RP_SSI_XIP_SPI_CTRL0_WAIT_CYCLES(x)    (((x)*8U) << 11U)
+#define RP_SSI_XIP_SPI_CTRL0_WAIT_CLOCKS(x)    ((x) << 11U)
 #define RP_SSI_XIP_SPI_CTRL0_XIP_CMD_SHIFT     24U
 #define RP_SSI_XIP_SPI_CTRL0_XIP_CMD(x)        ((x) << RP_SSI_XIP_SPI_CTRL0_XIP_CMD_SHIFT)
 #define RP_SSI_XIP_SPI_CTRL0_TRANS_1C1A        (0U << 0U)
@@ -131,37 +133,15 @@
 #define BOOTROM_FUNC_TABLE_ADDR      0x00000014U
 #define BOOTROM_FUNC_TABLE_TAG(x, y) ((uint8_t)(x) | ((uint8_t)(y) << 8U))
 
-#define FLASHSIZE_4K_SECTOR      (4U * 1024U)
-#define FLASHSIZE_32K_BLOCK      (32U * 1024U)
-#define FLASHSIZE_64K_BLOCK      (64U * 1024U)
-#define FLASHSIZE_32K_BLOCK_MASK ~(FLASHSIZE_32K_BLOCK - 1U)
-#define FLASHSIZE_64K_BLOCK_MASK ~(FLASHSIZE_64K_BLOCK - 1U)
 #define MAX_FLASH                (16U * 1024U * 1024U)
+/* Worst case for the largest block erases of common parts, per block */
+#define RP_ERASE_BLOCK_TIMEOUT   2000U
 #define MAX_WRITE_CHUNK          0x1000
-
-#define RP_SPI_OPCODE(x)            (x)
-#define RP_SPI_OPCODE_MASK          0x00ffU
-#define RP_SPI_INTER_SHIFT          8U
-#define RP_SPI_INTER_LENGTH(x)      (((x)&7U) << RP_SPI_INTER_SHIFT)
-#define RP_SPI_INTER_MASK           0x0700U
-#define RP_SPI_FRAME_OPCODE_ONLY    (1 << 11U)
-#define RP_SPI_FRAME_OPCODE_3B_ADDR (2 << 11U)
-#define RP_SPI_FRAME_MASK           0x1800U
-
-/* Instruction codes taken from Winbond W25Q16JV datasheet, as used on the
- * original Pico board from Raspberry Pi.
- * https://www.winbond.com/resource-files/w25q16jv%20spi%20revd%2008122016.pdf
- * All dev boards supported by Pico SDK V1.3.1 use SPI flash chips which support
- * these commands. Other custom boards using different SPI flash chips might
- * not support these commands
+/*
+ * Writes are gathered in target SRAM so a whole run of them is programmed with one
+ * ROM call. This leaves the top of SRAM for the stack the ROM calls run on.
  */
-
-#define SPI_FLASH_CMD_SECTOR_ERASE  0x20
-#define FLASHCMD_BLOCK32K_ERASE     0x52
-#define FLASHCMD_BLOCK64K_ERASE     0xd8
-#define FLASHCMD_CHIP_ERASE         0x60
-#define SPI_FLASH_CMD_READ_JEDEC_ID (RP_SPI_OPCODE(0x9fU) | RP_SPI_INTER_LENGTH(0) | RP_SPI_FRAME_OPCODE_ONLY)
-#define SPI_FLASH_CMD_READ_SFDP     (RP_SPI_OPCODE(0x5aU) | RP_SPI_INTER_LENGTH(1) | RP_SPI_FRAME_OPCODE_3B_ADDR)
+#define RP_WRITE_STAGING_SIZE    0x30000U
 
 typedef struct rp_priv {
 	uint16_t rom_debug_trampoline_begin;
@@ -175,15 +155,16 @@ typedef struct rp_priv {
 	uint16_t rom_reset_usb_boot;
 	bool is_prepared;
 	bool is_monitor;
+	uint8_t parked_cores; /* cores of this part halted for the flash to leave XIP mode, by group index */
+	uint32_t staged_dest; /* flash offset the data gathered in SRAM is for */
+	uint32_t staged_len;
+	/* Read the flash's SFDP offers for XIP, 03h with one lane when xip_lanes is 0 */
+	uint8_t xip_opcode;
+	uint8_t xip_lanes;
+	uint8_t xip_wait_cycles;
 	uint32_t regs[0x20]; /* Register playground*/
 } rp_priv_s;
 
-typedef struct rp_flash {
-	target_flash_s f;
-	uint32_t page_size;
-	uint8_t sector_erase_opcode;
-} rp_flash_s;
-
 static bool rp_cmd_erase_sector(target *t, int argc, const char **argv);
 static bool rp_cmd_reset_usb_boot(target *t, int argc, const char **argv);
 
@@ -195,13 +176,16 @@ const struct command_s rp_cmd_list[] = {
 
 static bool rp_flash_erase(target_flash_s *f, target_addr_t addr, size_t len);
 static bool rp_flash_write(target_flash_s *f, target_addr_t dest, const void *src, size_t len);
+static bool rp_flash_done(target_flash_s *f);
+static bool rp_flash_write_staged(target *t);
 
 static bool rp_read_rom_func_table(target *t);
 static bool rp_attach(target *t);
 static bool rp_flash_prepare(target *t);
 static bool rp_flash_resume(target *t);
-static void rp_spi_read(target *t, uint16_t command, target_addr_t address, void *buffer, size_t length);
-static uint32_t rp_get_flash_length(target *t);
+static void rp_spi_read(spi_nor_flash_s *flash, uint16_t command, target_addr_t address, void *buffer, size_t length);
+static void rp_spi_write(
+	spi_nor_flash_s *flash, uint16_t command, target_addr_t address, const void *buffer, size_t length);
 static bool rp_mass_erase(target *t);
 
 // Our own implementation of bootloader functions for handling flash chip
@@ -212,46 +196,86 @@ static void rp_flash_connect_internal(target *const t);
 static void rp_flash_flush_cache(target *const t);
 #endif
 
-static void rp_spi_read_sfdp(target *const t, const uint32_t address, void *const buffer, const size_t length)
+/*
+ * The other core runs from flash through XIP too, so it is halted while the
+ * flash is out of XIP mode and let go again afterwards if it had been running.
+ */
+static void rp_park_cores(target *const t)
+{
+	rp_priv_s *const ps = (rp_priv_s *)t->target_storage;
+	target *cores[RP_CORES];
+	const size_t count = target_group(t, cores, RP_CORES);
+	for (size_t i = 0; i < count; ++i) {
+		target_addr_t watch;
+		if (cores[i] == t || target_halt_poll(cores[i], &watch) != TARGET_HALT_RUNNING)
+			continue;
+		DEBUG_INFO("Parking core %u for flash access\n", (unsigned)i);
+		target_halt_request(cores[i]);
+		platform_timeout timeout;
+		platform_timeout_set(&timeout, 100);
+		while (target_halt_poll(cores[i], &watch) == TARGET_HALT_RUNNING && !platform_timeout_is_expired(&timeout))
+			continue;
+		ps->parked_cores |= 1U << i;
+	}
+}
+
+static void rp_unpark_cores(target *const t)
 {
-	rp_spi_read(t, SPI_FLASH_CMD_READ_SFDP, address, buffer, length);
+	rp_priv_s *const ps = (rp_priv_s *)t->target_storage;
+	target *cores[RP_CORES];
+	const size_t count = target_group(t, cores, RP_CORES);
+	for (size_t i = 0; i < count; ++i) {
+		if (ps->parked_cores & (1U << i))
+			target_halt_resume(cores[i], false);
+	}
+	ps->parked_cores = 0;
 }
 
+/* Programming goes through the ROM, the SSI is only driven directly for the commands it has no call for */
+static const spi_nor_bus_s rp_spi_bus = {
+	.read = rp_spi_read,
+	.write = rp_spi_write,
+};
+
 static void rp_add_flash(target *t)
 {
-	rp_flash_s *flash = calloc(1, sizeof(*flash));
+	spi_nor_flash_s *flash = target_arena_calloc(sizeof(*flash));
 	if (!flash) { /* calloc failed: heap exhaustion */
 		DEBUG_WARN("calloc: failed in %s\n", __func__);
 		return;
 	}
+	flash->f.t = t;
+	flash->bus = &rp_spi_bus;
+	flash->regbase = RP_SSI_BASE_ADDR;
 
+	rp_park_cores(t);
 	rp_flash_exit_xip(t);
 
-	spi_parameters_s spi_parameters;
-	if (!sfdp_read_parameters(t, &spi_parameters, rp_spi_read_sfdp)) {
-		/* SFDP readout failed, so make some assumptions and hope for the best. */
-		spi_parameters.page_size = 256U;
-		spi_parameters.sector_size = 4096U;
-		spi_parameters.capacity = rp_get_flash_length(t);
-		spi_parameters.sector_erase_opcode = SPI_FLASH_CMD_SECTOR_ERASE;
-	}
+	spi_nor_read_parameters(flash);
+	spi_parameters_s *const spi_parameters = &flash->params;
+	/* Without a size from SFDP or the ID, assume the whole XIP window */
+	if (!spi_parameters->capacity || spi_parameters->capacity > MAX_FLASH)
+		spi_parameters->capacity = MAX_FLASH;
 
+	rp_priv_s *const ps = (rp_priv_s *)t->target_storage;
+	ps->xip_opcode = spi_parameters->fast_read_opcode;
+	ps->xip_lanes = spi_parameters->fast_read_opcode ? spi_parameters->fast_read_lanes : 0U;
+	ps->xip_wait_cycles = spi_parameters->fast_read_wait_cycles;
 	rp_flash_enter_xip(t);
+	rp_unpark_cores(t);
 
-	DEBUG_INFO("Flash size: %uMiB\n", spi_parameters.capacity / (1024U * 1024U));
+	DEBUG_INFO("Flash size: %zuMiB\n", spi_parameters->capacity / (1024U * 1024U));
 
 	target_flash_s *const f = &flash->f;
 	f->start = RP_XIP_FLASH_BASE;
-	f->length = spi_parameters.capacity;
-	f->blocksize = spi_parameters.sector_size;
+	f->length = spi_parameters->capacity;
+	f->blocksize = spi_parameters->sector_size;
 	f->erase = rp_flash_erase;
 	f->write = rp_flash_write;
+	f->done = rp_flash_done;
 	f->writesize = MAX_WRITE_CHUNK; /* Max buffer size used otherwise */
 	f->erased = 0xffU;
 	target_add_flash(t, f);
-
-	flash->page_size = spi_parameters.page_size;
-	flash->sector_erase_opcode = spi_parameters.sector_erase_opcode;
 }
 
 bool rp_probe(target *t)
@@ -268,7 +292,7 @@ bool rp_probe(target *t)
 		DEBUG_WARN("Old Bootrom Version 1!\n");
 #endif
 
-	rp_priv_s *priv_storage = calloc(1, sizeof(rp_priv_s));
+	rp_priv_s *priv_storage = target_arena_calloc(sizeof(rp_priv_s));
 	if (!priv_storage) { /* calloc failed: heap exhaustion */
 		DEBUG_WARN("calloc: failed in %s\n", __func__);
 		return false;
@@ -292,10 +316,12 @@ static bool rp_attach(target *t)
 	if (!cortexm_attach(t) || !rp_read_rom_func_table(t))
 		return false;
 
-	/* Free previously loaded memory map */
-	target_mem_map_free(t);
-	rp_add_flash(t);
-	target_add_ram(t, RP_SRAM_BASE, RP_SRAM_SIZE);
+	/* The map only changes with the flash chip, which takes a rescan to notice, so re-attach keeps it */
+	if (!t->flash) {
+		target_mem_map_free(t);
+		rp_add_flash(t);
+		target_add_ram(t, RP_SRAM_BASE, RP_SRAM_SIZE);
+	}
 
 	return true;
 }
@@ -404,6 +430,7 @@ static bool rp_flash_prepare(target *t)
 	bool result = true; /* catch false returns with &= */
 	if (!ps->is_prepared) {
 		DEBUG_INFO("rp_flash_prepare\n");
+		rp_park_cores(t);
 		/* connect*/
 		result &= rp_rom_call(t, ps->regs, ps->rom_connect_internal_flash, 100);
 		/* exit_xip */
@@ -423,6 +450,7 @@ static bool rp_flash_resume(target *t)
 		result &= rp_rom_call(t, ps->regs, ps->rom_flash_flush_cache, 100);
 		/* enter_cmd_xip */
 		result &= rp_rom_call(t, ps->regs, ps->rom_flash_enter_xip, 100);
+		rp_unpark_cores(t);
 		ps->is_prepared = false;
 	}
 	return result;
@@ -448,6 +476,9 @@ static bool rp_flash_erase(target_flash_s *f, target_addr_t addr, size_t len)
 		DEBUG_WARN("Address is invalid\n");
 		return false;
 	}
+	/* Anything gathered so far goes in first, the ROM call mustn't overtake it */
+	if (!rp_flash_write_staged(t))
+		return false;
 	addr -= f->start;
 	len = ALIGN(len, f->blocksize);
 	len = MIN(len, f->length - addr);
@@ -456,39 +487,29 @@ static bool rp_flash_erase(target_flash_s *f, target_addr_t addr, size_t len)
 	platform_timeout timeout;
 	platform_timeout_set(&timeout, 500);
 
+	/* The largest erase the flash has, which chunks of smaller erases stop short of reaching the boundary of */
+	const spi_nor_flash_s *const flash = (spi_nor_flash_s *)f;
+	size_t largest = f->blocksize;
+	for (size_t i = 0; i < SPI_ERASE_TYPES; ++i)
+		largest = MAX(largest, flash->params.erase_types[i].size);
+
 	/* erase */
 	bool result = false;
 	while (len) {
-		if (len >= FLASHSIZE_64K_BLOCK) {
-			const uint32_t chunk = len & FLASHSIZE_64K_BLOCK_MASK;
-			ps->regs[0] = addr;
-			ps->regs[1] = chunk;
-			ps->regs[2] = FLASHSIZE_64K_BLOCK;
-			ps->regs[3] = FLASHCMD_BLOCK64K_ERASE;
-			DEBUG_WARN("64k_ERASE addr 0x%08" PRIx32 " len 0x%" PRIx32 "\n", addr, chunk);
-			result = rp_rom_call(t, ps->regs, ps->rom_flash_range_erase, 25100);
-			len -= chunk;
-			addr += chunk;
-		} else if (len >= FLASHSIZE_32K_BLOCK) {
-			const uint32_t chunk = len & FLASHSIZE_32K_BLOCK_MASK;
-			ps->regs[0] = addr;
-			ps->regs[1] = chunk;
-			ps->regs[2] = FLASHSIZE_32K_BLOCK;
-			ps->regs[3] = FLASHCMD_BLOCK32K_ERASE;
-			DEBUG_WARN("32k_ERASE addr 0x%08" PRIx32 " len 0x%" PRIx32 "\n", addr, chunk);
-			result = rp_rom_call(t, ps->regs, ps->rom_flash_range_erase, 1700);
-			len -= chunk;
-			addr += chunk;
-		} else {
-			rp_flash_s *flash = (rp_flash_s *)f;
-			ps->regs[0] = addr;
-			ps->regs[1] = len;
-			ps->regs[2] = f->blocksize;
-			ps->regs[3] = flash->sector_erase_opcode;
-			DEBUG_WARN("Sector_ERASE addr 0x%08" PRIx32 " len 0x%" PRIx32 "\n", addr, (uint32_t)len);
-			result = rp_rom_call(t, ps->regs, ps->rom_flash_range_erase, 410);
-			len = 0;
-		}
+		uint8_t opcode;
+		const size_t size = spi_nor_erase_size(&flash->params, addr, len, &opcode);
+		uint32_t chunk = len & ~(size - 1U);
+		if (size < largest)
+			chunk = MIN(chunk, ALIGN(addr + 1U, largest) - addr);
+		ps->regs[0] = addr;
+		ps->regs[1] = chunk;
+		ps->regs[2] = size;
+		ps->regs[3] = opcode;
+		DEBUG_INFO("Erase %" PRIu32 "k blocks addr 0x%08" PRIx32 " len 0x%" PRIx32 "\n", (uint32_t)(size / 1024U),
+			addr, chunk);
+		result = rp_rom_call(t, ps->regs, ps->rom_flash_range_erase, (chunk / size) * RP_ERASE_BLOCK_TIMEOUT + 500U);
+		len -= chunk;
+		addr += chunk;
 		if (!result) {
 			DEBUG_WARN("Erase failed!\n");
 			break;
@@ -500,6 +521,32 @@ static bool rp_flash_erase(target_flash_s *f, target_addr_t addr, size_t len)
 	return result;
 }
 
+/* Program the data gathered in SRAM with a single ROM call */
+static bool rp_flash_write_staged(target *t)
+{
+	rp_priv_s *ps = (rp_priv_s *)t->target_storage;
+	if (!ps->staged_len)
+		return true;
+	DEBUG_INFO("RP Program 0x%08" PRIx32 " len 0x%" PRIx32 "\n", ps->staged_dest, ps->staged_len);
+	ps->regs[0] = ps->staged_dest;
+	ps->regs[1] = RP_SRAM_BASE;
+	ps->regs[2] = ps->staged_len;
+	/* Loading takes 3 ms per 256 byte page
+	 * however it takes much longer if the XOSC is not enabled
+	 * so lets give ourselves a little bit more time (x10)
+	 */
+	const bool result = rp_rom_call(t, ps->regs, ps->rom_flash_range_program, (3 * ps->staged_len * 10) >> 8);
+	if (!result)
+		DEBUG_WARN("Write failed!\n");
+	ps->staged_len = 0;
+	return result;
+}
+
+/*
+ * Writes only copy the data into SRAM, contiguous writes being gathered until the
+ * staging area is full. The flash stays in command mode throughout, and what is
+ * left is programmed on an erase or when the flash is done with.
+ */
 static bool rp_flash_write(target_flash_s *f, target_addr_t dest, const void *src, size_t len)
 {
 	DEBUG_INFO("RP Write 0x%08" PRIx32 " len 0x%" PRIx32 "\n", dest, (uint32_t)len);
@@ -510,39 +557,36 @@ static bool rp_flash_write(target_flash_s *f, target_addr_t dest, const void *sr
 	}
 	dest -= f->start;
 	rp_priv_s *ps = (rp_priv_s *)t->target_storage;
-	/* Write payload to target ram */
 	bool result = true;
 	while (len) {
-		uint32_t chunksize = (len <= MAX_WRITE_CHUNK) ? len : MAX_WRITE_CHUNK;
-		target_mem_write(t, RP_SRAM_BASE, src, chunksize);
-		/* Programm range */
-		ps->regs[0] = dest;
-		ps->regs[1] = RP_SRAM_BASE;
-		ps->regs[2] = chunksize;
-		/* Loading takes 3 ms per 256 byte page
-		 * however it takes much longer if the XOSC is not enabled
-		 * so lets give ourselves a little bit more time (x10)
-		 */
-		result = rp_rom_call(t, ps->regs, ps->rom_flash_range_program, (3 * chunksize * 10) >> 8);
-		if (!result) {
-			DEBUG_WARN("Write failed!\n");
-			break;
-		}
+		if (ps->staged_len &&
+			(dest != ps->staged_dest + ps->staged_len || ps->staged_len == RP_WRITE_STAGING_SIZE))
+			result &= rp_flash_write_staged(t);
+		if (!ps->staged_len)
+			ps->staged_dest = dest;
+		const uint32_t chunksize = MIN(len, RP_WRITE_STAGING_SIZE - ps->staged_len);
+		/* Write payload to target ram */
+		target_mem_write(t, RP_SRAM_BASE + ps->staged_len, src, chunksize);
+		ps->staged_len += chunksize;
 		len -= chunksize;
 		src += chunksize;
 		dest += chunksize;
 	}
-	DEBUG_INFO("Write done!\n");
 	return result;
 }
 
+static bool rp_flash_done(target_flash_s *f)
+{
+	return rp_flash_write_staged(f->t);
+}
+
 static bool rp_mass_erase(target *t)
 {
 	rp_priv_s *ps = (rp_priv_s *)t->target_storage;
 	ps->is_monitor = true;
 	bool result = true; /* catch false returns with &= */
 	result &= rp_flash_prepare(t);
-	result &= rp_flash_erase(t->flash, t->flash->start, t->flash->length);
+	result &= spi_nor_chip_erase((spi_nor_flash_s *)t->flash);
 	result &= rp_flash_resume(t);
 	ps->is_monitor = false;
 	return result;
@@ -554,8 +598,9 @@ static void rp_spi_chip_select(target *const t, const uint32_t state)
 	target_mem_write32(t, RP_GPIO_QSPI_CS_CTRL, (value & ~RP_GPIO_QSPI_CS_DRIVE_MASK) | state);
 }
 
-static void rp_spi_read(
-	target *const t, const uint16_t command, const target_addr_t address, void *const buffer, const size_t length)
+/* Run one command on the flash over the SSI in serial mode, sending tx or receiving into rx */
+static void rp_spi_transfer(target *const t, const uint16_t command, const target_addr_t address,
+	const uint8_t *const tx, uint8_t *const rx, const size_t length)
 {
 	/* Ensure the controller is in the correct serial SPI mode and select the Flash */
 	const uint32_t ssi_enabled = target_mem_read32(t, RP_SSI_ENABLE);
@@ -573,12 +618,12 @@ static void rp_spi_read(
 	rp_spi_chip_select(t, RP_GPIO_QSPI_CS_DRIVE_LOW);
 
 	/* Set up the instruction */
-	const uint8_t opcode = command & RP_SPI_OPCODE_MASK;
+	const uint8_t opcode = command & SPI_NOR_OPCODE_MASK;
 	target_mem_write32(t, RP_SSI_DR0, opcode);
 	target_mem_read32(t, RP_SSI_DR0);
 
-	const uint16_t addr_mode = command & RP_SPI_FRAME_MASK;
-	if (addr_mode == RP_SPI_FRAME_OPCODE_3B_ADDR) {
+	const uint16_t addr_mode = command & SPI_NOR_FRAME_MASK;
+	if (addr_mode == SPI_NOR_FRAME_OPCODE_3B_ADDR) {
 		/* For each byte sent here, we have to manually clean up from the controller with a read */
 		target_mem_write32(t, RP_SSI_DR0, (address >> 16U) & 0xffU);
 		target_mem_read32(t, RP_SSI_DR0);
@@ -588,19 +633,20 @@ static void rp_spi_read(
 		target_mem_read32(t, RP_SSI_DR0);
 	}
 
-	const size_t inter_length = (command & RP_SPI_INTER_MASK) >> RP_SPI_INTER_SHIFT;
+	const size_t inter_length = (command & SPI_NOR_DUMMY_MASK) >> SPI_NOR_DUMMY_SHIFT;
 	for (size_t i = 0; i < inter_length; ++i) {
 		/* For each byte sent here, we have to manually clean up from the controller with a read */
 		target_mem_write32(t, RP_SSI_DR0, 0);
 		target_mem_read32(t, RP_SSI_DR0);
 	}
 
-	/* Now read back the data that elicited */
-	uint8_t *const data = (uint8_t *const)buffer;
+	/* Now send the data, or read back the data that elicited */
 	for (size_t i = 0; i < length; ++i) {
-		/* Do a write to read */
-		target_mem_write32(t, RP_SSI_DR0, 0);
-		data[i] = target_mem_read32(t, RP_SSI_DR0) & 0xffU;
+		/* Every byte out clocks one in, a write to read */
+		target_mem_write32(t, RP_SSI_DR0, tx ? tx[i] : 0U);
+		const uint8_t data = target_mem_read32(t, RP_SSI_DR0) & 0xffU;
+		if (rx)
+			rx[i] = data;
 	}
 
 	/* Deselect the Flash and put things back to how they were */
@@ -612,6 +658,18 @@ static void rp_spi_read(
 	target_mem_write32(t, RP_SSI_ENABLE, ssi_enabled);
 }
 
+static void rp_spi_read(spi_nor_flash_s *const flash, const uint16_t command, const target_addr_t address,
+	void *const buffer, const size_t length)
+{
+	rp_spi_transfer(flash->f.t, command, address, NULL, (uint8_t *)buffer, length);
+}
+
+static void rp_spi_write(spi_nor_flash_s *const flash, const uint16_t command, const target_addr_t address,
+	const void *const buffer, const size_t length)
+{
+	rp_spi_transfer(flash->f.t, command, address, (const uint8_t *)buffer, NULL, length);
+}
+
 #if 0
 // Connect the XIP controller to the flash pads
 static void rp_flash_connect_internal(target *const t)
@@ -786,12 +844,26 @@ static void rp_flash_flush_cache(target *const t)
 }
 #endif
 
-// Put the SSI into a mode where XIP accesses translate to standard
-// serial 03h read commands. The flash remains in its default serial command
-// state, so will still respond to other commands.
+// Put the SSI into a mode where XIP accesses translate to the fast read the
+// flash's SFDP offers, dual or quad output with command and address still
+// serial, or standard serial 03h read commands without one. Neither takes
+// a status register change or continuous read mode, so the flash remains in
+// its default serial command state and will still respond to other commands.
 static void rp_flash_enter_xip(target *const t)
 {
+	const rp_priv_s *const ps = (rp_priv_s *)t->target_storage;
 	target_mem_write32(t, RP_SSI_ENABLE, 0);
+	if (ps->xip_lanes) {
+		target_mem_write32(t, RP_SSI_CTRL0,
+			(ps->xip_lanes == 4U ? RP_SSI_CTRL0_FRF_QUAD : RP_SSI_CTRL0_FRF_DUAL) | RP_SSI_CTRL0_DATA_BITS(32) |
+				RP_SSI_CTRL0_TMOD_EEPROM);
+		target_mem_write32(t, RP_SSI_XIP_SPI_CTRL0,
+			RP_SSI_XIP_SPI_CTRL0_XIP_CMD(ps->xip_opcode) | RP_SSI_XIP_SPI_CTRL0_INSTR_LENGTH_8b |
+				RP_SSI_XIP_SPI_CTRL0_ADDRESS_LENGTH(0x03) | RP_SSI_XIP_SPI_CTRL0_WAIT_CLOCKS(ps->xip_wait_cycles) |
+				RP_SSI_XIP_SPI_CTRL0_TRANS_1C1A);
+		target_mem_write32(t, RP_SSI_ENABLE, RP_SSI_ENABLE_SSI);
+		return;
+	}
 	target_mem_write32(t, RP_SSI_CTRL0,
 		RP_SSI_CTRL0_FRF_SERIAL |        // Standard 1-bit SPI serial frames
 			RP_SSI_CTRL0_DATA_BITS(32) | // 32 clocks per data frame
@@ -806,20 +878,6 @@ static void rp_flash_enter_xip(target *const t)
 	target_mem_write32(t, RP_SSI_ENABLE, RP_SSI_ENABLE_SSI);
 }
 
-static uint32_t rp_get_flash_length(target *const t)
-{
-	// Read the JEDEC ID and try to decode it
-	spi_flash_id_s flash_id;
-	rp_spi_read(t, SPI_FLASH_CMD_READ_JEDEC_ID, 0, &flash_id, sizeof(flash_id));
-
-	DEBUG_INFO("Flash device ID: %02x %02x %02x\n", flash_id.manufacturer, flash_id.type, flash_id.capacity);
-	if (flash_id.capacity >= 8 && flash_id.capacity <= 34)
-		return 1 << flash_id.capacity;
-
-	// Guess maximum flash size
-	return MAX_FLASH;
-}
-
 static bool rp_cmd_erase_sector(target *t, int argc, const char **argv)
 {
 	uint32_t start = t->flash->start;
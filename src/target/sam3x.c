@@ -193,7 +193,7 @@ struct sam_priv_s {
 
 static void sam3_add_flash(target *t, uint32_t eefc_base, uint32_t addr, size_t length)
 {
-	struct sam_flash *sf = calloc(1, sizeof(*sf));
+	struct sam_flash *sf = target_arena_calloc(sizeof(*sf));
 	target_flash_s *f;
 
 	if (!sf) {			/* calloc failed: heap exhaustion */
@@ -215,7 +215,7 @@ static void sam3_add_flash(target *t, uint32_t eefc_base, uint32_t addr, size_t
 
 static void sam_add_flash(target *t, uint32_t eefc_base, uint32_t addr, size_t length)
 {
-	struct sam_flash *sf = calloc(1, sizeof(*sf));
+	struct sam_flash *sf = target_arena_calloc(sizeof(*sf));
 	target_flash_s *f;
 
 	if (!sf) {			/* calloc failed: heap exhaustion */
@@ -396,7 +396,7 @@ bool samx7x_probe(target *t)
 		return false;
 	}
 
-	struct sam_priv_s *priv_storage = calloc(1, sizeof(*priv_storage));
+	struct sam_priv_s *priv_storage = target_arena_calloc(sizeof(*priv_storage));
 	if (!priv_storage) { /* calloc failed: heap exhaustion */
 		DEBUG_WARN("calloc: failed in %s\n", __func__);
 		return false;
@@ -167,7 +167,7 @@ static const size_t __nvp_size[16] = {
  */
 static void sam4l_add_flash(target *t, uint32_t addr, size_t length)
 {
-	target_flash_s *f = calloc(1, sizeof(target_flash_s));
+	target_flash_s *f = target_arena_calloc(sizeof(target_flash_s));
 	if (!f) { /* calloc failed: heap exhaustion */
 		DEBUG_WARN("calloc: failed in %s\n", __func__);
 		return;
@@ -331,7 +331,7 @@ static bool sam4l_flash_write_buf(target_flash_s *f, target_addr_t addr, const v
 	target *t = f->t;
 	uint32_t *src_data = (uint32_t *)src;
 
-	DEBUG_INFO("\nSAM4L: sam4l_flash_write_buf: addr = 0x%08" PRIx32 ", len %d\n", addr, len);
+	DEBUG_INFO("\nSAM4L: sam4l_flash_write_buf: addr = 0x%08" PRIx32 ", len %zu\n", addr, len);
 
 	/* This will fail with unaligned writes, the write_buf version */
 	const uint16_t page = addr / SAM4L_PAGE_SIZE;
@@ -373,7 +373,7 @@ static bool sam4l_flash_erase(target_flash_s *f, target_addr_t addr, size_t len)
 	target *t = f->t;
 	uint16_t page;
 
-	DEBUG_INFO("SAM4L: flash erase address 0x%08" PRIx32 " for %d bytes\n", addr, len);
+	DEBUG_INFO("SAM4L: flash erase address 0x%08" PRIx32 " for %zu bytes\n", addr, len);
 	/*
 	 *  NB: if addr isn't aligned to a page boundary, or length
 	 * is not an even multiple of page sizes, we may end up
@@ -92,9 +92,16 @@ const struct command_s samd_cmd_list[] = {
 #define SAMD_CTRLA_CMD_SSB             0x0045U
 #define SAMD_CTRLA_CMD_INVALL          0x0046U
 
+/* Control B Register (CTRLB) */
+#define SAMD_CTRLB_MANW (1U << 7U)
+
 /* Interrupt Flag Register (INTFLAG) */
 #define SAMD_NVMC_READY (1U << 0U)
 
+/* Typical NVM operation times from the datasheet, to pace the polls for READY */
+#define SAMD_ROW_ERASE_US    6000U
+#define SAMD_PAGE_PROGRAM_US 2500U
+
 /* Non-Volatile Memory Calibration and Auxiliary Registers */
 #define SAMD_NVM_USER_ROW_LOW  0x00804000U
 #define SAMD_NVM_USER_ROW_HIGH 0x00804004U
@@ -445,7 +452,7 @@ struct samd_descr samd_parse_device_id(uint32_t did)
 
 static void samd_add_flash(target *t, uint32_t addr, size_t length)
 {
-	target_flash_s *f = calloc(1, sizeof(*f));
+	target_flash_s *f = target_arena_calloc(sizeof(*f));
 	if (!f) { /* calloc failed: heap exhaustion */
 		DEBUG_WARN("calloc: failed in %s\n", __func__);
 		return;
@@ -456,7 +463,9 @@ static void samd_add_flash(target *t, uint32_t addr, size_t length)
 	f->blocksize = SAMD_ROW_SIZE;
 	f->erase = samd_flash_erase;
 	f->write = samd_flash_write;
-	f->writesize = SAMD_PAGE_SIZE;
+	/* Pages are written automatically, so a whole row can be streamed in one go */
+	f->writesize = SAMD_ROW_SIZE;
+	f->erased = 0xffU;
 	target_add_flash(t, f);
 }
 
@@ -484,7 +493,7 @@ bool samd_probe(target *t)
 		return false;
 
 	t->mass_erase = samd_mass_erase;
-	struct samd_priv_s *priv_storage = calloc(1, sizeof(*priv_storage));
+	struct samd_priv_s *priv_storage = target_arena_calloc(sizeof(*priv_storage));
 	t->target_storage = (void*)priv_storage;
 
 	uint32_t ctrlstat = target_mem_read32(t, SAMD_DSU_CTRLSTAT);
@@ -576,6 +585,19 @@ static void samd_unlock_current_address(target *t)
 	                   SAMD_CTRLA_CMD_KEY | SAMD_CTRLA_CMD_UNLOCK);
 }
 
+/* Poll for NVM Ready, false if the target can't be reached */
+static bool samd_nvm_ready_wait(target *t, uint32_t expected_us)
+{
+	flash_wait_s wait;
+	target_flash_wait_init(&wait, expected_us);
+	do {
+		target_flash_wait_poll(&wait);
+		if (target_check_error(t))
+			return false;
+	} while ((target_mem_read32(t, SAMD_NVMC_INTFLAG) & SAMD_NVMC_READY) == 0);
+	return !target_check_error(t);
+}
+
 /*
  * Erase flash row by row
  */
@@ -593,10 +615,8 @@ static bool samd_flash_erase(target_flash_s *f, target_addr_t addr, size_t len)
 		/* Issue the erase command */
 		target_mem_write32(t, SAMD_NVMC_CTRLA,
 		                   SAMD_CTRLA_CMD_KEY | SAMD_CTRLA_CMD_ERASEROW);
-		/* Poll for NVM Ready */
-		while ((target_mem_read32(t, SAMD_NVMC_INTFLAG) & SAMD_NVMC_READY) == 0)
-			if (target_check_error(t))
-				return false;
+		if (!samd_nvm_ready_wait(t, SAMD_ROW_ERASE_US))
+			return false;
 
 		/* Lock */
 		samd_lock_current_address(t);
@@ -612,31 +632,34 @@ static bool samd_flash_erase(target_flash_s *f, target_addr_t addr, size_t len)
 }
 
 /*
- * Write flash page by page
+ * Write flash a row at a time using automatic page writes: with CTRLB.MANW clear
+ * the NVMC programs each page as its last word lands in the page buffer, and
+ * stalls the bus while it is busy, so the row streams in a single memory write.
  */
 static bool samd_flash_write(target_flash_s *f, target_addr_t dest, const void *src, size_t len)
 {
 	target *t = f->t;
 
-	/* Write within a single page. This may be part or all of the page */
-	target_mem_write(t, dest, src, len);
-
 	/* Unlock */
+	/* Must be shifted right for 16-bit address, see Datasheet §20.8.8 Address */
+	target_mem_write32(t, SAMD_NVMC_ADDRESS, dest >> 1);
 	samd_unlock_current_address(t);
 
-	/* Issue the write page command */
-	target_mem_write32(t, SAMD_NVMC_CTRLA,
-	                   SAMD_CTRLA_CMD_KEY | SAMD_CTRLA_CMD_WRITEPAGE);
+	const uint32_t ctrlb = target_mem_read32(t, SAMD_NVMC_CTRLB);
+	target_mem_write32(t, SAMD_NVMC_CTRLB, ctrlb & ~SAMD_CTRLB_MANW);
 
-	/* Poll for NVM Ready */
-	while ((target_mem_read32(t, SAMD_NVMC_INTFLAG) & SAMD_NVMC_READY) == 0)
-		if (target_check_error(t))
-			return false;
+	/* Whole pages, so each of them is written as it fills */
+	target_mem_write(t, dest, src, len);
+
+	/* The bus stalls while the earlier pages program, so only the last is left */
+	const bool result = samd_nvm_ready_wait(t, SAMD_PAGE_PROGRAM_US);
+
+	target_mem_write32(t, SAMD_NVMC_CTRLB, ctrlb);
 
 	/* Lock */
 	samd_lock_current_address(t);
 
-	return true;
+	return result && !target_check_error(t);
 }
 
 /*
@@ -698,10 +721,8 @@ static bool samd_set_flashlock(target *t, uint16_t value, const char **argv)
 	target_mem_write32(t, SAMD_NVMC_CTRLA,
 	                   SAMD_CTRLA_CMD_KEY | SAMD_CTRLA_CMD_ERASEAUXROW);
 
-	/* Poll for NVM Ready */
-	while ((target_mem_read32(t, SAMD_NVMC_INTFLAG) & SAMD_NVMC_READY) == 0)
-		if (target_check_error(t))
-			return -1;
+	if (!samd_nvm_ready_wait(t, SAMD_ROW_ERASE_US))
+		return -1;
 
 	/* Modify the high byte of the user row */
 	high = (high & 0x0000FFFF) | ((value << 16) & 0xFFFF0000);
@@ -780,10 +801,8 @@ static bool samd_set_bootprot(target *t, uint16_t value, const char **argv)
 	target_mem_write32(t, SAMD_NVMC_CTRLA,
 	                   SAMD_CTRLA_CMD_KEY | SAMD_CTRLA_CMD_ERASEAUXROW);
 
-	/* Poll for NVM Ready */
-	while ((target_mem_read32(t, SAMD_NVMC_INTFLAG) & SAMD_NVMC_READY) == 0)
-		if (target_check_error(t))
-			return -1;
+	if (!samd_nvm_ready_wait(t, SAMD_ROW_ERASE_US))
+		return -1;
 
 	/* Modify the low word of the user row */
 	low = (low & 0xFFFFFFF8) | ((value << 0 ) & 0x00000007);
@@ -925,10 +944,8 @@ static bool samd_cmd_ssb(target *t, int argc, const char **argv)
 	target_mem_write32(t, SAMD_NVMC_CTRLA,
 	                   SAMD_CTRLA_CMD_KEY | SAMD_CTRLA_CMD_SSB);
 
-	/* Poll for NVM Ready */
-	while ((target_mem_read32(t, SAMD_NVMC_INTFLAG) & SAMD_NVMC_READY) == 0)
-		if (target_check_error(t))
-			return -1;
+	if (!samd_nvm_ready_wait(t, 0))
+		return -1;
 
 	tc_printf(t, "Security bit set!\nScan again, attach and issue 'monitor erase_mass' to reset.\n");
 
@@ -48,6 +48,8 @@ static bool samx5x_cmd_read_userpage(target *t, int argc, const char **argv);
 static bool samx5x_cmd_serial(target *t, int argc, const char **argv);
 static bool samx5x_cmd_ssb(target *t, int argc, const char **argv);
 static bool samx5x_cmd_update_user_word(target *t, int argc, const char **argv);
+static bool samx5x_cmd_bank_update(target *t, int argc, const char **argv);
+static bool samx5x_cmd_bank_swap(target *t, int argc, const char **argv);
 
 /* (The SAM D1x/2x implementation of erase_all is reused as it's identical)*/
 bool samd_mass_erase(target *t);
@@ -77,6 +79,10 @@ const struct command_s samx5x_cmd_list[] = {
 	 "Sets the security bit"},
 	{"update_user_word", (cmd_handler)samx5x_cmd_update_user_word,
 	 "Sets 32-bits in the user page: <addr> <value>"},
+	{"bank_update", (cmd_handler)samx5x_cmd_bank_update,
+	 "Program only the inactive bank, without resetting the target: (enable|disable)"},
+	{"bank_swap", (cmd_handler)samx5x_cmd_bank_swap,
+	 "Swap the flash banks and reset into the other one"},
 #ifdef SAMX5X_EXTRA_CMDS
 	{"mbist", (cmd_handler)samx5x_cmd_mbist,
 	 "Runs the built-in memory test"},
@@ -110,6 +116,10 @@ const struct command_s samx5x_cmd_list[] = {
 #define SAMX5X_NVMC_ADDRESS			(SAMX5X_NVMC + 0x14)
 #define SAMX5X_NVMC_RUNLOCK			(SAMX5X_NVMC + 0x18)
 
+/* Control A Register (CTRLA) */
+#define SAMX5X_CTRLA_WMODE_MASK			(3 << 4)
+#define SAMX5X_CTRLA_WMODE_AP			(3 << 4)
+
 /* Control B Register (CTRLB) */
 #define SAMX5X_CTRLB_CMD_KEY			0xA500
 #define SAMX5X_CTRLB_CMD_ERASEPAGE		0x0000
@@ -120,6 +130,7 @@ const struct command_s samx5x_cmd_list[] = {
 #define SAMX5X_CTRLB_CMD_UNLOCK		0x0012
 #define SAMX5X_CTRLB_CMD_PAGEBUFFERCLEAR	0x0015
 #define SAMX5X_CTRLB_CMD_SSB			0x0016
+#define SAMX5X_CTRLB_CMD_BKSWRST		0x0017
 
 /* Interrupt Flag Register (INTFLAG) */
 #define SAMX5X_INTFLAG_DONE			(1 << 0)
@@ -135,6 +146,7 @@ const struct command_s samx5x_cmd_list[] = {
 
 /* Status Register (STATUS) */
 #define SAMX5X_STATUS_READY			(1 << 0)
+#define SAMX5X_STATUS_AFIRST			(1 << 4)
 
 /* Non-Volatile Memory Calibration and Auxiliary Registers */
 #define SAMX5X_NVM_USER_PAGE			0x00804000
@@ -315,9 +327,9 @@ struct samx5x_descr samx5x_parse_device_id(uint32_t did)
 	return samd;
 }
 
-static void samx5x_add_flash(target *t, uint32_t addr, size_t length, size_t erase_block_size, size_t write_page_size)
+static void samx5x_add_flash(target *t, uint32_t addr, size_t length, size_t erase_block_size)
 {
-	target_flash_s *f = calloc(1, sizeof(*f));
+	target_flash_s *f = target_arena_calloc(sizeof(*f));
 	if (!f) { /* calloc failed: heap exhaustion */
 		DEBUG_INFO("calloc: failed in %s\n", __func__);
 		return;
@@ -328,14 +340,51 @@ static void samx5x_add_flash(target *t, uint32_t addr, size_t length, size_t era
 	f->blocksize = erase_block_size;
 	f->erase = samx5x_flash_erase;
 	f->write = samx5x_flash_write;
-	f->writesize = write_page_size;
+	/* Pages are written automatically, so a whole block can be streamed in one go */
+	f->writesize = erase_block_size;
+	f->erased = 0xff;
 	target_add_flash(t, f);
 }
 
 struct samx5x_priv_s {
 	char samx5x_variant_string[60];
+	/*
+	 * Flash operations only go to the inactive bank, mapped at the upper half,
+	 * and leave the target running what it was: no reset going into or out of
+	 * flash mode. The new image takes over with bank_swap.
+	 */
+	bool bank_update;
+	uint32_t bank_size;
 };
 
+static bool samx5x_enter_flash_mode(target *t)
+{
+	const struct samx5x_priv_s *priv = t->target_storage;
+	if (!priv->bank_update)
+		target_reset(t);
+	return true;
+}
+
+static bool samx5x_exit_flash_mode(target *t)
+{
+	const struct samx5x_priv_s *priv = t->target_storage;
+	if (!priv->bank_update)
+		target_reset(t);
+	return true;
+}
+
+/* In bank update mode the active bank, the one the target runs from, is off limits */
+static bool samx5x_bank_check(target *t, target_addr_t addr)
+{
+	const struct samx5x_priv_s *priv = t->target_storage;
+	if (priv->bank_update && addr < priv->bank_size) {
+		tc_printf(t, "Bank update: 0x%08" PRIx32 " is in the active bank, load at an offset of 0x%" PRIx32 "\n",
+			addr, priv->bank_size);
+		return false;
+	}
+	return true;
+}
+
 bool samx5x_probe(target *t)
 {
 	ADIv5_AP_t *ap = cortexm_ap(t);
@@ -361,7 +410,7 @@ bool samx5x_probe(target *t)
 	bool protected = (ctrlstat & SAMX5X_STATUSB_PROT);
 
 	/* Part String */
-	struct samx5x_priv_s *priv_storage = calloc(1, sizeof(*priv_storage));
+	struct samx5x_priv_s *priv_storage = target_arena_calloc(sizeof(*priv_storage));
 	t->target_storage = (void*)priv_storage;
 
 	if (protected) {
@@ -382,6 +431,8 @@ bool samx5x_probe(target *t)
 	t->mass_erase = samx5x_mass_erase;
 	t->driver = priv_storage->samx5x_variant_string;
 	t->reset = samx5x_reset;
+	t->enter_flash_mode = samx5x_enter_flash_mode;
+	t->exit_flash_mode = samx5x_exit_flash_mode;
 
 	if (protected) {
 		/**
@@ -397,15 +448,18 @@ bool samx5x_probe(target *t)
 	default:
 	case 18:
 		target_add_ram(t, 0x20000000, 0x20000);
-		samx5x_add_flash(t, 0x00000000, 0x40000, SAMX5X_BLOCK_SIZE, SAMX5X_PAGE_SIZE);
+		samx5x_add_flash(t, 0x00000000, 0x40000, SAMX5X_BLOCK_SIZE);
+		priv_storage->bank_size = 0x40000 / 2U;
 		break;
 	case 19:
 		target_add_ram(t, 0x20000000, 0x30000);
-		samx5x_add_flash(t, 0x00000000, 0x80000, SAMX5X_BLOCK_SIZE, SAMX5X_PAGE_SIZE);
+		samx5x_add_flash(t, 0x00000000, 0x80000, SAMX5X_BLOCK_SIZE);
+		priv_storage->bank_size = 0x80000 / 2U;
 		break;
 	case 20:
 		target_add_ram(t, 0x20000000, 0x40000);
-		samx5x_add_flash(t, 0x00000000, 0x100000, SAMX5X_BLOCK_SIZE, SAMX5X_PAGE_SIZE);
+		samx5x_add_flash(t, 0x00000000, 0x100000, SAMX5X_BLOCK_SIZE);
+		priv_storage->bank_size = 0x100000 / 2U;
 		break;
 	}
 
@@ -499,6 +553,8 @@ static int samx5x_check_nvm_error(target *t)
 static bool samx5x_flash_erase(target_flash_s *f, target_addr_t addr, size_t len)
 {
 	target *t = f->t;
+	if (!samx5x_bank_check(t, addr))
+		return false;
 	uint16_t errs = samx5x_read_nvm_error(t);
 	if (errs) {
 		DEBUG_WARN(NVM_ERROR_BITS_MSG, "erase", addr, len);
@@ -560,11 +616,16 @@ static bool samx5x_flash_erase(target_flash_s *f, target_addr_t addr, size_t len
 }
 
 /**
- * Write flash page by page
+ * Write flash a block at a time in automatic page write mode: the NVMC programs
+ * each page as soon as its last word is written to the page buffer, and stalls
+ * the bus while it is busy, so the pages stream in one memory write without a
+ * write page command and NVM Ready poll for each of them.
  */
 static bool samx5x_flash_write(target_flash_s *f, target_addr_t dest, const void *src, size_t len)
 {
 	target *t = f->t;
+	if (!samx5x_bank_check(t, dest))
+		return false;
 	bool error = false;
 	uint16_t errs = samx5x_read_nvm_error(t);
 	if (errs) {
@@ -577,12 +638,11 @@ static bool samx5x_flash_write(target_flash_s *f, target_addr_t dest, const void
 	target_mem_write32(t, SAMX5X_NVMC_ADDRESS, dest);
 	samx5x_unlock_current_address(t);
 
-	/* Write within a single page. This may be part or all of the page */
-	target_mem_write(t, dest, src, len);
+	const uint16_t ctrla = target_mem_read16(t, SAMX5X_NVMC_CTRLA);
+	target_mem_write16(t, SAMX5X_NVMC_CTRLA, (ctrla & ~SAMX5X_CTRLA_WMODE_MASK) | SAMX5X_CTRLA_WMODE_AP);
 
-	/* Issue the write page command */
-	target_mem_write32(t, SAMX5X_NVMC_CTRLB,
-			   SAMX5X_CTRLB_CMD_KEY | SAMX5X_CTRLB_CMD_WRITEPAGE);
+	/* Whole pages, so each of them is written as it fills */
+	target_mem_write(t, dest, src, len);
 
 	/* Poll for NVM Ready */
 	while ((target_mem_read32(t, SAMX5X_NVMC_STATUS) &
@@ -592,6 +652,8 @@ static bool samx5x_flash_write(target_flash_s *f, target_addr_t dest, const void
 			break;
 		}
 
+	target_mem_write16(t, SAMX5X_NVMC_CTRLA, ctrla);
+
 	if (error || target_check_error(t) || samx5x_check_nvm_error(t)) {
 		DEBUG_WARN("Error writing flash page at 0x%08"PRIx32
 		      " (len 0x%08zx)\n",  dest, len);
@@ -847,6 +909,50 @@ static bool samx5x_cmd_ssb(target *t, int argc, const char **argv)
 	return true;
 }
 
+/**
+ * Switches bank update mode, in which flash operations only go to the
+ * inactive bank so the target can keep running from the active one.
+ */
+static bool samx5x_cmd_bank_update(target *t, int argc, const char **argv)
+{
+	struct samx5x_priv_s *priv = t->target_storage;
+	if (argc > 1) {
+		if (!strcmp(argv[1], "enable"))
+			priv->bank_update = true;
+		else if (!strcmp(argv[1], "disable"))
+			priv->bank_update = false;
+		else {
+			tc_printf(t, "usage: monitor bank_update (enable|disable)\n");
+			return false;
+		}
+	}
+	const bool afirst = target_mem_read16(t, SAMX5X_NVMC_STATUS) & SAMX5X_STATUS_AFIRST;
+	tc_printf(t, "Running from bank %c, bank %c is at 0x%08" PRIx32 "\n", afirst ? 'A' : 'B', afirst ? 'B' : 'A',
+		priv->bank_size);
+	tc_printf(t, "Bank update %s\n", priv->bank_update ? "enabled: load at that offset, then bank_swap" : "disabled");
+	return true;
+}
+
+/**
+ * Swaps the banks with BKSWRST, which resets the target into the one
+ * that was inactive
+ */
+static bool samx5x_cmd_bank_swap(target *t, int argc, const char **argv)
+{
+	(void)argc;
+	(void)argv;
+	/* Wait out anything still being programmed before the reset */
+	while (!(target_mem_read16(t, SAMX5X_NVMC_STATUS) & SAMX5X_STATUS_READY)) {
+		if (target_check_error(t))
+			return false;
+	}
+	target_mem_write32(t, SAMX5X_NVMC_CTRLB, SAMX5X_CTRLB_CMD_KEY | SAMX5X_CTRLB_CMD_BKSWRST);
+	/* The reset that follows can leave the bus access itself looking faulted */
+	target_check_error(t);
+	tc_printf(t, "Banks swapped, target reset\n");
+	return true;
+}
+
 #define FACTORY_BITS_MSG						\
 	"Warning: the value provided would have modified factory\n"	\
 	"         setting bits that should not be changed. The\n"	\
@@ -71,17 +71,36 @@ static spi_parameters_s sfdp_read_basic_parameter_table(target *const t, const u
 	const size_t table_length = MIN(sizeof(sfdp_basic_parameter_table_s), length);
 	sfdp_read(t, address, &parameter_table, table_length);
 
-	spi_parameters_s result;
+	spi_parameters_s result = {0};
 	result.capacity = sfdp_memory_density_to_capacity_bits(parameter_table.memory_density) >> 3U;
 	for (size_t i = 0; i < SFDP_ERASE_TYPES; ++i) {
 		erase_parameters_s *erase_type = &parameter_table.erase_types[i];
-		if (erase_type->opcode == parameter_table.sector_erase_opcode) {
+		/* A size exponent of 0 marks an erase type the part doesn't have */
+		if (!erase_type->erase_size_exponent)
+			continue;
+		result.erase_types[i].size = SFDP_ERASE_SIZE(erase_type);
+		result.erase_types[i].opcode = erase_type->opcode;
+		if (erase_type->opcode == parameter_table.sector_erase_opcode && !result.sector_size) {
 			result.sector_erase_opcode = erase_type->opcode;
 			result.sector_size = SFDP_ERASE_SIZE(erase_type);
-			break;
 		}
 	}
 	result.page_size = SFDP_PAGE_SIZE(parameter_table);
+
+	/*
+	 * Quad output only if the part says quad reads need no QE bit set, writing
+	 * the status register of someone's flash is not a read's business.
+	 */
+	if ((parameter_table.value2 & SFDP_FAST_READ_1_1_4) && table_length >= SFDP_QUAD_ENABLE_TABLE_LENGTH &&
+		SFDP_QUAD_ENABLE_REQUIREMENTS(parameter_table) == 0U) {
+		result.fast_read_opcode = parameter_table.fast_quad_output.opcode;
+		result.fast_read_lanes = 4U;
+		result.fast_read_wait_cycles = SFDP_FAST_READ_WAIT_CYCLES(parameter_table.fast_quad_output.timings);
+	} else if (parameter_table.value2 & SFDP_FAST_READ_1_1_2) {
+		result.fast_read_opcode = parameter_table.fast_dual_output.opcode;
+		result.fast_read_lanes = 2U;
+		result.fast_read_wait_cycles = SFDP_FAST_READ_WAIT_CYCLES(parameter_table.fast_dual_output.timings);
+	}
 	return result;
 }
 
@@ -107,3 +126,44 @@ bool sfdp_read_parameters(target *const t, spi_parameters_s *params, const read_
 	}
 	return false;
 }
+
+#define SFDP_CACHE_ENTRIES 4U
+
+typedef struct sfdp_cache_entry {
+	spi_flash_id_s flash_id;
+	bool valid; /* False if the part had no usable SFDP */
+	spi_parameters_s params;
+} sfdp_cache_entry_s;
+
+static sfdp_cache_entry_s sfdp_cache[SFDP_CACHE_ENTRIES];
+static size_t sfdp_cache_count;
+static size_t sfdp_cache_next;
+
+bool sfdp_read_parameters_cached(
+	target *const t, const spi_flash_id_s *const flash_id, spi_parameters_s *const params, const read_sfdp_func sfdp_read)
+{
+	/* No part answering reads back all ones or all zeros, which says nothing about the next one */
+	const bool known = !(flash_id->manufacturer == 0xffU && flash_id->type == 0xffU) &&
+		!(flash_id->manufacturer == 0U && flash_id->type == 0U);
+	for (size_t i = 0; known && i < sfdp_cache_count; ++i) {
+		const sfdp_cache_entry_s *const entry = &sfdp_cache[i];
+		if (!memcmp(&entry->flash_id, flash_id, sizeof(*flash_id))) {
+			if (entry->valid)
+				*params = entry->params;
+			return entry->valid;
+		}
+	}
+
+	const bool valid = sfdp_read_parameters(t, params, sfdp_read);
+	if (known) {
+		sfdp_cache_entry_s *const entry = &sfdp_cache[sfdp_cache_next];
+		entry->flash_id = *flash_id;
+		entry->valid = valid;
+		if (valid)
+			entry->params = *params;
+		sfdp_cache_next = (sfdp_cache_next + 1U) % SFDP_CACHE_ENTRIES;
+		if (sfdp_cache_count < SFDP_CACHE_ENTRIES)
+			++sfdp_cache_count;
+	}
+	return valid;
+}
@@ -46,15 +46,34 @@ typedef struct spi_flash_id {
 	uint8_t capacity;
 } spi_flash_id_s;
 
+#define SPI_ERASE_TYPES 4U
+
+typedef struct spi_erase_type {
+	uint32_t size; /* 0 if this slot is unused */
+	uint8_t opcode;
+} spi_erase_type_s;
+
 typedef struct spi_parameters {
 	uint32_t page_size;
 	uint32_t sector_size;
 	size_t capacity;
 	uint8_t sector_erase_opcode;
+	/* Every erase the part offers, in the order its table lists them */
+	spi_erase_type_s erase_types[SPI_ERASE_TYPES];
+	/*
+	 * The fastest read that needs no status register changes, with command and
+	 * address on one lane and data on fast_read_lanes. 0 if only 03h reads.
+	 */
+	uint8_t fast_read_opcode;
+	uint8_t fast_read_lanes;
+	uint8_t fast_read_wait_cycles;
 } spi_parameters_s;
 
 typedef void (*read_sfdp_func)(target *t, uint32_t address, void *buffer, size_t length);
 
 bool sfdp_read_parameters(target *t, spi_parameters_s *params, read_sfdp_func sfdp_read);
+/* As sfdp_read_parameters(), but the result for a JEDEC ID is remembered so it is only read from the part once */
+bool sfdp_read_parameters_cached(
+	target *t, const spi_flash_id_s *flash_id, spi_parameters_s *params, read_sfdp_func sfdp_read);
 
 #endif /* TARGET_SFDP_H */
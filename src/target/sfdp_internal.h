@@ -52,11 +52,20 @@
 #define SFDP_DENSITY_VALUE(density) \
 	((((density)[3] & 0x7FU) << 24U) | ((density)[2] << 16U) | ((density)[1] << 8U) | (density)[0])
 
-#define SFDP_ERASE_TYPES            4U
+#define SFDP_ERASE_TYPES            SPI_ERASE_TYPES
 #define SFDP_ERASE_SIZE(erase_type) (1U << ((erase_type)->erase_size_exponent))
 #define SFDP_PAGE_SIZE(parameter_table) \
 	(1U << ((parameter_table).programming_and_chip_erase_timing.programming_timing_ratio_and_page_size >> 4U))
 
+/* Fast read support in the third byte of the first DWORD */
+#define SFDP_FAST_READ_1_1_2 (1U << 0U)
+#define SFDP_FAST_READ_1_1_4 (1U << 6U)
+/* Fast read timings: wait states in the low 5 bits, mode clocks in the top 3 */
+#define SFDP_FAST_READ_WAIT_CYCLES(timings) (((timings)&0x1fU) + ((timings) >> 5U))
+/* Quad Enable Requirements, DWORD 15 bits 20-22, only present from JESD216A on */
+#define SFDP_QUAD_ENABLE_REQUIREMENTS(parameter_table) (((parameter_table).dual_and_quad_mode[2] >> 4U) & 7U)
+#define SFDP_QUAD_ENABLE_TABLE_LENGTH                  60U
+
 typedef struct sfdp_header {
 	char magic[4];
 	uint8_t version_minor;
@@ -0,0 +1,280 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * Copyright (C) 2022  Black Sphere Technologies Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This file implements programming of serial NOR flash hanging off a target's
+ * SPI flash controller, described by the part's SFDP parameters. Controller
+ * adapters provide a spi_nor_bus_s to run commands with, and optionally a RAM
+ * loader that programs whole buffers of pages with the status polling done on
+ * the target.
+ */
+
+#include "general.h"
+#include "target.h"
+#include "target_internal.h"
+#include "cortexm.h"
+#include "crc32.h"
+#include "spi_nor.h"
+
+/* 3 byte addresses reach this far, anything beyond on larger parts isn't used */
+#define SPI_NOR_MAX_CAPACITY (16U * 1024U * 1024U)
+#define SPI_NOR_WRITE_SIZE   4096U
+
+/* Worst case times from the datasheets of common parts, with some to spare */
+#define SPI_NOR_PROGRAM_TIMEOUT    10U
+#define SPI_NOR_ERASE_TIMEOUT      5000U
+#define SPI_NOR_CHIP_ERASE_TIMEOUT 400000U
+
+static bool spi_nor_flash_erase(target_flash_s *f, target_addr_t addr, size_t len);
+static bool spi_nor_flash_erase_start(target_flash_s *f, target_addr_t addr, size_t len);
+static bool spi_nor_flash_erase_busy(target_flash_s *f, bool *busy);
+static bool spi_nor_flash_bank_erase(target_flash_s *f);
+static bool spi_nor_flash_write(target_flash_s *f, target_addr_t dest, const void *src, size_t len);
+static bool spi_nor_flash_verify(target_flash_s *f, target_addr_t dest, const void *src, size_t len);
+static bool spi_nor_flash_prepare(target_flash_s *f);
+static bool spi_nor_flash_done(target_flash_s *f);
+
+/* sfdp_read_parameters() only hands the target to its read routine, the flash comes from here */
+static spi_nor_flash_s *spi_nor_sfdp_flash;
+
+static void spi_nor_read_sfdp(target *const t, const uint32_t address, void *const buffer, const size_t length)
+{
+	(void)t;
+	spi_nor_sfdp_flash->bus->read(spi_nor_sfdp_flash, SPI_NOR_CMD_READ_SFDP, address, buffer, length);
+}
+
+/*
+ * Reads the part's JEDEC ID and SFDP parameters into flash->params. Without
+ * usable SFDP the part gets the page size and erases nearly every serial NOR
+ * has, and the capacity its ID claims, 0 if that doesn't say either.
+ */
+void spi_nor_read_parameters(spi_nor_flash_s *const flash)
+{
+	spi_parameters_s *const params = &flash->params;
+	spi_flash_id_s flash_id;
+	flash->bus->read(flash, SPI_NOR_CMD_READ_JEDEC_ID, 0, &flash_id, sizeof(flash_id));
+	DEBUG_INFO("Flash device ID: %02x %02x %02x\n", flash_id.manufacturer, flash_id.type, flash_id.capacity);
+
+	spi_nor_sfdp_flash = flash;
+	const bool have_sfdp = sfdp_read_parameters_cached(flash->f.t, &flash_id, params, spi_nor_read_sfdp);
+	spi_nor_sfdp_flash = NULL;
+	if (have_sfdp && params->sector_size && params->page_size)
+		return;
+
+	*params = (spi_parameters_s){0};
+	params->page_size = 256U;
+	params->sector_size = 4096U;
+	params->sector_erase_opcode = 0x20U;
+	params->erase_types[0] = (spi_erase_type_s){.size = 4096U, .opcode = 0x20U};
+	params->erase_types[1] = (spi_erase_type_s){.size = 32768U, .opcode = 0x52U};
+	params->erase_types[2] = (spi_erase_type_s){.size = 65536U, .opcode = 0xd8U};
+	if (flash_id.capacity >= 8U && flash_id.capacity <= 31U)
+		params->capacity = 1U << flash_id.capacity;
+}
+
+/*
+ * Picks the largest erase the part offers that is aligned at offset and fits in
+ * length, or the sector erase if none does. Returns its size, with its opcode
+ * in *opcode.
+ */
+size_t spi_nor_erase_size(
+	const spi_parameters_s *const params, const uint32_t offset, const size_t length, uint8_t *const opcode)
+{
+	size_t size = params->sector_size;
+	*opcode = params->sector_erase_opcode;
+	for (size_t i = 0; i < SPI_ERASE_TYPES; ++i) {
+		const spi_erase_type_s *const erase_type = &params->erase_types[i];
+		if (erase_type->size > size && erase_type->size <= length && !(offset & (erase_type->size - 1U))) {
+			size = erase_type->size;
+			*opcode = erase_type->opcode;
+		}
+	}
+	return size;
+}
+
+/* Polls the status register until the part finishes a program or erase */
+bool spi_nor_wait_ready(spi_nor_flash_s *const flash, const uint32_t timeout_ms)
+{
+	target *const t = flash->f.t;
+	platform_timeout timeout;
+	platform_timeout_set(&timeout, timeout_ms);
+	platform_timeout progress;
+	platform_timeout_set(&progress, 500);
+	uint8_t status = 0;
+	while (!platform_timeout_is_expired(&timeout)) {
+		flash->bus->read(flash, SPI_NOR_CMD_READ_STATUS, 0, &status, sizeof(status));
+		if (target_check_error(t))
+			return false;
+		if (!(status & SPI_NOR_STATUS_BUSY))
+			return true;
+		target_print_progress(&progress);
+	}
+	DEBUG_WARN("SPI NOR timed out with status %02x\n", status);
+	return false;
+}
+
+bool spi_nor_chip_erase(spi_nor_flash_s *const flash)
+{
+	flash->bus->write(flash, SPI_NOR_CMD_WRITE_ENABLE, 0, NULL, 0);
+	flash->bus->write(flash, SPI_NOR_CMD_CHIP_ERASE, 0, NULL, 0);
+	return spi_nor_wait_ready(flash, SPI_NOR_CHIP_ERASE_TIMEOUT);
+}
+
+/*
+ * Sets up a flash the adapter has allocated, with bus and regbase filled in,
+ * for the part memory mapped at start and the controller set up for length
+ * bytes of it, 0 if it doesn't say. If that finds no usable part, returns
+ * false and the flash is the caller's to free.
+ */
+bool spi_nor_add_flash(target *const t, spi_nor_flash_s *const flash, const target_addr_t start, const size_t length)
+{
+	target_flash_s *const f = &flash->f;
+	f->t = t;
+	if (!spi_nor_flash_prepare(f))
+		return false;
+	spi_nor_read_parameters(flash);
+	if (!spi_nor_flash_done(f))
+		return false;
+
+	const spi_parameters_s *const params = &flash->params;
+	size_t capacity = params->capacity ? params->capacity : length;
+	capacity = MIN(capacity, SPI_NOR_MAX_CAPACITY);
+	if (length)
+		capacity = MIN(capacity, length);
+	if (capacity < params->sector_size) {
+		DEBUG_WARN("SPI NOR: no usable flash found\n");
+		return false;
+	}
+	DEBUG_INFO("SPI NOR flash at 0x%08" PRIx32 ", %" PRIu32 " kiB\n", start, (uint32_t)(capacity / 1024U));
+
+	f->start = start;
+	f->length = capacity;
+	f->blocksize = params->sector_size;
+	f->writesize = MIN(params->sector_size, SPI_NOR_WRITE_SIZE);
+	f->erased = 0xffU;
+	f->prepare = spi_nor_flash_prepare;
+	f->done = spi_nor_flash_done;
+	f->erase = spi_nor_flash_erase;
+	f->erase_start = spi_nor_flash_erase_start;
+	f->erase_busy = spi_nor_flash_erase_busy;
+	f->write = spi_nor_flash_write;
+	f->verify = spi_nor_flash_verify;
+	/* Chip erase would take out the part of a larger flash beyond the window too */
+	if (capacity == params->capacity)
+		f->bank_erase = spi_nor_flash_bank_erase;
+	/* The loaders program in 256 byte pages, which larger pages take in pieces */
+	if (flash->bus->stub && !(params->page_size % SPI_NOR_STUB_PAGE_SIZE) &&
+		!(f->writesize % SPI_NOR_STUB_PAGE_SIZE))
+		f->stub = flash->bus->stub;
+	target_add_flash(t, f);
+	return true;
+}
+
+static bool spi_nor_flash_prepare(target_flash_s *const f)
+{
+	spi_nor_flash_s *const flash = (spi_nor_flash_s *)f;
+	return !flash->bus->prepare || flash->bus->prepare(flash);
+}
+
+static bool spi_nor_flash_done(target_flash_s *const f)
+{
+	spi_nor_flash_s *const flash = (spi_nor_flash_s *)f;
+	return !flash->bus->done || flash->bus->done(flash);
+}
+
+static bool spi_nor_flash_erase(target_flash_s *const f, const target_addr_t addr, size_t len)
+{
+	spi_nor_flash_s *const flash = (spi_nor_flash_s *)f;
+	uint32_t offset = addr - f->start;
+	while (len) {
+		uint8_t opcode;
+		const size_t size = spi_nor_erase_size(&flash->params, offset, len, &opcode);
+		flash->bus->write(flash, SPI_NOR_CMD_WRITE_ENABLE, 0, NULL, 0);
+		flash->bus->write(flash, SPI_NOR_CMD_ERASE(opcode), offset, NULL, 0);
+		if (!spi_nor_wait_ready(flash, SPI_NOR_ERASE_TIMEOUT))
+			return false;
+		offset += size;
+		len -= MIN(size, len);
+	}
+	return true;
+}
+
+/* Start erasing the sector at addr, leaving it to run while GDB sends more data */
+static bool spi_nor_flash_erase_start(target_flash_s *const f, const target_addr_t addr, const size_t len)
+{
+	(void)len;
+	spi_nor_flash_s *const flash = (spi_nor_flash_s *)f;
+	flash->bus->write(flash, SPI_NOR_CMD_WRITE_ENABLE, 0, NULL, 0);
+	flash->bus->write(flash, SPI_NOR_CMD_ERASE(flash->params.sector_erase_opcode), addr - f->start, NULL, 0);
+	return !target_check_error(f->t);
+}
+
+static bool spi_nor_flash_erase_busy(target_flash_s *const f, bool *const busy)
+{
+	spi_nor_flash_s *const flash = (spi_nor_flash_s *)f;
+	uint8_t status;
+	flash->bus->read(flash, SPI_NOR_CMD_READ_STATUS, 0, &status, sizeof(status));
+	*busy = status & SPI_NOR_STATUS_BUSY;
+	return !target_check_error(f->t);
+}
+
+static bool spi_nor_flash_bank_erase(target_flash_s *const f)
+{
+	return spi_nor_chip_erase((spi_nor_flash_s *)f);
+}
+
+/*
+ * With a loader, the pages go to the target in one buffer and are programmed
+ * and polled for there, while the next buffer streams into the other half.
+ * Without one, each page is programmed and polled for over the debug link.
+ */
+static bool spi_nor_flash_write(
+	target_flash_s *const f, const target_addr_t dest, const void *const src, const size_t len)
+{
+	spi_nor_flash_s *const flash = (spi_nor_flash_s *)f;
+	const uint32_t offset = dest - f->start;
+	if (f->stub && cortexm_flash_stub_load(f))
+		return cortexm_flash_stub_write(f, offset, src, len, flash->regbase);
+
+	const uint8_t *const data = (const uint8_t *)src;
+	const uint32_t page_size = flash->params.page_size;
+	for (size_t written = 0; written < len;) {
+		const size_t amount = MIN(len - written, page_size - ((offset + written) & (page_size - 1U)));
+		flash->bus->write(flash, SPI_NOR_CMD_WRITE_ENABLE, 0, NULL, 0);
+		flash->bus->write(flash, SPI_NOR_CMD_PAGE_PROGRAM, offset + written, data + written, amount);
+		if (!spi_nor_wait_ready(flash, SPI_NOR_PROGRAM_TIMEOUT))
+			return false;
+		written += amount;
+	}
+	return true;
+}
+
+/*
+ * Reads only go through the memory mapped window, so the controller goes back
+ * to it for the CRC and comes out of it again after.
+ */
+static bool spi_nor_flash_verify(
+	target_flash_s *const f, const target_addr_t dest, const void *const src, const size_t len)
+{
+	bool result = spi_nor_flash_done(f);
+	uint32_t crc;
+	result = result && !generic_crc32(f->t, &crc, dest, len) &&
+		crc == generic_crc32_buffer(0xffffffffU, (const uint8_t *)src, len);
+	return spi_nor_flash_prepare(f) && result;
+}
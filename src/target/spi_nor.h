@@ -0,0 +1,84 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * Copyright (C) 2022  Black Sphere Technologies Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TARGET_SPI_NOR_H
+#define TARGET_SPI_NOR_H
+
+#include "target_internal.h"
+#include "sfdp.h"
+
+/*
+ * A SPI NOR command for a controller adapter: the opcode, how many dummy bytes
+ * follow the address, and whether there is a 24 bit address at all.
+ */
+#define SPI_NOR_OPCODE(x)            (x)
+#define SPI_NOR_OPCODE_MASK          0x00ffU
+#define SPI_NOR_DUMMY_SHIFT          8U
+#define SPI_NOR_DUMMY_LENGTH(x)      (((x)&7U) << SPI_NOR_DUMMY_SHIFT)
+#define SPI_NOR_DUMMY_MASK           0x0700U
+#define SPI_NOR_FRAME_OPCODE_ONLY    (1U << 11U)
+#define SPI_NOR_FRAME_OPCODE_3B_ADDR (2U << 11U)
+#define SPI_NOR_FRAME_MASK           0x1800U
+
+#define SPI_NOR_CMD_WRITE_ENABLE  (SPI_NOR_OPCODE(0x06U) | SPI_NOR_DUMMY_LENGTH(0) | SPI_NOR_FRAME_OPCODE_ONLY)
+#define SPI_NOR_CMD_READ_STATUS   (SPI_NOR_OPCODE(0x05U) | SPI_NOR_DUMMY_LENGTH(0) | SPI_NOR_FRAME_OPCODE_ONLY)
+#define SPI_NOR_CMD_PAGE_PROGRAM  (SPI_NOR_OPCODE(0x02U) | SPI_NOR_DUMMY_LENGTH(0) | SPI_NOR_FRAME_OPCODE_3B_ADDR)
+#define SPI_NOR_CMD_CHIP_ERASE    (SPI_NOR_OPCODE(0xc7U) | SPI_NOR_DUMMY_LENGTH(0) | SPI_NOR_FRAME_OPCODE_ONLY)
+#define SPI_NOR_CMD_READ_JEDEC_ID (SPI_NOR_OPCODE(0x9fU) | SPI_NOR_DUMMY_LENGTH(0) | SPI_NOR_FRAME_OPCODE_ONLY)
+#define SPI_NOR_CMD_READ_SFDP     (SPI_NOR_OPCODE(0x5aU) | SPI_NOR_DUMMY_LENGTH(1) | SPI_NOR_FRAME_OPCODE_3B_ADDR)
+#define SPI_NOR_CMD_ERASE(opcode) (SPI_NOR_OPCODE(opcode) | SPI_NOR_DUMMY_LENGTH(0) | SPI_NOR_FRAME_OPCODE_3B_ADDR)
+
+#define SPI_NOR_STATUS_BUSY 0x01U
+
+/* Page programming stubs work in pages of this size */
+#define SPI_NOR_STUB_PAGE_SIZE 256U
+
+typedef struct spi_nor_flash spi_nor_flash_s;
+
+typedef void (*spi_nor_read_func)(
+	spi_nor_flash_s *flash, uint16_t command, target_addr_t address, void *buffer, size_t length);
+typedef void (*spi_nor_write_func)(
+	spi_nor_flash_s *flash, uint16_t command, target_addr_t address, const void *buffer, size_t length);
+typedef bool (*spi_nor_mode_func)(spi_nor_flash_s *flash);
+
+/* How a flash controller runs SPI NOR commands, provided by its adapter */
+typedef struct spi_nor_bus {
+	spi_nor_read_func read;    /* run a command, reading length bytes back */
+	spi_nor_write_func write;  /* run a command, sending length bytes after it */
+	spi_nor_mode_func prepare; /* leave memory mapped mode for commands, optional */
+	spi_nor_mode_func done;    /* go back to memory mapped mode, optional */
+	/* Page programming loader, called with the controller base in r3, optional */
+	const target_flash_stub_s *stub;
+} spi_nor_bus_s;
+
+/* Adapters that need more state embed this at the start of their own flash structure */
+struct spi_nor_flash {
+	target_flash_s f;
+	const spi_nor_bus_s *bus;
+	uint32_t regbase; /* controller base address */
+	spi_parameters_s params;
+};
+
+void spi_nor_read_parameters(spi_nor_flash_s *flash);
+size_t spi_nor_erase_size(const spi_parameters_s *params, uint32_t offset, size_t length, uint8_t *opcode);
+bool spi_nor_wait_ready(spi_nor_flash_s *flash, uint32_t timeout_ms);
+bool spi_nor_chip_erase(spi_nor_flash_s *flash);
+bool spi_nor_add_flash(target *t, spi_nor_flash_s *flash, target_addr_t start, size_t length);
+
+#endif /* TARGET_SPI_NOR_H */
@@ -0,0 +1,477 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * Copyright (C) 2022  Black Sphere Technologies Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This file implements the SPI NOR bus for the STM32 QUADSPI (F7, H74x/75x,
+ * L4, G47x) and OCTOSPI (H7Ax/Bx, H72x/73x, L4R/S) controllers, in indirect
+ * mode with commands, addresses and data on one line. The pin muxing and
+ * timings are board specific, so the controller is only used when the firmware
+ * has left it in memory mapped mode. How it was set up then, pins included, is
+ * kept so it can be put back after the reset that comes with flash mode, and
+ * memory mapped mode is restored after flashing.
+ */
+
+#include "general.h"
+#include "target.h"
+#include "target_internal.h"
+#include "spi_nor.h"
+#include "stm32_qspi.h"
+
+#define STM32_QSPI_MEMORY_BASE 0x90000000U
+#define STM32_QSPI_TIMEOUT     100U
+
+#define STM32_GPIO_PORT_SIZE 0x400U
+#define STM32_GPIO_MAX_PORTS 11U
+#define STM32_GPIO_MODER     0x00U
+#define STM32_GPIO_OTYPER    0x04U
+#define STM32_GPIO_OSPEEDR   0x08U
+#define STM32_GPIO_PUPDR     0x0cU
+#define STM32_GPIO_AFRL      0x20U
+#define STM32_GPIO_AFRH      0x24U
+#define STM32_GPIO_MODE_AF   2U
+
+#define QSPI_CR                 0x00U
+#define QSPI_DCR                0x04U
+#define QSPI_SR                 0x08U
+#define QSPI_FCR                0x0cU
+#define QSPI_DLR                0x10U
+#define QSPI_CCR                0x14U
+#define QSPI_AR                 0x18U
+#define QSPI_DR                 0x20U
+#define QSPI_CR_EN              (1U << 0U)
+#define QSPI_CR_ABORT           (1U << 1U)
+#define QSPI_CR_DFM             (1U << 6U)
+#define QSPI_DCR_FSIZE(dcr)     (((dcr) >> 16U) & 0x1fU)
+#define QSPI_SR_TEF             (1U << 0U)
+#define QSPI_SR_TCF             (1U << 1U)
+#define QSPI_SR_BUSY            (1U << 5U)
+#define QSPI_SR_FLEVEL(sr)      (((sr) >> 8U) & 0x3fU)
+#define QSPI_FCR_ALL            0x1bU
+#define QSPI_CCR_INSTRUCTION(x) (x)
+#define QSPI_CCR_IMODE_1LINE    (1U << 8U)
+#define QSPI_CCR_ADMODE_1LINE   (1U << 10U)
+#define QSPI_CCR_ADSIZE_24      (2U << 12U)
+#define QSPI_CCR_DCYC(x)        ((x) << 18U)
+#define QSPI_CCR_DMODE_1LINE    (1U << 24U)
+#define QSPI_CCR_FMODE_MASK     (3U << 26U)
+#define QSPI_CCR_FMODE_WRITE    (0U << 26U)
+#define QSPI_CCR_FMODE_READ     (1U << 26U)
+#define QSPI_CCR_FMODE_MMAP     (3U << 26U)
+
+#define OCTOSPI_CR               0x000U
+#define OCTOSPI_DCR1             0x008U
+#define OCTOSPI_DCR2             0x00cU
+#define OCTOSPI_DCR3             0x010U
+#define OCTOSPI_SR               0x020U
+#define OCTOSPI_FCR              0x024U
+#define OCTOSPI_DLR              0x040U
+#define OCTOSPI_AR               0x048U
+#define OCTOSPI_DR               0x050U
+#define OCTOSPI_CCR              0x100U
+#define OCTOSPI_TCR              0x108U
+#define OCTOSPI_IR               0x110U
+#define OCTOSPI_CR_EN            (1U << 0U)
+#define OCTOSPI_CR_ABORT         (1U << 1U)
+#define OCTOSPI_CR_DMM           (1U << 6U)
+#define OCTOSPI_CR_FMODE_MASK    (3U << 28U)
+#define OCTOSPI_CR_FMODE_WRITE   (0U << 28U)
+#define OCTOSPI_CR_FMODE_READ    (1U << 28U)
+#define OCTOSPI_CR_FMODE_MMAP    (3U << 28U)
+#define OCTOSPI_DCR1_DEVSIZE(x)  (((x) >> 16U) & 0x1fU)
+#define OCTOSPI_SR_TEF           (1U << 0U)
+#define OCTOSPI_SR_TCF           (1U << 1U)
+#define OCTOSPI_SR_BUSY          (1U << 5U)
+#define OCTOSPI_SR_FLEVEL(sr)    (((sr) >> 8U) & 0x3fU)
+#define OCTOSPI_FCR_ALL          0x1bU
+#define OCTOSPI_CCR_IMODE_1LINE  (1U << 0U)
+#define OCTOSPI_CCR_ADMODE_1LINE (1U << 8U)
+#define OCTOSPI_CCR_ADSIZE_24    (2U << 12U)
+#define OCTOSPI_CCR_DMODE_1LINE  (1U << 24U)
+#define OCTOSPI_TCR_DCYC_MASK    0x1fU
+
+/* The pins of one GPIO port in alternate function mode at attach, and how they were set up */
+typedef struct stm32_qspi_gpio {
+	uint16_t pins;
+	uint32_t moder;
+	uint32_t otyper;
+	uint32_t ospeedr;
+	uint32_t pupdr;
+	uint32_t afr[2];
+} stm32_qspi_gpio_s;
+
+typedef struct stm32_qspi_flash {
+	spi_nor_flash_s nor;
+	const stm32_qspi_family_s *family;
+	uint32_t cr;
+	uint32_t dcr[3];
+	/* The memory mapped read command, in CCR alone on QUADSPI */
+	uint32_t ccr;
+	uint32_t tcr;
+	uint32_t ir;
+	stm32_qspi_gpio_s gpio[STM32_GPIO_MAX_PORTS];
+} stm32_qspi_flash_s;
+
+static const uint16_t stm32_qspi_write_stub[] = {
+#include "flashstub/stm32_qspi.stub"
+};
+
+static const target_flash_stub_s stm32_qspi_flash_stub = {
+	.code = stm32_qspi_write_stub,
+	.code_size = sizeof(stm32_qspi_write_stub),
+};
+
+static const uint16_t stm32_octospi_write_stub[] = {
+#include "flashstub/stm32_octospi.stub"
+};
+
+static const target_flash_stub_s stm32_octospi_flash_stub = {
+	.code = stm32_octospi_write_stub,
+	.code_size = sizeof(stm32_octospi_write_stub),
+};
+
+/*
+ * Wait for the controller to finish the command in flight, or for an abort to
+ * take. The SR layout is the same on both controllers, only its offset isn't.
+ */
+static bool stm32_qspi_wait(target *const t, const uint32_t cr, const uint32_t sr, const uint32_t mask)
+{
+	platform_timeout timeout;
+	platform_timeout_set(&timeout, STM32_QSPI_TIMEOUT);
+	while ((target_mem_read32(t, cr) & QSPI_CR_ABORT) || (target_mem_read32(t, sr) & mask)) {
+		if (target_check_error(t) || platform_timeout_is_expired(&timeout)) {
+			DEBUG_WARN("QSPI: timed out with SR %08" PRIx32 "\n", target_mem_read32(t, sr));
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Move length bytes through the data register as the FIFO level allows */
+static void stm32_qspi_transfer(target *const t, const uint32_t sr, const uint32_t dr, const uint8_t *const tx,
+	uint8_t *const rx, const size_t length)
+{
+	platform_timeout timeout;
+	platform_timeout_set(&timeout, STM32_QSPI_TIMEOUT);
+	for (size_t offset = 0; offset < length && !platform_timeout_is_expired(&timeout);) {
+		const uint32_t level = QSPI_SR_FLEVEL(target_mem_read32(t, sr));
+		if (target_check_error(t))
+			return;
+		/* Reads wait for data in the FIFO, writes stall by themselves when it's full */
+		size_t amount = rx ? MIN(level, length - offset) : length - offset;
+		for (; amount >= 4U; amount -= 4U, offset += 4U) {
+			if (rx) {
+				const uint32_t value = target_mem_read32(t, dr);
+				memcpy(rx + offset, &value, 4U);
+			} else {
+				uint32_t value;
+				memcpy(&value, tx + offset, 4U);
+				target_mem_write32(t, dr, value);
+			}
+		}
+		for (; amount; --amount, ++offset) {
+			if (rx)
+				rx[offset] = target_mem_read8(t, dr);
+			else
+				target_mem_write8(t, dr, tx[offset]);
+		}
+	}
+}
+
+/* Widen a mask of pins to the fields of a register with width bits per pin, starting from pin first */
+static uint32_t stm32_qspi_pin_fields(const uint16_t pins, const uint8_t width, const uint8_t first)
+{
+	const uint32_t field = (1U << width) - 1U;
+	uint32_t mask = 0;
+	for (uint8_t pin = 0; pin < 32U / width && first + pin < 16U; ++pin) {
+		if (pins & (1U << (first + pin)))
+			mask |= field << (pin * width);
+	}
+	return mask;
+}
+
+static void stm32_qspi_merge(target *const t, const uint32_t addr, const uint32_t value, const uint32_t mask)
+{
+	const uint32_t current = target_mem_read32(t, addr);
+	target_mem_write32(t, addr, (current & ~mask) | (value & mask));
+}
+
+/*
+ * Which pins belong to the controller isn't known, so every pin in alternate
+ * function mode on a clocked port is kept. Putting them back after reset only
+ * repeats what the firmware did for them.
+ */
+static void stm32_qspi_save_pins(target *const t, stm32_qspi_flash_s *const flash)
+{
+	const stm32_qspi_family_s *const family = flash->family;
+	const uint32_t enabled = target_mem_read32(t, family->rcc_gpio_enr);
+	for (uint8_t port = 0; port < MIN(family->gpio_ports, STM32_GPIO_MAX_PORTS); ++port) {
+		if (!(enabled & (1U << port)))
+			continue;
+		stm32_qspi_gpio_s *const gpio = &flash->gpio[port];
+		const uint32_t base = family->gpio_base + port * STM32_GPIO_PORT_SIZE;
+		gpio->moder = target_mem_read32(t, base + STM32_GPIO_MODER);
+		for (uint8_t pin = 0; pin < 16U; ++pin) {
+			if (((gpio->moder >> (pin * 2U)) & 3U) == STM32_GPIO_MODE_AF)
+				gpio->pins |= 1U << pin;
+		}
+		if (!gpio->pins)
+			continue;
+		gpio->otyper = target_mem_read32(t, base + STM32_GPIO_OTYPER);
+		gpio->ospeedr = target_mem_read32(t, base + STM32_GPIO_OSPEEDR);
+		gpio->pupdr = target_mem_read32(t, base + STM32_GPIO_PUPDR);
+		gpio->afr[0] = target_mem_read32(t, base + STM32_GPIO_AFRL);
+		gpio->afr[1] = target_mem_read32(t, base + STM32_GPIO_AFRH);
+	}
+}
+
+/* Clock the controller and set its pins up again after a reset, mode last so they switch over set up */
+static void stm32_qspi_restore_setup(target *const t, const stm32_qspi_flash_s *const flash)
+{
+	const stm32_qspi_family_s *const family = flash->family;
+	for (uint8_t port = 0; port < MIN(family->gpio_ports, STM32_GPIO_MAX_PORTS); ++port) {
+		const stm32_qspi_gpio_s *const gpio = &flash->gpio[port];
+		if (!gpio->pins)
+			continue;
+		const uint32_t base = family->gpio_base + port * STM32_GPIO_PORT_SIZE;
+		stm32_qspi_merge(t, family->rcc_gpio_enr, 1U << port, 1U << port);
+		stm32_qspi_merge(t, base + STM32_GPIO_AFRL, gpio->afr[0], stm32_qspi_pin_fields(gpio->pins, 4U, 0U));
+		stm32_qspi_merge(t, base + STM32_GPIO_AFRH, gpio->afr[1], stm32_qspi_pin_fields(gpio->pins, 4U, 8U));
+		stm32_qspi_merge(t, base + STM32_GPIO_OTYPER, gpio->otyper, stm32_qspi_pin_fields(gpio->pins, 1U, 0U));
+		stm32_qspi_merge(t, base + STM32_GPIO_OSPEEDR, gpio->ospeedr, stm32_qspi_pin_fields(gpio->pins, 2U, 0U));
+		stm32_qspi_merge(t, base + STM32_GPIO_PUPDR, gpio->pupdr, stm32_qspi_pin_fields(gpio->pins, 2U, 0U));
+		stm32_qspi_merge(t, base + STM32_GPIO_MODER, gpio->moder, stm32_qspi_pin_fields(gpio->pins, 2U, 0U));
+	}
+	stm32_qspi_merge(t, family->rcc_enr, family->rcc_en, family->rcc_en);
+}
+
+static bool stm32_qspi_add(target *const t, stm32_qspi_flash_s *const flash, const size_t length)
+{
+	stm32_qspi_save_pins(t, flash);
+	if (target_check_error(t) || !spi_nor_add_flash(t, &flash->nor, STM32_QSPI_MEMORY_BASE, length)) {
+		target_arena_free(flash);
+		return false;
+	}
+	return true;
+}
+
+static bool stm32_qspi_prepare(spi_nor_flash_s *const nor)
+{
+	stm32_qspi_flash_s *const flash = (stm32_qspi_flash_s *)nor;
+	target *const t = nor->f.t;
+	const uint32_t regbase = nor->regbase;
+	/* Entering flash mode resets the target, and the controller and its pins with it */
+	if (!(target_mem_read32(t, regbase + QSPI_CR) & QSPI_CR_EN)) {
+		stm32_qspi_restore_setup(t, flash);
+		target_mem_write32(t, regbase + QSPI_DCR, flash->dcr[0]);
+		target_mem_write32(t, regbase + QSPI_CR, flash->cr);
+	}
+	/* Abort drops memory mapped mode and anything the firmware left running */
+	target_mem_write32(t, regbase + QSPI_CR, flash->cr | QSPI_CR_ABORT);
+	return stm32_qspi_wait(t, regbase + QSPI_CR, regbase + QSPI_SR, QSPI_SR_BUSY);
+}
+
+static bool stm32_qspi_done(spi_nor_flash_s *const nor)
+{
+	const stm32_qspi_flash_s *const flash = (stm32_qspi_flash_s *)nor;
+	target *const t = nor->f.t;
+	const uint32_t regbase = nor->regbase;
+	const bool result = stm32_qspi_wait(t, regbase + QSPI_CR, regbase + QSPI_SR, QSPI_SR_BUSY);
+	target_mem_write32(t, regbase + QSPI_CR, flash->cr);
+	target_mem_write32(t, regbase + QSPI_CCR, flash->ccr);
+	return result && !target_check_error(t);
+}
+
+static void stm32_qspi_command(target *const t, const uint32_t regbase, const uint16_t command,
+	const target_addr_t address, const uint8_t *const tx, uint8_t *const rx, const size_t length)
+{
+	target_mem_write32(t, regbase + QSPI_FCR, QSPI_FCR_ALL);
+	uint32_t ccr = (rx ? QSPI_CCR_FMODE_READ : QSPI_CCR_FMODE_WRITE) |
+		QSPI_CCR_INSTRUCTION(command & SPI_NOR_OPCODE_MASK) | QSPI_CCR_IMODE_1LINE |
+		QSPI_CCR_DCYC(((command & SPI_NOR_DUMMY_MASK) >> SPI_NOR_DUMMY_SHIFT) * 8U);
+	if ((command & SPI_NOR_FRAME_MASK) == SPI_NOR_FRAME_OPCODE_3B_ADDR)
+		ccr |= QSPI_CCR_ADMODE_1LINE | QSPI_CCR_ADSIZE_24;
+	if (length) {
+		target_mem_write32(t, regbase + QSPI_DLR, length - 1U);
+		ccr |= QSPI_CCR_DMODE_1LINE;
+	}
+	target_mem_write32(t, regbase + QSPI_CCR, ccr);
+	if (ccr & QSPI_CCR_ADMODE_1LINE)
+		target_mem_write32(t, regbase + QSPI_AR, address);
+	stm32_qspi_transfer(t, regbase + QSPI_SR, regbase + QSPI_DR, tx, rx, length);
+	stm32_qspi_wait(t, regbase + QSPI_CR, regbase + QSPI_SR, QSPI_SR_BUSY);
+	if (target_mem_read32(t, regbase + QSPI_SR) & QSPI_SR_TEF)
+		DEBUG_WARN("QSPI: transfer error on command %02x\n", command & SPI_NOR_OPCODE_MASK);
+}
+
+static void stm32_qspi_read(spi_nor_flash_s *const nor, const uint16_t command, const target_addr_t address,
+	void *const buffer, const size_t length)
+{
+	stm32_qspi_command(nor->f.t, nor->regbase, command, address, NULL, (uint8_t *)buffer, length);
+}
+
+static void stm32_qspi_write(spi_nor_flash_s *const nor, const uint16_t command, const target_addr_t address,
+	const void *const buffer, const size_t length)
+{
+	stm32_qspi_command(nor->f.t, nor->regbase, command, address, (const uint8_t *)buffer, NULL, length);
+}
+
+static const spi_nor_bus_s stm32_qspi_bus = {
+	.read = stm32_qspi_read,
+	.write = stm32_qspi_write,
+	.prepare = stm32_qspi_prepare,
+	.done = stm32_qspi_done,
+	.stub = &stm32_qspi_flash_stub,
+};
+
+bool stm32_qspi_add_flash(target *const t, const uint32_t regbase, const stm32_qspi_family_s *const family)
+{
+	/* Dual flash mode interleaves two parts byte by byte, which this doesn't do */
+	const uint32_t cr = target_mem_read32(t, regbase + QSPI_CR);
+	const uint32_t ccr = target_mem_read32(t, regbase + QSPI_CCR);
+	if (!(cr & QSPI_CR_EN) || (cr & QSPI_CR_DFM) || (ccr & QSPI_CCR_FMODE_MASK) != QSPI_CCR_FMODE_MMAP)
+		return false;
+
+	stm32_qspi_flash_s *const flash = target_arena_calloc(sizeof(*flash));
+	if (!flash) { /* calloc failed: heap exhaustion */
+		DEBUG_WARN("calloc: failed in %s\n", __func__);
+		return false;
+	}
+	flash->nor.bus = &stm32_qspi_bus;
+	flash->nor.regbase = regbase;
+	flash->family = family;
+	flash->cr = cr;
+	flash->ccr = ccr;
+	flash->dcr[0] = target_mem_read32(t, regbase + QSPI_DCR);
+	return stm32_qspi_add(t, flash, 2U << QSPI_DCR_FSIZE(flash->dcr[0]));
+}
+
+static void stm32_octospi_set_mode(target *const t, const uint32_t regbase, const uint32_t fmode)
+{
+	const uint32_t cr = target_mem_read32(t, regbase + OCTOSPI_CR);
+	target_mem_write32(t, regbase + OCTOSPI_CR, (cr & ~OCTOSPI_CR_FMODE_MASK) | fmode);
+}
+
+static bool stm32_octospi_prepare(spi_nor_flash_s *const nor)
+{
+	stm32_qspi_flash_s *const flash = (stm32_qspi_flash_s *)nor;
+	target *const t = nor->f.t;
+	const uint32_t regbase = nor->regbase;
+	if (!(target_mem_read32(t, regbase + OCTOSPI_CR) & OCTOSPI_CR_EN)) {
+		stm32_qspi_restore_setup(t, flash);
+		target_mem_write32(t, regbase + OCTOSPI_DCR1, flash->dcr[0]);
+		target_mem_write32(t, regbase + OCTOSPI_DCR2, flash->dcr[1]);
+		target_mem_write32(t, regbase + OCTOSPI_DCR3, flash->dcr[2]);
+		target_mem_write32(t, regbase + OCTOSPI_CR, flash->cr);
+	}
+	target_mem_write32(t, regbase + OCTOSPI_CR, flash->cr | OCTOSPI_CR_ABORT);
+	if (!stm32_qspi_wait(t, regbase + OCTOSPI_CR, regbase + OCTOSPI_SR, OCTOSPI_SR_BUSY))
+		return false;
+	/* The loader counts on indirect write mode and no dummy cycles */
+	stm32_octospi_set_mode(t, regbase, OCTOSPI_CR_FMODE_WRITE);
+	target_mem_write32(t, regbase + OCTOSPI_TCR, flash->tcr & ~OCTOSPI_TCR_DCYC_MASK);
+	return !target_check_error(t);
+}
+
+static bool stm32_octospi_done(spi_nor_flash_s *const nor)
+{
+	const stm32_qspi_flash_s *const flash = (stm32_qspi_flash_s *)nor;
+	target *const t = nor->f.t;
+	const uint32_t regbase = nor->regbase;
+	const bool result = stm32_qspi_wait(t, regbase + OCTOSPI_CR, regbase + OCTOSPI_SR, OCTOSPI_SR_BUSY);
+	target_mem_write32(t, regbase + OCTOSPI_CR, flash->cr);
+	target_mem_write32(t, regbase + OCTOSPI_TCR, flash->tcr);
+	target_mem_write32(t, regbase + OCTOSPI_CCR, flash->ccr);
+	/* In memory mapped mode IR only sets up the read command rather than starting one */
+	target_mem_write32(t, regbase + OCTOSPI_IR, flash->ir);
+	return result && !target_check_error(t);
+}
+
+static void stm32_octospi_command(target *const t, const uint32_t regbase, const uint16_t command,
+	const target_addr_t address, const uint8_t *const tx, uint8_t *const rx, const size_t length)
+{
+	target_mem_write32(t, regbase + OCTOSPI_FCR, OCTOSPI_FCR_ALL);
+	stm32_octospi_set_mode(t, regbase, rx ? OCTOSPI_CR_FMODE_READ : OCTOSPI_CR_FMODE_WRITE);
+	const uint32_t dummy_cycles = ((command & SPI_NOR_DUMMY_MASK) >> SPI_NOR_DUMMY_SHIFT) * 8U;
+	const uint32_t tcr = target_mem_read32(t, regbase + OCTOSPI_TCR);
+	target_mem_write32(t, regbase + OCTOSPI_TCR, (tcr & ~OCTOSPI_TCR_DCYC_MASK) | dummy_cycles);
+	uint32_t ccr = OCTOSPI_CCR_IMODE_1LINE;
+	if ((command & SPI_NOR_FRAME_MASK) == SPI_NOR_FRAME_OPCODE_3B_ADDR)
+		ccr |= OCTOSPI_CCR_ADMODE_1LINE | OCTOSPI_CCR_ADSIZE_24;
+	if (length) {
+		target_mem_write32(t, regbase + OCTOSPI_DLR, length - 1U);
+		ccr |= OCTOSPI_CCR_DMODE_1LINE;
+	}
+	target_mem_write32(t, regbase + OCTOSPI_CCR, ccr);
+	/* The command starts on the last of IR, AR and DR it needs written */
+	target_mem_write32(t, regbase + OCTOSPI_IR, command & SPI_NOR_OPCODE_MASK);
+	if (ccr & OCTOSPI_CCR_ADMODE_1LINE)
+		target_mem_write32(t, regbase + OCTOSPI_AR, address);
+	stm32_qspi_transfer(t, regbase + OCTOSPI_SR, regbase + OCTOSPI_DR, tx, rx, length);
+	stm32_qspi_wait(t, regbase + OCTOSPI_CR, regbase + OCTOSPI_SR, OCTOSPI_SR_BUSY);
+	if (target_mem_read32(t, regbase + OCTOSPI_SR) & OCTOSPI_SR_TEF)
+		DEBUG_WARN("OCTOSPI: transfer error on command %02x\n", command & SPI_NOR_OPCODE_MASK);
+	/* Leave things as the loader expects them */
+	target_mem_write32(t, regbase + OCTOSPI_TCR, tcr & ~OCTOSPI_TCR_DCYC_MASK);
+	stm32_octospi_set_mode(t, regbase, OCTOSPI_CR_FMODE_WRITE);
+}
+
+static void stm32_octospi_read(spi_nor_flash_s *const nor, const uint16_t command, const target_addr_t address,
+	void *const buffer, const size_t length)
+{
+	stm32_octospi_command(nor->f.t, nor->regbase, command, address, NULL, (uint8_t *)buffer, length);
+}
+
+static void stm32_octospi_write(spi_nor_flash_s *const nor, const uint16_t command, const target_addr_t address,
+	const void *const buffer, const size_t length)
+{
+	stm32_octospi_command(nor->f.t, nor->regbase, command, address, (const uint8_t *)buffer, NULL, length);
+}
+
+static const spi_nor_bus_s stm32_octospi_bus = {
+	.read = stm32_octospi_read,
+	.write = stm32_octospi_write,
+	.prepare = stm32_octospi_prepare,
+	.done = stm32_octospi_done,
+	.stub = &stm32_octospi_flash_stub,
+};
+
+bool stm32_octospi_add_flash(target *const t, const uint32_t regbase, const stm32_qspi_family_s *const family)
+{
+	/* Dual memory mode splits data between two parts, which this doesn't do */
+	const uint32_t cr = target_mem_read32(t, regbase + OCTOSPI_CR);
+	if (!(cr & OCTOSPI_CR_EN) || (cr & OCTOSPI_CR_DMM) || (cr & OCTOSPI_CR_FMODE_MASK) != OCTOSPI_CR_FMODE_MMAP)
+		return false;
+
+	stm32_qspi_flash_s *const flash = target_arena_calloc(sizeof(*flash));
+	if (!flash) { /* calloc failed: heap exhaustion */
+		DEBUG_WARN("calloc: failed in %s\n", __func__);
+		return false;
+	}
+	flash->nor.bus = &stm32_octospi_bus;
+	flash->nor.regbase = regbase;
+	flash->family = family;
+	flash->cr = cr;
+	flash->dcr[0] = target_mem_read32(t, regbase + OCTOSPI_DCR1);
+	flash->dcr[1] = target_mem_read32(t, regbase + OCTOSPI_DCR2);
+	flash->dcr[2] = target_mem_read32(t, regbase + OCTOSPI_DCR3);
+	flash->ccr = target_mem_read32(t, regbase + OCTOSPI_CCR);
+	flash->tcr = target_mem_read32(t, regbase + OCTOSPI_TCR);
+	flash->ir = target_mem_read32(t, regbase + OCTOSPI_IR);
+	return stm32_qspi_add(t, flash, 2U << OCTOSPI_DCR1_DEVSIZE(flash->dcr[0]));
+}
@@ -0,0 +1,37 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * Copyright (C) 2022  Black Sphere Technologies Ltd.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TARGET_STM32_QSPI_H
+#define TARGET_STM32_QSPI_H
+
+#include "target.h"
+
+/* Where a family keeps the clocks and pins the controller needs set up again after reset */
+typedef struct stm32_qspi_family {
+	uint32_t rcc_enr;      /* Register and bit clocking the controller */
+	uint32_t rcc_en;
+	uint32_t rcc_gpio_enr; /* Register clocking the GPIO ports, bit 0 for port A on */
+	uint32_t gpio_base;    /* Port A, with the rest following every 0x400 */
+	uint8_t gpio_ports;
+} stm32_qspi_family_s;
+
+bool stm32_qspi_add_flash(target *t, uint32_t regbase, const stm32_qspi_family_s *family);
+bool stm32_octospi_add_flash(target *t, uint32_t regbase, const stm32_qspi_family_s *family);
+
+#endif /* TARGET_STM32_QSPI_H */
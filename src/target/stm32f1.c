@@ -40,12 +40,14 @@
 #include "cortexm.h"
 
 static bool stm32f1_cmd_option(target *t, int argc, const char **argv);
+static bool stm32f1_options_write(target *t, const target_option_s *options, size_t count);
 
 const struct command_s stm32f1_cmd_list[] = {
 	{"option", (cmd_handler)stm32f1_cmd_option, "Manipulate option bytes"},
 	{NULL, NULL, NULL}
 };
 
+static bool stm32f1_flash_prepare(target_flash_s *f);
 static bool stm32f1_flash_erase(target_flash_s *f, target_addr_t addr, size_t len);
 static bool stm32f1_flash_write(target_flash_s *f, target_addr_t dest, const void *src, size_t len);
 static bool stm32f1_mass_erase(target *t);
@@ -88,15 +90,28 @@ static bool stm32f1_mass_erase(target *t);
 #define SR_ERROR_MASK 0x14
 #define SR_EOP        0x20
 
+/* Typical operation times from the datasheets, to pace the status polls */
+#define FLASH_ERASE_US   20000U
+#define FLASH_PROGRAM_US 52U
+
 #define DBGMCU_IDCODE    0xE0042000
 #define DBGMCU_IDCODE_F0 0x40015800
 
 #define FLASHSIZE    0x1FFFF7E0
 #define FLASHSIZE_F0 0x1FFFF7CC
 
+static const uint16_t stm32f1_flash_write_stub[] = {
+#include "flashstub/stm32f1.stub"
+};
+
+static const target_flash_stub_s stm32f1_flash_stub = {
+	.code = stm32f1_flash_write_stub,
+	.code_size = sizeof(stm32f1_flash_write_stub),
+};
+
 static void stm32f1_add_flash(target *t, uint32_t addr, size_t length, size_t erasesize)
 {
-	target_flash_s *f = calloc(1, sizeof(*f));
+	target_flash_s *f = target_arena_calloc(sizeof(*f));
 	if (!f) { /* calloc failed: heap exhaustion */
 		DEBUG_WARN("calloc: failed in %s\n", __func__);
 		return;
@@ -105,8 +120,10 @@ static void stm32f1_add_flash(target *t, uint32_t addr, size_t length, size_t er
 	f->start = addr;
 	f->length = length;
 	f->blocksize = erasesize;
+	f->prepare = stm32f1_flash_prepare;
 	f->erase = stm32f1_flash_erase;
 	f->write = stm32f1_flash_write;
+	f->stub = &stm32f1_flash_stub;
 	f->writesize = erasesize;
 	f->erased = 0xff;
 	target_add_flash(t, f);
@@ -147,6 +164,7 @@ bool gd32f1_probe(target *t)
 
 	t->part_id = device_id;
 	t->mass_erase = stm32f1_mass_erase;
+	t->options_write = stm32f1_options_write;
 	target_add_ram(t, 0x20000000, ramSize * 1024);
 	stm32f1_add_flash(t, 0x8000000, flashSize * 1024, 0x400);
 	target_add_commands(t, stm32f1_cmd_list, t->driver);
@@ -250,6 +268,7 @@ bool stm32f1_probe(target *t)
 		device_id = target_mem_read32(t, DBGMCU_IDCODE) & 0xfff;
 
 	t->mass_erase = stm32f1_mass_erase;
+	t->options_write = stm32f1_options_write;
 	size_t flash_size;
 	size_t block_size = 0x400;
 
@@ -365,11 +384,15 @@ static inline void stm32f1_flash_clear_eop(target * const t, const uint32_t bank
 	target_mem_write32(t, FLASH_SR + bank_offset, status | SR_EOP); /* EOP is W1C */
 }
 
-static bool stm32f1_flash_busy_wait(target * const t, const uint32_t bank_offset, platform_timeout * const timeout)
+static bool stm32f1_flash_busy_wait(
+	target *const t, const uint32_t bank_offset, const uint32_t expected_us, platform_timeout *const timeout)
 {
-	/* Read FLASH_SR to poll for BSY bit */
+	/* Read FLASH_SR to poll for BSY bit, paced so a long erase doesn't flood the link */
+	flash_wait_s wait;
+	target_flash_wait_init(&wait, expected_us);
 	uint32_t sr;
 	do {
+		target_flash_wait_poll(&wait);
 		sr = target_mem_read32(t, FLASH_SR + bank_offset);
 		if ((sr & SR_ERROR_MASK) || target_check_error(t)) {
 			DEBUG_WARN("stm32f1 flash error 0x%" PRIx32 "\n", sr);
@@ -382,19 +405,29 @@ static bool stm32f1_flash_busy_wait(target * const t, const uint32_t bank_offset
 	return true;
 }
 
-static bool stm32f1_flash_erase(target_flash_s *f, target_addr_t addr, size_t len)
+/*
+ * Unlock the banks the flash covers once for the whole session. Programming
+ * relies on this too, as a session that finds its blocks blank already
+ * needn't erase any of them.
+ */
+static bool stm32f1_flash_prepare(target_flash_s *f)
 {
 	target *t = f->t;
-	target_addr_t end = addr + len - 1;
-
-	if (t->part_id == 0x430 && end >= FLASH_BANK_SPLIT)
+	if (t->part_id == 0x430 && f->start + f->length - 1U >= FLASH_BANK_SPLIT)
 		if (stm32f1_flash_unlock(t, FLASH_BANK2_OFFSET))
 			return false;
 
-	if (addr < FLASH_BANK_SPLIT)
+	if (f->start < FLASH_BANK_SPLIT)
 		if (stm32f1_flash_unlock(t, 0))
 			return false;
 
+	return true;
+}
+
+static bool stm32f1_flash_erase(target_flash_s *f, target_addr_t addr, size_t len)
+{
+	target *t = f->t;
+
 	while (len) {
 		uint32_t bank_offset = 0;
 		if (addr >= FLASH_BANK_SPLIT)
@@ -410,7 +443,7 @@ static bool stm32f1_flash_erase(target_flash_s *f, target_addr_t addr, size_t le
 		target_mem_write32(t, FLASH_CR + bank_offset, FLASH_CR_STRT | FLASH_CR_PER);
 
 		/* Wait for completion or an error */
-		if (!stm32f1_flash_busy_wait(t, bank_offset, NULL))
+		if (!stm32f1_flash_busy_wait(t, bank_offset, FLASH_ERASE_US, NULL))
 			return false;
 
 		if (len > f->blocksize)
@@ -424,6 +457,27 @@ static bool stm32f1_flash_erase(target_flash_s *f, target_addr_t addr, size_t le
 	return true;
 }
 
+static bool stm32f1_flash_write_bank(
+	target_flash_s *const f, const target_addr_t dest, const void *const src, const size_t len, const uint32_t bank_offset)
+{
+	target *const t = f->t;
+
+	/*
+	 * Prefer running the programming loop from target RAM, it clears and checks
+	 * FLASH_SR itself. FLASH_SR is left alone then as the stub may still be busy
+	 * with the last buffer. Otherwise stream the data over the link.
+	 */
+	if (cortexm_flash_stub_load(f))
+		return cortexm_flash_stub_write(f, dest, src, len, FPEC_BASE + bank_offset);
+
+	stm32f1_flash_clear_eop(t, bank_offset);
+	target_mem_write32(t, FLASH_CR + bank_offset, FLASH_CR_PG);
+	cortexm_mem_write_sized(t, dest, src, len, ALIGN_HALFWORD);
+
+	/* Wait for completion or an error */
+	return stm32f1_flash_busy_wait(t, bank_offset, FLASH_PROGRAM_US, NULL);
+}
+
 static bool stm32f1_flash_write(target_flash_s *f, target_addr_t dest, const void *src, size_t len)
 {
 	target *t = f->t;
@@ -435,13 +489,7 @@ static bool stm32f1_flash_write(target_flash_s *f, target_addr_t dest, const voi
 		else
 			length = len;
 
-		stm32f1_flash_clear_eop(t, 0);
-
-		target_mem_write32(t, FLASH_CR, FLASH_CR_PG);
-		cortexm_mem_write_sized(t, dest, src, length, ALIGN_HALFWORD);
-
-		/* Wait for completion or an error */
-		if (!stm32f1_flash_busy_wait(t, 0, NULL))
+		if (!stm32f1_flash_write_bank(f, dest, src, length, 0))
 			return false;
 
 		dest += length;
@@ -449,17 +497,8 @@ static bool stm32f1_flash_write(target_flash_s *f, target_addr_t dest, const voi
 	}
 
 	length = len - length;
-	if (t->part_id == 0x430 && length) { /* Write on bank 2 */
-
-		stm32f1_flash_clear_eop(t, FLASH_BANK2_OFFSET);
-
-		target_mem_write32(t, FLASH_CR + FLASH_BANK2_OFFSET, FLASH_CR_PG);
-		cortexm_mem_write_sized(t, dest, src, length, ALIGN_HALFWORD);
-
-		/* Wait for completion or an error */
-		if (!stm32f1_flash_busy_wait(t, FLASH_BANK2_OFFSET, NULL))
-			return false;
-	}
+	if (t->part_id == 0x430 && length) /* Write on bank 2 */
+		return stm32f1_flash_write_bank(f, dest, src, length, FLASH_BANK2_OFFSET);
 
 	return true;
 }
@@ -479,7 +518,7 @@ static bool stm32f1_mass_erase(target *t)
 	target_mem_write32(t, FLASH_CR, FLASH_CR_STRT | FLASH_CR_MER);
 
 	/* Wait for completion or an error */
-	if (!stm32f1_flash_busy_wait(t, 0, &timeout))
+	if (!stm32f1_flash_busy_wait(t, 0, FLASH_ERASE_US, &timeout))
 		return false;
 
 	if (t->part_id == 0x430) {
@@ -493,7 +532,7 @@ static bool stm32f1_mass_erase(target *t)
 		target_mem_write32(t, FLASH_CR + FLASH_BANK2_OFFSET, FLASH_CR_STRT | FLASH_CR_MER);
 
 		/* Wait for completion or an error */
-		if (!stm32f1_flash_busy_wait(t, FLASH_BANK2_OFFSET, &timeout))
+		if (!stm32f1_flash_busy_wait(t, FLASH_BANK2_OFFSET, FLASH_ERASE_US, &timeout))
 			return false;
 	}
 
@@ -509,7 +548,7 @@ static bool stm32f1_option_erase(target *t)
 	target_mem_write32(t, FLASH_CR, FLASH_CR_STRT | FLASH_CR_OPTER | FLASH_CR_OPTWRE);
 
 	/* Wait for completion or an error */
-	return stm32f1_flash_busy_wait(t, 0, NULL);
+	return stm32f1_flash_busy_wait(t, 0, FLASH_ERASE_US, NULL);
 }
 
 static bool stm32f1_option_write_erased(target *t, uint32_t addr, uint16_t value, bool width_word)
@@ -528,47 +567,101 @@ static bool stm32f1_option_write_erased(target *t, uint32_t addr, uint16_t value
 		target_mem_write16(t, addr, value);
 
 	/* Wait for completion or an error */
-	return stm32f1_flash_busy_wait(t, 0, NULL);
+	return stm32f1_flash_busy_wait(t, 0, FLASH_PROGRAM_US, NULL);
 }
 
-static bool stm32f1_option_write(target *t, uint32_t addr, uint16_t value)
+static bool stm32f1_option_width_word(target *t)
 {
-	uint16_t opt_val[8];
-	int index;
-
-	index = (addr - FLASH_OBP_RDP) / 2;
-	if (index < 0 || index > 7)
-		return false;
+	/* GD32E230 special case, target_mem_write16 does not work */
+	return t->part_id == 0x410 && (t->cpuid & CPUID_PARTNO_MASK) == CORTEX_M23;
+}
 
-	/* Retrieve old values */
+static void stm32f1_option_read(target *t, uint16_t *opt_val)
+{
 	for (size_t i = 0; i < 16; i += 4) {
 		uint32_t val = target_mem_read32(t, FLASH_OBP_RDP + i);
 		opt_val[i / 2] = val & 0xffff;
 		opt_val[i / 2 + 1] = val >> 16;
 	}
+}
 
-	if (opt_val[index] == value)
-		return true;
+/*
+ * Program the option bytes from old_val to opt_val, with a single erase if
+ * any of those that change was programmed already
+ */
+static bool stm32f1_option_program(target *t, const uint16_t *old_val, const uint16_t *opt_val)
+{
+	bool erase = false;
+	for (size_t i = 0; i < 8; i++)
+		erase |= opt_val[i] != old_val[i] && old_val[i] != 0xffff;
+	if (erase && !stm32f1_option_erase(t))
+		return false;
 
-	/* Check for erased value */
-	if (opt_val[index] != 0xffff)
-		if (!stm32f1_option_erase(t))
+	const bool width_word = stm32f1_option_width_word(t);
+	for (size_t i = 0; i < 8; i++) {
+		if (!erase && opt_val[i] == old_val[i])
+			continue;
+		if (!stm32f1_option_write_erased(t, FLASH_OBP_RDP + i * 2, opt_val[i], width_word))
 			return false;
+	}
 
+	return true;
+}
+
+static bool stm32f1_option_write(target *t, uint32_t addr, uint16_t value)
+{
+	uint16_t old_val[8];
+	uint16_t opt_val[8];
+	int index;
+
+	index = (addr - FLASH_OBP_RDP) / 2;
+	if (index < 0 || index > 7)
+		return false;
+
+	/* Retrieve old values */
+	stm32f1_option_read(t, old_val);
+	memcpy(opt_val, old_val, sizeof(opt_val));
 	opt_val[index] = value;
+	return stm32f1_option_program(t, old_val, opt_val);
+}
+
+static bool stm32f1_option_unlock(target *t)
+{
+	if (stm32f1_flash_unlock(t, 0))
+		return false;
+
+	target_mem_write32(t, FLASH_OPTKEYR, KEY1);
+	target_mem_write32(t, FLASH_OPTKEYR, KEY2);
+	return true;
+}
 
-	/* Write changed values*/
-	bool width_word = false;
-	if (t->part_id == 0x410 && (t->cpuid & CPUID_PARTNO_MASK) == CORTEX_M23) {
-		/* GD32E230 special case, target_mem_write16 does not work */
-		width_word = true;
+/*
+ * Option bytes staged for a flash session go in together, with at most one
+ * erase however many change, and load with the reset the session ends with
+ */
+static bool stm32f1_options_write(target *t, const target_option_s *options, size_t count)
+{
+	if (target_mem_read32(t, FLASH_OBR) & FLASH_OBR_RDPRT) {
+		tc_printf(t, "Device is Read Protected\n");
+		return false;
 	}
 
-	for (size_t i = 0; i < 8; i++)
-		if (!stm32f1_option_write_erased(t, FLASH_OBP_RDP + i * 2, opt_val[i], width_word))
+	uint16_t old_val[8];
+	uint16_t opt_val[8];
+	stm32f1_option_read(t, old_val);
+	memcpy(opt_val, old_val, sizeof(opt_val));
+	for (size_t i = 0; i < count; i++) {
+		const uint32_t addr = options[i].addr;
+		if (addr < FLASH_OBP_RDP || addr > FLASH_OBP_RDP + 14U || (addr & 1U) || options[i].value > 0xffffU) {
+			tc_printf(t, "Not an option byte: 0x%08" PRIx32 " = 0x%" PRIx32 "\n", addr, options[i].value);
 			return false;
+		}
+		opt_val[(addr - FLASH_OBP_RDP) / 2U] = options[i].value;
+	}
+	if (!memcmp(opt_val, old_val, sizeof(opt_val)))
+		return true;
 
-	return true;
+	return stm32f1_option_unlock(t) && stm32f1_option_program(t, old_val, opt_val);
 }
 
 static bool stm32f1_cmd_option(target *t, int argc, const char **argv)
@@ -594,20 +687,12 @@ static bool stm32f1_cmd_option(target *t, int argc, const char **argv)
 
 	rdprt = target_mem_read32(t, FLASH_OBR) & FLASH_OBR_RDPRT;
 
-	if (stm32f1_flash_unlock(t, 0))
+	if (!stm32f1_option_unlock(t))
 		return false;
 
-	target_mem_write32(t, FLASH_OPTKEYR, KEY1);
-	target_mem_write32(t, FLASH_OPTKEYR, KEY2);
-
 	if (argc == 2 && strcmp(argv[1], "erase") == 0) {
 		stm32f1_option_erase(t);
-		bool width_word = false;
-		if (t->part_id == 0x410 && (t->cpuid & CPUID_PARTNO_MASK) == CORTEX_M23) {
-			/* GD32E230 special case, target_mem_write16 does not work */
-			width_word = true;
-		}
-		stm32f1_option_write_erased(t, FLASH_OBP_RDP, flash_obp_rdp_key, width_word);
+		stm32f1_option_write_erased(t, FLASH_OBP_RDP, flash_obp_rdp_key, stm32f1_option_width_word(t));
 	} else if (rdprt) {
 		tc_printf(t, "Device is Read Protected\n");
 		tc_printf(t, "Use \"monitor option erase\" to unprotect, erasing device\n");
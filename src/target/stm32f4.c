@@ -42,12 +42,14 @@ static bool stm32f4_cmd_psize(target *t, int argc, char **argv);
 
 const struct command_s stm32f4_cmd_list[] = {
 	{"option", (cmd_handler)stm32f4_cmd_option, "Manipulate option bytes"},
-	{"psize", (cmd_handler)stm32f4_cmd_psize, "Configure flash write parallelism: (x8|x16|x32(default)|x64)"},
+	{"psize", (cmd_handler)stm32f4_cmd_psize, "Configure flash write parallelism: (x8|x16|x32|x64), set from the supply on attach"},
 	{NULL, NULL, NULL}
 };
 
 static bool stm32f4_attach(target *t);
 static bool stm32f4_flash_erase(target_flash_s *f, target_addr_t addr, size_t len);
+static bool stm32f4_flash_erase_start(target_flash_s *f, target_addr_t addr, size_t len);
+static bool stm32f4_flash_erase_busy(target_flash_s *f, bool *busy);
 static bool stm32f4_flash_write(target_flash_s *f, target_addr_t dest, const void *src, size_t len);
 static bool stm32f4_mass_erase(target *t);
 
@@ -78,6 +80,9 @@ static bool stm32f4_mass_erase(target *t);
 
 #define FLASH_OPTCR_OPTLOCK	(1 << 0)
 #define FLASH_OPTCR_OPTSTRT	(1 << 1)
+#define FLASH_OPTCR_BOR_LEV_MASK	(3 << 2)
+#define FLASH_OPTCR_BOR_LEV3	(0 << 2)
+#define FLASH_OPTCR_BOR_OFF	(3 << 2)
 #define FLASH_OPTCR_WDG_SW	(1 << 5)
 #define FLASH_OPTCR_nDBANK	(1 << 29)
 #define FLASH_OPTCR_DB1M	(1 << 30)
@@ -95,6 +100,14 @@ static bool stm32f4_mass_erase(target *t);
 #define SR_ERROR_MASK	0xF2
 #define SR_EOP		0x01
 
+/*
+ * Typical operation times at x32 parallelism from the datasheets, to pace the
+ * status polls: a sector erase takes about 150ms plus 7ms per KiB of sector.
+ */
+#define FLASH_ERASE_BASE_US    150000U
+#define FLASH_ERASE_PER_KIB_US 7000U
+#define FLASH_PROGRAM_US       16U
+
 #define F4_FLASHSIZE	0x1FFF7A22
 #define F7_FLASHSIZE	0x1FF0F442
 #define F72X_FLASHSIZE	0x1FF07A22
@@ -137,12 +150,37 @@ enum IDS_STM32F247 {
 	ID_STM32F413  = 0x463
 };
 
+/*
+ * Pick the widest write parallelism the supply allows: x32 from 2.7V, x16 from
+ * 2.1V and x8 below that (x64 needs an external VPP, so is left to monitor psize).
+ * The sensed target voltage is used where the probe can measure it, otherwise
+ * the brown-out reset level in the option bytes says how low the supply may go.
+ */
+static enum align stm32f4_flash_psize_auto(target *t)
+{
+#ifdef PLATFORM_HAS_POWER_SWITCH
+	const uint32_t voltage = platform_target_voltage_sense(); /* in 0.1V */
+	if (voltage > POWER_CONFLICT_THRESHOLD) {
+		DEBUG_INFO("stm32f4: target voltage %" PRIu32 ".%" PRIu32 "V\n", voltage / 10U, voltage % 10U);
+		if (voltage >= 27U)
+			return ALIGN_WORD;
+		return voltage >= 21U ? ALIGN_HALFWORD : ALIGN_BYTE;
+	}
+#endif
+	const uint32_t bor_level = target_mem_read32(t, FLASH_OPTCR) & FLASH_OPTCR_BOR_LEV_MASK;
+	/* With BOR off nothing is known about the supply, so keep the x32 default */
+	if (bor_level == FLASH_OPTCR_BOR_LEV3 || bor_level == FLASH_OPTCR_BOR_OFF)
+		return ALIGN_WORD;
+	/* BOR levels 1 and 2 guarantee at least 2.1V */
+	return ALIGN_HALFWORD;
+}
+
 static void stm32f4_add_flash(
 	target *t, uint32_t addr, size_t length, size_t blocksize, unsigned int base_sector, int split)
 {
 	if (length == 0)
 		return;
-	struct stm32f4_flash *sf = calloc(1, sizeof(*sf));
+	struct stm32f4_flash *sf = target_arena_calloc(sizeof(*sf));
 	if (!sf) { /* calloc failed: heap exhaustion */
 		DEBUG_WARN("calloc: failed in %s\n", __func__);
 		return;
@@ -153,6 +191,8 @@ static void stm32f4_add_flash(
 	f->length = length;
 	f->blocksize = blocksize;
 	f->erase = stm32f4_flash_erase;
+	f->erase_start = stm32f4_flash_erase_start;
+	f->erase_busy = stm32f4_flash_erase_busy;
 	f->write = stm32f4_flash_write;
 	f->writesize = 1024;
 	f->erased = 0xff;
@@ -303,7 +343,7 @@ static bool stm32f4_attach(target *t)
 	}
 	bool use_dual_bank = false;
 	/* Save DBGMCU_CR to restore it when detaching*/
-	struct stm32f4_priv_s *priv_storage = calloc(1, sizeof(*priv_storage));
+	struct stm32f4_priv_s *priv_storage = target_arena_calloc(sizeof(*priv_storage));
 	if (!priv_storage) {			/* calloc failed: heap exhaustion */
 		DEBUG_WARN("calloc: failed in %s\n", __func__);
 		return false;
@@ -381,6 +421,12 @@ static bool stm32f4_attach(target *t)
 			stm32f4_add_flash(t, bk2 + 0x20000, remains, 0x20000, 21, split);
 		}
 	}
+
+	const enum align psize = stm32f4_flash_psize_auto(t);
+	for (target_flash_s *f = t->flash; f; f = f->next) {
+		if (f->write == stm32f4_flash_write)
+			((struct stm32f4_flash *)f)->psize = psize;
+	}
 	return true;
 }
 
@@ -393,11 +439,14 @@ static void stm32f4_flash_unlock(target *t)
 	}
 }
 
-static bool stm32f4_flash_busy_wait(target *t)
+static bool stm32f4_flash_busy_wait(target *t, uint32_t expected_us)
 {
-	/* Read FLASH_SR to poll for BSY bit */
+	/* Read FLASH_SR to poll for BSY bit, paced so a long erase doesn't flood the link */
+	flash_wait_s wait;
+	target_flash_wait_init(&wait, expected_us);
 	uint32_t sr;
 	do {
+		target_flash_wait_poll(&wait);
 		sr = target_mem_read32(t, FLASH_SR);
 		if ((sr & SR_ERROR_MASK) || target_check_error(t)) {
 			DEBUG_WARN("stm32f4 flash error 0x%" PRIx32 "\n", sr);
@@ -408,13 +457,17 @@ static bool stm32f4_flash_busy_wait(target *t)
 	return true;
 }
 
-static bool stm32f4_flash_erase(target_flash_s *f, target_addr_t addr, size_t len)
+/* Sector erases take up to seconds, so they can run while GDB sends more data */
+static bool stm32f4_flash_erase_start(target_flash_s *f, target_addr_t addr, size_t len)
 {
+	(void)len;
 	target *t = f->t;
 	struct stm32f4_flash *sf = (struct stm32f4_flash *)f;
 
 	/* No address translation is needed here, as we erase by sector number */
-	uint8_t sector = sf->base_sector + (addr - f->start)/f->blocksize;
+	uint8_t sector = sf->base_sector + (addr - f->start) / f->blocksize;
+	if ((sf->bank_split) && (sector >= sf->bank_split))
+		sector += 16 - sf->bank_split;
 	stm32f4_flash_unlock(t);
 
 	enum align psize = ALIGN_WORD;
@@ -423,25 +476,39 @@ static bool stm32f4_flash_erase(target_flash_s *f, target_addr_t addr, size_t le
 			psize = ((struct stm32f4_flash *)currf)->psize;
 		}
 	}
-	while(len) {
-		uint32_t cr = FLASH_CR_EOPIE | FLASH_CR_ERRIE | FLASH_CR_SER |
-			(psize * FLASH_CR_PSIZE16) | (sector << 3);
-		/* Flash page erase instruction */
-		target_mem_write32(t, FLASH_CR, cr);
-		/* write address to FMA */
-		target_mem_write32(t, FLASH_CR, cr | FLASH_CR_STRT);
+	const uint32_t cr = FLASH_CR_EOPIE | FLASH_CR_ERRIE | FLASH_CR_SER |
+		(psize * FLASH_CR_PSIZE16) | (sector << 3);
+	/* Flash page erase instruction */
+	target_mem_write32(t, FLASH_CR, cr);
+	/* write address to FMA */
+	target_mem_write32(t, FLASH_CR, cr | FLASH_CR_STRT);
+	return !target_check_error(t);
+}
 
+static bool stm32f4_flash_erase_busy(target_flash_s *f, bool *busy)
+{
+	const uint32_t sr = target_mem_read32(f->t, FLASH_SR);
+	if ((sr & SR_ERROR_MASK) || target_check_error(f->t)) {
+		DEBUG_WARN("stm32f4 flash error 0x%" PRIx32 "\n", sr);
+		return false;
+	}
+	*busy = sr & FLASH_SR_BSY;
+	return true;
+}
+
+static bool stm32f4_flash_erase(target_flash_s *f, target_addr_t addr, size_t len)
+{
+	while (len) {
 		/* Wait for completion or an error */
-		if (!stm32f4_flash_busy_wait(t))
+		if (!stm32f4_flash_erase_start(f, addr, len) ||
+			!stm32f4_flash_busy_wait(f->t, FLASH_ERASE_BASE_US + (f->blocksize >> 10U) * FLASH_ERASE_PER_KIB_US))
 			return false;
 
 		if (len > f->blocksize)
 			len -= f->blocksize;
 		else
 			len = 0;
-		sector++;
-		if ((sf->bank_split) && (sector == sf->bank_split))
-			sector = 16;
+		addr += f->blocksize;
 	}
 
 	return true;
@@ -460,7 +527,7 @@ static bool stm32f4_flash_write(target_flash_s *f, target_addr_t dest, const voi
 	cortexm_mem_write_sized(t, dest, src, len, psize);
 
 	/* Wait for completion or an error */
-	return stm32f4_flash_busy_wait(t);
+	return stm32f4_flash_busy_wait(t, FLASH_PROGRAM_US);
 }
 
 static bool stm32f4_mass_erase(target *t)
@@ -475,11 +542,17 @@ static bool stm32f4_mass_erase(target *t)
 	target_mem_write32(t, FLASH_CR, ctrl_reg);
 	target_mem_write32(t, FLASH_CR, ctrl_reg | FLASH_CR_STRT);
 
+	size_t length = 0;
+	for (const target_flash_s *f = t->flash; f; f = f->next)
+		length += f->length;
+	flash_wait_s wait;
+	target_flash_wait_init(&wait, (length >> 10U) * FLASH_ERASE_PER_KIB_US);
 	platform_timeout timeout;
 	platform_timeout_set(&timeout, 500);
 	/* Read FLASH_SR to poll for BSY bit */
 	uint32_t sr;
 	do {
+		target_flash_wait_poll(&wait);
 		sr = target_mem_read32(t, FLASH_SR);
 		if ((sr & SR_ERROR_MASK) || target_check_error(t))
 			return false;
@@ -572,7 +645,7 @@ static bool stm32f4_option_write(target *t, uint32_t *val, int count)
 	target_mem_write32(t, FLASH_OPTKEYR, OPTKEY1);
 	target_mem_write32(t, FLASH_OPTKEYR, OPTKEY2);
 
-	if (!stm32f4_flash_busy_wait(t))
+	if (!stm32f4_flash_busy_wait(t, 0))
 		return false;
 
 	/* WRITE option bytes instruction */
@@ -590,10 +663,13 @@ static bool stm32f4_option_write(target *t, uint32_t *val, int count)
 	tc_printf(t, "Erasing flash... This may take a few seconds.  ");
 
 	/* Read FLASH_SR to poll for BSY bit */
+	flash_wait_s wait;
+	target_flash_wait_init(&wait, 0);
 	platform_timeout timeout;
 	platform_timeout_set(&timeout, 100);
 	uint32_t sr;
 	do {
+		target_flash_wait_poll(&wait);
 		sr = target_mem_read32(t, FLASH_SR);
 		if ((sr & SR_ERROR_MASK) || target_check_error(t)) {
 			tc_printf(t, " failed\n");
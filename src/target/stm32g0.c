@@ -70,6 +70,9 @@
 #define FLASH_CR                        (G0_FLASH_BASE + 0x014)
 #define FLASH_CR_LOCK                   (1U << 31U)
 #define FLASH_CR_OBL_LAUNCH             (1U << 27U)
+/* Time for the system reset of an option bytes load to be over, before taking the link back */
+#define STM32G0_OBL_RESET_MS            10U
+#define FLASH_CR_FSTPG                  (1U << 18U)
 #define FLASH_CR_OPTSTART               (1U << 17U)
 #define FLASH_CR_START                  (1U << 16U)
 #define FLASH_CR_MER2                   (1U << 15U)
@@ -156,17 +159,22 @@ typedef struct stm32g0_saved_regs {
 typedef struct stm32g0_priv {
 	stm32g0_saved_regs_s saved_regs;
 	bool irreversible_enabled;
+	bool fast_program; /* Main flash was mass erased in this flash mode session */
 } stm32g0_priv_s;
 
 static bool stm32g0_attach(target *t);
 static void stm32g0_detach(target *t);
 static bool stm32g0_flash_erase(target_flash_s *f, target_addr_t addr, size_t len);
+static bool stm32g0_flash_bank_erase(target_flash_s *f);
 static bool stm32g0_flash_write(target_flash_s *f, target_addr_t dest, const void *src, size_t len);
+static bool stm32g0_flash_done(target_flash_s *f);
+static bool stm32g0_exit_flash_mode(target *t);
 static bool stm32g0_mass_erase(target *t);
 
 /* Custom commands */
 static bool stm32g0_cmd_erase_bank(target *t, int argc, const char **argv);
 static bool stm32g0_cmd_option(target *t, int argc, const char **argv);
+static bool stm32g0_options_write(target *t, const target_option_s *options, size_t count);
 static bool stm32g0_cmd_irreversible(target *t, int argc, const char **argv);
 
 const struct command_s stm32g0_cmd_list[] = {
@@ -176,9 +184,20 @@ const struct command_s stm32g0_cmd_list[] = {
 	{NULL, NULL, NULL},
 };
 
+#define FLASH_FAST_ROW_SIZE 256U
+
+static const uint16_t stm32g0_flash_write_stub[] = {
+#include "flashstub/stm32g0.stub"
+};
+
+static const target_flash_stub_s stm32g0_flash_stub = {
+	.code = stm32g0_flash_write_stub,
+	.code_size = sizeof(stm32g0_flash_write_stub),
+};
+
 static void stm32g0_add_flash(target *t, uint32_t addr, size_t length, size_t blocksize)
 {
-	target_flash_s *f = calloc(1, sizeof(*f));
+	target_flash_s *f = target_arena_calloc(sizeof(*f));
 	if (!f) { /* calloc failed: heap exhaustion */
 		DEBUG_WARN("calloc: failed in %s\n", __func__);
 		return;
@@ -188,7 +207,12 @@ static void stm32g0_add_flash(target *t, uint32_t addr, size_t length, size_t bl
 	f->length = length;
 	f->blocksize = blocksize;
 	f->erase = stm32g0_flash_erase;
+	f->bank_erase = stm32g0_flash_bank_erase;
 	f->write = stm32g0_flash_write;
+	f->done = stm32g0_flash_done;
+	/* Fast programming is for the main flash only */
+	if (addr < FLASH_OTP_START)
+		f->stub = &stm32g0_flash_stub;
 	f->writesize = blocksize;
 	f->erased = 0xffU;
 	target_add_flash(t, f);
@@ -237,16 +261,18 @@ bool stm32g0_probe(target *t)
 	}
 
 	t->mass_erase = stm32g0_mass_erase;
+	t->options_write = stm32g0_options_write;
 	target_add_ram(t, RAM_START, ram_size);
 	/* Dual banks: contiguous in memory */
 	stm32g0_add_flash(t, FLASH_START, flash_size, FLASH_PAGE_SIZE);
 
 	t->attach = stm32g0_attach;
 	t->detach = stm32g0_detach;
+	t->exit_flash_mode = stm32g0_exit_flash_mode;
 	target_add_commands(t, stm32g0_cmd_list, t->driver);
 
 	/* Save private storage */
-	stm32g0_priv_s *priv_storage = calloc(1, sizeof(*priv_storage));
+	stm32g0_priv_s *priv_storage = target_arena_calloc(sizeof(*priv_storage));
 	priv_storage->irreversible_enabled = false;
 	t->target_storage = priv_storage;
 
@@ -358,6 +384,9 @@ static bool stm32g0_flash_erase(target_flash_s *f, target_addr_t addr, size_t le
 		return true;
 	}
 
+	/* Fast programming needs the flash mass erased */
+	((stm32g0_priv_s *)t->target_storage)->fast_program = false;
+
 	const size_t pages_to_erase = ((len - 1U) / f->blocksize) + 1U;
 	size_t bank1_end_page = FLASH_BANK2_START_PAGE - 1U;
 	if (t->part_id == STM32G0B_C) // Dual-bank devices
@@ -394,6 +423,33 @@ static bool stm32g0_flash_erase(target_flash_s *f, target_addr_t addr, size_t le
 	return !(status & FLASH_SR_ERROR_MASK);
 }
 
+/*
+ * Erase the whole main flash, both banks on dual-bank devices, in one go.
+ * OTP area cannot be erased, as with the page erase.
+ */
+static bool stm32g0_flash_bank_erase(target_flash_s *f)
+{
+	target *const t = f->t;
+	if (f->start >= FLASH_OTP_START)
+		return true;
+
+	stm32g0_flash_unlock(t);
+	target_mem_write32(t, FLASH_CR, FLASH_CR_MER1 | FLASH_CR_MER2 | FLASH_CR_START);
+	if (!stm32g0_wait_busy(t)) {
+		stm32g0_flash_op_finish(t);
+		return false;
+	}
+
+	/* Check for error */
+	const uint32_t status = target_mem_read32(t, FLASH_SR);
+	if (status & FLASH_SR_ERROR_MASK)
+		DEBUG_WARN("stm32g0 bank erase error: sr 0x%" PRIx32 "\n", status);
+	stm32g0_flash_op_finish(t);
+	/* The rows can now be fast programmed, HSI16 from reset being fast enough for that */
+	((stm32g0_priv_s *)t->target_storage)->fast_program = !(status & FLASH_SR_ERROR_MASK);
+	return !(status & FLASH_SR_ERROR_MASK);
+}
+
 /*
  * Flash programming function.
  * The SR is supposed to be ready and free of any error.
@@ -401,6 +457,9 @@ static bool stm32g0_flash_erase(target_flash_s *f, target_addr_t addr, size_t le
  * in Main Flash memory without power cycle.
  * OTP area is programmed as the "program" area. It can be programmed 8-bytes
  * by 8-bytes.
+ * After a bank erase whole rows are fast programmed by a stub instead, as the
+ * flash needs the 32 double words of a row without gaps. The flash is left
+ * unlocked for it until stm32g0_flash_done().
  */
 static bool stm32g0_flash_write(target_flash_s *f, target_addr_t dest, const void *src, size_t len)
 {
@@ -413,6 +472,14 @@ static bool stm32g0_flash_write(target_flash_s *f, target_addr_t dest, const voi
 		return false;
 	}
 
+	if (ps->fast_program && f->stub && !(dest % FLASH_FAST_ROW_SIZE) && !(len % FLASH_FAST_ROW_SIZE) &&
+		cortexm_flash_stub_load(f)) {
+		/* Unlocking an unlocked flash counts as a bad key sequence */
+		if (target_mem_read32(t, FLASH_CR) & FLASH_CR_LOCK)
+			stm32g0_flash_unlock(t);
+		return cortexm_flash_stub_write(f, dest, src, len, FLASH_SR);
+	}
+
 	stm32g0_flash_unlock(t);
 
 	target_mem_write32(t, FLASH_CR, FLASH_CR_PG);
@@ -440,6 +507,30 @@ static bool stm32g0_flash_write(target_flash_s *f, target_addr_t dest, const voi
 	return true;
 }
 
+/*
+ * Lock the flash again after the stub, and as for a PG write clear EMPTY if
+ * the main flash now has something to boot.
+ */
+static bool stm32g0_flash_done(target_flash_s *f)
+{
+	target *const t = f->t;
+	if (!f->stub_addr)
+		return true;
+	if (f->start == FLASH_START && target_mem_read32(t, FLASH_START) != 0xFFFFFFFF) {
+		const uint32_t acr = target_mem_read32(t, FLASH_ACR) & ~FLASH_ACR_EMPTY;
+		target_mem_write32(t, FLASH_ACR, acr);
+	}
+	stm32g0_flash_op_finish(t);
+	return true;
+}
+
+static bool stm32g0_exit_flash_mode(target *t)
+{
+	((stm32g0_priv_s *)t->target_storage)->fast_program = false;
+	target_reset(t);
+	return true;
+}
+
 static bool stm32g0_mass_erase(target *t)
 {
 	const uint32_t flash_cr = FLASH_CR_MER1 | FLASH_CR_MER2 | FLASH_CR_START;
@@ -590,7 +681,6 @@ static bool stm32g0_option_write(target *const t, const registers_s *const optio
 
 	/* Option bytes loading generates a system reset */
 	target_mem_write32(t, FLASH_CR, FLASH_CR_OBL_LAUNCH);
-	tc_printf(t, "Scan and attach again\n");
 	return true;
 
 exit_error:
@@ -671,6 +761,7 @@ static bool stm32g0_cmd_option(target *t, int argc, const char **argv)
 	if (argc == 2 && !strcmp(argv[1], "erase")) {
 		if (!stm32g0_option_write(t, options_def))
 			goto exit_error;
+		tc_printf(t, "Scan and attach again\n");
 	} else if ((argc > 2) && (argc % 2U == 0U) && !strcmp(argv[1], "write")) {
 		if (!parse_cmdline_registers((uint32_t)argc - 2U, argv + 2U, options_req, options_def, NB_REG_OPT))
 			goto exit_error;
@@ -678,6 +769,7 @@ static bool stm32g0_cmd_option(target *t, int argc, const char **argv)
 			goto exit_error;
 		if (!stm32g0_option_write(t, options_req))
 			goto exit_error;
+		tc_printf(t, "Scan and attach again\n");
 	} else {
 		tc_printf(t, "usage: monitor option erase\n");
 		tc_printf(t, "usage: monitor option write <addr> <val> [<addr> <val>]...\n");
@@ -690,6 +782,30 @@ exit_error:
 	return false;
 }
 
+/*
+ * Option bytes staged for a flash session are written in one OPTSTART, and the
+ * link is taken back after the OBL launch resets the part, in place of a rescan.
+ */
+static bool stm32g0_options_write(target *t, const target_option_s *options, size_t count)
+{
+	registers_s options_req[NB_REG_OPT] = {{0U, 0U}};
+	for (size_t i = 0; i < count; ++i) {
+		if (!add_reg_value(options_req, options_def, NB_REG_OPT, options[i].addr, options[i].value)) {
+			tc_printf(t, "Not an option register: 0x%08" PRIx32 "\n", options[i].addr);
+			return false;
+		}
+	}
+	if (!validate_options(t, options_req) || !stm32g0_option_write(t, options_req))
+		return false;
+
+	platform_delay(STM32G0_OBL_RESET_MS);
+	if (!cortexm_recover(t)) {
+		tc_printf(t, "Option bytes written, scan and attach again\n");
+		return false;
+	}
+	return true;
+}
+
 /*
  * Enables irreversible operations:
  * RDP level 2 read protection.
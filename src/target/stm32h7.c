@@ -36,6 +36,7 @@
 #include "target.h"
 #include "target_internal.h"
 #include "cortexm.h"
+#include "stm32_qspi.h"
 
 /* static bool stm32h7_cmd_option(target *t, int argc, char *argv[]); */
 static bool stm32h7_uid(target *t, int argc, const char **argv);
@@ -53,6 +54,9 @@ const struct command_s stm32h7_cmd_list[] = {
 };
 
 static bool stm32h7_flash_erase(target_flash_s *f, target_addr_t addr, size_t len);
+static bool stm32h7_flash_bank_erase(target_flash_s *f);
+static bool stm32h7_flash_erase_start(target_flash_s *f, target_addr_t addr, size_t len);
+static bool stm32h7_flash_erase_busy(target_flash_s *f, bool *busy);
 static bool stm32h7_flash_write(target_flash_s *f, target_addr_t dest, const void *src, size_t len);
 static bool stm32h7_mass_erase(target *t);
 
@@ -110,6 +114,11 @@ enum stm32h7_regs {
 #define FLASH_CR_SNB		(3 << 8)
 #define FLASH_CR_CRC_EN		(1 << 15)
 
+/* Typical operation times at x64 parallelism from the datasheets, to pace the status polls */
+#define FLASH_PROGRAM_US       20U
+#define FLASH_SECTOR_ERASE_US  1000000U
+#define FLASH_BANK_ERASE_US    3000000U
+
 #define FLASH_OPTCR_OPTLOCK	(1 << 0)
 #define FLASH_OPTCR_OPTSTRT	(1 << 1)
 
@@ -140,6 +149,19 @@ enum stm32h7_regs {
 #define D3DBGCKEN		(1 << 22)
 
 
+#define RCC_AHB3ENR			0x580244D4
+#define RCC_AHB3ENR_QSPIEN	(1 << 14) /* OCTOSPI1EN on the H7Ax/Bx and H72x/73x */
+#define QSPI_BASE			0x52005000 /* OCTOSPI1 on the H7Ax/Bx and H72x/73x */
+#define RCC_AHB4ENR			0x580244E0
+
+static const stm32_qspi_family_s stm32h7_qspi_family = {
+	.rcc_enr = RCC_AHB3ENR,
+	.rcc_en = RCC_AHB3ENR_QSPIEN,
+	.rcc_gpio_enr = RCC_AHB4ENR,
+	.gpio_base = 0x58020000,
+	.gpio_ports = 11, /* A to K */
+};
+
 #define BANK1_START 		0x08000000
 #define NUM_SECTOR_PER_BANK 8
 #define FLASH_SECTOR_SIZE 	0x20000
@@ -162,7 +184,7 @@ struct stm32h7_priv_s {
 
 static void stm32h7_add_flash(target *t, uint32_t addr, size_t length, size_t blocksize)
 {
-	struct stm32h7_flash *sf = calloc(1, sizeof(*sf));
+	struct stm32h7_flash *sf = target_arena_calloc(sizeof(*sf));
 	if (!sf) { /* calloc failed: heap exhaustion */
 		DEBUG_WARN("calloc: failed in %s\n", __func__);
 		return;
@@ -173,6 +195,9 @@ static void stm32h7_add_flash(target *t, uint32_t addr, size_t length, size_t bl
 	f->length = length;
 	f->blocksize = blocksize;
 	f->erase = stm32h7_flash_erase;
+	f->bank_erase = stm32h7_flash_bank_erase;
+	f->erase_start = stm32h7_flash_erase_start;
+	f->erase_busy = stm32h7_flash_erase_busy;
 	f->write = stm32h7_flash_write;
 	f->writesize = 2048;
 	f->erased = 0xff;
@@ -180,6 +205,8 @@ static void stm32h7_add_flash(target *t, uint32_t addr, size_t length, size_t bl
 	if (addr >= BANK2_START)
 		sf->regbase = FPEC2_BASE;
 	sf->psize = ALIGN_DWORD;
+	/* Each bank has its own controller, so one can erase while the other programs */
+	f->independent = true;
 	target_add_flash(t, f);
 }
 
@@ -210,6 +237,14 @@ static bool stm32h7_attach(target *t)
 	/* Add the flash to memory map. */
 	stm32h7_add_flash(t, 0x8000000, 0x100000, FLASH_SECTOR_SIZE);
 	stm32h7_add_flash(t, 0x8100000, 0x100000, FLASH_SECTOR_SIZE);
+
+	/* External SPI NOR, once the firmware has set up the controller and its pins */
+	if (target_mem_read32(t, RCC_AHB3ENR) & RCC_AHB3ENR_QSPIEN) {
+		if (t->part_id == ID_STM32H74x)
+			stm32_qspi_add_flash(t, QSPI_BASE, &stm32h7_qspi_family);
+		else
+			stm32_octospi_add_flash(t, QSPI_BASE, &stm32h7_qspi_family);
+	}
 	return true;
 }
 
@@ -230,7 +265,7 @@ bool stm32h7_probe(target *t)
 		t->detach = stm32h7_detach;
 		target_add_commands(t, stm32h7_cmd_list, stm32h7_driver_str);
 		/* Save private storage */
-		struct stm32h7_priv_s *priv_storage = calloc(1, sizeof(*priv_storage));
+		struct stm32h7_priv_s *priv_storage = target_arena_calloc(sizeof(*priv_storage));
 		priv_storage->dbg_cr = target_mem_read32(t, DBGMCU_CR);
 		t->target_storage = (void*)priv_storage;
 		/* RM0433 Rev 4 is not really clear, what bits are needed in DBGMCU_CR.
@@ -243,10 +278,13 @@ bool stm32h7_probe(target *t)
 	return false;
 }
 
-static bool stm32h7_flash_busy_wait(target *t, uint32_t regbase)
+static bool stm32h7_flash_busy_wait(target *t, uint32_t regbase, uint32_t expected_us)
 {
+	flash_wait_s wait;
+	target_flash_wait_init(&wait, expected_us);
 	uint32_t sr;
 	do {
+		target_flash_wait_poll(&wait);
 		sr = target_mem_read32(t, regbase + FLASH_SR);
 		if ((sr & FLASH_SR_ERROR_MASK) || target_check_error(t)) {
 			DEBUG_WARN("stm32h7_flash_write: error sr %08" PRIx32 "\n", sr);
@@ -264,7 +302,7 @@ static bool stm32h7_flash_unlock(target *t, const uint32_t addr)
 	if (addr >= BANK2_START)
 		regbase = FPEC2_BASE;
 
-	if (!stm32h7_flash_busy_wait(t, regbase))
+	if (!stm32h7_flash_busy_wait(t, regbase, 0))
 		return false;
 
 	if (target_mem_read32(t, regbase + FLASH_CR) & FLASH_CR_LOCK) {
@@ -275,8 +313,10 @@ static bool stm32h7_flash_unlock(target *t, const uint32_t addr)
 	return !(target_mem_read32(t, regbase + FLASH_CR) & FLASH_CR_LOCK);
 }
 
-static bool stm32h7_flash_erase(target_flash_s *f, target_addr_t addr, size_t len)
+/* Start erasing the sector at addr, leaving it to run while other work goes on */
+static bool stm32h7_flash_erase_start(target_flash_s *f, target_addr_t addr, size_t len)
 {
+	(void)len;
 	target *t = f->t;
 	struct stm32h7_flash *sf = (struct stm32h7_flash *)f;
 	if (!stm32h7_flash_unlock(t, addr))
@@ -284,23 +324,40 @@ static bool stm32h7_flash_erase(target_flash_s *f, target_addr_t addr, size_t le
 	/* We come out of reset with HSI 64 MHz. Adapt FLASH_ACR.*/
 	target_mem_write32(t, sf->regbase + FLASH_ACR, 0);
 	addr &= (NUM_SECTOR_PER_BANK * FLASH_SECTOR_SIZE) - 1;
-	size_t start_sector =  addr / FLASH_SECTOR_SIZE;
-	const size_t end_sector = (addr + len - 1) / FLASH_SECTOR_SIZE;
-
-	enum align psize = ((struct stm32h7_flash *)f)->psize;
-	while (start_sector <= end_sector) {
-		uint32_t ctrl_reg = (psize * FLASH_CR_PSIZE16) | FLASH_CR_SER | (start_sector * FLASH_CR_SNB_1);
-		target_mem_write32(t, sf->regbase + FLASH_CR, ctrl_reg);
-		ctrl_reg |= FLASH_CR_START;
-		target_mem_write32(t, sf->regbase + FLASH_CR, ctrl_reg);
-		DEBUG_INFO(" started cr %08" PRIx32 " sr %08" PRIx32 "\n",
-			target_mem_read32(t, sf->regbase + FLASH_CR),
-			target_mem_read32(t, sf->regbase + FLASH_SR));
-
-		if (!stm32h7_flash_busy_wait(t, sf->regbase))
-			return false;
+	const size_t sector = addr / FLASH_SECTOR_SIZE;
+
+	uint32_t ctrl_reg = (sf->psize * FLASH_CR_PSIZE16) | FLASH_CR_SER | (sector * FLASH_CR_SNB_1);
+	target_mem_write32(t, sf->regbase + FLASH_CR, ctrl_reg);
+	ctrl_reg |= FLASH_CR_START;
+	target_mem_write32(t, sf->regbase + FLASH_CR, ctrl_reg);
+	DEBUG_INFO(" started cr %08" PRIx32 " sr %08" PRIx32 "\n",
+		target_mem_read32(t, sf->regbase + FLASH_CR),
+		target_mem_read32(t, sf->regbase + FLASH_SR));
+	return !target_check_error(t);
+}
+
+static bool stm32h7_flash_erase_busy(target_flash_s *f, bool *busy)
+{
+	target *t = f->t;
+	const uint32_t regbase = ((struct stm32h7_flash *)f)->regbase;
+	const uint32_t sr = target_mem_read32(t, regbase + FLASH_SR);
+	if ((sr & FLASH_SR_ERROR_MASK) || target_check_error(t)) {
+		DEBUG_WARN("stm32h7_flash_erase: error sr %08" PRIx32 "\n", sr);
+		target_mem_write32(t, regbase + FLASH_CCR, sr & FLASH_SR_ERROR_MASK);
+		return false;
+	}
+	*busy = sr & (FLASH_SR_BSY | FLASH_SR_QW);
+	return true;
+}
 
-		++start_sector;
+static bool stm32h7_flash_erase(target_flash_s *f, target_addr_t addr, size_t len)
+{
+	const uint32_t regbase = ((struct stm32h7_flash *)f)->regbase;
+	const target_addr_t end = addr + len;
+	for (addr &= ~(FLASH_SECTOR_SIZE - 1U); addr < end; addr += FLASH_SECTOR_SIZE) {
+		if (!stm32h7_flash_erase_start(f, addr, FLASH_SECTOR_SIZE) ||
+			!stm32h7_flash_busy_wait(f->t, regbase, FLASH_SECTOR_ERASE_US))
+			return false;
 	}
 	return true;
 }
@@ -320,7 +377,7 @@ static bool stm32h7_flash_write(target_flash_s *f, target_addr_t dest, const voi
 
 	target_mem_write(t, dest, src, len);
 
-	if (!stm32h7_flash_busy_wait(t, sf->regbase))
+	if (!stm32h7_flash_busy_wait(t, sf->regbase, FLASH_PROGRAM_US))
 		return false;
 
 	/* Close write windows.*/
@@ -345,13 +402,18 @@ static bool stm32h7_erase_bank(target *const t, const enum align psize,
 
 static bool stm32h7_wait_erase_bank(target *const t, platform_timeout *timeout, const uint32_t reg_base)
 {
-	while (target_mem_read32(t, reg_base + FLASH_SR) & FLASH_SR_QW) {
+	flash_wait_s wait;
+	target_flash_wait_init(&wait, FLASH_BANK_ERASE_US);
+	uint32_t sr;
+	do {
+		target_flash_wait_poll(&wait);
+		sr = target_mem_read32(t, reg_base + FLASH_SR);
 		if (target_check_error(t)) {
 			DEBUG_WARN("mass erase bank: comm failed\n");
 			return false;
 		}
 		target_print_progress(timeout);
-	}
+	} while (sr & FLASH_SR_QW);
 	return true;
 }
 
@@ -363,6 +425,19 @@ static bool stm32h7_check_bank(target *const t, const uint32_t reg_base)
 	return !(status & FLASH_SR_ERROR_MASK);
 }
 
+/* Erase a whole bank with one BER rather than walking its 8 sectors */
+static bool stm32h7_flash_bank_erase(target_flash_s *f)
+{
+	target *t = f->t;
+	const struct stm32h7_flash *sf = (struct stm32h7_flash *)f;
+	if (!stm32h7_erase_bank(t, sf->psize, f->start, sf->regbase))
+		return false;
+
+	platform_timeout timeout;
+	platform_timeout_set(&timeout, 500);
+	return stm32h7_wait_erase_bank(t, &timeout, sf->regbase) && stm32h7_check_bank(t, sf->regbase);
+}
+
 /* Both banks are erased in parallel.*/
 static bool stm32h7_mass_erase(target *t)
 {
@@ -373,7 +448,7 @@ static bool stm32h7_mass_erase(target *t)
 	}
 	/* Send mass erase Flash start instruction */
 	if (!stm32h7_erase_bank(t, psize, BANK1_START, FPEC1_BASE) ||
-		stm32h7_erase_bank(t, psize, BANK2_START, FPEC2_BASE))
+		!stm32h7_erase_bank(t, psize, BANK2_START, FPEC2_BASE))
 		return false;
 
 	platform_timeout timeout;
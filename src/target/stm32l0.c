@@ -148,6 +148,7 @@ static bool stm32lx_nvm_prog_write(target_flash_s *f, target_addr_t destination,
 
 static bool stm32lx_nvm_data_erase(target_flash_s *f, target_addr_t addr, size_t len);
 static bool stm32lx_nvm_data_write(target_flash_s *f, target_addr_t destination, const void *source, size_t size);
+static bool stm32lx_nvm_done(target_flash_s *f);
 
 static bool stm32lx_cmd_option(target *t, int argc, char **argv);
 static bool stm32lx_cmd_eeprom(target *t, int argc, char **argv);
@@ -218,9 +219,18 @@ static uint32_t stm32lx_nvm_option_size(target *t)
 	}
 }
 
+static const uint16_t stm32lx_nvm_prog_write_stub[] = {
+#include "flashstub/stm32l0.stub"
+};
+
+static const target_flash_stub_s stm32lx_nvm_prog_stub = {
+	.code = stm32lx_nvm_prog_write_stub,
+	.code_size = sizeof(stm32lx_nvm_prog_write_stub),
+};
+
 static void stm32l_add_flash(target *t, uint32_t addr, size_t length, size_t erasesize)
 {
-	target_flash_s *f = calloc(1, sizeof(*f));
+	target_flash_s *f = target_arena_calloc(sizeof(*f));
 	if (!f) { /* calloc failed: heap exhaustion */
 		DEBUG_WARN("calloc: failed in %s\n", __func__);
 		return;
@@ -231,13 +241,15 @@ static void stm32l_add_flash(target *t, uint32_t addr, size_t length, size_t era
 	f->blocksize = erasesize;
 	f->erase = stm32lx_nvm_prog_erase;
 	f->write = stm32lx_nvm_prog_write;
+	f->done = stm32lx_nvm_done;
+	f->stub = &stm32lx_nvm_prog_stub;
 	f->writesize = erasesize / 2;
 	target_add_flash(t, f);
 }
 
 static void stm32l_add_eeprom(target *t, uint32_t addr, size_t length)
 {
-	target_flash_s *f = calloc(1, sizeof(*f));
+	target_flash_s *f = target_arena_calloc(sizeof(*f));
 	if (!f) { /* calloc failed: heap exhaustion */
 		DEBUG_WARN("calloc: failed in %s\n", __func__);
 		return;
@@ -248,6 +260,7 @@ static void stm32l_add_eeprom(target *t, uint32_t addr, size_t length)
 	f->blocksize = 4;
 	f->erase = stm32lx_nvm_data_erase;
 	f->write = stm32lx_nvm_data_write;
+	f->done = stm32lx_nvm_done;
 	target_add_flash(t, f);
 }
 
@@ -267,6 +280,8 @@ bool stm32l0_probe(target *t)
 		stm32l_add_flash(t, 0x8000000, 0x80000, 0x100);
 		//stm32l_add_eeprom(t, 0x8080000, 0x4000);
 		target_add_commands(t, stm32lx_cmd_list, "STM32L1x");
+		/* The AHB runs from the 2.1MHz MSI out of reset */
+		adiv5_dp_idle_hint(cortexm_ap(t)->dp, ADIV5_IDLE_AFTER_LOW_POWER);
 		return true;
 	case 0x457: /* STM32L0xx Cat1 */
 	case 0x425: /* STM32L0xx Cat2 */
@@ -279,6 +294,7 @@ bool stm32l0_probe(target *t)
 		stm32l_add_flash(t, 0x8020000, 0x10000, 0x80);
 		stm32l_add_eeprom(t, 0x8080000, 0x1800);
 		target_add_commands(t, stm32lx_cmd_list, "STM32L0x");
+		adiv5_dp_idle_hint(cortexm_ap(t)->dp, ADIV5_IDLE_AFTER_LOW_POWER);
 		return true;
 	}
 
@@ -321,6 +337,16 @@ static bool stm32lx_nvm_opt_unlock(target *t, uint32_t nvm)
 	return !(target_mem_read32(t, STM32Lx_NVM_PECR(nvm)) & STM32Lx_NVM_PECR_OPTLOCK);
 }
 
+/** Unlock for a flash session unless that's already been done, as
+    unlocking starts by locking, which would upset an operation in
+    progress.  Locked again by stm32lx_nvm_done(). */
+static bool stm32lx_nvm_session_unlock(target *t, uint32_t nvm)
+{
+	if (!(target_mem_read32(t, STM32Lx_NVM_PECR(nvm)) & (STM32Lx_NVM_PECR_PELOCK | STM32Lx_NVM_PECR_PRGLOCK)))
+		return true;
+	return stm32lx_nvm_prog_data_unlock(t, nvm);
+}
+
 static bool stm32lx_nvm_busy_wait(target *t, uint32_t nvm)
 {
 	uint32_t sr;
@@ -380,6 +406,14 @@ static bool stm32lx_nvm_prog_write(target_flash_s *f, target_addr_t dest, const
 	target *t = f->t;
 	const uint32_t nvm = stm32lx_nvm_phys(t);
 
+	/* The half page has to be written in one burst, which only a stub
+	   on the target can guarantee.  It waits for BSY itself. */
+	if (cortexm_flash_stub_load(f)) {
+		if (!stm32lx_nvm_session_unlock(t, nvm))
+			return false;
+		return cortexm_flash_stub_write(f, dest, src, size, nvm);
+	}
+
 	if (!stm32lx_nvm_prog_data_unlock(t, nvm))
 		return false;
 
@@ -443,34 +477,44 @@ static bool stm32lx_nvm_data_erase(target_flash_s *f, target_addr_t addr, size_t
 /** Write to data flash using operations through the debug interface.
     NVM register file address chosen from target.  Unaligned
     destination writes are supported (though unaligned sources are
-    not). */
+    not).  Each word takes milliseconds to program, so words that
+    already hold their value are skipped, and PECR stays unlocked for
+    the rest of the session. */
 static bool stm32lx_nvm_data_write(target_flash_s *f, target_addr_t destination, const void *src, size_t size)
 {
 	target *t = f->t;
 	const uint32_t nvm = stm32lx_nvm_phys(t);
 	const bool is_stm32l1 = stm32lx_is_stm32l1(t);
 	uint32_t *source = (uint32_t *)src;
-
-	if (!stm32lx_nvm_prog_data_unlock(t, nvm))
-		return false;
-
-	target_mem_write32(t, STM32Lx_NVM_PECR(nvm), is_stm32l1 ? 0 : STM32Lx_NVM_PECR_DATA);
+	bool written = false;
 
 	while (size) {
 		size -= 4;
 		uint32_t v = *source++;
-		target_mem_write32(t, destination, v);
+		if (target_mem_read32(t, destination) != v) {
+			if (!written) {
+				if (!stm32lx_nvm_session_unlock(t, nvm))
+					return false;
+				target_mem_write32(t, STM32Lx_NVM_PECR(nvm), is_stm32l1 ? 0 : STM32Lx_NVM_PECR_DATA);
+				written = true;
+			}
+			target_mem_write32(t, destination, v);
+		}
 		destination += 4;
 
 		if (target_check_error(t))
 			return false;
 	}
 
-	/* Disable further programming by locking PECR */
-	stm32lx_nvm_lock(t, nvm);
-
 	/* Wait for completion or an error */
-	return stm32lx_nvm_busy_wait(t, nvm);
+	return !written || stm32lx_nvm_busy_wait(t, nvm);
+}
+
+/** Lock PECR again at the end of a flash session. */
+static bool stm32lx_nvm_done(target_flash_s *f)
+{
+	stm32lx_nvm_lock(f->t, stm32lx_nvm_phys(f->t));
+	return true;
 }
 
 /** Write one option word.  The address is the physical address of the
@@ -40,6 +40,7 @@
 #include "target.h"
 #include "target_internal.h"
 #include "cortexm.h"
+#include "stm32_qspi.h"
 #include "gdb_packet.h"
 
 static bool stm32l4_cmd_erase_bank1(target *t, int argc, const char **argv);
@@ -55,7 +56,9 @@ const struct command_s stm32l4_cmd_list[] = {
 
 static bool stm32l4_flash_erase(target_flash_s *f, target_addr_t addr, size_t len);
 static bool stm32l4_flash_write(target_flash_s *f, target_addr_t dest, const void *src, size_t len);
+static bool stm32l4_exit_flash_mode(target *t);
 static bool stm32l4_mass_erase(target *t);
+static bool stm32l4_flash_bank_erase(target_flash_s *f);
 
 /* Flash Program ad Erase Controller Register Map */
 #define L4_FPEC_BASE			0x40022000
@@ -130,6 +133,7 @@ enum {
 struct stm32l4_flash {
 	target_flash_s f;
 	uint32_t bank1_start;
+	bool fast; /* Bank was mass erased in this flash mode session, so rows can be fast programmed */
 };
 
 struct stm32l4_priv_s {
@@ -364,9 +368,35 @@ static void stm32l4_flash_write32(target *t, enum stm32l4_flash_regs reg, uint32
 	target_mem_write32(t, addr, value);
 }
 
+#define L4_RCC_CR              0x40021000
+#define L4_RCC_CR_MSIRGSEL     (1 << 3)
+#define L4_RCC_CR_MSIRANGE_MSK (0xf << 4)
+#define L4_RCC_CR_MSIRANGE_16M (8 << 4)
+
+#define STM32L4_FAST_ROW_SIZE 256U
+
+static const uint16_t stm32l4_flash_write_stub[] = {
+#include "flashstub/stm32l4.stub"
+};
+
+static const target_flash_stub_s stm32l4_flash_stub = {
+	.code = stm32l4_flash_write_stub,
+	.code_size = sizeof(stm32l4_flash_write_stub),
+};
+
+/*
+ * FSTPG needs HCLK of at least 8MHz. The G4 comes out of reset on HSI16, the L4
+ * on a 4MHz MSI that can go to 16MHz without changing the flash latency. The
+ * WB and WL have CPU2 and the radio to consider, and the L5 has no fast mode.
+ */
+static bool stm32l4_flash_fast_capable(const struct stm32l4_info *const chip)
+{
+	return chip->family == FAM_STM32L4xx || chip->family == FAM_STM32L4Rx || chip->family == FAM_STM32G4xx;
+}
+
 static void stm32l4_add_flash(target *t, uint32_t addr, size_t length, size_t blocksize, uint32_t bank1_start)
 {
-	struct stm32l4_flash *sf = calloc(1, sizeof(*sf));
+	struct stm32l4_flash *sf = target_arena_calloc(sizeof(*sf));
 	if (!sf) { /* calloc failed: heap exhaustion */
 		DEBUG_WARN("calloc: failed in %s\n", __func__);
 		return;
@@ -377,13 +407,29 @@ static void stm32l4_add_flash(target *t, uint32_t addr, size_t length, size_t bl
 	f->length = length;
 	f->blocksize = blocksize;
 	f->erase = stm32l4_flash_erase;
+	f->bank_erase = stm32l4_flash_bank_erase;
 	f->write = stm32l4_flash_write;
+	if (stm32l4_flash_fast_capable(stm32l4_get_chip_info(t->part_id)))
+		f->stub = &stm32l4_flash_stub;
 	f->writesize = 2048;
 	f->erased = 0xff;
 	sf->bank1_start = bank1_start;
 	target_add_flash(t, f);
 }
 
+#define L4_RCC_AHB3ENR        0x40021050
+#define L4_RCC_AHB3ENR_QSPIEN (1 << 8) /* OCTOSPI1EN on the L4R/S */
+#define L4_QSPI_BASE          0xa0001000 /* OCTOSPI1 on the L4R/S */
+#define L4_RCC_AHB2ENR        0x4002104c
+
+static const stm32_qspi_family_s stm32l4_qspi_family = {
+	.rcc_enr = L4_RCC_AHB3ENR,
+	.rcc_en = L4_RCC_AHB3ENR_QSPIEN,
+	.rcc_gpio_enr = L4_RCC_AHB2ENR,
+	.gpio_base = 0x48000000,
+	.gpio_ports = 9, /* A to I, fewer on the smaller parts */
+};
+
 #define L5_RCC_APB1ENR1        0x50021058
 #define L5_RCC_APB1ENR1_PWREN (1 << 28)
 #define L5_PWR_CR1             0x50007000
@@ -416,7 +462,7 @@ static bool stm32l4_attach(target *t)
 		break;
 	}
 	/* Save DBGMCU_CR to restore it when detaching*/
-	struct stm32l4_priv_s *priv_storage = calloc(1, sizeof(*priv_storage));
+	struct stm32l4_priv_s *priv_storage = target_arena_calloc(sizeof(*priv_storage));
 	priv_storage->dbgmcu_cr = target_mem_read32(t, DBGMCU_CR(idcodereg));
 	t->target_storage = (void*)priv_storage;
 
@@ -494,6 +540,14 @@ static bool stm32l4_attach(target *t)
 	/* Clear all errors in the status register. */
 	stm32l4_flash_write32(t, FLASH_SR, stm32l4_flash_read32(t, FLASH_SR));
 
+	/* External SPI NOR, once the firmware has set up the controller and its pins */
+	if (target_mem_read32(t, L4_RCC_AHB3ENR) & L4_RCC_AHB3ENR_QSPIEN) {
+		if (chip->family == FAM_STM32L4Rx)
+			stm32_octospi_add_flash(t, L4_QSPI_BASE, &stm32l4_qspi_family);
+		else if (chip->family == FAM_STM32L4xx || chip->family == FAM_STM32G4xx)
+			stm32_qspi_add_flash(t, L4_QSPI_BASE, &stm32l4_qspi_family);
+	}
+
 	return true;
 }
 
@@ -554,6 +608,7 @@ bool stm32l4_probe(target *t)
 			}
 	}
 	t->mass_erase = stm32l4_mass_erase;
+	t->exit_flash_mode = stm32l4_exit_flash_mode;
 	t->attach = stm32l4_attach;
 	t->detach = stm32l4_detach;
 	target_add_commands(t, stm32l4_cmd_list, chip->designator);
@@ -587,6 +642,8 @@ static bool stm32l4_flash_busy_wait(target *t)
 static bool stm32l4_flash_erase(target_flash_s *f, target_addr_t addr, size_t len)
 {
 	target *t = f->t;
+	/* Fast programming wants the whole bank mass erased */
+	((struct stm32l4_flash *)f)->fast = false;
 	stm32l4_flash_unlock(t);
 
 	if (!stm32l4_flash_busy_wait(t))
@@ -624,6 +681,15 @@ static bool stm32l4_flash_erase(target_flash_s *f, target_addr_t addr, size_t le
 static bool stm32l4_flash_write(target_flash_s *f, target_addr_t dest, const void *src, size_t len)
 {
 	target *t = f->t;
+	/*
+	 * After a mass erase whole rows go through the FSTPG stub, which has to run
+	 * on the target as the flash needs each row's data without gaps.
+	 */
+	if (((struct stm32l4_flash *)f)->fast && !(dest % STM32L4_FAST_ROW_SIZE) && !(len % STM32L4_FAST_ROW_SIZE) &&
+		cortexm_flash_stub_load(f)) {
+		struct stm32l4_info const *chip = stm32l4_get_chip_info(t->part_id);
+		return cortexm_flash_stub_write(f, dest, src, len, chip->flash_regs_map[FLASH_SR]);
+	}
 	stm32l4_flash_write32(t, FLASH_CR, FLASH_CR_PG);
 	target_mem_write(t, dest, src, len);
 
@@ -659,6 +725,45 @@ static bool stm32l4_mass_erase(target *const t)
 	return stm32l4_cmd_erase(t, FLASH_CR_MER1 | FLASH_CR_MER2);
 }
 
+/* Note a freshly mass erased bank can be fast programmed, raising the L4's clock for it */
+static void stm32l4_flash_fast_enable(target_flash_s *const f)
+{
+	target *const t = f->t;
+	struct stm32l4_info const *chip = stm32l4_get_chip_info(t->part_id);
+	if (!f->stub)
+		return;
+	if (chip->family != FAM_STM32G4xx) {
+		/* The reset that started flash mode left the core on MSI, leaving flash mode resets it */
+		const uint32_t rcc_cr = target_mem_read32(t, L4_RCC_CR) & ~L4_RCC_CR_MSIRANGE_MSK;
+		target_mem_write32(t, L4_RCC_CR, rcc_cr | L4_RCC_CR_MSIRANGE_16M | L4_RCC_CR_MSIRGSEL);
+	}
+	((struct stm32l4_flash *)f)->fast = true;
+}
+
+static bool stm32l4_exit_flash_mode(target *const t)
+{
+	for (target_flash_s *f = t->flash; f; f = f->next) {
+		if (f->write == stm32l4_flash_write)
+			((struct stm32l4_flash *)f)->fast = false;
+	}
+	/* Reset as usual, which also puts back the clock fast programming raised */
+	target_reset(t);
+	return true;
+}
+
+/* A flash that is one of two banks gets that bank's erase, otherwise it is the whole array */
+static bool stm32l4_flash_bank_erase(target_flash_s *const f)
+{
+	const uint32_t bank1_start = ((struct stm32l4_flash *)f)->bank1_start;
+	uint32_t action = FLASH_CR_MER1 | FLASH_CR_MER2;
+	if (bank1_start != UINT32_MAX)
+		action = f->start >= bank1_start ? FLASH_CR_MER2 : FLASH_CR_MER1;
+	if (!stm32l4_cmd_erase(f->t, action))
+		return false;
+	stm32l4_flash_fast_enable(f);
+	return true;
+}
+
 static bool stm32l4_cmd_erase_bank1(target *const t, const int argc, const char **const argv)
 {
 	(void)argc;
@@ -21,23 +21,133 @@
 #include "general.h"
 #include "target_internal.h"
 #include "gdb_packet.h"
+#include "stats.h"
+#if PC_HOSTED == 1
+#include "read_cache.h"
+#endif
 
 #include <stdarg.h>
 #include <unistd.h>
 
 target *target_list = NULL;
 
-#define STDOUT_READ_BUF_SIZE	64
+#define STDOUT_READ_BUF_SIZE	256U
 
 static bool target_cmd_mass_erase(target *t, int argc, const char **argv);
 static bool target_cmd_range_erase(target *t, int argc, const char **argv);
+static bool target_cmd_flash_option(target *t, int argc, const char **argv);
 
 const struct command_s target_cmd_list[] = {
 	{"erase_mass", (cmd_handler)target_cmd_mass_erase, "Erase whole device Flash"},
 	{"erase_range", (cmd_handler)target_cmd_range_erase, "Erase a range of memory on a device"},
+	{"flash_option", (cmd_handler)target_cmd_flash_option,
+		"Option bytes to write as the next flash session ends: (<addr> <value>...|apply|clear)"},
 	{NULL, NULL, NULL}
 };
 
+/*
+ * Target, flash and driver descriptions all live until the next scan, so rather
+ * than leaving a spray of small holes in the heap behind every scan they are
+ * carved out of a few large chunks that target_list_free() hands back at once.
+ * Drivers that rebuild their memory map on attach free and then ask for the same
+ * sizes again, so freed blocks are kept to be handed out again for an exact fit.
+ */
+#ifndef TARGET_ARENA_CHUNK_SIZE
+#if PC_HOSTED == 1
+#define TARGET_ARENA_CHUNK_SIZE 4096U
+#else
+#define TARGET_ARENA_CHUNK_SIZE 1024U
+#endif
+#endif
+#define TARGET_ARENA_ALIGN _Alignof(max_align_t)
+
+typedef struct target_arena_chunk {
+	struct target_arena_chunk *next;
+	size_t size;
+	size_t used;
+	max_align_t data[];
+} target_arena_chunk_s;
+
+/* Every block starts with its size, a free one has the next free block after that */
+typedef union target_arena_block {
+	size_t size;
+	max_align_t align;
+} target_arena_block_u;
+
+static target_arena_chunk_s *target_arena;
+static target_arena_block_u *target_arena_free_list;
+
+static target_arena_block_u **target_arena_next_free(target_arena_block_u *const block)
+{
+	return (target_arena_block_u **)(block + 1);
+}
+
+void *target_arena_calloc(const size_t size)
+{
+	const size_t aligned =
+		sizeof(target_arena_block_u) + ((MAX(size, 1U) + TARGET_ARENA_ALIGN - 1U) & ~(TARGET_ARENA_ALIGN - 1U));
+	target_arena_block_u *block = NULL;
+	for (target_arena_block_u **prev = &target_arena_free_list; *prev; prev = target_arena_next_free(*prev)) {
+		if ((*prev)->size == aligned) {
+			block = *prev;
+			*prev = *target_arena_next_free(block);
+			break;
+		}
+	}
+
+	if (!block) {
+		target_arena_chunk_s *chunk = target_arena;
+		if (!chunk || chunk->size - chunk->used < aligned) {
+			/* Anything bigger than a chunk gets one of its own, behind the one being filled */
+			const size_t chunk_size = MAX(aligned, TARGET_ARENA_CHUNK_SIZE);
+			chunk = malloc(sizeof(*chunk) + chunk_size);
+			if (!chunk)
+				return NULL;
+			chunk->size = chunk_size;
+			chunk->used = 0;
+			if (target_arena && chunk_size > TARGET_ARENA_CHUNK_SIZE) {
+				chunk->next = target_arena->next;
+				target_arena->next = chunk;
+			} else {
+				chunk->next = target_arena;
+				target_arena = chunk;
+			}
+		}
+		block = (target_arena_block_u *)((uint8_t *)chunk->data + chunk->used);
+		chunk->used += aligned;
+		block->size = aligned;
+	}
+	memset(block + 1, 0, aligned - sizeof(*block));
+	return block + 1;
+}
+
+void target_arena_free(void *const ptr)
+{
+	if (!ptr)
+		return;
+	for (const target_arena_chunk_s *chunk = target_arena; chunk; chunk = chunk->next) {
+		const uint8_t *const data = (const uint8_t *)chunk->data;
+		if ((const uint8_t *)ptr >= data && (const uint8_t *)ptr < data + chunk->size) {
+			target_arena_block_u *const block = (target_arena_block_u *)ptr - 1;
+			*target_arena_next_free(block) = target_arena_free_list;
+			target_arena_free_list = block;
+			return;
+		}
+	}
+	/* Not from the arena, so it came from malloc() */
+	free(ptr);
+}
+
+static void target_arena_release(void)
+{
+	target_arena_free_list = NULL;
+	while (target_arena) {
+		target_arena_chunk_s *const next = target_arena->next;
+		free(target_arena);
+		target_arena = next;
+	}
+}
+
 static bool nop_function(void)
 {
 	return true;
@@ -50,7 +160,7 @@ static bool false_function(void)
 
 target *target_new(void)
 {
-	target *t = (void*)calloc(1, sizeof(*t));
+	target *t = target_arena_calloc(sizeof(*t));
 	if (!t) {			/* calloc failed: heap exhaustion */
 		DEBUG_WARN("calloc: failed in %s\n", __func__);
 		return NULL;
@@ -94,21 +204,28 @@ int target_foreach(void (*cb)(int, target *t, void *context), void *context)
 	return i;
 }
 
+/* The RAM or flash regions changed, so the memory map XML needs building again */
+static void target_mem_map_invalidate(target *t)
+{
+	free(t->mem_map);
+	t->mem_map = NULL;
+}
 
 void target_ram_map_free(target *t) {
+	target_mem_map_invalidate(t);
 	while (t->ram) {
 		void * next = t->ram->next;
-		free(t->ram);
+		target_arena_free(t->ram);
 		t->ram = next;
 	}
 }
 
 void target_flash_map_free(target *t) {
+	target_mem_map_invalidate(t);
 	while (t->flash) {
 		void * next = t->flash->next;
-		if (t->flash->buf)
-			free(t->flash->buf);
-		free(t->flash);
+		free(t->flash->erase_pending);
+		target_arena_free(t->flash);
 		t->flash = next;
 	}
 }
@@ -123,6 +240,9 @@ void target_list_free(void)
 {
 	struct target_command_s *tc;
 
+#if PC_HOSTED == 1
+	read_cache_invalidate(NULL);
+#endif
 	while (target_list) {
 		target *t = target_list->next;
 		if (target_list->tc && target_list->tc->destroy_callback)
@@ -131,26 +251,27 @@ void target_list_free(void)
 			target_list->priv_free(target_list->priv);
 		while (target_list->commands) {
 			tc = target_list->commands->next;
-			free(target_list->commands);
+			target_arena_free(target_list->commands);
 			target_list->commands = tc;
 		}
-		free(target_list->target_storage);
+		target_arena_free(target_list->target_storage);
 		target_mem_map_free(target_list);
 		while (target_list->bw_list) {
 			void * next = target_list->bw_list->next;
 			free(target_list->bw_list);
 			target_list->bw_list = next;
 		}
-		free(target_list);
+		target_arena_free(target_list);
 		target_list = t;
 	}
+	target_arena_release();
 }
 
 void target_add_commands(target *t, const struct command_s *cmds, const char *name)
 {
-	struct target_command_s *tc = malloc(sizeof(*tc));
-	if (!tc) {			/* malloc failed: heap exhaustion */
-		DEBUG_WARN("malloc: failed in %s\n", __func__);
+	struct target_command_s *tc = target_arena_calloc(sizeof(*tc));
+	if (!tc) {			/* calloc failed: heap exhaustion */
+		DEBUG_WARN("calloc: failed in %s\n", __func__);
 		return;
 	}
 
@@ -176,6 +297,16 @@ target *target_attach_n(const size_t n, struct target_controller *tc)
 	return NULL;
 }
 
+size_t target_group(target *const t, target **const cores, const size_t max)
+{
+	size_t count = 0;
+	for (target *core = target_list; core && count < max; core = core->next) {
+		if (core == t || (t->group && core->group == t->group))
+			cores[count++] = core;
+	}
+	return count;
+}
+
 target *target_attach(target *t, struct target_controller *tc)
 {
 	if (t->tc)
@@ -183,6 +314,8 @@ target *target_attach(target *t, struct target_controller *tc)
 
 	t->tc = tc;
 	platform_target_clk_output_enable(true);
+	/* Attach may size or add regions, so the map is built afresh for each one */
+	target_mem_map_invalidate(t);
 
 	if (!t->attach(t)) {
 		platform_target_clk_output_enable(false);
@@ -195,9 +328,9 @@ target *target_attach(target *t, struct target_controller *tc)
 
 void target_add_ram(target *t, target_addr_t start, uint32_t len)
 {
-	struct target_ram *ram = malloc(sizeof(*ram));
-	if (!ram) {			/* malloc failed: heap exhaustion */
-		DEBUG_WARN("malloc: failed in %s\n", __func__);
+	struct target_ram *ram = target_arena_calloc(sizeof(*ram));
+	if (!ram) {			/* calloc failed: heap exhaustion */
+		DEBUG_WARN("calloc: failed in %s\n", __func__);
 		return;
 	}
 
@@ -205,6 +338,7 @@ void target_add_ram(target *t, target_addr_t start, uint32_t len)
 	ram->length = len;
 	ram->next = t->ram;
 	t->ram = ram;
+	target_mem_map_invalidate(t);
 }
 
 void target_add_flash(target *t, target_flash_s *f)
@@ -216,42 +350,63 @@ void target_add_flash(target *t, target_flash_s *f)
 	f->t = t;
 	f->next = t->flash;
 	t->flash = f;
+	target_mem_map_invalidate(t);
 }
 
-static ssize_t map_ram(char *buf, size_t len, struct target_ram *ram)
+/* Like snprintf() at offset i of buf, but fine with buf too small or NULL when sizing */
+static size_t map_printf(char *buf, size_t len, size_t i, const char *fmt, ...)
 {
-	return snprintf(buf, len, "<memory type=\"ram\" start=\"0x%08"PRIx32
-	                          "\" length=\"0x%"PRIx32"\"/>",
-	                          ram->start, (uint32_t)ram->length);
+	va_list ap;
+	va_start(ap, fmt);
+	const int printed = vsnprintf(i < len ? buf + i : NULL, i < len ? len - i : 0U, fmt, ap);
+	va_end(ap);
+	return printed < 0 ? 0U : (size_t)printed;
 }
 
-static ssize_t map_flash(char *buf, size_t len, target_flash_s *f)
+bool target_mem_is_ram(target *t, target_addr_t addr, size_t len)
 {
-	int i = 0;
-	i += snprintf(&buf[i], len - i, "<memory type=\"flash\" start=\"0x%08"PRIx32
-	                                "\" length=\"0x%"PRIx32"\">",
-	                                f->start, (uint32_t)f->length);
-	i += snprintf(&buf[i], len - i, "<property name=\"blocksize\">0x%"PRIx32
-	                            "</property></memory>",
-	                            (uint32_t)f->blocksize);
-	return i;
+	for (struct target_ram *r = t->ram; r; r = r->next) {
+		if (addr >= r->start && len <= r->length && addr - r->start <= r->length - len)
+			return true;
+	}
+	return false;
 }
 
-bool target_mem_map(target *t, char *tmp, size_t len)
+/* Writes as much of the memory map XML as fits, returns the length of all of it */
+static size_t target_mem_map_print(target *t, char *buf, size_t len)
 {
-	size_t i = 0;
-	i = snprintf(&tmp[i], len - i, "<memory-map>");
+	size_t i = map_printf(buf, len, 0, "<memory-map>");
 	/* Map each defined RAM */
 	for (struct target_ram *r = t->ram; r; r = r->next)
-		i += map_ram(&tmp[i], len - i, r);
+		i += map_printf(buf, len, i, "<memory type=\"ram\" start=\"0x%08" PRIx32 "\" length=\"0x%" PRIx32 "\"/>",
+			r->start, (uint32_t)r->length);
 	/* Map each defined Flash */
 	for (target_flash_s *f = t->flash; f; f = f->next)
-		i += map_flash(&tmp[i], len - i, f);
-	i += snprintf(&tmp[i], len - i, "</memory-map>");
+		i += map_printf(buf, len, i,
+			"<memory type=\"flash\" start=\"0x%08" PRIx32 "\" length=\"0x%" PRIx32 "\">"
+			"<property name=\"blocksize\">0x%" PRIx32 "</property></memory>",
+			f->start, (uint32_t)f->length, (uint32_t)f->blocksize);
+	i += map_printf(buf, len, i, "</memory-map>");
+	return i;
+}
 
-	if (i > (len -2))
-		return false;
-	return true;
+/*
+ * The memory map XML, built on first use after attach or a change to the
+ * regions and then kept, so that GDB reading it a packet at a time is served
+ * slices of the one copy. NULL if there is no memory for it.
+ */
+const char *target_mem_map(target *t)
+{
+	if (t->mem_map)
+		return t->mem_map;
+	const size_t len = target_mem_map_print(t, NULL, 0) + 1U;
+	t->mem_map = malloc(len);
+	if (!t->mem_map) { /* malloc failed: heap exhaustion */
+		DEBUG_WARN("malloc: failed in %s\n", __func__);
+		return NULL;
+	}
+	target_mem_map_print(t, t->mem_map, len);
+	return t->mem_map;
 }
 
 void target_print_progress(platform_timeout *const timeout)
@@ -269,6 +424,7 @@ void target_detach(target *t)
 	platform_target_clk_output_enable(false);
 	t->attached = false;
 #if PC_HOSTED == 1
+	read_cache_invalidate(t);
 	platform_buffer_flush();
 #endif
 }
@@ -284,16 +440,96 @@ bool target_attached(target *t) { return t->attached; }
 /* Memory access functions */
 int target_mem_read(target *t, void *dest, target_addr_t src, size_t len)
 {
+#if PC_HOSTED == 1
+	if (!t->flash_mode && read_cache_read(t, dest, src, len))
+		return 0;
+#endif
+	stats_add(STATS_MEM_READ_BYTES, len);
 	t->mem_read(t, dest, src, len);
 	return target_check_error(t);
 }
 
+static int target_mem_readv_batch(target *t, const target_iovec_s *iov, size_t count)
+{
+	if (!count)
+		return 0;
+	for (size_t i = 0; i < count; ++i)
+		stats_add(STATS_MEM_READ_BYTES, iov[i].len);
+	const bool failed = t->mem_readv(t, iov, count);
+	return target_check_error(t) || failed ? -1 : 0;
+}
+
+int target_mem_readv(target *t, const target_iovec_s *iov, size_t count)
+{
+	if (!t->mem_readv) {
+		for (size_t i = 0; i < count; ++i) {
+			if (target_mem_read(t, iov[i].dest, iov[i].src, iov[i].len))
+				return -1;
+		}
+		return 0;
+	}
+	size_t first = 0;
+#if PC_HOSTED == 1
+	/* Ranges the cache serves are left out of the batch, splitting it there */
+	for (size_t i = 0; i < count; ++i) {
+		if (t->flash_mode || !read_cache_read(t, iov[i].dest, iov[i].src, iov[i].len))
+			continue;
+		if (target_mem_readv_batch(t, iov + first, i - first))
+			return -1;
+		first = i + 1U;
+	}
+#endif
+	return target_mem_readv_batch(t, iov + first, count - first);
+}
+
 int target_mem_write(target *t, target_addr_t dest, const void *src, size_t len)
 {
+	stats_add(STATS_MEM_WRITE_BYTES, len);
+#if PC_HOSTED == 1
+	read_cache_write(dest, src, len);
+#endif
 	t->mem_write(t, dest, src, len);
 	return target_check_error(t);
 }
 
+bool target_has_background_mem_access(target *t)
+{
+	return t->background_mem_read && t->background_mem_write;
+}
+
+int target_background_mem_read(target *t, void *dest, target_addr_t src, size_t len)
+{
+	if (!t->background_mem_read)
+		return target_mem_read(t, dest, src, len);
+	stats_add(STATS_MEM_READ_BYTES, len);
+	t->background_mem_read(t, dest, src, len);
+	return target_check_error(t);
+}
+
+int target_background_mem_write(target *t, target_addr_t dest, const void *src, size_t len)
+{
+	if (!t->background_mem_write)
+		return target_mem_write(t, dest, src, len);
+	stats_add(STATS_MEM_WRITE_BYTES, len);
+#if PC_HOSTED == 1
+	read_cache_write(dest, src, len);
+#endif
+	t->background_mem_write(t, dest, src, len);
+	return target_check_error(t);
+}
+
+/* Computes the CRC32 of a region on the target itself, false if the target can't */
+bool target_mem_crc32(target *t, uint32_t *crc, target_addr_t base, size_t len)
+{
+	if (!t->mem_crc32)
+		return false;
+#if PC_HOSTED == 1
+	/* The CRC is worked out by a stub the target runs from RAM */
+	read_cache_halted(t, false);
+#endif
+	return t->mem_crc32(t, crc, base, len);
+}
+
 /* Register access functions */
 ssize_t target_reg_read(target *t, int reg, void *data, size_t max)
 {
@@ -327,14 +563,32 @@ void target_regs_write(target *t, const void *data)
 }
 
 /* Halt/resume functions */
-void target_reset(target *t) { t->reset(t); }
+void target_reset(target *t)
+{
+#if PC_HOSTED == 1
+	read_cache_invalidate(t);
+	read_cache_halted(t, false);
+#endif
+	t->reset(t);
+}
+
 void target_halt_request(target *t) { t->halt_request(t); }
 enum target_halt_reason target_halt_poll(target *t, target_addr_t *watch)
 {
-	return t->halt_poll(t, watch);
+	const enum target_halt_reason reason = t->halt_poll(t, watch);
+#if PC_HOSTED == 1
+	read_cache_halted(t, reason != TARGET_HALT_RUNNING && reason != TARGET_HALT_ERROR);
+#endif
+	return reason;
 }
 
-void target_halt_resume(target *t, bool step) { t->halt_resume(t, step); }
+void target_halt_resume(target *t, bool step)
+{
+#if PC_HOSTED == 1
+	read_cache_halted(t, false);
+#endif
+	t->halt_resume(t, step);
+}
 
 /* Command line for semihosting get_cmdline */
 void target_set_cmdline(target *t, char *cmdline) {
@@ -366,6 +620,11 @@ int target_breakwatch_set(target *t,
 	};
 	int ret = 1;
 
+	/* GDB sends a breakpoint again to change its conditions, it is already in place */
+	for (struct breakwatch *bwp = t->bw_list; bwp; bwp = bwp->next)
+		if (bwp->type == type && bwp->addr == addr && bwp->size == len)
+			return 0;
+
 	if (t->breakwatch_set)
 		ret = t->breakwatch_set(t, &bw);
 
@@ -440,7 +699,44 @@ static bool target_cmd_range_erase(target *const t, const int argc, const char *
 	const uint32_t addr = strtoul(argv[1], NULL, 0);
 	const uint32_t length = strtoul(argv[2], NULL, 0);
 
-	return target_flash_erase(t, addr, length);
+	/* Completing the operation carries out any erases that were deferred */
+	return target_flash_erase(t, addr, length) && target_flash_complete(t);
+}
+
+static bool target_cmd_flash_option(target *const t, const int argc, const char **const argv)
+{
+	if (!t->options_write) {
+		gdb_out("Staged option bytes not implemented for target\n");
+		return true;
+	}
+	if (argc == 2 && !strcmp(argv[1], "clear"))
+		t->options_staged_count = 0;
+	else if (argc == 2 && !strcmp(argv[1], "apply")) {
+		if (!t->options_staged_count) {
+			gdb_out("No option bytes staged\n");
+			return true;
+		}
+		return target_options_apply(t);
+	} else if (argc > 1) {
+		if (argc % 2 == 0) {
+			gdb_out("usage: monitor flash_option <addr> <value> [<addr> <value>]...\n");
+			gdb_out("usage: monitor flash_option (apply|clear)\n");
+			return false;
+		}
+		for (int i = 1; i < argc; i += 2) {
+			const uint32_t addr = strtoul(argv[i], NULL, 0);
+			const uint32_t value = strtoul(argv[i + 1], NULL, 0);
+			if (!target_options_stage(t, addr, value)) {
+				gdb_outf("Can't stage more than %u option words\n", TARGET_OPTIONS_MAX);
+				return false;
+			}
+		}
+	}
+	for (size_t i = 0; i < t->options_staged_count; ++i)
+		gdb_outf("0x%08" PRIx32 ": 0x%08" PRIx32 "\n", t->options_staged[i].addr, t->options_staged[i].value);
+	if (t->options_staged_count)
+		gdb_out("Written after the next load, or with 'monitor flash_option apply'\n");
+	return true;
 }
 
 /* Accessor functions */
@@ -523,8 +819,13 @@ int target_command(target *t, int argc, const char *argv[])
 {
 	for (struct target_command_s *tc = t->commands; tc; tc = tc->next)
 		for(const struct command_s *c = tc->cmds; c->cmd; c++)
-			if(!strncmp(argv[0], c->cmd, strlen(argv[0])))
+			if(!strncmp(argv[0], c->cmd, strlen(argv[0]))) {
+#if PC_HOSTED == 1
+				/* Monitor commands erase, write option bytes and run code behind our back */
+				read_cache_invalidate(NULL);
+#endif
 				return (c->handler(t, argc, argv)) ? 0 : 1;
+			}
 	return -1;
 }
 
@@ -568,23 +869,38 @@ int tc_read(target *t, int fd, target_addr_t buf, unsigned int count)
 	return t->tc->read(t->tc, fd, buf, count);
 }
 
-int tc_write(target *t, int fd, target_addr_t buf, unsigned int count)
+void tc_console_write(target *t, const void *data, size_t len)
 {
 #ifdef PLATFORM_HAS_USBUART
-	if (t->stdout_redirected && (fd == STDOUT_FILENO || fd == STDERR_FILENO)) {
+	if (t->stdout_redirected) {
+		debug_serial_send_stdout(data, len);
+		return;
+	}
+#endif
+	tc_printf(t, "%.*s", (int)len, (const char *)data);
+}
+
+int tc_write(target *t, int fd, target_addr_t buf, unsigned int count)
+{
+	/*
+	 * Console output is read from the target in bursts and sent on from here,
+	 * saving the round trips of GDB fetching it with File-I/O and replying
+	 */
+	if (fd == STDOUT_FILENO || fd == STDERR_FILENO) {
+		const unsigned int total = count;
 		while (count) {
 			uint8_t tmp[STDOUT_READ_BUF_SIZE];
-			unsigned int cnt = sizeof(tmp);
-			if (cnt > count)
-				cnt = count;
-			target_mem_read(t, tmp, buf, cnt);
-			debug_serial_send_stdout(tmp, cnt);
+			const unsigned int cnt = MIN(count, STDOUT_READ_BUF_SIZE);
+			if (target_mem_read(t, tmp, buf, cnt)) {
+				t->tc->errno_ = TARGET_EFAULT;
+				return -1;
+			}
+			tc_console_write(t, tmp, cnt);
 			count -= cnt;
 			buf += cnt;
 		}
-		return 0;
+		return total;
 	}
-#endif
 
 	if (t->tc->write == NULL)
 		return 0;
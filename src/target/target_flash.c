@@ -37,9 +37,90 @@
 
 #include "general.h"
 #include "target_internal.h"
+#include "cortexm.h"
+#include "crc32.h"
+#include "stats.h"
+#if PC_HOSTED == 1
+#include "read_cache.h"
+#endif
 
-static bool flash_buffered_write(target_flash_s *f, target_addr_t dest, const void *src, size_t len);
+/*
+ * In incremental mode erasing a block is put off until the data for it is known,
+ * so the whole block has to be buffered. Blocks bigger than this are always erased.
+ */
+#ifndef FLASH_INCREMENTAL_MAX_BLOCKSIZE
+#define FLASH_INCREMENTAL_MAX_BLOCKSIZE 4096U
+#endif
+
+/*
+ * Memory for write buffers put aside when the data for a block arrives out of
+ * order, so each block is still programmed once. Past this they are flushed.
+ */
+#ifndef FLASH_PARK_BUDGET
+#if PC_HOSTED == 1
+#define FLASH_PARK_BUDGET 0x40000U
+#else
+#define FLASH_PARK_BUDGET 4096U
+#endif
+#endif
+
+bool target_flash_incremental;
+bool target_flash_verify;
+
+/* A write buffer put aside, see flash_park() */
+struct flash_parked {
+	struct flash_parked *next;
+	target_addr_t base;
+	target_addr_t low;
+	target_addr_t high;
+	size_t size;
+	uint8_t data[];
+};
+
+static bool flash_buffered_write(target_flash_s *f, target_addr_t dest, const void *src, size_t len, bool in_place);
 static bool flash_buffered_flush(target_flash_s *f);
+static bool flash_buffer_program(target_flash_s *f);
+
+#ifdef PLATFORM_HAS_VOLTAGE_MONITOR
+/* Below this VREF isn't connected, or the target isn't powered, so there is nothing to watch */
+#define FLASH_VOLTAGE_SENSED 10U /* 1.0V */
+/* A drop below this share of the voltage when flashing started is taken as a brown-out */
+#define FLASH_VOLTAGE_SAG_PERCENT 85U
+
+static uint32_t flash_voltage_threshold;
+
+static void flash_voltage_watch(void)
+{
+	platform_voltage_window_s window;
+	platform_target_voltage_window(&window);
+	flash_voltage_threshold =
+		window.min >= FLASH_VOLTAGE_SENSED ? (window.min * FLASH_VOLTAGE_SAG_PERCENT) / 100U : 0U;
+	platform_target_voltage_watch(flash_voltage_threshold);
+}
+
+/*
+ * A target browning out mid-operation otherwise shows up much later as timeouts
+ * or a failed verify, so stop as soon as the probe has seen its supply sag.
+ */
+static bool flash_voltage_ok(target *t)
+{
+	if (!platform_target_voltage_sagged())
+		return true;
+	tc_printf(t, "Target voltage fell below %" PRIu32 ".%" PRIu32 "V, aborting flash operations\n",
+		flash_voltage_threshold / 10U, flash_voltage_threshold % 10U);
+	return false;
+}
+#else
+static void flash_voltage_watch(void)
+{
+}
+
+static bool flash_voltage_ok(target *t)
+{
+	(void)t;
+	return true;
+}
+#endif
 
 target_flash_s *target_flash_for_addr(target *t, uint32_t addr)
 {
@@ -53,6 +134,10 @@ static bool target_enter_flash_mode(target *t)
 {
 	if (t->flash_mode)
 		return true;
+#if PC_HOSTED == 1
+	/* Nothing read from flash before stays true, and in flash mode reads go to the target */
+	read_cache_invalidate(t);
+#endif
 
 	bool ret = true;
 	if (t->enter_flash_mode)
@@ -62,8 +147,10 @@ static bool target_enter_flash_mode(target *t)
 		/* This saves us if we're interrupted in IRQ context */
 		target_reset(t);
 
-	if (ret == true)
+	if (ret == true) {
 		t->flash_mode = true;
+		flash_voltage_watch();
+	}
 
 	return ret;
 }
@@ -81,10 +168,43 @@ static bool target_exit_flash_mode(target *t)
 		target_reset(t);
 
 	t->flash_mode = false;
+#ifdef PLATFORM_HAS_VOLTAGE_MONITOR
+	platform_target_voltage_watch(0);
+#endif
 
 	return ret;
 }
 
+/*
+ * The share of the expected time slept through before the first poll, and bounds on
+ * the gaps after. The sleep is capped so callers still get to print their progress.
+ */
+#define FLASH_WAIT_SLEEP_PERCENT 75U
+#define FLASH_WAIT_MAX_SLEEP_US  250000U
+#define FLASH_WAIT_MIN_POLL_US   64U
+#define FLASH_WAIT_MAX_POLL_US   50000U
+
+void target_flash_wait_init(flash_wait_s *const wait, const uint32_t expected_us)
+{
+	wait->sleep_us =
+		MIN((uint32_t)(((uint64_t)expected_us * FLASH_WAIT_SLEEP_PERCENT) / 100U), FLASH_WAIT_MAX_SLEEP_US);
+	platform_backoff_init(&wait->backoff, MIN(MAX(expected_us / 8U, FLASH_WAIT_MIN_POLL_US), FLASH_WAIT_MAX_POLL_US));
+	wait->last_us = platform_time_us();
+}
+
+void target_flash_wait_poll(flash_wait_s *const wait)
+{
+	if (wait->sleep_us) {
+		platform_delay_us(wait->sleep_us);
+		wait->sleep_us = 0;
+	} else
+		platform_backoff_wait(&wait->backoff);
+	const uint32_t now = platform_time_us();
+	stats_add(STATS_FLASH_BUSY_POLLS, 1U);
+	stats_add(STATS_FLASH_BUSY_US, now - wait->last_us);
+	wait->last_us = now;
+}
+
 static bool flash_prepare(target_flash_s *f)
 {
 	if (f->ready)
@@ -100,32 +220,339 @@ static bool flash_prepare(target_flash_s *f)
 	return ret;
 }
 
+/* Collect the result of a stub still programming the last buffer */
+static bool flash_stub_idle(target_flash_s *f)
+{
+	return !f->stub || cortexm_flash_stub_wait(f);
+}
+
+static size_t flash_buffer_size(const target_flash_s *f)
+{
+	return f->erase_pending && !f->erase_background ? f->blocksize : f->writebufsize;
+}
+
+/* The most a write buffer for this flash can need, a whole block if its erases can be deferred */
+static size_t flash_buffer_max_size(const target_flash_s *f)
+{
+	if (f->blocksize <= FLASH_INCREMENTAL_MAX_BLOCKSIZE)
+		return MAX(f->blocksize, f->writebufsize);
+	return f->writebufsize;
+}
+
+/*
+ * Only the flash being written holds data in the buffer, the others are flushed
+ * before it is switched to, so one buffer sized for the largest flash serves them
+ * all until the next scan. Should a flash turn up that needs more, the old buffer
+ * stays valid in the arena for the flashes still pointing at it.
+ */
+static void *flash_buffer_get(target_flash_s *f)
+{
+	target *t = f->t;
+	const size_t size = flash_buffer_size(f);
+	if (size > t->flash_buffer_size) {
+		size_t largest = size;
+		for (const target_flash_s *flash = t->flash; flash; flash = flash->next)
+			largest = MAX(largest, flash_buffer_max_size(flash));
+		void *const buffer = target_arena_calloc(largest);
+		if (!buffer)
+			return NULL;
+		t->flash_buffer = buffer;
+		t->flash_buffer_size = largest;
+	}
+	return t->flash_buffer;
+}
+
+static bool flash_erase_is_pending(const target_flash_s *f, const target_addr_t addr)
+{
+	const size_t block = (addr - f->start) / f->blocksize;
+	return f->erase_pending && (f->erase_pending[block / 8U] & (1U << (block % 8U)));
+}
+
+static void flash_erase_clear_pending(target_flash_s *f, const target_addr_t addr)
+{
+	const size_t block = (addr - f->start) / f->blocksize;
+	f->erase_pending[block / 8U] &= ~(1U << (block % 8U));
+}
+
+/*
+ * In incremental mode, or when the driver can erase a block as part of writing
+ * it, note that the block at addr is to be erased rather than erasing it now.
+ * Returns false if the flash can't work that way.
+ */
+static bool flash_erase_defer(target_flash_s *f, const target_addr_t addr)
+{
+	if ((!target_flash_incremental && !f->erase_write) || f->erase_background)
+		return false;
+	if (!f->erase_pending) {
+		/* The write buffer becomes a whole block, so it mustn't be in use already */
+		if (f->buf || f->blocksize > FLASH_INCREMENTAL_MAX_BLOCKSIZE || (f->blocksize & (f->blocksize - 1U)) ||
+			f->blocksize % f->writebufsize)
+			return false;
+		f->erase_pending = calloc((f->length / f->blocksize + 7U) / 8U, 1);
+		if (!f->erase_pending) /* calloc failed: heap exhaustion, so just erase */
+			return false;
+	}
+	const size_t block = (addr - f->start) / f->blocksize;
+	f->erase_pending[block / 8U] |= 1U << (block % 8U);
+	return true;
+}
+
+/* The CRC of a block in the erased state */
+static uint32_t flash_erased_crc(const target_flash_s *f)
+{
+	uint8_t erased[64];
+	memset(erased, f->erased, sizeof(erased));
+	uint32_t crc = 0xffffffffU;
+	for (size_t offset = 0; offset < f->blocksize; offset += sizeof(erased))
+		crc = generic_crc32_buffer(crc, erased, MIN(sizeof(erased), f->blocksize - offset));
+	return crc;
+}
+
+/* Check if the block at addr already holds the contents of a block sized buffer */
+static bool flash_block_matches(target_flash_s *f, const target_addr_t addr, const uint8_t *const data)
+{
+	uint32_t target_crc;
+	if (generic_crc32(f->t, &target_crc, addr, f->blocksize))
+		return false;
+	/* A block that is only to be erased is compared against the erased state */
+	if (!data)
+		return target_crc == flash_erased_crc(f);
+	return target_crc == generic_crc32_buffer(0xffffffffU, data, f->blocksize);
+}
+
+/*
+ * Check if the block at addr is blank already, so needn't be erased. This uses the
+ * driver's blank check command if it has one, otherwise the target's CRC stub. With
+ * neither, reading the block back could take longer than erasing it, so it isn't.
+ */
+static bool flash_block_blank(target_flash_s *f, const target_addr_t addr)
+{
+	if (f->blank_check)
+		return f->blank_check(f, addr, f->blocksize);
+	uint32_t target_crc;
+	return target_mem_crc32(f->t, &target_crc, addr, f->blocksize) && target_crc == flash_erased_crc(f);
+}
+
+/* Erase the block at addr, unless it's blank already */
+static bool flash_erase_block(target_flash_s *f, const target_addr_t addr)
+{
+	/* Don't check or erase under a stub that is still programming */
+	if (!flash_stub_idle(f))
+		return false;
+	if (flash_block_blank(f, addr)) {
+		stats_add(STATS_FLASH_SKIPPED_BYTES, f->blocksize);
+		return true;
+	}
+	return f->erase(f, addr, f->blocksize);
+}
+
+/*
+ * With target_flash_verify set, check the data just programmed at dest while it's
+ * still in the write buffer, so a write and verify needs no second pass over the
+ * image. The stub has to finish first: reading flash that is being programmed
+ * stalls the bus on some parts and sets read collision errors on others.
+ */
+static bool flash_verify_written(target_flash_s *f, const target_addr_t dest, const uint8_t *const src, const size_t len)
+{
+	if (!target_flash_verify || !len)
+		return true;
+	if (!flash_stub_idle(f))
+		return false;
+	stats_add(STATS_FLASH_VERIFY_BYTES, len);
+	bool ret;
+	if (f->verify)
+		ret = f->verify(f, dest, src, len);
+	else {
+		uint32_t target_crc;
+		ret = !generic_crc32(f->t, &target_crc, dest, len) &&
+			target_crc == generic_crc32_buffer(0xffffffffU, src, len);
+	}
+	if (!ret)
+		DEBUG_WARN("Flash verify failed for 0x%08" PRIx32 "+%" PRIu32 "\n", dest, (uint32_t)len);
+	return ret;
+}
+
+/* Whether len bytes at data all hold the value the flash reads back when erased */
+static bool flash_chunk_erased(const target_flash_s *const f, const uint8_t *const data, const size_t len)
+{
+	return data[0] == f->erased && !memcmp(data, data + 1U, len - 1U);
+}
+
+/*
+ * Carry out a deferred erase of the block at addr, unless it already holds data
+ * (or is erased when data is NULL), which sets unchanged.
+ */
+static bool flash_erase_pending_block(
+	target_flash_s *f, const target_addr_t addr, const uint8_t *const data, bool *const unchanged)
+{
+	flash_erase_clear_pending(f, addr);
+	/* The CRC stub can't run alongside the flash stub */
+	bool ret = flash_stub_idle(f);
+	*unchanged = flash_block_matches(f, addr, data);
+	if (*unchanged) {
+		stats_add(STATS_FLASH_SKIPPED_BYTES, f->blocksize);
+		return ret;
+	}
+	/* An unwritten block that didn't match isn't blank, one with new data may still be */
+	if (!data)
+		return ret && f->erase(f, addr, f->blocksize);
+	return ret && flash_erase_block(f, addr);
+}
+
+/*
+ * When the driver can start an erase without waiting for it, note that the block
+ * at addr is to be erased in the background while GDB carries on sending data.
+ * Returns false if the flash can't work that way.
+ */
+static bool flash_erase_background(target_flash_s *f, const target_addr_t addr)
+{
+	if (!f->erase_start || target_flash_incremental)
+		return false;
+	if (!f->erase_pending) {
+		f->erase_pending = calloc((f->length / f->blocksize + 7U) / 8U, 1);
+		if (!f->erase_pending) /* calloc failed: heap exhaustion, so just erase */
+			return false;
+		f->erase_background = true;
+	}
+	if (!f->erase_background)
+		return false;
+	const size_t block = (addr - f->start) / f->blocksize;
+	f->erase_pending[block / 8U] |= 1U << (block % 8U);
+	return true;
+}
+
+/* Collect a background erase that has finished, waiting for it if wait is set */
+static bool flash_erase_background_poll(target_flash_s *f, const bool wait)
+{
+	if (!f->erase_running)
+		return true;
+	platform_timeout timeout;
+	platform_timeout_set(&timeout, 500);
+	bool busy = true;
+	while (busy) {
+		if (!f->erase_busy(f, &busy)) {
+			f->erase_running = false;
+			return false;
+		}
+		if (!wait)
+			break;
+		if (busy)
+			target_print_progress(&timeout);
+	}
+	f->erase_running = busy;
+	return true;
+}
+
+/* Start erasing the lowest block still waiting for it, unless an erase is already running */
+static bool flash_erase_background_next(target_flash_s *f)
+{
+	if (!f->erase_background)
+		return true;
+	if (!flash_erase_background_poll(f, false))
+		return false;
+	if (f->erase_running)
+		return true;
+	for (target_addr_t addr = f->start; addr < f->start + f->length; addr += f->blocksize) {
+		if (!flash_erase_is_pending(f, addr))
+			continue;
+		if (!flash_prepare(f) || !flash_stub_idle(f))
+			return false;
+		flash_erase_clear_pending(f, addr);
+		if (!f->erase_start(f, addr, f->blocksize))
+			return false;
+		f->erase_running = true;
+		break;
+	}
+	return true;
+}
+
+/* Make sure the blocks under [start, end) are erased before programming them */
+static bool flash_erase_background_wait(target_flash_s *f, const target_addr_t start, const target_addr_t end)
+{
+	bool ret = flash_erase_background_poll(f, true);
+	for (target_addr_t addr = start & ~(f->blocksize - 1U); addr < end; addr += f->blocksize) {
+		if (!flash_erase_is_pending(f, addr))
+			continue;
+		flash_erase_clear_pending(f, addr);
+		ret &= flash_stub_idle(f);
+		ret &= f->erase(f, addr, f->blocksize);
+	}
+	return ret;
+}
+
+/* At the end of a load, erase the blocks GDB asked to have erased but never wrote */
+static bool flash_erase_pending_finish(target_flash_s *f)
+{
+	if (!f->erase_pending)
+		return true;
+	bool ret = flash_erase_background_poll(f, true);
+	for (target_addr_t addr = f->start; addr < f->start + f->length; addr += f->blocksize) {
+		if (!flash_erase_is_pending(f, addr))
+			continue;
+		if (!flash_prepare(f)) {
+			ret = false;
+			break;
+		}
+		if (f->erase_background)
+			ret &= flash_erase_background_wait(f, addr, addr + 1U);
+		else {
+			bool unchanged;
+			ret &= flash_erase_pending_block(f, addr, NULL, &unchanged);
+		}
+	}
+	free(f->erase_pending);
+	f->erase_pending = NULL;
+	f->erase_background = false;
+	return ret;
+}
+
 static bool flash_done(target_flash_s *f)
 {
 	if (!f->ready)
 		return true;
 
-	bool ret = true;
+	bool ret = flash_stub_idle(f);
+	ret &= flash_erase_background_poll(f, true);
 	if (f->done)
-		ret = f->done(f);
-
-	if (f->buf) {
-		free(f->buf);
-		f->buf = NULL;
+		ret &= f->done(f);
+
+	/* The buffer is the target's, shared with its other flashes */
+	f->buf = NULL;
+	while (f->parked) {
+		struct flash_parked *const parked = f->parked;
+		f->parked = parked->next;
+		free(parked);
 	}
 
+	/* The target is free to reuse its RAM once we're done */
+	f->stub_addr = 0;
 	f->ready = false;
 
 	return ret;
 }
 
+/*
+ * Another flash is about to be used, so finish operations on this one. Flashes with
+ * independent controllers are instead left prepared, with their background erase
+ * carrying on, and are finished off by target_flash_complete().
+ */
+static bool flash_set_aside(target_flash_s *f, const target_flash_s *next)
+{
+	if (f->independent && next->independent)
+		return flash_erase_background_next(f);
+	return flash_done(f);
+}
+
 bool target_flash_erase(target *t, target_addr_t addr, size_t len)
 {
+	stats_add(STATS_FLASH_ERASE_BYTES, len);
 	if (!target_enter_flash_mode(t))
 		return false;
 
 	bool ret = true; /* catch false returns with &= */
 	while (len) {
+		if (!flash_voltage_ok(t))
+			return false;
 		target_flash_s *f = target_flash_for_addr(t, addr);
 		if (!f) {
 			DEBUG_WARN("Requested address is outside the valid range 0x%06" PRIx32 "\n", addr);
@@ -135,33 +562,61 @@ bool target_flash_erase(target *t, target_addr_t addr, size_t len)
 		/* terminate flash operations if we're not in the same target flash */
 		for (target_flash_s *target_f = t->flash; target_f; target_f = target_f->next)
 			if (target_f != f)
-				ret &= flash_done(target_f);
+				ret &= flash_set_aside(target_f, f);
+
+		/*
+		 * When the request covers this whole flash one bank erase beats erasing it
+		 * block by block, unless incremental mode wants to keep unchanged blocks
+		 */
+		if (f->bank_erase && !target_flash_incremental && addr == f->start && len >= f->length) {
+			if (!flash_prepare(f))
+				return false;
+			ret &= flash_stub_idle(f);
+			ret &= f->bank_erase(f);
+			len -= f->length;
+			addr = f->start + f->length;
+			if (len == 0)
+				ret &= flash_done(f);
+			continue;
+		}
 
 		const target_addr_t local_start_addr = addr & ~(f->blocksize - 1U);
 		const target_addr_t local_end_addr = local_start_addr + f->blocksize;
 
-		if (!flash_prepare(f))
-			return false;
-
-		ret &= f->erase(f, local_start_addr, f->blocksize);
+		/*
+		 * A driver that can erase in the background gets the erase started
+		 * and we return, so the next packet downloads while the target erases
+		 */
+		if (flash_erase_background(f, local_start_addr))
+			ret &= flash_erase_background_next(f);
+		/* In incremental mode, or for erase_write, the erase waits for the block's data */
+		else if (!flash_erase_defer(f, local_start_addr)) {
+			if (!flash_prepare(f))
+				return false;
+
+			ret &= flash_erase_block(f, local_start_addr);
+		}
 
 		len -= MIN(local_end_addr - addr, len);
 		addr = local_end_addr;
 
-		/* Issue flash done on last operation */
-		if (len == 0)
+		/* Issue flash done on last operation, unless an erase is still going on */
+		if (len == 0 && !f->erase_background)
 			ret &= flash_done(f);
 	}
 	return ret;
 }
 
-bool target_flash_write(target *t, target_addr_t dest, const void *src, size_t len)
+static bool flash_write(target *t, target_addr_t dest, const void *src, size_t len, const bool in_place)
 {
+	stats_add(STATS_FLASH_WRITE_BYTES, len);
 	if (!target_enter_flash_mode(t))
 		return false;
 
 	bool ret = true; /* catch false returns with &= */
 	while (len) {
+		if (!flash_voltage_ok(t))
+			return false;
 		target_flash_s *f = target_flash_for_addr(t, dest);
 		if (!f)
 			return false;
@@ -170,14 +625,14 @@ bool target_flash_write(target *t, target_addr_t dest, const void *src, size_t l
 		for (target_flash_s *target_f = t->flash; target_f; target_f = target_f->next) {
 			if (target_f != f) {
 				ret &= flash_buffered_flush(target_f);
-				ret &= flash_done(target_f);
+				ret &= flash_set_aside(target_f, f);
 			}
 		}
 
 		const target_addr_t local_end_addr = MIN(dest + len, f->start + f->length);
 		const target_addr_t local_length = local_end_addr - dest;
 
-		ret &= flash_buffered_write(f, dest, src, local_length);
+		ret &= flash_buffered_write(f, dest, src, local_length, in_place);
 
 		dest = local_end_addr;
 		src += local_length;
@@ -192,28 +647,152 @@ bool target_flash_write(target *t, target_addr_t dest, const void *src, size_t l
 	return ret;
 }
 
+bool target_flash_write(target *t, target_addr_t dest, const void *src, size_t len)
+{
+	return flash_write(t, dest, src, len, false);
+}
+
+bool target_flash_write_in_place(target *t, target_addr_t dest, void *src, size_t len)
+{
+	return flash_write(t, dest, src, len, true);
+}
+
+bool target_options_stage(target *const t, const uint32_t addr, const uint32_t value)
+{
+	if (!t->options_write)
+		return false;
+	if (!t->options_staged) {
+		t->options_staged = target_arena_calloc(TARGET_OPTIONS_MAX * sizeof(*t->options_staged));
+		if (!t->options_staged)
+			return false;
+	}
+	/* Staging the same word again replaces the value */
+	size_t i = 0;
+	while (i < t->options_staged_count && t->options_staged[i].addr != addr)
+		++i;
+	if (i == TARGET_OPTIONS_MAX)
+		return false;
+	t->options_staged[i].addr = addr;
+	t->options_staged[i].value = value;
+	if (i == t->options_staged_count)
+		++t->options_staged_count;
+	return true;
+}
+
+bool target_options_apply(target *const t)
+{
+	return target_enter_flash_mode(t) && target_flash_complete(t);
+}
+
 bool target_flash_complete(target *t)
 {
 	if (!t->flash_mode)
 		return false;
 
-	bool ret = true; /* catch false returns with &= */
+	bool ret = flash_voltage_ok(t); /* catch false returns with &= */
 	for (target_flash_s *f = t->flash; f; f = f->next) {
 		ret &= flash_buffered_flush(f);
+		ret &= flash_erase_pending_finish(f);
 		ret &= flash_done(f);
 	}
 
+	/* Option bytes go in last, and only over an image that went in whole, so the reset below loads both */
+	if (ret && t->options_staged_count) {
+		ret = t->options_write(t, t->options_staged, t->options_staged_count);
+		if (ret)
+			t->options_staged_count = 0;
+		else
+			DEBUG_WARN("Writing the staged option bytes failed\n");
+	}
+
 	target_exit_flash_mode(t);
 	return ret;
 }
 
-static bool flash_buffered_write(target_flash_s *f, target_addr_t dest, const void *src, size_t len)
+/* Whether the data given so far fills the buffer, so no more is expected for it */
+static bool flash_buffer_full(const target_flash_s *f)
+{
+	return f->buf_addr_low == f->buf_addr_base && f->buf_addr_high == f->buf_addr_base + flash_buffer_size(f);
+}
+
+/*
+ * GDB sends an ELF's sections in the order they are in the file, so the data for
+ * a block can come in pieces with other blocks' in between. Rather than program
+ * the block once per piece, a buffer that isn't full yet is copied aside until
+ * the rest of it turns up or the session ends. Returns false if there's no room.
+ */
+static bool flash_park(target_flash_s *f)
+{
+	const size_t size = flash_buffer_size(f);
+	size_t used = size;
+	for (const struct flash_parked *parked = f->parked; parked; parked = parked->next)
+		used += parked->size;
+	if (used > FLASH_PARK_BUDGET)
+		return false;
+	struct flash_parked *const parked = malloc(sizeof(*parked) + size);
+	if (!parked) /* malloc failed: heap exhaustion, so just program it */
+		return false;
+	parked->base = f->buf_addr_base;
+	parked->low = f->buf_addr_low;
+	parked->high = f->buf_addr_high;
+	parked->size = size;
+	memcpy(parked->data, f->buf, size);
+
+	/* Kept in address order, for flash_buffered_flush() */
+	struct flash_parked **next = &f->parked;
+	while (*next && (*next)->base < parked->base)
+		next = &(*next)->next;
+	parked->next = *next;
+	*next = parked;
+	f->buf_addr_base = UINT32_MAX;
+	f->buf_addr_low = UINT32_MAX;
+	f->buf_addr_high = 0;
+	return true;
+}
+
+/* Take back the buffer put aside for base_addr into the write buffer, false if there's none */
+static bool flash_unpark(target_flash_s *f, const target_addr_t base_addr)
+{
+	for (struct flash_parked **next = &f->parked; *next; next = &(*next)->next) {
+		struct flash_parked *const parked = *next;
+		if (parked->base != base_addr)
+			continue;
+		*next = parked->next;
+		f->buf_addr_base = parked->base;
+		f->buf_addr_low = parked->low;
+		f->buf_addr_high = parked->high;
+		memcpy(f->buf, parked->data, parked->size);
+		free(parked);
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Program a whole buffer's worth at base_addr straight from data, the caller's memory
+ * standing in for the write buffer, which saves copying it there. Drivers may patch
+ * the data they are given, as they can the buffer, so this is only for memory that
+ * the caller said may be changed.
+ */
+static bool flash_buffer_program_in_place(target_flash_s *f, const target_addr_t base_addr, void *const data)
+{
+	void *const buf = f->buf;
+	f->buf = data;
+	f->buf_addr_base = base_addr;
+	f->buf_addr_low = base_addr;
+	f->buf_addr_high = base_addr + flash_buffer_size(f);
+	const bool ret = flash_buffer_program(f);
+	f->buf = buf;
+	return ret;
+}
+
+static bool flash_buffered_write(
+	target_flash_s *f, target_addr_t dest, const void *src, size_t len, const bool in_place)
 {
 	if (f->buf == NULL) {
-		/* Allocate buffer */
-		f->buf = malloc(f->writebufsize);
-		if (!f->buf) { /* malloc failed: heap exhaustion */
-			DEBUG_WARN("malloc: failed in %s\n", __func__);
+		f->buf = flash_buffer_get(f);
+		if (!f->buf) { /* calloc failed: heap exhaustion */
+			DEBUG_WARN("calloc: failed in %s\n", __func__);
 			return false;
 		}
 		f->buf_addr_base = UINT32_MAX;
@@ -223,19 +802,32 @@ static bool flash_buffered_write(target_flash_s *f, target_addr_t dest, const vo
 
 	bool ret = true; /* catch false returns with &= */
 	while (len) {
-		const target_addr_t base_addr = dest & ~(f->writebufsize - 1U);
+		const size_t buffer_size = flash_buffer_size(f);
+		const target_addr_t base_addr = dest & ~(buffer_size - 1U);
 
 		/* check for base address change */
 		if (base_addr != f->buf_addr_base) {
-			ret &= flash_buffered_flush(f);
+			if (f->buf_addr_base == UINT32_MAX || flash_buffer_full(f) || !flash_park(f))
+				ret &= flash_buffer_program(f);
+
+			/* A whole buffer's worth with nothing put aside to merge with needn't be copied */
+			if (in_place && dest == base_addr && len >= buffer_size && !f->parked) {
+				ret &= flash_buffer_program_in_place(f, base_addr, (void *)src);
+				dest += buffer_size;
+				src += buffer_size;
+				len -= buffer_size;
+				continue;
+			}
 
-			/* Setup buffer */
-			f->buf_addr_base = base_addr;
-			memset(f->buf, f->erased, f->writebufsize);
+			/* Setup buffer, with what came for it earlier if it was put aside */
+			if (!flash_unpark(f, base_addr)) {
+				f->buf_addr_base = base_addr;
+				memset(f->buf, f->erased, buffer_size);
+			}
 		}
 
-		const size_t offset = dest % f->writebufsize;
-		const size_t local_len = MIN(f->writebufsize - offset, len);
+		const size_t offset = dest % buffer_size;
+		const size_t local_len = MIN(buffer_size - offset, len);
 
 		/* Copy chunk into sector buffer */
 		memcpy(f->buf + offset, src, local_len);
@@ -251,7 +843,23 @@ static bool flash_buffered_write(target_flash_s *f, target_addr_t dest, const vo
 	return ret;
 }
 
+/* Programs the write buffer and everything put aside, in address order */
 static bool flash_buffered_flush(target_flash_s *f)
+{
+	if (!f->buf)
+		return true;
+	bool ret = true; /* catch false returns with &= */
+	if (f->parked && f->buf_addr_base != UINT32_MAX && !flash_park(f))
+		ret &= flash_buffer_program(f);
+	while (f->parked) {
+		flash_unpark(f, f->parked->base);
+		ret &= flash_buffer_program(f);
+	}
+	ret &= flash_buffer_program(f);
+	return ret;
+}
+
+static bool flash_buffer_program(target_flash_s *f)
 {
 	bool ret = true; /* catch false returns with &= */
 	if (f->buf && f->buf_addr_base != UINT32_MAX && f->buf_addr_low != UINT32_MAX &&
@@ -261,13 +869,52 @@ static bool flash_buffered_flush(target_flash_s *f)
 		if (!flash_prepare(f))
 			return false;
 
+		/*
+		 * A whole block is buffered when its erase was deferred, and can be
+		 * skipped altogether if the flash already holds it.
+		 */
+		if (f->erase_background)
+			ret &= flash_erase_background_wait(f, f->buf_addr_low, f->buf_addr_high);
+		else if (f->erase_write && !target_flash_incremental && flash_erase_is_pending(f, f->buf_addr_base)) {
+			/* The driver erases the block on its way to programming it */
+			flash_erase_clear_pending(f, f->buf_addr_base);
+			ret &= f->erase_write(f, f->buf_addr_base, f->buf, f->blocksize);
+			ret = ret && flash_verify_written(f, f->buf_addr_base, f->buf, f->blocksize);
+			f->buf_addr_base = UINT32_MAX;
+			f->buf_addr_low = UINT32_MAX;
+			f->buf_addr_high = 0;
+			return ret;
+		} else if (flash_erase_is_pending(f, f->buf_addr_base)) {
+			bool unchanged;
+			ret = flash_erase_pending_block(f, f->buf_addr_base, f->buf, &unchanged);
+			if (unchanged || !ret) {
+				f->buf_addr_base = UINT32_MAX;
+				f->buf_addr_low = UINT32_MAX;
+				f->buf_addr_high = 0;
+				return ret;
+			}
+		}
+
 		target_addr_t aligned_addr = f->buf_addr_low & ~(f->writesize - 1U);
 
 		const uint8_t *src = f->buf + (aligned_addr - f->buf_addr_base);
 		uint32_t len = f->buf_addr_high - aligned_addr;
 
-		for (size_t offset = 0; offset < len; offset += f->writesize)
+		for (size_t offset = 0; offset < len; offset += f->writesize) {
+			/* Programming the erased value leaves the cells as the erase did, so gaps and padding are skipped */
+			if (flash_chunk_erased(f, src + offset, f->writesize)) {
+				stats_add(STATS_FLASH_SKIPPED_BYTES, f->writesize);
+				continue;
+			}
 			ret &= f->write(f, aligned_addr + offset, src + offset, f->writesize);
+		}
+		/* Only the bytes actually given, the padding may sit over data written earlier */
+		ret = ret && flash_verify_written(f, f->buf_addr_low,
+						 (const uint8_t *)f->buf + (f->buf_addr_low - f->buf_addr_base),
+						 f->buf_addr_high - f->buf_addr_low);
+
+		/* Get the next block erasing while the data for this one comes in */
+		ret &= flash_erase_background_next(f);
 
 		f->buf_addr_base = UINT32_MAX;
 		f->buf_addr_low = UINT32_MAX;
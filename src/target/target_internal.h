@@ -26,6 +26,14 @@
 extern target *target_list;
 target *target_new(void);
 
+/*
+ * Zeroed memory for anything that lives as long as the target it describes, such as
+ * flash descriptions and target_storage. It is all released by target_list_free(),
+ * target_arena_free() keeps it for reuse and passes anything else on to free().
+ */
+void *target_arena_calloc(size_t size);
+void target_arena_free(void *ptr);
+
 struct target_ram {
 	target_addr_t start;
 	size_t length;
@@ -34,10 +42,23 @@ struct target_ram {
 
 typedef struct target_flash target_flash_s;
 
+/*
+ * A RAM flash loader built from src/target/flashstub. Every loader is called as
+ * stub(dest, buffer, length, param) with the data already in the buffer in target
+ * RAM, and must exit with bkpt #0 on success and any other code on error.
+ */
+typedef struct target_flash_stub {
+	const uint16_t *code;
+	size_t code_size;
+} target_flash_stub_s;
+
 typedef bool (*flash_prepare_func)(target_flash_s *f);
 typedef bool (*flash_erase_func)(target_flash_s *f, target_addr_t addr, size_t len);
 typedef bool (*flash_write_func)(target_flash_s *f, target_addr_t dest, const void *src, size_t len);
 typedef bool (*flash_done_func)(target_flash_s *f);
+typedef bool (*flash_bank_erase_func)(target_flash_s *f);
+typedef bool (*flash_busy_func)(target_flash_s *f, bool *busy);
+typedef bool (*flash_blank_func)(target_flash_s *f, target_addr_t addr, size_t len);
 
 struct target_flash {
 	target *t;                   /* Target this flash is attached to */
@@ -52,10 +73,27 @@ struct target_flash {
 	flash_erase_func erase;      /* erase a range of flash */
 	flash_write_func write;      /* write to flash */
 	flash_done_func done;        /* finish flash operations */
+	flash_bank_erase_func bank_erase; /* erase the whole of this flash in one operation, optional */
+	flash_erase_func erase_start; /* start erasing a block without waiting for it, optional */
+	flash_busy_func erase_busy;  /* check on an erase begun with erase_start */
+	flash_write_func erase_write; /* erase the block at dest then program it in one go, optional */
+	flash_write_func verify;     /* check programmed data against src, optional, defaults to comparing CRCs */
+	flash_blank_func blank_check; /* true if the range reads erased, optional, defaults to the target's CRC stub */
+	const target_flash_stub_s *stub; /* RAM loader used to program this flash, if any */
+	target_addr_t stub_addr;     /* where the loader is in target RAM, 0 until loaded */
+	uint8_t stub_buffers;        /* number of loader buffers, 2 when they can be used ping-pong */
+	uint8_t stub_buffer;         /* loader buffer the next write goes to */
+	bool stub_running;           /* loader is still programming the last buffer handed to it */
+	target_addr_t stub_dest;     /* destination of that buffer */
 	void *buf;                   /* buffer for flash operations */
 	target_addr_t buf_addr_base; /* address of block this buffer is for */
 	target_addr_t buf_addr_low;  /* address of lowest byte written */
 	target_addr_t buf_addr_high; /* address of highest byte written */
+	struct flash_parked *parked; /* partly filled buffers put aside for later data, see flash_park() */
+	uint8_t *erase_pending;      /* bitmap of blocks whose erase is deferred */
+	bool erase_background;       /* erase_pending blocks are erased in the background, not incrementally */
+	bool erase_running;          /* a background erase is in progress */
+	bool independent;            /* has its own controller, so can stay busy while other such flashes are used */
 	target_flash_s *next;        /* next flash in list */
 };
 
@@ -83,6 +121,14 @@ struct breakwatch {
 
 #define MAX_CMDLINE 81
 
+/* An option byte word staged to be programmed as the next flash session ends */
+typedef struct target_option {
+	uint32_t addr;
+	uint32_t value;
+} target_option_s;
+
+#define TARGET_OPTIONS_MAX 16U
+
 struct target_s {
 	bool attached;
 	struct target_controller *tc;
@@ -95,10 +141,17 @@ struct target_s {
 	/* Memory access functions */
 	void (*mem_read)(target *t, void *dest, target_addr_t src, size_t len);
 	void (*mem_write)(target *t, target_addr_t dest, const void *src, size_t len);
+	bool (*mem_crc32)(target *t, uint32_t *crc, target_addr_t base, size_t len);
+	/* Optional, reads every range of iov in as few round trips as it can, true on error */
+	bool (*mem_readv)(target *t, const target_iovec_s *iov, size_t count);
+	/* Optional path to memory that works with the core running, such as the system AP
+	 * of a dual AP part, for cores whose own memory access needs them halted */
+	void (*background_mem_read)(target *t, void *dest, target_addr_t src, size_t len);
+	void (*background_mem_write)(target *t, target_addr_t dest, const void *src, size_t len);
 
 	/* Register access functions */
 	size_t regs_size;
-	char *tdesc;
+	const char *tdesc;
 	void (*regs_read)(target *t, void *data);
 	void (*regs_write)(target *t, const void *data);
 	ssize_t (*reg_read)(target *t, int reg, void *data, size_t max);
@@ -123,6 +176,14 @@ struct target_s {
 	bool (*enter_flash_mode)(target *t);
 	bool (*exit_flash_mode)(target *t);
 	bool flash_mode;
+	/*
+	 * Optional, programs all the staged option bytes in one go once the image is
+	 * in, for the reset that ends the flash session to load. Drivers whose option
+	 * load resets the part themselves get the link back before returning.
+	 */
+	bool (*options_write)(target *t, const target_option_s *options, size_t count);
+	target_option_s *options_staged;
+	size_t options_staged_count;
 
 	/* target-defined options */
 	unsigned target_options;
@@ -135,6 +196,11 @@ struct target_s {
 
 	struct target_ram *ram;
 	target_flash_s *flash;
+	/* Write buffer shared by all the flashes, from the arena and sized to the largest */
+	void *flash_buffer;
+	size_t flash_buffer_size;
+	/* Memory map XML built from ram and flash, NULL until asked for */
+	char *mem_map;
 
 	/* Other stuff */
 	const char *driver;
@@ -148,6 +214,8 @@ struct target_s {
 #endif
 
 	struct target_s *next;
+	/* Non-zero and the same for the cores of one device, see target_group() */
+	uint32_t group;
 
 	void *priv;
 	void (*priv_free)(void *);
@@ -161,6 +229,22 @@ struct target_s {
 };
 
 void target_print_progress(platform_timeout *timeout);
+
+/*
+ * Paces the status polls of a flash operation expected to take about expected_us,
+ * so a long erase doesn't flood the link: the first poll waits out most of the
+ * expected time, the ones after back off exponentially. Polls and time spent
+ * waiting are counted in 'monitor stats'.
+ */
+typedef struct flash_wait {
+	platform_backoff backoff;
+	uint32_t sleep_us;
+	uint32_t last_us;
+} flash_wait_s;
+
+void target_flash_wait_init(flash_wait_s *wait, uint32_t expected_us);
+/* Call before each status poll */
+void target_flash_wait_poll(flash_wait_s *wait);
 void target_ram_map_free(target *t);
 void target_flash_map_free(target *t);
 void target_mem_map_free(target *t);
@@ -169,6 +253,10 @@ void target_add_ram(target *t, target_addr_t start, uint32_t len);
 void target_add_flash(target *t, target_flash_s *f);
 
 target_flash_s *target_flash_for_addr(target *t, uint32_t addr);
+/* Stage an option byte word for the end of the next flash session, false if the target has no options_write */
+bool target_options_stage(target *t, uint32_t addr, uint32_t value);
+/* Program the staged option bytes in a flash session of their own */
+bool target_options_apply(target *t);
 
 /* Convenience function for MMIO access */
 uint32_t target_mem_read32(target *t, uint32_t addr);
@@ -181,6 +269,8 @@ bool target_check_error(target *t);
 
 /* Access to host controller interface */
 void tc_printf(target *t, const char *fmt, ...);
+/* Target console output, to the USB UART if redirected there and GDB's console otherwise */
+void tc_console_write(target *t, const void *data, size_t len);
 
 /* Interface to host system calls */
 int tc_open(target *, target_addr_t path, size_t plen, enum target_open_flags flags, mode_t mode);
@@ -57,6 +57,11 @@ APPLE_STATIC bool target_probe_nop(target *t)
 	return false;
 }
 
+bool target_probe_linked(bool (*const probe)(target *t))
+{
+	return probe != target_probe_nop;
+}
+
 /*
  * nop alias functions to allow suport for target probe methods
  * to be disabled by not compiling/linking them in.
@@ -68,6 +73,7 @@ CORTEXM_PROBE_WEAK_NOP(cortexm_probe)
 
 CORTEXM_PROBE_WEAK_NOP(kinetis_mdm_probe)
 CORTEXM_PROBE_WEAK_NOP(nrf51_mdm_probe)
+CORTEXM_PROBE_WEAK_NOP(nrf51_mdm_recover)
 CORTEXM_PROBE_WEAK_NOP(efm32_aap_probe)
 CORTEXM_PROBE_WEAK_NOP(rp_rescue_probe)
 
@@ -33,9 +33,13 @@ bool cortexm_probe(ADIv5_AP_t *ap);
 
 bool kinetis_mdm_probe(ADIv5_AP_t *ap);
 bool nrf51_mdm_probe(ADIv5_AP_t *ap);
+bool nrf51_mdm_recover(ADIv5_AP_t *ap);
 bool efm32_aap_probe(ADIv5_AP_t *ap);
 bool rp_rescue_probe(ADIv5_AP_t *ap);
 
+/* Whether the driver behind a probe was built in, see TARGETS in the Makefile */
+bool target_probe_linked(bool (*probe)(target *t));
+
 bool ch32f1_probe(target *t); // will catch all the clones
 bool at32fxx_probe(target *t); // STM32 clones from Artery
 bool gd32f1_probe(target *t);
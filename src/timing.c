@@ -30,3 +30,39 @@ bool platform_timeout_is_expired(platform_timeout *t)
 {
 	return platform_time_ms() > t->time;
 }
+
+void platform_timeout_us_set(platform_timeout_us *const t, const uint32_t us)
+{
+	t->time = platform_time_us() + us;
+}
+
+bool platform_timeout_us_is_expired(const platform_timeout_us *const t)
+{
+	/* the difference taken as signed keeps the comparison right across the wrap */
+	return (int32_t)(platform_time_us() - t->time) > 0;
+}
+
+#if PC_HOSTED == 0
+void platform_delay_us(const uint32_t us)
+{
+	platform_timeout_us timeout;
+	platform_timeout_us_set(&timeout, us);
+	while (!platform_timeout_us_is_expired(&timeout))
+		continue;
+}
+#endif
+
+#define PLATFORM_BACKOFF_MIN_US 8U
+
+void platform_backoff_init(platform_backoff *const b, const uint32_t max_us)
+{
+	b->interval_us = 0;
+	b->max_us = max_us;
+}
+
+void platform_backoff_wait(platform_backoff *const b)
+{
+	if (b->interval_us)
+		platform_delay_us(b->interval_us);
+	b->interval_us = b->interval_us ? MIN(b->interval_us * 2U, b->max_us) : MIN(PLATFORM_BACKOFF_MIN_US, b->max_us);
+}
@@ -60,7 +60,7 @@ int dfu_upload(usb_dev_handle *dev, uint16_t iface,
 {
 	return usb_control_msg(dev, 
 			USB_ENDPOINT_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
-			DFU_DNLOAD, wBlockNum, iface, data, size, 
+			DFU_UPLOAD, wBlockNum, iface, data, size, 
 			USB_DEFAULT_TIMEOUT);
 }
 
@@ -26,6 +26,7 @@
 #endif
 
 #include <assert.h>
+#include <stdbool.h>
 
 #include "dfu.h"
 #include "stm32mem.h"
@@ -34,6 +35,14 @@
 #define VERSION "1.0"
 
 #define LOAD_ADDRESS 0x8002000
+/* Erase granularity of the old bootloaders, which don't erase on their own */
+#define ERASE_SIZE 1024U
+/*
+ * Units compared against what the probe already holds, a multiple of every
+ * page size so a unit skipped never shares a page with one erased.
+ */
+#define UNIT_SIZE 2048U
+#define DEFAULT_TRANSFER_SIZE 1024U
 
 void banner(void)
 {
@@ -41,8 +50,8 @@ void banner(void)
 	puts("Copyright (C) 2022 Black Magic Debug Project");
 	puts("License GPLv3+: GNU GPL version 3 or later <http://gnu.org/licenses/gpl.html>\n");
 	puts("");
-	puts("** WARNING: This utility has been deprecated in favour of bmputil")
-	puts("   Please see https://github.com/blackmagic-debug/bmputil")
+	puts("** WARNING: This utility has been deprecated in favour of bmputil");
+	puts("   Please see https://github.com/blackmagic-debug/bmputil");
 }
 
 
@@ -93,7 +102,23 @@ struct usb_device * find_dev(void)
 	return NULL;
 }
 
-usb_dev_handle * get_dfu_interface(struct usb_device *dev, uint16_t *interface)
+/* wTransferSize from the DFU functional descriptor following the interface's */
+static uint16_t get_transfer_size(const struct usb_interface_descriptor *iface)
+{
+	const unsigned char *desc = iface->extra;
+	int left = iface->extralen;
+
+	while((left >= 7) && (desc[0] >= 7) && (desc[0] <= left)) {
+		if(desc[1] == 0x21)
+			return desc[5] | (desc[6] << 8);
+		left -= desc[0];
+		desc += desc[0];
+	}
+	return DEFAULT_TRANSFER_SIZE;
+}
+
+usb_dev_handle * get_dfu_interface(struct usb_device *dev, uint16_t *interface,
+				   uint16_t *transfer_size)
 {
 	int i, j, k;
 	struct usb_config_descriptor *config;
@@ -115,6 +140,7 @@ usb_dev_handle * get_dfu_interface(struct usb_device *dev, uint16_t *interface)
 					//usb_set_altinterface(handle, k);
 					//*interface = j;
 					*interface = iface->bInterfaceNumber;
+					*transfer_size = get_transfer_size(iface);
 					return handle;
 				}
 			}
@@ -123,19 +149,37 @@ usb_dev_handle * get_dfu_interface(struct usb_device *dev, uint16_t *interface)
 	return NULL;
 }
 
+/* Whether the probe already holds this unit of the image, read back a transfer at a time */
+static bool unit_unchanged(usb_dev_handle *handle, uint16_t iface, uint32_t offset,
+			   uint32_t size, uint16_t transfer_size)
+{
+	uint8_t buf[UNIT_SIZE];
+	uint32_t chunk, len;
+
+	for(chunk = 0; chunk < size; chunk += len) {
+		len = (size - chunk < transfer_size) ? size - chunk : transfer_size;
+		if((stm32_mem_read(handle, iface, buf, len, LOAD_ADDRESS + offset + chunk) < 0) ||
+		   memcmp(buf, &bindata[offset + chunk], len))
+			return false;
+	}
+	return true;
+}
+
 int main(void)
 {
 	struct usb_device *dev;
 	usb_dev_handle *handle;
 	uint16_t iface;
+	uint16_t transfer_size = DEFAULT_TRANSFER_SIZE;
 	int state;
-	uint32_t offset;
+	uint32_t offset, chunk, size, len;
+	uint32_t skipped = 0;
 
 	banner();
 	usb_init();
 
 retry:
-	if(!(dev = find_dev()) || !(handle = get_dfu_interface(dev, &iface))) {
+	if(!(dev = find_dev()) || !(handle = get_dfu_interface(dev, &iface, &transfer_size))) {
 		puts("FATAL: No compatible device found!\n");
 #ifdef WIN32
 		system("pause");
@@ -160,13 +204,28 @@ retry:
 
 	dfu_makeidle(handle, iface);
 
-	for(offset = 0; offset < bindatalen; offset += 1024) {
+	if(transfer_size > UNIT_SIZE)
+		transfer_size = UNIT_SIZE;
+
+	/* Only the units that differ from what the probe holds are erased and written */
+	for(offset = 0; offset < bindatalen; offset += UNIT_SIZE) {
 		printf("Progress: %d%%\r", (offset*100)/bindatalen);
 		fflush(stdout);
-		assert(stm32_mem_erase(handle, iface, LOAD_ADDRESS + offset) == 0);
-		stm32_mem_write(handle, iface, (void*)&bindata[offset], 1024, LOAD_ADDRESS + offset);
+		size = (bindatalen - offset < UNIT_SIZE) ? bindatalen - offset : UNIT_SIZE;
+		if(unit_unchanged(handle, iface, offset, size, transfer_size)) {
+			skipped += size;
+			continue;
+		}
+		for(chunk = 0; chunk < size; chunk += ERASE_SIZE)
+			assert(stm32_mem_erase(handle, iface, LOAD_ADDRESS + offset + chunk) == 0);
+		for(chunk = 0; chunk < size; chunk += len) {
+			len = (size - chunk < transfer_size) ? size - chunk : transfer_size;
+			stm32_mem_write(handle, iface, (void*)&bindata[offset + chunk], len,
+					LOAD_ADDRESS + offset + chunk);
+		}
 	}
 	stm32_mem_manifest(handle, iface);
+	printf("%u of %u bytes already up to date\n", (unsigned)skipped, (unsigned)bindatalen);
 
 	usb_release_interface(handle, iface);
 	usb_close(handle);
@@ -79,6 +79,20 @@ int stm32_mem_write(usb_dev_handle *dev, uint16_t iface, void *data, int size, u
 	return stm32_download(dev, iface, 2, data, size);
 }
 
+int stm32_mem_read(usb_dev_handle *dev, uint16_t iface, void *data, int size, uint32_t addr)
+{
+	uint8_t request[5];
+	int i;
+
+	request[0] = STM32_CMD_SETADDRESSPOINTER;
+	memcpy(request+1, &addr, sizeof(addr));
+	if((i = stm32_download(dev, iface, 0, request, sizeof(request))) < 0) return i;
+	i = dfu_upload(dev, iface, 2, data, size);
+	/* Back to dfuIDLE for the requests that follow */
+	dfu_abort(dev, iface);
+	return (i == size) ? 0 : -1;
+}
+
 int stm32_mem_manifest(usb_dev_handle *dev, uint16_t iface)
 {
 	dfu_status status;
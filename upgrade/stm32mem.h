@@ -29,6 +29,8 @@
 
 int stm32_mem_erase(usb_dev_handle *dev, uint16_t iface, uint32_t addr);
 int stm32_mem_write(usb_dev_handle *dev, uint16_t iface, void *data, int size, uint32_t addr);
+/* Reads back size bytes from addr, no more than the device's wTransferSize */
+int stm32_mem_read(usb_dev_handle *dev, uint16_t iface, void *data, int size, uint32_t addr);
 int stm32_mem_manifest(usb_dev_handle *dev, uint16_t iface);
 
 #endif /* STM32MEM_H */